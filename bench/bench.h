@@ -0,0 +1,110 @@
+#pragma once
+
+/*
+ * Minimal microbenchmark harness (the benchmarks' test_harness.h).
+ *
+ * Every result is one line on stdout:
+ *
+ *   NAME key=value ... iters=N ns_per_op=X ops_per_s=Y [mib_per_s=Z]
+ *
+ * NAME and the parameter keys of a benchmark never change, so lines from
+ * two runs can be joined on everything before iters= and compared.  Lines
+ * starting with '#' are comments (suite headers, setup notes).
+ *
+ * BENCH_MIN_MS  minimum duration of one measurement (default 200)
+ * BENCH_MAX_FILES  largest population of the file-count sweeps
+ *                  (default 1000000; 10000000 needs a few GiB of memory)
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+static inline uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t bench_env(const char *name, uint64_t def)
+{
+    const char *v = getenv(name);
+    if (!v || !*v)
+        return def;
+    char *end;
+    unsigned long long n = strtoull(v, &end, 10);
+    return *end == '\0' && n > 0 ? (uint64_t)n : def;
+}
+
+static inline uint64_t bench_min_ns(void)
+{
+    return bench_env("BENCH_MIN_MS", 200) * 1000000u;
+}
+
+static inline uint64_t bench_max_files(void)
+{
+    return bench_env("BENCH_MAX_FILES", 1000000);
+}
+
+/* Deterministic xorshift64*, so every run touches the same data */
+static inline uint64_t bench_rand(uint64_t *st)
+{
+    uint64_t x = *st;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *st = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/*
+ * Call fn(arg, n), which must perform n operations, with n growing until
+ * one call lasts at least bench_min_ns().  Returns that call's duration
+ * and stores its n in *iters.
+ */
+typedef void (*bench_fn)(void *arg, uint64_t n);
+
+static uint64_t bench_measure(bench_fn fn, void *arg, uint64_t *iters)
+{
+    const uint64_t min = bench_min_ns();
+    uint64_t       n   = 1;
+    for (;;) {
+        uint64_t t0 = bench_now_ns();
+        fn(arg, n);
+        uint64_t ns = bench_now_ns() - t0;
+        if (ns >= min || n >= ((uint64_t)1 << 40)) {
+            *iters = n;
+            return ns ? ns : 1;
+        }
+        /* Aim a little past the target, growing at most 10x per step */
+        uint64_t next = ns ? (uint64_t)((double)n * min / ns * 1.2) + 1
+                           : n * 10;
+        if (next > n * 10)
+            next = n * 10;
+        n = next > n ? next : n + 1;
+    }
+}
+
+/* One result line.  bytes_per_op > 0 adds the throughput in MiB/s. */
+static void bench_report(const char *name, const char *params,
+                         uint64_t iters, uint64_t ns, uint64_t bytes_per_op)
+{
+    double per_op = (double)ns / (double)iters;
+    printf("%s%s%s iters=%llu ns_per_op=%.1f ops_per_s=%.0f", name,
+           params && *params ? " " : "", params ? params : "",
+           (unsigned long long)iters, per_op, 1e9 / per_op);
+    if (bytes_per_op)
+        printf(" mib_per_s=%.1f",
+               (double)bytes_per_op * 1e9 / per_op / (1024.0 * 1024.0));
+    printf("\n");
+    fflush(stdout);
+}
+
+static void bench_header(const char *suite)
+{
+    printf("# liveraid bench suite=%s min_ms=%llu max_files=%llu\n", suite,
+           (unsigned long long)(bench_min_ns() / 1000000),
+           (unsigned long long)bench_max_files());
+}
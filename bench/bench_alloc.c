@@ -0,0 +1,98 @@
+#include "bench.h"
+#include "alloc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * alloc_positions / free_positions on a fragmented allocator: files of
+ * 1-64 blocks are allocated back to back and every other one is freed,
+ * leaving about `extents` free holes between live files.
+ */
+
+#define MAX_FILE_BLOCKS 64
+
+typedef struct {
+    lr_pos_allocator a;
+    lr_extent       *live;
+    uint32_t         nlive;
+    uint64_t         seed;
+} alloc_ctx;
+
+static int setup(alloc_ctx *c, uint32_t extents)
+{
+    memset(c, 0, sizeof(*c));
+    c->seed = 0x243F6A8885A308D3ULL;
+    c->live = malloc((size_t)extents * 2 * sizeof(lr_extent));
+    if (!c->live)
+        return -1;
+    alloc_init(&c->a);
+    for (uint32_t i = 0; i < extents * 2; i++) {
+        uint32_t n = 1 + (uint32_t)(bench_rand(&c->seed) % MAX_FILE_BLOCKS);
+        c->live[i].start = alloc_positions(&c->a, n);
+        c->live[i].count = n;
+    }
+    /* Free the odd ones; the even ones stay live */
+    for (uint32_t i = 0; i < extents; i++) {
+        free_positions(&c->a, c->live[2 * i + 1].start,
+                       c->live[2 * i + 1].count);
+        c->live[i] = c->live[2 * i];
+    }
+    c->nlive = extents;
+    return 0;
+}
+
+/* Delete a random file and create one of random size */
+static void churn(void *arg, uint64_t n)
+{
+    alloc_ctx *c = arg;
+    for (uint64_t i = 0; i < n; i++) {
+        lr_extent *e = &c->live[bench_rand(&c->seed) % c->nlive];
+        free_positions(&c->a, e->start, e->count);
+        e->count = 1 + (uint32_t)(bench_rand(&c->seed) % MAX_FILE_BLOCKS);
+        e->start = alloc_positions(&c->a, e->count);
+    }
+}
+
+/* A file larger than every hole: the size index rules out every hole
+ * at once and the high-water mark, which the free gives back, is used */
+static void no_fit(void *arg, uint64_t n)
+{
+    alloc_ctx *c = arg;
+    for (uint64_t i = 0; i < n; i++) {
+        uint32_t start = alloc_positions(&c->a, 1u << 20);
+        free_positions(&c->a, start, 1u << 20);
+    }
+}
+
+static void run(uint32_t extents)
+{
+    alloc_ctx c;
+    if (setup(&c, extents) != 0) {
+        printf("# alloc extents=%u: out of memory\n", extents);
+        return;
+    }
+
+    char params[64];
+    snprintf(params, sizeof(params), "extents=%u", extents);
+
+    uint64_t iters, ns;
+    ns = bench_measure(no_fit, &c, &iters);
+    bench_report("alloc_no_fit", params, iters, ns, 0);
+    ns = bench_measure(churn, &c, &iters);
+    bench_report("alloc_churn", params, iters, ns, 0);
+    printf("# alloc extents=%u: %u free extents after churn, next_free=%u\n",
+           extents, c.a.ext_count, c.a.next_free);
+
+    alloc_done(&c.a);
+    free(c.live);
+}
+
+int main(void)
+{
+    bench_header("alloc");
+    for (uint32_t extents = 100; extents <= 100000; extents *= 10)
+        run(extents);
+    return 0;
+}
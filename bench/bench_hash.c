@@ -0,0 +1,111 @@
+#include "bench.h"
+#include "lr_hash.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* lr_hash insert and lookups keyed by path strings shaped like vpaths. */
+
+typedef struct {
+    lr_hash_node node;
+    char         path[48];
+} item;
+
+typedef struct {
+    lr_hash   h;
+    item     *items;
+    uint32_t *order;    /* random permutation for lookups */
+    uint32_t  n;
+} hash_ctx;
+
+static int item_cmp(const void *arg, const void *obj)
+{
+    return strcmp((const char *)arg, ((const item *)obj)->path) != 0;
+}
+
+static void lookup_hit(void *arg, uint64_t n)
+{
+    hash_ctx *c = arg;
+    for (uint64_t i = 0; i < n; i++) {
+        const item *it = &c->items[c->order[i % c->n]];
+        if (!lr_hash_search(&c->h, lr_hash_string(it->path), item_cmp,
+                            it->path))
+            abort();
+    }
+}
+
+static void lookup_miss(void *arg, uint64_t n)
+{
+    hash_ctx *c = arg;
+    char      path[48];
+    for (uint64_t i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "/media/missing/%08u.mkv",
+                 c->order[i % c->n]);
+        if (lr_hash_search(&c->h, lr_hash_string(path), item_cmp, path))
+            abort();
+    }
+}
+
+static void run(uint32_t n)
+{
+    hash_ctx c;
+    memset(&c, 0, sizeof(c));
+    c.n     = n;
+    c.items = malloc((size_t)n * sizeof(item));
+    c.order = malloc((size_t)n * sizeof(uint32_t));
+    if (!c.items || !c.order) {
+        printf("# hash n=%u: out of memory\n", n);
+        free(c.items);
+        free(c.order);
+        return;
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        snprintf(c.items[i].path, sizeof(c.items[i].path),
+                 "/media/dir%04u/file%08u.mkv", i % 1000, i);
+        c.order[i] = i;
+    }
+    uint64_t seed = 0x9E3779B97F4A7C15ULL;
+    for (uint32_t i = n - 1; i > 0; i--) {
+        uint32_t j = (uint32_t)(bench_rand(&seed) % (i + 1));
+        uint32_t t = c.order[i];
+        c.order[i] = c.order[j];
+        c.order[j] = t;
+    }
+
+    char params[64];
+    snprintf(params, sizeof(params), "n=%u", n);
+
+    /* Insert: one pass from empty, growth included */
+    lr_hash_init(&c.h);
+    uint64_t t0 = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++)
+        lr_hash_insert(&c.h, &c.items[i].node, &c.items[i],
+                       lr_hash_string(c.items[i].path));
+    bench_report("hash_insert", params, n, bench_now_ns() - t0, 0);
+
+    uint64_t iters, ns;
+    ns = bench_measure(lookup_hit, &c, &iters);
+    bench_report("hash_lookup_hit", params, iters, ns, 0);
+    ns = bench_measure(lookup_miss, &c, &iters);
+    bench_report("hash_lookup_miss", params, iters, ns, 0);
+
+    /* Remove in random order until empty */
+    t0 = bench_now_ns();
+    for (uint32_t i = 0; i < n; i++)
+        lr_hash_remove(&c.h, &c.items[c.order[i]].node);
+    bench_report("hash_remove", params, n, bench_now_ns() - t0, 0);
+
+    lr_hash_done(&c.h);
+    free(c.items);
+    free(c.order);
+}
+
+int main(void)
+{
+    bench_header("hash");
+    uint64_t max = bench_max_files();
+    for (uint64_t n = 10000; n <= max && n <= UINT32_MAX; n *= 10)
+        run((uint32_t)n);
+    return 0;
+}
@@ -0,0 +1,154 @@
+#include "bench.h"
+#include "metadata.h"
+#include "state.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * metadata_save / metadata_load of synthetic content files in both
+ * formats, 10k files up to BENCH_MAX_FILES, one directory record per
+ * 1000 files.  The content file goes to $BENCH_DIR (default /tmp); save
+ * includes its fsync.
+ */
+
+#define DRIVES 4
+
+static char content_path[PATH_MAX];
+
+static void make_config(lr_config *cfg, int format)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->block_size       = 65536;
+    cfg->placement_policy = LR_PLACE_ROUNDROBIN;
+    cfg->parity_threads   = 1;
+    cfg->content_format   = format;
+    for (unsigned i = 0; i < DRIVES; i++) {
+        snprintf(cfg->drives[i].name, 64,       "d%u", i);
+        snprintf(cfg->drives[i].dir,  PATH_MAX, "/tmp/lr_bench_drive%u", i);
+    }
+    cfg->drive_count = DRIVES;
+    snprintf(cfg->content_paths[0], PATH_MAX, "%s", content_path);
+    cfg->content_count = 1;
+    snprintf(cfg->mountpoint, PATH_MAX, "/tmp/lr_bench_mount");
+}
+
+static int populate(lr_state *s, uint32_t n)
+{
+    char     path[64];
+    uint32_t limit[DRIVES] = { 0 };
+    for (uint32_t i = 0; i < n; i++) {
+        lr_file *f = calloc(1, sizeof(lr_file));
+        snprintf(path, sizeof(path), "/media/dir%05u/file%08u.mkv",
+                 i / 1000, i);
+        if (!f || state_set_path(s, &f->vpath, path) != 0) {
+            free(f);
+            return -1;
+        }
+        unsigned d = i % DRIVES;
+        f->drive_idx        = d;
+        f->block_count      = 1 + i % 8;
+        f->size             = (int64_t)f->block_count * 65536 - i % 4096;
+        f->parity_pos_start = limit[d];
+        f->mtime_sec        = 1600000000 + i;
+        f->mtime_nsec       = i % 1000000000;
+        f->mode             = S_IFREG | 0644;
+        f->uid              = 1000;
+        f->gid              = 1000;
+        limit[d]           += f->block_count;
+        state_insert_file(s, f);
+
+        if (i % 1000 == 0) {
+            lr_dir *dir = calloc(1, sizeof(lr_dir));
+            snprintf(path, sizeof(path), "/media/dir%05u", i / 1000);
+            if (!dir || state_set_path(s, &dir->vpath, path) != 0) {
+                free(dir);
+                return -1;
+            }
+            dir->mode      = S_IFDIR | 0755;
+            dir->mtime_sec = 1600000000;
+            state_insert_dir(s, dir);
+        }
+    }
+    for (unsigned d = 0; d < DRIVES; d++) {
+        s->drives[d].pos_alloc.next_free = limit[d];
+        state_rebuild_pos_index(s, d);
+    }
+    return 0;
+}
+
+static void save(void *arg, uint64_t n)
+{
+    for (uint64_t i = 0; i < n; i++)
+        if (metadata_save((lr_state *)arg) != 0)
+            abort();
+}
+
+static void run(uint32_t n, int format)
+{
+    static lr_state s;
+    lr_config cfg;
+    make_config(&cfg, format);
+    if (state_init(&s, &cfg) != 0) {
+        printf("# metadata n=%u: state_init failed\n", n);
+        return;
+    }
+    if (populate(&s, n) != 0) {
+        printf("# metadata n=%u: out of memory\n", n);
+        state_done(&s);
+        return;
+    }
+
+    char params[64];
+    snprintf(params, sizeof(params), "format=%s files=%u",
+             format == LR_CONTENT_BINARY ? "binary" : "text", n);
+
+    uint64_t iters, ns;
+    ns = bench_measure(save, &s, &iters);
+    state_done(&s);
+
+    struct stat st;
+    uint64_t bytes = stat(content_path, &st) == 0 ? (uint64_t)st.st_size : 0;
+    bench_report("metadata_save", params, iters, ns, bytes);
+
+    /* Each load needs an empty state; only the load itself is timed */
+    const uint64_t min = bench_min_ns();
+    iters = 0;
+    ns    = 0;
+    while (ns < min || iters == 0) {
+        if (state_init(&s, &cfg) != 0)
+            break;
+        uint64_t t0 = bench_now_ns();
+        int      rc = metadata_load(&s);
+        ns += bench_now_ns() - t0;
+        unsigned loaded = s.file_list.count;
+        state_done(&s);
+        if (rc != 0 || loaded != n) {
+            printf("# metadata n=%u: load failed (%u files)\n", n, loaded);
+            break;
+        }
+        iters++;
+    }
+    if (iters)
+        bench_report("metadata_load", params, iters, ns, bytes);
+    unlink(content_path);
+}
+
+int main(void)
+{
+    const char *dir = getenv("BENCH_DIR");
+    snprintf(content_path, sizeof(content_path), "%s/lr_bench_meta.content",
+             dir && *dir ? dir : "/tmp");
+
+    bench_header("metadata");
+    uint64_t max = bench_max_files();
+    for (uint64_t n = 10000; n <= max && n <= UINT32_MAX; n *= 10) {
+        run((uint32_t)n, LR_CONTENT_TEXT);
+        run((uint32_t)n, LR_CONTENT_BINARY);
+    }
+    return 0;
+}
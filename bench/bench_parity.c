@@ -0,0 +1,288 @@
+#include "bench.h"
+#include "parity.h"
+#include "fdcache.h"
+#include "state.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/*
+ * Parity encode and recovery across drive counts, parity levels, block
+ * sizes and codes.  Each data drive holds one file spanning every
+ * position (4 MiB of random data, at least 16 blocks) under a scratch
+ * directory in $BENCH_DIR (default /tmp), so after the first pass the
+ * reads come from the page cache and the numbers are the CPU cost of the
+ * code path plus its system calls.  Throughput counts data bytes: nd
+ * blocks per position encoded, one block per block recovered.
+ */
+
+#define DATA_BYTES (4u << 20)
+
+typedef struct {
+    lr_state   *s;
+    uint32_t    positions;
+    uint32_t    run;       /* positions per parity_update_range call */
+    void      **v;         /* nd + np blocks */
+    void      **rv;        /* nd + np runs */
+    void       *vfree, *rvfree, *out;
+    uint32_t    pos;
+} parity_ctx;
+
+static char root[PATH_MAX / 2];   /* room for the names below it */
+
+static int write_file(const char *path, uint64_t bytes, uint64_t *seed)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    uint64_t buf[8192];
+    for (uint64_t done = 0; done < bytes; done += sizeof(buf)) {
+        for (size_t i = 0; i < sizeof(buf) / sizeof(buf[0]); i++)
+            buf[i] = bench_rand(seed);
+        size_t n = bytes - done < sizeof(buf) ? (size_t)(bytes - done)
+                                               : sizeof(buf);
+        if (write(fd, buf, n) != (ssize_t)n) {
+            close(fd);
+            return -1;
+        }
+    }
+    return close(fd);
+}
+
+/* Drives and parity files for one combination; returns the state or NULL */
+static lr_state *setup(unsigned nd, unsigned np, uint32_t bs, int code,
+                       uint32_t positions)
+{
+    static lr_state s;
+    lr_config *cfg = calloc(1, sizeof(lr_config));
+    if (!cfg)
+        return NULL;
+    cfg->block_size       = bs;
+    cfg->placement_policy = LR_PLACE_ROUNDROBIN;
+    cfg->parity_threads   = 1;
+    cfg->parity_code      = code;
+    cfg->parity_levels    = np;
+    cfg->drive_count      = nd;
+    cfg->content_count    = 1;
+    snprintf(cfg->content_paths[0], PATH_MAX, "%s/content", root);
+    snprintf(cfg->mountpoint, PATH_MAX, "%s/mnt", root);
+
+    uint64_t seed = 0x452821E638D01377ULL ^ nd ^ ((uint64_t)bs << 8);
+    for (unsigned d = 0; d < nd; d++) {
+        snprintf(cfg->drives[d].name, 64, "d%u", d);
+        snprintf(cfg->drives[d].dir, PATH_MAX, "%s/d%u", root, d);
+        mkdir(cfg->drives[d].dir, 0755);
+        char path[PATH_MAX + 32];
+        snprintf(path, sizeof(path), "%s/bench%u.dat", cfg->drives[d].dir, d);
+        if (write_file(path, (uint64_t)positions * bs, &seed) != 0) {
+            free(cfg);
+            return NULL;
+        }
+    }
+    cfg->parity_stripe = 64;
+    for (unsigned p = 0; p < np; p++) {
+        snprintf(cfg->parity_path[p][0], PATH_MAX, "%s/parity%u", root, p + 1);
+        cfg->parity_shards[p] = 1;
+    }
+
+    if (state_init(&s, cfg) != 0) {
+        free(cfg);
+        return NULL;
+    }
+    free(cfg);
+
+    for (unsigned d = 0; d < nd; d++) {
+        char     vpath[32];
+        lr_file *f = calloc(1, sizeof(lr_file));
+        snprintf(vpath, sizeof(vpath), "/bench%u.dat", d);
+        if (!f || state_set_path(&s, &f->vpath, vpath) != 0) {
+            free(f);
+            state_done(&s);
+            return NULL;
+        }
+        f->drive_idx        = d;
+        f->size             = (int64_t)positions * bs;
+        f->block_count      = positions;
+        f->parity_pos_start = 0;
+        f->mode             = S_IFREG | 0644;
+        state_insert_file(&s, f);
+        state_pos_index_insert(&s, f);
+        s.drives[d].pos_alloc.next_free = positions;
+    }
+
+    lr_parity_handle *ph = calloc(1, sizeof(*ph));
+    lr_fdcache       *fc = calloc(1, sizeof(*fc));
+    if (!ph || !fc || parity_open(ph, &s.cfg) != 0) {
+        free(ph);
+        free(fc);
+        state_done(&s);
+        return NULL;
+    }
+    s.parity = ph;
+    if (fdcache_init(fc, 64) == 0)
+        s.fdcache = fc;
+    else
+        free(fc);
+    return &s;
+}
+
+static void teardown(lr_state *s)
+{
+    if (s->fdcache) {
+        fdcache_done(s->fdcache);
+        free(s->fdcache);
+        s->fdcache = NULL;
+    }
+    parity_close(s->parity);
+    free(s->parity);
+    s->parity = NULL;
+    for (unsigned d = 0; d < s->drive_count; d++) {
+        char path[PATH_MAX + 32];
+        snprintf(path, sizeof(path), "%sbench%u.dat", s->drives[d].dir, d);
+        unlink(path);
+        s->drives[d].dir[strlen(s->drives[d].dir) - 1] = '\0';
+        rmdir(s->drives[d].dir);
+    }
+    for (unsigned p = 0; p < s->cfg.parity_levels; p++)
+        unlink(s->cfg.parity_path[p][0]);
+    state_done(s);
+}
+
+static void update_position(void *arg, uint64_t n)
+{
+    parity_ctx *c = arg;
+    for (uint64_t i = 0; i < n; i++) {
+        if (parity_update_position(c->s, c->pos, c->v) != 0)
+            abort();
+        c->pos = (c->pos + 1) % c->positions;
+    }
+}
+
+static void update_range(void *arg, uint64_t n)
+{
+    parity_ctx *c = arg;
+    for (uint64_t i = 0; i < n; i++) {
+        if (parity_update_range(c->s, c->pos, c->run, c->rv) != 0)
+            abort();
+        c->pos = (c->pos + c->run) % c->positions;
+    }
+}
+
+static void recover_block(void *arg, uint64_t n)
+{
+    parity_ctx *c = arg;
+    state_rdlock(c->s);
+    for (uint64_t i = 0; i < n; i++) {
+        if (parity_recover_block(c->s, 0, c->pos, c->out) != 0)
+            abort();
+        c->pos = (c->pos + 1) % c->positions;
+    }
+    state_unlock(c->s);
+}
+
+/* The block recovered at pos 0 must match what drive 0 holds */
+static int check_recovery(parity_ctx *c, uint32_t bs)
+{
+    char path[PATH_MAX + 32];
+    snprintf(path, sizeof(path), "%sbench0.dat", c->s->drives[0].dir);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    int ok = pread(fd, c->v[0], bs, 0) == (ssize_t)bs;
+    close(fd);
+    state_rdlock(c->s);
+    ok = ok && parity_recover_block(c->s, 0, 0, c->out) == 0;
+    state_unlock(c->s);
+    return ok && memcmp(c->v[0], c->out, bs) == 0 ? 0 : -1;
+}
+
+static void run(unsigned nd, unsigned np, uint32_t bs, int code)
+{
+    uint32_t positions = DATA_BYTES / bs < 16 ? 16 : DATA_BYTES / bs;
+    uint32_t run       = (1u << 20) / bs;
+    if (run < 1)
+        run = 1;
+    if (run > positions)
+        run = positions;
+
+    char params[96];
+    snprintf(params, sizeof(params), "code=%s nd=%u np=%u block=%u",
+             code == LR_CODE_RAID ? "raid" : "cauchy", nd, np, bs);
+
+    lr_state *s = setup(nd, np, bs, code, positions);
+    if (!s) {
+        printf("# parity %s: setup failed\n", params);
+        return;
+    }
+    parity_ctx c;
+    memset(&c, 0, sizeof(c));
+    c.s         = s;
+    c.positions = positions;
+    c.run       = run;
+    c.v   = lr_alloc_vector((int)(nd + np), bs, &c.vfree);
+    c.rv  = lr_alloc_vector((int)(nd + np), run * bs, &c.rvfree);
+    c.out = aligned_alloc(64, bs);
+    if (!c.v || !c.rv || !c.out) {
+        printf("# parity %s: out of memory\n", params);
+        goto out;
+    }
+    printf("# parity %s kernel=%s positions=%u run=%u\n", params,
+           parity_kernel_name(s->parity), positions, run);
+
+    /* Cold pass: parity files written, data in the page cache */
+    update_range(&c, (positions + run - 1) / run);
+    c.pos = 0;
+    if (check_recovery(&c, bs) != 0) {
+        printf("# parity %s: recovered block does not match\n", params);
+        goto out;
+    }
+
+    uint64_t iters, ns;
+    ns = bench_measure(update_position, &c, &iters);
+    bench_report("parity_update_position", params, iters, ns,
+                 (uint64_t)nd * bs);
+    c.pos = 0;
+    ns = bench_measure(update_range, &c, &iters);
+    bench_report("parity_update_range", params, iters, ns,
+                 (uint64_t)nd * run * bs);
+    c.pos = 0;
+    ns = bench_measure(recover_block, &c, &iters);
+    bench_report("parity_recover_block", params, iters, ns, bs);
+
+out:
+    free(c.vfree);
+    free(c.rvfree);
+    free(c.out);
+    teardown(s);
+}
+
+int main(void)
+{
+    const char *dir = getenv("BENCH_DIR");
+    snprintf(root, sizeof(root), "%s/lr_bench_parity.XXXXXX",
+             dir && *dir ? dir : "/tmp");
+    if (!mkdtemp(root)) {
+        perror("bench_parity: mkdtemp");
+        return 1;
+    }
+
+    static const unsigned nds[] = { 3, 6, 12 };
+    static const uint32_t bss[] = { 4096, 65536, 262144 };
+
+    bench_header("parity");
+    for (unsigned i = 0; i < sizeof(nds) / sizeof(nds[0]); i++)
+        for (unsigned np = 1; np <= 3; np++)
+            for (unsigned j = 0; j < sizeof(bss) / sizeof(bss[0]); j++) {
+                run(nds[i], np, bss[j], LR_CODE_CAUCHY);
+                if (np <= 2)
+                    run(nds[i], np, bss[j], LR_CODE_RAID);
+            }
+
+    rmdir(root);
+    return 0;
+}
@@ -0,0 +1,162 @@
+#include "bench.h"
+#include "state.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * Namespace and position-index hot paths at 10k files up to
+ * BENCH_MAX_FILES: file i lives on drive i % DRIVES, holds 1-8 blocks and
+ * sits in one of 1000-file directories.
+ */
+
+#define DRIVES 4
+
+typedef struct {
+    lr_state  s;
+    uint32_t  n;
+    uint32_t  limit[DRIVES];   /* next_free per drive */
+    uint64_t  seed;
+} state_ctx;
+
+static void make_config(lr_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->block_size       = 65536;
+    cfg->placement_policy = LR_PLACE_ROUNDROBIN;
+    cfg->parity_threads   = 1;
+    for (unsigned i = 0; i < DRIVES; i++) {
+        snprintf(cfg->drives[i].name, 64,       "d%u", i);
+        snprintf(cfg->drives[i].dir,  PATH_MAX, "/tmp/lr_bench_drive%u", i);
+    }
+    cfg->drive_count = DRIVES;
+    snprintf(cfg->content_paths[0], PATH_MAX, "/tmp/lr_bench.content");
+    cfg->content_count = 1;
+    snprintf(cfg->mountpoint, PATH_MAX, "/tmp/lr_bench_mount");
+}
+
+static void file_path(char *buf, size_t len, uint32_t i)
+{
+    snprintf(buf, len, "/media/dir%05u/file%08u.mkv", i / 1000, i);
+}
+
+/* Insert n files; returns the elapsed ns, 0 on OOM */
+static uint64_t populate(state_ctx *c)
+{
+    char     path[64];
+    uint64_t t0 = bench_now_ns();
+    for (uint32_t i = 0; i < c->n; i++) {
+        lr_file *f = calloc(1, sizeof(lr_file));
+        file_path(path, sizeof(path), i);
+        if (!f || state_set_path(&c->s, &f->vpath, path) != 0) {
+            free(f);
+            return 0;
+        }
+        unsigned d = i % DRIVES;
+        f->drive_idx        = d;
+        f->block_count      = 1 + i % 8;
+        f->size             = (int64_t)f->block_count * 65536;
+        f->parity_pos_start = c->limit[d];
+        f->mode             = S_IFREG | 0644;
+        c->limit[d]        += f->block_count;
+        state_insert_file(&c->s, f);
+    }
+    uint64_t ns = bench_now_ns() - t0;
+    for (unsigned d = 0; d < DRIVES; d++)
+        c->s.drives[d].pos_alloc.next_free = c->limit[d];
+    return ns;
+}
+
+static void rebuild_index(void *arg, uint64_t n)
+{
+    state_ctx *c = arg;
+    for (uint64_t i = 0; i < n; i++)
+        for (unsigned d = 0; d < DRIVES; d++)
+            state_rebuild_pos_index(&c->s, d);
+}
+
+static void find_at_pos(void *arg, uint64_t n)
+{
+    state_ctx *c = arg;
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t r = bench_rand(&c->seed);
+        unsigned d = (unsigned)(r % DRIVES);
+        uint32_t pos = (uint32_t)((r >> 8) % c->limit[d]);
+        if (!state_find_file_at_pos(&c->s, d, pos))
+            abort();
+    }
+}
+
+static void lookup_pos(void *arg, uint64_t n)
+{
+    state_ctx *c = arg;
+    uint32_t   start, end;
+    for (uint64_t i = 0; i < n; i++) {
+        uint64_t r = bench_rand(&c->seed);
+        unsigned d = (unsigned)(r % DRIVES);
+        uint32_t pos = (uint32_t)((r >> 8) % c->limit[d]);
+        if (!state_lookup_pos(&c->s, d, pos, &start, &end))
+            abort();
+    }
+}
+
+static void find_file(void *arg, uint64_t n)
+{
+    state_ctx *c = arg;
+    char       path[64];
+    for (uint64_t i = 0; i < n; i++) {
+        file_path(path, sizeof(path),
+                  (uint32_t)(bench_rand(&c->seed) % c->n));
+        if (!state_find_file(&c->s, path))
+            abort();
+    }
+}
+
+static void run(uint32_t n)
+{
+    static state_ctx c;
+    lr_config cfg;
+    make_config(&cfg);
+    memset(&c, 0, sizeof(c));
+    c.n    = n;
+    c.seed = 0xB7E151628AED2A6BULL;
+    if (state_init(&c.s, &cfg) != 0) {
+        printf("# state n=%u: state_init failed\n", n);
+        return;
+    }
+
+    char params[64];
+    snprintf(params, sizeof(params), "files=%u", n);
+
+    uint64_t ns = populate(&c);
+    if (ns == 0) {
+        printf("# state n=%u: out of memory\n", n);
+        state_done(&c.s);
+        return;
+    }
+    bench_report("state_insert_file", params, n, ns, 0);
+
+    uint64_t iters;
+    ns = bench_measure(rebuild_index, &c, &iters);
+    bench_report("state_rebuild_pos_index", params, iters, ns, 0);
+    ns = bench_measure(find_at_pos, &c, &iters);
+    bench_report("state_find_file_at_pos", params, iters, ns, 0);
+    ns = bench_measure(lookup_pos, &c, &iters);
+    bench_report("state_lookup_pos", params, iters, ns, 0);
+    ns = bench_measure(find_file, &c, &iters);
+    bench_report("state_find_file", params, iters, ns, 0);
+
+    state_done(&c.s);
+}
+
+int main(void)
+{
+    bench_header("state");
+    uint64_t max = bench_max_files();
+    for (uint64_t n = 10000; n <= max && n <= UINT32_MAX; n *= 10)
+        run((uint32_t)n);
+    return 0;
+}
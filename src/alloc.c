@@ -5,38 +5,227 @@
 #include <stdio.h>
 #include <stdint.h>
 
+/*
+ * Both trees are treaps over the same nodes: each node is one free extent,
+ * linked into the address tree through kid[ADDR] and into the size tree
+ * through kid[SIZE], with one random priority shared by both.  Released
+ * slots are chained through their start field for reuse, so the pool never
+ * shrinks; indices stay valid across a realloc.
+ */
+
+enum { ADDR = 0, SIZE = 1 };
+
+#define N(a, x)         ((a)->nodes[x])
+#define KID(a, x, t, s) ((a)->nodes[x].kid[t][s])
+
 void alloc_init(lr_pos_allocator *a)
 {
     memset(a, 0, sizeof(*a));
+    a->seed = 0x9E3779B9u;
 }
 
 void alloc_done(lr_pos_allocator *a)
 {
-    free(a->extents);
+    free(a->nodes);
     memset(a, 0, sizeof(*a));
 }
 
-uint32_t alloc_positions(lr_pos_allocator *a, uint32_t count)
+/* ---- Node pool ---- */
+
+static int pool_reserve(lr_pos_allocator *a, uint32_t n)
+{
+    if (a->node_cap > a->node_used && n <= a->node_cap - 1 - a->node_used)
+        return 0;
+    uint64_t want = a->node_cap ? (uint64_t)a->node_cap * 2 : 64;
+    if (want < (uint64_t)a->node_used + n + 1)
+        want = (uint64_t)a->node_used + n + 1;
+    if (want > UINT32_MAX)
+        return -1;
+    lr_alloc_node *p = realloc(a->nodes, (size_t)want * sizeof(lr_alloc_node));
+    if (!p)
+        return -1;
+    a->nodes    = p;
+    a->node_cap = (uint32_t)want;
+    return 0;
+}
+
+static uint32_t node_new(lr_pos_allocator *a, uint32_t start, uint32_t count)
+{
+    uint32_t x;
+    if (a->spare) {
+        x        = a->spare;
+        a->spare = N(a, x).start;
+    } else {
+        if (pool_reserve(a, 1) != 0)
+            return 0;
+        x = ++a->node_used;
+    }
+    /* xorshift32; a zeroed allocator still gets distinct priorities */
+    uint32_t r = a->seed ? a->seed : 0x9E3779B9u;
+    r ^= r << 13;
+    r ^= r >> 17;
+    r ^= r << 5;
+    a->seed = r;
+
+    memset(&N(a, x), 0, sizeof(lr_alloc_node));
+    N(a, x).start     = start;
+    N(a, x).count     = count;
+    N(a, x).max_count = count;
+    N(a, x).prio      = r;
+    return x;
+}
+
+static void node_release(lr_pos_allocator *a, uint32_t x)
+{
+    N(a, x).start = a->spare;
+    a->spare      = x;
+}
+
+/* ---- Treap primitives ---- */
+
+/* Does node n sort before (count, start) in tree t? */
+static int key_less(const lr_alloc_node *n, int t, uint32_t count,
+                    uint32_t start)
+{
+    if (t == SIZE && n->count != count)
+        return n->count < count;
+    return n->start < start;
+}
+
+static void pull(lr_pos_allocator *a, uint32_t x)
+{
+    uint32_t m = N(a, x).count;
+    for (int s = 0; s < 2; s++) {
+        uint32_t k = KID(a, x, ADDR, s);
+        if (k && N(a, k).max_count > m)
+            m = N(a, k).max_count;
+    }
+    N(a, x).max_count = m;
+}
+
+/* Split tree t under x into the nodes before (count, start) and the rest */
+static void split(lr_pos_allocator *a, int t, uint32_t x, uint32_t count,
+                  uint32_t start, uint32_t *l, uint32_t *r)
+{
+    if (!x) {
+        *l = *r = 0;
+        return;
+    }
+    if (key_less(&N(a, x), t, count, start)) {
+        *l = x;
+        split(a, t, KID(a, x, t, 1), count, start, &KID(a, x, t, 1), r);
+    } else {
+        *r = x;
+        split(a, t, KID(a, x, t, 0), count, start, l, &KID(a, x, t, 0));
+    }
+    if (t == ADDR)
+        pull(a, x);
+}
+
+/* Join two trees; every key in l sorts before every key in r */
+static uint32_t merge(lr_pos_allocator *a, int t, uint32_t l, uint32_t r)
+{
+    if (!l)
+        return r;
+    if (!r)
+        return l;
+    if (N(a, l).prio > N(a, r).prio) {
+        KID(a, l, t, 1) = merge(a, t, KID(a, l, t, 1), r);
+        if (t == ADDR)
+            pull(a, l);
+        return l;
+    }
+    KID(a, r, t, 0) = merge(a, t, l, KID(a, r, t, 0));
+    if (t == ADDR)
+        pull(a, r);
+    return r;
+}
+
+static void tree_insert(lr_pos_allocator *a, int t, uint32_t x)
+{
+    uint32_t l, r;
+    KID(a, x, t, 0) = KID(a, x, t, 1) = 0;
+    if (t == ADDR)
+        N(a, x).max_count = N(a, x).count;
+    split(a, t, a->root[t], N(a, x).count, N(a, x).start, &l, &r);
+    a->root[t] = merge(a, t, merge(a, t, l, x), r);
+}
+
+static void tree_remove(lr_pos_allocator *a, int t, uint32_t x)
+{
+    uint32_t l, m, r;
+    uint32_t count = N(a, x).count, start = N(a, x).start;
+    split(a, t, a->root[t], count, start, &l, &m);
+    split(a, t, m, count, start + 1, &m, &r);    /* m is x alone */
+    a->root[t] = merge(a, t, l, r);
+}
+
+/* Recompute max_count on the path to the node now starting at start; its
+ * start or count changed without moving it past a neighbour */
+static void addr_refresh(lr_pos_allocator *a, uint32_t x, uint32_t start)
 {
-    uint32_t i;
+    if (!x)
+        return;
+    if (N(a, x).start != start)
+        addr_refresh(a, KID(a, x, ADDR, N(a, x).start < start), start);
+    pull(a, x);
+}
 
+/* Last extent starting below pos and first one starting at or after it */
+static void neighbours(const lr_pos_allocator *a, uint32_t pos,
+                       uint32_t *prev, uint32_t *next)
+{
+    uint32_t x = a->root[ADDR];
+    *prev = *next = 0;
+    while (x) {
+        if (N(a, x).start < pos) {
+            *prev = x;
+            x     = KID(a, x, ADDR, 1);
+        } else {
+            *next = x;
+            x     = KID(a, x, ADDR, 0);
+        }
+    }
+}
+
+/* Allocate the first count positions of extent x */
+static uint32_t take_front(lr_pos_allocator *a, uint32_t x, uint32_t count)
+{
+    uint32_t start = N(a, x).start;
+    tree_remove(a, SIZE, x);
+    if (N(a, x).count == count) {
+        tree_remove(a, ADDR, x);
+        node_release(a, x);
+        a->ext_count--;
+    } else {
+        N(a, x).start += count;
+        N(a, x).count -= count;
+        addr_refresh(a, a->root[ADDR], N(a, x).start);
+        tree_insert(a, SIZE, x);
+    }
+    a->free_count -= count;
+    return start;
+}
+
+/* ---- Public API ---- */
+
+uint32_t alloc_positions(lr_pos_allocator *a, uint32_t count)
+{
     if (count == 0)
         return a->next_free;
 
-    /* First-fit search through sorted free extents */
-    for (i = 0; i < a->ext_count; i++) {
-        if (a->extents[i].count >= count) {
-            uint32_t start = a->extents[i].start;
-            a->extents[i].start += count;
-            a->extents[i].count -= count;
-            if (a->extents[i].count == 0) {
-                memmove(&a->extents[i], &a->extents[i + 1],
-                        (a->ext_count - i - 1) * sizeof(lr_extent));
-                a->ext_count--;
-            }
-            return start;
+    /* Best fit: the smallest (count, start) at or above (count, 0) */
+    uint32_t x = a->root[SIZE], best = 0;
+    while (x) {
+        if (N(a, x).count >= count) {
+            best = x;
+            x    = KID(a, x, SIZE, 0);
+        } else {
+            x = KID(a, x, SIZE, 1);
         }
     }
+    if (best)
+        return take_front(a, best, count);
 
     /* No suitable extent found — bump allocate */
     if (count > UINT32_MAX - a->next_free) {
@@ -48,59 +237,132 @@ uint32_t alloc_positions(lr_pos_allocator *a, uint32_t count)
     return start;
 }
 
+uint32_t alloc_positions_low(lr_pos_allocator *a, uint32_t count,
+                             uint32_t below)
+{
+    if (count == 0)
+        return UINT32_MAX;
+
+    /* Leftmost node whose own extent fits, steering by max_count */
+    uint32_t x = a->root[ADDR];
+    while (x) {
+        uint32_t l = KID(a, x, ADDR, 0), r = KID(a, x, ADDR, 1);
+        if (l && N(a, l).max_count >= count)
+            x = l;
+        else if (N(a, x).count >= count)
+            break;
+        else
+            x = r && N(a, r).max_count >= count ? r : 0;
+    }
+    if (!x || N(a, x).start >= below)
+        return UINT32_MAX;
+    return take_front(a, x, count);
+}
+
 void free_positions(lr_pos_allocator *a, uint32_t start, uint32_t count)
 {
-    uint32_t i;
-    int merge_prev, merge_next;
+    uint32_t p, q, x;
 
     if (count == 0)
         return;
 
-    /* Find sorted insertion point */
-    for (i = 0; i < a->ext_count; i++) {
-        if (a->extents[i].start > start)
-            break;
+    neighbours(a, start, &p, &q);
+    if ((p && N(a, p).start + N(a, p).count > start) ||
+        (q && N(a, q).start - start < count)) {
+        fprintf(stderr, "liveraid: free_positions: [%u, +%u) is already "
+                        "free, ignored\n", start, count);
+        return;
     }
 
-    merge_prev = (i > 0 &&
-                  a->extents[i - 1].start + a->extents[i - 1].count == start);
-    merge_next = (i < a->ext_count &&
-                  start + count == a->extents[i].start);
+    int merge_prev = p && N(a, p).start + N(a, p).count == start;
+    int merge_next = q && start + count == N(a, q).start;
 
     if (merge_prev && merge_next) {
         /* Bridge the gap: absorb right extent into left */
-        a->extents[i - 1].count += count + a->extents[i].count;
-        memmove(&a->extents[i], &a->extents[i + 1],
-                (a->ext_count - i - 1) * sizeof(lr_extent));
+        uint32_t qc = N(a, q).count;
+        tree_remove(a, SIZE, q);
+        tree_remove(a, ADDR, q);
+        node_release(a, q);
         a->ext_count--;
+        tree_remove(a, SIZE, p);
+        N(a, p).count += count + qc;
+        addr_refresh(a, a->root[ADDR], N(a, p).start);
+        tree_insert(a, SIZE, p);
+        x = p;
     } else if (merge_prev) {
-        a->extents[i - 1].count += count;
+        tree_remove(a, SIZE, p);
+        N(a, p).count += count;
+        addr_refresh(a, a->root[ADDR], N(a, p).start);
+        tree_insert(a, SIZE, p);
+        x = p;
     } else if (merge_next) {
-        a->extents[i].start  = start;
-        a->extents[i].count += count;
+        tree_remove(a, SIZE, q);
+        N(a, q).start  = start;
+        N(a, q).count += count;
+        addr_refresh(a, a->root[ADDR], start);
+        tree_insert(a, SIZE, q);
+        x = q;
     } else {
-        /* Insert new extent at position i */
-        if (a->ext_count >= a->ext_cap) {
-            uint32_t new_cap = a->ext_cap ? a->ext_cap * 2 : 16;
-            lr_extent *p = realloc(a->extents, new_cap * sizeof(lr_extent));
-            if (!p)
-                return; /* leak on OOM */
-            a->extents  = p;
-            a->ext_cap  = new_cap;
-        }
-        memmove(&a->extents[i + 1], &a->extents[i],
-                (a->ext_count - i) * sizeof(lr_extent));
-        a->extents[i].start = start;
-        a->extents[i].count = count;
+        x = node_new(a, start, count);
+        if (!x)
+            return; /* leak on OOM */
+        tree_insert(a, ADDR, x);
+        tree_insert(a, SIZE, x);
         a->ext_count++;
     }
+    a->free_count += count;
 
-    /* If the last extent now abuts the bump high-water mark, reclaim it */
-    if (a->ext_count > 0) {
-        uint32_t last = a->ext_count - 1;
-        if (a->extents[last].start + a->extents[last].count == a->next_free) {
-            a->next_free = a->extents[last].start;
-            a->ext_count--;
-        }
+    /* If the extent now abuts the bump high-water mark, reclaim it */
+    if (N(a, x).start + N(a, x).count == a->next_free) {
+        a->next_free   = N(a, x).start;
+        a->free_count -= N(a, x).count;
+        tree_remove(a, SIZE, x);
+        tree_remove(a, ADDR, x);
+        node_release(a, x);
+        a->ext_count--;
     }
 }
+
+int alloc_set_extents(lr_pos_allocator *a, const lr_extent *ext, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++) {
+        if (ext[i].count == 0 || ext[i].start >= a->next_free ||
+            ext[i].count > a->next_free - ext[i].start)
+            return -1;
+        if (i > 0 && ext[i].start <= ext[i - 1].start + ext[i - 1].count)
+            return -1;
+    }
+    if (n > 0 && ext[n - 1].start + ext[n - 1].count == a->next_free)
+        return -1;  /* free_positions would have reclaimed it */
+
+    /* Reserve before dropping the old list, so OOM leaves it in place */
+    uint32_t used = a->node_used;
+    a->node_used = 0;
+    if (pool_reserve(a, n) != 0) {
+        a->node_used = used;
+        return -1;
+    }
+    a->spare      = 0;
+    a->root[ADDR] = a->root[SIZE] = 0;
+    a->ext_count  = 0;
+    a->free_count = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t x = node_new(a, ext[i].start, ext[i].count);
+        tree_insert(a, ADDR, x);
+        tree_insert(a, SIZE, x);
+        a->ext_count++;
+        a->free_count += ext[i].count;
+    }
+    return 0;
+}
+
+int alloc_next_extent(const lr_pos_allocator *a, uint32_t pos, lr_extent *out)
+{
+    uint32_t p, q;
+    neighbours(a, pos, &p, &q);
+    if (!q)
+        return 0;
+    out->start = N(a, q).start;
+    out->count = N(a, q).count;
+    return 1;
+}
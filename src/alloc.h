@@ -12,9 +12,12 @@
  * a zero block; parity at that position covers only the drive(s) that
  * actually have data there.
  *
- * Free positions are tracked as a sorted array of extents (start, count).
- * Allocation uses first-fit search; adjacent extents are merged on free.
- * next_free is the bump high-water mark, used when no suitable extent exists.
+ * Free positions are tracked as extents (start, count) held in two treaps
+ * sharing one node pool: one ordered by start, augmented with the largest
+ * extent in each subtree, and one ordered by (count, start).  Allocation
+ * is best-fit through the size tree; free merges with the neighbours
+ * found in the address tree.  Both are O(log n) in the number of extents.
+ * next_free is the bump high-water mark, used when no extent is big enough.
  *
  * Both next_free and the extent list are persisted in the content file
  * (as drive_next_free / drive_free_extent header lines) and restored on load.
@@ -26,10 +29,23 @@ typedef struct {
 } lr_extent;
 
 typedef struct {
-    uint32_t   next_free;   /* Bump high-water mark */
-    lr_extent *extents;     /* Sorted free extents (by start position) */
-    uint32_t   ext_count;
-    uint32_t   ext_cap;
+    uint32_t start;
+    uint32_t count;
+    uint32_t max_count;   /* largest count in this node's address subtree */
+    uint32_t prio;
+    uint32_t kid[2][2];   /* [tree][left/right]; 0 = none */
+} lr_alloc_node;
+
+typedef struct {
+    uint32_t       next_free;  /* Bump high-water mark */
+    uint32_t       ext_count;  /* Free extents */
+    uint64_t       free_count; /* Positions in them */
+    lr_alloc_node *nodes;      /* Pool; index 0 is unused */
+    uint32_t       node_cap;
+    uint32_t       node_used;  /* Slots handed out so far */
+    uint32_t       spare;      /* Released slots, linked through start */
+    uint32_t       root[2];    /* Address tree, size tree */
+    uint32_t       seed;
 } lr_pos_allocator;
 
 void     alloc_init(lr_pos_allocator *a);
@@ -37,18 +53,45 @@ void     alloc_done(lr_pos_allocator *a);
 
 /*
  * Allocate `count` contiguous positions. Returns the start position.
- * Uses first-fit search through free extents, falling back to bump allocation.
+ * Takes the front of the smallest free extent that fits (lowest start
+ * among equals), falling back to bump allocation.
  * Passing count == 0 returns next_free without side effects (used by lr_create
  * to probe the current high-water mark before the first write).
  */
 uint32_t alloc_positions(lr_pos_allocator *a, uint32_t count);
 
+/*
+ * Allocate `count` positions from the lowest-addressed free extent that
+ * holds them, if it starts below `below`.  Never bumps next_free.  Returns
+ * the start, or UINT32_MAX when there is no such extent.  Used by
+ * compaction to move files down.
+ */
+uint32_t alloc_positions_low(lr_pos_allocator *a, uint32_t count,
+                             uint32_t below);
+
 /*
  * Return `count` contiguous positions starting at `start` to the free pool.
- * The range is inserted into the sorted extent list and merged with any
- * adjacent free extents. If the freed range abuts next_free, the high-water
- * mark is reclaimed.
+ * The range is merged with any adjacent free extents. If the freed range
+ * abuts next_free, the high-water mark is reclaimed.  A range overlapping
+ * a free extent is refused with a message.
  */
 void     free_positions(lr_pos_allocator *a, uint32_t start, uint32_t count);
 
+/*
+ * Replace the free list with a copy of ext[0..n) in one step (bulk load).
+ * The extents must be non-empty, sorted, non-adjacent and below next_free,
+ * which the caller sets first.  Returns -1 and leaves the allocator
+ * unchanged if they are not, or on OOM.  n == 0 empties the list and
+ * cannot fail.
+ */
+int      alloc_set_extents(lr_pos_allocator *a, const lr_extent *ext, uint32_t n);
+
+/*
+ * The first free extent starting at or after pos.  Returns 1 and fills
+ * *out, or 0 when there is none.  Walk the list with
+ * pos = out->start + out->count.
+ */
+int      alloc_next_extent(const lr_pos_allocator *a, uint32_t pos,
+                           lr_extent *out);
+
 #endif /* LR_ALLOC_H */
@@ -0,0 +1,295 @@
+#include "compact.h"
+#include "state.h"
+#include "alloc.h"
+#include "metalog.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ------------------------------------------------------------------ */
+/* Helpers                                                              */
+/* ------------------------------------------------------------------ */
+
+/* Highest next_free over the drives. */
+static uint32_t position_limit(lr_state *s)
+{
+    uint32_t limit = 0;
+    state_rdlock(s);
+    for (unsigned d = 0; d < s->drive_count; d++) {
+        state_lock_drive(s, d);
+        if (s->drives[d].pos_alloc.next_free > limit)
+            limit = s->drives[d].pos_alloc.next_free;
+        state_unlock_drive(s, d);
+    }
+    state_unlock(s);
+    return limit;
+}
+
+/* Caller holds c->lock. */
+static void finish_pass(lr_compact *c, int stopped)
+{
+    const lr_compact_result *r = &c->result;
+    c->active       = 0;
+    c->stop         = 0;
+    c->done_id      = c->pass_id;
+    c->done_stopped = stopped;
+    c->last         = c->result;
+    if (!stopped)
+        c->passes++;
+    fprintf(stderr, "compact: %s: %u files moved (%llu blocks), %u busy, "
+                    "position limit %u -> %u\n",
+            stopped ? "stopped" : "done", r->files_moved,
+            (unsigned long long)r->blocks_moved, r->files_busy,
+            r->limit_before, r->limit_after);
+    pthread_cond_broadcast(&c->done_cond);
+}
+
+/*
+ * Move the top file of drive d as low as it goes.  Returns 1 with its old
+ * and new ranges, or 0 when the drive is done (*busy = 1 if an open file
+ * stopped it).
+ *
+ * The file's own positions are freed first, so free space right below it
+ * merges with them (or with next_free) and a file can slide down into a
+ * hole smaller than itself.  The lowest extent starting at or below its
+ * old start then holds it; if there is none, next_free has dropped to at
+ * most that start and a bump allocation takes it.
+ */
+static int move_top(lr_compact *c, unsigned d, lr_extent *from, lr_extent *to,
+                    int *busy)
+{
+    lr_state *s     = c->state;
+    int       moved = 0;
+
+    state_wrlock(s);
+    uint32_t n = s->pos_index_count[d];
+    lr_file *f = n > 0 ? s->pos_index[d][n - 1].file : NULL;
+    if (f && state_open_count(f) > 0) {
+        *busy = 1;
+    } else if (f) {
+        lr_pos_allocator *pa    = &s->drives[d].pos_alloc;
+        uint32_t          old   = f->parity_pos_start;
+        uint32_t          count = f->block_count;
+
+        free_positions(pa, old, count);
+        uint32_t pos = alloc_positions_low(pa, count, old + 1);
+        if (pos == UINT32_MAX && pa->next_free <= old)
+            pos = alloc_positions(pa, count);
+
+        if (pos != UINT32_MAX && pos != old) {
+            f->parity_pos_start = pos;
+            state_pos_index_update(s, f, old, count);
+            metalog_file(s, f);
+            /* The vacated positions no longer hold this drive's data, and
+             * the new ones do */
+            if (c->mark) {
+                c->mark(c->arg, old, count);
+                c->mark(c->arg, pos, count);
+            }
+            *from = (lr_extent){ old, count };
+            *to   = (lr_extent){ pos, count };
+            moved = 1;
+        }
+    }
+    state_unlock(s);
+    return moved;
+}
+
+/* Rewrite the parity of both ranges of a move; one call when they touch */
+static void flush_moved(lr_compact *c, const lr_extent *from,
+                        const lr_extent *to)
+{
+    if (!c->flush)
+        return;
+    if (to->start + to->count >= from->start) {
+        c->flush(c->arg, to->start, from->start + from->count - to->start);
+    } else {
+        c->flush(c->arg, to->start, to->count);
+        c->flush(c->arg, from->start, from->count);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/* Compaction thread                                                    */
+/* ------------------------------------------------------------------ */
+
+static void *compact_thread(void *arg)
+{
+    lr_compact *c = (lr_compact *)arg;
+
+    pthread_mutex_lock(&c->lock);
+    while (c->running) {
+        if (!c->active) {
+            pthread_cond_wait(&c->cond, &c->lock);
+            continue;
+        }
+        if (c->stop || c->cur_drive >= c->end_drive) {
+            finish_pass(c, c->stop);
+            continue;
+        }
+        unsigned d = c->cur_drive;
+        pthread_mutex_unlock(&c->lock);
+
+        lr_extent from, to;
+        int       busy  = 0;
+        int       moved = move_top(c, d, &from, &to, &busy);
+        if (moved)
+            flush_moved(c, &from, &to);
+        uint32_t limit = position_limit(c->state);
+
+        pthread_mutex_lock(&c->lock);
+        c->result.limit_after = limit;
+        if (!moved) {
+            if (busy)
+                c->result.files_busy++;
+            c->cur_drive++;
+            continue;
+        }
+        c->result.files_moved++;
+        c->result.blocks_moved += from.count;
+
+        /* Rate cap: wait for the next move's turn, waking early on stop */
+        uint64_t wait = throttle_reserve(&c->throttle,
+                                         (uint64_t)from.count * c->pos_bytes,
+                                         throttle_now_ns());
+        if (wait > 0) {
+            struct timespec ts;
+            deadline_after(&ts, wait);
+            while (c->running && !c->stop) {
+                if (pthread_cond_timedwait(&c->cond, &c->lock, &ts) == ETIMEDOUT)
+                    break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* Public API                                                           */
+/* ------------------------------------------------------------------ */
+
+int compact_init(lr_compact *c, struct lr_state *s, uint64_t rate_bps,
+                 lr_compact_parity_fn mark, lr_compact_parity_fn flush,
+                 void *arg)
+{
+    memset(c, 0, sizeof(*c));
+    c->state     = s;
+    c->mark      = mark;
+    c->flush     = flush;
+    c->arg       = arg;
+    c->pos_bytes = s->cfg.block_size;
+    throttle_init(&c->throttle, rate_bps);
+
+    if (pthread_mutex_init(&c->lock, NULL) != 0)
+        goto fail_throttle;
+    if (pthread_cond_init(&c->cond, NULL) != 0)
+        goto fail_lock;
+    if (pthread_cond_init(&c->done_cond, NULL) != 0)
+        goto fail_cond;
+
+    c->running = 1;
+    if (pthread_create(&c->thread, NULL, compact_thread, c) != 0) {
+        c->running = 0;
+        pthread_cond_destroy(&c->done_cond);
+        goto fail_cond;
+    }
+    return 0;
+
+fail_cond:
+    pthread_cond_destroy(&c->cond);
+fail_lock:
+    pthread_mutex_destroy(&c->lock);
+fail_throttle:
+    throttle_done(&c->throttle);
+    return -1;
+}
+
+void compact_done(lr_compact *c)
+{
+    pthread_mutex_lock(&c->lock);
+    c->running = 0;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    pthread_join(c->thread, NULL);
+
+    pthread_cond_destroy(&c->done_cond);
+    pthread_cond_destroy(&c->cond);
+    pthread_mutex_destroy(&c->lock);
+    throttle_done(&c->throttle);
+    memset(c, 0, sizeof(*c));
+}
+
+uint64_t compact_start(lr_compact *c, int drive)
+{
+    /* Outside c->lock: the state lock comes first */
+    uint32_t limit  = position_limit(c->state);
+    unsigned ndrive = c->state->drive_count;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->active) {
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+    c->active    = 1;
+    c->stop      = 0;
+    c->drive     = drive;
+    c->cur_drive = drive == LR_COMPACT_ALL ? 0 : (unsigned)drive;
+    c->end_drive = drive == LR_COMPACT_ALL ? ndrive : (unsigned)drive + 1;
+    memset(&c->result, 0, sizeof(c->result));
+    c->result.limit_before = limit;
+    c->result.limit_after  = limit;
+    uint64_t id = ++c->pass_id;
+    pthread_cond_signal(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    return id;
+}
+
+int compact_wait(lr_compact *c, uint64_t id, unsigned timeout_ms,
+                 lr_compact_result *out)
+{
+    struct timespec ts;
+    deadline_after(&ts, (uint64_t)timeout_ms * 1000000ull);
+
+    pthread_mutex_lock(&c->lock);
+    while (c->done_id < id) {
+        if (pthread_cond_timedwait(&c->done_cond, &c->lock, &ts) == ETIMEDOUT) {
+            pthread_mutex_unlock(&c->lock);
+            return 0;
+        }
+    }
+    if (c->done_id == id)
+        *out = c->last;
+    else
+        memset(out, 0, sizeof(*out));
+    int rc = (c->done_id == id && c->done_stopped) ? -1 : 1;
+    pthread_mutex_unlock(&c->lock);
+    return rc;
+}
+
+int compact_stop(lr_compact *c)
+{
+    pthread_mutex_lock(&c->lock);
+    int had = c->active;
+    if (had) {
+        c->stop = 1;
+        pthread_cond_broadcast(&c->cond);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return had;
+}
+
+void compact_get_status(lr_compact *c, lr_compact_status *st)
+{
+    pthread_mutex_lock(&c->lock);
+    st->id        = c->pass_id;
+    st->active    = c->active;
+    st->drive     = c->drive;
+    st->cur_drive = c->cur_drive;
+    st->result    = c->result;
+    st->passes    = c->passes;
+    pthread_mutex_unlock(&c->lock);
+}
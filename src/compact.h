@@ -0,0 +1,109 @@
+#ifndef LR_COMPACT_H
+#define LR_COMPACT_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "throttle.h"
+
+struct lr_state;
+
+/*
+ * Online compaction of the parity position namespace.
+ *
+ * Deleted and shrunk files leave free extents below a drive's next_free
+ * that only a new file of a fitting size reuses, so the position limit
+ * (parity file size, scrub and drain range) does not come back down on
+ * its own.  A compaction pass walks each drive from its highest file
+ * down and gives that file the lowest free positions that hold it: the
+ * lowest fitting extent, or the ones just below it when it can slide
+ * down.  The positions it leaves are freed, which lowers next_free.  The
+ * data on the drive does not move, only the parity stripes covering it.
+ *
+ * Each move runs under the state write lock and passes both ranges to
+ * the mark callback (parity there is stale); the pass thread then hands
+ * them to the flush callback with no locks held, so the parity is
+ * rewritten before the next move.  Open files stay where they are
+ * (counted as busy): a writer may hold positions it read before the
+ * move.  A drive is done at the first top file that is busy or cannot
+ * go lower, since moving anything under it cannot lower next_free.
+ *
+ * The rate cap spaces moves out by bytes moved (block_size per position).
+ */
+
+#define LR_COMPACT_ALL (-1)   /* compact_start: every drive */
+
+/* Parity of [start, start+count) changed mapping */
+typedef void (*lr_compact_parity_fn)(void *arg, uint32_t start, uint32_t count);
+
+typedef struct {
+    uint32_t files_moved;
+    uint32_t files_busy;     /* open top files that stopped a drive */
+    uint64_t blocks_moved;
+    uint32_t limit_before;   /* highest next_free when the pass started */
+    uint32_t limit_after;    /* ... when it ended (so far while running) */
+} lr_compact_result;
+
+typedef struct {
+    uint64_t          id;          /* current or last pass */
+    int               active;
+    int               drive;       /* LR_COMPACT_ALL or the one drive */
+    unsigned          cur_drive;   /* drive being walked */
+    lr_compact_result result;      /* so far in this pass */
+    uint64_t          passes;      /* passes finished since compact_init */
+} lr_compact_status;
+
+typedef struct lr_compact {
+    pthread_mutex_t      lock;
+    pthread_cond_t       cond;       /* wakes the thread */
+    pthread_cond_t       done_cond;  /* a pass finished or stopped */
+    pthread_t            thread;
+    int                  running;
+
+    struct lr_state     *state;
+    lr_compact_parity_fn mark;       /* under the state write lock; NULL = none */
+    lr_compact_parity_fn flush;      /* no locks held; NULL = none */
+    void                *arg;
+    uint64_t             pos_bytes;  /* bytes moved per position, for the cap */
+    lr_throttle          throttle;
+
+    /* Current pass */
+    int                  active;
+    int                  stop;       /* cancel requested */
+    int                  drive;
+    unsigned             cur_drive;
+    unsigned             end_drive;  /* one past the last drive to walk */
+    lr_compact_result    result;
+    uint64_t             pass_id;    /* last pass started */
+    uint64_t             done_id;    /* last pass finished or stopped */
+    int                  done_stopped;
+    lr_compact_result    last;       /* result of pass done_id */
+    uint64_t             passes;
+} lr_compact;
+
+/* Start the compaction thread; rate_bps caps the bytes moved per second
+ * (0 = unlimited).  Returns 0 or -1. */
+int  compact_init(lr_compact *c, struct lr_state *s, uint64_t rate_bps,
+                  lr_compact_parity_fn mark, lr_compact_parity_fn flush,
+                  void *arg);
+
+/* Stop the thread after the move in progress. */
+void compact_done(lr_compact *c);
+
+/* Start a pass over one drive index or LR_COMPACT_ALL.  Returns the pass
+ * id, or 0 if a pass is already running. */
+uint64_t compact_start(lr_compact *c, int drive);
+
+/* Wait up to timeout_ms for pass id.  Returns 1 when it finished (*out =
+ * its result), -1 if it was stopped (*out = partial result), 0 on
+ * timeout. */
+int  compact_wait(lr_compact *c, uint64_t id, unsigned timeout_ms,
+                  lr_compact_result *out);
+
+/* Cancel the running pass after its current move.  Returns 1 if there
+ * was one. */
+int  compact_stop(lr_compact *c);
+
+void compact_get_status(lr_compact *c, lr_compact_status *st);
+
+#endif /* LR_COMPACT_H */
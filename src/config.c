@@ -6,7 +6,20 @@
 #include <ctype.h>
 #include <errno.h>
 
-#define DEFAULT_BLOCK_SIZE (256 * 1024)
+#define DEFAULT_BLOCK_SIZE   (256 * 1024)
+#define DEFAULT_DELTA_PARITY 64   /* MiB */
+#define DEFAULT_FD_CACHE     256
+#define DEFAULT_IO_DEPTH     64
+#define DEFAULT_DEGRADED_CACHE 32   /* MiB */
+#define DEFAULT_DEGRADED_RA    8    /* blocks */
+#define DEFAULT_METADATA_LOG     5    /* seconds */
+#define DEFAULT_METADATA_COMPACT 64   /* MiB */
+#define DEFAULT_DIRTY_LOG        10   /* ms */
+#define DEFAULT_CACHE_IDLE       300  /* seconds */
+#define DEFAULT_ATTR_TIMEOUT     1    /* seconds, as libfuse */
+#define DEFAULT_ENTRY_TIMEOUT    1    /* seconds, as libfuse */
+#define DEFAULT_MAX_WRITE        1024 /* KiB: the kernel's largest request */
+#define DEFAULT_PARITY_STRIPE    64   /* positions per parity shard stripe */
 
 /* Strip leading/trailing whitespace in-place, return pointer to start. */
 static char *trim(char *s)
@@ -22,6 +35,25 @@ static char *trim(char *s)
     return s;
 }
 
+/* "NAME DIR" of a data or cache line into dc.  Returns 0, or -1 when
+ * either is missing. */
+static int parse_drive(char *rest, lr_drive_conf *dc)
+{
+    char *name = rest;
+    char *dir  = rest;
+    while (*dir && !isspace((unsigned char)*dir))
+        dir++;
+    if (*dir) {
+        *dir++ = '\0';
+        dir = trim(dir);
+    }
+    if (!*name || !*dir)
+        return -1;
+    snprintf(dc->name, sizeof(dc->name), "%s", name);
+    snprintf(dc->dir,  sizeof(dc->dir),  "%s", dir);
+    return 0;
+}
+
 int config_load(const char *path, lr_config *cfg)
 {
     FILE *f;
@@ -32,6 +64,23 @@ int config_load(const char *path, lr_config *cfg)
     cfg->block_size       = DEFAULT_BLOCK_SIZE;
     cfg->placement_policy = LR_PLACE_MOSTFREE;
     cfg->parity_threads   = 1;
+    cfg->delta_parity_mb  = DEFAULT_DELTA_PARITY;
+    cfg->fd_cache         = DEFAULT_FD_CACHE;
+    cfg->io_engine        = LR_IO_SYNC;
+    cfg->content_format   = LR_CONTENT_TEXT;
+    cfg->parity_code      = LR_CODE_CAUCHY;
+    cfg->io_depth         = DEFAULT_IO_DEPTH;
+    cfg->degraded_cache_mb  = DEFAULT_DEGRADED_CACHE;
+    cfg->degraded_readahead = DEFAULT_DEGRADED_RA;
+    cfg->metadata_log_s     = DEFAULT_METADATA_LOG;
+    cfg->metadata_compact_mb = DEFAULT_METADATA_COMPACT;
+    cfg->dirty_log_ms       = DEFAULT_DIRTY_LOG;
+    cfg->cache_idle_s       = DEFAULT_CACHE_IDLE;
+    cfg->attr_timeout_s     = DEFAULT_ATTR_TIMEOUT;
+    cfg->entry_timeout_s    = DEFAULT_ENTRY_TIMEOUT;
+    cfg->splice_write       = 1;
+    cfg->max_write_kb       = DEFAULT_MAX_WRITE;
+    cfg->parity_stripe      = DEFAULT_PARITY_STRIPE;
 
     f = fopen(path, "r");
     if (!f) {
@@ -64,30 +113,45 @@ int config_load(const char *path, lr_config *cfg)
 
         if (strcmp(key, "data") == 0) {
             /* data NAME DIR */
-            char *name = rest;
-            char *dir  = rest;
-            while (*dir && !isspace((unsigned char)*dir))
-                dir++;
-            if (*dir) {
-                *dir++ = '\0';
-                dir = trim(dir);
-            }
-            if (!*name || !*dir) {
+            if (cfg->drive_count >= LR_DRIVE_MAX) {
+                fprintf(stderr, "config:%d: too many drives\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            if (parse_drive(rest, &cfg->drives[cfg->drive_count]) != 0) {
                 fprintf(stderr, "config:%d: bad 'data' line\n", lineno);
                 fclose(f);
                 return -1;
             }
-            if (cfg->drive_count >= LR_DRIVE_MAX) {
-                fprintf(stderr, "config:%d: too many drives\n", lineno);
+            cfg->drive_count++;
+
+        } else if (strcmp(key, "cache") == 0) {
+            /* cache NAME DIR */
+            if (cfg->cache.name[0] != '\0') {
+                fprintf(stderr, "config:%d: only one cache drive is supported\n",
+                        lineno);
+                fclose(f);
+                return -1;
+            }
+            if (parse_drive(rest, &cfg->cache) != 0) {
+                fprintf(stderr, "config:%d: bad 'cache' line\n", lineno);
                 fclose(f);
                 return -1;
             }
-            lr_drive_conf *dc = &cfg->drives[cfg->drive_count++];
-            snprintf(dc->name, sizeof(dc->name), "%s", name);
-            snprintf(dc->dir,  sizeof(dc->dir),  "%s", dir);
+
+        } else if (strcmp(key, "cache_idle") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 86400) {
+                fprintf(stderr, "config:%d: cache_idle must be between 0 and 86400\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->cache_idle_s = (unsigned)val;
 
         } else if (strcmp(key, "parity") == 0) {
-            /* parity LEVEL PATH  e.g.:  parity 1 /mnt/p1/liveraid.parity */
+            /* parity LEVEL PATH  e.g.:  parity 1 /mnt/p1/liveraid.parity
+             * A level given more than once is striped across the files */
             char *endp;
             long level = strtol(rest, &endp, 10);
             char *path = trim(endp);
@@ -97,7 +161,33 @@ int config_load(const char *path, lr_config *cfg)
                 fclose(f);
                 return -1;
             }
-            snprintf(cfg->parity_path[level - 1], PATH_MAX, "%s", path);
+            unsigned *n = &cfg->parity_shards[level - 1];
+            if (*n >= LR_SHARD_MAX) {
+                fprintf(stderr, "config:%d: parity %ld has more than %d files\n",
+                        lineno, level, LR_SHARD_MAX);
+                fclose(f);
+                return -1;
+            }
+            for (unsigned k = 0; k < *n; k++) {
+                if (strcmp(cfg->parity_path[level - 1][k], path) == 0) {
+                    fprintf(stderr, "config:%d: '%s' is listed twice for parity %ld\n",
+                            lineno, path, level);
+                    fclose(f);
+                    return -1;
+                }
+            }
+            snprintf(cfg->parity_path[level - 1][*n], PATH_MAX, "%s", path);
+            (*n)++;
+
+        } else if (strcmp(key, "parity_stripe") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 1 || val > 1048576) {
+                fprintf(stderr, "config:%d: parity_stripe must be between 1 and 1048576\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->parity_stripe = (uint32_t)val;
 
         } else if (strcmp(key, "content") == 0) {
             if (cfg->content_count >= 8) {
@@ -130,6 +220,8 @@ int config_load(const char *path, lr_config *cfg)
                 cfg->placement_policy = LR_PLACE_LFS;
             else if (strcmp(rest, "pfrd") == 0)
                 cfg->placement_policy = LR_PLACE_PFRD;
+            else if (strcmp(rest, "dirlocal") == 0)
+                cfg->placement_policy = LR_PLACE_DIRLOCAL;
             else {
                 fprintf(stderr, "config:%d: unknown placement policy '%s'\n",
                         lineno, rest);
@@ -154,6 +246,259 @@ int config_load(const char *path, lr_config *cfg)
             }
             cfg->bitmap_interval_s = (unsigned)val;
 
+        } else if (strcmp(key, "delta_parity") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 65536) {
+                fprintf(stderr, "config:%d: delta_parity must be between 0 and 65536 (MiB)\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->delta_parity_mb = (unsigned)val;
+
+        } else if (strcmp(key, "fd_cache") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 65536) {
+                fprintf(stderr, "config:%d: fd_cache must be between 0 and 65536\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->fd_cache = (unsigned)val;
+
+        } else if (strcmp(key, "io_engine") == 0) {
+            if (strcmp(rest, "sync") == 0)
+                cfg->io_engine = LR_IO_SYNC;
+            else if (strcmp(rest, "uring") == 0)
+                cfg->io_engine = LR_IO_URING;
+            else {
+                fprintf(stderr, "config:%d: unknown io_engine '%s'\n",
+                        lineno, rest);
+                fclose(f);
+                return -1;
+            }
+
+        } else if (strcmp(key, "splice_read") == 0 ||
+                   strcmp(key, "splice_write") == 0 ||
+                   strcmp(key, "writeback_cache") == 0 ||
+                   strcmp(key, "parallel_direct_writes") == 0 ||
+                   strcmp(key, "clone_fd") == 0 ||
+                   strcmp(key, "parity_direct") == 0) {
+            int on;
+            if (strcmp(rest, "on") == 0)
+                on = 1;
+            else if (strcmp(rest, "off") == 0)
+                on = 0;
+            else {
+                fprintf(stderr, "config:%d: %s must be on or off\n",
+                        lineno, key);
+                fclose(f);
+                return -1;
+            }
+            if (strcmp(key, "splice_read") == 0)
+                cfg->splice_read = on;
+            else if (strcmp(key, "splice_write") == 0)
+                cfg->splice_write = on;
+            else if (strcmp(key, "writeback_cache") == 0)
+                cfg->writeback_cache = on;
+            else if (strcmp(key, "parallel_direct_writes") == 0)
+                cfg->parallel_direct_writes = on;
+            else if (strcmp(key, "clone_fd") == 0)
+                cfg->clone_fd = on;
+            else
+                cfg->parity_direct = on;
+
+        } else if (strcmp(key, "max_write") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 4 || val > 1024) {
+                fprintf(stderr, "config:%d: max_write must be between 4 and 1024 (KiB)\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->max_write_kb = (unsigned)val;
+
+        } else if (strcmp(key, "max_readahead") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 65536) {
+                fprintf(stderr, "config:%d: max_readahead must be between 0 and 65536 (KiB)\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->max_readahead_kb = (unsigned)val;
+
+        } else if (strcmp(key, "max_threads") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 1024) {
+                fprintf(stderr, "config:%d: max_threads must be between 0 and 1024\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->max_threads = (unsigned)val;
+
+        } else if (strcmp(key, "parity_code") == 0) {
+            if (strcmp(rest, "cauchy") == 0)
+                cfg->parity_code = LR_CODE_CAUCHY;
+            else if (strcmp(rest, "raid") == 0)
+                cfg->parity_code = LR_CODE_RAID;
+            else {
+                fprintf(stderr, "config:%d: unknown parity_code '%s'\n",
+                        lineno, rest);
+                fclose(f);
+                return -1;
+            }
+
+        } else if (strcmp(key, "content_format") == 0) {
+            if (strcmp(rest, "text") == 0)
+                cfg->content_format = LR_CONTENT_TEXT;
+            else if (strcmp(rest, "binary") == 0)
+                cfg->content_format = LR_CONTENT_BINARY;
+            else {
+                fprintf(stderr, "config:%d: unknown content_format '%s'\n",
+                        lineno, rest);
+                fclose(f);
+                return -1;
+            }
+
+        } else if (strcmp(key, "metadata_log") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 3600) {
+                fprintf(stderr, "config:%d: metadata_log must be between 0 and 3600\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->metadata_log_s = (unsigned)val;
+
+        } else if (strcmp(key, "dirty_log") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 1000) {
+                fprintf(stderr, "config:%d: dirty_log must be between 0 and 1000 (ms)\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->dirty_log_ms = (unsigned)val;
+
+        } else if (strcmp(key, "metadata_compact") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 1 || val > 65536) {
+                fprintf(stderr, "config:%d: metadata_compact must be between 1 and 65536 (MiB)\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->metadata_compact_mb = (unsigned)val;
+
+        } else if (strcmp(key, "io_depth") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 1 || val > 4096) {
+                fprintf(stderr, "config:%d: io_depth must be between 1 and 4096\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->io_depth = (unsigned)val;
+
+        } else if (strcmp(key, "degraded_cache") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 65536) {
+                fprintf(stderr, "config:%d: degraded_cache must be between 0 and 65536\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->degraded_cache_mb = (unsigned)val;
+
+        } else if (strcmp(key, "degraded_readahead") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 1024) {
+                fprintf(stderr, "config:%d: degraded_readahead must be between 0 and 1024\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->degraded_readahead = (unsigned)val;
+
+        } else if (strcmp(key, "rebuild_rate") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 1048576) {
+                fprintf(stderr, "config:%d: rebuild_rate must be between 0 and 1048576\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->rebuild_rate_mb = (unsigned)val;
+
+        } else if (strcmp(key, "scrub_rate") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 1048576) {
+                fprintf(stderr, "config:%d: scrub_rate must be between 0 and 1048576\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->scrub_rate_mb = (unsigned)val;
+
+        } else if (strcmp(key, "compact_rate") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 1048576) {
+                fprintf(stderr, "config:%d: compact_rate must be between 0 and 1048576\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->compact_rate_mb = (unsigned)val;
+
+        } else if (strcmp(key, "scrub_daily") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 100) {
+                fprintf(stderr, "config:%d: scrub_daily must be between 0 and 100\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->scrub_daily_pct = (unsigned)val;
+
+        } else if (strcmp(key, "drain_max_dirty") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 1048576) {
+                fprintf(stderr, "config:%d: drain_max_dirty must be between 0 and 1048576\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->drain_max_dirty_mb = (unsigned)val;
+
+        } else if (strcmp(key, "drain_max_age") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 86400) {
+                fprintf(stderr, "config:%d: drain_max_age must be between 0 and 86400\n", lineno);
+                fclose(f);
+                return -1;
+            }
+            cfg->drain_max_age_s = (unsigned)val;
+
+        } else if (strcmp(key, "attr_timeout") == 0 ||
+                   strcmp(key, "entry_timeout") == 0 ||
+                   strcmp(key, "negative_timeout") == 0) {
+            char *endp;
+            long val = strtol(rest, &endp, 10);
+            if (endp == rest || val < 0 || val > 86400) {
+                fprintf(stderr, "config:%d: %s must be between 0 and 86400\n", lineno, key);
+                fclose(f);
+                return -1;
+            }
+            if (key[0] == 'a')
+                cfg->attr_timeout_s = (unsigned)val;
+            else if (key[0] == 'e')
+                cfg->entry_timeout_s = (unsigned)val;
+            else
+                cfg->negative_timeout_s = (unsigned)val;
+
         } else {
             fprintf(stderr, "config:%d: unknown directive '%s'\n", lineno, key);
             /* non-fatal: ignore */
@@ -166,10 +511,10 @@ int config_load(const char *path, lr_config *cfg)
     {
         int highest = -1, i;
         for (i = 0; i < LR_LEV_MAX; i++)
-            if (cfg->parity_path[i][0] != '\0')
+            if (cfg->parity_shards[i] > 0)
                 highest = i;
         for (i = 0; i <= highest; i++) {
-            if (cfg->parity_path[i][0] == '\0') {
+            if (cfg->parity_shards[i] == 0) {
                 fprintf(stderr, "config: parity levels have a gap — "
                         "parity %d is missing\n", i + 1);
                 return -1;
@@ -177,12 +522,39 @@ int config_load(const char *path, lr_config *cfg)
         }
         cfg->parity_levels = (unsigned)(highest + 1);
     }
+    if (cfg->parity_direct && cfg->block_size % 4096 != 0) {
+        fprintf(stderr, "config: parity_direct needs a blocksize that is a "
+                        "multiple of 4 KiB\n");
+        return -1;
+    }
+    if (cfg->parity_code == LR_CODE_RAID && cfg->parity_levels > 2) {
+        fprintf(stderr, "config: parity_code raid supports at most 2 parity "
+                        "levels (%u configured)\n", cfg->parity_levels);
+        return -1;
+    }
 
     /* Validate */
     if (cfg->drive_count == 0) {
         fprintf(stderr, "config: no data drives defined\n");
         return -1;
     }
+    if (cfg->cache.name[0] != '\0') {
+        /* The cache takes the drive slot after the data drives, and
+         * records find their drive by name */
+        if (cfg->drive_count >= LR_DRIVE_MAX) {
+            fprintf(stderr, "config: too many drives for a cache drive "
+                            "(at most %d data drives with one)\n",
+                    LR_DRIVE_MAX - 1);
+            return -1;
+        }
+        for (unsigned i = 0; i < cfg->drive_count; i++) {
+            if (strcmp(cfg->drives[i].name, cfg->cache.name) == 0) {
+                fprintf(stderr, "config: cache drive '%s' has the name of a "
+                                "data drive\n", cfg->cache.name);
+                return -1;
+            }
+        }
+    }
     if (cfg->content_count == 0) {
         fprintf(stderr, "config: no content file defined\n");
         return -1;
@@ -204,13 +576,37 @@ void config_dump(const lr_config *cfg)
     for (i = 0; i < cfg->drive_count; i++)
         fprintf(stderr, "  drive[%u]: name=%s dir=%s\n",
                 i, cfg->drives[i].name, cfg->drives[i].dir);
+    if (cfg->cache.name[0] != '\0')
+        fprintf(stderr, "  cache: name=%s dir=%s idle=%us\n",
+                cfg->cache.name, cfg->cache.dir, cfg->cache_idle_s);
+    fprintf(stderr, "  fuse: max_write=%uK max_readahead=%uK writeback_cache=%d "
+                    "parallel_direct_writes=%d clone_fd=%d max_threads=%u\n",
+            cfg->max_write_kb, cfg->max_readahead_kb, cfg->writeback_cache,
+            cfg->parallel_direct_writes, cfg->clone_fd, cfg->max_threads);
     for (i = 0; i < cfg->parity_levels; i++)
-        fprintf(stderr, "  parity[%u]: %s\n", i, cfg->parity_path[i]);
+        for (unsigned k = 0; k < cfg->parity_shards[i]; k++)
+            fprintf(stderr, "  parity[%u.%u]: %s\n", i, k, cfg->parity_path[i][k]);
+    fprintf(stderr, "  parity_stripe: %u  parity_direct: %d\n",
+            cfg->parity_stripe, cfg->parity_direct);
+    fprintf(stderr, "  parity_code: %s\n",
+            cfg->parity_code == LR_CODE_RAID ? "raid" : "cauchy");
     for (i = 0; i < cfg->content_count; i++)
         fprintf(stderr, "  content[%u]: %s\n", i, cfg->content_paths[i]);
+    fprintf(stderr, "  content_format: %s\n",
+            cfg->content_format == LR_CONTENT_BINARY ? "binary" : "text");
+    if (cfg->metadata_log_s > 0)
+        fprintf(stderr, "  metadata_log: %us, compact at %u MiB\n",
+                cfg->metadata_log_s, cfg->metadata_compact_mb);
+    else
+        fprintf(stderr, "  metadata_log: off\n");
+    if (cfg->dirty_log_ms > 0)
+        fprintf(stderr, "  dirty_log: %ums\n", cfg->dirty_log_ms);
+    else
+        fprintf(stderr, "  dirty_log: off\n");
     const char *placement = "mostfree";
     if (cfg->placement_policy == LR_PLACE_ROUNDROBIN) placement = "roundrobin";
     else if (cfg->placement_policy == LR_PLACE_LFS)   placement = "lfs";
     else if (cfg->placement_policy == LR_PLACE_PFRD)  placement = "pfrd";
+    else if (cfg->placement_policy == LR_PLACE_DIRLOCAL) placement = "dirlocal";
     fprintf(stderr, "  placement: %s\n", placement);
 }
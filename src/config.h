@@ -10,10 +10,26 @@
 #define LR_LEV_MAX    6
 #define LR_DRIVE_MAX  (256 - LR_LEV_MAX)  /* = 250 */
 
+/* Files one parity level can be striped across (repeated "parity N" lines) */
+#define LR_SHARD_MAX  8
+
 #define LR_PLACE_MOSTFREE   0
 #define LR_PLACE_ROUNDROBIN 1
 #define LR_PLACE_LFS        2   /* least free space: fill fullest drive first */
 #define LR_PLACE_PFRD       3   /* probabilistic: weighted random by free space */
+#define LR_PLACE_DIRLOCAL   4   /* drive of the directory's files, else mostfree */
+
+/* I/O engines for parity reads/writes (io_engine directive) */
+#define LR_IO_SYNC          0   /* pread/pwrite one request at a time */
+#define LR_IO_URING         1   /* io_uring batches (needs LR_HAVE_URING build) */
+
+/* Content file formats written by metadata_save (content_format directive);
+ * metadata_load reads either */
+#define LR_CONTENT_TEXT     0   /* line-based, human-readable */
+#define LR_CONTENT_BINARY   1   /* sectioned, mmap-loaded */
+
+#define LR_CODE_CAUCHY      0   /* ISA-L Cauchy matrix, any level count */
+#define LR_CODE_RAID        1   /* P = XOR, Q = RAID-6 (at most 2 levels) */
 
 typedef struct {
     char name[64];
@@ -23,19 +39,53 @@ typedef struct {
 typedef struct {
     lr_drive_conf  drives[LR_DRIVE_MAX];
     unsigned       drive_count;
+    lr_drive_conf  cache;           /* write-landing tier; name[0] == '\0' = none */
+    unsigned       cache_idle_s;    /* closed and unmodified this long before it moves, seconds */
 
-    char           parity_path[LR_LEV_MAX][PATH_MAX];
+    char           parity_path[LR_LEV_MAX][LR_SHARD_MAX][PATH_MAX];
+    unsigned       parity_shards[LR_LEV_MAX]; /* files per level, 0 = level unset */
     unsigned       parity_levels;
+    uint32_t       parity_stripe;   /* positions per shard before the next one */
+    int            parity_direct;   /* O_DIRECT parity I/O */
+    int            parity_code;     /* LR_CODE_CAUCHY or LR_CODE_RAID */
 
     char           content_paths[8][PATH_MAX];
     unsigned       content_count;
+    int            content_format;  /* LR_CONTENT_TEXT or LR_CONTENT_BINARY */
+    unsigned       metadata_log_s;      /* seconds between change-log flushes (0 = snapshots only) */
+    unsigned       metadata_compact_mb; /* change-log size that triggers a snapshot, MiB */
 
     char           mountpoint[PATH_MAX];
 
     uint32_t       block_size;      /* bytes, multiple of 64 */
     int            placement_policy;
     unsigned       parity_threads;      /* parallel threads for parity drain (default 1) */
-    unsigned       bitmap_interval_s;   /* seconds between metadata+bitmap saves (0 = default 300) */
+    unsigned       bitmap_interval_s;   /* seconds between metadata+bitmap saves (0 = default 300);
+                                         * with metadata_log, bitmap only */
+    unsigned       dirty_log_ms;        /* dirty-range log group commit interval, ms (0 = off) */
+    unsigned       delta_parity_mb;     /* MiB of pending delta-parity blocks (0 = disabled) */
+    unsigned       fd_cache;            /* cached read-only data fds (0 = disabled) */
+    int            io_engine;           /* LR_IO_SYNC or LR_IO_URING */
+    unsigned       io_depth;            /* max in-flight requests per io_uring ring */
+    unsigned       degraded_cache_mb;   /* MiB of recovered blocks cached (0 = off) */
+    unsigned       degraded_readahead;  /* blocks recovered ahead of sequential degraded reads */
+    unsigned       rebuild_rate_mb;     /* rebuild bandwidth cap in MiB/s (0 = unlimited) */
+    unsigned       scrub_rate_mb;       /* background scrub read cap in MiB/s (0 = unlimited) */
+    unsigned       scrub_daily_pct;     /* rolling scrub, percent of the array per day (0 = off) */
+    unsigned       compact_rate_mb;     /* compaction cap in MiB/s of files moved (0 = unlimited) */
+    unsigned       drain_max_dirty_mb;  /* undrained parity backlog that stalls writes, MiB (0 = no cap) */
+    unsigned       drain_max_age_s;     /* age of the oldest undrained write that stalls writes (0 = no cap) */
+    unsigned       attr_timeout_s;      /* kernel attribute cache lifetime, seconds */
+    unsigned       entry_timeout_s;     /* kernel name lookup cache lifetime, seconds */
+    unsigned       negative_timeout_s;  /* kernel cache of failed lookups, seconds (0 = off) */
+    int            splice_read;         /* reads spliced from the drive to /dev/fuse (loses EIO recovery) */
+    int            splice_write;        /* writes spliced from /dev/fuse to the drive */
+    unsigned       max_write_kb;        /* largest FUSE write request, KiB */
+    unsigned       max_readahead_kb;    /* kernel readahead cap, KiB (0 = kernel default) */
+    int            writeback_cache;     /* kernel write-back page cache */
+    int            parallel_direct_writes; /* concurrent direct-I/O writes to one file */
+    int            clone_fd;            /* one /dev/fuse fd per worker thread */
+    unsigned       max_threads;         /* FUSE worker threads (0 = libfuse default) */
 } lr_config;
 
 /* Parse config file at path into cfg.  Returns 0 on success, -1 on error. */
@@ -2,6 +2,15 @@
 #include "state.h"
 #include "parity.h"
 #include "journal.h"
+#include "metalog.h"
+#include "wal.h"
+#include "fdcache.h"
+#include "pool.h"
+#include "rcache.h"
+#include "rebuild.h"
+#include "scrub.h"
+#include "compact.h"
+#include "mover.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,245 +42,808 @@ static int ctrl_send(int conn, const char *fmt, ...)
     return (write(conn, buf, (size_t)n) < 0) ? -1 : 0;
 }
 
+/* Rebuild engine progress callback: "rate done=B total=B bps=B eta=S" */
+static void live_rebuild_progress(void *arg, const lr_rebuild_progress *p)
+{
+    int conn = *(int *)arg;
+    if (p->eta_sec == UINT64_MAX)
+        ctrl_send(conn, "rate done=%llu total=%llu bps=0 eta=?\n",
+                  (unsigned long long)p->done_bytes,
+                  (unsigned long long)p->total_bytes);
+    else
+        ctrl_send(conn, "rate done=%llu total=%llu bps=%llu eta=%llu\n",
+                  (unsigned long long)p->done_bytes,
+                  (unsigned long long)p->total_bytes,
+                  (unsigned long long)p->bytes_per_sec,
+                  (unsigned long long)p->eta_sec);
+}
+
+typedef struct {
+    lr_state *state;
+    int       conn;
+    unsigned  total;
+    unsigned  finished;
+    unsigned  rebuilt;
+    unsigned  failed;
+    unsigned  skipped;
+} live_rebuild_ctx;
+
 /*--------------------------------------------------------------------
- * mkdir -p for the parent directory of real_file_path.
+ * Per-file result of a live rebuild.
+ *
+ * Files open when the rebuild started are skipped ("busy"), as are files
+ * removed or moved while they were being reconstructed ("gone").
  *------------------------------------------------------------------*/
-static void ctrl_mkdirs(const char *real_file_path)
+static void live_rebuild_done(void *arg, const lr_rebuild_target *t, int rc)
 {
-    char tmp[PATH_MAX];
-    snprintf(tmp, sizeof(tmp), "%s", real_file_path);
+    live_rebuild_ctx *lc   = (live_rebuild_ctx *)arg;
+    lr_state         *s    = lc->state;
+    int               conn = lc->conn;
 
-    char *slash = strrchr(tmp, '/');
-    if (!slash || slash == tmp)
-        return;
-    *slash = '\0';
+    ctrl_send(conn, "progress %u %u %s\n", ++lc->finished, lc->total, t->vpath);
 
-    for (char *p = tmp + 1; *p; p++) {
-        if (*p != '/')
-            continue;
-        *p = '\0';
-        mkdir(tmp, 0755);
-        *p = '/';
+    if (rc == 0) {
+        /* Any cached read fd refers to the file that was replaced */
+        if (s->fdcache) {
+            state_rdlock(s);
+            lr_file *rf = state_find_file(s, t->vpath);
+            if (rf)
+                fdcache_invalidate(s->fdcache, rf);
+            state_unlock(s);
+        }
+        ctrl_send(conn, "ok %s\n", t->vpath);
+        lc->rebuilt++;
+    } else if (rc > 0) {
+        ctrl_send(conn, "skip %s %s\n", t->vpath, t->busy ? "busy" : "gone");
+        lc->skipped++;
+    } else {
+        if (t->create_err)
+            ctrl_send(conn, "fail %s cannot create: %s\n",
+                      t->vpath, strerror(t->create_err));
+        else if (t->err == 0)
+            ctrl_send(conn, "fail %s parity error at block %u\n",
+                      t->vpath, t->bad_blk);
+        else
+            ctrl_send(conn, "fail %s write error at block %u: %s\n",
+                      t->vpath, t->bad_blk, strerror(t->err));
+        lc->failed++;
     }
-    mkdir(tmp, 0755);
 }
 
 /*--------------------------------------------------------------------
- * Rebuild one file from parity while the filesystem is live.
- *
- * Looks up the file under rdlock, checks that it is not currently
- * open (open_count == 0), snapshots its metadata, then recovers
- * block-by-block while holding rdlock only around the parity call.
- *
- * Returns:
- *   0   — file rebuilt successfully
- *   1   — file skipped (busy or gone)
- *  -1   — rebuild failed (error sent to conn)
+ * Rebuild all files on the space-separated drive names in one pass;
+ * stream progress to conn.
  *------------------------------------------------------------------*/
-static int live_rebuild_one_file(lr_ctrl *c, int conn,
-                                  unsigned drive_idx, const char *vpath)
+static void live_rebuild(lr_ctrl *c, int conn, const char *drive_names)
 {
     lr_state *s = c->state;
-    uint32_t bs = s->cfg.block_size;
-
-    /* --- Snapshot metadata under rdlock; check open_count --- */
-    pthread_rwlock_rdlock(&s->state_lock);
-    lr_file *f = state_find_file(s, vpath);
-    if (!f || f->drive_idx != drive_idx) {
-        pthread_rwlock_unlock(&s->state_lock);
-        return 1;   /* gone or moved to another drive — skip silently */
-    }
-    if (f->open_count > 0) {
-        pthread_rwlock_unlock(&s->state_lock);
-        ctrl_send(conn, "skip %s busy\n", vpath);
-        return 1;
-    }
-
-    char     real_path[PATH_MAX];
-    uint32_t pos_start   = f->parity_pos_start;
-    uint32_t block_count = f->block_count;
-    int64_t  file_size   = f->size;
-    mode_t   mode        = f->mode;
-    uid_t    uid         = f->uid;
-    gid_t    gid         = f->gid;
-    time_t   mtime_sec   = f->mtime_sec;
-    long     mtime_nsec  = f->mtime_nsec;
-    snprintf(real_path, sizeof(real_path), "%s", f->real_path);
-    pthread_rwlock_unlock(&s->state_lock);
-
-    /* --- Create parent dirs --- */
-    ctrl_mkdirs(real_path);
-
-    /* --- Open/truncate output file --- */
-    mode_t create_mode = (mode & 07777) ? (mode & 07777) : 0644;
-    int fd = open(real_path, O_WRONLY | O_CREAT | O_TRUNC, create_mode);
-    if (fd < 0) {
-        ctrl_send(conn, "fail %s cannot create: %s\n", vpath, strerror(errno));
-        return -1;
+    char list[512];
+    snprintf(list, sizeof(list), "%s", drive_names);
+
+    /* --- Find drive indices under rdlock --- */
+    state_rdlock(s);
+    unsigned drives[LR_LEV_MAX];
+    unsigned ndrives = 0;
+    char    *save    = NULL;
+    for (char *name = strtok_r(list, " ", &save); name;
+         name = strtok_r(NULL, " ", &save)) {
+        unsigned idx = (unsigned)-1;
+        for (unsigned i = 0; i < s->drive_count; i++) {
+            if (strcmp(s->drives[i].name, name) == 0) {
+                idx = i;
+                break;
+            }
+        }
+        if (idx == (unsigned)-1) {
+            state_unlock(s);
+            ctrl_send(conn, "error drive '%s' not found\n", name);
+            return;
+        }
+        int dup = 0;
+        for (unsigned i = 0; i < ndrives; i++)
+            if (drives[i] == idx)
+                dup = 1;
+        if (dup)
+            continue;
+        if (ndrives == s->parity->levels) {
+            state_unlock(s);
+            ctrl_send(conn, "error parity can recover at most %u drive(s)\n",
+                      s->parity->levels);
+            return;
+        }
+        drives[ndrives++] = idx;
+    }
+    if (ndrives == 0) {
+        state_unlock(s);
+        ctrl_send(conn, "error no drive given\n");
+        return;
     }
 
-    void *block_buf = malloc(bs);
-    if (!block_buf) {
-        close(fd);
-        unlink(real_path);
-        ctrl_send(conn, "fail %s out of memory\n", vpath);
-        return -1;
+    /* Snapshot the files on those drives */
+    lr_rebuild_target *targets;
+    unsigned           total;
+    uint64_t           bytes;
+    int rc = rebuild_collect(s, drives, ndrives, &targets, &total, &bytes);
+    state_unlock(s);
+    if (rc != 0) {
+        ctrl_send(conn, "error out of memory\n");
+        return;
+    }
+
+    /* Recover on the shared parity pool when there is one */
+    lr_rebuild *rb = rebuild_start(s, s->journal ? s->journal->pool : NULL,
+                                   drives, ndrives, bytes,
+                                   (uint64_t)s->cfg.rebuild_rate_mb << 20,
+                                   live_rebuild_progress, &conn);
+    if (!rb) {
+        rebuild_free_targets(targets, total);
+        ctrl_send(conn, "error cannot start rebuild engine\n");
+        return;
     }
 
-    /* --- Recover blocks --- */
-    int ok = 1;
-    for (uint32_t blk = 0; blk < block_count; blk++) {
-        uint32_t pos = pos_start + blk;
+    pthread_mutex_lock(&c->lock);
+    c->rebuild = rb;
+    pthread_mutex_unlock(&c->lock);
+    ctrl_send(conn, "progress 0 %u (starting)\n", total);
 
-        pthread_rwlock_rdlock(&s->state_lock);
-        int rc = parity_recover_block(s, drive_idx, pos, block_buf);
-        pthread_rwlock_unlock(&s->state_lock);
+    live_rebuild_ctx lc;
+    memset(&lc, 0, sizeof(lc));
+    lc.state = s;
+    lc.conn  = conn;
+    lc.total = total;
+    rebuild_targets(rb, targets, total, live_rebuild_done, &lc);
+    rebuild_free_targets(targets, total);
 
-        if (rc != 0) {
-            ctrl_send(conn, "fail %s parity error at block %u\n", vpath, blk);
-            ok = 0;
-            break;
+    lr_rebuild_progress p;
+    pthread_mutex_lock(&c->lock);
+    c->rebuild = NULL;
+    pthread_mutex_unlock(&c->lock);
+    rebuild_get_progress(rb, &p);
+    rebuild_finish(rb);
+    live_rebuild_progress(&conn, &p);
+
+    ctrl_send(conn, "done %u %u skipped=%u\n", lc.rebuilt, lc.failed, lc.skipped);
+}
+
+/* One live rebuild at a time: the engine is reserved for its duration. */
+static void live_do_rebuild(lr_ctrl *c, int conn, const char *drive_names)
+{
+    lr_state *s = c->state;
+
+    if (!s->parity || s->parity->levels == 0) {
+        ctrl_send(conn, "error no parity configured\n");
+        return;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    int busy = c->rebuilding;
+    c->rebuilding = 1;
+    pthread_mutex_unlock(&c->lock);
+    if (busy) {
+        ctrl_send(conn, "error a rebuild is already running\n");
+        return;
+    }
+    live_rebuild(c, conn, drive_names);
+    pthread_mutex_lock(&c->lock);
+    c->rebuilding = 0;
+    pthread_mutex_unlock(&c->lock);
+}
+
+/* Parse a decimal position; returns 0 on success. */
+static int parse_pos(const char *str, uint32_t *out)
+{
+    char *endp;
+    errno = 0;
+    unsigned long v = strtoul(str, &endp, 10);
+    if (endp == str || *endp != '\0' || errno != 0 || v > UINT32_MAX ||
+        str[0] == '-')
+        return -1;
+    *out = (uint32_t)v;
+    return 0;
+}
+
+static void send_scrub_result(int conn, int repair, const lr_scrub_result *r)
+{
+    if (repair)
+        ctrl_send(conn, "done %u %u fixed=%u errors=%u\n",
+                  r->positions_checked,
+                  r->parity_mismatches,
+                  r->parity_fixed,
+                  r->read_errors);
+    else
+        ctrl_send(conn, "done %u %u errors=%u\n",
+                  r->positions_checked,
+                  r->parity_mismatches,
+                  r->read_errors);
+}
+
+/*--------------------------------------------------------------------
+ * scrub [repair] [START END] — run a scrub or repair pass over all
+ * positions, or [START, END), and stream its progress and result to
+ * conn.  The pass runs on the background scrubber: a client that
+ * disconnects leaves it running.
+ *
+ * scrub stop       — cancel the running pass
+ * scrub daily PCT  — set the rolling schedule (0 = off)
+ *------------------------------------------------------------------*/
+static void live_do_scrub(lr_ctrl *c, int conn, const char *args)
+{
+    lr_state *s  = c->state;
+    lr_scrub *sc = s->scrub;
+
+    char  buf[512];
+    char *tok[4];
+    int   ntok = 0;
+    char *save = NULL;
+    snprintf(buf, sizeof(buf), "%s", args);
+    for (char *t = strtok_r(buf, " ", &save); t;
+         t = strtok_r(NULL, " ", &save)) {
+        if (ntok == 4) {
+            ctrl_send(conn, "error usage: scrub [repair] [START END]\n");
+            return;
         }
+        tok[ntok++] = t;
+    }
 
-        size_t write_len = bs;
-        if (blk == block_count - 1 && file_size > 0) {
-            size_t tail = (size_t)(file_size % bs);
-            if (tail != 0)
-                write_len = tail;
+    if (ntok > 0 && strcmp(tok[0], "stop") == 0) {
+        if (!sc) {
+            ctrl_send(conn, "error background scrub unavailable\n");
+            return;
+        }
+        ctrl_send(conn, "done stopped=%d\n", scrub_stop(sc));
+        return;
+    }
+    if (ntok > 0 && strcmp(tok[0], "daily") == 0) {
+        uint32_t pct;
+        if (ntok != 2 || parse_pos(tok[1], &pct) != 0 || pct > 100) {
+            ctrl_send(conn, "error usage: scrub daily PCT (0-100)\n");
+            return;
+        }
+        if (!sc) {
+            ctrl_send(conn, "error background scrub unavailable\n");
+            return;
         }
+        scrub_set_daily(sc, pct);
+        ctrl_send(conn, "done daily=%u\n", pct);
+        return;
+    }
 
-        ssize_t n = pwrite(fd, block_buf, write_len, (off_t)blk * bs);
-        if (n != (ssize_t)write_len) {
-            ctrl_send(conn, "fail %s write error at block %u: %s\n",
-                      vpath, blk, strerror(errno));
-            ok = 0;
-            break;
+    int repair = 0, i = 0;
+    if (ntok > 0 && strcmp(tok[0], "repair") == 0) {
+        repair = 1;
+        i      = 1;
+    }
+    uint32_t start = 0, end = 0;
+    if (ntok - i == 2) {
+        if (parse_pos(tok[i], &start) != 0 || parse_pos(tok[i + 1], &end) != 0 ||
+            end <= start) {
+            ctrl_send(conn, "error bad range (START END, END > START)\n");
+            return;
         }
+    } else if (ntok - i != 0) {
+        ctrl_send(conn, "error usage: scrub [repair] [START END]\n");
+        return;
     }
 
-    free(block_buf);
-    close(fd);
+    if (!s->parity || s->parity->levels == 0) {
+        ctrl_send(conn, "error no parity configured\n");
+        return;
+    }
 
-    if (!ok) {
-        unlink(real_path);
-        return -1;
+    lr_scrub_result result;
+    memset(&result, 0, sizeof(result));
+
+    if (!sc) {
+        /* No scrubber thread: run the pass here */
+        uint32_t limit = parity_position_limit(s);
+        if (end == 0 || end > limit)
+            end = limit;
+        if (start < end)
+            parity_scrub_range(s, start, end - start, repair, &result);
+        send_scrub_result(conn, repair, &result);
+        return;
     }
 
-    /* --- Restore metadata --- */
-    if (mode & 07777)
-        chmod(real_path, mode & 07777);
-    /* Best-effort: may fail if not running as root */
-    int chown_rc = lchown(real_path, uid, gid);
-    (void)chown_rc;
-    if (mtime_sec != 0) {
-        struct timespec ts[2];
-        ts[0].tv_sec  = mtime_sec;  ts[0].tv_nsec = mtime_nsec;
-        ts[1].tv_sec  = mtime_sec;  ts[1].tv_nsec = mtime_nsec;
-        utimensat(AT_FDCWD, real_path, ts, 0);
+    uint64_t id = scrub_start(sc, start, end, repair);
+    if (id == 0) {
+        lr_scrub_status st;
+        scrub_get_status(sc, &st);
+        ctrl_send(conn, "error scrub already running at position %u of %u\n",
+                  st.cursor, st.end);
+        return;
     }
 
-    ctrl_send(conn, "ok %s\n", vpath);
-    return 0;
+    int rc;
+    while ((rc = scrub_wait(sc, id, 1000, &result)) == 0) {
+        lr_scrub_status st;
+        scrub_get_status(sc, &st);
+        if (st.active && st.end != UINT32_MAX &&
+            ctrl_send(conn, "progress %u %u\n", st.cursor, st.end) != 0)
+            return;     /* client gone; the pass carries on */
+    }
+    if (rc < 0) {
+        ctrl_send(conn, "error scrub stopped after %u positions\n",
+                  result.positions_checked);
+        return;
+    }
+    send_scrub_result(conn, repair, &result);
 }
 
 /*--------------------------------------------------------------------
- * Rebuild all files on drive_name; stream progress to conn.
+ * compact [DRIVE] — move files down into free positions on every drive,
+ * or on DRIVE, and stream progress and the result to conn.  The pass
+ * runs on the compaction thread: a client that disconnects leaves it
+ * running.
+ *
+ * compact stop     — cancel the running pass
  *------------------------------------------------------------------*/
-static void live_do_rebuild(lr_ctrl *c, int conn, const char *drive_name)
+static void live_do_compact(lr_ctrl *c, int conn, const char *args)
 {
-    lr_state *s = c->state;
+    lr_state   *s  = c->state;
+    lr_compact *cp = s->compact;
 
-    /* --- Find drive index under rdlock --- */
-    pthread_rwlock_rdlock(&s->state_lock);
-    unsigned drive_idx = (unsigned)-1;
-    for (unsigned i = 0; i < s->drive_count; i++) {
-        if (strcmp(s->drives[i].name, drive_name) == 0) {
-            drive_idx = i;
-            break;
-        }
+    char  buf[512];
+    char *save = NULL;
+    snprintf(buf, sizeof(buf), "%s", args);
+    char *arg = strtok_r(buf, " ", &save);
+    if (arg && strtok_r(NULL, " ", &save)) {
+        ctrl_send(conn, "error usage: compact [DRIVE|stop]\n");
+        return;
     }
-    if (drive_idx == (unsigned)-1) {
-        pthread_rwlock_unlock(&s->state_lock);
-        ctrl_send(conn, "error drive '%s' not found\n", drive_name);
+    if (!cp) {
+        ctrl_send(conn, "error compaction unavailable\n");
         return;
     }
-
-    /* Count files on this drive and snapshot their vpaths */
-    unsigned total = 0;
-    lr_list_node *node = lr_list_head(&s->file_list);
-    while (node) {
-        lr_file *f = (lr_file *)node->data;
-        if (f->drive_idx == drive_idx)
-            total++;
-        node = node->next;
+    if (arg && strcmp(arg, "stop") == 0) {
+        ctrl_send(conn, "done stopped=%d\n", compact_stop(cp));
+        return;
     }
 
-    char (*vpaths)[PATH_MAX] = NULL;
-    if (total > 0) {
-        vpaths = malloc((size_t)total * PATH_MAX);
-        if (!vpaths) {
-            pthread_rwlock_unlock(&s->state_lock);
-            ctrl_send(conn, "error out of memory\n");
+    int drive = LR_COMPACT_ALL;
+    if (arg) {
+        for (unsigned i = 0; i < s->drive_count; i++)
+            if (strcmp(s->drives[i].name, arg) == 0)
+                drive = (int)i;
+        if (drive == LR_COMPACT_ALL) {
+            ctrl_send(conn, "error unknown drive '%s'\n", arg);
             return;
         }
-        unsigned idx = 0;
-        node = lr_list_head(&s->file_list);
-        while (node && idx < total) {
-            lr_file *f = (lr_file *)node->data;
-            if (f->drive_idx == drive_idx)
-                snprintf(vpaths[idx++], PATH_MAX, "%s", f->vpath);
-            node = node->next;
-        }
-        total = idx;
     }
-    pthread_rwlock_unlock(&s->state_lock);
 
-    ctrl_send(conn, "progress 0 %u (starting)\n", total);
+    uint64_t id = compact_start(cp, drive);
+    if (id == 0) {
+        ctrl_send(conn, "error compaction already running\n");
+        return;
+    }
 
-    unsigned rebuilt = 0, failed = 0, skipped = 0;
-    for (unsigned i = 0; i < total; i++) {
-        ctrl_send(conn, "progress %u %u %s\n", i + 1, total, vpaths[i]);
-        int rc = live_rebuild_one_file(c, conn, drive_idx, vpaths[i]);
-        if (rc == 0)
-            rebuilt++;
-        else if (rc > 0)
-            skipped++;
-        else
-            failed++;
+    lr_compact_result r;
+    int               rc;
+    while ((rc = compact_wait(cp, id, 1000, &r)) == 0) {
+        lr_compact_status st;
+        compact_get_status(cp, &st);
+        if (st.active && st.id == id &&
+            ctrl_send(conn, "progress drive=%s moved=%u blocks=%llu limit=%u\n",
+                      st.cur_drive < s->drive_count
+                          ? s->drives[st.cur_drive].name : "-",
+                      st.result.files_moved,
+                      (unsigned long long)st.result.blocks_moved,
+                      st.result.limit_after) != 0)
+            return;     /* client gone; the pass carries on */
     }
+    if (rc < 0) {
+        ctrl_send(conn, "error compaction stopped after %u files\n",
+                  r.files_moved);
+        return;
+    }
+    ctrl_send(conn, "done moved=%u blocks=%llu busy=%u limit=%u->%u\n",
+              r.files_moved, (unsigned long long)r.blocks_moved,
+              r.files_busy, r.limit_before, r.limit_after);
+}
 
-    free(vpaths);
+/*--------------------------------------------------------------------
+ * migrate — move every closed file off the cache drive now, whatever its
+ * age, and report the result.  Runs on the connection thread, after a
+ * background pass in progress.
+ *
+ * migrate stop     — cancel the running pass
+ *------------------------------------------------------------------*/
+static void live_do_migrate(lr_ctrl *c, int conn, const char *args)
+{
+    lr_mover *m = c->state->mover;
+
+    while (*args == ' ')
+        args++;
+    if (*args != '\0' && strcmp(args, "stop") != 0) {
+        ctrl_send(conn, "error usage: migrate [stop]\n");
+        return;
+    }
+    if (!m) {
+        ctrl_send(conn, "error no cache drive\n");
+        return;
+    }
+    if (*args != '\0') {
+        ctrl_send(conn, "done stopped=%d\n", mover_stop(m));
+        return;
+    }
 
-    ctrl_send(conn, "done %u %u skipped=%u\n", rebuilt, failed, skipped);
+    lr_mover_result r;
+    if (mover_run(m, 1, &r) != 0) {
+        ctrl_send(conn, "error migration stopped after %u files\n",
+                  r.files_moved);
+        return;
+    }
+    ctrl_send(conn, "done moved=%u bytes=%llu raced=%u failed=%u\n",
+              r.files_moved, (unsigned long long)r.bytes_moved, r.raced,
+              r.failed);
+}
+
+/* Progress of the running live rebuild; returns 0 when there is none. */
+static int rebuild_progress(lr_ctrl *c, lr_rebuild_progress *p)
+{
+    pthread_mutex_lock(&c->lock);
+    int running = c->rebuild != NULL;
+    if (running)
+        rebuild_get_progress(c->rebuild, p);
+    pthread_mutex_unlock(&c->lock);
+    return running;
+}
+
+/* Latency histograms and device counters (stats.h), text or Prometheus. */
+static void send_metrics(lr_ctrl *c, int conn, int prom)
+{
+    lr_state *s = c->state;
+    if (!s->stats)
+        return;
+
+    const char *names[LR_STATS_DEVS];
+    char        parity_names[LR_LEV_MAX][16];
+    memset(names, 0, sizeof(names));
+    for (unsigned i = 0; i < s->drive_count; i++)
+        names[i] = s->drives[i].name;
+    unsigned levels = s->parity ? s->parity->levels : 0;
+    for (unsigned p = 0; p < levels; p++) {
+        snprintf(parity_names[p], sizeof(parity_names[p]), "parity%u", p + 1);
+        names[LR_STATS_DEV_PARITY + p] = parity_names[p];
+    }
+
+    lr_stats_counters *snap = malloc(sizeof(*snap));
+    int                fd   = dup(conn);
+    FILE              *out  = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!snap || !out) {
+        if (out)
+            fclose(out);
+        else if (fd >= 0)
+            close(fd);
+        free(snap);
+        return;
+    }
+    stats_snapshot(s->stats, snap);
+    stats_print(snap, names, s->cfg.block_size, out, prom);
+    fclose(out);
+    free(snap);
 }
 
 /*--------------------------------------------------------------------
- * Run a scrub or repair pass and stream the result to conn.
- * repair=0: verify only; repair=1: verify and fix mismatched parity.
+ * Report runtime counters, one "name key=value ..." line per subsystem.
  *------------------------------------------------------------------*/
-static void live_do_scrub(lr_ctrl *c, int conn, int repair)
+static void live_do_stats(lr_ctrl *c, int conn)
 {
     lr_state *s = c->state;
 
-    if (!s->parity || s->parity->levels == 0) {
-        ctrl_send(conn, "error no parity configured\n");
-        return;
+    state_rdlock(s);
+    unsigned files    = s->file_list.count;
+    unsigned dirs     = s->dir_list.count;
+    unsigned symlinks = s->symlink_list.count;
+    state_unlock(s);
+    lr_strpool_stats ps;
+    strpool_get_stats(&s->paths, &ps);
+    ctrl_send(conn, "metadata files=%u dirs=%u symlinks=%u strings=%llu "
+                    "path_bytes=%llu reserved=%llu\n",
+              files, dirs, symlinks,
+              (unsigned long long)ps.strings,
+              (unsigned long long)ps.used,
+              (unsigned long long)ps.reserved);
+    if (s->mlog) {
+        lr_metalog_stats st;
+        metalog_get_stats(s->mlog, &st);
+        ctrl_send(conn, "metalog flushes=%llu records=%llu bytes=%llu "
+                        "log_bytes=%llu compactions=%llu\n",
+                  (unsigned long long)st.flushes,
+                  (unsigned long long)st.records,
+                  (unsigned long long)st.bytes,
+                  (unsigned long long)st.log_bytes,
+                  (unsigned long long)st.compactions);
+    } else {
+        ctrl_send(conn, "metalog disabled\n");
     }
 
-    lr_scrub_result result;
-    parity_scrub(s, &result, repair);
+    if (s->fdcache) {
+        lr_fdcache_stats st;
+        fdcache_get_stats(s->fdcache, &st);
+        ctrl_send(conn, "fdcache hits=%llu misses=%llu evictions=%llu "
+                        "open=%u capacity=%u\n",
+                  (unsigned long long)st.hits,
+                  (unsigned long long)st.misses,
+                  (unsigned long long)st.evictions,
+                  st.open, st.capacity);
+    } else {
+        ctrl_send(conn, "fdcache disabled\n");
+    }
+    if (s->journal) {
+        lr_journal_stats st;
+        journal_get_stats(s->journal, &st);
+        ctrl_send(conn, "journal dirty=%llu draining=%llu deltas=%llu "
+                        "backlog_bytes=%llu age_ms=%llu drains=%llu "
+                        "throttled=%llu throttled_ms=%llu\n",
+                  (unsigned long long)st.dirty,
+                  (unsigned long long)st.draining,
+                  (unsigned long long)st.deltas,
+                  (unsigned long long)st.backlog_bytes,
+                  (unsigned long long)st.age_ms,
+                  (unsigned long long)st.drains,
+                  (unsigned long long)st.throttled,
+                  (unsigned long long)st.throttled_ms);
+    } else {
+        ctrl_send(conn, "journal disabled\n");
+    }
+    if (s->journal && s->journal->wal) {
+        lr_wal_stats st;
+        wal_get_stats(s->journal->wal, &st);
+        ctrl_send(conn, "wal commits=%llu records=%llu log_bytes=%llu "
+                        "checkpoints=%llu failures=%llu\n",
+                  (unsigned long long)st.commits,
+                  (unsigned long long)st.records,
+                  (unsigned long long)st.log_bytes,
+                  (unsigned long long)st.checkpoints,
+                  (unsigned long long)st.failures);
+    } else {
+        ctrl_send(conn, "wal disabled\n");
+    }
+    if (s->journal && s->journal->pool) {
+        lr_pool_stats st;
+        pool_get_stats(s->journal->pool, &st);
+        ctrl_send(conn, "pool threads=%u runs=%llu chunks=%llu steals=%llu\n",
+                  st.threads,
+                  (unsigned long long)st.runs,
+                  (unsigned long long)st.chunks,
+                  (unsigned long long)st.steals);
+    } else {
+        ctrl_send(conn, "pool serial\n");
+    }
+    if (s->parity) {
+        uint64_t hits, misses;
+        parity_decode_stats(s->parity, &hits, &misses);
+        ctrl_send(conn, "parity code=%s kernel=%s punched=%llu shards=%u "
+                        "direct=%d\n",
+                  parity_code_name(s->parity), parity_kernel_name(s->parity),
+                  (unsigned long long)parity_punched(s->parity),
+                  parity_shard_groups(s->parity), s->parity->direct);
+        ctrl_send(conn, "decode hits=%llu misses=%llu\n",
+                  (unsigned long long)hits, (unsigned long long)misses);
+    }
+    if (s->rcache) {
+        lr_rcache_stats st;
+        rcache_get_stats(s->rcache, &st);
+        ctrl_send(conn, "degraded hits=%llu misses=%llu evictions=%llu "
+                        "prefetched=%llu blocks=%u capacity=%u\n",
+                  (unsigned long long)st.hits,
+                  (unsigned long long)st.misses,
+                  (unsigned long long)st.evictions,
+                  (unsigned long long)st.prefetched,
+                  st.blocks, st.capacity);
+    } else {
+        ctrl_send(conn, "degraded disabled\n");
+    }
+    if (s->scrub) {
+        lr_scrub_status st;
+        scrub_get_status(s->scrub, &st);
+        if (st.active)
+            ctrl_send(conn, "scrub running repair=%d pos=%u start=%u end=%u "
+                            "checked=%u mismatches=%u fixed=%u errors=%u "
+                            "daily=%u roll=%u passes=%llu\n",
+                      st.repair, st.cursor, st.start, st.end,
+                      st.result.positions_checked,
+                      st.result.parity_mismatches,
+                      st.result.parity_fixed,
+                      st.result.read_errors,
+                      st.daily_pct, st.roll_cursor,
+                      (unsigned long long)st.passes);
+        else
+            ctrl_send(conn, "scrub idle daily=%u roll=%u passes=%llu\n",
+                      st.daily_pct, st.roll_cursor,
+                      (unsigned long long)st.passes);
+    } else {
+        ctrl_send(conn, "scrub inline\n");
+    }
 
-    if (repair)
-        ctrl_send(conn, "done %u %u fixed=%u errors=%u\n",
-                  result.positions_checked,
-                  result.parity_mismatches,
-                  result.parity_fixed,
-                  result.read_errors);
+    if (s->compact) {
+        lr_compact_status st;
+        compact_get_status(s->compact, &st);
+        if (st.active)
+            ctrl_send(conn, "compact running drive=%s moved=%u blocks=%llu "
+                            "busy=%u limit=%u passes=%llu\n",
+                      st.cur_drive < s->drive_count
+                          ? s->drives[st.cur_drive].name : "-",
+                      st.result.files_moved,
+                      (unsigned long long)st.result.blocks_moved,
+                      st.result.files_busy, st.result.limit_after,
+                      (unsigned long long)st.passes);
+        else
+            ctrl_send(conn, "compact idle passes=%llu\n",
+                      (unsigned long long)st.passes);
+    } else {
+        ctrl_send(conn, "compact unavailable\n");
+    }
+
+    if (s->mover) {
+        lr_mover_stats st;
+        mover_get_stats(s->mover, &st);
+        ctrl_send(conn, "mover %s pending=%u pending_bytes=%llu moved=%llu "
+                        "moved_bytes=%llu raced=%llu failures=%llu "
+                        "passes=%llu\n",
+                  st.active ? "running" : "idle", st.pending,
+                  (unsigned long long)st.pending_bytes,
+                  (unsigned long long)st.files_moved,
+                  (unsigned long long)st.bytes_moved,
+                  (unsigned long long)st.raced,
+                  (unsigned long long)st.failures,
+                  (unsigned long long)st.passes);
+    } else {
+        ctrl_send(conn, "mover disabled\n");
+    }
+
+    lr_rebuild_progress rp;
+    if (rebuild_progress(c, &rp))
+        ctrl_send(conn, "rebuild running done_bytes=%llu total_bytes=%llu "
+                        "bps=%llu eta=%lld\n",
+                  (unsigned long long)rp.done_bytes,
+                  (unsigned long long)rp.total_bytes,
+                  (unsigned long long)rp.bytes_per_sec,
+                  rp.eta_sec == UINT64_MAX ? -1LL : (long long)rp.eta_sec);
     else
-        ctrl_send(conn, "done %u %u errors=%u\n",
-                  result.positions_checked,
-                  result.parity_mismatches,
-                  result.read_errors);
+        ctrl_send(conn, "rebuild idle\n");
+
+    send_metrics(c, conn, 0);
+    ctrl_send(conn, "done\n");
+}
+
+/*--------------------------------------------------------------------
+ * "stats prom": the same counters in the Prometheus text format, for a
+ * node_exporter textfile collector or a scrape proxy.  Ends with "# EOF".
+ *------------------------------------------------------------------*/
+#define PROM_GAUGE(name, help, val)                                        \
+    ctrl_send(conn, "# HELP liveraid_" name " " help "\n"                  \
+                    "# TYPE liveraid_" name " gauge\n"                     \
+                    "liveraid_" name " %llu\n", (unsigned long long)(val))
+#define PROM_COUNTER(name, help, val)                                      \
+    ctrl_send(conn, "# HELP liveraid_" name " " help "\n"                  \
+                    "# TYPE liveraid_" name " counter\n"                   \
+                    "liveraid_" name " %llu\n", (unsigned long long)(val))
+
+static void live_do_prom(lr_ctrl *c, int conn)
+{
+    lr_state *s = c->state;
+
+    state_rdlock(s);
+    unsigned files    = s->file_list.count;
+    unsigned dirs     = s->dir_list.count;
+    unsigned symlinks = s->symlink_list.count;
+    state_unlock(s);
+    PROM_GAUGE("files", "Regular files.", files);
+    PROM_GAUGE("dirs", "Directories.", dirs);
+    PROM_GAUGE("symlinks", "Symbolic links.", symlinks);
+
+    if (s->journal) {
+        lr_journal_stats st;
+        journal_get_stats(s->journal, &st);
+        PROM_GAUGE("journal_dirty_positions",
+                   "Positions waiting for a parity drain.", st.dirty);
+        PROM_GAUGE("journal_backlog_bytes",
+                   "Parity work waiting for a drain, in bytes per drive.",
+                   st.backlog_bytes);
+        PROM_GAUGE("journal_age_seconds", "Age of the oldest dirty position.",
+                   st.age_ms / 1000);
+        PROM_COUNTER("journal_throttled_total",
+                     "Writes delayed by the backlog limit.", st.throttled);
+    }
+    if (s->journal && s->journal->wal) {
+        lr_wal_stats st;
+        wal_get_stats(s->journal->wal, &st);
+        PROM_COUNTER("wal_commits_total",
+                     "Dirty-range log batches committed.", st.commits);
+        PROM_GAUGE("wal_log_bytes", "Size of the dirty-range log.",
+                   st.log_bytes);
+        PROM_COUNTER("wal_failures_total",
+                     "Dirty-range log writes that failed.", st.failures);
+    }
+    if (s->fdcache) {
+        lr_fdcache_stats st;
+        fdcache_get_stats(s->fdcache, &st);
+        PROM_COUNTER("fdcache_hits_total", "Descriptor cache hits.", st.hits);
+        PROM_COUNTER("fdcache_misses_total", "Descriptor cache misses.",
+                     st.misses);
+        PROM_GAUGE("fdcache_open", "Descriptors held open.", st.open);
+    }
+    if (s->parity) {
+        uint64_t hits, misses;
+        parity_decode_stats(s->parity, &hits, &misses);
+        PROM_COUNTER("decode_hits_total", "Recovery matrix cache hits.", hits);
+        PROM_COUNTER("decode_misses_total", "Recovery matrix cache misses.",
+                     misses);
+        PROM_COUNTER("parity_punched_total",
+                     "Parity positions released with a hole punch.",
+                     parity_punched(s->parity));
+    }
+    if (s->rcache) {
+        lr_rcache_stats st;
+        rcache_get_stats(s->rcache, &st);
+        PROM_COUNTER("degraded_hits_total", "Degraded read cache hits.",
+                     st.hits);
+        PROM_COUNTER("degraded_misses_total", "Degraded read cache misses.",
+                     st.misses);
+    }
+    if (s->scrub) {
+        lr_scrub_status st;
+        scrub_get_status(s->scrub, &st);
+        PROM_GAUGE("scrub_running", "1 while a scrub pass runs.", st.active);
+        PROM_GAUGE("scrub_position", "Next position the scrub checks.",
+                   st.active ? st.cursor : st.roll_cursor);
+        PROM_GAUGE("scrub_end", "End of the running scrub pass.",
+                   st.active ? st.end : 0);
+        PROM_GAUGE("scrub_checked", "Positions checked by the running pass.",
+                   st.active ? st.result.positions_checked : 0);
+        PROM_GAUGE("scrub_mismatches",
+                   "Parity mismatches found by the running pass.",
+                   st.active ? st.result.parity_mismatches : 0);
+        PROM_COUNTER("scrub_passes_total", "Completed scrub passes.",
+                     st.passes);
+    }
+
+    if (s->compact) {
+        lr_compact_status st;
+        compact_get_status(s->compact, &st);
+        PROM_GAUGE("compact_running", "1 while a compaction pass runs.",
+                   st.active);
+        PROM_GAUGE("compact_files_moved",
+                   "Files moved by the running compaction pass.",
+                   st.active ? st.result.files_moved : 0);
+        PROM_COUNTER("compact_passes_total", "Completed compaction passes.",
+                     st.passes);
+    }
+
+    if (s->mover) {
+        lr_mover_stats st;
+        mover_get_stats(s->mover, &st);
+        PROM_GAUGE("mover_pending_files", "Files on the cache drive.",
+                   st.pending);
+        PROM_GAUGE("mover_pending_bytes", "Bytes of files on the cache drive.",
+                   st.pending_bytes);
+        PROM_COUNTER("mover_files_moved_total",
+                     "Files moved from the cache to the data drives.",
+                     st.files_moved);
+        PROM_COUNTER("mover_bytes_moved_total",
+                     "Bytes moved from the cache to the data drives.",
+                     st.bytes_moved);
+        PROM_COUNTER("mover_raced_total",
+                     "Moves abandoned because the file changed meanwhile.",
+                     st.raced);
+        PROM_COUNTER("mover_failures_total", "Moves that failed.",
+                     st.failures);
+    }
+
+    lr_rebuild_progress rp;
+    memset(&rp, 0, sizeof(rp));
+    int rebuilding = rebuild_progress(c, &rp);
+    PROM_GAUGE("rebuild_running", "1 while a live rebuild runs.", rebuilding);
+    PROM_GAUGE("rebuild_done_bytes", "Bytes the live rebuild has written.",
+               rp.done_bytes);
+    PROM_GAUGE("rebuild_total_bytes", "Bytes the live rebuild will write.",
+               rp.total_bytes);
+    PROM_GAUGE("rebuild_bytes_per_second", "Average live rebuild rate.",
+               rp.bytes_per_sec);
+
+    send_metrics(c, conn, 1);
+    ctrl_send(conn, "# EOF\n");
 }
 
 /*--------------------------------------------------------------------
@@ -301,17 +873,47 @@ static void handle_connection(lr_ctrl *c, int conn)
 
     if (strncmp(line, "rebuild ", 8) == 0)
         live_do_rebuild(c, conn, line + 8);
-    else if (strcmp(line, "scrub repair") == 0)
-        live_do_scrub(c, conn, 1);
-    else if (strcmp(line, "scrub") == 0)
-        live_do_scrub(c, conn, 0);
+    else if (strcmp(line, "scrub") == 0 || strncmp(line, "scrub ", 6) == 0)
+        live_do_scrub(c, conn, line + 5);
+    else if (strcmp(line, "compact") == 0 || strncmp(line, "compact ", 8) == 0)
+        live_do_compact(c, conn, line + 7);
+    else if (strcmp(line, "migrate") == 0 || strncmp(line, "migrate ", 8) == 0)
+        live_do_migrate(c, conn, line + 7);
+    else if (strcmp(line, "stats") == 0)
+        live_do_stats(c, conn);
+    else if (strcmp(line, "stats prom") == 0)
+        live_do_prom(c, conn);
     else
         ctrl_send(conn, "error unknown command\n");
 }
 
 /*--------------------------------------------------------------------
- * Accept thread
+ * Connection threads: one per client, detached; ctrl_stop waits for
+ * c->active to drop to zero.
  *------------------------------------------------------------------*/
+typedef struct {
+    lr_ctrl *c;
+    int      conn;
+} ctrl_conn;
+
+static void conn_done(lr_ctrl *c, int conn)
+{
+    close(conn);
+    pthread_mutex_lock(&c->lock);
+    if (--c->active == 0)
+        pthread_cond_broadcast(&c->idle);
+    pthread_mutex_unlock(&c->lock);
+}
+
+static void *conn_thread(void *arg)
+{
+    ctrl_conn cc = *(ctrl_conn *)arg;
+    free(arg);
+    handle_connection(cc.c, cc.conn);
+    conn_done(cc.c, cc.conn);
+    return NULL;
+}
+
 static void *ctrl_thread(void *arg)
 {
     lr_ctrl *c = (lr_ctrl *)arg;
@@ -325,8 +927,27 @@ static void *ctrl_thread(void *arg)
                 continue;
             break;
         }
-        handle_connection(c, conn);
-        close(conn);
+
+        pthread_mutex_lock(&c->lock);
+        c->active++;
+        pthread_mutex_unlock(&c->lock);
+
+        ctrl_conn     *cc = malloc(sizeof(*cc));
+        pthread_t      th;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (cc) {
+            cc->c    = c;
+            cc->conn = conn;
+        }
+        if (!cc || pthread_create(&th, &attr, conn_thread, cc) != 0) {
+            /* No thread: serve it here, as before */
+            free(cc);
+            handle_connection(c, conn);
+            conn_done(c, conn);
+        }
+        pthread_attr_destroy(&attr);
     }
     return NULL;
 }
@@ -337,9 +958,14 @@ static void *ctrl_thread(void *arg)
 
 int ctrl_start(lr_ctrl *c, struct lr_state *s)
 {
-    c->state   = s;
-    c->running = 1;
-    c->sock_fd = -1;
+    c->state      = s;
+    c->running    = 1;
+    c->sock_fd    = -1;
+    c->active     = 0;
+    c->rebuilding = 0;
+    c->rebuild    = NULL;
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->idle, NULL);
 
     if (s->cfg.content_count == 0)
         return -1;
@@ -391,4 +1017,17 @@ void ctrl_stop(lr_ctrl *c)
 
     pthread_join(c->thread, NULL);
     unlink(c->sock_path);
+
+    /* A rebuild or scrub still streaming keeps its client until it ends;
+     * a compaction or migration pass is stopped after its current move */
+    if (c->state->compact)
+        compact_stop(c->state->compact);
+    if (c->state->mover)
+        mover_stop(c->state->mover);
+    pthread_mutex_lock(&c->lock);
+    while (c->active > 0)
+        pthread_cond_wait(&c->idle, &c->lock);
+    pthread_mutex_unlock(&c->lock);
+    pthread_cond_destroy(&c->idle);
+    pthread_mutex_destroy(&c->lock);
 }
@@ -6,6 +6,7 @@
 
 /* Forward declaration; state.h is included by ctrl.c which needs full type */
 struct lr_state;
+struct lr_rebuild;
 
 /*--------------------------------------------------------------------
  * Control server: Unix domain socket listener for live rebuild.
@@ -18,6 +19,14 @@ typedef struct lr_ctrl {
     int              running;
     struct lr_state *state;
     char             sock_path[PATH_MAX + 8];
+
+    /* Each connection runs on its own thread, so "stats" answers while a
+     * rebuild or scrub streams progress to another client */
+    pthread_mutex_t     lock;
+    pthread_cond_t      idle;        /* active dropped to 0 */
+    unsigned            active;      /* connection threads running */
+    int                 rebuilding;  /* a live rebuild owns the engine */
+    struct lr_rebuild  *rebuild;     /* its engine once started, for stats */
 } lr_ctrl;
 
 /*
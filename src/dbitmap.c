@@ -0,0 +1,210 @@
+#include "dbitmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LOAD(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define OR(p, v)     __atomic_fetch_or((p), (v), __ATOMIC_SEQ_CST)
+#define XCHG(p, v)   __atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+
+/* ------------------------------------------------------------------ */
+/* Pages                                                                */
+/* ------------------------------------------------------------------ */
+
+/* Page p, installing a zeroed one if there is none.  Losing the install
+ * race costs a calloc/free; the winner's page is used. */
+static lr_dbm_page *page_get(lr_dbitmap *b, uint32_t p)
+{
+    lr_dbm_page *pg = LOAD(&b->pages[p]);
+    if (pg)
+        return pg;
+
+    lr_dbm_page *fresh = calloc(1, sizeof(*fresh));
+    if (!fresh)
+        return NULL;
+    if (__atomic_compare_exchange_n(&b->pages[p], &pg, fresh, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        __atomic_add_fetch(&b->npages, 1, __ATOMIC_RELAXED);
+        return fresh;
+    }
+    free(fresh);
+    return pg;
+}
+
+/* ------------------------------------------------------------------ */
+/* Lifecycle                                                            */
+/* ------------------------------------------------------------------ */
+
+int dbitmap_init(lr_dbitmap *b, uint32_t positions)
+{
+    memset(b, 0, sizeof(*b));
+    uint32_t n = (uint32_t)(((uint64_t)positions + LR_DBM_PAGE_BITS - 1)
+                            >> LR_DBM_PAGE_SHIFT);
+    for (uint32_t p = 0; p < n; p++)
+        if (!page_get(b, p))
+            return -1;
+    return 0;
+}
+
+void dbitmap_done(lr_dbitmap *b)
+{
+    for (uint32_t p = 0; p < LR_DBM_PAGES; p++)
+        free(b->pages[p]);
+    memset(b, 0, sizeof(*b));
+}
+
+/* ------------------------------------------------------------------ */
+/* Set / test                                                           */
+/* ------------------------------------------------------------------ */
+
+int dbitmap_or_word(lr_dbitmap *b, uint32_t word, uint64_t bits)
+{
+    if (!bits)
+        return 0;
+
+    uint32_t     p  = word / LR_DBM_PAGE_WORDS;
+    uint32_t     w  = word % LR_DBM_PAGE_WORDS;
+    lr_dbm_page *pg = page_get(b, p);
+    if (!pg)
+        return -1;
+
+    /* Bottom-up: a summary bit is only needed when the word was empty */
+    uint64_t old   = OR(&pg->words[w], bits);
+    uint64_t added = bits & ~old;
+    if (added)
+        __atomic_add_fetch(&b->count, __builtin_popcountll(added),
+                           __ATOMIC_SEQ_CST);
+    if (old == 0 &&
+        OR(&pg->summary[w / 64], (uint64_t)1 << (w % 64)) == 0)
+        OR(&b->top[p / 64], (uint64_t)1 << (p % 64));
+    return 0;
+}
+
+int dbitmap_set_range(lr_dbitmap *b, uint32_t start, uint32_t count)
+{
+    int      rc  = 0;
+    uint64_t pos = start;
+    uint64_t end = (uint64_t)start + count;
+
+    while (pos < end) {
+        uint32_t bit  = (uint32_t)(pos % 64);
+        uint64_t n    = end - pos < 64 - bit ? end - pos : 64 - bit;
+        uint64_t mask = n == 64 ? ~(uint64_t)0
+                                : (((uint64_t)1 << n) - 1) << bit;
+        if (dbitmap_or_word(b, (uint32_t)(pos / 64), mask) != 0)
+            rc = -1;
+        pos += n;
+    }
+    return rc;
+}
+
+int dbitmap_test(const lr_dbitmap *b, uint32_t pos)
+{
+    const lr_dbm_page *pg = LOAD(&b->pages[pos >> LR_DBM_PAGE_SHIFT]);
+    if (!pg)
+        return 0;
+    uint32_t w = (pos % LR_DBM_PAGE_BITS) / 64;
+    return (LOAD(&pg->words[w]) >> (pos % 64)) & 1;
+}
+
+uint64_t dbitmap_word(const lr_dbitmap *b, uint32_t word)
+{
+    const lr_dbm_page *pg = LOAD(&b->pages[word / LR_DBM_PAGE_WORDS]);
+    return pg ? LOAD(&pg->words[word % LR_DBM_PAGE_WORDS]) : 0;
+}
+
+uint64_t dbitmap_clear_word(lr_dbitmap *b, uint32_t word, uint64_t mask)
+{
+    lr_dbm_page *pg = LOAD(&b->pages[word / LR_DBM_PAGE_WORDS]);
+    if (!pg || !mask)
+        return 0;
+    uint64_t old  = __atomic_fetch_and(&pg->words[word % LR_DBM_PAGE_WORDS],
+                                       ~mask, __ATOMIC_SEQ_CST);
+    uint64_t bits = old & mask;
+    if (bits)
+        __atomic_sub_fetch(&b->count, __builtin_popcountll(bits),
+                           __ATOMIC_SEQ_CST);
+    return bits;
+}
+
+/* ------------------------------------------------------------------ */
+/* Iteration                                                            */
+/* ------------------------------------------------------------------ */
+
+uint64_t dbitmap_next_word(const lr_dbitmap *b, uint32_t *word)
+{
+    const uint64_t limit = (uint64_t)LR_DBM_PAGES * LR_DBM_PAGE_WORDS;
+    uint64_t       w     = *word;
+
+    while (w < limit) {
+        uint32_t p   = (uint32_t)(w / LR_DBM_PAGE_WORDS);
+        uint64_t top = LOAD(&b->top[p / 64]) >> (p % 64);
+        if (!top) {
+            w = (uint64_t)(p / 64 + 1) * 64 * LR_DBM_PAGE_WORDS;
+            continue;
+        }
+        p += (uint32_t)__builtin_ctzll(top);
+        if ((uint64_t)p * LR_DBM_PAGE_WORDS > w)
+            w = (uint64_t)p * LR_DBM_PAGE_WORDS;
+
+        const lr_dbm_page *pg = LOAD(&b->pages[p]);
+        uint32_t           i  = (uint32_t)(w % LR_DBM_PAGE_WORDS);
+        while (pg && i < LR_DBM_PAGE_WORDS) {
+            uint64_t sum = LOAD(&pg->summary[i / 64]) >> (i % 64);
+            if (!sum) {
+                i = (i / 64 + 1) * 64;
+                continue;
+            }
+            i += (uint32_t)__builtin_ctzll(sum);
+            uint64_t bits = LOAD(&pg->words[i]);
+            if (bits) {
+                *word = p * LR_DBM_PAGE_WORDS + i;
+                return bits;
+            }
+            i++;   /* stale summary bit */
+        }
+        w = (uint64_t)(p + 1) * LR_DBM_PAGE_WORDS;
+    }
+    return 0;
+}
+
+uint64_t dbitmap_take(lr_dbitmap *src, lr_dbitmap *dst)
+{
+    uint64_t taken = 0;
+
+    /* Top-down, so a concurrent setter re-marks whatever it adds behind us */
+    for (uint32_t t = 0; t < LR_DBM_PAGES / 64; t++) {
+        if (!LOAD(&src->top[t]))
+            continue;
+        uint64_t pages = XCHG(&src->top[t], 0);
+        while (pages) {
+            uint32_t p = t * 64 + (uint32_t)__builtin_ctzll(pages);
+            pages &= pages - 1;
+            lr_dbm_page *pg = LOAD(&src->pages[p]);
+            if (!pg)
+                continue;
+            for (uint32_t s = 0; s < LR_DBM_PAGE_WORDS / 64; s++) {
+                if (!LOAD(&pg->summary[s]))
+                    continue;
+                uint64_t sum = XCHG(&pg->summary[s], 0);
+                while (sum) {
+                    uint32_t i = s * 64 + (uint32_t)__builtin_ctzll(sum);
+                    sum &= sum - 1;
+                    uint64_t bits = XCHG(&pg->words[i], 0);
+                    if (!bits)
+                        continue;
+                    uint32_t word = p * LR_DBM_PAGE_WORDS + i;
+                    __atomic_sub_fetch(&src->count, __builtin_popcountll(bits),
+                                       __ATOMIC_SEQ_CST);
+                    if (dst && dbitmap_or_word(dst, word, bits) != 0) {
+                        /* No page in dst: put the bits back */
+                        dbitmap_or_word(src, word, bits);
+                        continue;
+                    }
+                    taken += (uint64_t)__builtin_popcountll(bits);
+                }
+            }
+        }
+    }
+    return taken;
+}
@@ -0,0 +1,83 @@
+#ifndef LR_DBITMAP_H
+#define LR_DBITMAP_H
+
+#include <stdint.h>
+
+/*
+ * Hierarchical dirty-position bitmap.
+ *
+ * One bit per parity position over the whole 32-bit position space,
+ * split into pages of LR_DBM_PAGE_BITS positions.  Each page keeps a
+ * summary word per 64 bitmap words (bit i = word i is non-zero) and the
+ * bitmap keeps a top bit per page, so finding the set bits and checking
+ * for emptiness cost O(dirty), not O(capacity).
+ *
+ * Setting, testing and taking bits are lock-free.  Pages are installed
+ * with a compare-and-swap the first time a position in them is set and
+ * stay until dbitmap_done, so the structure never moves under a setter;
+ * dbitmap_init preallocates the pages covering the positions in use.
+ *
+ * Setters go bottom-up (word, then summary, then top) and dbitmap_take
+ * clears top-down (top, summary, word), so a bit set while its word is
+ * being taken is either taken or left with its summary bits set.  A
+ * summary bit may briefly point at an empty word; readers skip it.
+ */
+
+#define LR_DBM_PAGE_SHIFT 18u                          /* 256 Ki positions */
+#define LR_DBM_PAGE_BITS  (1u << LR_DBM_PAGE_SHIFT)
+#define LR_DBM_PAGE_WORDS (LR_DBM_PAGE_BITS / 64)      /* 4096 */
+#define LR_DBM_PAGES      (1u << (32 - LR_DBM_PAGE_SHIFT))
+
+typedef struct {
+    uint64_t summary[LR_DBM_PAGE_WORDS / 64];  /* bit per non-zero word */
+    uint64_t words[LR_DBM_PAGE_WORDS];
+} lr_dbm_page;
+
+typedef struct lr_dbitmap {
+    lr_dbm_page *pages[LR_DBM_PAGES];  /* NULL until first set */
+    uint64_t     top[LR_DBM_PAGES / 64];
+    int64_t      count;   /* set bits; may lag a concurrent set or take */
+    uint32_t     npages;  /* pages installed */
+} lr_dbitmap;
+
+/* Preallocate the pages for positions [0, positions).  Returns 0, or -1
+ * on OOM (the bitmap is still usable; pages come on demand). */
+int  dbitmap_init(lr_dbitmap *b, uint32_t positions);
+void dbitmap_done(lr_dbitmap *b);
+
+/* Set [start, start+count), word at a time.  Returns 0, or -1 if a page
+ * could not be allocated (its positions stay clear). */
+int  dbitmap_set_range(lr_dbitmap *b, uint32_t start, uint32_t count);
+
+/* OR bits into word index `word` (bit i = position word*64 + i). */
+int  dbitmap_or_word(lr_dbitmap *b, uint32_t word, uint64_t bits);
+
+int  dbitmap_test(const lr_dbitmap *b, uint32_t pos);
+
+/* Bits of word index `word` (0 if its page is not installed). */
+uint64_t dbitmap_word(const lr_dbitmap *b, uint32_t word);
+
+/* Clear the bits of `mask` in word index `word` and return those that
+ * were set.  Summary bits are left for dbitmap_take to clear. */
+uint64_t dbitmap_clear_word(lr_dbitmap *b, uint32_t word, uint64_t mask);
+
+static inline int dbitmap_empty(const lr_dbitmap *b)
+{
+    return __atomic_load_n(&b->count, __ATOMIC_SEQ_CST) <= 0;
+}
+
+static inline uint64_t dbitmap_count(const lr_dbitmap *b)
+{
+    int64_t n = __atomic_load_n(&b->count, __ATOMIC_SEQ_CST);
+    return n > 0 ? (uint64_t)n : 0;
+}
+
+/* First non-zero word at index >= *word: stores its index in *word and
+ * returns its bits, or 0 when there is none. */
+uint64_t dbitmap_next_word(const lr_dbitmap *b, uint32_t *word);
+
+/* Clear every set bit of src and OR it into dst (NULL = discard).  dst
+ * must not be changed by anyone else meanwhile.  Returns the bits taken. */
+uint64_t dbitmap_take(lr_dbitmap *src, lr_dbitmap *dst);
+
+#endif /* LR_DBITMAP_H */
@@ -0,0 +1,162 @@
+#include "fdcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* ------------------------------------------------------------------ */
+/* Helpers                                                              */
+/* ------------------------------------------------------------------ */
+
+static inline uint32_t key_hash(const void *key)
+{
+    uint64_t k = (uint64_t)(uintptr_t)key;
+    return (uint32_t)((k >> 4) ^ (k >> 32)) * 2654435761u;
+}
+
+static int key_cmp(const void *arg, const void *obj)
+{
+    return ((const lr_fdent *)obj)->key != arg;
+}
+
+static void ent_free(lr_fdent *e)
+{
+    if (e->fd >= 0)
+        close(e->fd);
+    free(e->path);
+    free(e);
+}
+
+/* Unlink a live entry from table and LRU; close it now if unpinned.
+ * Caller holds c->lock. */
+static void ent_retire(lr_fdcache *c, lr_fdent *e)
+{
+    lr_hash_remove(&c->table, &e->hash_node);
+    lr_list_remove(&c->lru, &e->lru_node);
+    e->dead = 1;
+    if (e->refs == 0)
+        ent_free(e);
+}
+
+/* ------------------------------------------------------------------ */
+/* Public API                                                           */
+/* ------------------------------------------------------------------ */
+
+int fdcache_init(lr_fdcache *c, unsigned capacity)
+{
+    memset(c, 0, sizeof(*c));
+    c->capacity = capacity;
+    lr_hash_init(&c->table);
+    lr_list_init(&c->lru);
+    if (pthread_mutex_init(&c->lock, NULL) != 0) {
+        lr_hash_done(&c->table);
+        return -1;
+    }
+    return 0;
+}
+
+void fdcache_done(lr_fdcache *c)
+{
+    lr_list_node *n = lr_list_head(&c->lru);
+    while (n) {
+        lr_fdent *e = (lr_fdent *)n->data;
+        n = n->next;
+        ent_free(e);
+    }
+    lr_hash_done(&c->table);
+    pthread_mutex_destroy(&c->lock);
+    memset(c, 0, sizeof(*c));
+}
+
+lr_fdent *fdcache_get(lr_fdcache *c, const void *key, const char *path)
+{
+    pthread_mutex_lock(&c->lock);
+
+    lr_fdent *e = lr_hash_search(&c->table, key_hash(key), key_cmp, key);
+    if (e && strcmp(e->path, path) == 0) {
+        /* Hit: move to the most-recent end */
+        lr_list_remove(&c->lru, &e->lru_node);
+        lr_list_insert_tail(&c->lru, &e->lru_node, e);
+        e->refs++;
+        c->hits++;
+        pthread_mutex_unlock(&c->lock);
+        return e;
+    }
+    if (e)
+        ent_retire(c, e);   /* same key, different file */
+    c->misses++;
+    pthread_mutex_unlock(&c->lock);
+
+    /* Open outside the lock: a slow drive must not stall other readers */
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    e = calloc(1, sizeof(*e));
+    if (e)
+        e->path = strdup(path);
+    if (!e || !e->path) {
+        free(e);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    e->key  = key;
+    e->fd   = fd;
+    e->refs = 1;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->capacity == 0) {
+        e->dead = 1;        /* uncached: closed by fdcache_put */
+        pthread_mutex_unlock(&c->lock);
+        return e;
+    }
+
+    /* Another thread may have cached the same key while we were opening */
+    lr_fdent *other = lr_hash_search(&c->table, key_hash(key), key_cmp, key);
+    if (other)
+        ent_retire(c, other);
+
+    while (c->lru.count >= c->capacity) {
+        lr_fdent *victim = (lr_fdent *)lr_list_head(&c->lru)->data;
+        ent_retire(c, victim);
+        c->evictions++;
+    }
+
+    lr_hash_insert(&c->table, &e->hash_node, e, key_hash(key));
+    lr_list_insert_tail(&c->lru, &e->lru_node, e);
+    pthread_mutex_unlock(&c->lock);
+    return e;
+}
+
+void fdcache_put(lr_fdcache *c, lr_fdent *e)
+{
+    if (!e)
+        return;
+    pthread_mutex_lock(&c->lock);
+    if (--e->refs == 0 && e->dead)
+        ent_free(e);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void fdcache_invalidate(lr_fdcache *c, const void *key)
+{
+    pthread_mutex_lock(&c->lock);
+    lr_fdent *e = lr_hash_search(&c->table, key_hash(key), key_cmp, key);
+    if (e)
+        ent_retire(c, e);
+    pthread_mutex_unlock(&c->lock);
+}
+
+void fdcache_get_stats(lr_fdcache *c, lr_fdcache_stats *st)
+{
+    pthread_mutex_lock(&c->lock);
+    st->hits      = c->hits;
+    st->misses    = c->misses;
+    st->evictions = c->evictions;
+    st->open      = c->lru.count;
+    st->capacity  = c->capacity;
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,77 @@
+#ifndef LR_FDCACHE_H
+#define LR_FDCACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "lr_hash.h"
+#include "lr_list.h"
+
+/*
+ * Bounded LRU cache of read-only data-file descriptors.
+ *
+ * The parity worker, recovery and scrub read one block per drive per
+ * position; without a cache every block costs an open/pread/close.
+ * Entries are keyed by an opaque pointer (the lr_file*) and remember the
+ * path they were opened with: a lookup whose path differs from the cached
+ * one (rename, or a freed lr_file reused at the same address) reopens.
+ *
+ * fdcache_get pins the entry; the fd stays open until fdcache_put even if
+ * the entry is evicted or invalidated meanwhile, so readers on different
+ * threads never see an fd closed under them.  Callers that free or
+ * replace the file behind a key must call fdcache_invalidate.
+ */
+
+#define LR_FDCACHE_DEFAULT 256   /* default capacity (open descriptors) */
+
+typedef struct lr_fdent {
+    const void   *key;
+    char         *path;       /* strdup'd path the fd was opened from */
+    int           fd;
+    unsigned      refs;       /* pins held by fdcache_get callers */
+    int           dead;       /* evicted/invalidated; close on last put */
+
+    lr_hash_node  hash_node;  /* live entries only */
+    lr_list_node  lru_node;   /* live entries only; head = least recent */
+} lr_fdent;
+
+typedef struct lr_fdcache {
+    pthread_mutex_t lock;
+    lr_hash         table;     /* key → lr_fdent* */
+    lr_list         lru;
+    unsigned        capacity;  /* max live entries; 0 = caching disabled */
+
+    /* Counters (guarded by lock) */
+    uint64_t        hits;
+    uint64_t        misses;
+    uint64_t        evictions;
+} lr_fdcache;
+
+int  fdcache_init(lr_fdcache *c, unsigned capacity);
+void fdcache_done(lr_fdcache *c);
+
+/*
+ * Return a pinned entry for key whose fd is `path` opened O_RDONLY,
+ * opening it on a miss.  Returns NULL (errno set) if open fails.
+ * With capacity 0 the entry is private and closed by fdcache_put.
+ */
+lr_fdent *fdcache_get(lr_fdcache *c, const void *key, const char *path);
+
+/* Release a pin taken by fdcache_get. */
+void fdcache_put(lr_fdcache *c, lr_fdent *e);
+
+/* Drop the entry for key (its fd closes once no longer pinned). */
+void fdcache_invalidate(lr_fdcache *c, const void *key);
+
+/* Snapshot of the counters and current number of live entries. */
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    unsigned open;
+    unsigned capacity;
+} lr_fdcache_stats;
+
+void fdcache_get_stats(lr_fdcache *c, lr_fdcache_stats *st);
+
+#endif /* LR_FDCACHE_H */
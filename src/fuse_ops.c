@@ -4,9 +4,16 @@
 #include "fuse_ops.h"
 #include "state.h"
 #include "metadata.h"
+#include "metalog.h"
 #include "journal.h"
 #include "parity.h"
 #include "ctrl.h"
+#include "fdcache.h"
+#include "io.h"
+#include "rcache.h"
+#include "scrub.h"
+#include "compact.h"
+#include "mover.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -23,9 +30,35 @@
  * fd == -1 means the real drive is unavailable; reads use parity recovery. */
 typedef struct {
     int  fd;               /* real file descriptor, or -1 for dead-drive opens */
-    char vpath[PATH_MAX];  /* vpath captured at open/create time */
+    unsigned drive;        /* drive the file was on at open (for stats) */
+
+    /* Degraded-read sequential detection (block indices within the file) */
+    pthread_mutex_t ra_lock;
+    uint32_t        ra_next;    /* block after the last degraded read */
+    uint32_t        ra_issued;  /* readahead already queued up to here */
+
+    char vpath[];          /* vpath captured at open/create time */
 } lr_fh_t;
 
+static lr_fh_t *fh_new(const char *vpath, int fd, unsigned drive)
+{
+    size_t   len = strlen(vpath);
+    lr_fh_t *fh  = calloc(1, sizeof(lr_fh_t) + len + 1);
+    if (!fh)
+        return NULL;
+    fh->fd    = fd;
+    fh->drive = drive;
+    memcpy(fh->vpath, vpath, len + 1);
+    pthread_mutex_init(&fh->ra_lock, NULL);
+    return fh;
+}
+
+static void fh_free(lr_fh_t *fh)
+{
+    pthread_mutex_destroy(&fh->ra_lock);
+    free(fh);
+}
+
 /*--------------------------------------------------------------------
  * Helper: build the real path for vpath on a given drive.
  * Works for both files and directories; vpath may be "/".
@@ -43,26 +76,13 @@ static void real_path_on_drive(lr_state *s, unsigned drive_idx,
 }
 
 /*--------------------------------------------------------------------
- * Helper: is vpath a directory prefix for any known file?
+ * Helper: is vpath a directory in the tree (holds a file or symlink
+ * somewhere below it, or has a dir_table entry)?  O(depth).
  * Caller must hold state_lock.
  *------------------------------------------------------------------*/
 static int is_virtual_dir(lr_state *s, const char *vpath)
 {
-    if (strcmp(vpath, "/") == 0)
-        return 1;
-
-    size_t vlen = strlen(vpath);
-    lr_list_node *node = lr_list_head(&s->file_list);
-    while (node) {
-        lr_file *f = (lr_file *)node->data;
-        if (strncmp(f->vpath, vpath, vlen) == 0) {
-            char c = f->vpath[vlen];
-            if (c == '/' || c == '\0')
-                return 1;
-        }
-        node = node->next;
-    }
-    return 0;
+    return state_find_dnode(s, vpath) != NULL;
 }
 
 /*--------------------------------------------------------------------
@@ -96,10 +116,10 @@ static lr_dir *dir_get_or_create(lr_state *s, const char *path)
         return d;
 
     d = calloc(1, sizeof(lr_dir));
-    if (!d)
+    if (!d || state_set_path(s, &d->vpath, path) != 0) {
+        free(d);
         return NULL;
-
-    snprintf(d->vpath, PATH_MAX, "%s", path);
+    }
 
     for (unsigned i = 0; i < s->drive_count; i++) {
         char real[PATH_MAX];
@@ -121,77 +141,6 @@ static lr_dir *dir_get_or_create(lr_state *s, const char *path)
     return d;
 }
 
-/*--------------------------------------------------------------------
- * Helper: create parent directories for real_file_path on drive_idx,
- * inheriting modes from the corresponding directory on another drive
- * when available, falling back to 0755.
- *
- * drive_dir_len is strlen(s->drives[drive_idx].dir) — used to strip
- * the drive prefix and recover the virtual path component.
- *
- * Caller must hold state_lock (at least rdlock).
- *------------------------------------------------------------------*/
-static void mkdirs_p(lr_state *s, unsigned drive_idx,
-                     const char *real_file_path)
-{
-    char tmp[PATH_MAX];
-    snprintf(tmp, sizeof(tmp), "%s", real_file_path);
-
-    char *slash = strrchr(tmp, '/');
-    if (!slash || slash == tmp)
-        return;
-    *slash = '\0'; /* tmp is now the parent directory real path */
-
-    size_t drive_dir_len = strlen(s->drives[drive_idx].dir);
-
-    /* Walk from left, creating each missing component */
-    for (char *p = tmp + drive_dir_len; *p; p++) {
-        if (*p != '/')
-            continue;
-        *p = '\0';
-
-        struct stat st;
-        if (lstat(tmp, &st) != 0) {
-            /* Component missing — find its mode from another drive */
-            mode_t mode = 0755;
-            /* Virtual path = '/' + (tmp + drive_dir_len) */
-            char vpath[PATH_MAX];
-            snprintf(vpath, sizeof(vpath), "/%s", tmp + drive_dir_len);
-            for (unsigned i = 0; i < s->drive_count; i++) {
-                if (i == drive_idx) continue;
-                char other[PATH_MAX];
-                real_path_on_drive(s, i, vpath, other, sizeof(other));
-                struct stat ost;
-                if (lstat(other, &ost) == 0 && S_ISDIR(ost.st_mode)) {
-                    mode = ost.st_mode & 07777;
-                    break;
-                }
-            }
-            mkdir(tmp, mode);
-        }
-        *p = '/';
-    }
-
-    /* Final (leaf) directory */
-    struct stat st;
-    if (lstat(tmp, &st) != 0) {
-        mode_t mode = 0755;
-        char vpath[PATH_MAX];
-        snprintf(vpath, sizeof(vpath), "/%s", tmp + drive_dir_len);
-        for (unsigned i = 0; i < s->drive_count; i++) {
-            if (i == drive_idx) continue;
-            char other[PATH_MAX];
-            real_path_on_drive(s, i, vpath, other, sizeof(other));
-            struct stat ost;
-            if (lstat(other, &ost) == 0 && S_ISDIR(ost.st_mode)) {
-                mode = ost.st_mode & 07777;
-                break;
-            }
-        }
-        mkdir(tmp, mode);
-    }
-}
-
 /*--------------------------------------------------------------------
  * getattr
  *------------------------------------------------------------------*/
@@ -203,7 +152,7 @@ static int lr_getattr(const char *path, struct stat *st,
 
     memset(st, 0, sizeof(*st));
 
-    pthread_rwlock_rdlock(&s->state_lock);
+    state_rdlock(s);
 
     /* Root directory */
     if (strcmp(path, "/") == 0) {
@@ -213,90 +162,100 @@ static int lr_getattr(const char *path, struct stat *st,
             real_path_on_drive(s, i, "/", real, sizeof(real));
             struct stat real_st;
             if (lstat(real, &real_st) == 0 && S_ISDIR(real_st.st_mode)) {
-                pthread_rwlock_unlock(&s->state_lock);
+                state_unlock(s);
                 *st = real_st;
                 st->st_nlink = 2;
                 return 0;
             }
         }
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         st->st_mode  = S_IFDIR | 0755;
         st->st_nlink = 2;
         return 0;
     }
 
-    /* Real file? */
+    /* File: the record is authoritative (and covers a dead drive) */
     lr_file *f = state_find_file(s, path);
     if (f) {
-        struct stat real_st;
-        if (lstat(f->real_path, &real_st) == 0) {
-            *st = real_st;
-        } else {
-            /* File in table but not on disk: use stored metadata */
-            st->st_mode          = f->mode ? f->mode : (S_IFREG | 0644);
-            st->st_nlink         = 1;
-            st->st_size          = f->size;
-            st->st_uid           = f->uid;
-            st->st_gid           = f->gid;
-            st->st_mtim.tv_sec   = f->mtime_sec;
-            st->st_mtim.tv_nsec  = f->mtime_nsec;
-        }
-        pthread_rwlock_unlock(&s->state_lock);
+        state_stat_file(s, f, st);
+        state_unlock(s);
         return 0;
     }
 
     /* Symlink? */
     lr_symlink *sl = state_find_symlink(s, path);
     if (sl) {
-        st->st_mode         = S_IFLNK | 0777;
-        st->st_nlink        = 1;
-        st->st_size         = (off_t)strlen(sl->target);
-        st->st_uid          = sl->uid;
-        st->st_gid          = sl->gid;
-        st->st_mtim.tv_sec  = sl->mtime_sec;
-        st->st_mtim.tv_nsec = sl->mtime_nsec;
-        pthread_rwlock_unlock(&s->state_lock);
+        state_stat_symlink(sl, st);
+        state_unlock(s);
+        return 0;
+    }
+
+    /* Directory with a dir_table record: authoritative, no I/O */
+    lr_dir *d = state_find_dir(s, path);
+    if (d) {
+        state_stat_dir(d, st);
+        state_unlock(s);
         return 0;
     }
 
-    /* Directory? Check dir_table first (authoritative), then real dirs. */
+    /* Implicit or drive-only directory: the first backing directory */
     if (is_any_dir(s, path)) {
-        lr_dir *d = state_find_dir(s, path);
-        if (d) {
-            st->st_mode        = S_IFDIR | (d->mode & 07777);
-            st->st_nlink       = 2;
-            st->st_uid         = d->uid;
-            st->st_gid         = d->gid;
-            st->st_mtim.tv_sec  = d->mtime_sec;
-            st->st_mtim.tv_nsec = d->mtime_nsec;
-            pthread_rwlock_unlock(&s->state_lock);
-            return 0;
-        }
         for (unsigned i = 0; i < s->drive_count; i++) {
             char real[PATH_MAX];
             real_path_on_drive(s, i, path, real, sizeof(real));
             struct stat real_st;
             if (lstat(real, &real_st) == 0 && S_ISDIR(real_st.st_mode)) {
-                pthread_rwlock_unlock(&s->state_lock);
+                state_unlock(s);
                 *st = real_st;
                 st->st_nlink = 2;
                 return 0;
             }
         }
         /* Virtual dir with no backing real directory */
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         st->st_mode  = S_IFDIR | 0755;
         st->st_nlink = 2;
         return 0;
     }
 
-    pthread_rwlock_unlock(&s->state_lock);
+    state_unlock(s);
     return -ENOENT;
 }
 
 /*--------------------------------------------------------------------
  * readdir
  *------------------------------------------------------------------*/
+
+/* Names of drive-only directories already emitted, so a directory that
+ * exists on several drives is listed once. */
+typedef struct seen_name {
+    lr_hash_node      node;
+    struct seen_name *next;
+    char              name[];
+} seen_name;
+
+static int seen_compare(const void *arg, const void *obj)
+{
+    return strcmp((const char *)arg, ((const seen_name *)obj)->name) != 0;
+}
+
+/* Returns 1 if name was already seen, 0 otherwise (and adds it). */
+static int seen_add(lr_hash *h, seen_name **all, const char *name)
+{
+    uint32_t hash = lr_hash_string(name);
+    if (lr_hash_search(h, hash, seen_compare, name))
+        return 1;
+    size_t len = strlen(name);
+    seen_name *e = malloc(sizeof(*e) + len + 1);
+    if (!e)
+        return 1; /* skip rather than risk a duplicate */
+    memcpy(e->name, name, len + 1);
+    e->next = *all;
+    *all    = e;
+    lr_hash_insert(h, &e->node, e, hash);
+    return 0;
+}
+
 static int lr_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                       off_t offset, struct fuse_file_info *fi,
                       enum fuse_readdir_flags flags)
@@ -304,152 +263,56 @@ static int lr_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     (void)offset; (void)fi;
     lr_state *s = g_state;
     int use_plus = (flags & FUSE_READDIR_PLUS) != 0;
+    enum fuse_fill_dir_flags plus = use_plus ? FUSE_FILL_DIR_PLUS : 0;
+    struct stat st;
 
     filler(buf, ".",  NULL, 0, 0);
     filler(buf, "..", NULL, 0, 0);
 
-    size_t path_len = strlen(path);
-
-    /* Track emitted names to avoid duplicates */
-    char  **seen     = NULL;
-    size_t  seen_cap = 0;
-    size_t  seen_cnt = 0;
-
-    /* Returns 1 if name was already seen, 0 otherwise (and adds it) */
-#define SEEN_ADD(nm) ({                                              \
-    int _found = 0;                                                  \
-    for (size_t _i = 0; _i < seen_cnt; _i++) {                      \
-        if (strcmp(seen[_i], (nm)) == 0) { _found = 1; break; }     \
-    }                                                                \
-    if (!_found) {                                                   \
-        if (seen_cnt == seen_cap) {                                  \
-            size_t _nc = seen_cap ? seen_cap * 2 : 32;              \
-            char **_p = realloc(seen, _nc * sizeof(char *));         \
-            if (_p) { seen = _p; seen_cap = _nc; }                  \
-            else    { _found = 1; /* skip to avoid NULL deref */  } \
-        }                                                            \
-        if (!_found) seen[seen_cnt++] = strdup(nm);                  \
-    }                                                                \
-    _found;                                                          \
-})
-
-    pthread_rwlock_rdlock(&s->state_lock);
-    lr_list_node *node = lr_list_head(&s->file_list);
-
-    while (node) {
-        lr_file *f = (lr_file *)node->data;
-        const char *fp = f->vpath;
-
-        if (strncmp(fp, path, path_len) != 0) {
-            node = node->next;
-            continue;
-        }
-
-        const char *rest = fp + path_len;
-        if (path_len > 1 && rest[0] != '/') {
-            node = node->next;
-            continue;
-        }
-        if (path_len == 1 && rest[0] == '/')
-            rest++;
-        else if (path_len > 1 && rest[0] == '/')
-            rest++;
-
-        if (rest[0] == '\0') {
-            node = node->next;
-            continue;
-        }
-
-        char name[NAME_MAX + 1];
-        const char *slash = strchr(rest, '/');
-        if (slash) {
-            size_t n = (size_t)(slash - rest);
-            if (n >= sizeof(name)) n = sizeof(name) - 1;
-            strncpy(name, rest, n);
-            name[n] = '\0';
-        } else {
-            strncpy(name, rest, sizeof(name) - 1);
-            name[sizeof(name)-1] = '\0';
-        }
-
-        if (!SEEN_ADD(name)) {
-            struct stat st;
-            struct stat *stp = NULL;
-            enum fuse_fill_dir_flags fill_flags = 0;
-            if (use_plus && !slash) {
-                /* Direct file — fill stat from real path or stored metadata */
-                memset(&st, 0, sizeof(st));
-                if (lstat(f->real_path, &st) != 0) {
-                    st.st_mode         = f->mode ? f->mode : (S_IFREG | 0644);
-                    st.st_nlink        = 1;
-                    st.st_size         = f->size;
-                    st.st_uid          = f->uid;
-                    st.st_gid          = f->gid;
-                    st.st_mtim.tv_sec  = f->mtime_sec;
-                    st.st_mtim.tv_nsec = f->mtime_nsec;
-                }
-                stp        = &st;
-                fill_flags = FUSE_FILL_DIR_PLUS;
+    /* Entries the tree knows about: subdirectories, files, symlinks */
+    state_rdlock(s);
+    lr_dnode *dn = state_find_dnode(s, path);
+    if (dn) {
+        lr_list_node *node;
+        for (node = lr_list_head(&dn->subdirs); node; node = node->next) {
+            lr_dnode *c = (lr_dnode *)node->data;
+            if (use_plus && c->dir) {
+                state_stat_dir(c->dir, &st);
+                filler(buf, c->name, &st, 0, plus);
+            } else {
+                filler(buf, c->name, NULL, 0, 0);
             }
-            filler(buf, name, stp, 0, fill_flags);
         }
-        node = node->next;
-    }
-
-    /* Add symlinks in this directory */
-    node = lr_list_head(&s->symlink_list);
-    while (node) {
-        lr_symlink *sl_entry = (lr_symlink *)node->data;
-        const char *fp = sl_entry->vpath;
-        node = node->next;
-
-        if (strncmp(fp, path, path_len) != 0)
-            continue;
-        const char *rest = fp + path_len;
-        if (path_len > 1 && rest[0] != '/')
-            continue;
-        if (path_len == 1 && rest[0] == '/')
-            rest++;
-        else if (path_len > 1 && rest[0] == '/')
-            rest++;
-
-        if (rest[0] == '\0')
-            continue;
-
-        /* Only direct children: no further slash */
-        if (strchr(rest, '/') != NULL)
-            continue;
-
-        if (!SEEN_ADD(rest)) {
-            struct stat st;
-            struct stat *stp = NULL;
-            enum fuse_fill_dir_flags fill_flags = 0;
-            if (use_plus) {
-                memset(&st, 0, sizeof(st));
-                st.st_mode         = S_IFLNK | 0777;
-                st.st_nlink        = 1;
-                st.st_size         = (off_t)strlen(sl_entry->target);
-                st.st_uid          = sl_entry->uid;
-                st.st_gid          = sl_entry->gid;
-                st.st_mtim.tv_sec  = sl_entry->mtime_sec;
-                st.st_mtim.tv_nsec = sl_entry->mtime_nsec;
-                stp        = &st;
-                fill_flags = FUSE_FILL_DIR_PLUS;
-            }
-            filler(buf, rest, stp, 0, fill_flags);
+        for (node = lr_list_head(&dn->files); node; node = node->next) {
+            lr_file *f = (lr_file *)node->data;
+            const char *name = strrchr(f->vpath, '/') + 1;
+            if (use_plus)
+                state_stat_file(s, f, &st);
+            filler(buf, name, use_plus ? &st : NULL, 0, plus);
+        }
+        for (node = lr_list_head(&dn->symlinks); node; node = node->next) {
+            lr_symlink *sl = (lr_symlink *)node->data;
+            const char *name = strrchr(sl->vpath, '/') + 1;
+            if (use_plus)
+                state_stat_symlink(sl, &st);
+            filler(buf, name, use_plus ? &st : NULL, 0, plus);
         }
     }
 
-    /* Also scan real drive directories for subdirs not in file_table
+    /* Also scan real drive directories for subdirs not in the tree
      * (e.g. empty directories created via mkdir). */
     unsigned drive_count = s->drive_count;
-    pthread_rwlock_unlock(&s->state_lock);
+    state_unlock(s);
+
+    lr_hash    seen;
+    seen_name *seen_all = NULL;
+    lr_hash_init(&seen);
 
     for (unsigned i = 0; i < drive_count; i++) {
         char real[PATH_MAX];
-        pthread_rwlock_rdlock(&s->state_lock);
+        state_rdlock(s);
         real_path_on_drive(s, i, path, real, sizeof(real));
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
 
         DIR *dp = opendir(real);
         if (!dp)
@@ -459,49 +322,42 @@ static int lr_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
             if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
                 continue;
             /* Only emit directories from this pass; files are owned by file_table */
-            if (de->d_type == DT_DIR || de->d_type == DT_UNKNOWN) {
-                char sub[PATH_MAX];
-                snprintf(sub, sizeof(sub), "%s/%s", real, de->d_name);
-                struct stat st;
-                int have_stat = 0;
-                if (de->d_type == DT_UNKNOWN || use_plus) {
-                    have_stat = (lstat(sub, &st) == 0);
-                    if (de->d_type == DT_UNKNOWN &&
-                        (!have_stat || !S_ISDIR(st.st_mode)))
-                        continue;
-                }
-                if (!SEEN_ADD(de->d_name)) {
-                    /* For PLUS, prefer dir_table metadata if available */
-                    if (use_plus && have_stat) {
-                        char subvpath[PATH_MAX];
-                        snprintf(subvpath, sizeof(subvpath), "%s/%s",
-                                 strcmp(path, "/") == 0 ? "" : path,
-                                 de->d_name);
-                        pthread_rwlock_rdlock(&s->state_lock);
-                        lr_dir *dd = state_find_dir(s, subvpath);
-                        if (dd) {
-                            st.st_mode        = S_IFDIR | (dd->mode & 07777);
-                            st.st_uid         = dd->uid;
-                            st.st_gid         = dd->gid;
-                            st.st_mtim.tv_sec  = dd->mtime_sec;
-                            st.st_mtim.tv_nsec = dd->mtime_nsec;
-                            st.st_nlink       = 2;
-                        }
-                        pthread_rwlock_unlock(&s->state_lock);
-                    }
-                    filler(buf, de->d_name,
-                           (use_plus && have_stat) ? &st : NULL, 0,
-                           (use_plus && have_stat) ? FUSE_FILL_DIR_PLUS : 0);
-                }
+            if (de->d_type != DT_DIR && de->d_type != DT_UNKNOWN)
+                continue;
+            char sub[PATH_MAX];
+            snprintf(sub, sizeof(sub), "%s/%s", real, de->d_name);
+            int have_stat = 0;
+            if (de->d_type == DT_UNKNOWN || use_plus) {
+                have_stat = (lstat(sub, &st) == 0);
+                if (de->d_type == DT_UNKNOWN &&
+                    (!have_stat || !S_ISDIR(st.st_mode)))
+                    continue;
             }
+
+            char subvpath[PATH_MAX];
+            snprintf(subvpath, sizeof(subvpath), "%s/%s",
+                     strcmp(path, "/") == 0 ? "" : path, de->d_name);
+            state_rdlock(s);
+            int listed = state_find_dnode(s, subvpath)   != NULL ||
+                         state_find_file(s, subvpath)    != NULL ||
+                         state_find_symlink(s, subvpath) != NULL;
+            state_unlock(s);
+            if (listed || seen_add(&seen, &seen_all, de->d_name))
+                continue;
+
+            filler(buf, de->d_name,
+                   (use_plus && have_stat) ? &st : NULL, 0,
+                   (use_plus && have_stat) ? FUSE_FILL_DIR_PLUS : 0);
         }
         closedir(dp);
     }
 
-    for (size_t i = 0; i < seen_cnt; i++)
-        free(seen[i]);
-    free(seen);
-#undef SEEN_ADD
+    while (seen_all) {
+        seen_name *next = seen_all->next;
+        free(seen_all);
+        seen_all = next;
+    }
+    lr_hash_done(&seen);
 
     return 0;
 }
@@ -509,38 +365,61 @@ static int lr_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 /*--------------------------------------------------------------------
  * open / release
  *------------------------------------------------------------------*/
+
+/* Flags for the drive file behind an open or create.  With the kernel's
+ * write-back cache it reads pages in to fill partial writes, even of a
+ * write-only file, and it keeps the file size itself, so the drive file
+ * is opened read-write and without O_APPEND.  Also asks for parallel
+ * direct writes when configured. */
+static int open_flags(lr_state *s, struct fuse_file_info *fi)
+{
+    int flags = fi->flags;
+    if (s->writeback_cache) {
+        if ((flags & O_ACCMODE) == O_WRONLY)
+            flags = (flags & ~O_ACCMODE) | O_RDWR;
+        flags &= ~O_APPEND;
+    }
+#if FUSE_MAJOR_VERSION > 3 || (FUSE_MAJOR_VERSION == 3 && FUSE_MINOR_VERSION >= 15)
+    if (s->cfg.parallel_direct_writes)
+        fi->parallel_direct_writes = 1;
+#endif
+    return flags;
+}
+
 static int lr_open(const char *path, struct fuse_file_info *fi)
 {
     lr_state *s = g_state;
 
     /* Increment open_count before releasing the lock so the live-rebuild
-     * thread never sees open_count == 0 while we are mid-open.
-     * Use wrlock because open_count is a write. */
-    pthread_rwlock_wrlock(&s->state_lock);
+     * thread never sees open_count == 0 while we are mid-open.  The count
+     * is atomic: the read lock keeps the record alive. */
+    state_rdlock(s);
     lr_file *f = state_find_file(s, path);
     if (!f) {
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return -ENOENT;
     }
     char real[PATH_MAX];
-    snprintf(real, sizeof(real), "%s", f->real_path);
-    int has_parity = (s->parity != NULL && s->parity->levels > 0);
-    f->open_count++;
-    pthread_rwlock_unlock(&s->state_lock);
-
-    lr_fh_t *fh = malloc(sizeof(lr_fh_t));
+    state_real_path(s, f, real, sizeof(real));
+    /* Nothing on the cache tier is covered by parity */
+    int has_parity = (s->parity != NULL && s->parity->levels > 0 &&
+                      !state_is_cache(s, f->drive_idx));
+    unsigned drive = f->drive_idx;
+    state_open_inc(f);
+    state_unlock(s);
+
+    lr_fh_t *fh = fh_new(path, -1, drive);
     if (!fh) {
         /* OOM — undo the open_count increment */
-        pthread_rwlock_wrlock(&s->state_lock);
+        state_rdlock(s);
         lr_file *f2 = state_find_file(s, path);
-        if (f2 && f2->open_count > 0)
-            f2->open_count--;
-        pthread_rwlock_unlock(&s->state_lock);
+        if (f2)
+            state_open_dec(f2);
+        state_unlock(s);
         return -ENOMEM;
     }
-    snprintf(fh->vpath, sizeof(fh->vpath), "%s", path);
 
-    int fd = open(real, fi->flags & ~O_CREAT);
+    int fd = open(real, open_flags(s, fi) & ~O_CREAT);
     if (fd >= 0) {
         fh->fd = fd;
         fi->fh = (uint64_t)(uintptr_t)fh;
@@ -558,12 +437,12 @@ static int lr_open(const char *path, struct fuse_file_info *fi)
     }
 
     /* Open failed with no recovery path — undo the open_count increment. */
-    free(fh);
-    pthread_rwlock_wrlock(&s->state_lock);
+    fh_free(fh);
+    state_rdlock(s);
     lr_file *f2 = state_find_file(s, path);
-    if (f2 && f2->open_count > 0)
-        f2->open_count--;
-    pthread_rwlock_unlock(&s->state_lock);
+    if (f2)
+        state_open_dec(f2);
+    state_unlock(s);
     return -saved;
 }
 
@@ -574,21 +453,67 @@ static int lr_release(const char *path, struct fuse_file_info *fi)
     lr_state *s  = g_state;
 
     /* Use the vpath captured at open time — immune to intervening rename. */
-    pthread_rwlock_wrlock(&s->state_lock);
+    state_rdlock(s);
     lr_file *f = state_find_file(s, fh->vpath);
-    if (f && f->open_count > 0)
-        f->open_count--;
-    pthread_rwlock_unlock(&s->state_lock);
+    if (f)
+        state_open_dec(f);
+    state_unlock(s);
 
     if (fh->fd >= 0)
         close(fh->fd);
-    free(fh);
+    fh_free(fh);
     return 0;
 }
 
 /*--------------------------------------------------------------------
  * read / write
  *------------------------------------------------------------------*/
+
+/* Recover count blocks of drive at pos and offer them to the degraded-read
+ * cache.  A run touching a dirty position is not cached: its parity is not
+ * current until the drain catches up.  Caller holds state_lock (read). */
+static const uint8_t *degraded_recover(lr_state *s, unsigned drive,
+                                       uint32_t pos, uint32_t count)
+{
+    lr_rcache *c     = s->rcache;
+    uint64_t   gen   = c ? rcache_gen(c) : 0;
+    int        clean = c != NULL;
+    for (uint32_t i = 0; clean && s->journal && i < count; i++)
+        if (journal_position_dirty(s->journal, pos + i))
+            clean = 0;
+
+    const uint8_t *data = parity_recover_range(s, drive, pos, count);
+    if (data && clean) {
+        uint32_t bs = s->cfg.block_size;
+        for (uint32_t i = 0; i < count; i++)
+            rcache_put(c, drive, pos + i, data + (size_t)i * bs, gen);
+    }
+    return data;
+}
+
+int lr_degraded_fill(void *arg, unsigned drive, uint32_t pos, uint32_t count)
+{
+    lr_state *s  = (lr_state *)arg;
+    int       rc = 0;
+
+    state_rdlock(s);
+    if (!s->parity || s->parity->levels == 0) {
+        state_unlock(s);
+        return -1;
+    }
+    uint32_t run_max = parity_recover_run_max(s->parity);
+    while (count > 0) {
+        uint32_t n = count < run_max ? count : run_max;
+        if (!degraded_recover(s, drive, pos, n)) {
+            rc = -1;
+            break;
+        }
+        pos   += n;
+        count -= n;
+    }
+    state_unlock(s);
+    return rc;
+}
 static int lr_read(const char *path, char *buf, size_t size, off_t offset,
                    struct fuse_file_info *fi)
 {
@@ -597,6 +522,7 @@ static int lr_read(const char *path, char *buf, size_t size, off_t offset,
 
     if (fh->fd >= 0) {
         ssize_t n = pread(fh->fd, buf, size, offset);
+        stats_dev_io(g_state->stats, fh->drive, 0, n);
         if (n >= 0)
             return (int)n;
         if (errno != EIO)
@@ -605,22 +531,24 @@ static int lr_read(const char *path, char *buf, size_t size, off_t offset,
 
     /* EIO or dead-drive (fd == -1): attempt transparent recovery from parity */
     lr_state *s = g_state;
-    pthread_rwlock_rdlock(&s->state_lock);
+    state_rdlock(s);
 
     lr_file *f = state_find_file(s, fh->vpath);
     if (!f || !s->parity || s->parity->levels == 0) {
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return -EIO;
     }
 
     uint32_t bs          = s->cfg.block_size;
     unsigned drive_idx   = f->drive_idx;
+    state_lock_drive(s, drive_idx);
     uint32_t pos_start   = f->parity_pos_start;
     uint32_t block_count = f->block_count;
     int64_t  file_size   = f->size;
+    state_unlock_drive(s, drive_idx);
 
     if ((int64_t)offset >= file_size) {
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return 0;
     }
     if ((int64_t)(offset + (off_t)size) > file_size)
@@ -628,35 +556,117 @@ static int lr_read(const char *path, char *buf, size_t size, off_t offset,
 
     uint32_t first_blk = (uint32_t)(offset / bs);
     uint32_t last_blk  = (uint32_t)((offset + (off_t)size - 1) / bs);
-
-    void *tmp = malloc(bs);
-    if (!tmp) {
-        pthread_rwlock_unlock(&s->state_lock);
-        return -ENOMEM;
-    }
+    uint32_t end_blk   = last_blk < block_count ? last_blk + 1 : block_count;
+    uint32_t run_max   = parity_recover_run_max(s->parity);
 
     ssize_t total = 0;
-    for (uint32_t blk = first_blk; blk <= last_blk && blk < block_count; blk++) {
-        uint32_t pos = pos_start + blk;
-        if (parity_recover_block(s, drive_idx, pos, tmp) != 0) {
-            free(tmp);
-            pthread_rwlock_unlock(&s->state_lock);
-            return total > 0 ? (int)total : -EIO;
-        }
-        off_t    blk_base   = (off_t)blk * bs;
-        off_t    copy_start = (offset > blk_base) ? (offset - blk_base) : 0;
-        size_t   copy_len   = bs - (size_t)copy_start;
+    uint32_t blk  = first_blk;
+    while (blk < end_blk) {
+        off_t  blk_base   = (off_t)blk * bs;
+        size_t copy_start = (offset > blk_base) ? (size_t)(offset - blk_base) : 0;
+        size_t copy_len   = bs - copy_start;
         if (copy_len > size - (size_t)total)
             copy_len = size - (size_t)total;
-        memcpy(buf + total, (char *)tmp + copy_start, copy_len);
-        total += (ssize_t)copy_len;
+
+        if (s->rcache && rcache_read(s->rcache, drive_idx, pos_start + blk,
+                                     buf + total, (uint32_t)copy_start,
+                                     (uint32_t)copy_len)) {
+            total += (ssize_t)copy_len;
+            blk++;
+            continue;
+        }
+
+        /* Recover the whole run of uncached blocks in one pass */
+        uint32_t n = 1;
+        while (blk + n < end_blk && n < run_max &&
+               !(s->rcache && rcache_contains(s->rcache, drive_idx,
+                                              pos_start + blk + n)))
+            n++;
+        const uint8_t *data = degraded_recover(s, drive_idx, pos_start + blk, n);
+        if (!data) {
+            state_unlock(s);
+            return total > 0 ? (int)total : -EIO;
+        }
+        for (uint32_t i = 0; i < n; i++, blk++) {
+            blk_base   = (off_t)blk * bs;
+            copy_start = (offset > blk_base) ? (size_t)(offset - blk_base) : 0;
+            copy_len   = bs - copy_start;
+            if (copy_len > size - (size_t)total)
+                copy_len = size - (size_t)total;
+            memcpy(buf + total, data + (size_t)i * bs + copy_start, copy_len);
+            total += (ssize_t)copy_len;
+        }
     }
 
-    free(tmp);
-    pthread_rwlock_unlock(&s->state_lock);
+    state_unlock(s);
+
+    /* Sequential reader: keep degraded_readahead blocks queued ahead of it,
+     * topping up once half the window has been consumed */
+    uint32_t ra = s->cfg.degraded_readahead;
+    if (s->rcache && ra > 0) {
+        uint32_t from = 0, to = 0;
+        pthread_mutex_lock(&fh->ra_lock);
+        int seq = first_blk <= fh->ra_next && first_blk + 1 >= fh->ra_next;
+        fh->ra_next = end_blk;
+        if (!seq) {
+            fh->ra_issued = end_blk;
+        } else if (fh->ra_issued < end_blk + ra / 2) {
+            from = fh->ra_issued > end_blk ? fh->ra_issued : end_blk;
+            to   = (uint64_t)end_blk + ra < block_count ? end_blk + ra
+                                                        : block_count;
+            if (from < to)
+                fh->ra_issued = to;
+        }
+        pthread_mutex_unlock(&fh->ra_lock);
+        if (from < to)
+            rcache_prefetch(s->rcache, drive_idx, pos_start + from, to - from);
+    }
     return (int)total;
 }
 
+/*
+ * read_buf: with splice_read, a healthy handle's reply is an fd-backed
+ * buffer and libfuse splices the bytes from the drive to /dev/fuse with
+ * no userspace copy.  The read then happens inside libfuse, where an EIO
+ * can no longer be recovered from parity, so splicing is opt-in; dead-
+ * drive handles (fd == -1) and splice_read off use the buffered lr_read.
+ */
+static int lr_read_buf(const char *path, struct fuse_bufvec **bufp,
+                       size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    lr_fh_t  *fh = (lr_fh_t *)(uintptr_t)fi->fh;
+    lr_state *s  = g_state;
+
+    struct fuse_bufvec *bv = malloc(sizeof(*bv));
+    if (!bv)
+        return -ENOMEM;
+    *bv = FUSE_BUFVEC_INIT(size);
+
+    if (fh->fd >= 0 && s->cfg.splice_read) {
+        bv->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bv->buf[0].fd    = fh->fd;
+        bv->buf[0].pos   = offset;
+        *bufp = bv;
+        return 0;
+    }
+
+    char *mem = malloc(size ? size : 1);
+    if (!mem) {
+        free(bv);
+        return -ENOMEM;
+    }
+    int n = lr_read(path, mem, size, offset, fi);
+    if (n < 0) {
+        free(mem);
+        free(bv);
+        return n;
+    }
+    bv->buf[0].mem  = mem;    /* libfuse frees it with the vector */
+    bv->buf[0].size = (size_t)n;
+    *bufp = bv;
+    return 0;
+}
+
 /*--------------------------------------------------------------------
  * create
  *------------------------------------------------------------------*/
@@ -665,14 +675,16 @@ static int lr_create(const char *path, mode_t mode,
 {
     lr_state *s = g_state;
 
-    pthread_rwlock_wrlock(&s->state_lock);
+    state_wrlock(s);
 
     lr_file *existing_f = state_find_file(s, path);
     if (existing_f) {
         lr_file *f = existing_f;
-        int fd = open(f->real_path, fi->flags, mode);
+        char real[PATH_MAX];
+        int fd = open(state_real_path(s, f, real, sizeof(real)),
+                      open_flags(s, fi), mode);
         if (fd < 0) {
-            pthread_rwlock_unlock(&s->state_lock);
+            state_unlock(s);
             return -errno;
         }
         /* O_TRUNC: the kernel truncated the real file; sync our metadata */
@@ -680,36 +692,43 @@ static int lr_create(const char *path, mode_t mode,
             if (s->journal)
                 journal_mark_dirty_range(s->journal,
                                          f->parity_pos_start, f->block_count);
+            state_pos_index_remove(s, f);
             free_positions(&s->drives[f->drive_idx].pos_alloc,
                            f->parity_pos_start, f->block_count);
+            state_account_free(s, f->drive_idx, -f->size);
             f->block_count = 0;
             f->size        = 0;
-            state_rebuild_pos_index(s, f->drive_idx);
         } else if (fi->flags & O_TRUNC) {
+            state_account_free(s, f->drive_idx, -f->size);
             f->size = 0;
         }
-        f->open_count++;
-        pthread_rwlock_unlock(&s->state_lock);
+        if (fi->flags & O_TRUNC) {
+            state_touch_file(f);
+            metalog_file(s, f);
+        }
+        unsigned drive = f->drive_idx;
+        state_open_inc(f);
+        state_unlock(s);
 
-        lr_fh_t *fh = malloc(sizeof(lr_fh_t));
+        lr_fh_t *fh = fh_new(path, fd, drive);
         if (!fh) {
             close(fd);
-            pthread_rwlock_wrlock(&s->state_lock);
+            state_rdlock(s);
             lr_file *f2 = state_find_file(s, path);
-            if (f2 && f2->open_count > 0)
-                f2->open_count--;
-            pthread_rwlock_unlock(&s->state_lock);
+            if (f2)
+                state_open_dec(f2);
+            state_unlock(s);
             return -ENOMEM;
         }
-        fh->fd = fd;
-        snprintf(fh->vpath, sizeof(fh->vpath), "%s", path);
         fi->fh = (uint64_t)(uintptr_t)fh;
         return 0;
     }
 
-    unsigned drive_idx = state_pick_drive(s);
+    /* New files land on the cache tier while it has room */
+    unsigned drive_idx = state_cache_has_room(s) ? s->cache_drive
+                                                 : state_pick_drive(s, path);
     if (drive_idx == UINT32_MAX) {
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return -ENOSPC;
     }
     lr_drive *drive    = &s->drives[drive_idx];
@@ -719,39 +738,40 @@ static int lr_create(const char *path, mode_t mode,
     snprintf(real, sizeof(real), "%s%s", drive->dir, rel);
 
     /* Create parent directories, inheriting modes from other drives */
-    mkdirs_p(s, drive_idx, real);
+    state_make_parents(s, drive_idx, real);
 
-    int fd = open(real, fi->flags | O_CREAT, mode);
+    int fd = open(real, open_flags(s, fi) | O_CREAT, mode);
     if (fd < 0) {
         int saved = errno;
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return -saved;
     }
 
     uint32_t pos_start = alloc_positions(&s->drives[drive_idx].pos_alloc, 0);
 
     lr_file *f = calloc(1, sizeof(lr_file));
-    if (!f) {
+    if (!f || state_set_path(s, &f->vpath, path) != 0) {
+        free(f);
         close(fd);
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return -ENOMEM;
     }
 
-    snprintf(f->vpath,     sizeof(f->vpath),    "%s", path);
-    snprintf(f->real_path, sizeof(f->real_path), "%s", real);
     f->drive_idx        = drive_idx;
     f->size             = 0;
     f->block_count      = 0;
     f->parity_pos_start = pos_start;
-    f->mtime_sec        = time(NULL);
 
-    /* Capture actual mode/uid/gid assigned by the kernel after creation */
+    /* Capture actual mode/uid/gid/mtime assigned by the kernel after creation */
     struct stat created_st;
     if (fstat(fd, &created_st) == 0) {
-        f->mode = created_st.st_mode;
-        f->uid  = created_st.st_uid;
-        f->gid  = created_st.st_gid;
+        f->mode       = created_st.st_mode;
+        f->uid        = created_st.st_uid;
+        f->gid        = created_st.st_gid;
+        f->mtime_sec  = created_st.st_mtim.tv_sec;
+        f->mtime_nsec = created_st.st_mtim.tv_nsec;
     } else {
+        state_touch_file(f);
         f->mode = S_IFREG | (mode & 0777);
         f->uid  = (uid_t)getuid();
         f->gid  = (gid_t)getgid();
@@ -760,23 +780,21 @@ static int lr_create(const char *path, mode_t mode,
     }
 
     state_insert_file(s, f);
+    metalog_file(s, f);
     f->open_count = 1;
-    state_rebuild_pos_index(s, drive_idx);
 
-    pthread_rwlock_unlock(&s->state_lock);
+    state_unlock(s);
 
-    lr_fh_t *fh = malloc(sizeof(lr_fh_t));
+    lr_fh_t *fh = fh_new(path, fd, drive_idx);
     if (!fh) {
         close(fd);
-        pthread_rwlock_wrlock(&s->state_lock);
+        state_rdlock(s);
         lr_file *f2 = state_find_file(s, path);
-        if (f2 && f2->open_count > 0)
-            f2->open_count--;
-        pthread_rwlock_unlock(&s->state_lock);
+        if (f2)
+            state_open_dec(f2);
+        state_unlock(s);
         return -ENOMEM;
     }
-    fh->fd = fd;
-    snprintf(fh->vpath, sizeof(fh->vpath), "%s", path);
     fi->fh = (uint64_t)(uintptr_t)fh;
     return 0;
 }
@@ -791,27 +809,29 @@ static int lr_do_symlink(const char *target, const char *link_path)
     if (strlen(target) >= PATH_MAX)
         return -ENAMETOOLONG;
 
-    pthread_rwlock_wrlock(&s->state_lock);
+    state_wrlock(s);
 
     if (state_find_file(s, link_path) || state_find_dir(s, link_path) ||
         state_find_symlink(s, link_path)) {
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return -EEXIST;
     }
 
     lr_symlink *sl = calloc(1, sizeof(lr_symlink));
-    if (!sl) {
-        pthread_rwlock_unlock(&s->state_lock);
+    if (!sl || state_set_path(s, &sl->vpath,  link_path) != 0 ||
+               state_set_path(s, &sl->target, target)    != 0) {
+        if (sl)
+            state_free_symlink(s, sl);
+        state_unlock(s);
         return -ENOMEM;
     }
-    snprintf(sl->vpath,  PATH_MAX, "%s", link_path);
-    snprintf(sl->target, PATH_MAX, "%s", target);
     sl->mtime_sec = time(NULL);
     sl->uid       = (uid_t)fuse_get_context()->uid;
     sl->gid       = (gid_t)fuse_get_context()->gid;
 
     state_insert_symlink(s, sl);
-    pthread_rwlock_unlock(&s->state_lock);
+    metalog_symlink(s, sl);
+    state_unlock(s);
     return 0;
 }
 
@@ -819,10 +839,10 @@ static int lr_readlink(const char *path, char *buf, size_t size)
 {
     lr_state *s = g_state;
 
-    pthread_rwlock_rdlock(&s->state_lock);
+    state_rdlock(s);
     lr_symlink *sl = state_find_symlink(s, path);
     if (!sl) {
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return -ENOENT;
     }
     /* readlink must null-terminate; truncate to size-1 if necessary */
@@ -831,7 +851,7 @@ static int lr_readlink(const char *path, char *buf, size_t size)
         len = size - 1;
     memcpy(buf, sl->target, len);
     buf[len] = '\0';
-    pthread_rwlock_unlock(&s->state_lock);
+    state_unlock(s);
     return 0;
 }
 
@@ -842,38 +862,43 @@ static int lr_unlink(const char *path)
 {
     lr_state *s = g_state;
 
-    pthread_rwlock_wrlock(&s->state_lock);
+    state_wrlock(s);
 
     lr_file *f = state_remove_file(s, path);
     if (!f) {
         lr_symlink *sl = state_remove_symlink(s, path);
         if (sl) {
-            pthread_rwlock_unlock(&s->state_lock);
-            free(sl);
+            metalog_remove_symlink(s, path);
+            state_unlock(s);
+            state_free_symlink(s, sl);
             return 0;
         }
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return -ENOENT;
     }
 
     char real[PATH_MAX];
-    snprintf(real, sizeof(real), "%s", f->real_path);
+    state_real_path(s, f, real, sizeof(real));
     unsigned drive_idx   = f->drive_idx;
     uint32_t pos_start   = f->parity_pos_start;
     uint32_t block_count = f->block_count;
 
     if (block_count > 0 && s->journal)
         journal_mark_dirty_range(s->journal, pos_start, block_count);
+    if (s->fdcache)
+        fdcache_invalidate(s->fdcache, f);
 
+    state_pos_index_remove(s, f);
     free_positions(&s->drives[drive_idx].pos_alloc, pos_start, block_count);
-    state_rebuild_pos_index(s, drive_idx);
+    state_account_free(s, drive_idx, -f->size);
+    metalog_remove_file(s, path);
 
-    pthread_rwlock_unlock(&s->state_lock);
+    state_unlock(s);
 
     /* unlink and free after releasing the lock: avoids holding wrlock
      * during a potentially slow disk operation. */
     unlink(real);
-    free(f);
+    state_free_file(s, f);
     return 0;
 }
 
@@ -897,7 +922,7 @@ static int lr_rename(const char *from, const char *to, unsigned int flags)
 
     lr_state *s = g_state;
 
-    pthread_rwlock_wrlock(&s->state_lock);
+    state_wrlock(s);
 
     lr_file *f = state_find_file(s, from);
     if (!f) {
@@ -906,37 +931,47 @@ static int lr_rename(const char *from, const char *to, unsigned int flags)
             /* Check if it's a symlink */
             lr_symlink *sl = state_find_symlink(s, from);
             if (!sl) {
-                pthread_rwlock_unlock(&s->state_lock);
+                state_unlock(s);
                 return -ENOENT;
             }
             if ((flags & RENAME_NOREPLACE) &&
                 (state_find_file(s, to) || state_find_symlink(s, to))) {
-                pthread_rwlock_unlock(&s->state_lock);
+                state_unlock(s);
                 return -EEXIST;
             }
+            /* Re-key the symlink under the new path */
+            state_remove_symlink(s, from);
+            if (state_set_path(s, &sl->vpath, to) != 0) {
+                state_insert_symlink(s, sl);
+                state_unlock(s);
+                return -ENOMEM;
+            }
             /* Remove overwritten destination symlink if present */
             lr_symlink *old_dest = state_remove_symlink(s, to);
-            /* Re-key the symlink under the new path */
-            lr_hash_remove(&s->symlink_table, &sl->vpath_node);
-            snprintf(sl->vpath, PATH_MAX, "%s", to);
-            uint32_t h = lr_hash_string(sl->vpath);
-            lr_hash_insert(&s->symlink_table, &sl->vpath_node, sl, h);
-            pthread_rwlock_unlock(&s->state_lock);
-            free(old_dest);
+            state_insert_symlink(s, sl);
+            metalog_remove_symlink(s, from);
+            metalog_symlink(s, sl);
+            state_unlock(s);
+            state_free_symlink(s, old_dest);
             return 0;
         }
 
         /* RENAME_NOREPLACE: fail if destination already exists */
         if ((flags & RENAME_NOREPLACE) && is_any_dir(s, to)) {
-            pthread_rwlock_unlock(&s->state_lock);
+            state_unlock(s);
             return -EEXIST;
         }
 
+        /* A directory cannot move inside itself */
         size_t from_len = strlen(from);
+        if (strncmp(to, from, from_len) == 0 && to[from_len] == '/') {
+            state_unlock(s);
+            return -EINVAL;
+        }
 
         /* Rename the real backing directory on each drive that has it */
         int rc = 0;
-        for (unsigned i = 0; i < s->drive_count && rc == 0; i++) {
+        for (unsigned i = 0; i < state_drive_slots(s) && rc == 0; i++) {
             char real_from[PATH_MAX], real_to[PATH_MAX];
             real_path_on_drive(s, i, from, real_from, sizeof(real_from));
             real_path_on_drive(s, i, to,   real_to,   sizeof(real_to));
@@ -947,130 +982,91 @@ static int lr_rename(const char *from, const char *to, unsigned int flags)
             }
         }
         if (rc != 0) {
-            pthread_rwlock_unlock(&s->state_lock);
+            state_unlock(s);
             return rc;
         }
 
-        /* Update all lr_file vpaths whose prefix matches from */
-        lr_list_node *node = lr_list_head(&s->file_list);
-        while (node) {
-            lr_file *file = (lr_file *)node->data;
-            node = node->next;
-            if (strncmp(file->vpath, from, from_len) == 0 &&
-                (file->vpath[from_len] == '/' || file->vpath[from_len] == '\0')) {
-                lr_hash_remove(&s->file_table, &file->vpath_node);
-                char new_vpath[PATH_MAX];
-                snprintf(new_vpath, sizeof(new_vpath), "%s%s",
-                         to, file->vpath + from_len);
-                snprintf(file->vpath, sizeof(file->vpath), "%s", new_vpath);
-                const char *rel = file->vpath[0] == '/' ? file->vpath + 1 : file->vpath;
-                snprintf(file->real_path, sizeof(file->real_path), "%s%s",
-                         s->drives[file->drive_idx].dir, rel);
-                uint32_t h = lr_hash_string(file->vpath);
-                lr_hash_insert(&s->file_table, &file->vpath_node, file, h);
-            }
-        }
-
-        /* Update all lr_dir entries whose vpath matches from or has it as prefix */
-        node = lr_list_head(&s->dir_list);
-        while (node) {
-            lr_dir *dir = (lr_dir *)node->data;
-            node = node->next;
-            if (strcmp(dir->vpath, from) == 0 ||
-                (strncmp(dir->vpath, from, from_len) == 0 &&
-                 dir->vpath[from_len] == '/')) {
-                lr_hash_remove(&s->dir_table, &dir->vpath_node);
-                char new_vpath[PATH_MAX];
-                snprintf(new_vpath, sizeof(new_vpath), "%s%s",
-                         to, dir->vpath + from_len);
-                snprintf(dir->vpath, sizeof(dir->vpath), "%s", new_vpath);
-                uint32_t h = lr_hash_string(dir->vpath);
-                lr_hash_insert(&s->dir_table, &dir->vpath_node, dir, h);
-            }
-        }
-
-        /* Update all lr_symlink entries whose vpath has from as prefix */
-        node = lr_list_head(&s->symlink_list);
-        while (node) {
-            lr_symlink *sl = (lr_symlink *)node->data;
-            node = node->next;
-            if (strncmp(sl->vpath, from, from_len) == 0 &&
-                (sl->vpath[from_len] == '/' || sl->vpath[from_len] == '\0')) {
-                lr_hash_remove(&s->symlink_table, &sl->vpath_node);
-                char new_vpath[PATH_MAX];
-                snprintf(new_vpath, sizeof(new_vpath), "%s%s",
-                         to, sl->vpath + from_len);
-                snprintf(sl->vpath, sizeof(sl->vpath), "%s", new_vpath);
-                uint32_t h = lr_hash_string(sl->vpath);
-                lr_hash_insert(&s->symlink_table, &sl->vpath_node, sl, h);
-            }
+        /* Move the subtree: re-keys only the files, symlinks and dir
+         * records below from */
+        if (state_rename_dir(s, from, to) != 0) {
+            state_unlock(s);
+            return -ENOMEM;
         }
+        metalog_rename_dir(s, from, to);
 
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return 0;
     }
 
     /* Trivial self-rename */
     if (strcmp(from, to) == 0) {
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return 0;
     }
 
     /* RENAME_NOREPLACE: fail if destination already exists */
     if ((flags & RENAME_NOREPLACE) && state_find_file(s, to)) {
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return -EEXIST;
     }
 
     /* Locate existing destination entry before we modify anything */
     lr_file *existing = state_find_file(s, to);
 
-    char old_real[PATH_MAX];
-    snprintf(old_real, sizeof(old_real), "%s", f->real_path);
-
-    char new_real[PATH_MAX];
-    const char *rel = to[0] == '/' ? to + 1 : to;
-    snprintf(new_real, sizeof(new_real), "%s%s",
-             s->drives[f->drive_idx].dir, rel);
-
-    lr_hash_remove(&s->file_table, &f->vpath_node);
-    lr_list_remove(&s->file_list, &f->list_node);
+    /* Allocate the new path up front so a failure changes nothing */
+    const char *new_vpath = NULL;
+    if (state_set_path(s, &new_vpath, to) != 0) {
+        state_unlock(s);
+        return -ENOMEM;
+    }
 
-    snprintf(f->vpath,     sizeof(f->vpath),    "%s", to);
-    snprintf(f->real_path, sizeof(f->real_path), "%s", new_real);
+    char old_real[PATH_MAX], new_real[PATH_MAX];
+    state_real_path(s, f, old_real, sizeof(old_real));
+    real_path_on_drive(s, f->drive_idx, to, new_real, sizeof(new_real));
 
     /* Create parent directories for new path, inheriting modes */
-    mkdirs_p(s, f->drive_idx, new_real);
+    state_make_parents(s, f->drive_idx, new_real);
 
     if (rename(old_real, new_real) != 0) {
-        /* Rollback: restore f to its original path */
-        snprintf(f->vpath,     sizeof(f->vpath),    "%s", from);
-        snprintf(f->real_path, sizeof(f->real_path), "%s", old_real);
-        state_insert_file(s, f);
-        pthread_rwlock_unlock(&s->state_lock);
-        return -errno;
+        int saved = errno;
+        strpool_free(&s->paths, new_vpath);
+        state_unlock(s);
+        return -saved;
     }
 
+    state_remove_file(s, from);
+
+    if (s->fdcache)
+        fdcache_invalidate(s->fdcache, f);
+
     /* rename() succeeded: discard the overwritten destination's state */
     if (existing) {
-        lr_hash_remove(&s->file_table, &existing->vpath_node);
-        lr_list_remove(&s->file_list, &existing->list_node);
+        if (s->fdcache)
+            fdcache_invalidate(s->fdcache, existing);
+        state_remove_file(s, to);
         if (existing->block_count > 0) {
             if (s->journal)
                 journal_mark_dirty_range(s->journal,
                                          existing->parity_pos_start,
                                          existing->block_count);
+            state_pos_index_remove(s, existing);
             free_positions(&s->drives[existing->drive_idx].pos_alloc,
                            existing->parity_pos_start,
                            existing->block_count);
-            state_rebuild_pos_index(s, existing->drive_idx);
         }
-        free(existing);
+        state_account_free(s, existing->drive_idx, -existing->size);
+        state_free_file(s, existing);
     }
 
+    strpool_free(&s->paths, f->vpath);
+    f->vpath = new_vpath;
     state_insert_file(s, f);
+    /* Replay drops the old record and upserts the new path, which also
+     * replaces an overwritten destination */
+    metalog_remove_file(s, from);
+    metalog_file(s, f);
 
-    pthread_rwlock_unlock(&s->state_lock);
+    state_unlock(s);
     return 0;
 }
 
@@ -1085,10 +1081,10 @@ static int lr_mkdir(const char *path, mode_t mode)
      * holding wrlock during malloc (which may block). */
     lr_dir *d = calloc(1, sizeof(lr_dir));
 
-    pthread_rwlock_wrlock(&s->state_lock);
-    unsigned drive_idx = state_pick_drive(s);
+    state_wrlock(s);
+    unsigned drive_idx = state_pick_drive(s, path);
     if (drive_idx >= s->drive_count) {
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         free(d);
         return -ENOSPC;
     }
@@ -1096,20 +1092,23 @@ static int lr_mkdir(const char *path, mode_t mode)
     real_path_on_drive(s, drive_idx, path, real, sizeof(real));
 
     /* Ensure parent directories exist on this drive before mkdir. */
-    mkdirs_p(s, drive_idx, real);
+    state_make_parents(s, drive_idx, real);
 
     /* Keep wrlock held through mkdir: prevents a concurrent lr_mkdir for the
      * same path from inserting a duplicate dir_table entry. */
     if (mkdir(real, mode) != 0) {
         int saved = errno;
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         free(d);
         return -saved;
     }
 
     /* Record directory metadata in dir_table */
+    if (d && state_set_path(s, &d->vpath, path) != 0) {
+        free(d);
+        d = NULL;
+    }
     if (d) {
-        snprintf(d->vpath, PATH_MAX, "%s", path);
         struct stat st;
         if (lstat(real, &st) == 0) {
             d->mode       = st.st_mode;
@@ -1121,9 +1120,10 @@ static int lr_mkdir(const char *path, mode_t mode)
             d->mode = S_IFDIR | (mode & 07777);
         }
         state_insert_dir(s, d);
+        metalog_dir(s, d);
     }
 
-    pthread_rwlock_unlock(&s->state_lock);
+    state_unlock(s);
     return 0;
 }
 
@@ -1131,28 +1131,30 @@ static int lr_rmdir(const char *path)
 {
     lr_state *s = g_state;
 
-    pthread_rwlock_rdlock(&s->state_lock);
-    unsigned count = s->drive_count;
-    pthread_rwlock_unlock(&s->state_lock);
+    state_rdlock(s);
+    unsigned count = state_drive_slots(s);
+    state_unlock(s);
 
     /* Attempt real rmdir first: if any drive rejects it (e.g. ENOTEMPTY),
      * don't touch the dir_table — the virtual directory still exists. */
     int rc = 0;
     for (unsigned i = 0; i < count; i++) {
-        pthread_rwlock_rdlock(&s->state_lock);
+        state_rdlock(s);
         char real[PATH_MAX];
         real_path_on_drive(s, i, path, real, sizeof(real));
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         if (rmdir(real) != 0 && errno != ENOENT)
             rc = -errno;
     }
     if (rc != 0)
         return rc;
 
-    pthread_rwlock_wrlock(&s->state_lock);
+    state_wrlock(s);
     lr_dir *d = state_remove_dir(s, path);
-    pthread_rwlock_unlock(&s->state_lock);
-    free(d);
+    if (d)
+        metalog_remove_dir(s, path);
+    state_unlock(s);
+    state_free_dir(s, d);
     return 0;
 }
 
@@ -1165,26 +1167,33 @@ static int lr_truncate(const char *path, off_t size,
     (void)fi;
     lr_state *s = g_state;
 
-    pthread_rwlock_wrlock(&s->state_lock);
+    state_wrlock(s);
 
     lr_file *f = state_find_file(s, path);
     if (!f) {
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return -ENOENT;
     }
 
-    int rc = truncate(f->real_path, size);
+    char real[PATH_MAX];
+    int rc = truncate(state_real_path(s, f, real, sizeof(real)), size);
     if (rc != 0) {
         int saved = errno;
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return -saved;
     }
+    if (s->fdcache)
+        fdcache_invalidate(s->fdcache, f);
 
+    uint32_t old_start  = f->parity_pos_start;
     uint32_t old_blocks = f->block_count;
-    uint32_t new_blocks = blocks_for_size((uint64_t)size, s->cfg.block_size);
+    uint32_t new_blocks = state_file_blocks(s, f->drive_idx, (uint64_t)size);
 
+    state_account_free(s, f->drive_idx, (int64_t)size - f->size);
     f->size        = (int64_t)size;
     f->block_count = new_blocks;
+    state_touch_file(f);
+    metalog_file(s, f);
 
     lr_pos_allocator *pa = &s->drives[f->drive_idx].pos_alloc;
     if (new_blocks > old_blocks) {
@@ -1192,7 +1201,7 @@ static int lr_truncate(const char *path, off_t size,
         if (old_blocks == 0) {
             uint32_t new_pos = alloc_positions(pa, new_blocks);
             if (new_pos == UINT32_MAX) {
-                pthread_rwlock_unlock(&s->state_lock);
+                state_unlock(s);
                 return -ENOSPC;
             }
             f->parity_pos_start = new_pos;
@@ -1203,12 +1212,16 @@ static int lr_truncate(const char *path, off_t size,
             dirty_count = new_blocks - old_blocks;
             pa->next_free += dirty_count;
         } else {
+            /* The vacated positions no longer hold this drive's data */
+            if (s->journal)
+                journal_mark_dirty_range(s->journal, f->parity_pos_start,
+                                         old_blocks);
             free_positions(pa, f->parity_pos_start, old_blocks);
             uint32_t new_pos = alloc_positions(pa, new_blocks);
             if (new_pos == UINT32_MAX) {
                 f->block_count = 0;
-                state_rebuild_pos_index(s, f->drive_idx);
-                pthread_rwlock_unlock(&s->state_lock);
+                state_pos_index_update(s, f, old_start, old_blocks);
+                state_unlock(s);
                 return -ENOSPC;
             }
             f->parity_pos_start = new_pos;
@@ -1227,9 +1240,9 @@ static int lr_truncate(const char *path, off_t size,
                        old_blocks - new_blocks);
     }
 
-    state_rebuild_pos_index(s, f->drive_idx);
+    state_pos_index_update(s, f, old_start, old_blocks);
 
-    pthread_rwlock_unlock(&s->state_lock);
+    state_unlock(s);
     return 0;
 }
 
@@ -1243,19 +1256,19 @@ static int lr_statfs(const char *path, struct statvfs *sv)
 
     memset(sv, 0, sizeof(*sv));
 
-    pthread_rwlock_rdlock(&s->state_lock);
+    state_rdlock(s);
     unsigned count = s->drive_count;
-    pthread_rwlock_unlock(&s->state_lock);
+    state_unlock(s);
 
     /* Accumulate in bytes so drives with different f_frsize are comparable */
     uint64_t total_bytes = 0, free_bytes = 0, avail_bytes = 0;
     unsigned long bsize = 4096;
 
     for (unsigned i = 0; i < count; i++) {
-        pthread_rwlock_rdlock(&s->state_lock);
+        state_rdlock(s);
         char dir[PATH_MAX];
         snprintf(dir, sizeof(dir), "%s", s->drives[i].dir);
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
 
         struct statvfs dsv;
         if (statvfs(dir, &dsv) == 0) {
@@ -1285,12 +1298,12 @@ static int lr_utimens(const char *path, const struct timespec ts[2],
     (void)fi;
     lr_state *s = g_state;
 
-    pthread_rwlock_wrlock(&s->state_lock);
+    state_wrlock(s);
 
     lr_file *f = state_find_file(s, path);
     if (f) {
         char real[PATH_MAX];
-        snprintf(real, sizeof(real), "%s", f->real_path);
+        state_real_path(s, f, real, sizeof(real));
         int rc = utimensat(AT_FDCWD, real, ts, 0);
         if (rc == 0) {
             struct stat st;
@@ -1298,8 +1311,9 @@ static int lr_utimens(const char *path, const struct timespec ts[2],
                 f->mtime_sec  = st.st_mtim.tv_sec;
                 f->mtime_nsec = st.st_mtim.tv_nsec;
             }
+            metalog_file(s, f);
         }
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return rc ? -errno : 0;
     }
 
@@ -1309,7 +1323,8 @@ static int lr_utimens(const char *path, const struct timespec ts[2],
         if (sl) {
             sl->mtime_sec  = ts[1].tv_sec;
             sl->mtime_nsec = ts[1].tv_nsec;
-            pthread_rwlock_unlock(&s->state_lock);
+            metalog_symlink(s, sl);
+            state_unlock(s);
             return 0;
         }
     }
@@ -1317,7 +1332,7 @@ static int lr_utimens(const char *path, const struct timespec ts[2],
     /* Directory: apply to every drive that has it, update dir_table */
     if (is_any_dir(s, path)) {
         lr_dir *d = dir_get_or_create(s, path);
-        unsigned count = s->drive_count;
+        unsigned count = state_drive_slots(s);
         int ret = -ENOENT;
         for (unsigned i = 0; i < count; i++) {
             char real[PATH_MAX];
@@ -1343,11 +1358,13 @@ static int lr_utimens(const char *path, const struct timespec ts[2],
             }
             ret = 0;
         }
-        pthread_rwlock_unlock(&s->state_lock);
+        if (d)
+            metalog_dir(s, d);
+        state_unlock(s);
         return ret;
     }
 
-    pthread_rwlock_unlock(&s->state_lock);
+    state_unlock(s);
     return -ENOENT;
 }
 
@@ -1360,29 +1377,31 @@ static int lr_chmod(const char *path, mode_t mode,
     (void)fi;
     lr_state *s = g_state;
 
-    pthread_rwlock_wrlock(&s->state_lock);
+    state_wrlock(s);
 
     lr_file *f = state_find_file(s, path);
     if (f) {
         char real[PATH_MAX];
-        snprintf(real, sizeof(real), "%s", f->real_path);
+        state_real_path(s, f, real, sizeof(real));
         int rc = chmod(real, mode);
-        if (rc == 0)
+        if (rc == 0) {
             f->mode = (f->mode & ~(mode_t)07777) | (mode & 07777);
-        pthread_rwlock_unlock(&s->state_lock);
+            metalog_file(s, f);
+        }
+        state_unlock(s);
         return rc ? -errno : 0;
     }
 
     /* Symlink: chmod has no meaning; accept silently */
     if (state_find_symlink(s, path)) {
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return 0;
     }
 
     /* Directory: apply to every drive that has it, update dir_table */
     if (is_any_dir(s, path)) {
         lr_dir *d = dir_get_or_create(s, path);
-        unsigned count = s->drive_count;
+        unsigned count = state_drive_slots(s);
         int ret = -ENOENT;
         for (unsigned i = 0; i < count; i++) {
             char real[PATH_MAX];
@@ -1395,15 +1414,17 @@ static int lr_chmod(const char *path, mode_t mode,
                     ret = -errno;
             }
         }
-        if (d)
+        if (d) {
             d->mode = (d->mode & ~(mode_t)07777) | (mode & 07777);
+            metalog_dir(s, d);
+        }
         if (ret == -ENOENT && is_virtual_dir(s, path))
             ret = 0;
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return ret;
     }
 
-    pthread_rwlock_unlock(&s->state_lock);
+    state_unlock(s);
     return -ENOENT;
 }
 
@@ -1416,18 +1437,19 @@ static int lr_chown(const char *path, uid_t uid, gid_t gid,
     (void)fi;
     lr_state *s = g_state;
 
-    pthread_rwlock_wrlock(&s->state_lock);
+    state_wrlock(s);
 
     lr_file *f = state_find_file(s, path);
     if (f) {
         char real[PATH_MAX];
-        snprintf(real, sizeof(real), "%s", f->real_path);
+        state_real_path(s, f, real, sizeof(real));
         int rc = lchown(real, uid, gid);
         if (rc == 0) {
             if (uid != (uid_t)-1) f->uid = uid;
             if (gid != (gid_t)-1) f->gid = gid;
+            metalog_file(s, f);
         }
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return rc ? -errno : 0;
     }
 
@@ -1437,7 +1459,8 @@ static int lr_chown(const char *path, uid_t uid, gid_t gid,
         if (sl) {
             if (uid != (uid_t)-1) sl->uid = uid;
             if (gid != (gid_t)-1) sl->gid = gid;
-            pthread_rwlock_unlock(&s->state_lock);
+            metalog_symlink(s, sl);
+            state_unlock(s);
             return 0;
         }
     }
@@ -1445,7 +1468,7 @@ static int lr_chown(const char *path, uid_t uid, gid_t gid,
     /* Directory: apply to every drive that has it, update dir_table */
     if (is_any_dir(s, path)) {
         lr_dir *d = dir_get_or_create(s, path);
-        unsigned count = s->drive_count;
+        unsigned count = state_drive_slots(s);
         int ret = -ENOENT;
         for (unsigned i = 0; i < count; i++) {
             char real[PATH_MAX];
@@ -1461,14 +1484,15 @@ static int lr_chown(const char *path, uid_t uid, gid_t gid,
         if (d) {
             if (uid != (uid_t)-1) d->uid = uid;
             if (gid != (gid_t)-1) d->gid = gid;
+            metalog_dir(s, d);
         }
         if (ret == -ENOENT && is_virtual_dir(s, path))
             ret = 0;
-        pthread_rwlock_unlock(&s->state_lock);
+        state_unlock(s);
         return ret;
     }
 
-    pthread_rwlock_unlock(&s->state_lock);
+    state_unlock(s);
     return -ENOENT;
 }
 
@@ -1496,18 +1520,22 @@ static int lr_fsync(const char *path, int datasync,
     if (fdatasync(fh->fd) != 0)
         return -errno;
 
-    /* Also flush any dirty parity positions for this file so the caller's
-     * durability guarantee extends to parity as well. */
+    /* Also flush this file's dirty parity positions so the caller's
+     * durability guarantee extends to parity as well.  Only its own range
+     * is processed; other files' backlog stays with the worker. */
     if (s->journal) {
-        pthread_rwlock_rdlock(&s->state_lock);
+        state_rdlock(s);
         lr_file *f = state_find_file(s, fh->vpath);
-        uint32_t pos_start  = f ? f->parity_pos_start : 0;
-        uint32_t block_count = f ? f->block_count      : 0;
-        pthread_rwlock_unlock(&s->state_lock);
+        uint32_t pos_start = 0, block_count = 0;
+        if (f) {
+            state_lock_drive(s, f->drive_idx);
+            pos_start   = f->parity_pos_start;
+            block_count = f->block_count;
+            state_unlock_drive(s, f->drive_idx);
+        }
+        state_unlock(s);
 
-        if (block_count > 0)
-            journal_mark_dirty_range(s->journal, pos_start, block_count);
-        journal_flush(s->journal);
+        journal_flush_range(s->journal, pos_start, block_count);
     }
 
     return 0;
@@ -1516,30 +1544,56 @@ static int lr_fsync(const char *path, int datasync,
 /*--------------------------------------------------------------------
  * write
  *------------------------------------------------------------------*/
-static int lr_write2(const char *path, const char *buf, size_t size,
-                     off_t offset, struct fuse_file_info *fi)
-{
-    (void)path;
-    lr_fh_t *fh = (lr_fh_t *)(uintptr_t)fi->fh;
 
-    if (fh->fd < 0)
-        return -EIO;
+/* Would journal_delta_capture record anything for this write?  A cheap
+ * early answer for write_buf, which would otherwise splice the bytes
+ * straight to the drive without them ever being in memory.  A stale
+ * answer is harmless: blocks without a delta get a dirty bit. */
+static int delta_applies(lr_state *s, lr_fh_t *fh, size_t size, off_t offset)
+{
+    lr_journal *j  = s->journal;
+    uint32_t    bs = s->cfg.block_size;
 
-    lr_state *s = g_state;
+    if (!j || j->delta_budget == 0 || size == 0 || !s->parity ||
+        s->parity->levels == 0)
+        return 0;
+    uint32_t first = (uint32_t)(offset / bs);
+    uint32_t last  = (uint32_t)((offset + (off_t)size - 1) / bs);
+    if (last - first + 1 > LR_DELTA_MAX_BLOCKS)
+        return 0;
 
-    ssize_t n = pwrite(fh->fd, buf, size, offset);
-    if (n < 0)
-        return -errno;
+    int covered = 0;
+    state_rdlock(s);
+    lr_file *f = state_find_file(s, fh->vpath);
+    if (f) {
+        state_lock_drive(s, f->drive_idx);
+        covered = first < f->block_count;
+        state_unlock_drive(s, f->drive_idx);
+    }
+    state_unlock(s);
+    return covered;
+}
 
+/* Account for n bytes written at offset: grow the file's size and
+ * positions and mark the parity of the blocks without a delta dirty. */
+static void write_account(lr_state *s, lr_fh_t *fh, off_t offset, ssize_t n,
+                          lr_delta_span *ds)
+{
+    if (n <= 0)
+        return;
     int64_t new_end = (int64_t)(offset + n);
 
-    pthread_rwlock_wrlock(&s->state_lock);
+    /* Size and positions are the drive lock's: writers to files on other
+     * drives run this concurrently under the read lock */
+    state_rdlock(s);
     lr_file *f = state_find_file(s, fh->vpath);
     if (f) {
+        state_lock_drive(s, f->drive_idx);
         uint32_t bs         = s->cfg.block_size;
+        uint32_t old_start  = f->parity_pos_start;
         uint32_t old_blocks = f->block_count;
-        uint32_t new_blocks = blocks_for_size(
-                (uint64_t)(new_end > f->size ? new_end : f->size), bs);
+        uint32_t new_blocks = state_file_blocks(s, f->drive_idx,
+                (uint64_t)(new_end > f->size ? new_end : f->size));
         uint32_t dirty_start = 0, dirty_count = 0;
 
         lr_pos_allocator *pa = &s->drives[f->drive_idx].pos_alloc;
@@ -1556,20 +1610,24 @@ static int lr_write2(const char *path, const char *buf, size_t size,
                     dirty_start = f->parity_pos_start;
                     dirty_count = new_blocks;
                     f->block_count = new_blocks;
-                    state_rebuild_pos_index(s, f->drive_idx);
+                    state_pos_index_update(s, f, old_start, old_blocks);
                 }
             } else if (f->parity_pos_start + old_blocks == pa->next_free) {
                 dirty_start = f->parity_pos_start + old_blocks;
                 dirty_count = new_blocks - old_blocks;
                 pa->next_free += dirty_count;
                 f->block_count = new_blocks;
-                state_rebuild_pos_index(s, f->drive_idx);
+                state_pos_index_update(s, f, old_start, old_blocks);
             } else {
+                /* The vacated positions no longer hold this drive's data */
+                if (s->journal)
+                    journal_mark_dirty_range(s->journal, f->parity_pos_start,
+                                             old_blocks);
                 free_positions(pa, f->parity_pos_start, old_blocks);
                 uint32_t new_pos = alloc_positions(pa, new_blocks);
                 if (new_pos == UINT32_MAX) {
                     f->block_count = 0;
-                    state_rebuild_pos_index(s, f->drive_idx);
+                    state_pos_index_update(s, f, old_start, old_blocks);
                     fprintf(stderr, "liveraid: parity namespace exhausted for %s\n",
                             fh->vpath);
                 } else {
@@ -1577,13 +1635,21 @@ static int lr_write2(const char *path, const char *buf, size_t size,
                     dirty_start = f->parity_pos_start;
                     dirty_count = new_blocks;
                     f->block_count = new_blocks;
-                    state_rebuild_pos_index(s, f->drive_idx);
+                    state_pos_index_update(s, f, old_start, old_blocks);
                 }
             }
         }
 
-        if (new_end > f->size)
+        int grew = new_end > f->size;
+        if (grew) {
+            state_account_free(s, f->drive_idx, new_end - f->size);
             f->size = new_end;
+        }
+        /* A new second of mtime is logged; the nanoseconds ride along
+         * with the next record or snapshot */
+        int touched = state_touch_file(f);
+        int changed = touched || grew || f->block_count != old_blocks ||
+                      f->parity_pos_start != old_start;
 
         if (f->block_count > 0 && s->journal) {
             if (dirty_count > 0)
@@ -1591,17 +1657,191 @@ static int lr_write2(const char *path, const char *buf, size_t size,
 
             uint32_t first_blk = (uint32_t)(offset / bs);
             uint32_t last_blk  = (uint32_t)((offset + n - 1) / bs);
-            if (last_blk < f->block_count)
-                journal_mark_dirty_range(s->journal,
-                                         f->parity_pos_start + first_blk,
-                                         last_blk - first_blk + 1);
+
+            /* Deltas only stand if the file kept its positions */
+            if (ds->pos_start != f->parity_pos_start)
+                ds->mask = 0;
+
+            if (!ds->mask) {
+                if (last_blk < f->block_count)
+                    journal_mark_dirty_range(s->journal,
+                                             f->parity_pos_start + first_blk,
+                                             last_blk - first_blk + 1);
+            } else {
+                for (uint32_t b = first_blk;
+                     b <= last_blk && b < f->block_count; b++) {
+                    if (!(ds->mask & ((uint32_t)1 << (b - first_blk))))
+                        journal_mark_dirty_range(s->journal,
+                                                 f->parity_pos_start + b, 1);
+                }
+            }
         }
+        state_unlock_drive(s, f->drive_idx);
+        if (changed)
+            metalog_file(s, f);
+    }
+    state_unlock(s);
+}
+
+static int lr_write2(const char *path, const char *buf, size_t size,
+                     off_t offset, struct fuse_file_info *fi)
+{
+    (void)path;
+    lr_fh_t *fh = (lr_fh_t *)(uintptr_t)fi->fh;
+
+    if (fh->fd < 0)
+        return -EIO;
+
+    lr_state *s = g_state;
+
+    /* Backpressure: wait here, holding nothing, while the parity backlog
+     * is over its cap.  Writes to the cache tier add none. */
+    if (s->journal && !state_is_cache(s, fh->drive))
+        journal_throttle(s->journal);
+
+    lr_delta_span ds;
+    memset(&ds, 0, sizeof(ds));
+    if (s->journal)
+        journal_delta_capture(s->journal, fh->vpath, fh->fd, buf, size,
+                              offset, &ds);
+
+    ssize_t n = pwrite(fh->fd, buf, size, offset);
+    int saved = errno;
+    stats_dev_io(s->stats, fh->drive, 1, n);
+    if (s->journal)
+        journal_delta_release(s->journal, &ds);
+
+    /* A delta discarded before the bytes landed (a concurrent write marked
+     * the position dirty), or a recompute that may have read the old bytes,
+     * leaves the parity stale: its block gets a dirty bit like any other */
+    for (uint32_t b = 0; ds.mask && b < LR_DELTA_MAX_BLOCKS; b++)
+        if ((ds.mask & ((uint32_t)1 << b)) &&
+            !journal_delta_kept(s->journal, ds.pos_start + ds.first_blk + b,
+                                ds.gen[b]))
+            ds.mask &= ~((uint32_t)1 << b);
+    if (ds.begun)
+        journal_delta_end(s->journal, ds.begun);
+
+    /* The recorded deltas assumed the whole buffer landed on disk */
+    if (ds.mask && n != (ssize_t)size) {
+        for (uint32_t b = 0; b < LR_DELTA_MAX_BLOCKS; b++)
+            if (ds.mask & ((uint32_t)1 << b))
+                journal_mark_dirty_range(s->journal,
+                                         ds.pos_start + ds.first_blk + b, 1);
+        ds.mask = 0;
+    }
+    if (n < 0)
+        return -saved;
+
+    write_account(s, fh, offset, n, &ds);
+    return (int)n;
+}
+
+/*
+ * write_buf: with splice_write, libfuse hands us the request's pipe and
+ * the bytes go from /dev/fuse to the drive without a userspace copy.
+ * Overwrites that record delta parity need old XOR new, so those (small)
+ * writes are copied into memory and take the lr_write2 path.
+ */
+static int lr_write_buf(const char *path, struct fuse_bufvec *src,
+                        off_t offset, struct fuse_file_info *fi)
+{
+    lr_fh_t  *fh   = (lr_fh_t *)(uintptr_t)fi->fh;
+    lr_state *s    = g_state;
+    size_t    size = fuse_buf_size(src);
+
+    if (fh->fd < 0)
+        return -EIO;
+
+    if (delta_applies(s, fh, size, offset)) {
+        char *mem = malloc(size);
+        if (!mem)
+            return -ENOMEM;
+        struct fuse_bufvec tmp = FUSE_BUFVEC_INIT(size);
+        tmp.buf[0].mem = mem;
+        ssize_t got = fuse_buf_copy(&tmp, src, 0);
+        int rc = got < 0 ? (int)got
+                         : lr_write2(path, mem, (size_t)got, offset, fi);
+        free(mem);
+        return rc;
     }
-    pthread_rwlock_unlock(&s->state_lock);
 
+    if (s->journal && !state_is_cache(s, fh->drive))
+        journal_throttle(s->journal);
+
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    dst.buf[0].fd    = fh->fd;
+    dst.buf[0].pos   = offset;
+    ssize_t n = fuse_buf_copy(&dst, src, FUSE_BUF_SPLICE_NONBLOCK);
+    stats_dev_io(s->stats, fh->drive, 1, n);
+    if (n < 0)
+        return (int)n;
+
+    lr_delta_span ds;
+    memset(&ds, 0, sizeof(ds));
+    write_account(s, fh, offset, n, &ds);
     return (int)n;
 }
 
+/*--------------------------------------------------------------------
+ * init
+ *
+ * Every change to the drives goes through these handlers, so the kernel
+ * may cache attributes and names for as long as configured: its own
+ * writes, truncates, renames and unlinks update or drop what it cached.
+ *------------------------------------------------------------------*/
+static void *lr_init(struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+    lr_state *s = g_state;
+
+    /* libfuse names these from the device's side: SPLICE_WRITE splices
+     * read replies into /dev/fuse, SPLICE_READ splices write requests out
+     * of it */
+    const unsigned reads  = FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+    const unsigned writes = FUSE_CAP_SPLICE_READ;
+    if (s->cfg.splice_read)
+        conn->want |= conn->capable & reads;
+    else
+        conn->want &= ~reads;
+    if (s->cfg.splice_write)
+        conn->want |= conn->capable & writes;
+    else
+        conn->want &= ~writes;
+
+    cfg->attr_timeout     = (double)s->cfg.attr_timeout_s;
+    cfg->entry_timeout    = (double)s->cfg.entry_timeout_s;
+    cfg->negative_timeout = (double)s->cfg.negative_timeout_s;
+
+    /* Mount profile: the kernel caps both at what it supports */
+    conn->max_write = s->cfg.max_write_kb * 1024;
+    if (s->cfg.max_readahead_kb)
+        conn->max_readahead = s->cfg.max_readahead_kb * 1024;
+
+    /* Write-back caching: the kernel gathers small writes into pages and
+     * sends them later.  Every byte still goes through lr_write and fsync
+     * still flushes, so parity is kept as before; what is only in the page
+     * cache is lost in a crash, as on any cached filesystem. */
+    s->writeback_cache = 0;
+    if (s->cfg.writeback_cache) {
+        if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+            conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+            s->writeback_cache = 1;
+        } else {
+            fprintf(stderr, "liveraid: kernel does not support "
+                            "writeback_cache, leaving it off\n");
+        }
+    } else {
+        conn->want &= ~FUSE_CAP_WRITEBACK_CACHE;
+    }
+#if !(FUSE_MAJOR_VERSION > 3 || (FUSE_MAJOR_VERSION == 3 && FUSE_MINOR_VERSION >= 15))
+    if (s->cfg.parallel_direct_writes)
+        fprintf(stderr, "liveraid: parallel_direct_writes needs libfuse "
+                        "3.15, leaving it off\n");
+#endif
+    return fuse_get_context()->private_data;
+}
+
 /*--------------------------------------------------------------------
  * destroy
  *------------------------------------------------------------------*/
@@ -1619,6 +1859,37 @@ static void lr_destroy(void *private_data)
         s->ctrl = NULL;
     }
 
+    /* The mover and compaction mark and flush through the journal: stop
+     * them after the move in progress */
+    if (s->mover) {
+        mover_done(s->mover);
+        free(s->mover);
+        s->mover = NULL;
+    }
+    if (s->compact) {
+        compact_done(s->compact);
+        free(s->compact);
+        s->compact = NULL;
+    }
+
+    /* The scrubber runs on the journal's pool: stop it (at the end of the
+     * current slice, checkpointing the pass) before the journal goes */
+    if (s->scrub) {
+        if (s->journal)
+            journal_set_scrub(s->journal, NULL);
+        scrub_done(s->scrub);
+        free(s->scrub);
+        s->scrub = NULL;
+    }
+
+    /* Readahead recovers through parity and checks the journal: stop it
+     * before either goes away */
+    if (s->rcache) {
+        rcache_done(s->rcache);
+        free(s->rcache);
+        s->rcache = NULL;
+    }
+
     if (s->journal) {
         journal_flush(s->journal);
         journal_done(s->journal);
@@ -1629,36 +1900,135 @@ static void lr_destroy(void *private_data)
     metadata_save(s);
     s->metadata_saved = 1;
 
+    /* The final snapshot emptied the change log */
+    if (s->mlog) {
+        metalog_done(s->mlog);
+        free(s->mlog);
+        s->mlog = NULL;
+    }
+
     if (s->parity) {
         parity_close(s->parity);
         free(s->parity);
         s->parity = NULL;
     }
+
+    if (s->fdcache) {
+        fdcache_done(s->fdcache);
+        free(s->fdcache);
+        s->fdcache = NULL;
+    }
+
+    if (s->io) {
+        io_done(s->io);
+        free(s->io);
+        s->io = NULL;
+    }
 }
 
 /*--------------------------------------------------------------------
  * ops table
  *------------------------------------------------------------------*/
+/*--------------------------------------------------------------------
+ * Metrics
+ *
+ * The ops table points at wrappers that record each call's latency and
+ * result in s->stats (see stats.h).  Handlers calling one another
+ * (read_buf -> lr_read, write_buf -> lr_write2) are counted once.
+ *------------------------------------------------------------------*/
+#define TIMED(op, fn, params, args)                 \
+    static int timed_##fn params                    \
+    {                                               \
+        uint64_t t0 = stats_now_ns();               \
+        int      rc = fn args;                      \
+        stats_op(g_state->stats, op, t0, rc);       \
+        return rc;                                  \
+    }
+
+TIMED(LR_OP_GETATTR, lr_getattr,
+      (const char *path, struct stat *st, struct fuse_file_info *fi),
+      (path, st, fi))
+TIMED(LR_OP_READDIR, lr_readdir,
+      (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+       struct fuse_file_info *fi, enum fuse_readdir_flags flags),
+      (path, buf, filler, offset, fi, flags))
+TIMED(LR_OP_OPEN, lr_open,
+      (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED(LR_OP_RELEASE, lr_release,
+      (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED(LR_OP_READ, lr_read,
+      (const char *path, char *buf, size_t size, off_t offset,
+       struct fuse_file_info *fi),
+      (path, buf, size, offset, fi))
+TIMED(LR_OP_READ_BUF, lr_read_buf,
+      (const char *path, struct fuse_bufvec **bufp, size_t size,
+       off_t offset, struct fuse_file_info *fi),
+      (path, bufp, size, offset, fi))
+TIMED(LR_OP_WRITE, lr_write2,
+      (const char *path, const char *buf, size_t size, off_t offset,
+       struct fuse_file_info *fi),
+      (path, buf, size, offset, fi))
+TIMED(LR_OP_WRITE_BUF, lr_write_buf,
+      (const char *path, struct fuse_bufvec *src, off_t offset,
+       struct fuse_file_info *fi),
+      (path, src, offset, fi))
+TIMED(LR_OP_CREATE, lr_create,
+      (const char *path, mode_t mode, struct fuse_file_info *fi),
+      (path, mode, fi))
+TIMED(LR_OP_UNLINK, lr_unlink, (const char *path), (path))
+TIMED(LR_OP_RENAME, lr_rename,
+      (const char *from, const char *to, unsigned int flags),
+      (from, to, flags))
+TIMED(LR_OP_SYMLINK, lr_do_symlink,
+      (const char *target, const char *link_path), (target, link_path))
+TIMED(LR_OP_READLINK, lr_readlink,
+      (const char *path, char *buf, size_t size), (path, buf, size))
+TIMED(LR_OP_MKDIR, lr_mkdir, (const char *path, mode_t mode), (path, mode))
+TIMED(LR_OP_RMDIR, lr_rmdir, (const char *path), (path))
+TIMED(LR_OP_TRUNCATE, lr_truncate,
+      (const char *path, off_t size, struct fuse_file_info *fi),
+      (path, size, fi))
+TIMED(LR_OP_STATFS, lr_statfs,
+      (const char *path, struct statvfs *sv), (path, sv))
+TIMED(LR_OP_UTIMENS, lr_utimens,
+      (const char *path, const struct timespec ts[2],
+       struct fuse_file_info *fi),
+      (path, ts, fi))
+TIMED(LR_OP_CHMOD, lr_chmod,
+      (const char *path, mode_t mode, struct fuse_file_info *fi),
+      (path, mode, fi))
+TIMED(LR_OP_CHOWN, lr_chown,
+      (const char *path, uid_t uid, gid_t gid, struct fuse_file_info *fi),
+      (path, uid, gid, fi))
+TIMED(LR_OP_FLUSH, lr_flush,
+      (const char *path, struct fuse_file_info *fi), (path, fi))
+TIMED(LR_OP_FSYNC, lr_fsync,
+      (const char *path, int datasync, struct fuse_file_info *fi),
+      (path, datasync, fi))
+
 const struct fuse_operations lr_fuse_ops = {
-    .getattr  = lr_getattr,
-    .readdir  = lr_readdir,
-    .open     = lr_open,
-    .release  = lr_release,
-    .read     = lr_read,
-    .write    = lr_write2,
-    .create   = lr_create,
-    .unlink   = lr_unlink,
-    .rename   = lr_rename,
-    .symlink  = lr_do_symlink,
-    .readlink = lr_readlink,
-    .mkdir    = lr_mkdir,
-    .rmdir    = lr_rmdir,
-    .truncate = lr_truncate,
-    .statfs   = lr_statfs,
-    .utimens  = lr_utimens,
-    .chmod    = lr_chmod,
-    .chown    = lr_chown,
-    .flush    = lr_flush,
-    .fsync    = lr_fsync,
+    .getattr  = timed_lr_getattr,
+    .readdir  = timed_lr_readdir,
+    .open     = timed_lr_open,
+    .release  = timed_lr_release,
+    .read     = timed_lr_read,
+    .read_buf = timed_lr_read_buf,
+    .write    = timed_lr_write2,
+    .write_buf = timed_lr_write_buf,
+    .create   = timed_lr_create,
+    .unlink   = timed_lr_unlink,
+    .rename   = timed_lr_rename,
+    .symlink  = timed_lr_do_symlink,
+    .readlink = timed_lr_readlink,
+    .mkdir    = timed_lr_mkdir,
+    .rmdir    = timed_lr_rmdir,
+    .truncate = timed_lr_truncate,
+    .statfs   = timed_lr_statfs,
+    .utimens  = timed_lr_utimens,
+    .chmod    = timed_lr_chmod,
+    .chown    = timed_lr_chown,
+    .flush    = timed_lr_flush,
+    .fsync    = timed_lr_fsync,
+    .init     = lr_init,
     .destroy  = lr_destroy,
 };
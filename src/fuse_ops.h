@@ -4,6 +4,14 @@
 #define FUSE_USE_VERSION 35
 #include <fuse.h>
 
+#include <stdint.h>
+
 extern const struct fuse_operations lr_fuse_ops;
 
+/*
+ * rcache fill callback: recover [pos, pos+count) of drive from parity
+ * into s->rcache.  arg is the lr_state.  Returns 0, or -1 on failure.
+ */
+int lr_degraded_fill(void *arg, unsigned drive, uint32_t pos, uint32_t count);
+
 #endif /* LR_FUSE_OPS_H */
@@ -0,0 +1,194 @@
+#include "io.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef LR_HAVE_URING
+#include <liburing.h>
+#endif
+
+/* ------------------------------------------------------------------ */
+/* Sync engine                                                          */
+/* ------------------------------------------------------------------ */
+
+/* Finish req from byte `done` onward with pread/pwrite. */
+static void sync_finish(lr_io_req *r, size_t done)
+{
+    while (done < r->len) {
+        ssize_t n = r->write
+            ? pwrite(r->fd, (char *)r->buf + done, r->len - done,
+                     r->off + (off_t)done)
+            : pread(r->fd, (char *)r->buf + done, r->len - done,
+                    r->off + (off_t)done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            r->res = -errno;
+            return;
+        }
+        if (n == 0)
+            break;          /* EOF (reads) */
+        done += (size_t)n;
+    }
+    r->res = (ssize_t)done;
+}
+
+static void sync_run(lr_io_req *reqs, unsigned n)
+{
+    for (unsigned i = 0; i < n; i++)
+        sync_finish(&reqs[i], 0);
+}
+
+/* ------------------------------------------------------------------ */
+/* io_uring engine                                                      */
+/* ------------------------------------------------------------------ */
+
+#ifdef LR_HAVE_URING
+
+/* Marker stored in the thread key when this thread's ring failed to init */
+static char ring_unusable;
+
+static void ring_free(void *p)
+{
+    if (p && p != &ring_unusable) {
+        io_uring_queue_exit((struct io_uring *)p);
+        free(p);
+    }
+}
+
+static struct io_uring *thread_ring(lr_io *io)
+{
+    void *p = pthread_getspecific(io->ring_key);
+    if (p)
+        return p == &ring_unusable ? NULL : (struct io_uring *)p;
+
+    struct io_uring *ring = malloc(sizeof(*ring));
+    if (ring && io_uring_queue_init(io->depth, ring, 0) != 0) {
+        free(ring);
+        ring = NULL;
+    }
+    pthread_setspecific(io->ring_key, ring ? (void *)ring : &ring_unusable);
+    return ring;
+}
+
+static void uring_run(struct io_uring *ring, unsigned depth,
+                      lr_io_req *reqs, unsigned n)
+{
+    unsigned next = 0, inflight = 0;
+
+    while (next < n || inflight > 0) {
+        /* Fill the submission queue up to depth */
+        while (next < n && inflight < depth) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+            if (!sqe)
+                break;
+            lr_io_req *r = &reqs[next++];
+            if (r->write)
+                io_uring_prep_write(sqe, r->fd, r->buf, (unsigned)r->len,
+                                    r->off);
+            else
+                io_uring_prep_read(sqe, r->fd, r->buf, (unsigned)r->len,
+                                   r->off);
+            io_uring_sqe_set_data(sqe, r);
+            inflight++;
+        }
+        if (io_uring_submit(ring) < 0) {
+            /* Ring broken: finish everything not yet reaped synchronously */
+            for (unsigned i = 0; i < n; i++)
+                if (reqs[i].res == -EINPROGRESS)
+                    sync_finish(&reqs[i], 0);
+            return;
+        }
+
+        struct io_uring_cqe *cqe;
+        int wrc = io_uring_wait_cqe(ring, &cqe);
+        if (wrc == -EINTR)
+            continue;
+        if (wrc < 0) {
+            for (unsigned i = 0; i < n; i++)
+                if (reqs[i].res == -EINPROGRESS)
+                    sync_finish(&reqs[i], 0);
+            return;
+        }
+        lr_io_req *r = (lr_io_req *)io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(ring, cqe);
+        inflight--;
+
+        if (res < 0)
+            r->res = res;
+        else if ((size_t)res < r->len && res > 0)
+            sync_finish(r, (size_t)res);  /* short: continue (rare) */
+        else
+            r->res = res;
+    }
+}
+
+#endif /* LR_HAVE_URING */
+
+/* ------------------------------------------------------------------ */
+/* Public API                                                           */
+/* ------------------------------------------------------------------ */
+
+int io_init(lr_io *io, int engine, unsigned depth)
+{
+    memset(io, 0, sizeof(*io));
+    io->engine = LR_IO_SYNC;
+    io->depth  = depth > 0 ? depth : 1;
+
+    if (engine != LR_IO_URING)
+        return 0;
+
+#ifdef LR_HAVE_URING
+    /* Probe once so an unsupported kernel is reported at mount time */
+    struct io_uring probe;
+    if (io_uring_queue_init(io->depth, &probe, 0) != 0) {
+        fprintf(stderr, "io: io_uring unavailable, using sync I/O\n");
+        return 0;
+    }
+    io_uring_queue_exit(&probe);
+    if (pthread_key_create(&io->ring_key, ring_free) != 0)
+        return -1;
+    io->engine = LR_IO_URING;
+#else
+    fprintf(stderr, "io: built without liburing, using sync I/O\n");
+#endif
+    return 0;
+}
+
+void io_done(lr_io *io)
+{
+#ifdef LR_HAVE_URING
+    if (io->engine == LR_IO_URING) {
+        /* Only the calling thread's ring is reachable here; other threads'
+         * rings were freed by the key destructor when they exited. */
+        ring_free(pthread_getspecific(io->ring_key));
+        pthread_setspecific(io->ring_key, NULL);
+        pthread_key_delete(io->ring_key);
+    }
+#endif
+    memset(io, 0, sizeof(*io));
+}
+
+void io_run(lr_io *io, lr_io_req *reqs, unsigned n)
+{
+    if (n == 0)
+        return;
+#ifdef LR_HAVE_URING
+    if (io && io->engine == LR_IO_URING && n > 1) {
+        struct io_uring *ring = thread_ring(io);
+        if (ring) {
+            for (unsigned i = 0; i < n; i++)
+                reqs[i].res = -EINPROGRESS;
+            uring_run(ring, io->depth, reqs, n);
+            return;
+        }
+    }
+#else
+    (void)io;
+#endif
+    sync_run(reqs, n);
+}
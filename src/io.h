@@ -0,0 +1,54 @@
+#ifndef LR_IO_H
+#define LR_IO_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "config.h"   /* LR_IO_SYNC, LR_IO_URING */
+
+/*
+ * Batched block I/O for the parity paths.
+ *
+ * A caller describes every read (or write) it needs for one step — e.g.
+ * one block from each data drive at a position — as an array of
+ * lr_io_req and hands the whole array to io_run.  With the sync engine the
+ * requests run one after another with pread/pwrite (the historical
+ * behaviour).  With the io_uring engine (built when liburing is found,
+ * LR_HAVE_URING) they are all submitted at once, up to io_depth in flight,
+ * so a position costs roughly the slowest drive's latency instead of the
+ * sum over drives.
+ *
+ * Rings are per thread (created lazily, freed at thread exit), so io_run
+ * may be called concurrently from the drain threads and FUSE threads.
+ */
+
+typedef struct {
+    int     fd;
+    int     write;   /* 0 = read, 1 = write */
+    void   *buf;
+    size_t  len;
+    off_t   off;
+    ssize_t res;     /* out: bytes transferred (reads stop at EOF) or -errno */
+} lr_io_req;
+
+typedef struct lr_io {
+    int           engine;     /* effective engine (LR_IO_*) */
+    unsigned      depth;      /* max requests in flight per ring */
+    pthread_key_t ring_key;   /* per-thread ring (LR_IO_URING only) */
+} lr_io;
+
+/*
+ * Initialise with the requested engine.  If io_uring is requested but not
+ * compiled in or not usable on this kernel, warns and falls back to sync.
+ */
+int  io_init(lr_io *io, int engine, unsigned depth);
+void io_done(lr_io *io);
+
+/*
+ * Execute reqs[0..n-1] and fill in each res.  Short transfers are
+ * continued until len or EOF.  io may be NULL (sync engine).
+ */
+void io_run(lr_io *io, lr_io_req *reqs, unsigned n);
+
+#endif /* LR_IO_H */
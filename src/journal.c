@@ -1,7 +1,13 @@
+#define _GNU_SOURCE   /* for pthread_rwlockattr_setkind_np */
 #include "journal.h"
 #include "state.h"
 #include "parity.h"
 #include "metadata.h"
+#include "metalog.h"
+#include "pool.h"
+#include "rcache.h"
+#include "throttle.h"
+#include "wal.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,28 +18,168 @@
 #include <unistd.h>
 
 /* ------------------------------------------------------------------ */
-/* Bitmap helpers                                                       */
+/* Delta table                                                          */
 /* ------------------------------------------------------------------ */
 
-static void bitmap_ensure(lr_journal *j, uint32_t pos)
+/* Pending delta (old XOR new) for one drive's block at one position */
+typedef struct lr_delta {
+    uint32_t     pos;
+    unsigned     drive;
+    uint8_t     *buf;       /* block_size bytes */
+    lr_hash_node hash_node;
+    lr_list_node list_node;
+} lr_delta;
+
+#define DELTA_ANY_DRIVE UINT32_MAX
+
+typedef struct { uint32_t pos; unsigned drive; } delta_key;
+
+static inline uint32_t delta_hash(uint32_t pos)
+{
+    return pos * 2654435761u;
+}
+
+static int delta_cmp(const void *arg, const void *obj)
+{
+    const delta_key *k = (const delta_key *)arg;
+    const lr_delta  *d = (const lr_delta *)obj;
+    if (d->pos != k->pos)
+        return 1;
+    return k->drive != DELTA_ANY_DRIVE && d->drive != k->drive;
+}
+
+static lr_delta *delta_find(const lr_hash *h, uint32_t pos, unsigned drive)
+{
+    delta_key k = { pos, drive };
+    return lr_hash_search(h, delta_hash(pos), delta_cmp, &k);
+}
+
+static void delta_free(lr_journal *j, lr_delta *d)
+{
+    __atomic_sub_fetch(&j->delta_bytes, j->state->cfg.block_size,
+                       __ATOMIC_SEQ_CST);
+    free(d->buf);
+    free(d);
+}
+
+/* A delta at pos was discarded unapplied: its writer, if still between
+ * capture and write, must mark pos dirty (journal_delta_kept). */
+static void delta_dropped(lr_journal *j, uint32_t pos)
+{
+    __atomic_add_fetch(&j->delta_drops[pos % LR_DELTA_STRIPES], 1,
+                       __ATOMIC_SEQ_CST);
+}
+
+/* Discard pending deltas at pos (a full recompute supersedes them).
+ * Caller holds bitmap_lock. */
+static void delta_drop(lr_journal *j, uint32_t pos)
 {
-    uint32_t word = pos / 64;
-    if (word >= j->bitmap_words) {
-        uint32_t new_words = (word + 1) * 2;
-        uint64_t *p = realloc(j->bitmap, new_words * sizeof(uint64_t));
-        if (!p)
-            return;
-        memset(p + j->bitmap_words, 0,
-               (new_words - j->bitmap_words) * sizeof(uint64_t));
-        j->bitmap       = p;
-        j->bitmap_words = new_words;
+    lr_delta *d;
+    while ((d = delta_find(&j->delta_table, pos, DELTA_ANY_DRIVE)) != NULL) {
+        lr_hash_remove(&j->delta_table, &d->hash_node);
+        lr_list_remove(&j->delta_list, &d->list_node);
+        delta_free(j, d);
+        delta_dropped(j, pos);
     }
 }
 
-static void bitmap_set(lr_journal *j, uint32_t pos)
+/* 1 if pos lies in the range being flushed.  Caller holds bitmap_lock. */
+static inline int in_flush(const lr_journal *j, uint32_t pos)
 {
-    bitmap_ensure(j, pos);
-    j->bitmap[pos / 64] |= (uint64_t)1 << (pos % 64);
+    return j->flush_count > 0 && pos - j->flush_start < j->flush_count;
+}
+
+/* ------------------------------------------------------------------ */
+/* Scheduling                                                           */
+/* ------------------------------------------------------------------ */
+
+/* Writes pausing this long count as idle: drain now.  Also the period at
+ * which the worker re-checks while anything is dirty. */
+#define DRAIN_IDLE_MS 50
+
+#define MS_NS 1000000ull
+
+static void deadline_in(struct timespec *ts, unsigned ms)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec  += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/* Record a write.  Returns 1 for the first one since the last take: the
+ * caller then wakes the worker so it starts watching for idle. */
+static int note_write(lr_journal *j)
+{
+    uint64_t now  = throttle_now_ns();
+    uint64_t zero = 0;
+    __atomic_store_n(&j->last_mark_ns, now, __ATOMIC_RELAXED);
+    return __atomic_compare_exchange_n(&j->dirty_since_ns, &zero, now, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/* Undrained parity work in bytes: dirty and in-flight positions, plus
+ * the memory of pending deltas */
+static uint64_t backlog_bytes(const lr_journal *j)
+{
+    uint64_t positions = dbitmap_count(&j->dirty) +
+                         __atomic_load_n(&j->drain_left, __ATOMIC_SEQ_CST);
+    return positions * j->state->cfg.block_size +
+           __atomic_load_n(&j->delta_bytes, __ATOMIC_SEQ_CST);
+}
+
+/* When the oldest undrained write was made; 0 = nothing undrained.  A
+ * range flush can empty `dirty` behind dirty_since_ns, hence the checks. */
+static uint64_t oldest_ns(const lr_journal *j)
+{
+    uint64_t oldest = 0;
+    if (__atomic_load_n(&j->processing, __ATOMIC_SEQ_CST))
+        oldest = __atomic_load_n(&j->batch_since_ns, __ATOMIC_SEQ_CST);
+    uint64_t since = __atomic_load_n(&j->dirty_since_ns, __ATOMIC_SEQ_CST);
+    if (since && (!dbitmap_empty(&j->dirty) ||
+                  __atomic_load_n(&j->delta_bytes, __ATOMIC_SEQ_CST) > 0) &&
+        (!oldest || since < oldest))
+        oldest = since;
+    return oldest;
+}
+
+static uint64_t age_ns(const lr_journal *j, uint64_t now)
+{
+    uint64_t oldest = oldest_ns(j);
+    return oldest && now > oldest ? now - oldest : 0;
+}
+
+/* 1 if writers must wait for the drain (journal_throttle) */
+static int over_cap(const lr_journal *j, uint64_t now)
+{
+    return (j->max_dirty_bytes && backlog_bytes(j) >= j->max_dirty_bytes) ||
+           (j->max_age_ns && age_ns(j, now) >= j->max_age_ns);
+}
+
+/*
+ * 1 if the worker should take a batch now.  Drain at once when writes
+ * have paused or someone is waiting; under sustained writes let the batch
+ * grow (longer runs coalesce better) until it is interval_ms old or has
+ * reached half of a cap, so writers rarely hit the cap itself.  Caller
+ * holds bitmap_lock.
+ */
+static int drain_due(const lr_journal *j, uint64_t now)
+{
+    if (dbitmap_empty(&j->dirty) && j->delta_list.count == 0)
+        return 0;
+    if (j->waiters > 0)
+        return 1;
+    uint64_t last = __atomic_load_n(&j->last_mark_ns, __ATOMIC_RELAXED);
+    if (now - last >= DRAIN_IDLE_MS * MS_NS)
+        return 1;
+    uint64_t since = __atomic_load_n(&j->dirty_since_ns, __ATOMIC_SEQ_CST);
+    uint64_t age   = since && now > since ? now - since : 0;
+    return age >= (uint64_t)j->interval_ms * MS_NS ||
+           (j->max_age_ns && age * 2 >= j->max_age_ns) ||
+           (j->max_dirty_bytes && backlog_bytes(j) * 2 >= j->max_dirty_bytes);
 }
 
 /* ------------------------------------------------------------------ */
@@ -47,67 +193,159 @@ static void bitmap_set(lr_journal *j, uint32_t pos)
  *   bitmap data      uint64_t[bitmap_words]
  */
 
-static void journal_bitmap_save(lr_journal *j)
+/* A copy of the dirty set, taken under bitmap_lock */
+typedef struct {
+    lr_journal *j;
+    uint64_t   *copy;
+    uint32_t    words;
+    int         oom;
+} bitmap_snap;
+
+static void bitmap_mark(bitmap_snap *b, uint32_t pos)
 {
-    if (j->bitmap_path[0] == '\0')
-        return;
+    b->copy[pos / 64] |= (uint64_t)1 << (pos % 64);
+}
+
+/* Copy the bitmap.  Pending deltas live only in memory, so their
+ * positions are saved as dirty: after a crash they get a full recompute
+ * instead.  So is a range an fsync has claimed but not yet written. */
+static void bitmap_snapshot(void *arg)
+{
+    bitmap_snap *b = (bitmap_snap *)arg;
+    lr_journal  *j = b->j;
 
-    /* Copy the bitmap under lock */
     pthread_mutex_lock(&j->bitmap_lock);
-    uint32_t words = j->bitmap_words;
-    uint64_t *copy = NULL;
-    if (words > 0 && j->bitmap) {
-        copy = malloc(words * sizeof(uint64_t));
-        if (copy)
-            memcpy(copy, j->bitmap, words * sizeof(uint64_t));
+    uint32_t words = 0;
+    for (uint32_t w = 0; dbitmap_next_word(&j->dirty, &w); w++)
+        words = w + 1;
+    for (lr_list_node *n = lr_list_head(&j->delta_list); n; n = n->next) {
+        const lr_delta *d = (const lr_delta *)n->data;
+        if (d->pos / 64 >= words)
+            words = d->pos / 64 + 1;
+    }
+    uint64_t fend = (uint64_t)j->flush_start + j->flush_count;
+    if (j->flush_count > 0 && (fend + 63) / 64 > words)
+        words = (uint32_t)((fend + 63) / 64);
+
+    b->copy  = NULL;
+    b->words = words;
+    b->oom   = 0;
+    if (words > 0) {
+        b->copy = calloc(words, sizeof(uint64_t));
+        if (b->copy) {
+            uint64_t bits;
+            for (uint32_t w = 0;
+                 w < words && (bits = dbitmap_next_word(&j->dirty, &w)); w++)
+                if (w < words)
+                    b->copy[w] = bits;
+            for (lr_list_node *n = lr_list_head(&j->delta_list); n; n = n->next)
+                bitmap_mark(b, ((const lr_delta *)n->data)->pos);
+            for (uint64_t pos = j->flush_start; j->flush_count > 0 && pos < fend;
+                 pos++)
+                bitmap_mark(b, (uint32_t)pos);
+        } else {
+            b->oom = 1;
+        }
     }
     pthread_mutex_unlock(&j->bitmap_lock);
+}
 
-    if (!copy || words == 0) {
-        /* Nothing dirty — remove any stale file */
-        unlink(j->bitmap_path);
-        free(copy);
-        return;
+/* Write the snapshot to bitmap_path (or remove the file when nothing is
+ * dirty).  Returns 0 or -1. */
+static int bitmap_write(bitmap_snap *b)
+{
+    lr_journal *j = b->j;
+
+    if (b->oom) {
+        fprintf(stderr, "journal: out of memory, bitmap not saved\n");
+        return -1;
     }
 
     /* Skip write if all bits are zero */
     int has_bits = 0;
-    for (uint32_t w = 0; w < words && !has_bits; w++)
-        if (copy[w]) has_bits = 1;
+    for (uint32_t w = 0; w < b->words && !has_bits; w++)
+        if (b->copy[w]) has_bits = 1;
     if (!has_bits) {
+        /* Nothing dirty — remove any stale file */
         unlink(j->bitmap_path);
-        free(copy);
-        return;
+        return 0;
     }
 
     char tmp[PATH_MAX + 8]; /* +8 for ".tmp\0" with room to spare */
     snprintf(tmp, sizeof(tmp), "%s.tmp", j->bitmap_path);
 
     int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (fd < 0) {
-        free(copy);
-        return;
-    }
+    if (fd < 0)
+        return -1;
 
     const uint8_t magic[4] = { 'L', 'R', 'B', 'M' };
     if (write(fd, magic, 4) != 4 ||
-        write(fd, &words, sizeof(words)) != sizeof(words) ||
-        write(fd, copy, words * sizeof(uint64_t))
-            != (ssize_t)(words * sizeof(uint64_t))) {
+        write(fd, &b->words, sizeof(b->words)) != sizeof(b->words) ||
+        write(fd, b->copy, b->words * sizeof(uint64_t))
+            != (ssize_t)(b->words * sizeof(uint64_t)) ||
+        fsync(fd) != 0) {
         close(fd);
         unlink(tmp);
-        free(copy);
-        return;
+        return -1;
     }
-    fsync(fd);
     close(fd);
-    free(copy);
 
     if (rename(tmp, j->bitmap_path) != 0) {
         fprintf(stderr, "journal: failed to save bitmap '%s': %s\n",
                 j->bitmap_path, strerror(errno));
         unlink(tmp);
+        return -1;
     }
+    return 0;
+}
+
+/*
+ * Everything outside the snapshot was drained before it was taken, but
+ * the parity (and the data it was computed from) may still sit in the
+ * page cache.  Flush it before a checkpoint drops the log records that
+ * would have it recomputed.  Only a parity file that cannot be synced
+ * keeps the log: a data drive that fails here is one a rebuild replaces.
+ */
+static int sync_array(lr_state *s)
+{
+    int rc = 0;
+    if (s->parity && parity_sync(s->parity) != 0)
+        rc = -1;
+    for (unsigned d = 0; d < s->drive_count; d++) {
+        int fd = open(s->drives[d].dir, O_RDONLY | O_DIRECTORY);
+        if (fd < 0)
+            continue;
+        if (syncfs(fd) != 0)
+            fprintf(stderr, "journal: syncfs of drive %s failed: %s\n",
+                    s->drives[d].name, strerror(errno));
+        close(fd);
+    }
+    return rc;
+}
+
+static int bitmap_checkpoint_save(void *arg)
+{
+    bitmap_snap *b = (bitmap_snap *)arg;
+    if (sync_array(b->j->state) != 0)
+        return -1;
+    return bitmap_write(b);
+}
+
+/* Save the bitmap; with the dirty-range log on, as a checkpoint that
+ * truncates it */
+static void journal_bitmap_save(lr_journal *j)
+{
+    if (j->bitmap_path[0] == '\0')
+        return;
+
+    bitmap_snap b = { .j = j };
+    if (j->wal) {
+        wal_checkpoint(j->wal, bitmap_snapshot, bitmap_checkpoint_save, &b);
+    } else {
+        bitmap_snapshot(&b);
+        bitmap_write(&b);
+    }
+    free(b.copy);
 }
 
 static void journal_bitmap_load(lr_journal *j)
@@ -124,7 +362,7 @@ static void journal_bitmap_load(lr_journal *j)
     if (read(fd, magic, 4) != 4 ||
         memcmp(magic, "LRBM", 4) != 0 ||
         read(fd, &words, sizeof(words)) != sizeof(words) ||
-        words == 0 || words > 0x100000 /* 64M positions max */) {
+        words == 0 || words > LR_DBM_PAGES * LR_DBM_PAGE_WORDS) {
         close(fd);
         return;
     }
@@ -141,20 +379,8 @@ static void journal_bitmap_load(lr_journal *j)
     }
 
     /* Merge loaded bits into the current in-memory bitmap */
-    pthread_mutex_lock(&j->bitmap_lock);
-    if (j->bitmap_words < words) {
-        uint64_t *p = realloc(j->bitmap, words * sizeof(uint64_t));
-        if (p) {
-            memset(p + j->bitmap_words, 0,
-                   (words - j->bitmap_words) * sizeof(uint64_t));
-            j->bitmap       = p;
-            j->bitmap_words = words;
-        }
-    }
-    uint32_t limit = words < j->bitmap_words ? words : j->bitmap_words;
-    for (uint32_t w = 0; w < limit; w++)
-        j->bitmap[w] |= bm[w];
-    pthread_mutex_unlock(&j->bitmap_lock);
+    for (uint32_t w = 0; w < words; w++)
+        dbitmap_or_word(&j->dirty, w, bm[w]);
 
     free(bm);
     fprintf(stderr,
@@ -166,38 +392,142 @@ static void journal_bitmap_load(lr_journal *j)
 /* Parallel parity drain                                               */
 /* ------------------------------------------------------------------ */
 
-typedef struct {
-    lr_state *state;
-    uint32_t *positions;
-    uint32_t  count;
-    void    **v;
-} parity_work_t;
+/* Upper bound on one coalesced run, per drive buffer */
+#define DRAIN_RUN_BYTES (2u << 20)
 
-static void *parity_worker_thread(void *arg)
+static uint32_t drain_run_max(uint32_t block_size)
 {
-    parity_work_t *w = (parity_work_t *)arg;
-    lr_state      *s = w->state;
-    for (uint32_t i = 0; i < w->count; i++) {
-        pthread_rwlock_rdlock(&s->state_lock);
-        parity_update_position(s, w->positions[i], w->v);
-        pthread_rwlock_unlock(&s->state_lock);
+    uint32_t n = DRAIN_RUN_BYTES / block_size;
+    return n > 0 ? n : 1;
+}
+
+/* About to recompute [start, start+count) from the data on disk: a writer
+ * between delta capture and its kept check in one of those stripes may
+ * not have written yet, so it must re-mark (journal_delta_begin). */
+static void recompute_fence(lr_journal *j, uint32_t start, uint32_t count)
+{
+    if (!j)
+        return;
+    uint32_t n = count < LR_DELTA_STRIPES ? count : LR_DELTA_STRIPES;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t pos = start + i;
+        if (__atomic_load_n(&j->delta_writers[pos % LR_DELTA_STRIPES],
+                            __ATOMIC_SEQ_CST) > 0)
+            delta_dropped(j, pos);
     }
-    return NULL;
 }
 
-/* ------------------------------------------------------------------ */
-/* Background worker                                                    */
-/* ------------------------------------------------------------------ */
+/* Recompute [start, start+count) in chunks of at most run_max positions.
+ * For the worker (j set) each chunk holds drain_lock shared, so a range
+ * flush can get in between chunks, and counts down j->drain_left; a range
+ * flush holds drain_lock exclusively and passes NULL. */
+static void drain_run(lr_state *s, uint32_t start, uint32_t count,
+                      void **v, uint32_t run_max, lr_journal *j)
+{
+    while (count > 0) {
+        uint32_t n = count < run_max ? count : run_max;
+        if (j)
+            pthread_rwlock_rdlock(&j->drain_lock);
+        recompute_fence(s->journal, start, n);
+        state_rdlock(s);
+        parity_update_range(s, start, n, v);
+        state_unlock(s);
+        if (j) {
+            pthread_rwlock_unlock(&j->drain_lock);
+            __atomic_sub_fetch(&j->drain_left, n, __ATOMIC_SEQ_CST);
+        }
+        start += n;
+        count -= n;
+    }
+}
 
-static int bitmap_is_empty(lr_journal *j)
+/* Drain an ascending position array, coalescing consecutive positions */
+static void drain_positions(lr_state *s, const uint32_t *positions,
+                            uint32_t count, void **v, uint32_t run_max,
+                            lr_journal *j)
 {
-    if (j->bitmap == NULL || j->bitmap_words == 0)
-        return 1;
-    for (uint32_t w = 0; w < j->bitmap_words; w++)
-        if (j->bitmap[w]) return 0;
-    return 1;
+    uint32_t i = 0;
+    while (i < count) {
+        uint32_t n = 1;
+        while (i + n < count && positions[i + n] == positions[i] + n)
+            n++;
+        drain_run(s, positions[i], n, v, run_max, j);
+        i += n;
+    }
+}
+
+/* Drain every set bit of bm, coalescing runs of consecutive bits */
+static void drain_bitmap(lr_state *s, const lr_dbitmap *bm,
+                         void **v, uint32_t run_max, lr_journal *j)
+{
+    uint32_t run_start = 0, run_len = 0;
+    uint64_t word;
+    for (uint32_t w = 0; (word = dbitmap_next_word(bm, &w)) != 0; w++) {
+        while (word) {
+            int bit = __builtin_ctzll(word);
+            uint32_t pos = w * 64 + (uint32_t)bit;
+            word &= word - 1;
+            if (run_len > 0 && pos == run_start + run_len) {
+                run_len++;
+            } else {
+                if (run_len > 0)
+                    drain_run(s, run_start, run_len, v, run_max, j);
+                run_start = pos;
+                run_len   = 1;
+            }
+        }
+    }
+    if (run_len > 0)
+        drain_run(s, run_start, run_len, v, run_max, j);
 }
 
+typedef struct {
+    lr_state         *state;
+    const uint32_t   *positions;
+    uint32_t          run_max;
+    lr_journal       *journal;   /* NULL for a range flush */
+} drain_job;
+
+/*
+ * With sharded parity, reorder the (ascending) dirty positions so those of
+ * each shard group are together, still ascending.  The pool deals each
+ * worker a contiguous range of chunks, so workers then write different
+ * parity shards instead of all of them taking turns on each.  Left as is
+ * when it cannot allocate.
+ */
+static void group_by_shard(const lr_parity_handle *ph, uint32_t *positions,
+                           uint32_t n)
+{
+    unsigned groups = parity_shard_groups(ph);
+    if (groups <= 1 || n < 2)
+        return;
+    uint32_t *sorted = malloc((size_t)n * sizeof(uint32_t));
+    if (!sorted)
+        return;
+
+    uint32_t at[LR_SHARD_MAX + 1] = { 0 };
+    for (uint32_t i = 0; i < n; i++)
+        at[parity_shard_group(ph, positions[i]) + 1]++;
+    for (unsigned g = 1; g <= groups; g++)
+        at[g] += at[g - 1];
+    for (uint32_t i = 0; i < n; i++)
+        sorted[at[parity_shard_group(ph, positions[i])]++] = positions[i];
+    memcpy(positions, sorted, (size_t)n * sizeof(uint32_t));
+    free(sorted);
+}
+
+/* Pool callback: drain positions[start..start+count) */
+static void drain_chunk(void *arg, void **v, uint32_t start, uint32_t count)
+{
+    drain_job *dj = (drain_job *)arg;
+    drain_positions(dj->state, dj->positions + start, count, v, dj->run_max,
+                    dj->journal);
+}
+
+/* ------------------------------------------------------------------ */
+/* Background worker                                                    */
+/* ------------------------------------------------------------------ */
+
 static void *worker_thread(void *arg)
 {
     lr_journal *j = (lr_journal *)arg;
@@ -209,30 +539,41 @@ static void *worker_thread(void *arg)
     void    *freeptr = NULL;
     void   **v = NULL;
 
+    /* Scratch buffers hold a whole coalesced run per drive */
+    uint32_t run_max = drain_run_max(s->cfg.block_size);
     if (nd > 0 && np > 0) {
-        v = lr_alloc_vector((int)(nd + np), s->cfg.block_size, &freeptr);
+        v = lr_alloc_vector((int)(nd + np), run_max * s->cfg.block_size,
+                            &freeptr);
     }
 
-    time_t last_save = time(NULL);
+    time_t   last_save      = time(NULL);
+    time_t   last_log       = last_save;
+    time_t   last_ckpt      = 0;
+    unsigned log_interval_s = s->cfg.metadata_log_s > 0 ? s->cfg.metadata_log_s : 1;
 
     while (1) {
         /* Wait for wake signal or interval timeout.
          * Use min(interval_ms, save_interval_s * 1000) so the save fires
-         * within save_interval_s seconds even if not signalled externally. */
+         * within save_interval_s seconds even if not signalled externally.
+         * While anything is dirty, poll at DRAIN_IDLE_MS for a pause in
+         * the writes; skip the wait when a batch is already due. */
         unsigned sleep_ms = j->interval_ms;
         if (j->save_interval_s > 0 && j->save_interval_s * 1000 < sleep_ms)
             sleep_ms = j->save_interval_s * 1000;
-        struct timespec ts;
-        clock_gettime(CLOCK_REALTIME, &ts);
-        ts.tv_sec  += sleep_ms / 1000;
-        ts.tv_nsec += (sleep_ms % 1000) * 1000000L;
-        if (ts.tv_nsec >= 1000000000L) {
-            ts.tv_sec++;
-            ts.tv_nsec -= 1000000000L;
-        }
+        if (s->mlog && log_interval_s * 1000 < sleep_ms)
+            sleep_ms = log_interval_s * 1000;
 
+        /* running is re-checked under the lock: journal_done's signal
+         * finds nobody waiting if it lands while a cycle is under way */
         pthread_mutex_lock(&j->bitmap_lock);
-        pthread_cond_timedwait(&j->wake_cond, &j->bitmap_lock, &ts);
+        if (j->running && !drain_due(j, throttle_now_ns())) {
+            if ((!dbitmap_empty(&j->dirty) || j->delta_list.count > 0) &&
+                DRAIN_IDLE_MS < sleep_ms)
+                sleep_ms = DRAIN_IDLE_MS;
+            struct timespec ts;
+            deadline_in(&ts, sleep_ms);
+            pthread_cond_timedwait(&j->wake_cond, &j->bitmap_lock, &ts);
+        }
 
         if (!j->running) {
             pthread_mutex_unlock(&j->bitmap_lock);
@@ -245,186 +586,203 @@ static void *worker_thread(void *arg)
          * This ensures crash recovery works: if the process dies after the save
          * but before (or during) the drain, those positions are re-drained on
          * the next mount. */
-        if (j->save_interval_s > 0) {
+        if (s->mlog) {
+            /* Change log: append what changed, with the bitmap covering
+             * the positions those changes dirtied; a full snapshot only
+             * once the log is due for compaction */
+            time_t now = time(NULL);
+            if (now - last_log >= (time_t)log_interval_s) {
+                state_rdlock(s);
+                metalog_collect(s);
+                int compact = metalog_needs_compaction(s->mlog);
+                if (compact)
+                    metadata_save(s);
+                state_unlock(s);
+                if (compact || metalog_write(s->mlog) != 0)
+                    journal_bitmap_save(j);
+                last_log = now;
+            }
+            if (j->save_interval_s > 0 &&
+                now - last_save >= (time_t)j->save_interval_s) {
+                journal_bitmap_save(j);
+                last_save = now;
+            }
+        } else if (j->save_interval_s > 0) {
             time_t now = time(NULL);
             if (now - last_save >= (time_t)j->save_interval_s) {
-                pthread_rwlock_rdlock(&s->state_lock);
+                state_rdlock(s);
                 metadata_save(s);
-                pthread_rwlock_unlock(&s->state_lock);
+                state_unlock(s);
                 journal_bitmap_save(j);
                 last_save = now;
             }
         }
 
-        /* Atomically swap out the bitmap */
+        /* A dirty-range log past its size checkpoints early (retrying at
+         * most once a second if that fails) */
+        if (j->wal && wal_size(j->wal) >= LR_WAL_CHECKPOINT_BYTES) {
+            time_t now = time(NULL);
+            if (now != last_ckpt) {
+                journal_bitmap_save(j);
+                last_ckpt = now;
+            }
+        }
+
+        /* When a batch is due, atomically take the dirty bits and swap
+         * out the pending deltas */
         pthread_mutex_lock(&j->bitmap_lock);
-        uint64_t *old_bm    = j->bitmap;
-        uint32_t  old_words = j->bitmap_words;
-        j->bitmap       = NULL;
-        j->bitmap_words = 0;
-
-        /* Mark processing before releasing the lock so journal_flush
-         * can't see a false "empty + idle" window between the swap and
-         * the actual parity writes. */
-        if (old_bm) {
-            int has_bits = 0;
-            for (uint32_t w = 0; w < old_words; w++)
-                if (old_bm[w]) { has_bits = 1; break; }
-            if (has_bits)
+        uint64_t taken = 0;
+        uint64_t now   = throttle_now_ns();
+        int      cycle = 0;
+        if (drain_due(j, now)) {
+            taken = dbitmap_take(&j->dirty, &j->inflight);
+
+            /* The swapped-out deltas stay indexed until folded, so
+             * journal_position_dirty keeps seeing them */
+            j->draining = j->delta_list;
+            lr_list_init(&j->delta_list);
+            if (j->draining.count > 0) {
+                lr_hash_done(&j->draining_table);
+                j->draining_table = j->delta_table;
+                lr_hash_init(&j->delta_table);
                 j->processing = 1;
-            else {
-                free(old_bm);
-                old_bm = NULL;
+            }
+
+            /* Mark processing before releasing the lock so journal_flush
+             * can't see a false "empty + idle" window between the take and
+             * the actual parity writes. */
+            if (taken)
+                j->processing = 1;
+
+            /* The batch keeps its age; bits set during the take start
+             * the next one */
+            __atomic_store_n(&j->batch_since_ns,
+                             __atomic_exchange_n(&j->dirty_since_ns, 0,
+                                                 __ATOMIC_SEQ_CST),
+                             __ATOMIC_SEQ_CST);
+            if (!dbitmap_empty(&j->dirty))
+                __atomic_store_n(&j->dirty_since_ns, now, __ATOMIC_SEQ_CST);
+            __atomic_store_n(&j->drain_left, taken, __ATOMIC_SEQ_CST);
+            if (j->processing) {
+                j->drains++;
+                cycle = 1;
             }
         }
         pthread_mutex_unlock(&j->bitmap_lock);
 
         /* Process each dirty position */
-        if (v && old_bm) {
-            unsigned nt = j->nthreads > 0 ? j->nthreads : 1;
-
-            if (nt <= 1) {
+        if (v && taken) {
+            if (!j->pool) {
                 /* Serial path */
-                for (uint32_t w = 0; w < old_words; w++) {
-                    uint64_t word = old_bm[w];
-                    while (word) {
-                        int bit = __builtin_ctzll(word);
-                        uint32_t pos = w * 64 + (uint32_t)bit;
-                        word &= word - 1;
-                        pthread_rwlock_rdlock(&s->state_lock);
-                        parity_update_position(s, pos, v);
-                        pthread_rwlock_unlock(&s->state_lock);
-                    }
-                }
+                drain_bitmap(s, &j->inflight, v, run_max, j);
             } else {
-                /* Parallel path: collect positions, divide across nt threads */
-                uint32_t pos_count = 0;
-                for (uint32_t w = 0; w < old_words; w++)
-                    pos_count += (uint32_t)__builtin_popcountll(old_bm[w]);
-
-                uint32_t *positions = pos_count
-                    ? malloc(pos_count * sizeof(uint32_t)) : NULL;
-
+                /* Parallel path: flatten to a position array; the pool deals
+                 * run_max-sized chunks and idle workers steal the rest */
+                uint32_t *positions = malloc(taken * sizeof(uint32_t));
                 if (positions) {
                     uint32_t idx = 0;
-                    for (uint32_t w = 0; w < old_words; w++) {
-                        uint64_t word = old_bm[w];
-                        while (word) {
+                    uint64_t word;
+                    for (uint32_t w = 0;
+                         idx < taken &&
+                         (word = dbitmap_next_word(&j->inflight, &w)) != 0;
+                         w++) {
+                        while (word && idx < taken) {
                             int bit = __builtin_ctzll(word);
                             positions[idx++] = w * 64 + (uint32_t)bit;
                             word &= word - 1;
                         }
                     }
-                }
-
-                if (nt > pos_count && pos_count > 0) nt = pos_count;
-
-                parity_work_t *works   = positions ? malloc(nt * sizeof(parity_work_t))  : NULL;
-                pthread_t     *threads = positions ? malloc((nt-1) * sizeof(pthread_t))  : NULL;
-                void         **fps     = positions ? calloc(nt, sizeof(void *))           : NULL;
-                int            par_ok  = works && threads && fps;
-
-                /* Allocate scratch vectors for threads 1..nt-1 */
-                if (par_ok) {
-                    uint32_t chunk = (pos_count + nt - 1) / nt;
-                    works[0].state     = s;
-                    works[0].positions = positions;
-                    works[0].count     = chunk < pos_count ? chunk : pos_count;
-                    works[0].v         = v;
-                    for (unsigned t = 1; t < nt && par_ok; t++) {
-                        uint32_t start = t * chunk;
-                        uint32_t end   = start + chunk < pos_count
-                                         ? start + chunk : pos_count;
-                        works[t].state     = s;
-                        works[t].positions = positions + start;
-                        works[t].count     = end - start;
-                        works[t].v = lr_alloc_vector((int)(nd + np),
-                                         s->cfg.block_size, &fps[t]);
-                        if (!works[t].v) par_ok = 0;
-                    }
-                }
-
-                if (par_ok) {
-                    /* Spawn threads 1..nt-1, run chunk 0 inline */
-                    int *created = calloc(nt - 1, sizeof(int));
-                    for (unsigned t = 1; t < nt; t++) {
-                        if (created)
-                            created[t-1] = (pthread_create(&threads[t-1], NULL,
-                                            parity_worker_thread, &works[t]) == 0);
-                    }
-                    parity_worker_thread(&works[0]);
-                    for (unsigned t = 1; t < nt; t++) {
-                        if (created && created[t-1])
-                            pthread_join(threads[t-1], NULL);
-                        else
-                            parity_worker_thread(&works[t]);
-                        free(fps[t]);
-                    }
-                    free(created);
+                    group_by_shard(s->parity, positions, idx);
+                    drain_job dj = { s, positions, run_max, j };
+                    pool_run(j->pool, idx, run_max, drain_chunk, &dj);
+                    free(positions);
                 } else {
-                    /* Fallback: serial over positions array (or bitmap if alloc failed) */
-                    for (unsigned t = 1; t < nt; t++) {
-                        if (fps) free(fps[t]);
-                    }
-                    if (positions) {
-                        for (uint32_t i = 0; i < pos_count; i++) {
-                            pthread_rwlock_rdlock(&s->state_lock);
-                            parity_update_position(s, positions[i], v);
-                            pthread_rwlock_unlock(&s->state_lock);
-                        }
-                    } else {
-                        for (uint32_t w = 0; w < old_words; w++) {
-                            uint64_t word = old_bm[w];
-                            while (word) {
-                                int bit = __builtin_ctzll(word);
-                                uint32_t pos = w * 64 + (uint32_t)bit;
-                                word &= word - 1;
-                                pthread_rwlock_rdlock(&s->state_lock);
-                                parity_update_position(s, pos, v);
-                                pthread_rwlock_unlock(&s->state_lock);
-                            }
-                        }
-                    }
+                    drain_bitmap(s, &j->inflight, v, run_max, j);
                 }
+            }
+        }
 
-                free(works);
-                free(threads);
-                free(fps);
-                free(positions);
+        /* Fold pending deltas into parity.  A delta whose parity cannot be
+         * read or written falls back to a full recompute next sweep.  Each
+         * is unlinked and folded under drain_lock, so a range flush either
+         * takes it first or sees it applied; it leaves draining_table only
+         * once folded. */
+        while (1) {
+            pthread_rwlock_rdlock(&j->drain_lock);
+            pthread_mutex_lock(&j->bitmap_lock);
+            lr_list_node *dn = lr_list_head(&j->draining);
+            if (dn)
+                lr_list_remove(&j->draining, dn);
+            pthread_mutex_unlock(&j->bitmap_lock);
+            if (!dn) {
+                pthread_rwlock_unlock(&j->drain_lock);
+                break;
             }
-            free(old_bm);
-        } else {
-            free(old_bm);
+            lr_delta *d = (lr_delta *)dn->data;
+            int rc = 0;
+            if (v && !dbitmap_test(&j->inflight, d->pos)) {
+                state_rdlock(s);
+                rc = parity_delta_position(s, d->pos, d->drive, d->buf, v);
+                state_unlock(s);
+            } else if (v) {
+                /* Recomputed this cycle, maybe before the write landed */
+                delta_dropped(j, d->pos);
+            }
+            pthread_rwlock_unlock(&j->drain_lock);
+            if (rc != 0)
+                dbitmap_set_range(&j->dirty, d->pos, 1);
+            pthread_mutex_lock(&j->bitmap_lock);
+            lr_hash_remove(&j->draining_table, &d->hash_node);
+            delta_free(j, d);
+            pthread_mutex_unlock(&j->bitmap_lock);
         }
 
         /* Clear processing flag and wake any flush waiters */
         pthread_mutex_lock(&j->bitmap_lock);
+        dbitmap_take(&j->inflight, NULL);
+        __atomic_store_n(&j->drain_left, 0, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&j->batch_since_ns, 0, __ATOMIC_SEQ_CST);
         j->processing = 0;
         pthread_cond_broadcast(&j->drain_cond);
         pthread_mutex_unlock(&j->bitmap_lock);
+        if (cycle)
+            stats_drain(s->stats, taken, throttle_now_ns() - now);
 
-        /* Scrub / repair if requested — after the drain completes */
+        /* Scrub / repair if requested — after the drain completes.  With a
+         * background scrubber the pass runs there, a slice at a time. */
         if (j->repair_pending || j->scrub_pending) {
             int do_repair    = j->repair_pending;
             j->scrub_pending  = 0;
             j->repair_pending = 0;
-            lr_scrub_result result;
-            parity_scrub(s, &result, do_repair);
-            if (do_repair)
-                fprintf(stderr,
-                        "repair: %u positions checked, "
-                        "%u mismatches, %u fixed, %u read errors\n",
-                        result.positions_checked,
-                        result.parity_mismatches,
-                        result.parity_fixed,
-                        result.read_errors);
-            else
-                fprintf(stderr,
-                        "scrub: %u positions checked, "
-                        "%u parity mismatches, %u read errors\n",
-                        result.positions_checked,
-                        result.parity_mismatches,
-                        result.read_errors);
+
+            pthread_mutex_lock(&j->bitmap_lock);
+            lr_scrub *sc = j->scrub;
+            uint64_t  id = sc ? scrub_start(sc, 0, 0, do_repair) : 0;
+            pthread_mutex_unlock(&j->bitmap_lock);
+
+            if (sc) {
+                if (id == 0)
+                    fprintf(stderr, "scrub: a pass is already running, "
+                                    "request ignored\n");
+            } else {
+                lr_scrub_result result;
+                parity_scrub(s, &result, do_repair);
+                if (do_repair)
+                    fprintf(stderr,
+                            "repair: %u positions checked, "
+                            "%u mismatches, %u fixed, %u read errors\n",
+                            result.positions_checked,
+                            result.parity_mismatches,
+                            result.parity_fixed,
+                            result.read_errors);
+                else
+                    fprintf(stderr,
+                            "scrub: %u positions checked, "
+                            "%u parity mismatches, %u read errors\n",
+                            result.positions_checked,
+                            result.parity_mismatches,
+                            result.read_errors);
+            }
         }
     }
 
@@ -444,8 +802,28 @@ int journal_init(lr_journal *j, struct lr_state *s, unsigned interval_ms,
     j->interval_ms      = interval_ms > 0 ? interval_ms : 5000;
     j->save_interval_s  = s->cfg.bitmap_interval_s > 0 ? s->cfg.bitmap_interval_s : 300;
     j->nthreads         = nthreads > 0 ? nthreads : 1;
+    j->delta_budget     = (uint64_t)s->cfg.delta_parity_mb << 20;
+    j->max_dirty_bytes  = (uint64_t)s->cfg.drain_max_dirty_mb << 20;
+    j->max_age_ns       = (uint64_t)s->cfg.drain_max_age_s * 1000 * MS_NS;
     j->running          = 1;
 
+    lr_hash_init(&j->delta_table);
+    lr_list_init(&j->delta_list);
+    lr_hash_init(&j->draining_table);
+    for (unsigned i = 0; i < LR_DELTA_STRIPES; i++)
+        pthread_mutex_init(&j->delta_stripes[i], NULL);
+
+    /* Pages for every position in use now; growth past them installs
+     * pages on demand */
+    uint32_t positions = 0;
+    for (unsigned d = 0; d < s->drive_count; d++)
+        if (s->drives[d].pos_alloc.next_free > positions)
+            positions = s->drives[d].pos_alloc.next_free;
+    if (dbitmap_init(&j->dirty, positions) != 0)
+        fprintf(stderr, "journal: warning: could not preallocate the dirty "
+                        "bitmap for %u positions\n", positions);
+    dbitmap_init(&j->inflight, 0);
+
     if (pthread_mutex_init(&j->bitmap_lock, NULL) != 0)
         return -1;
     if (pthread_cond_init(&j->wake_cond, NULL) != 0) {
@@ -457,8 +835,44 @@ int journal_init(lr_journal *j, struct lr_state *s, unsigned interval_ms,
         pthread_mutex_destroy(&j->bitmap_lock);
         return -1;
     }
+    /* Writer-preferring, so an fsync is not starved by the pool's stream
+     * of drain runs */
+    pthread_rwlockattr_t ra;
+    pthread_rwlockattr_init(&ra);
+    pthread_rwlockattr_setkind_np(&ra,
+                                  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    int rc = pthread_rwlock_init(&j->drain_lock, &ra);
+    pthread_rwlockattr_destroy(&ra);
+    if (rc != 0) {
+        pthread_cond_destroy(&j->drain_cond);
+        pthread_cond_destroy(&j->wake_cond);
+        pthread_mutex_destroy(&j->bitmap_lock);
+        return -1;
+    }
+    /* Persistent drain/scrub/rebuild workers.  Scratch covers a full
+     * coalesced run for the drain and nd + 2*np slots for scrub. */
+    unsigned nd = s->drive_count;
+    unsigned np = s->parity ? s->parity->levels : 0;
+    if (j->nthreads > 1 && nd > 0 && np > 0) {
+        lr_pool *pool = calloc(1, sizeof(lr_pool));
+        uint32_t bs   = s->cfg.block_size;
+        if (pool && pool_init(pool, j->nthreads, nd + 2 * np,
+                              (size_t)drain_run_max(bs) * bs) == 0) {
+            j->pool = pool;
+        } else {
+            fprintf(stderr, "journal: warning: parity pool failed, "
+                            "draining serially\n");
+            free(pool);
+        }
+    }
+
     if (pthread_create(&j->worker, NULL, worker_thread, j) != 0) {
+        if (j->pool) {
+            pool_done(j->pool);
+            free(j->pool);
+        }
         j->running = 0;
+        pthread_rwlock_destroy(&j->drain_lock);
         pthread_cond_destroy(&j->drain_cond);
         pthread_cond_destroy(&j->wake_cond);
         pthread_mutex_destroy(&j->bitmap_lock);
@@ -477,46 +891,526 @@ void journal_done(lr_journal *j)
 
     pthread_join(j->worker, NULL);
 
-    /* Clean shutdown: remove the persistent bitmap file */
+    if (j->pool) {
+        pool_done(j->pool);
+        free(j->pool);
+    }
+
+    /* Clean shutdown: remove the dirty-range log and the persistent
+     * bitmap file */
+    if (j->wal) {
+        wal_close(j->wal, 1);
+        free(j->wal);
+        j->wal = NULL;
+    }
     if (j->bitmap_path[0] != '\0')
         unlink(j->bitmap_path);
 
     pthread_mutex_destroy(&j->bitmap_lock);
     pthread_cond_destroy(&j->wake_cond);
     pthread_cond_destroy(&j->drain_cond);
-    free(j->bitmap);
+    pthread_rwlock_destroy(&j->drain_lock);
+    free(j->flush_free);
+    dbitmap_done(&j->dirty);
+    dbitmap_done(&j->inflight);
+
+    lr_list_node *n = lr_list_head(&j->delta_list);
+    while (n) {
+        lr_delta *d = (lr_delta *)n->data;
+        n = n->next;
+        delta_free(j, d);
+    }
+    lr_hash_done(&j->delta_table);
+    lr_hash_done(&j->draining_table);
+    for (unsigned i = 0; i < LR_DELTA_STRIPES; i++)
+        pthread_mutex_destroy(&j->delta_stripes[i]);
     memset(j, 0, sizeof(*j));
 }
 
 void journal_mark_dirty_range(lr_journal *j, uint32_t start, uint32_t count)
 {
+    if (dbitmap_set_range(&j->dirty, start, count) != 0)
+        fprintf(stderr, "journal: out of memory, positions %u+%u not marked "
+                        "dirty\n", start, count);
+    /* Logged after the bits are set, so a checkpoint's snapshot covers
+     * every record it truncates (wal.h) */
+    if (j->wal)
+        wal_append(j->wal, start, count);
+
+    /* A full recompute supersedes pending deltas.  A delta added while the
+     * bits were being set is swapped out together with them and skipped
+     * by the drain (see journal.h). */
+    if (__atomic_load_n(&j->delta_bytes, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&j->bitmap_lock);
+        for (uint32_t i = 0; i < count && j->delta_table.count > 0; i++)
+            delta_drop(j, start + i);
+        pthread_mutex_unlock(&j->bitmap_lock);
+    }
+    /* Only the first mark of a batch wakes the worker; it then decides
+     * when to drain (drain_due) */
+    if (note_write(j)) {
+        pthread_mutex_lock(&j->bitmap_lock);
+        pthread_cond_signal(&j->wake_cond);
+        pthread_mutex_unlock(&j->bitmap_lock);
+    }
+
+    /* The data changed: drop any block recovered from the old contents */
+    if (j->state->rcache)
+        rcache_invalidate(j->state->rcache, start, count);
+}
+
+int journal_delta_add(lr_journal *j, unsigned drive, uint32_t pos,
+                      uint32_t off, const void *delta, uint32_t len)
+{
+    uint32_t bs = j->state->cfg.block_size;
+    if (j->delta_budget == 0 || off >= bs || len > bs - off)
+        return 0;
+
+    /* Called before the new bytes are written, whatever the outcome */
+    if (j->state->rcache)
+        rcache_invalidate(j->state->rcache, pos, 1);
+
+    pthread_mutex_lock(&j->bitmap_lock);
+    if (dbitmap_test(&j->dirty, pos) || dbitmap_test(&j->inflight, pos) ||
+        in_flush(j, pos)) {
+        pthread_mutex_unlock(&j->bitmap_lock);
+        return 0;
+    }
+
+    lr_delta *d     = delta_find(&j->delta_table, pos, drive);
+    int       fresh = !d;
+    if (!d) {
+        if (j->delta_bytes + bs > j->delta_budget) {
+            pthread_mutex_unlock(&j->bitmap_lock);
+            return 0;
+        }
+        d = calloc(1, sizeof(*d));
+        if (d)
+            d->buf = calloc(1, bs);
+        if (!d || !d->buf) {
+            free(d);
+            pthread_mutex_unlock(&j->bitmap_lock);
+            return 0;
+        }
+        d->pos   = pos;
+        d->drive = drive;
+        lr_hash_insert(&j->delta_table, &d->hash_node, d, delta_hash(pos));
+        lr_list_insert_tail(&j->delta_list, &d->list_node, d);
+        __atomic_add_fetch(&j->delta_bytes, bs, __ATOMIC_SEQ_CST);
+    }
+
+    const uint8_t *src = (const uint8_t *)delta;
+    uint8_t       *dst = d->buf + off;
+    for (uint32_t i = 0; i < len; i++)
+        dst[i] ^= src[i];
+    if (note_write(j))
+        pthread_cond_signal(&j->wake_cond);
+    pthread_mutex_unlock(&j->bitmap_lock);
+    /* The parity of pos is stale until the delta is folded */
+    if (fresh && j->wal)
+        wal_append(j->wal, pos, 1);
+    return 1;
+}
+
+static void stripes_lock(lr_journal *j, uint64_t stripes)
+{
+    /* In index order so concurrent writers can't deadlock */
+    for (unsigned i = 0; i < LR_DELTA_STRIPES; i++)
+        if (stripes & ((uint64_t)1 << i))
+            pthread_mutex_lock(&j->delta_stripes[i]);
+}
+
+static void stripes_unlock(lr_journal *j, uint64_t stripes)
+{
+    for (unsigned i = 0; i < LR_DELTA_STRIPES; i++)
+        if (stripes & ((uint64_t)1 << i))
+            pthread_mutex_unlock(&j->delta_stripes[i]);
+}
+
+void journal_delta_capture(lr_journal *j, const char *vpath, int fd,
+                           const char *buf, size_t size, off_t offset,
+                           lr_delta_span *ds)
+{
+    lr_state *s  = j->state;
+    uint32_t  bs = s->cfg.block_size;
+
+    memset(ds, 0, sizeof(*ds));
+    if (j->delta_budget == 0 || size == 0 || !s->parity ||
+        s->parity->levels == 0)
+        return;
+
+    uint32_t first = (uint32_t)(offset / bs);
+    uint32_t last  = (uint32_t)((offset + (off_t)size - 1) / bs);
+    if (last - first + 1 > LR_DELTA_MAX_BLOCKS)
+        return;
+
+    state_rdlock(s);
+    lr_file *f = state_find_file(s, vpath);
+    if (!f) {
+        state_unlock(s);
+        return;
+    }
+    /* Snapshot the positions; the read below runs without the drive lock */
+    unsigned drive = f->drive_idx;
+    state_lock_drive(s, drive);
+    uint32_t pos_start = f->parity_pos_start;
+    uint32_t blocks    = f->block_count;
+    state_unlock_drive(s, drive);
+    if (first >= blocks) {
+        state_unlock(s);
+        return;
+    }
+    if (last >= blocks)
+        last = blocks - 1;
+
+    /* Only the bytes being overwritten matter: [offset, end) */
+    off_t  end = (off_t)(last + 1) * bs;
+    if (end > offset + (off_t)size)
+        end = offset + (off_t)size;
+    size_t len = (size_t)(end - offset);
+
+    uint8_t *old = malloc(len);
+    if (!old) {
+        state_unlock(s);
+        return;
+    }
+
+    uint64_t stripes = 0;
+    for (uint32_t b = first; b <= last; b++)
+        stripes |= (uint64_t)1 << ((pos_start + b) % LR_DELTA_STRIPES);
+    stripes_lock(j, stripes);
+
+    /* Write-only handles can't pread; read through a temporary fd. */
+    ssize_t got = pread(fd, old, len, offset);
+    if (got < 0 && errno == EBADF) {
+        char real[PATH_MAX];
+        int rfd = open(state_real_path(s, f, real, sizeof(real)), O_RDONLY);
+        if (rfd >= 0) {
+            got = pread(rfd, old, len, offset);
+            close(rfd);
+        }
+    }
+    if (got < 0) {
+        free(old);
+        stripes_unlock(j, stripes);
+        state_unlock(s);
+        return;
+    }
+    if ((size_t)got < len)
+        memset(old + got, 0, len - (size_t)got); /* past EOF reads as zero */
+
+    for (size_t i = 0; i < len; i++)
+        old[i] ^= (uint8_t)buf[i];
+
+    /* The drive lock keeps the positions from moving (another writer
+     * extending the file) until the deltas against them are recorded.
+     * If they moved during the read, record none: the write marks its
+     * blocks dirty instead. */
+    state_lock_drive(s, drive);
+    if (f->parity_pos_start != pos_start || f->block_count <= last) {
+        state_unlock_drive(s, drive);
+        free(old);
+        stripes_unlock(j, stripes);
+        state_unlock(s);
+        return;
+    }
+
+    ds->pos_start = pos_start;
+    ds->first_blk = first;
+    ds->stripes   = stripes;
+    ds->begun     = stripes;
+    journal_delta_begin(j, stripes);
+    for (uint32_t b = first; b <= last; b++) {
+        off_t lo = (off_t)b * bs > offset ? (off_t)b * bs : offset;
+        off_t hi = (off_t)(b + 1) * bs < end ? (off_t)(b + 1) * bs : end;
+        ds->gen[b - first] = journal_delta_gen(j, pos_start + b);
+        if (journal_delta_add(j, drive, pos_start + b,
+                              (uint32_t)(lo - (off_t)b * bs),
+                              old + (lo - offset), (uint32_t)(hi - lo)))
+            ds->mask |= (uint32_t)1 << (b - first);
+    }
+    state_unlock_drive(s, drive);
+
+    free(old);
+    state_unlock(s);
+}
+
+void journal_delta_release(lr_journal *j, lr_delta_span *ds)
+{
+    stripes_unlock(j, ds->stripes);
+    ds->stripes = 0;
+}
+
+int journal_position_dirty(lr_journal *j, uint32_t pos)
+{
+    if (dbitmap_test(&j->dirty, pos) || dbitmap_test(&j->inflight, pos))
+        return 1;
+    if (__atomic_load_n(&j->delta_bytes, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&j->flush_count, __ATOMIC_SEQ_CST) == 0)
+        return 0;
     pthread_mutex_lock(&j->bitmap_lock);
-    for (uint32_t i = 0; i < count; i++)
-        bitmap_set(j, start + i);
-    /* No signal here: drain is timer-driven so the periodic save fires first
-     * and captures the dirty bitmap before it is drained (crash recovery).
-     * Explicit drains (file close, unmount) use journal_flush() which signals. */
+    int dirty = in_flush(j, pos) ||
+                delta_find(&j->delta_table, pos, DELTA_ANY_DRIVE) != NULL ||
+                delta_find(&j->draining_table, pos, DELTA_ANY_DRIVE) != NULL;
     pthread_mutex_unlock(&j->bitmap_lock);
+    return dirty;
 }
 
 void journal_flush(lr_journal *j)
 {
     /* Kick the worker so it drains immediately */
     pthread_mutex_lock(&j->bitmap_lock);
+    j->waiters++;
     pthread_cond_signal(&j->wake_cond);
 
     /* Wait until both the bitmap is empty AND the worker has finished
      * processing the batch it swapped out. */
-    while (j->processing || !bitmap_is_empty(j))
+    while (j->processing || !dbitmap_empty(&j->dirty) || j->delta_list.count > 0)
         pthread_cond_wait(&j->drain_cond, &j->bitmap_lock);
 
+    j->waiters--;
+    pthread_mutex_unlock(&j->bitmap_lock);
+}
+
+void journal_throttle(lr_journal *j)
+{
+    if (!j->max_dirty_bytes && !j->max_age_ns)
+        return;
+    uint64_t start = throttle_now_ns();
+    if (!over_cap(j, start))
+        return;
+
+    /* Drain right away and re-check as the backlog comes down */
+    pthread_mutex_lock(&j->bitmap_lock);
+    j->waiters++;
+    pthread_cond_signal(&j->wake_cond);
+    while (j->running && over_cap(j, throttle_now_ns())) {
+        struct timespec ts;
+        deadline_in(&ts, DRAIN_IDLE_MS);
+        pthread_cond_timedwait(&j->drain_cond, &j->bitmap_lock, &ts);
+    }
+    j->waiters--;
+    j->throttled++;
+    j->throttled_ns += throttle_now_ns() - start;
+    pthread_mutex_unlock(&j->bitmap_lock);
+}
+
+void journal_get_stats(lr_journal *j, lr_journal_stats *st)
+{
+    uint64_t now = throttle_now_ns();
+    memset(st, 0, sizeof(*st));
+    pthread_mutex_lock(&j->bitmap_lock);
+    st->dirty         = dbitmap_count(&j->dirty);
+    st->draining      = __atomic_load_n(&j->drain_left, __ATOMIC_SEQ_CST);
+    st->deltas        = j->delta_list.count + j->draining.count;
+    st->backlog_bytes = backlog_bytes(j);
+    st->age_ms        = age_ns(j, now) / MS_NS;
+    st->drains        = j->drains;
+    st->throttled     = j->throttled;
+    st->throttled_ms  = j->throttled_ns / MS_NS;
+    pthread_mutex_unlock(&j->bitmap_lock);
+}
+
+/* Append pos to a growable position array; -1 on OOM */
+static int positions_push(uint32_t **a, uint32_t *n, uint32_t *cap,
+                          uint32_t pos)
+{
+    if (*n == *cap) {
+        uint32_t  ncap = *cap ? *cap * 2 : 256;
+        uint32_t *na   = realloc(*a, ncap * sizeof(uint32_t));
+        if (!na)
+            return -1;
+        *a   = na;
+        *cap = ncap;
+    }
+    (*a)[(*n)++] = pos;
+    return 0;
+}
+
+static int positions_contain(const uint32_t *a, uint32_t n, uint32_t pos)
+{
+    uint32_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (a[mid] < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < n && a[lo] == pos;
+}
+
+/* Move the deltas of l, indexed by table, inside the flush range to mine.
+ * Caller holds bitmap_lock. */
+static void deltas_claim(lr_journal *j, lr_list *l, lr_hash *table,
+                         lr_list *mine)
+{
+    lr_list_node *n = lr_list_head(l);
+    while (n) {
+        lr_delta *d = (lr_delta *)n->data;
+        n = n->next;
+        if (!in_flush(j, d->pos))
+            continue;
+        lr_hash_remove(table, &d->hash_node);
+        lr_list_remove(l, &d->list_node);
+        lr_list_insert_tail(mine, &d->list_node, d);
+    }
+}
+
+void journal_flush_range(lr_journal *j, uint32_t start, uint32_t count)
+{
+    lr_state *s = j->state;
+    if (count == 0 || !s->parity)
+        return;
+    uint64_t end = (uint64_t)start + count;
+    if (end > (uint64_t)UINT32_MAX + 1) {
+        end   = (uint64_t)UINT32_MAX + 1;
+        count = (uint32_t)(end - start);
+    }
+
+    /* The worker (and its pool) stop at the end of the run in progress */
+    pthread_rwlock_wrlock(&j->drain_lock);
+
+    /* Fence the range: new deltas in it are refused, and a writer that
+     * recorded one before the fence holds its stripe until pwrite returns,
+     * so once every stripe has been visited the data is final. */
+    pthread_mutex_lock(&j->bitmap_lock);
+    j->flush_start = start;
+    __atomic_store_n(&j->flush_count, count, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&j->bitmap_lock);
+    for (unsigned i = 0; i < LR_DELTA_STRIPES; i++) {
+        pthread_mutex_lock(&j->delta_stripes[i]);
+        pthread_mutex_unlock(&j->delta_stripes[i]);
+    }
+
+    /* Claim the range: pending dirty bits, bits the worker has taken but
+     * maybe not drained yet (recomputing them twice is harmless), and the
+     * deltas both pending and swapped out */
+    uint32_t *pos = NULL;
+    uint32_t  n = 0, cap = 0;
+    int       oom = 0;
+    lr_list   mine;
+    lr_list_init(&mine);
+
+    pthread_mutex_lock(&j->bitmap_lock);
+    for (uint64_t w = start / 64; w * 64 < end; w++) {
+        uint64_t lo   = w * 64 < start ? start - w * 64 : 0;
+        uint64_t hi   = end - w * 64 < 64 ? end - w * 64 : 64;
+        uint64_t mask = (hi - lo == 64 ? ~(uint64_t)0
+                                       : (((uint64_t)1 << (hi - lo)) - 1))
+                        << lo;
+        uint64_t bits = dbitmap_clear_word(&j->dirty, (uint32_t)w, mask) |
+                        (dbitmap_word(&j->inflight, (uint32_t)w) & mask);
+        while (bits && !oom) {
+            uint32_t p = (uint32_t)(w * 64) + (uint32_t)__builtin_ctzll(bits);
+            if (positions_push(&pos, &n, &cap, p) != 0)
+                oom = 1;
+            else
+                bits &= bits - 1;
+        }
+        if (oom) {
+            /* Leave the rest of the range to the worker */
+            dbitmap_or_word(&j->dirty, (uint32_t)w, bits);
+            break;
+        }
+    }
+    deltas_claim(j, &j->delta_list, &j->delta_table, &mine);
+    deltas_claim(j, &j->draining, &j->draining_table, &mine);
+    pthread_mutex_unlock(&j->bitmap_lock);
+
+    /* Serially, in this thread: the pool may be parked inside the
+     * worker's pool_run, waiting on drain_lock */
+    uint32_t run_max = drain_run_max(s->cfg.block_size);
+    if (!j->flush_v && (n > 0 || mine.count > 0) &&
+        s->drive_count > 0 && s->parity->levels > 0)
+        j->flush_v = lr_alloc_vector((int)(s->drive_count + s->parity->levels),
+                                     run_max * s->cfg.block_size,
+                                     &j->flush_free);
+
+    int recomputed = 0;
+    if (n > 0) {
+        if (j->flush_v) {
+            drain_positions(s, pos, n, j->flush_v, run_max, NULL);
+            recomputed = 1;
+        } else {
+            for (uint32_t i = 0; i < n; i++)
+                dbitmap_set_range(&j->dirty, pos[i], 1);
+            oom = 1;
+        }
+    }
+
+    /* Deltas at recomputed positions are covered; the rest are folded */
+    lr_list_node *dn = lr_list_head(&mine);
+    while (dn) {
+        lr_delta *d = (lr_delta *)dn->data;
+        dn = dn->next;
+        int rc = 0;
+        if (!recomputed || !positions_contain(pos, n, d->pos)) {
+            rc = -1;
+            if (j->flush_v) {
+                state_rdlock(s);
+                rc = parity_delta_position(s, d->pos, d->drive, d->buf,
+                                           j->flush_v);
+                state_unlock(s);
+            } else {
+                oom = 1;
+            }
+        }
+        if (rc != 0)
+            dbitmap_set_range(&j->dirty, d->pos, 1);
+        delta_free(j, d);
+    }
+    free(pos);
+
+    pthread_mutex_lock(&j->bitmap_lock);
+    __atomic_store_n(&j->flush_count, 0, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&j->drain_cond);
     pthread_mutex_unlock(&j->bitmap_lock);
+    pthread_rwlock_unlock(&j->drain_lock);
+
+    /* Out of memory: whatever could not be claimed goes the slow way */
+    if (oom)
+        journal_flush(j);
+}
+
+static void replay_range(void *arg, uint32_t start, uint32_t count)
+{
+    lr_journal *j = (lr_journal *)arg;
+    if (dbitmap_set_range(&j->dirty, start, count) != 0)
+        fprintf(stderr, "journal: out of memory, positions %u+%u not "
+                        "restored\n", start, count);
 }
 
 void journal_set_bitmap_path(lr_journal *j, const char *path)
 {
     snprintf(j->bitmap_path, sizeof(j->bitmap_path), "%s", path);
     journal_bitmap_load(j); /* restore dirty positions from previous run */
+
+    /* Then what was marked since that save.  The records stay in the log
+     * until the next checkpoint covers them. */
+    char log[PATH_MAX + 8];
+    snprintf(log, sizeof(log), "%s.log", j->bitmap_path);
+    uint64_t n = wal_replay(log, replay_range, j);
+    if (n > 0)
+        fprintf(stderr, "journal: replayed %llu dirty range(s) from '%s' "
+                        "(crash recovery)\n", (unsigned long long)n, log);
+
+    unsigned ms = j->state->cfg.dirty_log_ms;
+    if (ms == 0) {
+        /* Log switched off: the bitmap save below replaces it */
+        if (n > 0)
+            journal_bitmap_save(j);
+        unlink(log);
+        return;
+    }
+    lr_wal *w = calloc(1, sizeof(lr_wal));
+    if (w && wal_open(w, log, ms) == 0) {
+        j->wal = w;
+    } else {
+        fprintf(stderr, "journal: warning: dirty-range log unavailable, "
+                        "relying on bitmap saves\n");
+        free(w);
+    }
 }
 
 void journal_scrub_request(lr_journal *j)
@@ -527,6 +1421,51 @@ void journal_scrub_request(lr_journal *j)
     pthread_mutex_unlock(&j->bitmap_lock);
 }
 
+void journal_set_scrub(lr_journal *j, lr_scrub *sc)
+{
+    pthread_mutex_lock(&j->bitmap_lock);
+    j->scrub = sc;
+    pthread_mutex_unlock(&j->bitmap_lock);
+}
+
+void journal_wait_idle(lr_journal *j)
+{
+    pthread_mutex_lock(&j->bitmap_lock);
+    while (j->processing)
+        pthread_cond_wait(&j->drain_cond, &j->bitmap_lock);
+    pthread_mutex_unlock(&j->bitmap_lock);
+}
+
+int journal_scrub_range(void *arg, uint32_t pos, uint32_t count, int repair,
+                        lr_scrub_result *r)
+{
+    lr_state *s = (lr_state *)arg;
+
+    /* A drain in progress goes first */
+    if (s->journal)
+        journal_wait_idle(s->journal);
+    return parity_scrub_range(s, pos, count, repair, r);
+}
+
+uint32_t journal_scrub_limit(void *arg)
+{
+    return parity_position_limit((lr_state *)arg);
+}
+
+void journal_compact_mark(void *arg, uint32_t start, uint32_t count)
+{
+    lr_state *s = (lr_state *)arg;
+    if (s->journal)
+        journal_mark_dirty_range(s->journal, start, count);
+}
+
+void journal_compact_flush(void *arg, uint32_t start, uint32_t count)
+{
+    lr_state *s = (lr_state *)arg;
+    if (s->journal)
+        journal_flush_range(s->journal, start, count);
+}
+
 void journal_repair_request(lr_journal *j)
 {
     j->repair_pending = 1;
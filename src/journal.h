@@ -5,8 +5,23 @@
 #include <pthread.h>
 #include <signal.h>
 #include <limits.h>
+#include <sys/types.h>
+
+#include "lr_hash.h"
+#include "lr_list.h"
+#include "dbitmap.h"
+#include "scrub.h"
 
 struct lr_state;
+struct lr_pool;
+struct lr_wal;
+
+/* Stripe locks serialising read-old/write-new on the same position */
+#define LR_DELTA_STRIPES 64
+
+/* Largest overwrite (in blocks) that records delta parity; longer writes
+ * dirty their positions for a full recompute. */
+#define LR_DELTA_MAX_BLOCKS 16
 
 /*
  * Dirty-position bitmap + background worker thread.
@@ -16,16 +31,50 @@ struct lr_state;
  * periodically drains the bitmap by calling parity_update_position()
  * for each set bit.
  *
+ * The bitmap is an lr_dbitmap (dbitmap.h): writers set bits without
+ * bitmap_lock, and the worker moves them into `inflight` under the lock
+ * (with the deltas) and walks only the words that are set.
+ *
+ * Scheduling: the worker drains as soon as writes pause (DRAIN_IDLE_MS
+ * without a new dirty mark), and under sustained writes lets the batch
+ * grow for coalescing until its oldest position is interval_ms old or it
+ * reaches half of a configured cap.  With drain_max_dirty / drain_max_age
+ * set, journal_throttle holds writers back while the undrained backlog
+ * is over either cap.
+ *
+ * journal_flush_range (fsync) processes one file's positions in the
+ * calling thread, ahead of the worker's backlog: it takes drain_lock
+ * exclusively, so the worker stops between runs, fences the range against
+ * new deltas, and recomputes or folds only what lies in the range.
+ *
+ * With nthreads > 1 the drain runs on a persistent work-stealing pool
+ * (pool.c) created here; scrub, repair and live rebuild share it.
+ *
  * Crash-consistent journal: the bitmap is saved to bitmap_path alongside
  * each periodic metadata save.  On unmount the file is deleted (clean
  * shutdown).  On remount, if the file is found, the dirty bits are merged
  * into the in-memory bitmap so stale parity positions are recomputed.
+ * With dirty_log on, every mark (and every new delta) is also appended to
+ * a dirty-range log next to it (wal.h), group-committed every
+ * dirty_log ms; each bitmap save is a checkpoint that truncates the log,
+ * taken early once the log reaches LR_WAL_CHECKPOINT_BYTES.  Remount
+ * merges the bitmap and then the log.
+ *
+ * Delta parity: an overwrite of blocks that already have parity can
+ * instead record a per-(position, drive) delta (old XOR new).  The worker
+ * folds each delta into the stored parity with ec_encode_data_update,
+ * reading np parity blocks instead of nd data blocks.  A position never
+ * has a pending delta and a dirty bit at the same time: setting the bit
+ * discards the delta (the full recompute covers it), and a delta is
+ * refused while the bit is set or being drained.  (A bit set while a
+ * delta is being added at the same position can leave both; they are
+ * swapped out together and the drain skips the delta.)  Deltas are not
+ * persisted; the bitmap save records their positions as dirty instead.
  */
 typedef struct lr_journal {
-    /* Bitmap — one bit per parity position */
-    uint64_t       *bitmap;
-    uint32_t        bitmap_words; /* current allocated words */
-    pthread_mutex_t bitmap_lock;
+    /* Bitmap — one bit per parity position, set lock-free */
+    lr_dbitmap      dirty;
+    pthread_mutex_t bitmap_lock;  /* deltas, the take into inflight, worker state */
 
     /* Background worker */
     pthread_t       worker;
@@ -33,22 +82,78 @@ typedef struct lr_journal {
     int             processing;   /* 1 while worker is computing parity */
     pthread_cond_t  wake_cond;
     pthread_cond_t  drain_cond;   /* signalled when processing==0 and bitmap empty */
-    unsigned        interval_ms;     /* default sleep between sweeps */
-    unsigned        save_interval_s; /* seconds between periodic metadata+bitmap saves */
+    pthread_rwlock_t drain_lock;  /* shared around each drain run and delta fold,
+                                   * exclusive in journal_flush_range */
+    unsigned        interval_ms;     /* longest a batch grows under sustained writes */
+    unsigned        save_interval_s; /* seconds between periodic metadata+bitmap saves
+                                      * (bitmap only with the change log on) */
 
     /* Persistent crash journal */
     char            bitmap_path[PATH_MAX]; /* on-disk dirty-bitmap file; "" = disabled */
+    struct lr_wal  *wal;                   /* dirty-range log (bitmap_path.log);
+                                            * NULL = bitmap saves only */
+
+    /* Delta parity — pending (position, drive) deltas */
+    lr_hash         delta_table;
+    lr_list         delta_list;
+    uint64_t        delta_bytes;    /* memory held by delta_list (atomic) */
+    uint64_t        delta_budget;   /* max delta_bytes; 0 = delta parity off */
+    lr_dbitmap      inflight;       /* bits being drained, for delta refusal */
+    lr_list         draining;       /* deltas swapped out, not yet folded */
+    lr_hash         draining_table; /* indexes draining until each is folded */
+    pthread_mutex_t delta_stripes[LR_DELTA_STRIPES];
+    uint64_t        delta_drops[LR_DELTA_STRIPES]; /* deltas discarded per stripe
+                                                    * (atomic) */
+    uint32_t        delta_writers[LR_DELTA_STRIPES]; /* writers between capture
+                                                      * and kept check (atomic) */
+
+    /* Adaptive scheduling and backpressure (CLOCK_MONOTONIC ns, atomic) */
+    uint64_t        last_mark_ns;    /* latest journal_mark_dirty_range */
+    uint64_t        dirty_since_ns;  /* first mark since the last take; 0 = none */
+    uint64_t        batch_since_ns;  /* dirty_since_ns of the batch being drained */
+    uint64_t        drain_left;      /* positions of that batch not yet drained */
+    uint64_t        max_dirty_bytes; /* drain_max_dirty; 0 = no cap */
+    uint64_t        max_age_ns;      /* drain_max_age; 0 = no cap */
+    unsigned        waiters;         /* journal_flush / journal_throttle callers
+                                      * waiting for the drain (bitmap_lock) */
+    uint64_t        drains;          /* batches drained */
+    uint64_t        throttled;       /* writes held back by journal_throttle */
+    uint64_t        throttled_ns;    /* total time they waited */
+
+    /* Range flush (fsync): [flush_start, flush_start+flush_count) refuses
+     * deltas and reads as dirty while it is processed (bitmap_lock) */
+    uint32_t        flush_start;
+    uint32_t        flush_count;    /* 0 = no flush in progress */
+    void          **flush_v;        /* serial scratch, allocated on first use */
+    void           *flush_free;     /* (both under drain_lock, exclusive) */
 
     /* Parity drain parallelism */
     unsigned        nthreads;  /* number of threads to use when draining dirty positions */
+    struct lr_pool *pool;      /* persistent workers when nthreads > 1, shared
+                                * with scrub and rebuild; NULL = serial */
 
     /* Scrub / repair */
     volatile sig_atomic_t scrub_pending;  /* set by SIGUSR1 handler */
     volatile sig_atomic_t repair_pending; /* set by SIGUSR2 handler */
+    lr_scrub             *scrub;          /* background scrubber that takes
+                                           * these requests; NULL = run the
+                                           * pass inline (bitmap_lock) */
 
     struct lr_state *state;
 } lr_journal;
 
+/* Backlog and scheduler counters for the "stats" control command */
+typedef struct {
+    uint64_t dirty;         /* positions waiting for the next batch */
+    uint64_t draining;      /* positions of the current batch not yet drained */
+    uint64_t deltas;        /* pending delta blocks */
+    uint64_t backlog_bytes; /* (dirty + draining) * block_size + delta memory */
+    uint64_t age_ms;        /* age of the oldest undrained position */
+    uint64_t drains;
+    uint64_t throttled;
+    uint64_t throttled_ms;
+} lr_journal_stats;
+
 int  journal_init(lr_journal *j, struct lr_state *s, unsigned interval_ms,
                   unsigned nthreads);
 void journal_done(lr_journal *j);
@@ -56,12 +161,139 @@ void journal_done(lr_journal *j);
 /* Mark positions [start, start+count) as dirty. */
 void journal_mark_dirty_range(lr_journal *j, uint32_t start, uint32_t count);
 
+/*
+ * Delta parity.  The caller holds the stripe lock for `pos` (see
+ * journal_delta_stripe) from reading the old bytes until the new bytes are
+ * on disk, and calls journal_delta_add BEFORE writing them, so that scrub
+ * sees the position as dirty while the write is in flight.
+ *
+ * journal_delta_add XORs `len` bytes of `delta` (old XOR new) into the
+ * pending delta for (pos, drive), starting at byte `off` of the block.
+ * Returns 1 if recorded,
+ * 0 if refused (delta parity disabled, over budget, or the position already
+ * has its dirty bit set) — the caller must then mark the position dirty
+ * after the write as usual.
+ */
+int  journal_delta_add(lr_journal *j, unsigned drive, uint32_t pos,
+                       uint32_t off, const void *delta, uint32_t len);
+
+static inline pthread_mutex_t *journal_delta_stripe(lr_journal *j,
+                                                    uint32_t pos)
+{
+    return &j->delta_stripes[pos % LR_DELTA_STRIPES];
+}
+
+/*
+ * A dirty mark discards the pending deltas at its positions, including
+ * one a writer recorded but has not written yet: the drain may then read
+ * the old bytes, so the writer must mark the block dirty itself after its
+ * write.  Take journal_delta_gen before journal_delta_add and, after the
+ * write, journal_delta_kept says whether the delta survived (0 = mark
+ * pos dirty).  Drops are counted per stripe, so a drop at another
+ * position of the stripe also reads as 0: an extra recompute.
+ */
+static inline uint64_t journal_delta_gen(lr_journal *j, uint32_t pos)
+{
+    return __atomic_load_n(&j->delta_drops[pos % LR_DELTA_STRIPES],
+                           __ATOMIC_SEQ_CST);
+}
+
+static inline int journal_delta_kept(lr_journal *j, uint32_t pos,
+                                     uint64_t gen)
+{
+    return journal_delta_gen(j, pos) == gen;
+}
+
+/*
+ * A recompute can also read the old bytes without dropping anything: a
+ * mark racing the worker's swap, or a mark after the delta was already
+ * folded.  So a writer brackets capture through its journal_delta_kept
+ * check with journal_delta_begin/end on the stripes it locked (bit per
+ * stripe), and a recompute bumps the drop generation of every stripe in
+ * its range that has a writer in there, before it reads the data.
+ */
+static inline void journal_delta_begin(lr_journal *j, uint64_t stripes)
+{
+    for (unsigned i = 0; stripes; i++, stripes >>= 1)
+        if (stripes & 1)
+            __atomic_add_fetch(&j->delta_writers[i], 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void journal_delta_end(lr_journal *j, uint64_t stripes)
+{
+    for (unsigned i = 0; stripes; i++, stripes >>= 1)
+        if (stripes & 1)
+            __atomic_sub_fetch(&j->delta_writers[i], 1, __ATOMIC_SEQ_CST);
+}
+
+/* Blocks of one write whose parity is updated by delta */
+typedef struct {
+    uint32_t pos_start;  /* file's parity_pos_start when deltas were taken */
+    uint32_t first_blk;  /* first file block of the write */
+    uint32_t mask;       /* bit i: block first_blk+i has a recorded delta */
+    uint64_t stripes;    /* journal stripe locks held (bit per stripe) */
+    uint64_t begun;      /* stripes under journal_delta_begin until the
+                          * kept check */
+    uint64_t gen[LR_DELTA_MAX_BLOCKS]; /* journal_delta_gen before each add */
+} lr_delta_span;
+
+/*
+ * Record old XOR new for every block of a write of `size` bytes of buf at
+ * offset into vpath (open as fd) that already has parity, before the new
+ * bytes hit the disk.  On return the stripe locks covering those blocks
+ * are held; release them with journal_delta_release once pwrite has
+ * completed.  Blocks not in ds->mask get a dirty bit afterwards.
+ *
+ * The drive lock is held only to snapshot the file's positions and, after
+ * the old bytes are read, to check they did not move while the deltas are
+ * recorded; stats and writes on the drive do not wait for the read.
+ * Lock order: state read lock, stripe locks, drive lock, bitmap_lock.
+ */
+void journal_delta_capture(lr_journal *j, const char *vpath, int fd,
+                           const char *buf, size_t size, off_t offset,
+                           lr_delta_span *ds);
+void journal_delta_release(lr_journal *j, lr_delta_span *ds);
+
+/* 1 if pos has a dirty bit (pending or being drained) or a delta not
+ * yet folded. */
+int  journal_position_dirty(lr_journal *j, uint32_t pos);
+
+/*
+ * Scrub repair: hold off drain runs, delta folds and range flushes while
+ * a mismatch is confirmed and its parity rewritten.  Exclusive, since
+ * those all run under drain_lock shared.  Take it holding no locks; the
+ * state read lock and then the position's stripe lock go inside it.
+ */
+static inline void journal_drain_exclude(lr_journal *j)
+{
+    pthread_rwlock_wrlock(&j->drain_lock);
+}
+
+static inline void journal_drain_allow(lr_journal *j)
+{
+    pthread_rwlock_unlock(&j->drain_lock);
+}
+
+/* Backpressure: block while the undrained backlog is over drain_max_dirty
+ * or older than drain_max_age.  Call with no locks held, before a write. */
+void journal_throttle(lr_journal *j);
+
+void journal_get_stats(lr_journal *j, lr_journal_stats *st);
+
 /* Block until all dirty positions have been processed. */
 void journal_flush(lr_journal *j);
 
+/* Bring the parity of positions [start, start+count) up to date and
+ * return.  Dirty bits and deltas in the range are processed by the caller
+ * right away (waiting only for the drain run in progress); everything
+ * else stays queued for the worker. */
+void journal_flush_range(lr_journal *j, uint32_t start, uint32_t count);
+
 /*
- * Set the path for the on-disk dirty-bitmap file and load any existing
- * bitmap (crash recovery).  Call after journal_init, before fuse_main.
+ * Set the path for the on-disk dirty-bitmap file, load any existing
+ * bitmap and replay the dirty-range log next to it (crash recovery), then
+ * open the log when dirty_log is on.  Call after journal_init, before
+ * fuse_main.
  */
 void journal_set_bitmap_path(lr_journal *j, const char *path);
 
@@ -73,4 +305,23 @@ void journal_scrub_request(lr_journal *j);
  * Use after adding a new parity level or to fix parity after a crash. */
 void journal_repair_request(lr_journal *j);
 
+/* Hand scrub/repair requests to a background scrubber (NULL = inline).
+ * Clear it before the scrubber is destroyed. */
+void journal_set_scrub(lr_journal *j, lr_scrub *sc);
+
+/* Block while the worker is draining. */
+void journal_wait_idle(lr_journal *j);
+
+/* Background scrub callbacks (scrub.h); arg is the lr_state.  The range
+ * callback waits for a running drain before each slice. */
+int      journal_scrub_range(void *arg, uint32_t pos, uint32_t count,
+                             int repair, lr_scrub_result *r);
+uint32_t journal_scrub_limit(void *arg);
+
+/* Compaction callbacks (compact.h); arg is the lr_state.  mark sets the
+ * dirty bits of a range whose mapping changed, flush rewrites its parity
+ * right away. */
+void     journal_compact_mark(void *arg, uint32_t start, uint32_t count);
+void     journal_compact_flush(void *arg, uint32_t start, uint32_t count);
+
 #endif /* LR_JOURNAL_H */
@@ -18,9 +18,8 @@ void lr_hash_done(lr_hash *h)
     h->count    = 0;
 }
 
-static void grow(lr_hash *h)
+static void resize(lr_hash *h, uint32_t new_n)
 {
-    uint32_t new_n = h->nbuckets * 2;
     lr_hash_node **new_b = calloc(new_n, sizeof(lr_hash_node *));
     if (!new_b)
         return;
@@ -40,6 +39,20 @@ static void grow(lr_hash *h)
     h->nbuckets = new_n;
 }
 
+static void grow(lr_hash *h)
+{
+    resize(h, h->nbuckets * 2);
+}
+
+void lr_hash_reserve(lr_hash *h, uint32_t n)
+{
+    uint32_t new_n = h->nbuckets ? h->nbuckets : INIT_BUCKETS;
+    while (n >= new_n / 4 * 3 && new_n < (1u << 31))
+        new_n *= 2;
+    if (new_n > h->nbuckets)
+        resize(h, new_n);
+}
+
 void lr_hash_insert(lr_hash *h, lr_hash_node *node, void *data, uint32_t hash)
 {
     if (h->count >= h->nbuckets * 3 / 4)
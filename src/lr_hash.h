@@ -29,6 +29,10 @@ typedef struct {
 void  lr_hash_init(lr_hash *h);
 void  lr_hash_done(lr_hash *h);
 
+/* Grow the bucket array so that n entries fit without further growth
+ * (bulk loads).  Never shrinks; keeps the current size on OOM. */
+void  lr_hash_reserve(lr_hash *h, uint32_t n);
+
 void  lr_hash_insert(lr_hash *h, lr_hash_node *node, void *data, uint32_t hash);
 
 /* Returns data pointer if found, NULL otherwise.
@@ -49,4 +53,13 @@ static inline uint32_t lr_hash_string(const char *s)
     return h;
 }
 
+/* lr_hash_string over the first n bytes of s. */
+static inline uint32_t lr_hash_bytes(const char *s, size_t n)
+{
+    uint32_t h = 2166136261u;
+    while (n--)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
 #endif /* LR_HASH_H */
@@ -4,11 +4,18 @@
 #include "config.h"
 #include "state.h"
 #include "metadata.h"
+#include "metalog.h"
 #include "fuse_ops.h"
 #include "parity.h"
 #include "journal.h"
 #include "rebuild.h"
 #include "ctrl.h"
+#include "fdcache.h"
+#include "io.h"
+#include "rcache.h"
+#include "scrub.h"
+#include "compact.h"
+#include "mover.h"
 #include "version.h"
 
 #include <stdio.h>
@@ -34,13 +41,70 @@ static void sigusr2_handler(int sig)
         g_state->journal->repair_pending = 1;
 }
 
+/*--------------------------------------------------------------------
+ * Subcommand: export -c CONFIG [FILE] — write the content file in the
+ * text format (to stdout by default), whichever format it is stored in.
+ *------------------------------------------------------------------*/
+static int cmd_export(int argc, char *argv[])
+{
+    char *config_path = NULL;
+    int   opt;
+
+    optind = 1; /* reset getopt state */
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        switch (opt) {
+        case 'c': config_path = optarg; break;
+        default:
+            fprintf(stderr, "Usage: liveraid export -c CONFIG [FILE]\n");
+            return 1;
+        }
+    }
+    if (!config_path || optind < argc - 1) {
+        fprintf(stderr, "Usage: liveraid export -c CONFIG [FILE]\n");
+        return 1;
+    }
+    const char *out = optind < argc ? argv[optind] : "-";
+
+    lr_config *cfg = calloc(1, sizeof(lr_config));
+    lr_state  *s   = calloc(1, sizeof(lr_state));
+    if (!cfg || !s) {
+        fprintf(stderr, "export: out of memory\n");
+        free(cfg);
+        free(s);
+        return 1;
+    }
+    if (config_load(config_path, cfg) != 0) {
+        fprintf(stderr, "export: cannot load config '%s'\n", config_path);
+        free(cfg);
+        free(s);
+        return 1;
+    }
+    if (state_init(s, cfg) != 0) {
+        fprintf(stderr, "export: state_init failed\n");
+        free(cfg);
+        free(s);
+        return 1;
+    }
+    free(cfg);
+
+    int rc = 1;
+    if (metadata_load(s) != 0)
+        fprintf(stderr, "export: metadata_load failed\n");
+    else if (metadata_export_text(s, out) == 0)
+        rc = 0;
+    state_done(s);
+    free(s);
+    return rc;
+}
+
 static void usage(const char *prog)
 {
     fprintf(stderr,
         "liveraid %s\n"
         "\n"
         "Usage: %s -c CONFIG [FUSE_OPTIONS] MOUNTPOINT\n"
-        "       %s rebuild -c CONFIG -d DRIVE_NAME\n"
+        "       %s rebuild -c CONFIG -d DRIVE_NAME[,DRIVE_NAME...]\n"
+        "       %s export -c CONFIG [FILE]   (content file as text)\n"
         "\n"
         "Options:\n"
         "  -c CONFIG    Path to liveraid.conf\n"
@@ -55,7 +119,7 @@ static void usage(const char *prog)
         "\n"
         "Example:\n"
         "  %s -c /etc/liveraid.conf /mnt/array\n",
-        lr_version, prog, prog, prog);
+        lr_version, prog, prog, prog, prog);
 }
 
 int main(int argc, char *argv[])
@@ -63,6 +127,8 @@ int main(int argc, char *argv[])
     /* Dispatch subcommands before FUSE argument processing */
     if (argc >= 2 && strcmp(argv[1], "rebuild") == 0)
         return cmd_rebuild(argc - 1, argv + 1);
+    if (argc >= 2 && strcmp(argv[1], "export") == 0)
+        return cmd_export(argc - 1, argv + 1);
 
     char *config_path = NULL;
     int   opt;
@@ -70,7 +136,7 @@ int main(int argc, char *argv[])
 
     /* Extract -c CONFIG before passing remaining args to fuse_main */
     /* We'll rebuild argv without -c CONFIG for fuse */
-    char **fuse_argv = malloc((argc + 2) * sizeof(char *));
+    char **fuse_argv = malloc((argc + 6) * sizeof(char *));
     if (!fuse_argv) {
         fprintf(stderr, "liveraid: out of memory\n");
         return 1;
@@ -120,6 +186,26 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    /* ---- FUSE session loop options (mount profile) ---- */
+    if (cfg->clone_fd) {
+        fuse_argv[fuse_argc++] = "-o";
+        fuse_argv[fuse_argc++] = "clone_fd";
+    }
+    if (cfg->max_threads) {
+#if FUSE_MAJOR_VERSION > 3 || (FUSE_MAJOR_VERSION == 3 && FUSE_MINOR_VERSION >= 12)
+        static char max_threads_opt[32];
+        snprintf(max_threads_opt, sizeof(max_threads_opt), "max_threads=%u",
+                 cfg->max_threads);
+        fuse_argv[fuse_argc++] = "-o";
+        fuse_argv[fuse_argc++] = max_threads_opt;
+#else
+        /* Older libfuse rejects the option and would fail the mount */
+        fprintf(stderr, "liveraid: max_threads needs libfuse 3.12, "
+                        "ignoring it\n");
+#endif
+    }
+    fuse_argv[fuse_argc] = NULL;
+
     /* ---- Initialize state ---- */
     lr_state *state = calloc(1, sizeof(lr_state));
     if (!state) {
@@ -138,11 +224,33 @@ int main(int argc, char *argv[])
     }
     free(cfg); /* copied into state->cfg */
 
+    /* ---- Runtime metrics (ctrl "stats") ---- */
+    state->stats = malloc(sizeof(lr_stats));
+    if (state->stats)
+        stats_init(state->stats);
+    else
+        fprintf(stderr, "liveraid: warning: no memory for metrics\n");
+
     /* ---- Load metadata ---- */
     if (metadata_load(state) != 0) {
         fprintf(stderr, "liveraid: warning: metadata_load failed (fresh start?)\n");
     }
 
+    /* ---- Metadata change log ---- */
+    if (state->cfg.metadata_log_s > 0) {
+        /* Fold replayed changes into a snapshot before the logs restart */
+        int ok = state->log_replayed == 0 || metadata_save(state) == 0;
+        lr_metalog *ml = calloc(1, sizeof(lr_metalog));
+        if (ok && ml && metalog_init(ml, state,
+                                     (uint64_t)state->cfg.metadata_compact_mb << 20) == 0) {
+            state->mlog = ml;
+        } else {
+            fprintf(stderr, "liveraid: warning: metalog_init failed, "
+                            "saving full snapshots\n");
+            free(ml);
+        }
+    }
+
     /* ---- Open parity files (if configured) ---- */
     if (state->cfg.parity_levels > 0) {
         lr_parity_handle *ph = calloc(1, sizeof(lr_parity_handle));
@@ -155,6 +263,44 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* ---- Descriptor cache for parity reads ---- */
+    if (state->cfg.fd_cache > 0) {
+        lr_fdcache *fc = calloc(1, sizeof(lr_fdcache));
+        if (fc && fdcache_init(fc, state->cfg.fd_cache) == 0) {
+            state->fdcache = fc;
+        } else {
+            fprintf(stderr, "liveraid: warning: fdcache_init failed\n");
+            free(fc);
+        }
+    }
+
+    /* ---- Batched I/O engine for parity paths ---- */
+    {
+        lr_io *io = calloc(1, sizeof(lr_io));
+        if (io && io_init(io, state->cfg.io_engine, state->cfg.io_depth) == 0) {
+            state->io = io;
+        } else {
+            fprintf(stderr, "liveraid: warning: io_init failed, using sync I/O\n");
+            free(io);
+        }
+    }
+
+    /* ---- Recovered-block cache + readahead for degraded reads ---- */
+    if (state->parity && state->cfg.degraded_cache_mb > 0) {
+        lr_rcache *rc     = calloc(1, sizeof(lr_rcache));
+        unsigned   blocks = (unsigned)(((uint64_t)state->cfg.degraded_cache_mb << 20)
+                                       / state->cfg.block_size);
+        if (rc && rcache_init(rc, blocks, state->cfg.block_size,
+                              state->cfg.degraded_readahead > 0
+                                  ? lr_degraded_fill : NULL,
+                              state) == 0) {
+            state->rcache = rc;
+        } else {
+            fprintf(stderr, "liveraid: warning: rcache_init failed\n");
+            free(rc);
+        }
+    }
+
     /* ---- Start journal ---- */
     {
         lr_journal *j = calloc(1, sizeof(lr_journal));
@@ -174,6 +320,60 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* ---- Background scrub on the journal's parity pool ---- */
+    if (state->parity && state->journal) {
+        lr_scrub *sc        = calloc(1, sizeof(lr_scrub));
+        uint32_t  bs        = state->cfg.block_size;
+        uint64_t  pos_bytes = (uint64_t)bs * (state->drive_count +
+                                              state->parity->levels);
+        if (sc && scrub_init(sc, LR_SCRUB_SLICE_BYTES / bs, pos_bytes,
+                             (uint64_t)state->cfg.scrub_rate_mb << 20,
+                             journal_scrub_range, journal_scrub_limit,
+                             state) == 0) {
+            state->scrub = sc;
+            scrub_set_daily(sc, state->cfg.scrub_daily_pct);
+            if (state->cfg.content_count > 0) {
+                char ck_path[PATH_MAX + 8]; /* +8 for ".scrub\0" */
+                snprintf(ck_path, sizeof(ck_path), "%s.scrub",
+                         state->cfg.content_paths[0]);
+                scrub_set_checkpoint(sc, ck_path);
+            }
+            journal_set_scrub(state->journal, sc);
+        } else {
+            fprintf(stderr, "liveraid: warning: scrub_init failed, "
+                            "scrubbing inline\n");
+            free(sc);
+        }
+    }
+
+    /* ---- Compaction of the position namespace (ctrl "compact") ---- */
+    if (state->journal) {
+        lr_compact *cp = calloc(1, sizeof(lr_compact));
+        if (cp && compact_init(cp, state,
+                               (uint64_t)state->cfg.compact_rate_mb << 20,
+                               journal_compact_mark, journal_compact_flush,
+                               state) == 0) {
+            state->compact = cp;
+        } else {
+            fprintf(stderr, "liveraid: warning: compact_init failed\n");
+            free(cp);
+        }
+    }
+
+    /* ---- Cache mover (ctrl "migrate") ---- */
+    if (state->journal && state->cache_drive != LR_NO_CACHE) {
+        lr_mover *mv = calloc(1, sizeof(lr_mover));
+        if (mv && mover_init(mv, state, state->cfg.cache_idle_s,
+                             journal_compact_mark, journal_compact_flush,
+                             state) == 0) {
+            state->mover = mv;
+        } else {
+            fprintf(stderr, "liveraid: warning: mover_init failed, files "
+                            "stay on the cache drive\n");
+            free(mv);
+        }
+    }
+
     /* ---- Start control server (live rebuild socket) ---- */
     if (state->cfg.content_count > 0) {
         lr_ctrl *ctrl = calloc(1, sizeof(lr_ctrl));
@@ -209,6 +409,28 @@ int main(int argc, char *argv[])
         free(state->ctrl);
         state->ctrl = NULL;
     }
+    if (state->mover) {
+        mover_done(state->mover);
+        free(state->mover);
+        state->mover = NULL;
+    }
+    if (state->compact) {
+        compact_done(state->compact);
+        free(state->compact);
+        state->compact = NULL;
+    }
+    if (state->scrub) {
+        if (state->journal)
+            journal_set_scrub(state->journal, NULL);
+        scrub_done(state->scrub);
+        free(state->scrub);
+        state->scrub = NULL;
+    }
+    if (state->rcache) {
+        rcache_done(state->rcache);
+        free(state->rcache);
+        state->rcache = NULL;
+    }
     if (state->journal) {
         journal_flush(state->journal);
         journal_done(state->journal);
@@ -220,8 +442,25 @@ int main(int argc, char *argv[])
         free(state->parity);
         state->parity = NULL;
     }
+    if (state->fdcache) {
+        fdcache_done(state->fdcache);
+        free(state->fdcache);
+        state->fdcache = NULL;
+    }
+    if (state->io) {
+        io_done(state->io);
+        free(state->io);
+        state->io = NULL;
+    }
     if (!state->metadata_saved)
         metadata_save(state);
+    if (state->mlog) {
+        metalog_done(state->mlog);
+        free(state->mlog);
+        state->mlog = NULL;
+    }
+    free(state->stats);
+    state->stats = NULL;
     state_done(state);
     free(state);
     free(fuse_argv);
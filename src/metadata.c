@@ -2,6 +2,7 @@
 #include "metadata.h"
 #include "state.h"
 #include "alloc.h"
+#include "metalog.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,6 +11,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdint.h>
 
 #define META_VERSION 1
@@ -41,32 +43,212 @@ static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len)
     return crc;
 }
 
+uint32_t metadata_crc32(const void *data, size_t len)
+{
+    return crc32_update(0xFFFFFFFFU, (const uint8_t *)data, len) ^ 0xFFFFFFFFU;
+}
+
 /* ------------------------------------------------------------------ */
-/* Load                                                                */
+/* Text records                                                        */
 /* ------------------------------------------------------------------ */
 
-int metadata_load(lr_state *s)
+int metadata_parse_record(lr_state *s, char *p, int lineno, int replace)
 {
-    FILE *f = NULL;
-    char  line[PATH_MAX + 256];
-    int   lineno = 0;
-    unsigned i;
 
-    /* Try each content path in order; load the first one found */
-    for (i = 0; i < s->cfg.content_count; i++) {
-        f = fopen(s->cfg.content_paths[i], "r");
-        if (f)
-            break;
+    /* Directory records: dir|VPATH|MODE|UID|GID|MTIME_SEC|MTIME_NSEC */
+    if (strncmp(p, "dir|", 4) == 0) {
+        char buf[PATH_MAX + 256];
+        strncpy(buf, p + 4, sizeof(buf) - 1);
+        buf[sizeof(buf)-1] = '\0';
+
+        char *tok;
+        char *vpath    = buf;
+        tok = strchr(vpath, '|'); if (!tok) return 0; *tok++ = '\0';
+        char *mode_s   = tok;
+        tok = strchr(mode_s, '|'); if (!tok) return 0; *tok++ = '\0';
+        char *uid_s    = tok;
+        tok = strchr(uid_s, '|'); if (!tok) return 0; *tok++ = '\0';
+        char *gid_s    = tok;
+        tok = strchr(gid_s, '|'); if (!tok) return 0; *tok++ = '\0';
+        char *mtime_s  = tok;
+        tok = strchr(mtime_s, '|'); if (!tok) return 0; *tok++ = '\0';
+        char *mtime_ns_s = tok;
+
+        if (strlen(vpath) >= PATH_MAX) {
+            fprintf(stderr, "metadata: dir vpath too long at line %d, skipping\n",
+                    lineno);
+            return 0;
+        }
+
+        lr_dir *dir = calloc(1, sizeof(lr_dir));
+        if (!dir || state_set_path(s, &dir->vpath, vpath) != 0) {
+            free(dir);
+            return -1;
+        }
+
+        dir->mode       = (mode_t)strtoul(mode_s,    NULL, 8);
+        dir->uid        = (uid_t) strtoul(uid_s,     NULL, 10);
+        dir->gid        = (gid_t) strtoul(gid_s,     NULL, 10);
+        dir->mtime_sec  = (time_t)strtoll(mtime_s,   NULL, 10);
+        dir->mtime_nsec = strtol(mtime_ns_s,         NULL, 10);
+        if (!dir->mode)
+            dir->mode = S_IFDIR | 0755;
+
+        if (replace)
+            state_free_dir(s, state_remove_dir(s, dir->vpath));
+        state_insert_dir(s, dir);
+        return 1;
     }
 
-    if (!f) {
-        /* No content file yet — fresh start */
+    /* Symlink records: symlink|VPATH|TARGET|MTIME_SEC|MTIME_NSEC|UID|GID */
+    if (strncmp(p, "symlink|", 8) == 0) {
+        char buf[PATH_MAX * 2 + 256];
+        strncpy(buf, p + 8, sizeof(buf) - 1);
+        buf[sizeof(buf)-1] = '\0';
+
+        char *tok;
+        char *vpath      = buf;
+        tok = strchr(vpath, '|'); if (!tok) return 0; *tok++ = '\0';
+        char *target     = tok;
+        tok = strchr(target, '|'); if (!tok) return 0; *tok++ = '\0';
+        char *mtime_s    = tok;
+        tok = strchr(mtime_s, '|'); if (!tok) return 0; *tok++ = '\0';
+        char *mtime_ns_s = tok;
+        tok = strchr(mtime_ns_s, '|'); if (!tok) return 0; *tok++ = '\0';
+        char *uid_s      = tok;
+        tok = strchr(uid_s, '|'); if (!tok) return 0; *tok++ = '\0';
+        char *gid_s      = tok;
+
+        if (strlen(vpath) >= PATH_MAX || strlen(target) >= PATH_MAX) {
+            fprintf(stderr,
+                    "metadata: symlink vpath/target too long at line %d, skipping\n",
+                    lineno);
+            return 0;
+        }
+
+        lr_symlink *sl = calloc(1, sizeof(lr_symlink));
+        if (!sl || state_set_path(s, &sl->vpath,  vpath)  != 0 ||
+                   state_set_path(s, &sl->target, target) != 0) {
+            if (sl)
+                state_free_symlink(s, sl);
+            return -1;
+        }
+        sl->mtime_sec  = (time_t)strtoll(mtime_s,    NULL, 10);
+        sl->mtime_nsec = strtol(mtime_ns_s,           NULL, 10);
+        sl->uid        = (uid_t)strtoul(uid_s,        NULL, 10);
+        sl->gid        = (gid_t)strtoul(gid_s,        NULL, 10);
+        if (replace)
+            state_free_symlink(s, state_remove_symlink(s, sl->vpath));
+        state_insert_symlink(s, sl);
+        return 1;
+    }
+
+    /* File records: file|DRIVE|VPATH|SIZE|POS_START|BLOCKS|MTIME_SEC|MTIME_NSEC */
+    if (strncmp(p, "file|", 5) != 0)
         return 0;
+
+    char *tok;
+    char  buf[PATH_MAX + 256];
+    strncpy(buf, p + 5, sizeof(buf) - 1);
+    buf[sizeof(buf)-1] = '\0';
+
+    char *drive_name = buf;
+    tok = strchr(drive_name, '|'); if (!tok) return 0;
+    *tok++ = '\0';
+    char *vpath = tok;
+    tok = strchr(vpath, '|'); if (!tok) return 0;
+    *tok++ = '\0';
+    char *size_s = tok;
+    tok = strchr(size_s, '|'); if (!tok) return 0;
+    *tok++ = '\0';
+    char *pos_s = tok;
+    tok = strchr(pos_s, '|'); if (!tok) return 0;
+    *tok++ = '\0';
+    char *cnt_s = tok;
+    tok = strchr(cnt_s, '|'); if (!tok) return 0;
+    *tok++ = '\0';
+    char *mtime_s = tok;
+    tok = strchr(mtime_s, '|'); if (!tok) return 0;
+    *tok++ = '\0';
+    char *mtime_ns_s = tok;
+
+    /* Find drive index (a data drive or the cache) */
+    unsigned drive_idx = state_find_drive(s, drive_name);
+    if (drive_idx == UINT32_MAX) {
+        fprintf(stderr, "metadata: unknown drive '%s' at line %d, skipping\n",
+                drive_name, lineno);
+        return 0;
+    }
+    if (strlen(vpath) >= PATH_MAX) {
+        fprintf(stderr, "metadata: file vpath too long at line %d, skipping\n",
+                lineno);
+        return 0;
+    }
+
+    lr_file *file = calloc(1, sizeof(lr_file));
+    if (!file || state_set_path(s, &file->vpath, vpath) != 0) {
+        free(file);
+        return -1;
     }
 
-    uint32_t file_block_size = s->cfg.block_size;
+    file->drive_idx        = drive_idx;
+    file->size             = (int64_t)strtoll(size_s, NULL, 10);
+    file->parity_pos_start = (uint32_t)strtoul(pos_s, NULL, 10);
+    file->block_count      = (uint32_t)strtoul(cnt_s, NULL, 10);
+    file->mtime_sec        = (time_t)strtoll(mtime_s, NULL, 10);
+    /* mtime_ns_s may have trailing fields: |MODE|UID|GID (v2 format) */
+    tok = strchr(mtime_ns_s, '|');
+    if (tok) {
+        *tok++ = '\0';
+        char *mode_s = tok;
+        tok = strchr(mode_s, '|');
+        if (tok) {
+            *tok++ = '\0';
+            char *uid_s = tok;
+            tok = strchr(uid_s, '|');
+            if (tok) {
+                *tok++ = '\0';
+                char *gid_s = tok;
+                file->mode = (mode_t)strtoul(mode_s, NULL, 8); /* octal */
+                file->uid  = (uid_t) strtoul(uid_s,  NULL, 10);
+                file->gid  = (gid_t) strtoul(gid_s,  NULL, 10);
+            }
+        }
+    }
+    file->mtime_nsec = strtol(mtime_ns_s, NULL, 10);
+    if (!file->mode)
+        file->mode = S_IFREG | 0644; /* default for old-format files */
+
+    /* Validate block_count against size */
+    uint32_t expected = state_file_blocks(s, drive_idx, (uint64_t)file->size);
+    if (file->block_count != expected) {
+        fprintf(stderr, "metadata: block_count mismatch for %s: stored %u, computed %u\n",
+                vpath, file->block_count, expected);
+        file->block_count = expected;
+    }
+
+    /* Ensure this drive's allocator covers this file's position range */
+    uint32_t end = file->parity_pos_start + file->block_count;
+    if (end > s->drives[drive_idx].pos_alloc.next_free)
+        s->drives[drive_idx].pos_alloc.next_free = end;
+
+    if (replace)
+        state_free_file(s, state_remove_file(s, file->vpath));
+    state_insert_file(s, file);
+    return 1;
+}
+
+/* ------------------------------------------------------------------ */
+/* Text load                                                           */
+/* ------------------------------------------------------------------ */
+
+static int load_text(lr_state *s, FILE *f, const char *path)
+{
+    char  line[PATH_MAX + 256];
+    int   lineno = 0;
+    unsigned i;
+
     uint32_t running_crc = 0xFFFFFFFFU;
-    unsigned content_idx = i; /* save index of loaded content path for CRC message */
 
     while (fgets(line, sizeof(line), f)) {
         lineno++;
@@ -81,7 +263,7 @@ int metadata_load(lr_state *s)
                 fprintf(stderr,
                         "metadata: CRC mismatch in '%s' "
                         "(stored %08X, computed %08X) — file may be corrupt\n",
-                        s->cfg.content_paths[content_idx], stored, computed);
+                        path, stored, computed);
             break; /* no more records after the CRC line */
         }
 
@@ -121,6 +303,10 @@ int metadata_load(lr_state *s)
         }
         /* old global format: next_free_pos / free_extent — ignored on upgrade;
          * per-drive next_free is derived from file records below instead */
+        if (strncmp(p, "# log_gen:", 10) == 0) {
+            s->meta_gen = strtoull(p + 10, NULL, 10);
+            continue;
+        }
         if (strncmp(p, "# next_free_pos:", 16) == 0)
             continue;
         if (strncmp(p, "# free_extent:", 14) == 0)
@@ -130,192 +316,674 @@ int metadata_load(lr_state *s)
         if (p[0] == '#' || p[0] == '\0')
             continue;
 
-        /* Directory records: dir|VPATH|MODE|UID|GID|MTIME_SEC|MTIME_NSEC */
-        if (strncmp(p, "dir|", 4) == 0) {
-            char buf[PATH_MAX + 256];
-            strncpy(buf, p + 4, sizeof(buf) - 1);
-            buf[sizeof(buf)-1] = '\0';
-
-            char *tok;
-            char *vpath    = buf;
-            tok = strchr(vpath, '|'); if (!tok) continue; *tok++ = '\0';
-            char *mode_s   = tok;
-            tok = strchr(mode_s, '|'); if (!tok) continue; *tok++ = '\0';
-            char *uid_s    = tok;
-            tok = strchr(uid_s, '|'); if (!tok) continue; *tok++ = '\0';
-            char *gid_s    = tok;
-            tok = strchr(gid_s, '|'); if (!tok) continue; *tok++ = '\0';
-            char *mtime_s  = tok;
-            tok = strchr(mtime_s, '|'); if (!tok) continue; *tok++ = '\0';
-            char *mtime_ns_s = tok;
-
-            if (strlen(vpath) >= PATH_MAX) {
-                fprintf(stderr, "metadata: dir vpath too long at line %d, skipping\n",
-                        lineno);
-                continue;
-            }
+        if (metadata_parse_record(s, p, lineno, 0) < 0)
+            return -1;
+    }
 
-            lr_dir *dir = calloc(1, sizeof(lr_dir));
-            if (!dir) { fclose(f); return -1; }
+    for (i = 0; i < s->drive_count; i++)
+        state_rebuild_pos_index(s, i);
+    return 0;
+}
 
-            snprintf(dir->vpath, PATH_MAX, "%s", vpath);
-            dir->mode       = (mode_t)strtoul(mode_s,    NULL, 8);
-            dir->uid        = (uid_t) strtoul(uid_s,     NULL, 10);
-            dir->gid        = (gid_t) strtoul(gid_s,     NULL, 10);
-            dir->mtime_sec  = (time_t)strtoll(mtime_s,   NULL, 10);
-            dir->mtime_nsec = strtol(mtime_ns_s,         NULL, 10);
-            if (!dir->mode)
-                dir->mode = S_IFDIR | 0755;
+/* ------------------------------------------------------------------ */
+/* Binary format                                                       */
+/* ------------------------------------------------------------------ */
 
-            state_insert_dir(s, dir);
-            continue;
-        }
+/*
+ * header | section table | sections
+ *
+ * Each section starts on an 8-byte boundary and has its own CRC32 in the
+ * table; header_crc covers the header (with header_crc zero) and the table.
+ * Integers are in the writer's byte order, recorded in byte_order.  Every
+ * string is stored once, NUL-terminated, in the string section and records
+ * refer to it by offset, so all other records are fixed-size and are read
+ * straight out of the mapping.  Files are stored in list order; the
+ * position-index section lists, per drive, the files that own positions
+ * already sorted by start, so a load does not sort.
+ */
 
-        /* Symlink records: symlink|VPATH|TARGET|MTIME_SEC|MTIME_NSEC|UID|GID */
-        if (strncmp(p, "symlink|", 8) == 0) {
-            char buf[PATH_MAX * 2 + 256];
-            strncpy(buf, p + 8, sizeof(buf) - 1);
-            buf[sizeof(buf)-1] = '\0';
-
-            char *tok;
-            char *vpath      = buf;
-            tok = strchr(vpath, '|'); if (!tok) continue; *tok++ = '\0';
-            char *target     = tok;
-            tok = strchr(target, '|'); if (!tok) continue; *tok++ = '\0';
-            char *mtime_s    = tok;
-            tok = strchr(mtime_s, '|'); if (!tok) continue; *tok++ = '\0';
-            char *mtime_ns_s = tok;
-            tok = strchr(mtime_ns_s, '|'); if (!tok) continue; *tok++ = '\0';
-            char *uid_s      = tok;
-            tok = strchr(uid_s, '|'); if (!tok) continue; *tok++ = '\0';
-            char *gid_s      = tok;
-
-            if (strlen(vpath) >= PATH_MAX || strlen(target) >= PATH_MAX) {
-                fprintf(stderr,
-                        "metadata: symlink vpath/target too long at line %d, skipping\n",
-                        lineno);
-                continue;
-            }
+#define LRB_MAGIC      "LRCONTB\n"
+#define LRB_MAGIC_LEN  8
+#define LRB_VERSION    1
+#define LRB_BYTE_ORDER 0x01020304U
+#define LRB_ALIGN      8
 
-            lr_symlink *sl = calloc(1, sizeof(lr_symlink));
-            if (!sl) { fclose(f); return -1; }
-            snprintf(sl->vpath,  PATH_MAX, "%s", vpath);
-            snprintf(sl->target, PATH_MAX, "%s", target);
-            sl->mtime_sec  = (time_t)strtoll(mtime_s,    NULL, 10);
-            sl->mtime_nsec = strtol(mtime_ns_s,           NULL, 10);
-            sl->uid        = (uid_t)strtoul(uid_s,        NULL, 10);
-            sl->gid        = (gid_t)strtoul(gid_s,        NULL, 10);
-            state_insert_symlink(s, sl);
-            continue;
-        }
+enum {
+    LRB_SEC_STRINGS = 1,
+    LRB_SEC_DRIVES,
+    LRB_SEC_EXTENTS,
+    LRB_SEC_FILES,
+    LRB_SEC_DIRS,
+    LRB_SEC_SYMLINKS,
+    LRB_SEC_POS_INDEX,
+    LRB_SEC_REQUIRED = LRB_SEC_POS_INDEX,
+    LRB_SEC_LOG_GEN,            /* optional: change-log generation */
+    LRB_SEC_MAX = LRB_SEC_LOG_GEN
+};
 
-        /* File records: file|DRIVE|VPATH|SIZE|POS_START|BLOCKS|MTIME_SEC|MTIME_NSEC */
-        if (strncmp(p, "file|", 5) != 0)
-            continue;
+typedef struct {
+    char     magic[LRB_MAGIC_LEN];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t block_size;
+    uint32_t section_count;
+    uint32_t header_crc;
+    uint32_t reserved;
+} lrb_header;
 
-        char *tok;
-        char  buf[PATH_MAX + 256];
-        strncpy(buf, p + 5, sizeof(buf) - 1);
-        buf[sizeof(buf)-1] = '\0';
+typedef struct {
+    uint32_t type;
+    uint32_t crc;
+    uint64_t offset;        /* from the start of the file */
+    uint64_t size;          /* bytes */
+    uint64_t count;         /* records (strings: bytes) */
+} lrb_section;
 
-        char *drive_name = buf;
-        tok = strchr(drive_name, '|'); if (!tok) continue;
-        *tok++ = '\0';
-        char *vpath = tok;
-        tok = strchr(vpath, '|'); if (!tok) continue;
-        *tok++ = '\0';
-        char *size_s = tok;
-        tok = strchr(size_s, '|'); if (!tok) continue;
-        *tok++ = '\0';
-        char *pos_s = tok;
-        tok = strchr(pos_s, '|'); if (!tok) continue;
-        *tok++ = '\0';
-        char *cnt_s = tok;
-        tok = strchr(cnt_s, '|'); if (!tok) continue;
-        *tok++ = '\0';
-        char *mtime_s = tok;
-        tok = strchr(mtime_s, '|'); if (!tok) continue;
-        *tok++ = '\0';
-        char *mtime_ns_s = tok;
+typedef struct {
+    uint32_t name;          /* string offset */
+    uint32_t next_free;
+    uint32_t ext_first;     /* into the extent section */
+    uint32_t ext_count;
+    uint32_t pos_first;     /* into the position-index section */
+    uint32_t pos_count;
+} lrb_drive;
 
-        /* Find drive index */
-        unsigned drive_idx = UINT32_MAX;
-        for (i = 0; i < s->drive_count; i++) {
-            if (strcmp(s->drives[i].name, drive_name) == 0) {
-                drive_idx = i;
-                break;
-            }
+typedef struct {
+    uint32_t vpath;
+    uint32_t drive;         /* into the drive section */
+    int64_t  size;
+    uint32_t pos_start;
+    uint32_t block_count;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t reserved;
+} lrb_file;
+
+typedef struct {
+    uint32_t vpath;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+} lrb_dir;
+
+typedef struct {
+    uint32_t vpath;
+    uint32_t target;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+} lrb_symlink;
+
+typedef struct {
+    uint32_t pos_start;
+    uint32_t file;          /* into the file section */
+} lrb_pos;
+
+static const size_t lrb_rec_size[LRB_SEC_MAX + 1] = {
+    [LRB_SEC_STRINGS]   = 1,
+    [LRB_SEC_DRIVES]    = sizeof(lrb_drive),
+    [LRB_SEC_EXTENTS]   = sizeof(lr_extent),
+    [LRB_SEC_FILES]     = sizeof(lrb_file),
+    [LRB_SEC_DIRS]      = sizeof(lrb_dir),
+    [LRB_SEC_SYMLINKS]  = sizeof(lrb_symlink),
+    [LRB_SEC_POS_INDEX] = sizeof(lrb_pos),
+    [LRB_SEC_LOG_GEN]   = sizeof(uint64_t),
+};
+
+static uint32_t header_crc(const lrb_header *hdr, const lrb_section *table)
+{
+    lrb_header h = *hdr;
+    h.header_crc = 0;
+    uint32_t crc = crc32_update(0xFFFFFFFFU, (const uint8_t *)&h, sizeof(h));
+    crc = crc32_update(crc, (const uint8_t *)table,
+                       (size_t)h.section_count * sizeof(lrb_section));
+    return crc ^ 0xFFFFFFFFU;
+}
+
+/* ---- Binary save ---- */
+
+typedef struct {
+    uint32_t drive;
+    uint32_t pos_start;
+    uint32_t file;
+} lrb_save_pos;
+
+static int save_pos_cmp(const void *a, const void *b)
+{
+    const lrb_save_pos *x = a, *y = b;
+    if (x->drive != y->drive)
+        return x->drive < y->drive ? -1 : 1;
+    if (x->pos_start != y->pos_start)
+        return x->pos_start < y->pos_start ? -1 : 1;
+    return 0;
+}
+
+static size_t lrb_align(size_t n)
+{
+    return (n + LRB_ALIGN - 1) & ~(size_t)(LRB_ALIGN - 1);
+}
+
+static uint32_t put_str(char *strs, size_t *off, const char *str)
+{
+    size_t   n  = strlen(str) + 1;
+    uint32_t at = (uint32_t)*off;
+    memcpy(strs + *off, str, n);
+    *off += n;
+    return at;
+}
+
+static int build_binary(lr_state *s, uint64_t gen, char **out,
+                        size_t *out_size)
+{
+    uint64_t n[LRB_SEC_MAX + 1] = { 0 };
+    lr_list_node *node;
+
+    n[LRB_SEC_LOG_GEN]  = 1;
+    n[LRB_SEC_DRIVES]   = state_drive_slots(s);
+    n[LRB_SEC_FILES]    = s->file_list.count;
+    n[LRB_SEC_DIRS]     = s->dir_list.count;
+    n[LRB_SEC_SYMLINKS] = s->symlink_list.count;
+    for (unsigned d = 0; d < state_drive_slots(s); d++) {
+        n[LRB_SEC_STRINGS] += strlen(s->drives[d].name) + 1;
+        n[LRB_SEC_EXTENTS] += s->drives[d].pos_alloc.ext_count;
+    }
+    for (node = lr_list_head(&s->file_list); node; node = node->next) {
+        lr_file *file = (lr_file *)node->data;
+        n[LRB_SEC_STRINGS] += strlen(file->vpath) + 1;
+        if (file->block_count > 0)
+            n[LRB_SEC_POS_INDEX]++;
+    }
+    for (node = lr_list_head(&s->dir_list); node; node = node->next)
+        n[LRB_SEC_STRINGS] += strlen(((lr_dir *)node->data)->vpath) + 1;
+    for (node = lr_list_head(&s->symlink_list); node; node = node->next) {
+        lr_symlink *sl = (lr_symlink *)node->data;
+        n[LRB_SEC_STRINGS] += strlen(sl->vpath) + strlen(sl->target) + 2;
+    }
+    if (n[LRB_SEC_STRINGS] > UINT32_MAX) {
+        fprintf(stderr, "metadata_save: string table too large for the "
+                        "binary format\n");
+        return -1;
+    }
+
+    lrb_section table[LRB_SEC_MAX];
+    size_t off = lrb_align(sizeof(lrb_header) + sizeof(table));
+    for (unsigned t = 1; t <= LRB_SEC_MAX; t++) {
+        lrb_section *sec = &table[t - 1];
+        sec->type   = t;
+        sec->crc    = 0;
+        sec->offset = off;
+        sec->count  = n[t];
+        sec->size   = n[t] * lrb_rec_size[t];
+        off = lrb_align(off + (size_t)sec->size);
+    }
+
+    char         *buf = calloc(1, off);
+    lrb_save_pos *pos = malloc((size_t)(n[LRB_SEC_POS_INDEX] ? n[LRB_SEC_POS_INDEX] : 1)
+                               * sizeof(lrb_save_pos));
+    if (!buf || !pos) {
+        fprintf(stderr, "metadata_save: out of memory\n");
+        free(buf);
+        free(pos);
+        return -1;
+    }
+
+#define SEC(t, type) ((type *)(buf + table[(t) - 1].offset))
+    char        *strs = SEC(LRB_SEC_STRINGS, char);
+    lrb_drive   *dr   = SEC(LRB_SEC_DRIVES, lrb_drive);
+    lr_extent   *ex   = SEC(LRB_SEC_EXTENTS, lr_extent);
+    lrb_file    *fr   = SEC(LRB_SEC_FILES, lrb_file);
+    lrb_dir     *dir  = SEC(LRB_SEC_DIRS, lrb_dir);
+    lrb_symlink *slr  = SEC(LRB_SEC_SYMLINKS, lrb_symlink);
+    lrb_pos     *px   = SEC(LRB_SEC_POS_INDEX, lrb_pos);
+    memcpy(SEC(LRB_SEC_LOG_GEN, char), &gen, sizeof(gen));
+#undef SEC
+    size_t   so = 0;
+    uint32_t ei = 0, fi = 0, pi = 0;
+
+    /* The cache has a slot too, for its files' drive index */
+    for (unsigned d = 0; d < state_drive_slots(s); d++) {
+        lr_pos_allocator *pa = &s->drives[d].pos_alloc;
+        dr[d].name      = put_str(strs, &so, s->drives[d].name);
+        dr[d].next_free = pa->next_free;
+        dr[d].ext_first = ei;
+        dr[d].ext_count = pa->ext_count;
+        for (uint32_t pos = 0; alloc_next_extent(pa, pos, &ex[ei]);
+             pos = ex[ei].start + ex[ei].count, ei++)
+            ;
+    }
+
+    for (node = lr_list_head(&s->file_list); node; node = node->next, fi++) {
+        lr_file  *file = (lr_file *)node->data;
+        lrb_file *r    = &fr[fi];
+        r->vpath       = put_str(strs, &so, file->vpath);
+        r->drive       = file->drive_idx;
+        r->size        = file->size;
+        r->pos_start   = file->parity_pos_start;
+        r->block_count = file->block_count;
+        r->mtime_sec   = file->mtime_sec;
+        r->mtime_nsec  = file->mtime_nsec;
+        r->mode        = (uint32_t)file->mode;
+        r->uid         = (uint32_t)file->uid;
+        r->gid         = (uint32_t)file->gid;
+        if (file->block_count > 0)
+            pos[pi++] = (lrb_save_pos){ file->drive_idx,
+                                        file->parity_pos_start, fi };
+    }
+
+    uint32_t k = 0;
+    for (node = lr_list_head(&s->dir_list); node; node = node->next, k++) {
+        lr_dir *d = (lr_dir *)node->data;
+        dir[k].vpath      = put_str(strs, &so, d->vpath);
+        dir[k].mode       = (uint32_t)d->mode;
+        dir[k].uid        = (uint32_t)d->uid;
+        dir[k].gid        = (uint32_t)d->gid;
+        dir[k].mtime_sec  = d->mtime_sec;
+        dir[k].mtime_nsec = d->mtime_nsec;
+    }
+
+    k = 0;
+    for (node = lr_list_head(&s->symlink_list); node; node = node->next, k++) {
+        lr_symlink *sl = (lr_symlink *)node->data;
+        slr[k].vpath      = put_str(strs, &so, sl->vpath);
+        slr[k].target     = put_str(strs, &so, sl->target);
+        slr[k].uid        = (uint32_t)sl->uid;
+        slr[k].gid        = (uint32_t)sl->gid;
+        slr[k].mtime_sec  = sl->mtime_sec;
+        slr[k].mtime_nsec = sl->mtime_nsec;
+    }
+
+    /* Sort here, off the mount path, so the load can take the index as is */
+    qsort(pos, pi, sizeof(lrb_save_pos), save_pos_cmp);
+    k = 0;
+    for (unsigned d = 0; d < state_drive_slots(s); d++) {
+        dr[d].pos_first = k;
+        for (; k < pi && pos[k].drive == d; k++)
+            px[k] = (lrb_pos){ pos[k].pos_start, pos[k].file };
+        dr[d].pos_count = k - dr[d].pos_first;
+    }
+    free(pos);
+
+    for (unsigned t = 0; t < LRB_SEC_MAX; t++)
+        table[t].crc = metadata_crc32(buf + table[t].offset, (size_t)table[t].size);
+
+    lrb_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, LRB_MAGIC, LRB_MAGIC_LEN);
+    hdr.version       = LRB_VERSION;
+    hdr.byte_order    = LRB_BYTE_ORDER;
+    hdr.block_size    = s->cfg.block_size;
+    hdr.section_count = LRB_SEC_MAX;
+    hdr.header_crc    = header_crc(&hdr, table);
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), table, sizeof(table));
+
+    *out      = buf;
+    *out_size = off;
+    return 0;
+}
+
+/* ---- Binary load ---- */
+
+/* Check the header, the section table and every section checksum; fill
+ * sec[type] for each known section.  Returns 0, or -1 with a message. */
+static int lrb_check(const char *map, size_t size, const char *path,
+                     const lrb_section **sec)
+{
+    lrb_header hdr;
+    if (size < sizeof(hdr)) {
+        fprintf(stderr, "metadata: '%s' is truncated\n", path);
+        return -1;
+    }
+    memcpy(&hdr, map, sizeof(hdr));
+    if (hdr.byte_order != LRB_BYTE_ORDER) {
+        fprintf(stderr, "metadata: '%s' was written on a machine with a "
+                        "different byte order\n", path);
+        return -1;
+    }
+    if (hdr.version != LRB_VERSION) {
+        fprintf(stderr, "metadata: '%s' has unsupported binary version %u\n",
+                path, hdr.version);
+        return -1;
+    }
+    if (hdr.section_count > 64 ||
+        sizeof(hdr) + (size_t)hdr.section_count * sizeof(lrb_section) > size) {
+        fprintf(stderr, "metadata: '%s' is truncated\n", path);
+        return -1;
+    }
+    const lrb_section *table = (const lrb_section *)(map + sizeof(hdr));
+    if (header_crc(&hdr, table) != hdr.header_crc) {
+        fprintf(stderr, "metadata: header checksum mismatch in '%s'\n", path);
+        return -1;
+    }
+
+    memset(sec, 0, (LRB_SEC_MAX + 1) * sizeof(*sec));
+    for (uint32_t k = 0; k < hdr.section_count; k++) {
+        const lrb_section *t = &table[k];
+        if (t->type == 0 || t->type > LRB_SEC_MAX)
+            continue;   /* unknown sections are ignored */
+        if (t->offset % LRB_ALIGN != 0 || t->offset > size ||
+            t->size > size - t->offset || t->count > UINT32_MAX ||
+            t->size != t->count * lrb_rec_size[t->type]) {
+            fprintf(stderr, "metadata: section %u out of bounds in '%s'\n",
+                    t->type, path);
+            return -1;
         }
-        if (drive_idx == UINT32_MAX) {
-            fprintf(stderr, "metadata: unknown drive '%s' at line %d, skipping\n",
-                    drive_name, lineno);
-            continue;
+        if (metadata_crc32(map + t->offset, (size_t)t->size) != t->crc) {
+            fprintf(stderr, "metadata: section %u checksum mismatch in '%s'\n",
+                    t->type, path);
+            return -1;
         }
-        if (strlen(vpath) >= PATH_MAX) {
-            fprintf(stderr, "metadata: file vpath too long at line %d, skipping\n",
-                    lineno);
-            continue;
+        sec[t->type] = t;
+    }
+    for (unsigned t = 1; t <= LRB_SEC_REQUIRED; t++) {
+        if (!sec[t]) {
+            fprintf(stderr, "metadata: section %u missing in '%s'\n", t, path);
+            return -1;
         }
+    }
+    return 0;
+}
 
-        lr_file *file = calloc(1, sizeof(lr_file));
-        if (!file) {
-            fclose(f);
-            return -1;
+/* String offset off is inside the table and names a string shorter than
+ * max bytes. */
+static int lrb_str_ok(const char *strs, uint64_t strs_size, uint32_t off,
+                      size_t max)
+{
+    return off < strs_size && strnlen(strs + off, strs_size - off) < max;
+}
+
+/* Check every cross-reference, so that applying the file cannot fail
+ * half-way except on OOM.  Returns 0, or -1 with a message. */
+static int lrb_validate(const char *map, const lrb_section **sec,
+                        const char *path)
+{
+    const char        *strs = map + sec[LRB_SEC_STRINGS]->offset;
+    uint64_t           ns   = sec[LRB_SEC_STRINGS]->size;
+    const lrb_drive   *dr   = (const lrb_drive *)(map + sec[LRB_SEC_DRIVES]->offset);
+    const lrb_file    *fr   = (const lrb_file *)(map + sec[LRB_SEC_FILES]->offset);
+    const lrb_dir     *dir  = (const lrb_dir *)(map + sec[LRB_SEC_DIRS]->offset);
+    const lrb_symlink *slr  = (const lrb_symlink *)(map + sec[LRB_SEC_SYMLINKS]->offset);
+    const lrb_pos     *px   = (const lrb_pos *)(map + sec[LRB_SEC_POS_INDEX]->offset);
+    uint64_t k;
+
+    /* A final NUL keeps every in-range offset terminated */
+    if (ns > 0 && strs[ns - 1] != '\0')
+        goto bad;
+    for (k = 0; k < sec[LRB_SEC_DRIVES]->count; k++) {
+        if (!lrb_str_ok(strs, ns, dr[k].name, 64) ||
+            (uint64_t)dr[k].ext_first + dr[k].ext_count > sec[LRB_SEC_EXTENTS]->count ||
+            (uint64_t)dr[k].pos_first + dr[k].pos_count > sec[LRB_SEC_POS_INDEX]->count)
+            goto bad;
+    }
+    for (k = 0; k < sec[LRB_SEC_FILES]->count; k++) {
+        if (!lrb_str_ok(strs, ns, fr[k].vpath, PATH_MAX) ||
+            fr[k].drive >= sec[LRB_SEC_DRIVES]->count)
+            goto bad;
+    }
+    for (k = 0; k < sec[LRB_SEC_DIRS]->count; k++) {
+        if (!lrb_str_ok(strs, ns, dir[k].vpath, PATH_MAX))
+            goto bad;
+    }
+    for (k = 0; k < sec[LRB_SEC_SYMLINKS]->count; k++) {
+        if (!lrb_str_ok(strs, ns, slr[k].vpath, PATH_MAX) ||
+            !lrb_str_ok(strs, ns, slr[k].target, PATH_MAX))
+            goto bad;
+    }
+    for (k = 0; k < sec[LRB_SEC_POS_INDEX]->count; k++) {
+        if (px[k].file >= sec[LRB_SEC_FILES]->count)
+            goto bad;
+    }
+    return 0;
+
+bad:
+    fprintf(stderr, "metadata: bad record reference in '%s'\n", path);
+    return -1;
+}
+
+/* Move the validated records into s.  Returns 0 or -1 (OOM). */
+static int lrb_apply(lr_state *s, const char *map, const lrb_section **sec,
+                     const char *path)
+{
+    const char        *strs = map + sec[LRB_SEC_STRINGS]->offset;
+    const lrb_drive   *dr   = (const lrb_drive *)(map + sec[LRB_SEC_DRIVES]->offset);
+    const lr_extent   *ex   = (const lr_extent *)(map + sec[LRB_SEC_EXTENTS]->offset);
+    const lrb_file    *fr   = (const lrb_file *)(map + sec[LRB_SEC_FILES]->offset);
+    const lrb_dir     *dir  = (const lrb_dir *)(map + sec[LRB_SEC_DIRS]->offset);
+    const lrb_symlink *slr  = (const lrb_symlink *)(map + sec[LRB_SEC_SYMLINKS]->offset);
+    const lrb_pos     *px   = (const lrb_pos *)(map + sec[LRB_SEC_POS_INDEX]->offset);
+    uint32_t nd = (uint32_t)sec[LRB_SEC_DRIVES]->count;
+    uint32_t nf = (uint32_t)sec[LRB_SEC_FILES]->count;
+    uint32_t ndir = (uint32_t)sec[LRB_SEC_DIRS]->count;
+    uint32_t nsl = (uint32_t)sec[LRB_SEC_SYMLINKS]->count;
+    uint32_t with_blocks[LR_DRIVE_MAX] = { 0 };
+    uint32_t k;
+
+    unsigned *local  = malloc((size_t)(nd ? nd : 1) * sizeof(unsigned));
+    lr_file **loaded = calloc(nf ? nf : 1, sizeof(lr_file *));
+    if (!local || !loaded)
+        goto oom;
+
+    if (sec[LRB_SEC_LOG_GEN] && sec[LRB_SEC_LOG_GEN]->count == 1)
+        memcpy(&s->meta_gen, map + sec[LRB_SEC_LOG_GEN]->offset,
+               sizeof(s->meta_gen));
+
+    /* Drives, matched to the config by name */
+    for (k = 0; k < nd; k++) {
+        const char *name = strs + dr[k].name;
+        local[k] = state_find_drive(s, name);
+        if (local[k] == UINT32_MAX) {
+            fprintf(stderr, "metadata: unknown drive '%s' in '%s', "
+                            "skipping its files\n", name, path);
+            continue;
+        }
+        lr_pos_allocator *pa = &s->drives[local[k]].pos_alloc;
+        if (dr[k].next_free > pa->next_free)
+            pa->next_free = dr[k].next_free;
+        const lr_extent *e = &ex[dr[k].ext_first];
+        if (pa->ext_count != 0 ||
+            alloc_set_extents(pa, e, dr[k].ext_count) != 0) {
+            for (uint32_t x = 0; x < dr[k].ext_count; x++)
+                free_positions(pa, e[x].start, e[x].count);
         }
+    }
 
-        snprintf(file->vpath, PATH_MAX, "%s", vpath);
-        snprintf(file->real_path, PATH_MAX, "%s%s",
-                 s->drives[drive_idx].dir,
-                 vpath[0] == '/' ? vpath + 1 : vpath);
-        file->drive_idx        = drive_idx;
-        file->size             = (int64_t)strtoll(size_s, NULL, 10);
-        file->parity_pos_start = (uint32_t)strtoul(pos_s, NULL, 10);
-        file->block_count      = (uint32_t)strtoul(cnt_s, NULL, 10);
-        file->mtime_sec        = (time_t)strtoll(mtime_s, NULL, 10);
-        /* mtime_ns_s may have trailing fields: |MODE|UID|GID (v2 format) */
-        tok = strchr(mtime_ns_s, '|');
-        if (tok) {
-            *tok++ = '\0';
-            char *mode_s = tok;
-            tok = strchr(mode_s, '|');
-            if (tok) {
-                *tok++ = '\0';
-                char *uid_s = tok;
-                tok = strchr(uid_s, '|');
-                if (tok) {
-                    *tok++ = '\0';
-                    char *gid_s = tok;
-                    file->mode = (mode_t)strtoul(mode_s, NULL, 8); /* octal */
-                    file->uid  = (uid_t) strtoul(uid_s,  NULL, 10);
-                    file->gid  = (gid_t) strtoul(gid_s,  NULL, 10);
-                }
-            }
+    lr_hash_reserve(&s->file_table,    s->file_table.count + nf);
+    lr_hash_reserve(&s->dir_table,     s->dir_table.count + ndir);
+    lr_hash_reserve(&s->symlink_table, s->symlink_table.count + nsl);
+
+    for (k = 0; k < nf; k++) {
+        const lrb_file *r = &fr[k];
+        unsigned d = local[r->drive];
+        if (d == UINT32_MAX)
+            continue;
+        lr_file *file = calloc(1, sizeof(lr_file));
+        if (!file || state_set_path(s, &file->vpath, strs + r->vpath) != 0) {
+            free(file);
+            goto oom;
         }
-        file->mtime_nsec = strtol(mtime_ns_s, NULL, 10);
-        if (!file->mode)
-            file->mode = S_IFREG | 0644; /* default for old-format files */
+        file->drive_idx        = d;
+        file->size             = r->size;
+        file->parity_pos_start = r->pos_start;
+        file->block_count      = r->block_count;
+        file->mtime_sec        = (time_t)r->mtime_sec;
+        file->mtime_nsec       = (long)r->mtime_nsec;
+        file->mode             = r->mode ? (mode_t)r->mode : S_IFREG | 0644;
+        file->uid              = (uid_t)r->uid;
+        file->gid              = (gid_t)r->gid;
 
-        /* Validate block_count against size */
-        uint32_t expected = blocks_for_size((uint64_t)file->size, file_block_size);
+        uint32_t expected = state_file_blocks(s, d, (uint64_t)file->size);
         if (file->block_count != expected) {
             fprintf(stderr, "metadata: block_count mismatch for %s: stored %u, computed %u\n",
-                    vpath, file->block_count, expected);
+                    file->vpath, file->block_count, expected);
             file->block_count = expected;
         }
-
-        /* Ensure this drive's allocator covers this file's position range */
         uint32_t end = file->parity_pos_start + file->block_count;
-        if (end > s->drives[drive_idx].pos_alloc.next_free)
-            s->drives[drive_idx].pos_alloc.next_free = end;
+        if (end > s->drives[d].pos_alloc.next_free)
+            s->drives[d].pos_alloc.next_free = end;
 
         state_insert_file(s, file);
+        loaded[k] = file;
+        if (file->block_count > 0)
+            with_blocks[d]++;
     }
 
-    fclose(f);
+    for (k = 0; k < ndir; k++) {
+        lr_dir *d = calloc(1, sizeof(lr_dir));
+        if (!d || state_set_path(s, &d->vpath, strs + dir[k].vpath) != 0) {
+            free(d);
+            goto oom;
+        }
+        d->mode       = dir[k].mode ? (mode_t)dir[k].mode : S_IFDIR | 0755;
+        d->uid        = (uid_t)dir[k].uid;
+        d->gid        = (gid_t)dir[k].gid;
+        d->mtime_sec  = (time_t)dir[k].mtime_sec;
+        d->mtime_nsec = (long)dir[k].mtime_nsec;
+        state_insert_dir(s, d);
+    }
 
-    /* Rebuild position indexes */
-    for (i = 0; i < s->drive_count; i++)
-        state_rebuild_pos_index(s, i);
+    for (k = 0; k < nsl; k++) {
+        lr_symlink *sl = calloc(1, sizeof(lr_symlink));
+        if (!sl || state_set_path(s, &sl->vpath,  strs + slr[k].vpath)  != 0 ||
+                   state_set_path(s, &sl->target, strs + slr[k].target) != 0) {
+            if (sl)
+                state_free_symlink(s, sl);
+            goto oom;
+        }
+        sl->uid        = (uid_t)slr[k].uid;
+        sl->gid        = (gid_t)slr[k].gid;
+        sl->mtime_sec  = (time_t)slr[k].mtime_sec;
+        sl->mtime_nsec = (long)slr[k].mtime_nsec;
+        state_insert_symlink(s, sl);
+    }
+
+    /* Position indexes in bulk; a drive whose stored index does not match
+     * the files just loaded falls back to a rebuild */
+    for (k = 0; k < nd; k++) {
+        unsigned d = local[k];
+        if (d == UINT32_MAX)
+            continue;
+        uint32_t      n   = dr[k].pos_count;
+        lr_pos_entry *arr = NULL;
+        uint32_t      i   = 0;
+        if (n == with_blocks[d])
+            arr = malloc((size_t)(n ? n : 1) * sizeof(lr_pos_entry));
+        for (; arr && i < n; i++) {
+            const lrb_pos *e = &px[dr[k].pos_first + i];
+            lr_file       *f = loaded[e->file];
+            if (!f || f->drive_idx != d || f->block_count == 0 ||
+                f->parity_pos_start != e->pos_start)
+                break;
+            arr[i].pos_start   = f->parity_pos_start;
+            arr[i].block_count = f->block_count;
+            arr[i].file        = f;
+        }
+        if (arr && i == n) {
+            state_load_pos_index(s, d, arr, n);
+        } else {
+            free(arr);
+            fprintf(stderr, "metadata: position index for drive '%s' in '%s' "
+                            "does not match its files, rebuilding\n",
+                    s->drives[d].name, path);
+            state_rebuild_pos_index(s, d);
+        }
+    }
+
+    free(local);
+    free(loaded);
+    return 0;
+
+oom:
+    fprintf(stderr, "metadata: out of memory loading '%s'\n", path);
+    free(local);
+    free(loaded);
+    return -1;
+}
+
+/* Returns 0, -1 on OOM (s partly loaded) or -2 when the file is rejected
+ * (s untouched). */
+static int load_binary(lr_state *s, int fd, const char *path)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(lrb_header)) {
+        fprintf(stderr, "metadata: '%s' is truncated\n", path);
+        return -2;
+    }
+    size_t size = (size_t)st.st_size;
+    char  *map  = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "metadata: mmap '%s': %s\n", path, strerror(errno));
+        return -2;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const lrb_section *sec[LRB_SEC_MAX + 1];
+    int rc = -2;
+    if (lrb_check(map, size, path, sec) == 0 &&
+        lrb_validate(map, sec, path) == 0)
+        rc = lrb_apply(s, map, sec, path);
+    munmap(map, size);
+    return rc;
+}
+
+/* ------------------------------------------------------------------ */
+/* Load                                                                */
+/* ------------------------------------------------------------------ */
+
+int metadata_load(lr_state *s)
+{
+    int loaded = 0, rejected = 0;
+    unsigned i;
+
+    /* Try each content path in order; load the first one found.  A binary
+     * file that fails its checksums is skipped for the next copy. */
+    for (i = 0; i < s->cfg.content_count && !loaded; i++) {
+        const char *path = s->cfg.content_paths[i];
+        FILE *f = fopen(path, "r");
+        if (!f)
+            continue;
+
+        char magic[LRB_MAGIC_LEN];
+        int  rc;
+        if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+            memcmp(magic, LRB_MAGIC, sizeof(magic)) == 0) {
+            rc = load_binary(s, fileno(f), path);
+        } else {
+            rewind(f);
+            rc = load_text(s, f, path);
+        }
+        fclose(f);
+
+        if (rc == -2) {
+            rejected = 1;
+            continue;
+        }
+        if (rc != 0)
+            return -1;
+        loaded = 1;
+
+        /* Changes made since this snapshot was written */
+        int n = metalog_replay(s, path, s->meta_gen);
+        if (n < 0)
+            return -1;
+        if (n > 0) {
+            for (unsigned d = 0; d < s->drive_count; d++) {
+                state_rebuild_pos_index(s, d);
+                state_rebuild_allocator(s, d);
+            }
+            s->log_replayed = (uint32_t)n;
+        }
+    }
+
+    if (!loaded) {
+        /* No content file yet — fresh start */
+        return rejected ? -1 : 0;
+    }
 
     /* Integrity check: warn if any two files on the same drive have
      * overlapping parity position ranges (indicates a corrupt content file). */
@@ -344,12 +1012,46 @@ int metadata_load(lr_state *s)
 /* Save                                                                */
 /* ------------------------------------------------------------------ */
 
-static int write_to_path(lr_state *s, const char *path)
+/* ---- Record output ---- */
+
+void metadata_print_file(FILE *out, const lr_state *s, const lr_file *file)
 {
-    char tmp[PATH_MAX];
-    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    fprintf(out, "file|%s|%s|%lld|%u|%u|%lld|%ld|%o|%u|%u\n",
+            s->drives[file->drive_idx].name,
+            file->vpath,
+            (long long)file->size,
+            file->parity_pos_start,
+            file->block_count,
+            (long long)file->mtime_sec,
+            file->mtime_nsec,
+            (unsigned)file->mode,
+            (unsigned)file->uid,
+            (unsigned)file->gid);
+}
+
+void metadata_print_dir(FILE *out, const lr_dir *dir)
+{
+    fprintf(out, "dir|%s|%o|%u|%u|%lld|%ld\n",
+            dir->vpath,
+            (unsigned)dir->mode,
+            (unsigned)dir->uid,
+            (unsigned)dir->gid,
+            (long long)dir->mtime_sec,
+            dir->mtime_nsec);
+}
 
-    /* Step 1: build content in a memory buffer so we can CRC it */
+void metadata_print_symlink(FILE *out, const lr_symlink *sl)
+{
+    fprintf(out, "symlink|%s|%s|%lld|%ld|%u|%u\n",
+            sl->vpath, sl->target,
+            (long long)sl->mtime_sec, sl->mtime_nsec,
+            (unsigned)sl->uid, (unsigned)sl->gid);
+}
+
+/* Text content, CRC footer included, in a malloc'd buffer. */
+static int build_text(lr_state *s, uint64_t gen, char **out, size_t *out_size)
+{
+    /* Build in a memory buffer so we can CRC it */
     char  *mbuf  = NULL;
     size_t msize = 0;
     FILE  *mf    = open_memstream(&mbuf, &msize);
@@ -362,73 +1064,49 @@ static int write_to_path(lr_state *s, const char *path)
     fprintf(mf, "# liveraid content\n");
     fprintf(mf, "# version: %d\n", META_VERSION);
     fprintf(mf, "# blocksize: %u\n", s->cfg.block_size);
+    fprintf(mf, "# log_gen: %llu\n", (unsigned long long)gen);
     for (unsigned d = 0; d < s->drive_count; d++) {
         lr_pos_allocator *pa = &s->drives[d].pos_alloc;
         fprintf(mf, "# drive_next_free: %s %u\n", s->drives[d].name, pa->next_free);
-        for (uint32_t ei = 0; ei < pa->ext_count; ei++)
+        lr_extent e;
+        for (uint32_t pos = 0; alloc_next_extent(pa, pos, &e);
+             pos = e.start + e.count)
             fprintf(mf, "# drive_free_extent: %s %u %u\n",
-                    s->drives[d].name,
-                    pa->extents[ei].start,
-                    pa->extents[ei].count);
+                    s->drives[d].name, e.start, e.count);
     }
 
-    lr_list_node *node = lr_list_head(&s->file_list);
-    while (node) {
-        lr_file *file = (lr_file *)node->data;
-        fprintf(mf, "file|%s|%s|%lld|%u|%u|%lld|%ld|%o|%u|%u\n",
-                s->drives[file->drive_idx].name,
-                file->vpath,
-                (long long)file->size,
-                file->parity_pos_start,
-                file->block_count,
-                (long long)file->mtime_sec,
-                file->mtime_nsec,
-                (unsigned)file->mode,
-                (unsigned)file->uid,
-                (unsigned)file->gid);
-        node = node->next;
-    }
-
-    node = lr_list_head(&s->dir_list);
-    while (node) {
-        lr_dir *dir = (lr_dir *)node->data;
-        fprintf(mf, "dir|%s|%o|%u|%u|%lld|%ld\n",
-                dir->vpath,
-                (unsigned)dir->mode,
-                (unsigned)dir->uid,
-                (unsigned)dir->gid,
-                (long long)dir->mtime_sec,
-                dir->mtime_nsec);
-        node = node->next;
-    }
-
-    node = lr_list_head(&s->symlink_list);
-    while (node) {
-        lr_symlink *sl = (lr_symlink *)node->data;
-        fprintf(mf, "symlink|%s|%s|%lld|%ld|%u|%u\n",
-                sl->vpath, sl->target,
-                (long long)sl->mtime_sec, sl->mtime_nsec,
-                (unsigned)sl->uid, (unsigned)sl->gid);
-        node = node->next;
-    }
+    lr_list_node *node;
+    for (node = lr_list_head(&s->file_list); node; node = node->next)
+        metadata_print_file(mf, s, (const lr_file *)node->data);
+    for (node = lr_list_head(&s->dir_list); node; node = node->next)
+        metadata_print_dir(mf, (const lr_dir *)node->data);
+    for (node = lr_list_head(&s->symlink_list); node; node = node->next)
+        metadata_print_symlink(mf, (const lr_symlink *)node->data);
 
-    /* Step 2: flush to get msize, compute CRC of the body, append footer */
+    /* Flush to get msize, compute CRC of the body, append footer */
     fflush(mf);
     uint32_t crc = crc32_update(0xFFFFFFFFU, (const uint8_t *)mbuf, msize)
                    ^ 0xFFFFFFFFU;
     fprintf(mf, "# crc32: %08X\n", crc);
     fclose(mf);  /* updates mbuf/msize to include the CRC footer */
 
-    /* Step 3: write mbuf atomically to the target path */
+    *out      = mbuf;
+    *out_size = msize;
+    return 0;
+}
+
+static int write_atomic(const char *path, const char *mbuf, size_t msize)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
     FILE *f = fopen(tmp, "w");
     if (!f) {
         fprintf(stderr, "metadata_save: cannot open '%s': %s\n",
                 tmp, strerror(errno));
-        free(mbuf);
         return -1;
     }
     size_t written = fwrite(mbuf, 1, msize, f);
-    free(mbuf);
 
     if (written != msize) {
         fprintf(stderr, "metadata_save: short write to '%s'\n", tmp);
@@ -453,11 +1131,82 @@ static int write_to_path(lr_state *s, const char *path)
 
 int metadata_save(lr_state *s)
 {
+    char    *buf;
+    size_t   size;
+    int      rc, saved = 0;
+    uint64_t gen = s->meta_gen + 1;
+
+    /* Changes not yet in the log go there first: a content path whose
+     * snapshot write fails keeps its old snapshot and a complete log. */
+    if (s->mlog) {
+        metalog_collect(s);
+        metalog_write(s->mlog);
+    }
+
+    /* Build once, write the same bytes to every content path.  The drive
+     * locks hold off writes extending files, which need only the read lock
+     * our caller holds. */
+    state_lock_drives(s);
+    if (s->cfg.content_format == LR_CONTENT_BINARY)
+        rc = build_binary(s, gen, &buf, &size);
+    else
+        rc = build_text(s, gen, &buf, &size);
+    state_unlock_drives(s);
+    if (rc != 0)
+        return -1;
+
+    for (unsigned i = 0; i < s->cfg.content_count; i++) {
+        if (write_atomic(s->cfg.content_paths[i], buf, size) != 0) {
+            rc = -1;
+            continue;
+        }
+        saved = 1;
+        /* The new snapshot holds everything logged so far */
+        if (s->mlog)
+            metalog_reset(s->mlog, i, gen);
+    }
+    free(buf);
+    if (saved) {
+        s->meta_gen = gen;
+        if (s->mlog)
+            metalog_compacted(s->mlog, rc == 0);
+    }
+    return rc;
+}
+
+int metadata_sync(lr_state *s)
+{
+    if (!s->mlog) {
+        state_wrlock(s);
+        int rc = metadata_save(s);
+        state_unlock(s);
+        return rc;
+    }
+    state_rdlock(s);
+    metalog_collect(s);
+    state_unlock(s);
+    return metalog_write(s->mlog) < 0 ? -1 : 0;
+}
+
+int metadata_export_text(lr_state *s, const char *path)
+{
+    char  *buf;
+    size_t size;
+    state_lock_drives(s);
+    int built = build_text(s, s->meta_gen, &buf, &size);
+    state_unlock_drives(s);
+    if (built != 0)
+        return -1;
+
     int rc = 0;
-    unsigned i;
-    for (i = 0; i < s->cfg.content_count; i++) {
-        if (write_to_path(s, s->cfg.content_paths[i]) != 0)
+    if (strcmp(path, "-") == 0) {
+        if (fwrite(buf, 1, size, stdout) != size || fflush(stdout) != 0) {
+            fprintf(stderr, "metadata: write to stdout failed\n");
             rc = -1;
+        }
+    } else {
+        rc = write_atomic(path, buf, size);
     }
+    free(buf);
     return rc;
 }
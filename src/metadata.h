@@ -1,19 +1,61 @@
 #ifndef LR_METADATA_H
 #define LR_METADATA_H
 
+#include <stdio.h>
+
 #include "state.h"
 
 /*
  * Load content file into state (file_table, file_list, pos_alloc).
- * Returns 0 on success, -1 if file missing (not an error on first run).
+ * Either format is accepted, told apart by the binary magic.  A binary
+ * file that fails its checksums is skipped for the next content path.
+ * Returns 0 on success (also when no file exists yet: first run), -1 on
+ * OOM or when every content file present was rejected.
+ * The change log next to the loaded file (<path>.log) is replayed on top
+ * of it; s->log_replayed counts the records applied.
  */
 int metadata_load(lr_state *s);
 
 /*
- * Save state to content file atomically (write temp → fsync → rename).
- * Writes to every path in cfg.content_paths.
+ * Save state to content file atomically (write temp → fsync → rename),
+ * in the format chosen by cfg.content_format.
+ * Writes to every path in cfg.content_paths.  With the change log on,
+ * pending changes are flushed to it first and each path whose snapshot
+ * was written gets an empty log of the new generation (compaction).
  * Returns 0 on success.
  */
 int metadata_save(lr_state *s);
 
+/*
+ * Make every change so far durable: one change-log batch, or a full save
+ * with the log off.  Takes the state lock itself (the write lock for a
+ * save, so it cannot run next to the journal worker's).
+ * Returns 0 on success.
+ */
+int metadata_sync(lr_state *s);
+
+/*
+ * Write state in the text format to path ("-" = stdout), whatever
+ * content_format says: for inspecting or exporting a binary content file.
+ * Returns 0 on success.
+ */
+int metadata_export_text(lr_state *s, const char *path);
+
+/*
+ * Apply one text record line (file|, dir| or symlink|, newline stripped;
+ * p is modified).  With replace, a record already at the same vpath is
+ * removed and freed first.  Positions are not allocated: callers rebuild
+ * the position index and the allocators afterwards.
+ * Returns 1 if a record was applied, 0 if the line was skipped, -1 on OOM.
+ */
+int metadata_parse_record(lr_state *s, char *p, int lineno, int replace);
+
+/* Write one record line in the text content format. */
+void metadata_print_file(FILE *out, const lr_state *s, const lr_file *f);
+void metadata_print_dir(FILE *out, const lr_dir *d);
+void metadata_print_symlink(FILE *out, const lr_symlink *sl);
+
+/* CRC32 (IEEE) of a buffer, as used in the content file footers. */
+uint32_t metadata_crc32(const void *data, size_t len);
+
 #endif /* LR_METADATA_H */
@@ -0,0 +1,476 @@
+#define _GNU_SOURCE   /* for open_memstream */
+#include "metalog.h"
+#include "metadata.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOG_HEADER "# liveraid log gen "
+#define LOG_COMMIT "# commit "
+
+static void log_path(char *out, size_t size, const char *content_path)
+{
+    snprintf(out, size, "%s.log", content_path);
+}
+
+/* ------------------------------------------------------------------ */
+/* Init / teardown                                                     */
+/* ------------------------------------------------------------------ */
+
+int metalog_init(lr_metalog *l, lr_state *s, uint64_t compact_bytes)
+{
+    memset(l, 0, sizeof(*l));
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_mutex_init(&l->io_lock, NULL);
+    l->compact_bytes = compact_bytes;
+    l->count = s->cfg.content_count < LR_METALOG_MAX_PATHS
+               ? s->cfg.content_count : LR_METALOG_MAX_PATHS;
+    for (unsigned i = 0; i < LR_METALOG_MAX_PATHS; i++)
+        l->fd[i] = -1;
+
+    l->pending = open_memstream(&l->pbuf, &l->plen);
+    if (!l->pending) {
+        fprintf(stderr, "metalog: open_memstream failed: %s\n",
+                strerror(errno));
+        metalog_done(l);
+        return -1;
+    }
+
+    for (unsigned i = 0; i < l->count; i++) {
+        log_path(l->path[i], sizeof(l->path[i]), s->cfg.content_paths[i]);
+        metalog_reset(l, i, s->meta_gen);
+        if (l->fd[i] < 0) {
+            metalog_done(l);
+            return -1;
+        }
+    }
+    l->failed = 0;
+    return 0;
+}
+
+void metalog_done(lr_metalog *l)
+{
+    for (unsigned i = 0; i < LR_METALOG_MAX_PATHS; i++) {
+        if (l->fd[i] >= 0)
+            close(l->fd[i]);
+        l->fd[i] = -1;
+    }
+    if (l->pending)
+        fclose(l->pending);
+    l->pending = NULL;
+    free(l->pbuf);
+    l->pbuf = NULL;
+    pthread_mutex_destroy(&l->io_lock);
+    pthread_mutex_destroy(&l->lock);
+}
+
+/* ------------------------------------------------------------------ */
+/* Recording                                                           */
+/* ------------------------------------------------------------------ */
+
+/* Lock the pending batch; NULL (unlocked) when the log is off. */
+static FILE *batch_begin(lr_state *s)
+{
+    lr_metalog *l = s->mlog;
+    if (!l)
+        return NULL;
+    pthread_mutex_lock(&l->lock);
+    if (!l->pending) {
+        /* Lost records: only a snapshot can cover them now */
+        l->failed = 1;
+        pthread_mutex_unlock(&l->lock);
+        return NULL;
+    }
+    return l->pending;
+}
+
+static void batch_end(lr_state *s)
+{
+    s->mlog->precords++;
+    pthread_mutex_unlock(&s->mlog->lock);
+}
+
+void metalog_file(lr_state *s, lr_file *f)
+{
+    lr_metalog *l = s->mlog;
+    if (!l)
+        return;
+    pthread_mutex_lock(&l->lock);
+    if (!f->log_dirty) {
+        lr_list_insert_tail(&s->log_dirty, &f->log_node, f);
+        f->log_dirty = 1;
+    }
+    pthread_mutex_unlock(&l->lock);
+}
+
+void metalog_dir(lr_state *s, const lr_dir *d)
+{
+    FILE *out = batch_begin(s);
+    if (!out)
+        return;
+    metadata_print_dir(out, d);
+    batch_end(s);
+}
+
+void metalog_symlink(lr_state *s, const lr_symlink *sl)
+{
+    FILE *out = batch_begin(s);
+    if (!out)
+        return;
+    metadata_print_symlink(out, sl);
+    batch_end(s);
+}
+
+static void put_remove(lr_state *s, const char *kind, const char *vpath)
+{
+    FILE *out = batch_begin(s);
+    if (!out)
+        return;
+    fprintf(out, "-%s|%s\n", kind, vpath);
+    batch_end(s);
+}
+
+void metalog_remove_file(lr_state *s, const char *vpath)
+{
+    put_remove(s, "file", vpath);
+}
+
+void metalog_remove_dir(lr_state *s, const char *vpath)
+{
+    put_remove(s, "dir", vpath);
+}
+
+void metalog_remove_symlink(lr_state *s, const char *vpath)
+{
+    put_remove(s, "symlink", vpath);
+}
+
+void metalog_rename_dir(lr_state *s, const char *from, const char *to)
+{
+    FILE *out = batch_begin(s);
+    if (!out)
+        return;
+    fprintf(out, "rename|%s|%s\n", from, to);
+    batch_end(s);
+}
+
+void metalog_collect(lr_state *s)
+{
+    lr_metalog *l = s->mlog;
+    if (!l)
+        return;
+
+    pthread_mutex_lock(&l->lock);
+    lr_list_node *node;
+    while ((node = lr_list_head(&s->log_dirty)) != NULL) {
+        lr_file *f = (lr_file *)node->data;
+        lr_list_remove(&s->log_dirty, node);
+        f->log_dirty = 0;
+        if (l->pending) {
+            /* Size and positions may be changing under the read lock */
+            state_lock_drive(s, f->drive_idx);
+            metadata_print_file(l->pending, s, f);
+            state_unlock_drive(s, f->drive_idx);
+            l->precords++;
+        } else {
+            l->failed = 1;
+        }
+    }
+    pthread_mutex_unlock(&l->lock);
+}
+
+/* ------------------------------------------------------------------ */
+/* Writing                                                             */
+/* ------------------------------------------------------------------ */
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int metalog_write(lr_metalog *l)
+{
+    pthread_mutex_lock(&l->io_lock);
+
+    /* Seal the pending batch with its commit line and start a new one */
+    pthread_mutex_lock(&l->lock);
+    if (l->precords == 0 || !l->pending) {
+        pthread_mutex_unlock(&l->lock);
+        pthread_mutex_unlock(&l->io_lock);
+        return 0;
+    }
+    fflush(l->pending);
+    uint32_t crc = metadata_crc32(l->pbuf, l->plen);
+    uint32_t nrec = l->precords;
+    fprintf(l->pending, LOG_COMMIT "%llu %u crc32:%08X\n",
+            (unsigned long long)(l->seq + 1), nrec, crc);
+    fclose(l->pending);
+    char  *buf = l->pbuf;
+    size_t len = l->plen;
+    l->pbuf     = NULL;
+    l->plen     = 0;
+    l->precords = 0;
+    l->pending  = open_memstream(&l->pbuf, &l->plen);
+    if (!l->pending)
+        fprintf(stderr, "metalog: open_memstream failed: %s\n",
+                strerror(errno));
+    l->seq++;
+    pthread_mutex_unlock(&l->lock);
+
+    int rc = 0;
+    for (unsigned i = 0; i < l->count; i++) {
+        int fd = l->fd[i];
+        if (fd < 0) {
+            rc = -1;
+            continue;
+        }
+        off_t end = lseek(fd, 0, SEEK_END);
+        if (write_all(fd, buf, len) != 0 || fdatasync(fd) != 0) {
+            fprintf(stderr, "metalog: write to '%s' failed: %s\n",
+                    l->path[i], strerror(errno));
+            /* Keep the log ending on a commit so later batches replay */
+            if (end >= 0 && ftruncate(fd, end) != 0)
+                fprintf(stderr, "metalog: truncate '%s' failed: %s\n",
+                        l->path[i], strerror(errno));
+            rc = -1;
+        }
+    }
+    free(buf);
+
+    pthread_mutex_lock(&l->lock);
+    l->size += len;
+    l->stats.flushes++;
+    l->stats.records += nrec;
+    l->stats.bytes   += (uint64_t)len * l->count;
+    if (rc != 0)
+        l->failed = 1;
+    pthread_mutex_unlock(&l->lock);
+
+    pthread_mutex_unlock(&l->io_lock);
+    return rc != 0 ? -1 : (int)nrec;
+}
+
+int metalog_needs_compaction(lr_metalog *l)
+{
+    pthread_mutex_lock(&l->lock);
+    int due = l->failed || (l->compact_bytes > 0 && l->size >= l->compact_bytes);
+    pthread_mutex_unlock(&l->lock);
+    return due;
+}
+
+void metalog_reset(lr_metalog *l, unsigned idx, uint64_t gen)
+{
+    if (idx >= l->count)
+        return;
+
+    char tmp[PATH_MAX + 8];
+    char hdr[64];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", l->path[idx]);
+    int hlen = snprintf(hdr, sizeof(hdr), LOG_HEADER "%llu\n",
+                        (unsigned long long)gen);
+
+    pthread_mutex_lock(&l->io_lock);
+    if (l->fd[idx] >= 0)
+        close(l->fd[idx]);
+    l->fd[idx] = -1;
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || write_all(fd, hdr, (size_t)hlen) != 0 || fsync(fd) != 0 ||
+        rename(tmp, l->path[idx]) != 0) {
+        fprintf(stderr, "metalog: cannot reset '%s': %s\n",
+                l->path[idx], strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+    } else {
+        close(fd);
+        l->fd[idx] = open(l->path[idx], O_WRONLY | O_APPEND);
+        if (l->fd[idx] < 0)
+            fprintf(stderr, "metalog: cannot open '%s': %s\n",
+                    l->path[idx], strerror(errno));
+    }
+    pthread_mutex_unlock(&l->io_lock);
+
+    if (l->fd[idx] < 0) {
+        pthread_mutex_lock(&l->lock);
+        l->failed = 1;
+        pthread_mutex_unlock(&l->lock);
+    }
+}
+
+void metalog_compacted(lr_metalog *l, int all_paths)
+{
+    pthread_mutex_lock(&l->io_lock);
+    int open_all = 1;
+    for (unsigned i = 0; i < l->count; i++)
+        if (l->fd[i] < 0)
+            open_all = 0;
+    pthread_mutex_unlock(&l->io_lock);
+
+    pthread_mutex_lock(&l->lock);
+    l->size   = 0;
+    l->failed = !(all_paths && open_all);
+    l->stats.compactions++;
+    pthread_mutex_unlock(&l->lock);
+}
+
+void metalog_get_stats(lr_metalog *l, lr_metalog_stats *st)
+{
+    pthread_mutex_lock(&l->lock);
+    *st = l->stats;
+    st->log_bytes = l->size;
+    pthread_mutex_unlock(&l->lock);
+}
+
+/* ------------------------------------------------------------------ */
+/* Replay                                                              */
+/* ------------------------------------------------------------------ */
+
+/* Apply one record line.  Returns 1 if applied, 0 if skipped, -1 on OOM. */
+static int replay_record(lr_state *s, char *p, int lineno)
+{
+    if (strncmp(p, "-file|", 6) == 0) {
+        lr_file *f = state_remove_file(s, p + 6);
+        state_free_file(s, f);
+        return f != NULL;
+    }
+    if (strncmp(p, "-dir|", 5) == 0) {
+        lr_dir *d = state_remove_dir(s, p + 5);
+        state_free_dir(s, d);
+        return d != NULL;
+    }
+    if (strncmp(p, "-symlink|", 9) == 0) {
+        lr_symlink *sl = state_remove_symlink(s, p + 9);
+        state_free_symlink(s, sl);
+        return sl != NULL;
+    }
+    if (strncmp(p, "rename|", 7) == 0) {
+        char *from = p + 7;
+        char *to   = strchr(from, '|');
+        if (!to) {
+            fprintf(stderr, "metalog: line %d: bad rename record\n", lineno);
+            return 0;
+        }
+        *to++ = '\0';
+        return state_rename_dir(s, from, to) != 0 ? -1 : 1;
+    }
+    return metadata_parse_record(s, p, lineno, 1);
+}
+
+/* Read all of path into a NUL-terminated buffer.  NULL if it does not
+ * exist or cannot be read. */
+static char *slurp(const char *path, size_t *out_len)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    char *buf = NULL;
+    if (fstat(fd, &st) == 0 && (buf = malloc((size_t)st.st_size + 1))) {
+        size_t len = 0;
+        while (len < (size_t)st.st_size) {
+            ssize_t n = read(fd, buf + len, (size_t)st.st_size - len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            len += (size_t)n;
+        }
+        buf[len]  = '\0';
+        *out_len  = len;
+    }
+    close(fd);
+    return buf;
+}
+
+int metalog_replay(lr_state *s, const char *content_path, uint64_t gen)
+{
+    char path[PATH_MAX + 8];
+    log_path(path, sizeof(path), content_path);
+
+    size_t len;
+    char  *buf = slurp(path, &len);
+    if (!buf)
+        return 0;
+
+    unsigned long long file_gen;
+    char *p = strchr(buf, '\n');
+    if (!p || sscanf(buf, LOG_HEADER "%llu", &file_gen) != 1) {
+        fprintf(stderr, "metalog: '%s' has no header, ignored\n", path);
+        free(buf);
+        return 0;
+    }
+    if (file_gen != gen) {
+        /* Written before the snapshot: its changes are already in it */
+        free(buf);
+        return 0;
+    }
+    p++;
+
+    int applied = 0, lineno = 1;
+    char *batch = p;
+    uint32_t nrec = 0;
+    while (p < buf + len) {
+        char *eol = strchr(p, '\n');
+        if (!eol)
+            break;      /* torn last line */
+
+        if (strncmp(p, LOG_COMMIT, strlen(LOG_COMMIT)) != 0) {
+            nrec++;
+            p = eol + 1;
+            continue;
+        }
+
+        unsigned long long seq;
+        unsigned n;
+        uint32_t crc;
+        if (sscanf(p, LOG_COMMIT "%llu %u crc32:%x", &seq, &n, &crc) != 3 ||
+            n != nrec || metadata_crc32(batch, (size_t)(p - batch)) != crc) {
+            fprintf(stderr, "metalog: batch ending at line %d of '%s' fails "
+                            "its checksum, ignoring the rest of the log\n",
+                    lineno + (int)nrec + 1, path);
+            break;
+        }
+
+        /* Batch verified: apply its records */
+        for (char *r = batch; r < p; ) {
+            char *end = strchr(r, '\n');
+            *end = '\0';
+            lineno++;
+            int rc = replay_record(s, r, lineno);
+            if (rc < 0) {
+                fprintf(stderr, "metalog: out of memory replaying '%s'\n",
+                        path);
+                free(buf);
+                return -1;
+            }
+            applied += rc;
+            r = end + 1;
+        }
+        lineno++;   /* the commit line */
+        p = batch = eol + 1;
+        nrec = 0;
+    }
+    free(buf);
+
+    if (applied > 0)
+        fprintf(stderr, "metalog: replayed %d change(s) from '%s'\n",
+                applied, path);
+    return applied;
+}
@@ -0,0 +1,120 @@
+#ifndef LR_METALOG_H
+#define LR_METALOG_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <limits.h>
+
+#include "state.h"
+
+/*
+ * Metadata change log.
+ *
+ * A full content-file snapshot costs time proportional to the whole
+ * namespace and holds the read lock while it is built.  With the change
+ * log on, mutations instead record what they changed and the journal
+ * thread appends those records to <content_path>.log every few seconds;
+ * a snapshot is only written when the log grows past its compaction
+ * threshold (and at unmount).
+ *
+ * The log is text, one record per line:
+ *
+ *   # liveraid log gen N                 header; N = the snapshot's log_gen
+ *   file|... dir|... symlink|...         upsert, same syntax as the content file
+ *   -file|VPATH -dir|VPATH -symlink|VPATH
+ *   rename|FROM|TO                       directory subtree rename
+ *   # commit SEQ NRECORDS crc32:XXXXXXXX end of a flushed batch
+ *
+ * The commit line's CRC covers the batch's record lines; replay stops at
+ * the first batch that is torn or fails its CRC.  A log whose generation
+ * does not match the snapshot next to it is stale and ignored.
+ *
+ * File records are deferred: metalog_file only queues the file on
+ * s->log_dirty, and the flush writes its state at that moment, so a file
+ * written a thousand times between flushes costs one record.  Other
+ * records are appended to the pending batch at once, in order.
+ */
+
+#define LR_METALOG_MAX_PATHS 8     /* capacity of cfg.content_paths */
+
+typedef struct {
+    uint64_t flushes;      /* batches written */
+    uint64_t records;      /* records written */
+    uint64_t bytes;        /* bytes written, all logs */
+    uint64_t compactions;  /* snapshots that emptied the log */
+    uint64_t log_bytes;    /* current size of one log */
+} lr_metalog_stats;
+
+typedef struct lr_metalog {
+    pthread_mutex_t lock;        /* pending batch and counters */
+    FILE           *pending;     /* memstream of records not yet written */
+    char           *pbuf;
+    size_t          plen;
+    uint32_t        precords;    /* records in pending */
+
+    pthread_mutex_t io_lock;     /* log fds, one writer at a time */
+    unsigned        count;       /* content paths */
+    int             fd[LR_METALOG_MAX_PATHS];          /* -1 = not open */
+    char            path[LR_METALOG_MAX_PATHS][PATH_MAX];
+    uint64_t        size;        /* bytes appended per log since the last compaction */
+    uint64_t        compact_bytes;
+    uint64_t        seq;         /* last batch written */
+    int             failed;      /* a write failed: compact soon */
+
+    lr_metalog_stats stats;
+} lr_metalog;
+
+/* Start a fresh log (generation s->meta_gen) next to every content path.
+ * Call after metadata_load, and after a snapshot when records were
+ * replayed.  Returns 0 or -1. */
+int  metalog_init(lr_metalog *l, lr_state *s, uint64_t compact_bytes);
+void metalog_done(lr_metalog *l);
+
+/*
+ * Record a change; no-ops when s->mlog is NULL.  Caller holds the
+ * state_lock write lock and calls after the change is made in s;
+ * metalog_file also accepts the read lock, without the file's drive lock
+ * held (lr_write2).
+ */
+void metalog_file(lr_state *s, lr_file *f);           /* file created or changed */
+void metalog_dir(lr_state *s, const lr_dir *d);       /* dir record created or changed */
+void metalog_symlink(lr_state *s, const lr_symlink *sl);
+void metalog_remove_file(lr_state *s, const char *vpath);
+void metalog_remove_dir(lr_state *s, const char *vpath);
+void metalog_remove_symlink(lr_state *s, const char *vpath);
+void metalog_rename_dir(lr_state *s, const char *from, const char *to);
+
+/* Move the queued file records into the pending batch.  Caller holds the
+ * state_lock (read or write). */
+void metalog_collect(lr_state *s);
+
+/* Append the pending batch to every log and fdatasync; needs no
+ * state_lock.  Returns the records written (0 = nothing pending), or -1
+ * if a log could not be written (it is truncated back to its last commit
+ * and the failure forces compaction). */
+int  metalog_write(lr_metalog *l);
+
+/* The log is due for a snapshot: past the compaction size, or a write
+ * failed. */
+int  metalog_needs_compaction(lr_metalog *l);
+
+/* Replace content path idx's log with an empty one of generation gen
+ * (its snapshot of gen was just written). */
+void metalog_reset(lr_metalog *l, unsigned idx, uint64_t gen);
+
+/* A snapshot covering every logged change was written; all_paths = it
+ * was written to every content path (else compaction stays due). */
+void metalog_compacted(lr_metalog *l, int all_paths);
+
+void metalog_get_stats(lr_metalog *l, lr_metalog_stats *st);
+
+/*
+ * Apply <content_path>.log to s if its generation is gen.  Positions are
+ * not allocated: after a non-zero return the caller rebuilds the position
+ * indexes and allocators.  Returns the number of records applied, or -1
+ * on OOM.
+ */
+int  metalog_replay(lr_state *s, const char *content_path, uint64_t gen);
+
+#endif /* LR_METALOG_H */
@@ -0,0 +1,494 @@
+#include "mover.h"
+#include "state.h"
+#include "alloc.h"
+#include "fdcache.h"
+#include "metadata.h"
+#include "metalog.h"
+#include "throttle.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/* The copy is written under this suffix and renamed over the target */
+#define MOVE_SUFFIX  ".lrmove"
+#define COPY_CHUNK   (1u << 20)
+
+/* A file due to move, as seen when the pass collected it */
+typedef struct {
+    char    *vpath;
+    int64_t  size;
+    time_t   mtime_sec;
+    long     mtime_nsec;
+} candidate;
+
+enum { MOVE_OK, MOVE_RACED, MOVE_FAILED, MOVE_STOPPED };
+
+/* ------------------------------------------------------------------ */
+/* Helpers                                                              */
+/* ------------------------------------------------------------------ */
+
+static int stopping(lr_mover *m)
+{
+    pthread_mutex_lock(&m->lock);
+    int stop = m->stop || !m->running;
+    pthread_mutex_unlock(&m->lock);
+    return stop;
+}
+
+/* The record at c->vpath if it is still the closed cache file c
+ * describes, else NULL.  Caller holds the write lock. */
+static lr_file *still_due(lr_state *s, const candidate *c)
+{
+    lr_file *f = state_find_file(s, c->vpath);
+    if (!f || !state_is_cache(s, f->drive_idx) || state_open_count(f) > 0 ||
+        f->size != c->size || f->mtime_sec != c->mtime_sec ||
+        f->mtime_nsec != c->mtime_nsec)
+        return NULL;
+    return f;
+}
+
+/*
+ * The closed files on the cache that are due: all of them with all, else
+ * those unmodified for idle_s.  Returns the count (*out is malloc'd), or
+ * -1 on OOM.
+ */
+static int collect(lr_mover *m, int all, candidate **out)
+{
+    lr_state *s   = m->state;
+    time_t    now = time(NULL);
+    candidate *c  = NULL;
+    int       n   = 0, cap = 0;
+
+    state_rdlock(s);
+    state_lock_drive(s, s->cache_drive);
+    lr_list_node *node;
+    for (node = lr_list_head(&s->cache_files); node; node = node->next) {
+        lr_file *f = (lr_file *)node->data;
+        if (state_open_count(f) > 0)
+            continue;
+        if (!all && now - f->mtime_sec < (time_t)m->idle_s)
+            continue;
+        if (n == cap) {
+            int        ncap = cap ? cap * 2 : 64;
+            candidate *nc   = realloc(c, (size_t)ncap * sizeof(*c));
+            if (!nc)
+                goto oom;
+            c   = nc;
+            cap = ncap;
+        }
+        c[n] = (candidate){ strdup(f->vpath), f->size,
+                            f->mtime_sec, f->mtime_nsec };
+        if (!c[n].vpath)
+            goto oom;
+        n++;
+    }
+    state_unlock_drive(s, s->cache_drive);
+    state_unlock(s);
+    *out = c;
+    return n;
+
+oom:
+    state_unlock_drive(s, s->cache_drive);
+    state_unlock(s);
+    fprintf(stderr, "mover: out of memory collecting cache files\n");
+    for (int i = 0; i < n; i++)
+        free(c[i].vpath);
+    free(c);
+    return -1;
+}
+
+/* Copy src to a new file tmp with f's attributes and fsync it.  Returns
+ * MOVE_OK, or another MOVE_* with tmp removed. */
+static int copy_file(lr_mover *m, const char *src, const char *tmp,
+                     const candidate *c, mode_t mode, uid_t uid, gid_t gid)
+{
+    int in = open(src, O_RDONLY);
+    if (in < 0) {
+        fprintf(stderr, "mover: cannot open '%s': %s\n", src, strerror(errno));
+        return MOVE_FAILED;
+    }
+    int out = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (out < 0) {
+        fprintf(stderr, "mover: cannot create '%s': %s\n", tmp, strerror(errno));
+        close(in);
+        return MOVE_FAILED;
+    }
+
+    int      rc     = MOVE_OK;
+    int64_t  copied = 0;
+    char    *buf    = malloc(COPY_CHUNK);
+    if (!buf) {
+        fprintf(stderr, "mover: out of memory copying '%s'\n", src);
+        rc = MOVE_FAILED;
+    }
+    while (rc == MOVE_OK) {
+        if (stopping(m)) {
+            rc = MOVE_STOPPED;
+            break;
+        }
+        ssize_t got = read(in, buf, COPY_CHUNK);
+        if (got == 0)
+            break;
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "mover: read '%s': %s\n", src, strerror(errno));
+            rc = MOVE_FAILED;
+            break;
+        }
+        for (ssize_t off = 0; off < got; ) {
+            ssize_t put = write(out, buf + off, (size_t)(got - off));
+            if (put < 0 && errno == EINTR)
+                continue;
+            if (put <= 0) {
+                fprintf(stderr, "mover: write '%s': %s\n", tmp,
+                        put < 0 ? strerror(errno) : "short write");
+                rc = MOVE_FAILED;
+                break;
+            }
+            off += put;
+        }
+        copied += got;
+    }
+    free(buf);
+    close(in);
+
+    /* Shorter or longer than the record: changed behind our back */
+    if (rc == MOVE_OK && copied != c->size)
+        rc = MOVE_RACED;
+    if (rc == MOVE_OK) {
+        struct timespec ts[2] = {
+            { 0, UTIME_OMIT },
+            { c->mtime_sec, c->mtime_nsec },
+        };
+        /* Ownership first: chown clears the set-id bits */
+        if (fchown(out, uid, gid) != 0) { /* not root: keep ours */ }
+        if (fchmod(out, mode) != 0 || futimens(out, ts) != 0 ||
+            fsync(out) != 0) {
+            fprintf(stderr, "mover: finishing '%s': %s\n", tmp, strerror(errno));
+            rc = MOVE_FAILED;
+        }
+    }
+    if (close(out) != 0 && rc == MOVE_OK) {
+        fprintf(stderr, "mover: close '%s': %s\n", tmp, strerror(errno));
+        rc = MOVE_FAILED;
+    }
+    if (rc != MOVE_OK)
+        unlink(tmp);
+    return rc;
+}
+
+/*
+ * Move one candidate to a data drive.  The copy runs with no locks held;
+ * the record is re-checked, positioned and re-homed under the write lock
+ * around it.
+ */
+static int move_one(lr_mover *m, const candidate *c)
+{
+    lr_state *s = m->state;
+    char      src[PATH_MAX], dst[PATH_MAX], tmp[PATH_MAX + sizeof(MOVE_SUFFIX)];
+    char      tmp_vpath[PATH_MAX + sizeof(MOVE_SUFFIX)];
+
+    state_wrlock(s);
+    lr_file *f = still_due(s, c);
+    if (!f) {
+        state_unlock(s);
+        return MOVE_RACED;
+    }
+    unsigned d = state_pick_drive(s, c->vpath);
+    snprintf(tmp_vpath, sizeof(tmp_vpath), "%s" MOVE_SUFFIX, c->vpath);
+    if (d >= s->drive_count || state_find_file(s, tmp_vpath) ||
+        state_find_dir(s, tmp_vpath) || state_find_symlink(s, tmp_vpath)) {
+        state_unlock(s);
+        fprintf(stderr, "mover: no place for '%s'%s\n", c->vpath,
+                d >= s->drive_count ? "" : ": " MOVE_SUFFIX " name taken");
+        return MOVE_FAILED;
+    }
+    state_real_path(s, f, src, sizeof(src));
+    snprintf(dst, sizeof(dst), "%s%s", s->drives[d].dir, c->vpath + 1);
+    snprintf(tmp, sizeof(tmp), "%s" MOVE_SUFFIX, dst);
+    state_make_parents(s, d, dst);
+    unlink(tmp);    /* left by an interrupted pass: no record owns it */
+    mode_t mode = f->mode & 07777;
+    uid_t  uid  = f->uid;
+    gid_t  gid  = f->gid;
+    state_unlock(s);
+
+    int rc = copy_file(m, src, tmp, c, mode, uid, gid);
+    if (rc != MOVE_OK)
+        return rc;
+
+    state_wrlock(s);
+    lr_pos_allocator *pa     = &s->drives[d].pos_alloc;
+    uint32_t          blocks = blocks_for_size((uint64_t)c->size,
+                                               s->cfg.block_size);
+    uint32_t          pos    = UINT32_MAX;
+    f = still_due(s, c);
+    if (f)
+        pos = alloc_positions(pa, blocks);
+    if (!f || pos == UINT32_MAX || rename(tmp, dst) != 0) {
+        int err = errno;
+        if (f && pos != UINT32_MAX) {
+            free_positions(pa, pos, blocks);
+            fprintf(stderr, "mover: rename '%s': %s\n", tmp, strerror(err));
+        }
+        state_unlock(s);
+        unlink(tmp);
+        return f ? MOVE_FAILED : MOVE_RACED;
+    }
+
+    if (s->fdcache)
+        fdcache_invalidate(s->fdcache, f);
+    state_account_free(s, s->cache_drive, -c->size);
+    state_account_free(s, d, c->size);
+    state_set_file_drive(s, f, d);
+    f->parity_pos_start = pos;
+    f->block_count      = blocks;
+    state_pos_index_insert(s, f);
+    metalog_file(s, f);
+    if (m->mark && blocks > 0)
+        m->mark(m->arg, pos, blocks);
+    state_unlock(s);
+
+    if (m->flush && blocks > 0)
+        m->flush(m->arg, pos, blocks);
+    return MOVE_OK;
+}
+
+/* rmdir the now-empty directories above path, up to the cache root */
+static void prune_parents(const lr_state *s, const char *path)
+{
+    char   buf[PATH_MAX];
+    size_t root = strlen(s->drives[s->cache_drive].dir);
+    snprintf(buf, sizeof(buf), "%s", path);
+    for (char *slash; (slash = strrchr(buf, '/')) && (size_t)(slash - buf) >= root; ) {
+        *slash = '\0';
+        if (rmdir(buf) != 0)
+            break;
+    }
+}
+
+/*
+ * Once the moved records are durable, delete their cache copies, unless
+ * a new cache file took the vpath meanwhile.  On a failed sync the list
+ * is kept for the next try: until then a crash reloads the records on
+ * the cache, which must still find their data there.
+ */
+static int drop_sources(lr_mover *m, char **moved, int *n)
+{
+    lr_state *s = m->state;
+    if (*n == 0)
+        return 0;
+    if (metadata_sync(s) != 0)
+        return -1;
+
+    state_wrlock(s);
+    for (int i = 0; i < *n; i++) {
+        lr_file *f = state_find_file(s, moved[i]);
+        if (!f || !state_is_cache(s, f->drive_idx)) {
+            char src[PATH_MAX];
+            snprintf(src, sizeof(src), "%s%s", s->drives[s->cache_drive].dir,
+                     moved[i] + 1);
+            if (unlink(src) == 0)
+                prune_parents(s, src);
+        }
+        free(moved[i]);
+    }
+    state_unlock(s);
+    *n = 0;
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* Mover thread                                                         */
+/* ------------------------------------------------------------------ */
+
+static void *mover_thread(void *arg)
+{
+    lr_mover *m = (lr_mover *)arg;
+
+    pthread_mutex_lock(&m->lock);
+    while (m->running) {
+        struct timespec ts;
+        deadline_after(&ts, (uint64_t)LR_MOVER_SCAN_S * 1000000000ull);
+        if (pthread_cond_timedwait(&m->cond, &m->lock, &ts) != ETIMEDOUT)
+            continue;
+        pthread_mutex_unlock(&m->lock);
+        lr_mover_result r;
+        mover_run(m, 0, &r);
+        pthread_mutex_lock(&m->lock);
+    }
+    pthread_mutex_unlock(&m->lock);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* Public API                                                           */
+/* ------------------------------------------------------------------ */
+
+int mover_init(lr_mover *m, struct lr_state *s, unsigned idle_s,
+               lr_mover_parity_fn mark, lr_mover_parity_fn flush, void *arg)
+{
+    memset(m, 0, sizeof(*m));
+    m->state  = s;
+    m->idle_s = idle_s;
+    m->mark   = mark;
+    m->flush  = flush;
+    m->arg    = arg;
+
+    if (pthread_mutex_init(&m->lock, NULL) != 0)
+        return -1;
+    if (pthread_mutex_init(&m->pass_lock, NULL) != 0)
+        goto fail_lock;
+    if (pthread_cond_init(&m->cond, NULL) != 0)
+        goto fail_pass_lock;
+
+    m->running = 1;
+    if (pthread_create(&m->thread, NULL, mover_thread, m) != 0) {
+        m->running = 0;
+        pthread_cond_destroy(&m->cond);
+        goto fail_pass_lock;
+    }
+    return 0;
+
+fail_pass_lock:
+    pthread_mutex_destroy(&m->pass_lock);
+fail_lock:
+    pthread_mutex_destroy(&m->lock);
+    return -1;
+}
+
+void mover_done(lr_mover *m)
+{
+    pthread_mutex_lock(&m->lock);
+    m->running = 0;
+    m->stop    = 1;
+    pthread_cond_broadcast(&m->cond);
+    pthread_mutex_unlock(&m->lock);
+    pthread_join(m->thread, NULL);
+
+    pthread_cond_destroy(&m->cond);
+    pthread_mutex_destroy(&m->pass_lock);
+    pthread_mutex_destroy(&m->lock);
+    memset(m, 0, sizeof(*m));
+}
+
+int mover_run(lr_mover *m, int all, lr_mover_result *out)
+{
+    lr_state *s = m->state;
+    memset(out, 0, sizeof(*out));
+
+    pthread_mutex_lock(&m->pass_lock);
+    pthread_mutex_lock(&m->lock);
+    m->active = 1;
+    m->stop   = !m->running;
+    pthread_mutex_unlock(&m->lock);
+
+    /* A full cache moves everything closed, fresh or not */
+    state_wrlock(s);
+    if (!state_cache_has_room(s))
+        all = 1;
+    state_unlock(s);
+
+    candidate *c = NULL;
+    int        n = collect(m, all, &c);
+    char     **moved  = n > 0 ? calloc((size_t)n, sizeof(*moved)) : NULL;
+    int        nmoved = 0, stopped = 0;
+    if (n > 0 && !moved) {
+        fprintf(stderr, "mover: out of memory\n");
+        out->failed = (uint32_t)n;
+    }
+    for (int i = 0; moved && i < n; i++) {
+        if (stopping(m)) {
+            stopped = 1;
+            break;
+        }
+        switch (move_one(m, &c[i])) {
+        case MOVE_OK:
+            out->files_moved++;
+            out->bytes_moved += (uint64_t)c[i].size;
+            moved[nmoved++] = c[i].vpath;
+            c[i].vpath      = NULL;
+            break;
+        case MOVE_RACED:
+            out->raced++;
+            break;
+        case MOVE_FAILED:
+            out->failed++;
+            break;
+        default:
+            stopped = 1;
+            break;
+        }
+        if (nmoved > 0 && nmoved % LR_MOVER_BATCH == 0)
+            drop_sources(m, moved, &nmoved);
+    }
+    if (drop_sources(m, moved, &nmoved) != 0) {
+        fprintf(stderr, "mover: metadata sync failed; the cache copies of "
+                        "%d moved files are kept\n", nmoved);
+        for (int i = 0; i < nmoved; i++)
+            free(moved[i]);
+    }
+    free(moved);
+    for (int i = 0; i < n; i++)
+        free(c[i].vpath);
+    free(c);
+
+    if (out->files_moved || out->raced || out->failed)
+        fprintf(stderr, "mover: %s: %u files moved (%llu bytes), %u raced, "
+                        "%u failed\n",
+                stopped ? "stopped" : "done", out->files_moved,
+                (unsigned long long)out->bytes_moved, out->raced, out->failed);
+
+    pthread_mutex_lock(&m->lock);
+    m->active = 0;
+    m->stop   = 0;
+    if (!stopped)
+        m->passes++;
+    m->files_moved += out->files_moved;
+    m->bytes_moved += out->bytes_moved;
+    m->raced       += out->raced;
+    m->failures    += out->failed;
+    pthread_mutex_unlock(&m->lock);
+    pthread_mutex_unlock(&m->pass_lock);
+    return stopped ? -1 : 0;
+}
+
+int mover_stop(lr_mover *m)
+{
+    pthread_mutex_lock(&m->lock);
+    int had = m->active;
+    if (had)
+        m->stop = 1;
+    pthread_mutex_unlock(&m->lock);
+    return had;
+}
+
+void mover_get_stats(lr_mover *m, lr_mover_stats *st)
+{
+    lr_state *s = m->state;
+    memset(st, 0, sizeof(*st));
+
+    state_rdlock(s);
+    state_lock_drive(s, s->cache_drive);
+    st->pending = s->cache_files.count;
+    for (lr_list_node *node = lr_list_head(&s->cache_files); node; node = node->next)
+        st->pending_bytes += (uint64_t)((lr_file *)node->data)->size;
+    state_unlock_drive(s, s->cache_drive);
+    state_unlock(s);
+
+    pthread_mutex_lock(&m->lock);
+    st->passes      = m->passes;
+    st->files_moved = m->files_moved;
+    st->bytes_moved = m->bytes_moved;
+    st->raced       = m->raced;
+    st->failures    = m->failures;
+    st->active      = m->active;
+    pthread_mutex_unlock(&m->lock);
+}
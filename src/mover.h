@@ -0,0 +1,99 @@
+#ifndef LR_MOVER_H
+#define LR_MOVER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+struct lr_state;
+
+/*
+ * Cache mover: copies files from the cache drive (state.h, "Cache tier")
+ * to the data drives.
+ *
+ * A file is due once it has been closed and unmodified for idle_s
+ * seconds, or at once while the cache is below its reserve.  A pass
+ * copies each due file to a temporary name on the drive state_pick_drive
+ * chooses, with no locks held, and fsyncs it.  Under the state write
+ * lock it then checks the file is still the one it copied (same record,
+ * size and mtime, not open), allocates its positions, renames the copy
+ * into place and re-homes the record; the new positions go to the mark
+ * callback and, with no locks held, to the flush callback, which
+ * computes their parity.  A file that changed meanwhile is left for the
+ * next pass (counted as raced).
+ *
+ * The cache copies are deleted only after the re-homed records are
+ * durable (metadata_sync), so a crash at any point leaves either the
+ * cache record and its file, or the data-drive record and its file; at
+ * worst an orphaned copy on one side.
+ *
+ * The thread runs a pass every LR_MOVER_SCAN_S seconds; mover_run runs
+ * one synchronously (the control socket's migrate command).
+ */
+
+#define LR_MOVER_SCAN_S  10
+#define LR_MOVER_BATCH   64      /* files moved per metadata sync */
+
+/* Parity of [start, start+count) now covers a moved file */
+typedef void (*lr_mover_parity_fn)(void *arg, uint32_t start, uint32_t count);
+
+typedef struct {
+    uint32_t files_moved;
+    uint64_t bytes_moved;
+    uint32_t raced;          /* changed, renamed or opened while copied */
+    uint32_t failed;         /* copy or rename failed */
+} lr_mover_result;
+
+typedef struct {
+    uint64_t passes;         /* since mover_init */
+    uint64_t files_moved;
+    uint64_t bytes_moved;
+    uint64_t raced;
+    uint64_t failures;
+    int      active;         /* a pass is running */
+    uint32_t pending;        /* files on the cache now */
+    uint64_t pending_bytes;
+} lr_mover_stats;
+
+typedef struct lr_mover {
+    pthread_mutex_t    lock;       /* everything below but pass_lock */
+    pthread_cond_t     cond;       /* wakes the thread */
+    pthread_t          thread;
+    int                running;
+
+    pthread_mutex_t    pass_lock;  /* one pass at a time */
+    int                active;
+    int                stop;       /* cancel the running pass */
+
+    struct lr_state   *state;
+    unsigned           idle_s;
+    lr_mover_parity_fn mark;       /* under the state write lock; NULL = none */
+    lr_mover_parity_fn flush;      /* no locks held; NULL = none */
+    void              *arg;
+
+    uint64_t           passes;
+    uint64_t           files_moved;
+    uint64_t           bytes_moved;
+    uint64_t           raced;
+    uint64_t           failures;
+} lr_mover;
+
+/* Start the mover thread.  Returns 0 or -1. */
+int  mover_init(lr_mover *m, struct lr_state *s, unsigned idle_s,
+                lr_mover_parity_fn mark, lr_mover_parity_fn flush, void *arg);
+
+/* Stop the thread after the file in progress. */
+void mover_done(lr_mover *m);
+
+/* Run one pass now, waiting for a running one first.  all = 1 moves
+ * every closed file whatever its age.  Returns 0, or -1 if it was
+ * stopped (*out = what it moved so far). */
+int  mover_run(lr_mover *m, int all, lr_mover_result *out);
+
+/* Cancel the running pass after its current file.  Returns 1 if there
+ * was one. */
+int  mover_stop(lr_mover *m);
+
+/* Counters, plus what is on the cache now (takes the state read lock). */
+void mover_get_stats(lr_mover *m, lr_mover_stats *st);
+
+#endif /* LR_MOVER_H */
@@ -1,4 +1,9 @@
+#define _GNU_SOURCE   /* for fallocate */
 #include "parity.h"
+#include "journal.h"
+#include "fdcache.h"
+#include "io.h"
+#include "pool.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +12,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdint.h>
+#include <isa-l/raid.h>
 
 /* ------------------------------------------------------------------ */
 /* Vector allocator                                                     */
@@ -14,16 +20,18 @@
 
 /*
  * Single allocation layout:
- *   [ void*[n] pointer array | <pad to 64-byte boundary> | block 0 | block 1 | … ]
+ *   [ void*[n] pointer array | <pad to a page> | block 0 | block 1 | … ]
  *
- * All block pointers are 64-byte aligned, satisfying ISA-L AVX2 requirements.
- * Free *freeptr (the raw malloc result) to release everything.
+ * Block 0 is page-aligned for O_DIRECT parity files; the rest follow at
+ * block_size strides.  Free *freeptr (the raw malloc result) to release
+ * everything.
  */
 void **lr_alloc_vector(int n, uint32_t block_size, void **freeptr)
 {
+    const size_t a     = LR_VECTOR_ALIGN;
     size_t ptrs_bytes  = (size_t)n * sizeof(void *);
-    size_t ptrs_padded = (ptrs_bytes + 63) & ~(size_t)63;
-    size_t total       = ptrs_padded + (size_t)n * block_size + 63;
+    size_t ptrs_padded = (ptrs_bytes + a - 1) & ~(a - 1);
+    size_t total       = ptrs_padded + (size_t)n * block_size + a - 1;
 
     void *raw = malloc(total);
     if (!raw) {
@@ -32,8 +40,8 @@ void **lr_alloc_vector(int n, uint32_t block_size, void **freeptr)
     }
     *freeptr = raw;
 
-    /* Align pointer array base to 64 bytes */
-    uint8_t *base  = (uint8_t *)(((uintptr_t)raw + 63) & ~(uintptr_t)63);
+    /* Align pointer array base to a page */
+    uint8_t *base  = (uint8_t *)(((uintptr_t)raw + a - 1) & ~(uintptr_t)(a - 1));
     void   **v     = (void **)base;
     uint8_t *data  = base + ptrs_padded;
 
@@ -43,10 +51,200 @@ void **lr_alloc_vector(int n, uint32_t block_size, void **freeptr)
     return v;
 }
 
+/* ------------------------------------------------------------------ */
+/* Per-thread recovery scratch                                          */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    lr_parity_handle *ph;
+    void            **v;        /* nd + np buffers of one recovery run */
+    void             *freeptr;
+    uint8_t          *tbls;     /* 32 * nd * np: decode tables for one call */
+    lr_list_node      node;     /* in ph->scratch_list */
+} recover_scratch;
+
+/* pthread key destructor: thread exited */
+static void recover_scratch_free(void *p)
+{
+    recover_scratch  *rs = (recover_scratch *)p;
+    lr_parity_handle *ph = rs->ph;
+
+    pthread_mutex_lock(&ph->dec_lock);
+    lr_list_remove(&ph->scratch_list, &rs->node);
+    pthread_mutex_unlock(&ph->dec_lock);
+    free(rs->tbls);
+    free(rs->freeptr);
+    free(rs);
+}
+
+/* This thread's scratch, allocated on first use.  NULL on OOM. */
+static recover_scratch *recover_scratch_get(lr_parity_handle *ph)
+{
+    recover_scratch *rs = pthread_getspecific(ph->scratch_key);
+    if (rs)
+        return rs;
+
+    unsigned nd = ph->nd, np = ph->levels;
+    rs = calloc(1, sizeof(*rs));
+    if (!rs)
+        return NULL;
+    rs->ph = ph;
+    rs->v  = lr_alloc_vector((int)(nd + np),
+                             parity_recover_run_max(ph) * ph->block_size,
+                             &rs->freeptr);
+    rs->tbls = rs->v ? malloc(32 * nd * np) : NULL;
+    if (!rs->tbls) {
+        free(rs->freeptr);
+        free(rs);
+        return NULL;
+    }
+    if (pthread_setspecific(ph->scratch_key, rs) != 0) {
+        free(rs->tbls);
+        free(rs->freeptr);
+        free(rs);
+        return NULL;
+    }
+    pthread_mutex_lock(&ph->dec_lock);
+    lr_list_insert_tail(&ph->scratch_list, &rs->node, rs);
+    pthread_mutex_unlock(&ph->dec_lock);
+    return rs;
+}
+
+/* ------------------------------------------------------------------ */
+/* Encode kernels                                                       */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Parity of len bytes: data in v[0..nd-1], parity into v[nd..nd+np-1].
+ * The xor/pq kernels take exactly that layout (sources, then P, then Q);
+ * they refuse lengths or vector counts their SIMD code cannot handle, and
+ * those fall back to the general path.
+ */
+static void encode(const lr_parity_handle *ph, size_t len, void **v)
+{
+    if (ph->kernel == LR_PARITY_XOR &&
+        xor_gen((int)ph->nd + 1, (int)len, v) == 0)
+        return;
+    if (ph->kernel == LR_PARITY_PQ &&
+        pq_gen((int)ph->nd + 2, (int)len, v) == 0)
+        return;
+    ec_encode_data((int)len, (int)ph->nd, (int)ph->levels, ph->gftbls,
+                   (uint8_t **)v, (uint8_t **)v + ph->nd);
+}
+
+/* Fill the parity rows of enc_matrix (identity rows for data come first). */
+static void build_matrix(lr_parity_handle *ph)
+{
+    unsigned nd = ph->nd, np = ph->levels;
+
+    if (ph->code == LR_CODE_CAUCHY) {
+        gf_gen_cauchy1_matrix(ph->enc_matrix, (int)(nd + np), (int)nd);
+        return;
+    }
+
+    /* raid: P row all ones, Q row 2^j (the generator pq_gen uses) */
+    memset(ph->enc_matrix, 0, (size_t)(nd + np) * nd);
+    for (unsigned i = 0; i < nd; i++)
+        ph->enc_matrix[i * nd + i] = 1;
+    uint8_t q = 1;
+    for (unsigned j = 0; j < nd; j++) {
+        ph->enc_matrix[nd * nd + j] = 1;
+        if (np > 1)
+            ph->enc_matrix[(nd + 1) * nd + j] = q;
+        q = gf_mul(q, 2);
+    }
+}
+
+/* Pick the kernel for the raid code and check it against ec_encode_data
+ * on a small pseudo-random stripe.  Leaves LR_PARITY_EC on any doubt. */
+static void select_kernel(lr_parity_handle *ph)
+{
+    enum { TEST_LEN = 256 };
+    unsigned nd = ph->nd, np = ph->levels;
+
+    ph->kernel = LR_PARITY_EC;
+    if (ph->code != LR_CODE_RAID || np > 2)
+        return;
+    int want = np == 1 ? LR_PARITY_XOR : LR_PARITY_PQ;
+
+    void  *freeptr = NULL;
+    void **v = lr_alloc_vector((int)(nd + 2 * np), TEST_LEN, &freeptr);
+    if (!v)
+        return;
+
+    uint32_t x = 0x9e3779b9u;
+    for (unsigned d = 0; d < nd; d++)
+        for (unsigned i = 0; i < TEST_LEN; i++) {
+            x = x * 1664525u + 1013904223u;
+            ((uint8_t *)v[d])[i] = (uint8_t)(x >> 24);
+        }
+
+    /* Reference parity in v[nd+np..]; kernel parity in v[nd..] */
+    ec_encode_data(TEST_LEN, (int)nd, (int)np, ph->gftbls,
+                   (uint8_t **)v, (uint8_t **)v + nd + np);
+    int rc = want == LR_PARITY_XOR ? xor_gen((int)nd + 1, TEST_LEN, v)
+                                   : pq_gen((int)nd + 2, TEST_LEN, v);
+    int ok = rc == 0;
+    for (unsigned p = 0; p < np && ok; p++)
+        if (memcmp(v[nd + p], v[nd + np + p], TEST_LEN) != 0)
+            ok = 0;
+    free(freeptr);
+
+    if (ok)
+        ph->kernel = want;
+    else
+        fprintf(stderr, "parity_open: %s kernel disagrees with the "
+                        "general encoder, not using it\n",
+                want == LR_PARITY_XOR ? "xor" : "pq");
+}
+
+uint64_t parity_punched(const lr_parity_handle *ph)
+{
+    return __atomic_load_n(&ph->punched, __ATOMIC_RELAXED);
+}
+
+const char *parity_code_name(const lr_parity_handle *ph)
+{
+    return ph->code == LR_CODE_RAID ? "raid" : "cauchy";
+}
+
+const char *parity_kernel_name(const lr_parity_handle *ph)
+{
+    switch (ph->kernel) {
+    case LR_PARITY_XOR: return "xor";
+    case LR_PARITY_PQ:  return "pq";
+    default:            return "ec";
+    }
+}
+
 /* ------------------------------------------------------------------ */
 /* Parity file open / close                                            */
 /* ------------------------------------------------------------------ */
 
+/* Open one parity file, O_DIRECT when asked for.  A filesystem that
+ * refuses O_DIRECT (tmpfs, some FUSE mounts) turns it off for every file,
+ * with a warning, rather than failing the mount. */
+static int open_shard(lr_parity_handle *ph, const char *path, int *fd)
+{
+    if (ph->direct) {
+        *fd = open(path, O_RDWR | O_CREAT | O_DIRECT, 0644);
+        if (*fd >= 0)
+            return 0;
+        if (errno != EINVAL)
+            return -1;
+        fprintf(stderr, "parity_open: '%s' does not support O_DIRECT, "
+                        "using buffered parity I/O\n", path);
+        ph->direct = 0;
+        for (unsigned i = 0; i < ph->levels; i++)
+            for (unsigned k = 0; k < ph->shards[i]; k++)
+                if (ph->fds[i][k] >= 0)
+                    fcntl(ph->fds[i][k], F_SETFL,
+                          fcntl(ph->fds[i][k], F_GETFL) & ~O_DIRECT);
+    }
+    *fd = open(path, O_RDWR | O_CREAT, 0644);
+    return *fd >= 0 ? 0 : -1;
+}
+
 int parity_open(lr_parity_handle *ph, const lr_config *cfg)
 {
     unsigned nd = cfg->drive_count;
@@ -57,30 +255,38 @@ int parity_open(lr_parity_handle *ph, const lr_config *cfg)
     ph->block_size = cfg->block_size;
     ph->levels     = np;
     ph->nd         = nd;
+    ph->code       = cfg->parity_code;
+    ph->kernel     = LR_PARITY_EC;
+    ph->stripe     = cfg->parity_stripe > 0 ? cfg->parity_stripe : 1;
+    ph->direct     = cfg->parity_direct && cfg->block_size % LR_VECTOR_ALIGN == 0;
 
     for (i = 0; i < LR_LEV_MAX; i++)
-        ph->fds[i] = -1;
+        for (unsigned k = 0; k < LR_SHARD_MAX; k++)
+            ph->fds[i][k] = -1;
 
     for (i = 0; i < np; i++) {
-        ph->fds[i] = open(cfg->parity_path[i], O_RDWR | O_CREAT, 0644);
-        if (ph->fds[i] < 0) {
-            fprintf(stderr, "parity_open: cannot open '%s': %s\n",
-                    cfg->parity_path[i], strerror(errno));
-            parity_close(ph);
-            return -1;
+        ph->shards[i] = cfg->parity_shards[i] > 0 ? cfg->parity_shards[i] : 1;
+        for (unsigned k = 0; k < ph->shards[i]; k++) {
+            const char *path = cfg->parity_path[i][k];
+            if (open_shard(ph, path, &ph->fds[i][k]) != 0) {
+                fprintf(stderr, "parity_open: cannot open '%s': %s\n",
+                        path, strerror(errno));
+                parity_close(ph);
+                return -1;
+            }
         }
     }
 
     if (nd == 0 || np == 0)
         return 0; /* no RAID math needed */
 
-    /* Build (nd+np) x nd Cauchy encoding matrix */
+    /* Build the (nd+np) x nd encoding matrix */
     ph->enc_matrix = malloc((nd + np) * nd);
     if (!ph->enc_matrix) {
         parity_close(ph);
         return -1;
     }
-    gf_gen_cauchy1_matrix(ph->enc_matrix, (int)(nd + np), (int)nd);
+    build_matrix(ph);
 
     /* Precompute GF encode tables for the np parity rows */
     ph->gftbls = malloc(32 * nd * np);
@@ -92,7 +298,20 @@ int parity_open(lr_parity_handle *ph, const lr_config *cfg)
     ec_init_tables((int)nd, (int)np,
                    ph->enc_matrix + nd * nd,
                    ph->gftbls);
+    select_kernel(ph);
 
+    /* Recovery decode cache and per-thread scratch */
+    lr_list_init(&ph->scratch_list);
+    if (pthread_mutex_init(&ph->dec_lock, NULL) != 0) {
+        parity_close(ph);
+        return -1;
+    }
+    if (pthread_key_create(&ph->scratch_key, recover_scratch_free) != 0) {
+        pthread_mutex_destroy(&ph->dec_lock);
+        parity_close(ph);
+        return -1;
+    }
+    ph->dec_ready = 1;
     return 0;
 }
 
@@ -100,10 +319,29 @@ void parity_close(lr_parity_handle *ph)
 {
     unsigned i;
     for (i = 0; i < LR_LEV_MAX; i++) {
-        if (ph->fds[i] >= 0) {
-            close(ph->fds[i]);
-            ph->fds[i] = -1;
+        for (unsigned k = 0; k < LR_SHARD_MAX; k++) {
+            if (ph->fds[i][k] >= 0) {
+                close(ph->fds[i][k]);
+                ph->fds[i][k] = -1;
+            }
+        }
+    }
+    if (ph->dec_ready) {
+        /* Threads still holding scratch lose it here; their key destructor
+         * no longer runs once the key is deleted. */
+        pthread_key_delete(ph->scratch_key);
+        lr_list_node *n = lr_list_head(&ph->scratch_list);
+        while (n) {
+            recover_scratch *rs = (recover_scratch *)n->data;
+            n = n->next;
+            free(rs->tbls);
+            free(rs->freeptr);
+            free(rs);
         }
+        for (i = 0; i < LR_DECODE_CACHE; i++)
+            free(ph->dec_cache[i].tbls);
+        pthread_mutex_destroy(&ph->dec_lock);
+        ph->dec_ready = 0;
     }
     free(ph->enc_matrix);
     free(ph->gftbls);
@@ -115,14 +353,40 @@ void parity_close(lr_parity_handle *ph)
 /* Block I/O                                                            */
 /* ------------------------------------------------------------------ */
 
+/*
+ * Where [pos, pos+count) of level lev starts: the shard's fd in *fd and
+ * the byte offset in it in *off.  Returns how many of the positions stay
+ * in that shard (up to the next stripe boundary).
+ */
+static uint32_t shard_extent(const lr_parity_handle *ph, unsigned lev,
+                             uint32_t pos, uint32_t count, int *fd, off_t *off)
+{
+    unsigned n = ph->shards[lev];
+    if (n <= 1) {
+        *fd  = ph->fds[lev][0];
+        *off = (off_t)pos * ph->block_size;
+        return count;
+    }
+    uint32_t stripe = pos / ph->stripe;
+    uint32_t in     = pos % ph->stripe;
+    *fd  = ph->fds[lev][stripe % n];
+    *off = ((off_t)(stripe / n) * ph->stripe + in) * ph->block_size;
+    uint32_t left = ph->stripe - in;
+    return count < left ? count : left;
+}
+
 int parity_read_block(lr_parity_handle *ph, unsigned lev, uint32_t pos,
                       void *buf)
 {
-    if (lev >= ph->levels || ph->fds[lev] < 0)
+    if (lev >= ph->levels)
         return -1;
 
-    off_t   offset = (off_t)pos * ph->block_size;
-    ssize_t n      = pread(ph->fds[lev], buf, ph->block_size, offset);
+    int   fd;
+    off_t offset;
+    shard_extent(ph, lev, pos, 1, &fd, &offset);
+    if (fd < 0)
+        return -1;
+    ssize_t n = pread(fd, buf, ph->block_size, offset);
     if (n != (ssize_t)ph->block_size) {
         if (n >= 0)
             memset((char *)buf + n, 0, ph->block_size - n); /* sparse read */
@@ -135,156 +399,352 @@ int parity_read_block(lr_parity_handle *ph, unsigned lev, uint32_t pos,
 int parity_write_block(lr_parity_handle *ph, unsigned lev, uint32_t pos,
                        const void *buf)
 {
-    if (lev >= ph->levels || ph->fds[lev] < 0)
+    if (lev >= ph->levels)
         return -1;
 
-    off_t   offset = (off_t)pos * ph->block_size;
-    ssize_t n      = pwrite(ph->fds[lev], buf, ph->block_size, offset);
+    int   fd;
+    off_t offset;
+    shard_extent(ph, lev, pos, 1, &fd, &offset);
+    if (fd < 0)
+        return -1;
+    ssize_t n = pwrite(fd, buf, ph->block_size, offset);
     if (n != (ssize_t)ph->block_size)
         return -1;
     return 0;
 }
 
+int parity_sync(lr_parity_handle *ph)
+{
+    int rc = 0;
+    for (unsigned lev = 0; lev < ph->levels; lev++)
+        for (unsigned k = 0; k < ph->shards[lev]; k++)
+            if (ph->fds[lev][k] >= 0 && fdatasync(ph->fds[lev][k]) != 0) {
+                fprintf(stderr, "parity: fdatasync of parity %u file %u "
+                                "failed: %s\n", lev + 1, k + 1, strerror(errno));
+                rc = -1;
+            }
+    return rc;
+}
+
 /* ------------------------------------------------------------------ */
-/* Parity update                                                        */
+/* Batched reads                                                        */
 /* ------------------------------------------------------------------ */
 
-int parity_update_position(lr_state *s, uint32_t pos, void **scratch_v)
+/*
+ * Data-block reads collected for one io_run.  Each entry keeps the pinned
+ * descriptor (or private fd) until the batch is flushed, and a caller tag
+ * (drive index) so failures can be attributed.
+ */
+#define READ_BATCH 64
+
+typedef struct {
+    lr_io_req  req[READ_BATCH];
+    lr_fdent  *ent[READ_BATCH];   /* NULL: req.fd is private, close it */
+    int        tag[READ_BATCH];
+    unsigned   n;
+} read_batch;
+
+/* Queue a read of `count` blocks of f (whose first position is start) at
+ * parity position pos.  Returns -1 (with buf zero-filled) if the file
+ * cannot be opened. */
+static int batch_add(lr_state *s, read_batch *b, const lr_file *f,
+                     uint32_t start, uint32_t pos, uint32_t count, void *buf,
+                     uint32_t block_size, int tag)
 {
-    unsigned d;
-    unsigned nd         = s->drive_count;
-    unsigned np         = s->parity ? s->parity->levels : 0;
-    uint32_t block_size = s->cfg.block_size;
+    size_t    len = (size_t)count * block_size;
+    lr_fdent *ent = NULL;
+    int       fd;
+
+    char real[PATH_MAX];
+    state_real_path(s, f, real, sizeof(real));
+    if (s->fdcache) {
+        ent = fdcache_get(s->fdcache, f, real);
+        fd  = ent ? ent->fd : -1;
+    } else {
+        fd = open(real, O_RDONLY);
+    }
+    if (fd < 0) {
+        memset(buf, 0, len);
+        return -1;
+    }
 
-    if (np == 0 || !s->parity)
-        return 0;
+    lr_io_req *r = &b->req[b->n];
+    r->fd    = fd;
+    r->write = 0;
+    r->buf   = buf;
+    r->len   = len;
+    r->off   = (off_t)(pos - start) * block_size;
+    r->res   = 0;
+    b->ent[b->n] = ent;
+    b->tag[b->n] = tag;
+    b->n++;
+    return 0;
+}
 
-    /* Fill data slots scratch_v[0..nd-1] */
-    for (d = 0; d < nd; d++) {
-        lr_file *f = state_find_file_at_pos(s, d, pos);
-        if (!f) {
-            memset(scratch_v[d], 0, block_size);
-        } else {
-            uint32_t blk_off = pos - f->parity_pos_start;
-            off_t    offset  = (off_t)blk_off * block_size;
-            int      fd      = open(f->real_path, O_RDONLY);
-            if (fd < 0) {
-                memset(scratch_v[d], 0, block_size);
-            } else {
-                ssize_t n = pread(fd, scratch_v[d], block_size, offset);
-                close(fd);
-                if (n < (ssize_t)block_size) {
-                    if (n > 0)
-                        memset((char *)scratch_v[d] + n, 0, block_size - n);
+/* Run the queued reads, zero-fill short/failed buffers, release fds.
+ * Results stay in b->req[i].res until the next batch_add. */
+static void batch_run(lr_state *s, read_batch *b)
+{
+    io_run(s->io, b->req, b->n);
+    for (unsigned i = 0; i < b->n; i++) {
+        lr_io_req *r = &b->req[i];
+        stats_dev_io(s->stats, (unsigned)b->tag[i], 0, r->res);
+        if (r->res < 0)
+            memset(r->buf, 0, r->len);
+        else if ((size_t)r->res < r->len)
+            memset((char *)r->buf + r->res, 0, r->len - (size_t)r->res);
+        if (b->ent[i])
+            fdcache_put(s->fdcache, b->ent[i]);
+        else
+            close(r->fd);
+    }
+}
+
+/*
+ * Read or write `nlev` parity levels at [pos, pos+count) in one io_run
+ * per LEVELS_BATCH requests: one request per level, or per stripe piece
+ * of a sharded level.  Reads past the end of a parity file return zeros;
+ * a failed read leaves its buffer zeroed.  Returns the number of levels
+ * that failed.
+ */
+#define LEVELS_BATCH 64
+
+static int parity_levels_io(lr_state *s, int write, uint32_t pos,
+                            uint32_t count, void **bufs, unsigned nlev)
+{
+    lr_parity_handle *ph = s->parity;
+    uint32_t          bs = ph->block_size;
+    lr_io_req         req[LEVELS_BATCH];
+    unsigned          lev_of[LEVELS_BATCH];
+    int               failed[LR_LEV_MAX] = { 0 };
+    unsigned          n = 0;
+
+    for (unsigned p = 0; p < nlev; p++) {
+        uint32_t done = 0;
+        while (done < count) {
+            int      fd;
+            off_t    off;
+            uint32_t len = shard_extent(ph, p, pos + done, count - done,
+                                        &fd, &off);
+            req[n].fd    = fd;
+            req[n].write = write;
+            req[n].buf   = (uint8_t *)bufs[p] + (size_t)done * bs;
+            req[n].len   = (size_t)len * bs;
+            req[n].off   = off;
+            req[n].res   = 0;
+            lev_of[n++]  = p;
+            done += len;
+
+            if (n < LEVELS_BATCH && (done < count || p + 1 < nlev))
+                continue;
+            io_run(s->io, req, n);
+            for (unsigned i = 0; i < n; i++) {
+                lr_io_req *r  = &req[i];
+                unsigned   lv = lev_of[i];
+                stats_dev_io(s->stats, LR_STATS_DEV_PARITY + lv, write, r->res);
+                if (r->res < 0) {
+                    if (!write)
+                        memset(r->buf, 0, r->len);
+                    failed[lv] = 1;
+                } else if ((size_t)r->res < r->len) {
+                    if (write)
+                        failed[lv] = 1;
                     else
-                        memset(scratch_v[d], 0, block_size);
+                        memset((char *)r->buf + r->res, 0,
+                               r->len - (size_t)r->res);   /* sparse read */
                 }
             }
+            n = 0;
         }
     }
 
-    /* Compute parity into scratch_v[nd..nd+np-1] */
-    ec_encode_data((int)block_size, (int)nd, (int)np,
-                   s->parity->gftbls,
-                   (uint8_t **)scratch_v,
-                   (uint8_t **)scratch_v + nd);
-
-    /* Write parity blocks */
-    int write_err = 0;
-    for (unsigned p = 0; p < np; p++) {
-        if (parity_write_block(s->parity, p, pos, scratch_v[nd + p]) != 0)
-            write_err = 1;
-    }
-    return write_err ? -1 : 0;
+    int nerr = 0;
+    for (unsigned p = 0; p < nlev; p++)
+        nerr += failed[p];
+    return nerr;
 }
 
 /* ------------------------------------------------------------------ */
-/* Block recovery                                                       */
+/* Parity update                                                        */
 /* ------------------------------------------------------------------ */
 
-int parity_recover_block(lr_state *s, unsigned drive_idx, uint32_t pos,
-                         void *out_buf)
+/* Encode [pos, pos+count) from the data drives and write every level. */
+static int encode_span(lr_state *s, uint32_t pos, uint32_t count,
+                       void **scratch_v)
 {
-    if (!s->parity || s->parity->levels == 0 || drive_idx >= s->drive_count)
-        return -1;
-
+    unsigned d;
     unsigned nd         = s->drive_count;
     unsigned np         = s->parity->levels;
     uint32_t block_size = s->cfg.block_size;
+    size_t   len        = (size_t)count * block_size;
 
-    void *freeptr = NULL;
-    void **v = lr_alloc_vector((int)(nd + np), block_size, &freeptr);
-    if (!v)
-        return -1;
+    /* Fill data slots scratch_v[0..nd-1]: one read per file segment, all
+     * drives submitted together */
+    read_batch b;
+    b.n = 0;
+    for (d = 0; d < nd; d++) {
+        uint8_t *dst = (uint8_t *)scratch_v[d];
+        uint32_t p   = pos;
+        while (p < pos + count) {
+            uint8_t *at = dst + (size_t)(p - pos) * block_size;
+            uint32_t start, seg_end;
+            lr_file *f  = state_lookup_pos(s, d, p, &start, &seg_end);
+            if (!f) {
+                memset(at, 0, block_size);
+                p++;
+                continue;
+            }
+            if (seg_end > pos + count)
+                seg_end = pos + count;
+            if (b.n == READ_BATCH) {
+                batch_run(s, &b);
+                b.n = 0;
+            }
+            batch_add(s, &b, f, start, p, seg_end - p, at, block_size, (int)d);
+            p = seg_end;
+        }
+    }
+    batch_run(s, &b);
 
-    /* failed[] is maintained in sorted order (required by ISA-L decode) */
-    int failed[LR_LEV_MAX];
-    int nfailed = 1;
-    failed[0] = (int)drive_idx;
-    memset(v[drive_idx], 0, block_size);
+    /* Encoding is bytewise, so the whole run encodes in one call */
+    encode(s->parity, len, scratch_v);
 
-    /* Read all surviving data drives */
-    for (unsigned d = 0; d < nd; d++) {
-        if (d == drive_idx)
-            continue;
+    /* One write per parity level, submitted together */
+    return parity_levels_io(s, 1, pos, count, scratch_v + nd, np) ? -1 : 0;
+}
 
-        lr_file *f = state_find_file_at_pos(s, d, pos);
-        if (!f) {
-            memset(v[d], 0, block_size);
-            continue;
+/*
+ * End of the span starting at pos (at most end) whose positions are all
+ * used by some drive, or all unused by every drive; *used says which.
+ * A file's extent covers the rest of its segment in one step.
+ */
+static uint32_t span_end(lr_state *s, uint32_t pos, uint32_t end, int *used)
+{
+    uint32_t p = pos;
+    while (p < end) {
+        uint32_t reach = p;
+        for (unsigned d = 0; d < s->drive_count; d++) {
+            uint32_t start, seg_end;
+            if (state_lookup_pos(s, d, p, &start, &seg_end) && seg_end > reach)
+                reach = seg_end;
         }
+        int u = reach > p;
+        if (p == pos)
+            *used = u;
+        else if (u != *used)
+            return p;
+        p = u ? reach : p + 1;
+    }
+    return end;
+}
 
-        uint32_t blk_off = pos - f->parity_pos_start;
-        int fd = open(f->real_path, O_RDONLY);
-        int ok = 0;
-        if (fd >= 0) {
-            ssize_t n = pread(fd, v[d], block_size,
-                              (off_t)blk_off * block_size);
-            close(fd);
-            if (n >= 0) {
-                if (n < (ssize_t)block_size)
-                    memset((char *)v[d] + n, 0, block_size - n);
-                ok = 1;
-            }
-        }
+/* Deallocate [pos, pos+count) in every parity file: no drive has data
+ * there, so its parity is all zeros, which a hole reads back as.  Returns
+ * -1 (after disabling punching) if the filesystem cannot punch holes. */
+static int punch_span(lr_parity_handle *ph, uint32_t pos, uint32_t count)
+{
+    if (__atomic_load_n(&ph->no_punch, __ATOMIC_RELAXED))
+        return -1;
 
-        if (!ok) {
-            if (nfailed >= (int)np) {
-                free(freeptr);
+    for (unsigned lev = 0; lev < ph->levels; lev++) {
+        uint32_t done = 0;
+        while (done < count) {
+            int      fd;
+            off_t    off;
+            uint32_t n = shard_extent(ph, lev, pos + done, count - done,
+                                      &fd, &off);
+            if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          off, (off_t)n * ph->block_size) != 0) {
+                if (errno == EOPNOTSUPP || errno == ENOSYS) {
+                    if (!__atomic_exchange_n(&ph->no_punch, 1, __ATOMIC_RELAXED))
+                        fprintf(stderr, "parity: cannot punch holes in parity "
+                                        "files (%s), writing zeros instead\n",
+                                strerror(errno));
+                }
                 return -1;
             }
-            /* Insert d into failed[] in sorted order */
-            int i = nfailed - 1;
-            while (i >= 0 && failed[i] > (int)d) {
-                failed[i + 1] = failed[i];
-                i--;
-            }
-            failed[i + 1] = (int)d;
-            nfailed++;
-            memset(v[d], 0, block_size);
+            done += n;
         }
     }
+    __atomic_add_fetch(&ph->punched, count, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int parity_update_range(lr_state *s, uint32_t pos, uint32_t count,
+                        void **scratch_v)
+{
+    if (!s->parity || s->parity->levels == 0 || count == 0)
+        return 0;
 
-    /* Read the nfailed lowest parity levels */
-    for (int p = 0; p < nfailed; p++) {
-        if (parity_read_block(s->parity, (unsigned)p, pos, v[nd + p]) != 0)
-            memset(v[nd + p], 0, block_size);
+    /* Spans that no drive uses are punched out instead of encoding
+     * zeros; the encode path still writes them if punching fails */
+    int      rc  = 0;
+    uint32_t end = pos + count;
+    while (pos < end) {
+        int      used = 0;
+        uint32_t e = span_end(s, pos, end, &used);
+        if (used || punch_span(s->parity, pos, e - pos) != 0)
+            if (encode_span(s, pos, e - pos, scratch_v) != 0)
+                rc = -1;
+        pos = e;
     }
+    return rc;
+}
 
-    /*
-     * Build the nd×nd decode submatrix from:
-     *   - surviving data drives (identity rows of enc_matrix)
-     *   - nfailed parity rows
-     * Then invert to get decode coefficients.
-     */
-    uint8_t *enc_matrix = s->parity->enc_matrix;
+int parity_update_position(lr_state *s, uint32_t pos, void **scratch_v)
+{
+    return parity_update_range(s, pos, 1, scratch_v);
+}
+
+int parity_delta_position(lr_state *s, uint32_t pos, unsigned drive_idx,
+                          const void *delta, void **scratch_v)
+{
+    unsigned nd         = s->drive_count;
+    unsigned np         = s->parity ? s->parity->levels : 0;
+    uint32_t block_size = s->cfg.block_size;
+
+    if (np == 0 || !s->parity)
+        return 0;
+    if (drive_idx >= nd || nd != s->parity->nd)
+        return -1;
+
+    /* Stored parity into scratch_v[nd..nd+np-1] */
+    if (parity_levels_io(s, 0, pos, 1, scratch_v + nd, np) != 0)
+        return -1;
+
+    /* parity[p] ^= coeff[p][drive_idx] * delta; a lone P has coeff 1 */
+    void *px[3] = { scratch_v[nd], (void *)delta, scratch_v[nd] };
+    if (s->parity->kernel != LR_PARITY_XOR ||
+        xor_gen(3, (int)block_size, px) != 0)
+        ec_encode_data_update((int)block_size, (int)nd, (int)np,
+                              (int)drive_idx, s->parity->gftbls,
+                              (unsigned char *)delta,
+                              (unsigned char **)scratch_v + nd);
+
+    return parity_levels_io(s, 1, pos, 1, scratch_v + nd, np) ? -1 : 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* Block recovery                                                       */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Build decode tables for the sorted failed set failed[0..nfailed-1] into
+ * tbls: invert the nd×nd submatrix formed by the surviving data rows
+ * (identity rows of enc_matrix) and the nfailed lowest parity rows, then
+ * expand the rows belonging to the failed drives.  Returns 0 or -1.
+ */
+static int decode_build(const lr_parity_handle *ph, const int *failed,
+                        int nfailed, uint8_t *tbls)
+{
+    unsigned nd         = ph->nd;
+    uint8_t *enc_matrix = ph->enc_matrix;
 
     uint8_t *dec_matrix = malloc(nd * nd);
     uint8_t *inv_matrix = malloc(nd * nd);
-    uint8_t *dec_tbls   = malloc(32 * nd * (unsigned)nfailed);
-    if (!dec_matrix || !inv_matrix || !dec_tbls) {
-        free(dec_matrix); free(inv_matrix); free(dec_tbls);
-        free(freeptr);
+    uint8_t *decode_rows = malloc((unsigned)nfailed * nd);
+    if (!dec_matrix || !inv_matrix || !decode_rows) {
+        free(dec_matrix); free(inv_matrix); free(decode_rows);
         return -1;
     }
 
@@ -301,28 +761,193 @@ int parity_recover_block(lr_state *s, unsigned drive_idx, uint32_t pos,
     for (int i = 0; i < (int)nd; i++)
         memcpy(dec_matrix + i * nd, enc_matrix + surv_rows[i] * nd, nd);
 
-    if (gf_invert_matrix(dec_matrix, inv_matrix, (int)nd) != 0) {
-        free(dec_matrix); free(inv_matrix); free(dec_tbls);
-        free(freeptr);
-        return -1;
+    int rc = -1;
+    if (gf_invert_matrix(dec_matrix, inv_matrix, (int)nd) == 0) {
+        /* Extract decode rows for each failed drive */
+        for (int i = 0; i < nfailed; i++)
+            memcpy(decode_rows + i * nd, inv_matrix + failed[i] * nd, nd);
+        ec_init_tables((int)nd, nfailed, decode_rows, tbls);
+        rc = 0;
     }
 
-    /* Extract decode rows for each failed drive */
-    uint8_t *decode_rows = malloc((unsigned)nfailed * nd);
-    if (!decode_rows) {
-        free(dec_matrix); free(inv_matrix); free(dec_tbls);
-        free(freeptr);
+    free(dec_matrix);
+    free(inv_matrix);
+    free(decode_rows);
+    return rc;
+}
+
+/* Fill tbls with the decode tables for failed[], from the cache when the
+ * same failure set was seen before.  Returns 0 or -1. */
+static int decode_tables(lr_parity_handle *ph, const int *failed, int nfailed,
+                         uint8_t *tbls)
+{
+    size_t len = 32 * (size_t)ph->nd * (size_t)nfailed;
+
+    pthread_mutex_lock(&ph->dec_lock);
+    for (unsigned i = 0; i < LR_DECODE_CACHE; i++) {
+        lr_decode_entry *e = &ph->dec_cache[i];
+        if (e->nfailed != (unsigned)nfailed)
+            continue;
+        int k = 0;
+        while (k < nfailed && e->failed[k] == (uint8_t)failed[k])
+            k++;
+        if (k < nfailed)
+            continue;
+        memcpy(tbls, e->tbls, len);
+        e->last_use = ++ph->dec_tick;
+        ph->dec_hits++;
+        pthread_mutex_unlock(&ph->dec_lock);
+        return 0;
+    }
+    ph->dec_misses++;
+    pthread_mutex_unlock(&ph->dec_lock);
+
+    /* Invert outside the lock; a concurrent miss on the same set just
+     * builds it twice */
+    if (decode_build(ph, failed, nfailed, tbls) != 0)
+        return -1;
+
+    uint8_t *copy = malloc(len);
+    if (!copy)
+        return 0;       /* still usable, just not cached */
+    memcpy(copy, tbls, len);
+
+    pthread_mutex_lock(&ph->dec_lock);
+    lr_decode_entry *victim = &ph->dec_cache[0];
+    for (unsigned i = 1; i < LR_DECODE_CACHE; i++)
+        if (ph->dec_cache[i].last_use < victim->last_use)
+            victim = &ph->dec_cache[i];
+    free(victim->tbls);
+    victim->tbls     = copy;
+    victim->nfailed  = (unsigned)nfailed;
+    for (int k = 0; k < nfailed; k++)
+        victim->failed[k] = (uint8_t)failed[k];
+    victim->last_use = ++ph->dec_tick;
+    pthread_mutex_unlock(&ph->dec_lock);
+    return 0;
+}
+
+void parity_decode_stats(lr_parity_handle *ph, uint64_t *hits,
+                         uint64_t *misses)
+{
+    *hits = *misses = 0;
+    if (!ph->dec_ready)
+        return;
+    pthread_mutex_lock(&ph->dec_lock);
+    *hits   = ph->dec_hits;
+    *misses = ph->dec_misses;
+    pthread_mutex_unlock(&ph->dec_lock);
+}
+
+int parity_recover_drives(lr_state *s, const unsigned *drives,
+                          unsigned ndrives, uint32_t pos, uint32_t count,
+                          const void **out)
+{
+    if (!s->parity || s->parity->levels == 0 || !s->parity->dec_ready ||
+        ndrives == 0 || ndrives > s->parity->levels || count == 0 ||
+        count > parity_recover_run_max(s->parity))
+        return -1;
+
+    unsigned nd         = s->drive_count;
+    unsigned np         = s->parity->levels;
+    uint32_t block_size = s->cfg.block_size;
+    size_t   len        = (size_t)count * block_size;
+
+    recover_scratch *rs = recover_scratch_get(s->parity);
+    if (!rs)
         return -1;
+    void **v = rs->v;
+
+    /* The requested drives are not read: they start out failed */
+    uint8_t is_bad[LR_DRIVE_MAX];
+    uint8_t wanted[LR_DRIVE_MAX];
+    memset(is_bad, 0, nd);
+    memset(wanted, 0, nd);
+    for (unsigned i = 0; i < ndrives; i++) {
+        if (drives[i] >= nd)
+            return -1;
+        wanted[drives[i]] = 1;
+        is_bad[drives[i]] = 1;
+        memset(v[drives[i]], 0, len);
     }
-    for (int i = 0; i < nfailed; i++)
-        memcpy(decode_rows + i * nd, inv_matrix + failed[i] * nd, nd);
 
-    ec_init_tables((int)nd, nfailed, decode_rows, dec_tbls);
-    free(decode_rows);
+    /* Read all surviving data drives, one request per file segment, all
+     * submitted together; a drive whose file cannot be opened or read
+     * joins the failed set. */
+    read_batch b;
+    b.n = 0;
+    for (unsigned d = 0; d < nd; d++) {
+        if (wanted[d])
+            continue;
+
+        uint8_t *dst = (uint8_t *)v[d];
+        uint32_t p   = pos;
+        while (p < pos + count) {
+            uint8_t *at = dst + (size_t)(p - pos) * block_size;
+            uint32_t start, seg_end;
+            lr_file *f  = state_lookup_pos(s, d, p, &start, &seg_end);
+            if (!f) {
+                memset(at, 0, block_size);
+                p++;
+                continue;
+            }
+            if (seg_end > pos + count)
+                seg_end = pos + count;
+            if (b.n == READ_BATCH) {
+                batch_run(s, &b);
+                for (unsigned i = 0; i < b.n; i++)
+                    if (b.req[i].res < 0)
+                        is_bad[b.tag[i]] = 1;
+                b.n = 0;
+            }
+            if (batch_add(s, &b, f, start, p, seg_end - p, at, block_size,
+                          (int)d) < 0)
+                is_bad[d] = 1;
+            p = seg_end;
+        }
+    }
+    batch_run(s, &b);
+    for (unsigned i = 0; i < b.n; i++)
+        if (b.req[i].res < 0)
+            is_bad[b.tag[i]] = 1;
+
+    /* failed[] in ascending drive order (required by ISA-L decode) */
+    int failed[LR_LEV_MAX];
+    int nfailed = 0;
+    for (unsigned d = 0; d < nd; d++) {
+        if (!is_bad[d])
+            continue;
+        if (nfailed >= (int)np)
+            return -1;
+        failed[nfailed++] = (int)d;
+    }
+
+    /* Read the nfailed lowest parity levels (a failed level reads as zeros) */
+    parity_levels_io(s, 0, pos, count, v + nd, (unsigned)nfailed);
+
+    /* raid code, one failure: the lost drive is the XOR of P and the
+     * survivors, no decode tables needed */
+    if (s->parity->code == LR_CODE_RAID && nfailed == 1) {
+        void *xv[LR_DRIVE_MAX + 1];
+        int   n = 0;
+        for (unsigned d = 0; d < nd; d++)
+            if ((int)d != failed[0])
+                xv[n++] = v[d];
+        xv[n++] = v[nd];
+        xv[n++] = v[failed[0]];
+        if (xor_gen(n, (int)len, xv) == 0) {
+            for (unsigned i = 0; i < ndrives; i++)
+                out[i] = v[drives[i]];
+            return 0;
+        }
+    }
+
+    if (decode_tables(s->parity, failed, nfailed, rs->tbls) != 0)
+        return -1;
 
-    /* Collect surviving input pointers (same order as surv_rows) */
+    /* Collect surviving input pointers (same order as the decode rows) */
     uint8_t *src[LR_DRIVE_MAX];
-    si = 0; fi = 0;
+    int si = 0, fi = 0;
     for (int d = 0; d < (int)nd; d++) {
         if (fi < nfailed && d == failed[fi]) { fi++; continue; }
         src[si++] = (uint8_t *)v[d];
@@ -335,14 +960,30 @@ int parity_recover_block(lr_state *s, unsigned drive_idx, uint32_t pos,
     for (int i = 0; i < nfailed; i++)
         dst[i] = (uint8_t *)v[failed[i]];
 
-    ec_encode_data((int)block_size, (int)nd, nfailed, dec_tbls, src, dst);
+    /* Decoding is bytewise too, so the whole run decodes in one call */
+    ec_encode_data((int)len, (int)nd, nfailed, rs->tbls, src, dst);
 
-    memcpy(out_buf, v[drive_idx], block_size);
+    for (unsigned i = 0; i < ndrives; i++)
+        out[i] = v[drives[i]];
+    return 0;
+}
 
-    free(dec_matrix);
-    free(inv_matrix);
-    free(dec_tbls);
-    free(freeptr);
+const void *parity_recover_range(lr_state *s, unsigned drive_idx,
+                                 uint32_t pos, uint32_t count)
+{
+    const void *out;
+    if (parity_recover_drives(s, &drive_idx, 1, pos, count, &out) != 0)
+        return NULL;
+    return out;
+}
+
+int parity_recover_block(lr_state *s, unsigned drive_idx, uint32_t pos,
+                         void *out_buf)
+{
+    const void *data = parity_recover_range(s, drive_idx, pos, 1);
+    if (!data)
+        return -1;
+    memcpy(out_buf, data, s->cfg.block_size);
     return 0;
 }
 
@@ -350,108 +991,239 @@ int parity_recover_block(lr_state *s, unsigned drive_idx, uint32_t pos,
 /* Scrub                                                                */
 /* ------------------------------------------------------------------ */
 
-int parity_scrub(lr_state *s, lr_scrub_result *result, int repair)
+/* Read the data blocks of pos into v[0..nd-1], zeros where no file maps
+ * it.  Caller holds the state read lock.  Returns 0, or -1 on a read
+ * error. */
+static int scrub_read_data(lr_state *s, uint32_t pos, void **v)
 {
-    memset(result, 0, sizeof(*result));
+    unsigned nd         = s->drive_count;
+    uint32_t block_size = s->cfg.block_size;
 
-    if (!s->parity || s->parity->levels == 0)
-        return 0;
+    int read_err = 0;
+    read_batch b;
+    b.n = 0;
+    for (unsigned d = 0; d < nd; d++) {
+        uint32_t start, end;
+        lr_file *f = state_lookup_pos(s, d, pos, &start, &end);
+        if (!f) {
+            memset(v[d], 0, block_size);
+            continue;
+        }
+        if (b.n == READ_BATCH) {
+            batch_run(s, &b);
+            for (unsigned i = 0; i < b.n; i++)
+                if (b.req[i].res <= 0)
+                    read_err = 1;
+            b.n = 0;
+        }
+        if (batch_add(s, &b, f, start, pos, 1, v[d], block_size, (int)d) < 0)
+            read_err = 1;
+    }
+    batch_run(s, &b);
+    for (unsigned i = 0; i < b.n; i++)
+        if (b.req[i].res <= 0)
+            read_err = 1;
+    return read_err ? -1 : 0;
+}
 
+/* Check the stored parity of pos against the data in v[0..nd-1].
+ * Returns 0 if consistent, 1 on a mismatch (the expected parity is then
+ * in v[nd..nd+np-1]), -1 if the parity cannot be read. */
+static int scrub_check(lr_state *s, uint32_t pos, void **v)
+{
     unsigned nd         = s->drive_count;
     unsigned np         = s->parity->levels;
     uint32_t block_size = s->cfg.block_size;
 
-    /*
-     * Allocate: nd data + np computed-parity + np stored-parity slots.
-     * ec_encode_data writes into v[nd..nd+np-1]; stored parity goes into
-     * v[nd+np..nd+2*np-1] for byte-for-byte comparison.
-     */
-    void *freeptr = NULL;
-    void **v = lr_alloc_vector((int)(nd + 2 * np), block_size, &freeptr);
-    if (!v)
+    /* Read stored parity into v[nd+np..nd+2*np-1] */
+    if (parity_levels_io(s, 0, pos, 1, v + nd + np, np) != 0)
         return -1;
 
-    pthread_rwlock_rdlock(&s->state_lock);
+    /* The xor/pq kernels check data against stored parity in one pass
+     * (0 = consistent); anything else is recomputed and compared */
+    if (s->parity->kernel != LR_PARITY_EC) {
+        void *cv[LR_DRIVE_MAX + 2];
+        for (unsigned d = 0; d < nd; d++)
+            cv[d] = v[d];
+        for (unsigned p = 0; p < np; p++)
+            cv[nd + p] = v[nd + np + p];
+        int rc = s->parity->kernel == LR_PARITY_XOR
+                     ? xor_check((int)nd + 1, (int)block_size, cv)
+                     : pq_check((int)nd + 2, (int)block_size, cv);
+        if (rc == 0)
+            return 0;
+    }
+
+    /* Compute expected parity into v[nd..nd+np-1] and compare */
+    encode(s->parity, block_size, v);
+    for (unsigned p = 0; p < np; p++) {
+        if (memcmp(v[nd + p], v[nd + np + p], block_size) != 0)
+            return 1;
+    }
+    return 0;
+}
+
+/* Verify (and with repair, fix) one position.  v has nd + 2*np slots of
+ * at least block_size bytes. */
+static void scrub_position(lr_state *s, uint32_t pos, void **v, int repair,
+                           lr_scrub_result *result)
+{
+    unsigned nd = s->drive_count;
+
+    state_rdlock(s);
+    int rc = scrub_read_data(s, pos, v);
+    state_unlock(s);
+
+    result->positions_checked++;
+
+    if (rc == 0)
+        rc = scrub_check(s, pos, v);
+    if (rc < 0) {
+        result->read_errors++;
+        return;
+    }
+
+    /* A position dirtied since it was read is not a mismatch: the drain
+     * will recompute it, and rewriting it here could race a pending
+     * delta update that assumes the old parity. */
+    if (rc > 0 && s->journal && journal_position_dirty(s->journal, pos))
+        rc = 0;
+    if (rc == 0)
+        return;
+
+    if (!repair || !s->journal) {
+        result->parity_mismatches++;
+        if (repair && parity_levels_io(s, 1, pos, 1, v + nd,
+                                       s->parity->levels) == 0)
+            result->parity_fixed++;
+        return;
+    }
+
+    /* Repair confirms the mismatch before rewriting: a delta folded or a
+     * recompute run after the check above would otherwise be overwritten
+     * with parity of data that has since changed.  With drain runs and
+     * folds held off, and no writer between capture and write at pos,
+     * the data, the stored parity and the dirty state stay put. */
+    lr_journal      *j      = s->journal;
+    pthread_mutex_t *stripe = journal_delta_stripe(j, pos);
+    journal_drain_exclude(j);
+    state_rdlock(s);
+    pthread_mutex_lock(stripe);
+    rc = scrub_read_data(s, pos, v);
+    if (rc == 0)
+        rc = scrub_check(s, pos, v);
+    if (rc > 0 && journal_position_dirty(j, pos))
+        rc = 0;
+    if (rc < 0) {
+        result->read_errors++;
+    } else if (rc > 0) {
+        result->parity_mismatches++;
+        if (parity_levels_io(s, 1, pos, 1, v + nd, s->parity->levels) == 0)
+            result->parity_fixed++;
+    }
+    pthread_mutex_unlock(stripe);
+    state_unlock(s);
+    journal_drain_allow(j);
+}
+
+typedef struct {
+    lr_state        *state;
+    int              repair;
+    uint32_t         base;     /* first position of the range */
+    pthread_mutex_t  lock;     /* guards total */
+    lr_scrub_result  total;
+} scrub_job;
+
+static void scrub_chunk(void *arg, void **v, uint32_t start, uint32_t count)
+{
+    scrub_job      *job = (scrub_job *)arg;
+    lr_scrub_result r;
+    memset(&r, 0, sizeof(r));
+
+    for (uint32_t i = start; i < start + count; i++)
+        scrub_position(job->state, job->base + i, v, job->repair, &r);
+
+    pthread_mutex_lock(&job->lock);
+    job->total.positions_checked += r.positions_checked;
+    job->total.parity_mismatches += r.parity_mismatches;
+    job->total.parity_fixed      += r.parity_fixed;
+    job->total.read_errors       += r.read_errors;
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Positions per pool chunk: small enough to balance a background scrub
+ * slice across the workers, large enough that the per-chunk merge is
+ * noise */
+#define SCRUB_GRAIN 16
+
+uint32_t parity_position_limit(lr_state *s)
+{
+    state_rdlock(s);
     uint32_t max_pos = 0;
     for (unsigned d = 0; d < s->drive_count; d++) {
+        state_lock_drive(s, d);
         if (s->drives[d].pos_alloc.next_free > max_pos)
             max_pos = s->drives[d].pos_alloc.next_free;
+        state_unlock_drive(s, d);
     }
-    pthread_rwlock_unlock(&s->state_lock);
+    state_unlock(s);
+    return max_pos;
+}
 
-    for (uint32_t pos = 0; pos < max_pos; pos++) {
-        pthread_rwlock_rdlock(&s->state_lock);
+int parity_scrub_range(lr_state *s, uint32_t start, uint32_t count,
+                       int repair, lr_scrub_result *result)
+{
+    if (!s->parity || s->parity->levels == 0)
+        return -1;
+    if (count == 0)
+        return 0;
 
-        int read_err = 0;
-        for (unsigned d = 0; d < nd; d++) {
-            lr_file *f = state_find_file_at_pos(s, d, pos);
-            if (!f) {
-                memset(v[d], 0, block_size);
-                continue;
-            }
-            uint32_t blk_off = pos - f->parity_pos_start;
-            int fd = open(f->real_path, O_RDONLY);
-            if (fd < 0) {
-                memset(v[d], 0, block_size);
-                read_err = 1;
-                continue;
-            }
-            ssize_t n = pread(fd, v[d], block_size,
-                              (off_t)blk_off * block_size);
-            close(fd);
-            if (n < (ssize_t)block_size) {
-                if (n > 0)
-                    memset((char *)v[d] + n, 0, block_size - n);
-                else {
-                    memset(v[d], 0, block_size);
-                    read_err = 1;
-                }
-            }
-        }
+    unsigned nd = s->drive_count;
+    unsigned np = s->parity->levels;
+
+    /* Shared parity pool: each worker's scratch already holds
+     * nd + 2*np slots of at least one block */
+    lr_pool *pool = s->journal ? s->journal->pool : NULL;
+    if (pool) {
+        scrub_job job;
+        memset(&job, 0, sizeof(job));
+        job.state  = s;
+        job.repair = repair;
+        job.base   = start;
+        pthread_mutex_init(&job.lock, NULL);
+        pool_run(pool, count, SCRUB_GRAIN, scrub_chunk, &job);
+        pthread_mutex_destroy(&job.lock);
+        result->positions_checked += job.total.positions_checked;
+        result->parity_mismatches += job.total.parity_mismatches;
+        result->parity_fixed      += job.total.parity_fixed;
+        result->read_errors       += job.total.read_errors;
+        return 0;
+    }
 
-        pthread_rwlock_unlock(&s->state_lock);
+    /*
+     * Allocate: nd data + np computed-parity + np stored-parity slots.
+     * encode() writes into v[nd..nd+np-1]; stored parity goes into
+     * v[nd+np..nd+2*np-1] for byte-for-byte comparison.
+     */
+    void *freeptr = NULL;
+    void **v = lr_alloc_vector((int)(nd + 2 * np), s->cfg.block_size,
+                               &freeptr);
+    if (!v)
+        return -1;
 
-        result->positions_checked++;
+    for (uint32_t i = 0; i < count; i++)
+        scrub_position(s, start + i, v, repair, result);
 
-        if (read_err) {
-            result->read_errors++;
-            continue;
-        }
+    free(freeptr);
+    return 0;
+}
 
-        /* Compute expected parity into v[nd..nd+np-1] */
-        ec_encode_data((int)block_size, (int)nd, (int)np,
-                       s->parity->gftbls,
-                       (uint8_t **)v,
-                       (uint8_t **)v + nd);
-
-        /* Read stored parity into v[nd+np..nd+2*np-1] and compare */
-        int mismatch        = 0;
-        int parity_read_err = 0;
-        for (unsigned p = 0; p < np; p++) {
-            if (parity_read_block(s->parity, p, pos, v[nd + np + p]) != 0) {
-                parity_read_err = 1;
-                break;
-            }
-            if (memcmp(v[nd + p], v[nd + np + p], block_size) != 0)
-                mismatch = 1;
-        }
+int parity_scrub(lr_state *s, lr_scrub_result *result, int repair)
+{
+    memset(result, 0, sizeof(*result));
 
-        if (parity_read_err) {
-            result->read_errors++;
-        } else if (mismatch) {
-            result->parity_mismatches++;
-            if (repair) {
-                int write_err = 0;
-                for (unsigned p = 0; p < np; p++) {
-                    if (parity_write_block(s->parity, p, pos, v[nd + p]) != 0)
-                        write_err = 1;
-                }
-                if (!write_err)
-                    result->parity_fixed++;
-            }
-        }
-    }
+    if (!s->parity || s->parity->levels == 0)
+        return 0;
 
-    free(freeptr);
-    return 0;
+    return parity_scrub_range(s, 0, parity_position_limit(s), repair, result);
 }
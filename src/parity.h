@@ -2,38 +2,118 @@
 #define LR_PARITY_H
 
 #include "state.h"
+#include "scrub.h"
 #include <stdint.h>
 #include <isa-l/erasure_code.h>
 
 /*
  * Parity file handles and I/O (ISA-L backend).
  *
- * The Cauchy encoding matrix and precomputed GF tables are built once
- * at parity_open() time from the drive/parity counts in the config.
+ * The encoding matrix and precomputed GF tables are built once at
+ * parity_open() time from the drive/parity counts and parity_code in the
+ * config.  With parity_code raid the matrix is P = XOR and Q = RAID-6
+ * (sum of 2^j * D_j), so one parity level encodes, checks and recovers a
+ * single failure with ISA-L's xor_* kernels and two levels encode and
+ * check with pq_*; both are verified against the general ec_encode_data
+ * path at open and dropped in its favour if they disagree.
+ *
+ * Recovery decode tables depend only on which drives failed, so they are
+ * cached per sorted failed-drive set: a degraded read of a large file
+ * inverts the decode matrix once, not once per block.  Each thread that
+ * recovers blocks also keeps its own scratch vector (freed at thread exit
+ * or parity_close) instead of allocating one per call.
+ *
+ * A level may be striped across several files (shards), normally on
+ * different devices: position pos lives in shard (pos / stripe) % shards,
+ * at block (pos / stripe / shards) * stripe + pos % stripe of that file.
+ * Every parity read, write and punch is split at stripe boundaries and
+ * routed to its shard, so one drain writes several devices at once.
+ * Changing a level's files or the stripe moves every position: run a
+ * repair afterwards.  With parity_direct the files are opened O_DIRECT;
+ * every buffer handed to them must be page-aligned, which lr_alloc_vector
+ * and the pool scratch are.
  */
+
+/* Decode table sets kept (LRU).  Distinct failure sets are rare. */
+#define LR_DECODE_CACHE 16
+
+/* Upper bound on one parity_recover_range run, per drive buffer */
+#define LR_RECOVER_RUN_BYTES (1u << 20)
+
+typedef struct {
+    unsigned  nfailed;            /* 0 = empty slot */
+    uint8_t   failed[LR_LEV_MAX]; /* sorted failed drive indices */
+    uint64_t  last_use;
+    uint8_t  *tbls;               /* 32 * nd * nfailed bytes */
+} lr_decode_entry;
+
+/* Encode kernel chosen at parity_open */
+#define LR_PARITY_EC  0   /* ec_encode_data with the GF tables */
+#define LR_PARITY_XOR 1   /* xor_gen / xor_check (raid code, 1 level) */
+#define LR_PARITY_PQ  2   /* pq_gen / pq_check (raid code, 2 levels) */
+
 typedef struct lr_parity_handle {
-    int      fds[LR_LEV_MAX];   /* open file descriptors, -1 if unused */
+    int      fds[LR_LEV_MAX][LR_SHARD_MAX]; /* per level and shard, -1 if unused */
+    unsigned shards[LR_LEV_MAX]; /* files per level (>= 1 for levels in use) */
+    uint32_t stripe;             /* positions per shard stripe */
+    int      direct;             /* files opened O_DIRECT */
     unsigned levels;             /* number of parity levels (np) */
     unsigned nd;                 /* number of data drives at open time */
     uint32_t block_size;
+    int      code;               /* LR_CODE_* from the config */
+    int      kernel;             /* LR_PARITY_* */
+    int      no_punch;           /* fallocate cannot punch holes here */
+    uint64_t punched;            /* positions deallocated (atomic) */
 
-    /* ISA-L: (nd+np)*nd Cauchy encoding matrix and precomputed tables */
+    /* ISA-L: (nd+np)*nd encoding matrix and precomputed tables */
     uint8_t *enc_matrix;         /* (nd+np) * nd bytes */
     uint8_t *gftbls;             /* 32 * nd * np bytes */
+
+    /* Recovery: decode-table cache + per-thread scratch (guarded by dec_lock) */
+    int             dec_ready;   /* lock and key initialised */
+    pthread_mutex_t dec_lock;
+    lr_decode_entry dec_cache[LR_DECODE_CACHE];
+    uint64_t        dec_tick;
+    uint64_t        dec_hits;
+    uint64_t        dec_misses;
+    pthread_key_t   scratch_key; /* → this thread's recovery scratch */
+    lr_list         scratch_list;
 } lr_parity_handle;
 
 /* Open/create parity files.  Returns 0 on success. */
 int  parity_open(lr_parity_handle *ph, const lr_config *cfg);
 void parity_close(lr_parity_handle *ph);
 
-/* Read one block from parity level `lev` at position `pos`. */
+/* Read one block from parity level `lev` at position `pos`.  With
+ * O_DIRECT files buf must be page-aligned. */
 int  parity_read_block(lr_parity_handle *ph, unsigned lev, uint32_t pos,
                        void *buf);
 
-/* Write one block to parity level `lev` at position `pos`. */
+/* Write one block to parity level `lev` at position `pos`.  Same
+ * alignment rule as parity_read_block. */
 int  parity_write_block(lr_parity_handle *ph, unsigned lev, uint32_t pos,
                         const void *buf);
 
+/* fdatasync every parity file.  Returns 0, or -1 if any failed. */
+int  parity_sync(lr_parity_handle *ph);
+
+/* Most shards of any level: drain groups positions by
+ * parity_shard_group so pool workers write different shards. */
+static inline unsigned parity_shard_groups(const lr_parity_handle *ph)
+{
+    unsigned n = 1;
+    for (unsigned lev = 0; lev < ph->levels; lev++)
+        if (ph->shards[lev] > n)
+            n = ph->shards[lev];
+    return n;
+}
+
+static inline unsigned parity_shard_group(const lr_parity_handle *ph,
+                                          uint32_t pos)
+{
+    return (pos / ph->stripe) % parity_shard_groups(ph);
+}
+
 /*
  * Recompute parity for position `pos` using current data blocks.
  * `scratch_v` must have room for (nd + np) blocks of block_size bytes;
@@ -41,6 +121,30 @@ int  parity_write_block(lr_parity_handle *ph, unsigned lev, uint32_t pos,
  */
 int  parity_update_position(lr_state *s, uint32_t pos, void **scratch_v);
 
+/*
+ * Recompute parity for positions [pos, pos+count) in one pass: one pread
+ * per drive per file segment, one encode over the whole run and
+ * one pwrite per parity level.  Spans where no drive has a file are
+ * punched out of the parity files (FALLOC_FL_PUNCH_HOLE) instead, since
+ * holes read back as the zero parity they would hold.  `scratch_v` must
+ * have room for (nd + np) buffers of count * block_size bytes.  Same
+ * locking as parity_update_position.
+ */
+int  parity_update_range(lr_state *s, uint32_t pos, uint32_t count,
+                         void **scratch_v);
+
+/*
+ * Delta update: fold `delta` (old XOR new content of drive `drive_idx`'s
+ * block at `pos`) into the stored parity (XOR for a lone raid P level,
+ * ec_encode_data_update otherwise),
+ * without reading any data drive.  Returns -1 if parity could not be read
+ * or written, in which case the caller must fall back to a full
+ * parity_update_position().  Same scratch_v requirements and locking as
+ * parity_update_position.
+ */
+int  parity_delta_position(lr_state *s, uint32_t pos, unsigned drive_idx,
+                           const void *delta, void **scratch_v);
+
 /*
  * Reconstruct one data block for drive `drive_idx` at parity position `pos`.
  * Additional drives returning EIO are auto-detected (up to np total failures).
@@ -51,16 +155,56 @@ int  parity_update_position(lr_state *s, uint32_t pos, void **scratch_v);
 int  parity_recover_block(lr_state *s, unsigned drive_idx, uint32_t pos,
                           void *out_buf);
 
+/*
+ * Reconstruct `count` consecutive blocks of drive `drive_idx` starting at
+ * `pos` in one pass: one read per surviving drive per file segment and a
+ * single decode over the run.  A drive failing any read in the run counts
+ * as failed for the whole run.  count must not exceed
+ * parity_recover_run_max().
+ *
+ * Returns a pointer to count * block_size recovered bytes in the calling
+ * thread's scratch (valid until its next recovery call), or NULL.
+ * Caller must hold state_lock for reading.
+ */
+const void *parity_recover_range(lr_state *s, unsigned drive_idx,
+                                 uint32_t pos, uint32_t count);
+
+/*
+ * parity_recover_range for several drives at once: every drive in
+ * drives[] (distinct, at most the number of parity levels) is treated as
+ * failed and reconstructed by the same decode, so the surviving drives are
+ * read once for all of them.  out[i] receives drives[i]'s count blocks in
+ * the calling thread's scratch (valid until its next recovery call).
+ * Returns 0, or -1 if the run cannot be recovered.
+ * Caller must hold state_lock for reading.
+ */
+int parity_recover_drives(lr_state *s, const unsigned *drives,
+                          unsigned ndrives, uint32_t pos, uint32_t count,
+                          const void **out);
+
+/* Longest run parity_recover_range / parity_recover_drives accept (>= 1). */
+static inline uint32_t parity_recover_run_max(const lr_parity_handle *ph)
+{
+    uint32_t n = LR_RECOVER_RUN_BYTES / ph->block_size;
+    return n > 0 ? n : 1;
+}
+
+/* Positions punched out of the parity files so far (for "stats"). */
+uint64_t parity_punched(const lr_parity_handle *ph);
+
+/* Names of the parity code and encode kernel (for "stats"). */
+const char *parity_code_name(const lr_parity_handle *ph);
+const char *parity_kernel_name(const lr_parity_handle *ph);
+
+/* Decode-table cache counters (for the ctrl "stats" command). */
+void parity_decode_stats(lr_parity_handle *ph, uint64_t *hits,
+                         uint64_t *misses);
+
 /* ------------------------------------------------------------------ */
 /* Scrub                                                                */
 /* ------------------------------------------------------------------ */
 
-typedef struct {
-    uint32_t positions_checked;
-    uint32_t parity_mismatches;
-    uint32_t parity_fixed;
-    uint32_t read_errors;
-} lr_scrub_result;
+/* lr_scrub_result is defined in scrub.h */
 
 /*
  * Walk every parity position and verify stored parity matches recomputed.
@@ -69,14 +213,32 @@ typedef struct {
  */
 int  parity_scrub(lr_state *s, lr_scrub_result *result, int repair);
 
+/*
+ * Same for positions [start, start+count), adding to *result.  Runs on the
+ * journal's parity pool when there is one.  The background scrub (scrub.c)
+ * calls this one slice at a time.
+ */
+int  parity_scrub_range(lr_state *s, uint32_t start, uint32_t count,
+                        int repair, lr_scrub_result *result);
+
+/* One past the highest allocated parity position of any drive (takes the
+ * state read lock). */
+uint32_t parity_position_limit(lr_state *s);
+
 /* ------------------------------------------------------------------ */
 /* Vector allocator                                                     */
 /* ------------------------------------------------------------------ */
 
+/* Alignment of lr_alloc_vector buffers: a page, for O_DIRECT parity I/O
+ * (also satisfies ISA-L's 64-byte AVX2/AVX-512 paths) */
+#define LR_VECTOR_ALIGN 4096
+
 /*
- * Allocate n blocks of block_size bytes each, 64-byte aligned (safe for
- * ISA-L AVX2 paths).  Returns a void*[n] pointer array; free *freeptr
- * (not the returned pointer) to release everything.
+ * Allocate n blocks of block_size bytes each, the first LR_VECTOR_ALIGN
+ * aligned and the rest block_size apart: all page-aligned when block_size
+ * is a multiple of a page, 64-byte aligned (ISA-L AVX2) when it is a
+ * multiple of 64.  Returns a void*[n] pointer array; free *freeptr (not
+ * the returned pointer) to release everything.
  *
  * Returns NULL on allocation failure.
  */
@@ -0,0 +1,219 @@
+#include "pool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* ------------------------------------------------------------------ */
+/* Helpers                                                              */
+/* ------------------------------------------------------------------ */
+
+/* Page alignment, as lr_alloc_vector: parity files may be O_DIRECT */
+#define SCRATCH_ALIGN 4096
+
+/* Same layout as lr_alloc_vector: page-aligned pointer array followed
+ * by n page-aligned buffers. */
+static void **scratch_alloc(unsigned n, size_t size, void **freeptr)
+{
+    const size_t a     = SCRATCH_ALIGN;
+    size_t ptrs_bytes  = (size_t)n * sizeof(void *);
+    size_t ptrs_padded = (ptrs_bytes + a - 1) & ~(a - 1);
+    size_t size_padded = (size + a - 1) & ~(a - 1);
+
+    void *raw = malloc(ptrs_padded + (size_t)n * size_padded + a - 1);
+    *freeptr = raw;
+    if (!raw)
+        return NULL;
+
+    uint8_t *base = (uint8_t *)(((uintptr_t)raw + a - 1) & ~(uintptr_t)(a - 1));
+    void   **v    = (void **)base;
+    for (unsigned i = 0; i < n; i++)
+        v[i] = base + ptrs_padded + (size_t)i * size_padded;
+    return v;
+}
+
+/* Next chunk for worker t: front of its own deque, else steal from the
+ * back of another.  Returns UINT32_MAX when no work is left anywhere. */
+static uint32_t take_chunk(lr_pool *p, unsigned t, int *stolen)
+{
+    lr_pool_deque *own = &p->deques[t];
+    uint32_t       c   = UINT32_MAX;
+
+    pthread_mutex_lock(&own->lock);
+    if (own->lo < own->hi)
+        c = own->lo++;
+    pthread_mutex_unlock(&own->lock);
+    if (c != UINT32_MAX) {
+        *stolen = 0;
+        return c;
+    }
+
+    for (unsigned i = 1; i < p->nthreads; i++) {
+        lr_pool_deque *dq = &p->deques[(t + i) % p->nthreads];
+        pthread_mutex_lock(&dq->lock);
+        if (dq->lo < dq->hi)
+            c = --dq->hi;
+        pthread_mutex_unlock(&dq->lock);
+        if (c != UINT32_MAX) {
+            *stolen = 1;
+            return c;
+        }
+    }
+    return UINT32_MAX;
+}
+
+static void *pool_thread(void *arg)
+{
+    lr_pool_deque *self = (lr_pool_deque *)arg;
+    lr_pool       *p    = self->pool;
+    unsigned       t    = self->idx;
+    uint64_t       seen = 0;
+
+    while (1) {
+        pthread_mutex_lock(&p->lock);
+        while (!p->stopping && p->generation == seen)
+            pthread_cond_wait(&p->start_cond, &p->lock);
+        if (p->stopping) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        seen = p->generation;
+        lr_pool_fn fn    = p->fn;
+        void      *farg  = p->arg;
+        uint32_t   total = p->total;
+        uint32_t   grain = p->grain;
+        pthread_mutex_unlock(&p->lock);
+
+        uint64_t nchunks = 0, nsteals = 0;
+        uint32_t c;
+        int      stolen;
+        while ((c = take_chunk(p, t, &stolen)) != UINT32_MAX) {
+            uint64_t start = (uint64_t)c * grain;
+            uint32_t count = total - start < grain
+                             ? (uint32_t)(total - start) : grain;
+            fn(farg, p->scratch[t], (uint32_t)start, count);
+            nchunks++;
+            nsteals += (uint64_t)stolen;
+        }
+
+        pthread_mutex_lock(&p->lock);
+        p->chunks += nchunks;
+        p->steals += nsteals;
+        if (--p->busy == 0)
+            pthread_cond_signal(&p->done_cond);
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* Public API                                                           */
+/* ------------------------------------------------------------------ */
+
+int pool_init(lr_pool *p, unsigned nthreads, unsigned nvec, size_t vec_size)
+{
+    memset(p, 0, sizeof(*p));
+    if (nthreads == 0)
+        nthreads = 1;
+    if (nthreads > LR_POOL_MAX)
+        nthreads = LR_POOL_MAX;
+
+    for (unsigned t = 0; t < nthreads; t++) {
+        if (nvec == 0)
+            continue;
+        p->scratch[t] = scratch_alloc(nvec, vec_size, &p->scratch_mem[t]);
+        if (!p->scratch[t]) {
+            for (unsigned i = 0; i < t; i++)
+                free(p->scratch_mem[i]);
+            return -1;
+        }
+    }
+
+    pthread_mutex_init(&p->run_lock, NULL);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start_cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+    for (unsigned t = 0; t < LR_POOL_MAX; t++) {
+        pthread_mutex_init(&p->deques[t].lock, NULL);
+        p->deques[t].pool = p;
+        p->deques[t].idx  = t;
+    }
+
+    for (unsigned t = 0; t < nthreads; t++) {
+        if (pthread_create(&p->threads[t], NULL, pool_thread,
+                           &p->deques[t]) != 0) {
+            p->nthreads = t;    /* pool_done joins the ones that started */
+            pool_done(p);
+            return -1;
+        }
+        p->nthreads = t + 1;
+    }
+    return 0;
+}
+
+void pool_done(lr_pool *p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->stopping = 1;
+    pthread_cond_broadcast(&p->start_cond);
+    pthread_mutex_unlock(&p->lock);
+
+    for (unsigned t = 0; t < p->nthreads; t++)
+        pthread_join(p->threads[t], NULL);
+
+    for (unsigned t = 0; t < LR_POOL_MAX; t++) {
+        free(p->scratch_mem[t]);
+        pthread_mutex_destroy(&p->deques[t].lock);
+    }
+    pthread_cond_destroy(&p->done_cond);
+    pthread_cond_destroy(&p->start_cond);
+    pthread_mutex_destroy(&p->lock);
+    pthread_mutex_destroy(&p->run_lock);
+    memset(p, 0, sizeof(*p));
+}
+
+void pool_run(lr_pool *p, uint32_t total, uint32_t grain,
+              lr_pool_fn fn, void *arg)
+{
+    if (total == 0)
+        return;
+    if (grain == 0)
+        grain = 1;
+
+    pthread_mutex_lock(&p->run_lock);
+
+    /* Deal contiguous chunk ranges so neighbouring positions stay on one
+     * worker (and keep coalescing) until stealing kicks in */
+    uint64_t nchunks = ((uint64_t)total + grain - 1) / grain;
+    unsigned n       = p->nthreads;
+    for (unsigned t = 0; t < n; t++) {
+        pthread_mutex_lock(&p->deques[t].lock);
+        p->deques[t].lo = (uint32_t)(nchunks * t / n);
+        p->deques[t].hi = (uint32_t)(nchunks * (t + 1) / n);
+        pthread_mutex_unlock(&p->deques[t].lock);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->fn    = fn;
+    p->arg   = arg;
+    p->total = total;
+    p->grain = grain;
+    p->busy  = n;
+    p->generation++;
+    p->runs++;
+    pthread_cond_broadcast(&p->start_cond);
+    while (p->busy > 0)
+        pthread_cond_wait(&p->done_cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+
+    pthread_mutex_unlock(&p->run_lock);
+}
+
+void pool_get_stats(lr_pool *p, lr_pool_stats *st)
+{
+    pthread_mutex_lock(&p->lock);
+    st->threads = p->nthreads;
+    st->runs    = p->runs;
+    st->chunks  = p->chunks;
+    st->steals  = p->steals;
+    pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,84 @@
+#ifndef LR_POOL_H
+#define LR_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Persistent work-stealing thread pool for background parity math.
+ *
+ * pool_run splits [0, total) into chunks of `grain` items and deals a
+ * contiguous range of chunks to each worker's deque.  A worker takes
+ * chunks from the front of its own deque and, once that is empty, steals
+ * from the back of the others', so a chunk stuck behind a slow drive no
+ * longer holds up the rest of the pass.
+ *
+ * Each worker owns a scratch vector of `nvec` buffers of `vec_size` bytes
+ * (page-aligned, same layout as lr_alloc_vector), allocated once at
+ * pool_init and handed to every chunk it runs.
+ *
+ * pool_run blocks until every chunk has finished.  Concurrent callers
+ * (drain, scrub, live rebuild) are serialised; the calling thread only
+ * waits.  A chunk callback must not call pool_run on the same pool.
+ */
+
+#define LR_POOL_MAX 64   /* matches the parity_threads limit */
+
+typedef void (*lr_pool_fn)(void *arg, void **scratch,
+                           uint32_t start, uint32_t count);
+
+struct lr_pool;
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t        lo, hi;    /* chunk indices [lo, hi) still queued */
+    struct lr_pool *pool;      /* owner, for the worker thread */
+    unsigned        idx;       /* worker index */
+} lr_pool_deque;
+
+typedef struct lr_pool {
+    unsigned        nthreads;
+    pthread_t       threads[LR_POOL_MAX];
+    lr_pool_deque   deques[LR_POOL_MAX];
+    void          **scratch[LR_POOL_MAX];
+    void           *scratch_mem[LR_POOL_MAX];
+
+    pthread_mutex_t run_lock;  /* one pool_run at a time */
+    pthread_mutex_t lock;      /* guards the fields below */
+    pthread_cond_t  start_cond;
+    pthread_cond_t  done_cond;
+    uint64_t        generation;  /* bumped per pool_run */
+    unsigned        busy;        /* workers still on the current job */
+    int             stopping;
+
+    /* Current job (valid while busy > 0) */
+    lr_pool_fn      fn;
+    void           *arg;
+    uint32_t        total;
+    uint32_t        grain;
+
+    /* Counters (guarded by lock) */
+    uint64_t        runs;
+    uint64_t        chunks;
+    uint64_t        steals;
+} lr_pool;
+
+/* Start nthreads (1..LR_POOL_MAX) workers.  Returns 0 or -1. */
+int  pool_init(lr_pool *p, unsigned nthreads, unsigned nvec, size_t vec_size);
+void pool_done(lr_pool *p);
+
+/* Run fn over [0, total) in chunks of at most grain items; blocks. */
+void pool_run(lr_pool *p, uint32_t total, uint32_t grain,
+              lr_pool_fn fn, void *arg);
+
+typedef struct {
+    unsigned threads;
+    uint64_t runs;
+    uint64_t chunks;
+    uint64_t steals;
+} lr_pool_stats;
+
+void pool_get_stats(lr_pool *p, lr_pool_stats *st);
+
+#endif /* LR_POOL_H */
@@ -0,0 +1,272 @@
+#include "rcache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* ------------------------------------------------------------------ */
+/* Helpers                                                              */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    unsigned drive;
+    uint32_t pos;
+} rkey;
+
+static inline uint32_t rkey_hash(unsigned drive, uint32_t pos)
+{
+    return (pos * 2654435761u) ^ (drive * 40503u);
+}
+
+static int rkey_cmp(const void *arg, const void *obj)
+{
+    const rkey      *k = (const rkey *)arg;
+    const lr_rblock *b = (const lr_rblock *)obj;
+    return !(b->drive == k->drive && b->pos == k->pos);
+}
+
+/* Caller holds c->lock. */
+static lr_rblock *find(lr_rcache *c, unsigned drive, uint32_t pos)
+{
+    rkey k = { drive, pos };
+    return lr_hash_search(&c->table, rkey_hash(drive, pos), rkey_cmp, &k);
+}
+
+/* Caller holds c->lock. */
+static void drop(lr_rcache *c, lr_rblock *b)
+{
+    lr_hash_remove(&c->table, &b->hash_node);
+    lr_list_remove(&c->lru, &b->lru_node);
+    free(b);
+}
+
+/* ------------------------------------------------------------------ */
+/* Readahead thread                                                     */
+/* ------------------------------------------------------------------ */
+
+static void *ra_thread(void *arg)
+{
+    lr_rcache *c = (lr_rcache *)arg;
+
+    pthread_mutex_lock(&c->lock);
+    while (1) {
+        while (c->running && c->ra_count == 0)
+            pthread_cond_wait(&c->ra_cond, &c->lock);
+        if (!c->running)
+            break;
+        lr_rcache_ra r = c->ra_queue[c->ra_head];
+        c->ra_head = (c->ra_head + 1) % LR_RCACHE_RA_QUEUE;
+        c->ra_count--;
+        pthread_mutex_unlock(&c->lock);
+
+        /* Recover each run of uncached blocks; a degraded reader may have
+         * filled some of them since the request was queued */
+        uint32_t p = r.pos, end = r.pos + r.count;
+        while (p < end) {
+            if (rcache_contains(c, r.drive, p)) {
+                p++;
+                continue;
+            }
+            uint32_t n = 1;
+            while (p + n < end && !rcache_contains(c, r.drive, p + n))
+                n++;
+            if (c->fill(c->fill_arg, r.drive, p, n) != 0)
+                break;
+            p += n;
+        }
+
+        pthread_mutex_lock(&c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* Public API                                                           */
+/* ------------------------------------------------------------------ */
+
+int rcache_init(lr_rcache *c, unsigned capacity, uint32_t block_size,
+                lr_rcache_fill_fn fill, void *fill_arg)
+{
+    memset(c, 0, sizeof(*c));
+    c->capacity   = capacity > 0 ? capacity : 1;
+    c->block_size = block_size;
+    c->fill       = fill;
+    c->fill_arg   = fill_arg;
+    lr_hash_init(&c->table);
+    lr_list_init(&c->lru);
+
+    if (pthread_mutex_init(&c->lock, NULL) != 0) {
+        lr_hash_done(&c->table);
+        return -1;
+    }
+    if (pthread_cond_init(&c->ra_cond, NULL) != 0) {
+        pthread_mutex_destroy(&c->lock);
+        lr_hash_done(&c->table);
+        return -1;
+    }
+    if (fill) {
+        c->running = 1;
+        if (pthread_create(&c->thread, NULL, ra_thread, c) != 0) {
+            c->running = 0;
+            pthread_cond_destroy(&c->ra_cond);
+            pthread_mutex_destroy(&c->lock);
+            lr_hash_done(&c->table);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void rcache_done(lr_rcache *c)
+{
+    if (c->fill) {
+        pthread_mutex_lock(&c->lock);
+        c->running = 0;
+        pthread_cond_signal(&c->ra_cond);
+        pthread_mutex_unlock(&c->lock);
+        pthread_join(c->thread, NULL);
+    }
+
+    lr_list_node *n = lr_list_head(&c->lru);
+    while (n) {
+        lr_rblock *b = (lr_rblock *)n->data;
+        n = n->next;
+        free(b);
+    }
+    lr_hash_done(&c->table);
+    pthread_cond_destroy(&c->ra_cond);
+    pthread_mutex_destroy(&c->lock);
+    memset(c, 0, sizeof(*c));
+}
+
+int rcache_read(lr_rcache *c, unsigned drive, uint32_t pos,
+                void *out, uint32_t off, uint32_t len)
+{
+    pthread_mutex_lock(&c->lock);
+    lr_rblock *b = find(c, drive, pos);
+    if (!b) {
+        c->misses++;
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+    lr_list_remove(&c->lru, &b->lru_node);
+    lr_list_insert_tail(&c->lru, &b->lru_node, b);
+    memcpy(out, b->data + off, len);
+    c->hits++;
+    pthread_mutex_unlock(&c->lock);
+    return 1;
+}
+
+int rcache_contains(lr_rcache *c, unsigned drive, uint32_t pos)
+{
+    pthread_mutex_lock(&c->lock);
+    int found = find(c, drive, pos) != NULL;
+    pthread_mutex_unlock(&c->lock);
+    return found;
+}
+
+uint64_t rcache_gen(lr_rcache *c)
+{
+    pthread_mutex_lock(&c->lock);
+    uint64_t g = c->gen;
+    pthread_mutex_unlock(&c->lock);
+    return g;
+}
+
+void rcache_put(lr_rcache *c, unsigned drive, uint32_t pos,
+                const void *buf, uint64_t gen)
+{
+    /* Copy outside the lock; most puts are not stale */
+    lr_rblock *nb = malloc(sizeof(*nb) + c->block_size);
+    if (!nb)
+        return;
+    nb->drive = drive;
+    nb->pos   = pos;
+    memcpy(nb->data, buf, c->block_size);
+
+    pthread_mutex_lock(&c->lock);
+    if (gen != c->gen) {
+        pthread_mutex_unlock(&c->lock);
+        free(nb);
+        return;
+    }
+    lr_rblock *old = find(c, drive, pos);
+    if (old)
+        drop(c, old);
+    while (c->lru.count >= c->capacity) {
+        drop(c, (lr_rblock *)lr_list_head(&c->lru)->data);
+        c->evictions++;
+    }
+    lr_hash_insert(&c->table, &nb->hash_node, nb, rkey_hash(drive, pos));
+    lr_list_insert_tail(&c->lru, &nb->lru_node, nb);
+    if (drive > c->max_drive)
+        c->max_drive = drive;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void rcache_invalidate(lr_rcache *c, uint32_t pos, uint32_t count)
+{
+    pthread_mutex_lock(&c->lock);
+    c->gen++;
+
+    uint64_t probes = (uint64_t)count * (c->max_drive + 1);
+    if (probes >= c->lru.count) {
+        /* Fewer cached blocks than lookups: scan the cache */
+        lr_list_node *n = lr_list_head(&c->lru);
+        while (n) {
+            lr_rblock *b = (lr_rblock *)n->data;
+            n = n->next;
+            if (b->pos >= pos && b->pos - pos < count)
+                drop(c, b);
+        }
+    } else {
+        for (uint32_t i = 0; i < count; i++) {
+            for (unsigned d = 0; d <= c->max_drive; d++) {
+                lr_rblock *b = find(c, d, pos + i);
+                if (b)
+                    drop(c, b);
+            }
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void rcache_prefetch(lr_rcache *c, unsigned drive, uint32_t pos,
+                     uint32_t count)
+{
+    if (!c->fill || count == 0)
+        return;
+
+    pthread_mutex_lock(&c->lock);
+    for (unsigned i = 0; i < c->ra_count; i++) {
+        const lr_rcache_ra *q =
+            &c->ra_queue[(c->ra_head + i) % LR_RCACHE_RA_QUEUE];
+        if (q->drive == drive && q->pos == pos) {
+            pthread_mutex_unlock(&c->lock);
+            return;
+        }
+    }
+    if (c->ra_count < LR_RCACHE_RA_QUEUE) {
+        lr_rcache_ra *q =
+            &c->ra_queue[(c->ra_head + c->ra_count) % LR_RCACHE_RA_QUEUE];
+        q->drive = drive;
+        q->pos   = pos;
+        q->count = count;
+        c->ra_count++;
+        c->prefetched += count;
+        pthread_cond_signal(&c->ra_cond);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void rcache_get_stats(lr_rcache *c, lr_rcache_stats *st)
+{
+    pthread_mutex_lock(&c->lock);
+    st->hits       = c->hits;
+    st->misses     = c->misses;
+    st->evictions  = c->evictions;
+    st->prefetched = c->prefetched;
+    st->blocks     = c->lru.count;
+    st->capacity   = c->capacity;
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,113 @@
+#ifndef LR_RCACHE_H
+#define LR_RCACHE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include "lr_hash.h"
+#include "lr_list.h"
+
+/*
+ * Recovered-block cache and readahead for degraded reads.
+ *
+ * When a drive is missing, lr_read reconstructs its blocks from parity.
+ * FUSE reads are smaller than a block, so without a cache every block is
+ * reconstructed once per read that touches it.  This module keeps a
+ * bounded LRU of reconstructed blocks keyed by (drive, position) and runs
+ * one readahead thread that fills the cache ahead of sequential readers.
+ *
+ * The cache does not know how to recover a block: readahead calls the
+ * fill callback given to rcache_init, which recovers and rcache_put()s.
+ *
+ * Staleness: any change to the data at a position must call
+ * rcache_invalidate (the journal does so whenever a position is dirtied or
+ * gets a delta).  A recovery that raced with such a change is discarded:
+ * callers take rcache_gen() before recovering and pass it to rcache_put,
+ * which drops the block if an invalidation happened in between.
+ */
+
+#define LR_RCACHE_RA_QUEUE 32    /* pending readahead requests */
+
+typedef int (*lr_rcache_fill_fn)(void *arg, unsigned drive, uint32_t pos,
+                                 uint32_t count);
+
+typedef struct lr_rblock {
+    unsigned      drive;
+    uint32_t      pos;
+    lr_hash_node  hash_node;
+    lr_list_node  lru_node;     /* head = least recent */
+    uint8_t       data[];       /* block_size bytes */
+} lr_rblock;
+
+typedef struct {
+    unsigned drive;
+    uint32_t pos;
+    uint32_t count;
+} lr_rcache_ra;
+
+typedef struct lr_rcache {
+    pthread_mutex_t   lock;
+    lr_hash           table;       /* (drive, pos) → lr_rblock* */
+    lr_list           lru;
+    unsigned          capacity;    /* max cached blocks */
+    uint32_t          block_size;
+    unsigned          max_drive;   /* highest drive index cached, for invalidate */
+    uint64_t          gen;         /* bumped by every rcache_invalidate */
+
+    /* Readahead (thread runs only when fill != NULL) */
+    lr_rcache_fill_fn fill;
+    void             *fill_arg;
+    pthread_t         thread;
+    int               running;
+    pthread_cond_t    ra_cond;
+    lr_rcache_ra      ra_queue[LR_RCACHE_RA_QUEUE];
+    unsigned          ra_head;
+    unsigned          ra_count;
+
+    /* Counters (guarded by lock) */
+    uint64_t          hits;
+    uint64_t          misses;
+    uint64_t          evictions;
+    uint64_t          prefetched;  /* blocks requested by readahead */
+} lr_rcache;
+
+/* capacity in blocks (>= 1).  fill may be NULL (no readahead thread). */
+int  rcache_init(lr_rcache *c, unsigned capacity, uint32_t block_size,
+                 lr_rcache_fill_fn fill, void *fill_arg);
+void rcache_done(lr_rcache *c);
+
+/* Copy len bytes at byte off of the cached block into out.
+ * Returns 1 on hit, 0 on miss. */
+int  rcache_read(lr_rcache *c, unsigned drive, uint32_t pos,
+                 void *out, uint32_t off, uint32_t len);
+
+/* 1 if (drive, pos) is cached; does not count as a hit or touch the LRU. */
+int  rcache_contains(lr_rcache *c, unsigned drive, uint32_t pos);
+
+/* Generation to pass to rcache_put for a recovery about to start. */
+uint64_t rcache_gen(lr_rcache *c);
+
+/* Insert a recovered block (copied).  Dropped if gen is stale. */
+void rcache_put(lr_rcache *c, unsigned drive, uint32_t pos,
+                const void *buf, uint64_t gen);
+
+/* Drop every drive's blocks at positions [pos, pos+count). */
+void rcache_invalidate(lr_rcache *c, uint32_t pos, uint32_t count);
+
+/* Queue asynchronous recovery of [pos, pos+count) on drive.  Requests that
+ * duplicate a queued one, or arrive while the queue is full, are dropped. */
+void rcache_prefetch(lr_rcache *c, unsigned drive, uint32_t pos,
+                     uint32_t count);
+
+typedef struct {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t prefetched;
+    unsigned blocks;
+    unsigned capacity;
+} lr_rcache_stats;
+
+void rcache_get_stats(lr_rcache *c, lr_rcache_stats *st);
+
+#endif /* LR_RCACHE_H */
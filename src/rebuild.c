@@ -3,6 +3,9 @@
 #include "state.h"
 #include "metadata.h"
 #include "parity.h"
+#include "io.h"
+#include "pool.h"
+#include "throttle.h"
 #include "lr_list.h"
 
 #include <stdio.h>
@@ -44,139 +47,683 @@ static void mkdirs_for_rebuild(const char *real_file_path)
 }
 
 /*--------------------------------------------------------------------
- * Reconstruct one file from parity onto its drive path.
- * Returns 0 on success, -1 on failure.
+ * Rebuild engine shared by offline and live rebuild.
  *------------------------------------------------------------------*/
-static int rebuild_one_file(lr_state *s, unsigned drive_idx, lr_file *f,
-                             void *block_buf)
-{
-    uint32_t bs = s->cfg.block_size;
 
-    /* Ensure parent directories exist */
-    mkdirs_for_rebuild(f->real_path);
+/* Positions per window, in recovery runs, and at most this many outputs
+ * open at once (files starting exactly at a window's first position are
+ * always opened, so a window never stalls) */
+#define REBUILD_WINDOW_RUNS 16
+#define REBUILD_MAX_OPEN    128
+
+typedef struct {
+    uint32_t             lo, hi;     /* positions [lo, hi) */
+    lr_rebuild_target  **active;     /* outputs open in this window */
+    unsigned             nactive;
+    unsigned             pending;    /* runs queued to or held by the writer */
+} rebuild_window;
+
+typedef struct rebuild_slot {
+    struct rebuild_slot *next;
+    rebuild_window      *win;
+    uint32_t             pos;        /* first position of the run */
+    uint32_t             count;
+    uint8_t             *buf;        /* ndrives regions of run_blocks blocks */
+} rebuild_slot;
+
+struct lr_rebuild {
+    lr_state               *state;
+    lr_pool                *pool;
+    unsigned                drives[LR_LEV_MAX];
+    unsigned                ndrives;
+    uint32_t                run_blocks;
+    size_t                  region;     /* bytes per drive in a slot */
+    lr_throttle             throttle;
+    lr_rebuild_progress_fn  progress;
+    void                   *progress_arg;
+
+    pthread_t               writer;
+    pthread_mutex_t         lock;       /* guards everything below, and the
+                                         * targets' failure fields */
+    pthread_cond_t          free_cond;  /* a slot was returned */
+    pthread_cond_t          work_cond;  /* a slot was queued, or stopping */
+    pthread_cond_t          done_cond;  /* a window's pending count hit 0 */
+    rebuild_slot           *slots;
+    uint8_t                *slot_mem;
+    rebuild_slot           *free_list;
+    rebuild_slot           *queue_head;
+    rebuild_slot           *queue_tail;
+    int                     stopping;
+
+    uint64_t                done_bytes;
+    uint64_t                total_bytes;
+    uint64_t                start_ns;
+    uint64_t                last_report_ns;
+};
+
+/* Positions of t inside [pos, pos+count); returns 0 if none. */
+static int target_overlap(const lr_rebuild_target *t, uint32_t pos,
+                          uint32_t count, uint32_t *a, uint32_t *b)
+{
+    uint64_t end = (uint64_t)t->pos_start + t->block_count;
+    *a = t->pos_start > pos ? t->pos_start : pos;
+    *b = end < (uint64_t)pos + count ? (uint32_t)end : pos + count;
+    return *a < *b;
+}
 
-    mode_t create_mode = (f->mode & 07777) ? (f->mode & 07777) : 0644;
-    int fd = open(f->real_path, O_WRONLY | O_CREAT | O_TRUNC, create_mode);
-    if (fd < 0) {
-        fprintf(stderr, "rebuild:   cannot create '%s': %s\n",
-                f->real_path, strerror(errno));
-        return -1;
+/* Caller holds rb->lock. */
+static void target_fail(lr_rebuild_target *t, uint32_t blk, int err)
+{
+    if (!t->failed || blk < t->bad_blk) {
+        t->bad_blk = blk;
+        t->err     = err;
     }
+    t->failed = 1;
+}
 
-    int ok = 1;
-    for (uint32_t blk = 0; blk < f->block_count; blk++) {
-        uint32_t pos = f->parity_pos_start + blk;
+static unsigned drive_region(const lr_rebuild *rb, unsigned drive)
+{
+    for (unsigned i = 0; i < rb->ndrives; i++)
+        if (rb->drives[i] == drive)
+            return i;
+    return 0;
+}
 
-        pthread_rwlock_rdlock(&s->state_lock);
-        int rc = parity_recover_block(s, drive_idx, pos, block_buf);
-        pthread_rwlock_unlock(&s->state_lock);
+/* Caller holds rb->lock. */
+static void progress_snapshot(lr_rebuild *rb, uint64_t now,
+                              lr_rebuild_progress *p)
+{
+    uint64_t elapsed = now - rb->start_ns;
+    p->done_bytes    = rb->done_bytes;
+    p->total_bytes   = rb->total_bytes;
+    p->bytes_per_sec = elapsed > 0
+        ? (uint64_t)((double)rb->done_bytes * 1e9 / (double)elapsed) : 0;
+    if (rb->done_bytes >= rb->total_bytes)
+        p->eta_sec = 0;
+    else if (p->bytes_per_sec > 0)
+        p->eta_sec = (rb->total_bytes - rb->done_bytes) / p->bytes_per_sec;
+    else
+        p->eta_sec = UINT64_MAX;
+}
 
-        if (rc != 0) {
-            fprintf(stderr, "rebuild:   parity_recover_block failed at pos %u\n", pos);
-            ok = 0;
-            break;
-        }
+/* Write every active target's share of one recovered run. */
+static void write_slot(lr_rebuild *rb, rebuild_slot *sl)
+{
+    rebuild_window *w  = sl->win;
+    uint32_t        bs = rb->state->cfg.block_size;
+    uint8_t         skip[REBUILD_MAX_OPEN + LR_LEV_MAX];
+
+    pthread_mutex_lock(&rb->lock);
+    for (unsigned i = 0; i < w->nactive; i++)
+        skip[i] = (uint8_t)w->active[i]->failed;
+    pthread_mutex_unlock(&rb->lock);
+
+    for (unsigned i = 0; i < w->nactive; i++) {
+        lr_rebuild_target *t = w->active[i];
+        uint32_t a, b;
+        if (skip[i] || !target_overlap(t, sl->pos, sl->count, &a, &b))
+            continue;
 
         /* Last block: only write bytes within the actual file size */
-        size_t write_len = bs;
-        if (blk == f->block_count - 1 && f->size > 0) {
-            size_t tail = (size_t)(f->size % bs);
+        size_t len = (size_t)(b - a) * bs;
+        if (b == t->pos_start + t->block_count && t->size > 0) {
+            size_t tail = (size_t)(t->size % bs);
             if (tail != 0)
-                write_len = tail;
+                len -= bs - tail;
         }
+        const uint8_t *src = sl->buf
+                           + drive_region(rb, t->drive) * rb->region
+                           + (size_t)(a - sl->pos) * bs;
+        ssize_t n   = pwrite(t->fd, src, len, (off_t)(a - t->pos_start) * bs);
+        int     err = n < 0 ? errno : EIO;
+        stats_dev_io(rb->state->stats, t->drive, 1, n);
+
+        pthread_mutex_lock(&rb->lock);
+        if (n == (ssize_t)len)
+            rb->done_bytes += len;
+        else
+            target_fail(t, a - t->pos_start, err);
+        pthread_mutex_unlock(&rb->lock);
+    }
+}
 
-        ssize_t n = pwrite(fd, block_buf, write_len, (off_t)blk * bs);
-        if (n != (ssize_t)write_len) {
-            fprintf(stderr, "rebuild:   pwrite failed at block %u: %s\n",
-                    blk, strerror(errno));
-            ok = 0;
+static void *writer_thread(void *arg)
+{
+    lr_rebuild *rb = (lr_rebuild *)arg;
+
+    pthread_mutex_lock(&rb->lock);
+    while (1) {
+        while (!rb->stopping && !rb->queue_head)
+            pthread_cond_wait(&rb->work_cond, &rb->lock);
+        if (!rb->queue_head)
             break;
+        rebuild_slot *sl = rb->queue_head;
+        rb->queue_head   = sl->next;
+        if (!rb->queue_head)
+            rb->queue_tail = NULL;
+        pthread_mutex_unlock(&rb->lock);
+
+        write_slot(rb, sl);
+
+        /* Report before releasing the window so the callback is finished
+         * by the time rebuild_targets moves on */
+        pthread_mutex_lock(&rb->lock);
+        uint64_t now = throttle_now_ns();
+        if (rb->progress &&
+            now - rb->last_report_ns >= LR_REBUILD_PROGRESS_MS * 1000000ull) {
+            lr_rebuild_progress p;
+            rb->last_report_ns = now;
+            progress_snapshot(rb, now, &p);
+            pthread_mutex_unlock(&rb->lock);
+            rb->progress(rb->progress_arg, &p);
+            pthread_mutex_lock(&rb->lock);
+        }
+
+        rebuild_window *w = sl->win;
+        sl->next      = rb->free_list;
+        rb->free_list = sl;
+        pthread_cond_signal(&rb->free_cond);
+        if (--w->pending == 0)
+            pthread_cond_broadcast(&rb->done_cond);
+    }
+    pthread_mutex_unlock(&rb->lock);
+    return NULL;
+}
+
+typedef struct {
+    lr_rebuild     *rb;
+    rebuild_window *win;
+} window_job;
+
+/* Caller holds rb->lock.  1 if some unfailed target needs [pos, pos+n). */
+static int run_needed(const rebuild_window *w, uint32_t pos, uint32_t n)
+{
+    for (unsigned i = 0; i < w->nactive; i++) {
+        uint32_t a, b;
+        if (!w->active[i]->failed && target_overlap(w->active[i], pos, n, &a, &b))
+            return 1;
+    }
+    return 0;
+}
+
+/* Recover run `run` of the window for every target drive and queue it. */
+static void window_run(lr_rebuild *rb, rebuild_window *w, uint32_t run)
+{
+    lr_state *s   = rb->state;
+    uint32_t  bs  = s->cfg.block_size;
+    uint32_t  pos = w->lo + run * rb->run_blocks;
+    uint32_t  n   = w->hi - pos < rb->run_blocks ? w->hi - pos : rb->run_blocks;
+
+    pthread_mutex_lock(&rb->lock);
+    while (run_needed(w, pos, n) && !rb->free_list)
+        pthread_cond_wait(&rb->free_cond, &rb->lock);
+    if (!run_needed(w, pos, n)) {
+        /* A hole between files, or every target here has failed */
+        pthread_mutex_unlock(&rb->lock);
+        return;
+    }
+    rebuild_slot *sl = rb->free_list;
+    rb->free_list    = sl->next;
+    pthread_mutex_unlock(&rb->lock);
+
+    throttle_wait(&rb->throttle, (uint64_t)n * bs * rb->ndrives);
+
+    const void *out[LR_LEV_MAX];
+    state_rdlock(s);
+    int rc = parity_recover_drives(s, rb->drives, rb->ndrives, pos, n, out);
+    if (rc == 0)
+        for (unsigned i = 0; i < rb->ndrives; i++)
+            memcpy(sl->buf + i * rb->region, out[i], (size_t)n * bs);
+    state_unlock(s);
+
+    pthread_mutex_lock(&rb->lock);
+    if (rc != 0) {
+        for (unsigned i = 0; i < w->nactive; i++) {
+            uint32_t a, b;
+            if (target_overlap(w->active[i], pos, n, &a, &b))
+                target_fail(w->active[i], a - w->active[i]->pos_start, 0);
         }
+        sl->next      = rb->free_list;
+        rb->free_list = sl;
+        pthread_cond_broadcast(&rb->free_cond);  /* let waiters re-check */
+    } else {
+        sl->win   = w;
+        sl->pos   = pos;
+        sl->count = n;
+        sl->next  = NULL;
+        if (rb->queue_tail)
+            rb->queue_tail->next = sl;
+        else
+            rb->queue_head = sl;
+        rb->queue_tail = sl;
+        w->pending++;
+        pthread_cond_signal(&rb->work_cond);
+    }
+    pthread_mutex_unlock(&rb->lock);
+}
+
+static void window_chunk(void *arg, void **v, uint32_t start, uint32_t count)
+{
+    window_job *job = (window_job *)arg;
+    (void)v;
+    for (uint32_t r = start; r < start + count; r++)
+        window_run(job->rb, job->win, r);
+}
+
+static void window_process(lr_rebuild *rb, rebuild_window *w)
+{
+    uint32_t   nruns = (uint32_t)(((uint64_t)(w->hi - w->lo) + rb->run_blocks - 1)
+                                  / rb->run_blocks);
+    window_job job   = { rb, w };
+
+    if (rb->pool && nruns > 1)
+        pool_run(rb->pool, nruns, 1, window_chunk, &job);
+    else
+        window_chunk(&job, NULL, 0, nruns);
+
+    /* Wait for the writer to drain this window's runs */
+    pthread_mutex_lock(&rb->lock);
+    while (w->pending > 0)
+        pthread_cond_wait(&rb->done_cond, &rb->lock);
+    pthread_mutex_unlock(&rb->lock);
+}
+
+lr_rebuild *rebuild_start(lr_state *s, lr_pool *pool, const unsigned *drives,
+                          unsigned ndrives, uint64_t total_bytes,
+                          uint64_t rate_bps, lr_rebuild_progress_fn progress,
+                          void *arg)
+{
+    if (!s->parity || ndrives == 0 || ndrives > s->parity->levels)
+        return NULL;
+    lr_rebuild *rb = calloc(1, sizeof(*rb));
+    if (!rb)
+        return NULL;
+    rb->state        = s;
+    rb->pool         = pool;
+    rb->ndrives      = ndrives;
+    memcpy(rb->drives, drives, ndrives * sizeof(unsigned));
+    rb->run_blocks   = parity_recover_run_max(s->parity);
+    rb->region       = (size_t)rb->run_blocks * s->cfg.block_size;
+    rb->progress     = progress;
+    rb->progress_arg = arg;
+    rb->total_bytes  = total_bytes;
+    rb->start_ns     = throttle_now_ns();
+    rb->last_report_ns = rb->start_ns;
+
+    /* Two runs per recovering thread keep the writer busy while the next
+     * ones are decoded */
+    unsigned nslots    = 2 * (pool ? pool->nthreads : 1) + 2;
+    size_t   slot_size = rb->region * ndrives;
+    rb->slots    = calloc(nslots, sizeof(rebuild_slot));
+    rb->slot_mem = malloc((size_t)nslots * slot_size);
+    if (!rb->slots || !rb->slot_mem) {
+        free(rb->slots);
+        free(rb->slot_mem);
+        free(rb);
+        return NULL;
+    }
+    for (unsigned i = 0; i < nslots; i++) {
+        rb->slots[i].buf  = rb->slot_mem + (size_t)i * slot_size;
+        rb->slots[i].next = rb->free_list;
+        rb->free_list     = &rb->slots[i];
+    }
+
+    throttle_init(&rb->throttle, rate_bps);
+    pthread_mutex_init(&rb->lock, NULL);
+    pthread_cond_init(&rb->free_cond, NULL);
+    pthread_cond_init(&rb->work_cond, NULL);
+    pthread_cond_init(&rb->done_cond, NULL);
+    if (pthread_create(&rb->writer, NULL, writer_thread, rb) != 0) {
+        pthread_cond_destroy(&rb->done_cond);
+        pthread_cond_destroy(&rb->work_cond);
+        pthread_cond_destroy(&rb->free_cond);
+        pthread_mutex_destroy(&rb->lock);
+        throttle_done(&rb->throttle);
+        free(rb->slots);
+        free(rb->slot_mem);
+        free(rb);
+        return NULL;
+    }
+    return rb;
+}
+
+void rebuild_finish(lr_rebuild *rb)
+{
+    pthread_mutex_lock(&rb->lock);
+    rb->stopping = 1;
+    pthread_cond_signal(&rb->work_cond);
+    pthread_mutex_unlock(&rb->lock);
+    pthread_join(rb->writer, NULL);
+
+    pthread_cond_destroy(&rb->done_cond);
+    pthread_cond_destroy(&rb->work_cond);
+    pthread_cond_destroy(&rb->free_cond);
+    pthread_mutex_destroy(&rb->lock);
+    throttle_done(&rb->throttle);
+    free(rb->slots);
+    free(rb->slot_mem);
+    free(rb);
+}
+
+void rebuild_get_progress(lr_rebuild *rb, lr_rebuild_progress *p)
+{
+    pthread_mutex_lock(&rb->lock);
+    progress_snapshot(rb, throttle_now_ns(), p);
+    pthread_mutex_unlock(&rb->lock);
+}
+
+/*--------------------------------------------------------------------
+ * Targets: snapshot, output files, sweep.
+ *------------------------------------------------------------------*/
+int rebuild_collect(lr_state *s, const unsigned *drives, unsigned ndrives,
+                    lr_rebuild_target **out, unsigned *count, uint64_t *bytes)
+{
+    unsigned n = 0;
+    *out   = NULL;
+    *count = 0;
+    *bytes = 0;
+
+    uint8_t wanted[LR_DRIVE_MAX];
+    memset(wanted, 0, sizeof(wanted));
+    for (unsigned i = 0; i < ndrives; i++)
+        if (drives[i] < LR_DRIVE_MAX)
+            wanted[drives[i]] = 1;
+
+    lr_list_node *node;
+    for (node = lr_list_head(&s->file_list); node; node = node->next)
+        if (wanted[((lr_file *)node->data)->drive_idx])
+            n++;
+    if (n == 0)
+        return 0;
+
+    lr_rebuild_target *t = calloc(n, sizeof(*t));
+    if (!t)
+        return -1;
+    unsigned i = 0;
+    state_lock_drives(s);
+    for (node = lr_list_head(&s->file_list); node && i < n; node = node->next) {
+        lr_file *f = (lr_file *)node->data;
+        if (!wanted[f->drive_idx])
+            continue;
+        lr_rebuild_target *x = &t[i++];
+        char real[PATH_MAX];
+        x->vpath       = strdup(f->vpath);
+        x->real_path   = strdup(state_real_path(s, f, real, sizeof(real)));
+        x->drive       = f->drive_idx;
+        x->pos_start   = f->parity_pos_start;
+        x->block_count = f->block_count;
+        x->size        = f->size;
+        x->mode        = f->mode;
+        x->uid         = f->uid;
+        x->gid         = f->gid;
+        x->mtime_sec   = f->mtime_sec;
+        x->mtime_nsec  = f->mtime_nsec;
+        x->busy        = state_open_count(f) > 0;
+        x->fd          = -1;
+        if (!x->vpath || !x->real_path) {
+            state_unlock_drives(s);
+            rebuild_free_targets(t, i);
+            return -1;
+        }
+        *bytes += (uint64_t)f->size;
+    }
+    state_unlock_drives(s);
+    *out   = t;
+    *count = i;
+    return 0;
+}
+
+void rebuild_free_targets(lr_rebuild_target *t, unsigned count)
+{
+    for (unsigned i = 0; i < count; i++) {
+        free(t[i].vpath);
+        free(t[i].real_path);
     }
+    free(t);
+}
+
+static int target_cmp(const void *a, const void *b)
+{
+    const lr_rebuild_target *x = (const lr_rebuild_target *)a;
+    const lr_rebuild_target *y = (const lr_rebuild_target *)b;
+    if (x->pos_start != y->pos_start)
+        return x->pos_start < y->pos_start ? -1 : 1;
+    return (x->drive > y->drive) - (x->drive < y->drive);
+}
+
+/* Create the output file.  Returns 0, or -1 with t->create_err set. */
+static int target_open(lr_rebuild_target *t)
+{
+    mkdirs_for_rebuild(t->real_path);
+
+    mode_t create_mode = (t->mode & 07777) ? (t->mode & 07777) : 0644;
+    t->fd = open(t->real_path, O_WRONLY | O_CREAT | O_TRUNC, create_mode);
+    if (t->fd < 0) {
+        t->create_err = errno;
+        t->failed     = 1;
+        return -1;
+    }
+    return 0;
+}
 
-    close(fd);
+/* Close and settle one output; returns the rc for the done callback. */
+static int target_finish(lr_rebuild *rb, lr_rebuild_target *t)
+{
+    lr_state *s = rb->state;
 
-    if (!ok) {
-        unlink(f->real_path); /* remove partial file */
+    close(t->fd);
+    t->fd = -1;
+    if (t->failed) {
+        unlink(t->real_path);   /* remove partial file */
         return -1;
     }
 
+    /* A live rebuild races with the filesystem: drop the output if its
+     * file was removed or moved while it was being reconstructed */
+    state_rdlock(s);
+    lr_file *f     = state_find_file(s, t->vpath);
+    /* Same vpath and drive means the same real path */
+    int      ours  = f && f->drive_idx == t->drive;
+    int      same  = 0;
+    if (ours) {
+        state_lock_drive(s, t->drive);
+        same = f->parity_pos_start == t->pos_start;
+        state_unlock_drive(s, t->drive);
+    }
+    state_unlock(s);
+    if (!same) {
+        if (!ours)
+            unlink(t->real_path);
+        return 1;
+    }
+
     /* Restore file metadata */
-    if (f->mode & 07777)
-        chmod(f->real_path, f->mode & 07777);
+    if (t->mode & 07777)
+        chmod(t->real_path, t->mode & 07777);
 
     /* Best-effort: may fail if not running as root */
-    int chown_rc = lchown(f->real_path, f->uid, f->gid);
+    int chown_rc = lchown(t->real_path, (uid_t)t->uid, (gid_t)t->gid);
     (void)chown_rc;
 
-    if (f->mtime_sec != 0) {
+    if (t->mtime_sec != 0) {
         struct timespec ts[2];
-        ts[0].tv_sec  = f->mtime_sec;
-        ts[0].tv_nsec = f->mtime_nsec;
-        ts[1].tv_sec  = f->mtime_sec;
-        ts[1].tv_nsec = f->mtime_nsec;
-        utimensat(AT_FDCWD, f->real_path, ts, 0);
+        ts[0].tv_sec  = (time_t)t->mtime_sec;
+        ts[0].tv_nsec = t->mtime_nsec;
+        ts[1].tv_sec  = (time_t)t->mtime_sec;
+        ts[1].tv_nsec = t->mtime_nsec;
+        utimensat(AT_FDCWD, t->real_path, ts, 0);
     }
-
     return 0;
 }
 
+unsigned rebuild_targets(lr_rebuild *rb, lr_rebuild_target *t, unsigned count,
+                         lr_rebuild_done_fn done, void *arg)
+{
+    lr_rebuild_target *active[REBUILD_MAX_OPEN + LR_LEV_MAX];
+    unsigned nactive = 0, next = 0, failures = 0;
+    uint32_t lo      = 0;
+
+    qsort(t, count, sizeof(*t), target_cmp);
+
+    while (next < count || nactive > 0) {
+        /* Skip the gap to the next file when nothing is open */
+        if (nactive == 0 && t[next].pos_start > lo)
+            lo = t[next].pos_start;
+        uint64_t hi64 = (uint64_t)lo + (uint64_t)REBUILD_WINDOW_RUNS * rb->run_blocks;
+        uint32_t hi   = hi64 > UINT32_MAX ? UINT32_MAX : (uint32_t)hi64;
+
+        /* Open every output that starts inside the window */
+        while (next < count && t[next].pos_start < hi) {
+            lr_rebuild_target *x = &t[next];
+            if (nactive >= REBUILD_MAX_OPEN && x->pos_start > lo) {
+                hi = x->pos_start;
+                break;
+            }
+            next++;
+            if (x->busy) {
+                done(arg, x, 1);
+                continue;
+            }
+            if (target_open(x) != 0) {
+                failures++;
+                done(arg, x, -1);
+                continue;
+            }
+            if (x->block_count == 0) {
+                /* Empty file: nothing to recover */
+                int rc = target_finish(rb, x);
+                failures += rc < 0;
+                done(arg, x, rc);
+                continue;
+            }
+            active[nactive++] = x;
+        }
+
+        if (nactive > 0) {
+            rebuild_window w;
+            memset(&w, 0, sizeof(w));
+            w.lo      = lo;
+            w.hi      = hi;
+            w.active  = active;
+            w.nactive = nactive;
+            window_process(rb, &w);
+        }
+
+        /* Finish outputs the sweep has passed (or that failed) */
+        unsigned keep = 0;
+        for (unsigned i = 0; i < nactive; i++) {
+            lr_rebuild_target *x = active[i];
+            pthread_mutex_lock(&rb->lock);
+            int failed = x->failed;
+            pthread_mutex_unlock(&rb->lock);
+            if (!failed && (uint64_t)x->pos_start + x->block_count > hi) {
+                active[keep++] = x;
+                continue;
+            }
+            int rc = target_finish(rb, x);
+            failures += rc < 0;
+            done(arg, x, rc);
+        }
+        nactive = keep;
+        lo      = hi;
+    }
+    return failures;
+}
+
 /*--------------------------------------------------------------------
- * Iterate all files on drive_idx and reconstruct each from parity.
+ * Offline rebuild of drives[] with stderr reporting.
  *------------------------------------------------------------------*/
-static int do_rebuild(lr_state *s, unsigned drive_idx)
+static void offline_progress(void *arg, const lr_rebuild_progress *p)
 {
-    uint32_t bs = s->cfg.block_size;
+    (void)arg;
+    if (p->eta_sec == UINT64_MAX)
+        fprintf(stderr, "rebuild: %llu/%llu MiB\n",
+                (unsigned long long)(p->done_bytes >> 20),
+                (unsigned long long)(p->total_bytes >> 20));
+    else
+        fprintf(stderr, "rebuild: %llu/%llu MiB, %.1f MiB/s, ETA %llus\n",
+                (unsigned long long)(p->done_bytes >> 20),
+                (unsigned long long)(p->total_bytes >> 20),
+                (double)p->bytes_per_sec / (1 << 20),
+                (unsigned long long)p->eta_sec);
+}
 
-    /* Count files on this drive */
-    unsigned total = 0;
-    lr_list_node *node = lr_list_head(&s->file_list);
-    while (node) {
-        lr_file *f = (lr_file *)node->data;
-        if (f->drive_idx == drive_idx)
-            total++;
-        node = node->next;
-    }
+typedef struct {
+    unsigned total;
+    unsigned rebuilt;
+    unsigned failed;
+} offline_ctx;
 
-    fprintf(stderr, "rebuild: drive '%s' (%s) — %u file(s) to reconstruct\n",
-            s->drives[drive_idx].name, s->drives[drive_idx].dir, total);
+static void offline_done(void *arg, const lr_rebuild_target *t, int rc)
+{
+    offline_ctx *ctx = (offline_ctx *)arg;
 
-    if (total == 0) {
-        fprintf(stderr, "rebuild: nothing to do\n");
-        return 0;
+    if (rc == 0) {
+        ctx->rebuilt++;
+        fprintf(stderr, "rebuild: [%u/%u] OK   %s\n",
+                ctx->rebuilt + ctx->failed, ctx->total, t->vpath);
+        return;
     }
+    if (t->create_err)
+        fprintf(stderr, "rebuild:   cannot create '%s': %s\n",
+                t->real_path, strerror(t->create_err));
+    else if (t->err == 0)
+        fprintf(stderr, "rebuild:   parity recovery failed at pos %u\n",
+                t->pos_start + t->bad_blk);
+    else
+        fprintf(stderr, "rebuild:   pwrite failed at block %u: %s\n",
+                t->bad_blk, strerror(t->err));
+    ctx->failed++;
+    fprintf(stderr, "rebuild: [%u/%u] FAIL %s\n",
+            ctx->rebuilt + ctx->failed, ctx->total, t->vpath);
+}
 
-    void *block_buf = malloc(bs);
-    if (!block_buf) {
+/*--------------------------------------------------------------------
+ * Reconstruct all files on drives[] from parity in one pass.
+ *------------------------------------------------------------------*/
+static int do_rebuild(lr_state *s, lr_pool *pool, const unsigned *drives,
+                      unsigned ndrives)
+{
+    lr_rebuild_target *t;
+    unsigned           total;
+    uint64_t           bytes;
+    if (rebuild_collect(s, drives, ndrives, &t, &total, &bytes) != 0) {
         fprintf(stderr, "rebuild: out of memory\n");
         return 1;
     }
 
-    unsigned rebuilt = 0, failed = 0;
-    node = lr_list_head(&s->file_list);
-    while (node) {
-        lr_file *f = (lr_file *)node->data;
-        node = node->next;
+    for (unsigned i = 0; i < ndrives; i++)
+        fprintf(stderr, "rebuild: drive '%s' (%s)\n",
+                s->drives[drives[i]].name, s->drives[drives[i]].dir);
+    fprintf(stderr, "rebuild: %u file(s) to reconstruct\n", total);
 
-        if (f->drive_idx != drive_idx)
-            continue;
+    if (total == 0) {
+        fprintf(stderr, "rebuild: nothing to do\n");
+        return 0;
+    }
 
-        if (rebuild_one_file(s, drive_idx, f, block_buf) == 0) {
-            rebuilt++;
-            fprintf(stderr, "rebuild: [%u/%u] OK   %s\n",
-                    rebuilt + failed, total, f->vpath);
-        } else {
-            failed++;
-            fprintf(stderr, "rebuild: [%u/%u] FAIL %s\n",
-                    rebuilt + failed, total, f->vpath);
-        }
+    lr_rebuild *rb = rebuild_start(s, pool, drives, ndrives, bytes,
+                                   (uint64_t)s->cfg.rebuild_rate_mb << 20,
+                                   offline_progress, NULL);
+    if (!rb) {
+        fprintf(stderr, "rebuild: cannot start rebuild engine\n");
+        rebuild_free_targets(t, total);
+        return 1;
     }
 
-    free(block_buf);
+    offline_ctx ctx = { total, 0, 0 };
+    rebuild_targets(rb, t, total, offline_done, &ctx);
+
+    lr_rebuild_progress p;
+    rebuild_get_progress(rb, &p);
+    rebuild_finish(rb);
+    rebuild_free_targets(t, total);
 
-    fprintf(stderr, "rebuild: complete — %u rebuilt, %u failed\n",
-            rebuilt, failed);
-    return (failed > 0) ? 1 : 0;
+    fprintf(stderr, "rebuild: complete — %u rebuilt, %u failed, "
+            "%llu MiB at %.1f MiB/s\n", ctx.rebuilt, ctx.failed,
+            (unsigned long long)(p.done_bytes >> 20),
+            (double)p.bytes_per_sec / (1 << 20));
+    return (ctx.failed > 0) ? 1 : 0;
 }
 
 /*--------------------------------------------------------------------
@@ -187,7 +734,7 @@ static int do_rebuild(lr_state *s, unsigned drive_idx)
  *   1  — some files failed
  *  -2  — no live process listening (fall through to offline rebuild)
  *------------------------------------------------------------------*/
-static int try_live_rebuild(const char *sock_path, const char *drive_name)
+static int try_live_rebuild(const char *sock_path, const char *drive_names)
 {
     struct sockaddr_un sa;
     if (strlen(sock_path) >= sizeof(sa.sun_path))
@@ -207,8 +754,8 @@ static int try_live_rebuild(const char *sock_path, const char *drive_name)
     }
 
     /* Send command */
-    char cmd[256];
-    int  n = snprintf(cmd, sizeof(cmd), "rebuild %s\n", drive_name);
+    char cmd[512];
+    int  n = snprintf(cmd, sizeof(cmd), "rebuild %s\n", drive_names);
     if (write(fd, cmd, (size_t)n) != n) {
         close(fd);
         return -2;
@@ -241,33 +788,69 @@ static int try_live_rebuild(const char *sock_path, const char *drive_name)
 }
 
 /*--------------------------------------------------------------------
- * Entry point: parse -c CONFIG -d DRIVE_NAME and run rebuild.
+ * Add the comma-separated drive names in arg to names[], skipping
+ * duplicates.  Returns -1 if more than LR_LEV_MAX are given.
+ *------------------------------------------------------------------*/
+static int add_drive_names(char names[][64], unsigned *count, char *arg)
+{
+    char *save = NULL;
+    for (char *tok = strtok_r(arg, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        int dup = 0;
+        for (unsigned i = 0; i < *count; i++)
+            if (strncmp(names[i], tok, 63) == 0)
+                dup = 1;
+        if (dup)
+            continue;
+        if (*count == LR_LEV_MAX)
+            return -1;
+        snprintf(names[(*count)++], 64, "%s", tok);
+    }
+    return 0;
+}
+
+/*--------------------------------------------------------------------
+ * Entry point: parse -c CONFIG -d DRIVE_NAME[,...] and run rebuild.
  *------------------------------------------------------------------*/
 int cmd_rebuild(int argc, char *argv[])
 {
-    char *config_path = NULL;
-    char *drive_name  = NULL;
-    int   opt;
+    char     *config_path = NULL;
+    char      names[LR_LEV_MAX][64];
+    unsigned  nnames = 0;
+    int       opt;
 
     optind = 1; /* reset getopt state */
     while ((opt = getopt(argc, argv, "c:d:")) != -1) {
         switch (opt) {
         case 'c': config_path = optarg; break;
-        case 'd': drive_name  = optarg; break;
+        case 'd':
+            if (add_drive_names(names, &nnames, optarg) != 0) {
+                fprintf(stderr, "rebuild: at most %d drives at once\n",
+                        LR_LEV_MAX);
+                return 1;
+            }
+            break;
         default:
             fprintf(stderr,
-                    "Usage: liveraid rebuild -c CONFIG -d DRIVE_NAME\n");
+                    "Usage: liveraid rebuild -c CONFIG -d DRIVE_NAME[,DRIVE_NAME...]\n");
             return 1;
         }
     }
 
-    if (!config_path || !drive_name) {
+    if (!config_path || nnames == 0) {
         fprintf(stderr,
                 "rebuild: -c CONFIG and -d DRIVE_NAME are required\n"
-                "Usage: liveraid rebuild -c CONFIG -d DRIVE_NAME\n");
+                "Usage: liveraid rebuild -c CONFIG -d DRIVE_NAME[,DRIVE_NAME...]\n");
         return 1;
     }
 
+    /* Space-separated list for the control socket command */
+    char drive_list[LR_LEV_MAX * 64 + LR_LEV_MAX];
+    size_t dl = 0;
+    for (unsigned i = 0; i < nnames; i++)
+        dl += (size_t)snprintf(drive_list + dl, sizeof(drive_list) - dl,
+                               "%s%s", i ? " " : "", names[i]);
+
     /* Load config */
     lr_config *cfg = calloc(1, sizeof(lr_config));
     if (!cfg) {
@@ -285,7 +868,7 @@ int cmd_rebuild(int argc, char *argv[])
         char sock_path[PATH_MAX + 8];
         snprintf(sock_path, sizeof(sock_path), "%s.ctrl",
                  cfg->content_paths[0]);
-        int lr = try_live_rebuild(sock_path, drive_name);
+        int lr = try_live_rebuild(sock_path, drive_list);
         if (lr >= 0) {
             free(cfg);
             return lr;
@@ -316,20 +899,23 @@ int cmd_rebuild(int argc, char *argv[])
         return 1;
     }
 
-    /* Find drive index */
-    unsigned drive_idx = (unsigned)-1;
-    for (unsigned i = 0; i < s->drive_count; i++) {
-        if (strcmp(s->drives[i].name, drive_name) == 0) {
-            drive_idx = i;
-            break;
+    /* Find drive indices */
+    unsigned drives[LR_LEV_MAX];
+    for (unsigned n = 0; n < nnames; n++) {
+        drives[n] = (unsigned)-1;
+        for (unsigned i = 0; i < s->drive_count; i++) {
+            if (strcmp(s->drives[i].name, names[n]) == 0) {
+                drives[n] = i;
+                break;
+            }
+        }
+        if (drives[n] == (unsigned)-1) {
+            fprintf(stderr, "rebuild: drive '%s' not found in config\n",
+                    names[n]);
+            state_done(s);
+            free(s);
+            return 1;
         }
-    }
-    if (drive_idx == (unsigned)-1) {
-        fprintf(stderr, "rebuild: drive '%s' not found in config\n",
-                drive_name);
-        state_done(s);
-        free(s);
-        return 1;
     }
 
     /* Open parity */
@@ -349,8 +935,38 @@ int cmd_rebuild(int argc, char *argv[])
     }
     s->parity = ph;
 
-    int rc = do_rebuild(s, drive_idx);
+    if (nnames > ph->levels) {
+        fprintf(stderr, "rebuild: %u drives requested but parity can "
+                "recover at most %u\n", nnames, ph->levels);
+        parity_close(ph);
+        free(ph);
+        s->parity = NULL;
+        state_done(s);
+        free(s);
+        return 1;
+    }
 
+    /* Degraded reads touch every surviving drive: batch them if configured */
+    lr_io io;
+    if (io_init(&io, s->cfg.io_engine, s->cfg.io_depth) == 0)
+        s->io = &io;
+
+    /* Spread run recovery over parity_threads workers (no pool scratch:
+     * parity_recover_drives uses its own per-thread vectors) */
+    lr_pool  pool;
+    lr_pool *pp = NULL;
+    if (s->cfg.parity_threads > 1 &&
+        pool_init(&pool, s->cfg.parity_threads, 0, 0) == 0)
+        pp = &pool;
+
+    int rc = do_rebuild(s, pp, drives, nnames);
+
+    if (pp)
+        pool_done(pp);
+    if (s->io) {
+        io_done(s->io);
+        s->io = NULL;
+    }
     parity_close(ph);
     free(ph);
     s->parity = NULL;
@@ -1,13 +1,112 @@
 #ifndef LR_REBUILD_H
 #define LR_REBUILD_H
 
+#include <stdint.h>
+
+struct lr_state;
+struct lr_pool;
+
 /*
  * Entry point for the "liveraid rebuild -c CONFIG -d DRIVE_NAME" subcommand.
- * Reconstructs all files assigned to the named drive from parity, writing
- * them to the drive's configured directory (which must be present and writable).
- * Does not mount FUSE; runs as a standalone offline operation.
+ * Reconstructs all files assigned to the named drives from parity, writing
+ * them to each drive's configured directory (which must be present and
+ * writable).  -d may be repeated or given a comma-separated list; all
+ * drives are rebuilt in one pass over the surviving data.
+ * Connects to a running instance's control socket when there is one,
+ * otherwise runs as a standalone offline operation.
  * Returns 0 if all files were rebuilt successfully, 1 otherwise.
  */
 int cmd_rebuild(int argc, char *argv[]);
 
+/*
+ * Rebuild engine shared by offline and live rebuild.
+ *
+ * The engine rebuilds a fixed set of drives (at most the number of parity
+ * levels) together.  It sweeps the parity positions covered by their
+ * files in windows; each window is split into runs of
+ * parity_recover_run_max() positions recovered on pool (or the calling
+ * thread when NULL) with parity_recover_drives: one large read per
+ * surviving drive and one decode per run for all target drives, with the
+ * state rdlock held for the run.  Recovered runs are copied into a fixed
+ * set of slots and handed to a single writer thread that pwrites each
+ * target file's share, so reads from the survivors overlap writes to the
+ * new drives.  Recovery blocks when every slot is waiting to be written.
+ *
+ * rate_bps (bytes per second of reconstructed data, 0 = unlimited) caps
+ * recovery throughput so a live rebuild leaves bandwidth for FUSE clients.
+ *
+ * progress, if set, is called from the writer thread at most once per
+ * LR_REBUILD_PROGRESS_MS while data is being written.
+ */
+
+#define LR_REBUILD_PROGRESS_MS 1000
+
+typedef struct {
+    uint64_t done_bytes;      /* written so far */
+    uint64_t total_bytes;     /* as given to rebuild_start */
+    uint64_t bytes_per_sec;   /* average since rebuild_start */
+    uint64_t eta_sec;         /* UINT64_MAX until a rate is known */
+} lr_rebuild_progress;
+
+typedef void (*lr_rebuild_progress_fn)(void *arg,
+                                       const lr_rebuild_progress *p);
+
+/* One file to reconstruct (snapshot of its lr_file). */
+typedef struct {
+    char     *vpath;
+    char     *real_path;
+    unsigned  drive;
+    uint32_t  pos_start;
+    uint32_t  block_count;
+    int64_t   size;
+    uint32_t  mode;
+    uint32_t  uid;
+    uint32_t  gid;
+    int64_t   mtime_sec;
+    long      mtime_nsec;
+    int       busy;          /* open at snapshot time: skipped */
+
+    /* Set by rebuild_targets */
+    int       fd;
+    int       failed;
+    int       create_err;    /* errno if the output could not be created */
+    uint32_t  bad_blk;       /* first failed block within the file */
+    int       err;           /* 0 = parity could not recover bad_blk,
+                              * else the errno of the failed write */
+} lr_rebuild_target;
+
+/* rc: 0 rebuilt, 1 skipped (busy, or gone/moved during a live rebuild),
+ * -1 failed (partial output removed). */
+typedef void (*lr_rebuild_done_fn)(void *arg, const lr_rebuild_target *t,
+                                   int rc);
+
+typedef struct lr_rebuild lr_rebuild;
+
+/* Snapshot every file on drives[] into a new target array.  Caller holds
+ * state_lock.  Returns 0 (with *out NULL when there are none) or -1. */
+int  rebuild_collect(struct lr_state *s, const unsigned *drives,
+                     unsigned ndrives, lr_rebuild_target **out,
+                     unsigned *count, uint64_t *bytes);
+void rebuild_free_targets(lr_rebuild_target *t, unsigned count);
+
+/* Start the writer thread.  Returns NULL on failure (including more
+ * drives than parity levels). */
+lr_rebuild *rebuild_start(struct lr_state *s, struct lr_pool *pool,
+                          const unsigned *drives, unsigned ndrives,
+                          uint64_t total_bytes, uint64_t rate_bps,
+                          lr_rebuild_progress_fn progress, void *arg);
+void        rebuild_finish(lr_rebuild *rb);
+
+/*
+ * Reconstruct every target (sorted in place by position).  Each output is
+ * created just before the first window that covers it and finished once
+ * the sweep has passed its last position: closed, then given its mode,
+ * owner and mtime, or unlinked if anything failed.  done is called once
+ * per target from the calling thread.  Returns the number of failures.
+ */
+unsigned rebuild_targets(lr_rebuild *rb, lr_rebuild_target *t, unsigned count,
+                         lr_rebuild_done_fn done, void *arg);
+
+void rebuild_get_progress(lr_rebuild *rb, lr_rebuild_progress *p);
+
 #endif /* LR_REBUILD_H */
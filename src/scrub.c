@@ -0,0 +1,446 @@
+#include "scrub.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Longest sleep while the rolling schedule earns its next slice */
+#define SCRUB_IDLE_MAX_MS 60000
+
+/* End of a pass "to the end of the array"; resolved against the limit
+ * callback by the thread */
+#define SCRUB_END_ALL UINT32_MAX
+
+/* Checkpoint file, host byte order */
+#define SCRUB_CKPT_VERSION 1
+
+typedef struct {
+    uint8_t         magic[4];     /* "LRSC" */
+    uint32_t        version;
+    uint32_t        active;
+    uint32_t        repair;
+    uint32_t        start;
+    uint32_t        cursor;
+    uint32_t        end;
+    lr_scrub_result result;
+    uint32_t        roll_cursor;
+    lr_scrub_result roll_result;
+} scrub_ckpt;
+
+/* ------------------------------------------------------------------ */
+/* Helpers                                                              */
+/* ------------------------------------------------------------------ */
+
+static void result_add(lr_scrub_result *a, const lr_scrub_result *b)
+{
+    a->positions_checked += b->positions_checked;
+    a->parity_mismatches += b->parity_mismatches;
+    a->parity_fixed      += b->parity_fixed;
+    a->read_errors       += b->read_errors;
+}
+
+static void log_result(const char *what, int repair, const lr_scrub_result *r)
+{
+    if (repair)
+        fprintf(stderr,
+                "%s: %u positions checked, "
+                "%u mismatches, %u fixed, %u read errors\n",
+                what, r->positions_checked, r->parity_mismatches,
+                r->parity_fixed, r->read_errors);
+    else
+        fprintf(stderr,
+                "%s: %u positions checked, "
+                "%u parity mismatches, %u read errors\n",
+                what, r->positions_checked, r->parity_mismatches,
+                r->read_errors);
+}
+
+/* Write the checkpoint file (tmp + rename).  Called without sc->lock, only
+ * from the scrub thread or after it has exited. */
+static void save_checkpoint(lr_scrub *sc)
+{
+    char       path[PATH_MAX];
+    scrub_ckpt ck;
+    memset(&ck, 0, sizeof(ck));
+    memcpy(ck.magic, "LRSC", 4);
+    ck.version = SCRUB_CKPT_VERSION;
+
+    pthread_mutex_lock(&sc->lock);
+    snprintf(path, sizeof(path), "%s", sc->path);
+    ck.active      = (uint32_t)sc->active;
+    ck.repair      = (uint32_t)sc->repair;
+    ck.start       = sc->start;
+    ck.cursor      = sc->cursor;
+    ck.end         = sc->end;
+    ck.result      = sc->result;
+    ck.roll_cursor = sc->roll_cursor;
+    ck.roll_result = sc->roll_result;
+    sc->ckpt_ns    = throttle_now_ns();
+    pthread_mutex_unlock(&sc->lock);
+
+    if (path[0] == '\0')
+        return;
+
+    char tmp[PATH_MAX + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return;
+    if (write(fd, &ck, sizeof(ck)) != (ssize_t)sizeof(ck)) {
+        close(fd);
+        unlink(tmp);
+        return;
+    }
+    fsync(fd);
+    close(fd);
+
+    if (rename(tmp, path) != 0) {
+        fprintf(stderr, "scrub: failed to save checkpoint '%s': %s\n",
+                path, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/* Caller holds sc->lock. */
+static void finish_pass(lr_scrub *sc, int stopped)
+{
+    sc->active       = 0;
+    sc->stop         = 0;
+    sc->done_id      = sc->pass_id;
+    sc->done_stopped = stopped;
+    sc->last         = sc->result;
+    if (stopped) {
+        fprintf(stderr, "scrub: pass stopped at position %u\n", sc->cursor);
+    } else {
+        sc->passes++;
+        log_result(sc->repair ? "repair" : "scrub", sc->repair, &sc->result);
+    }
+    pthread_cond_broadcast(&sc->done_cond);
+}
+
+/* ------------------------------------------------------------------ */
+/* Scrub thread                                                         */
+/* ------------------------------------------------------------------ */
+
+/* Next slice of the explicit pass.  Caller holds sc->lock; returns 0 if
+ * the pass has finished or stopped (handled), 1 with *pos and *n set. */
+static int next_pass_slice(lr_scrub *sc, uint32_t *pos, uint32_t *n)
+{
+    pthread_mutex_unlock(&sc->lock);
+    uint32_t limit = sc->limit(sc->arg);
+    pthread_mutex_lock(&sc->lock);
+
+    if (sc->end > limit)
+        sc->end = limit;
+    if (sc->start > sc->end)
+        sc->start = sc->end;
+    if (sc->cursor < sc->start)
+        sc->cursor = sc->start;
+
+    if (sc->stop || sc->cursor >= sc->end) {
+        finish_pass(sc, sc->stop);
+        pthread_mutex_unlock(&sc->lock);
+        save_checkpoint(sc);
+        pthread_mutex_lock(&sc->lock);
+        return 0;
+    }
+    *pos = sc->cursor;
+    *n   = sc->end - sc->cursor < sc->slice ? sc->end - sc->cursor : sc->slice;
+    return 1;
+}
+
+/* Next slice of the rolling schedule.  Caller holds sc->lock; returns 0
+ * after sleeping until more credit is earned, 1 with *pos and *n set. */
+static int next_roll_slice(lr_scrub *sc, uint32_t *pos, uint32_t *n,
+                           uint32_t *limit_out)
+{
+    pthread_mutex_unlock(&sc->lock);
+    uint32_t limit = sc->limit(sc->arg);
+    pthread_mutex_lock(&sc->lock);
+    if (!sc->running || sc->active || sc->daily_pct == 0)
+        return 0;
+
+    uint64_t now = throttle_now_ns();
+    sc->roll_credit += scrub_daily_positions(sc->daily_pct, limit,
+                                             now - sc->roll_last_ns);
+    sc->roll_last_ns = now;
+    if (sc->roll_credit > (double)limit)
+        sc->roll_credit = (double)limit;   /* at most one lap banked */
+    if (sc->roll_cursor >= limit)
+        sc->roll_cursor = 0;               /* the array shrank */
+
+    uint32_t want = limit - sc->roll_cursor < sc->slice
+                        ? limit - sc->roll_cursor : sc->slice;
+    if (limit == 0 || sc->roll_credit < (double)want) {
+        uint64_t ms = SCRUB_IDLE_MAX_MS;
+        double   per_ms = scrub_daily_positions(sc->daily_pct, limit, 1000000);
+        if (limit > 0 && per_ms > 0) {
+            double need = ((double)want - sc->roll_credit) / per_ms;
+            if (need < (double)ms)
+                ms = (uint64_t)need + 1;
+        }
+        struct timespec ts;
+        deadline_after(&ts, ms * 1000000ull);
+        pthread_cond_timedwait(&sc->cond, &sc->lock, &ts);
+        return 0;
+    }
+    *pos       = sc->roll_cursor;
+    *n         = want;
+    *limit_out = limit;
+    return 1;
+}
+
+static void *scrub_thread(void *arg)
+{
+    lr_scrub *sc = (lr_scrub *)arg;
+
+    pthread_mutex_lock(&sc->lock);
+    while (sc->running) {
+        uint32_t pos = 0, n = 0, limit = 0;
+        int      rolling, repair;
+
+        if (sc->active) {
+            if (!next_pass_slice(sc, &pos, &n))
+                continue;
+            rolling = 0;
+            repair  = sc->repair;
+        } else if (sc->daily_pct > 0) {
+            if (!next_roll_slice(sc, &pos, &n, &limit))
+                continue;
+            rolling = 1;
+            repair  = 0;
+        } else {
+            pthread_cond_wait(&sc->cond, &sc->lock);
+            continue;
+        }
+
+        /* Rate cap: wait for this slice's turn, waking early on stop */
+        uint64_t wait = throttle_reserve(&sc->throttle, (uint64_t)n * sc->pos_bytes,
+                                         throttle_now_ns());
+        if (wait > 0) {
+            struct timespec ts;
+            deadline_after(&ts, wait);
+            while (sc->running && !(sc->active && sc->stop) &&
+                   !(rolling && sc->active)) {
+                if (pthread_cond_timedwait(&sc->cond, &sc->lock, &ts) == ETIMEDOUT)
+                    break;
+            }
+            if (!sc->running)
+                break;
+            if (rolling ? (sc->active || sc->daily_pct == 0) : sc->stop)
+                continue;
+        }
+
+        pthread_mutex_unlock(&sc->lock);
+        lr_scrub_result r;
+        memset(&r, 0, sizeof(r));
+        int rc = sc->range(sc->arg, pos, n, repair, &r);
+        pthread_mutex_lock(&sc->lock);
+
+        if (rolling) {
+            result_add(&sc->roll_result, &r);
+            if (rc != 0) {
+                sc->roll_credit = 0;    /* retry once more credit is earned */
+            } else {
+                sc->roll_credit -= n;
+                sc->roll_cursor  = pos + n;
+                if (sc->roll_cursor >= limit) {
+                    log_result("scrub: rolling lap", 0, &sc->roll_result);
+                    sc->roll_cursor = 0;
+                    memset(&sc->roll_result, 0, sizeof(sc->roll_result));
+                }
+            }
+        } else {
+            result_add(&sc->result, &r);
+            sc->cursor = pos + n;
+            if (rc != 0)
+                sc->stop = 1;
+        }
+
+        if (throttle_now_ns() - sc->ckpt_ns >= LR_SCRUB_CHECKPOINT_S * 1000000000ull) {
+            pthread_mutex_unlock(&sc->lock);
+            save_checkpoint(sc);
+            pthread_mutex_lock(&sc->lock);
+        }
+    }
+    pthread_mutex_unlock(&sc->lock);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* Public API                                                           */
+/* ------------------------------------------------------------------ */
+
+int scrub_init(lr_scrub *sc, uint32_t slice, uint64_t pos_bytes,
+               uint64_t rate_bps, lr_scrub_range_fn range,
+               lr_scrub_limit_fn limit, void *arg)
+{
+    memset(sc, 0, sizeof(*sc));
+    sc->slice        = slice > 0 ? slice : 1;
+    sc->pos_bytes    = pos_bytes;
+    sc->range        = range;
+    sc->limit        = limit;
+    sc->arg          = arg;
+    sc->ckpt_ns      = throttle_now_ns();
+    sc->roll_last_ns = sc->ckpt_ns;
+    throttle_init(&sc->throttle, rate_bps);
+
+    if (pthread_mutex_init(&sc->lock, NULL) != 0)
+        goto fail_throttle;
+    if (pthread_cond_init(&sc->cond, NULL) != 0)
+        goto fail_lock;
+    if (pthread_cond_init(&sc->done_cond, NULL) != 0)
+        goto fail_cond;
+
+    sc->running = 1;
+    if (pthread_create(&sc->thread, NULL, scrub_thread, sc) != 0) {
+        sc->running = 0;
+        pthread_cond_destroy(&sc->done_cond);
+        goto fail_cond;
+    }
+    return 0;
+
+fail_cond:
+    pthread_cond_destroy(&sc->cond);
+fail_lock:
+    pthread_mutex_destroy(&sc->lock);
+fail_throttle:
+    throttle_done(&sc->throttle);
+    return -1;
+}
+
+void scrub_done(lr_scrub *sc)
+{
+    pthread_mutex_lock(&sc->lock);
+    sc->running = 0;
+    pthread_cond_broadcast(&sc->cond);
+    pthread_mutex_unlock(&sc->lock);
+    pthread_join(sc->thread, NULL);
+
+    save_checkpoint(sc);
+
+    pthread_cond_destroy(&sc->done_cond);
+    pthread_cond_destroy(&sc->cond);
+    pthread_mutex_destroy(&sc->lock);
+    throttle_done(&sc->throttle);
+    memset(sc, 0, sizeof(*sc));
+}
+
+void scrub_set_checkpoint(lr_scrub *sc, const char *path)
+{
+    scrub_ckpt ck;
+    int        have = 0;
+    int        fd   = open(path, O_RDONLY);
+    if (fd >= 0) {
+        have = read(fd, &ck, sizeof(ck)) == (ssize_t)sizeof(ck) &&
+               memcmp(ck.magic, "LRSC", 4) == 0 &&
+               ck.version == SCRUB_CKPT_VERSION;
+        close(fd);
+    }
+
+    pthread_mutex_lock(&sc->lock);
+    snprintf(sc->path, sizeof(sc->path), "%s", path);
+    if (have) {
+        sc->roll_cursor = ck.roll_cursor;
+        sc->roll_result = ck.roll_result;
+        if (ck.active && !sc->active && ck.cursor < ck.end) {
+            sc->active = 1;
+            sc->repair = ck.repair != 0;
+            sc->start  = ck.start;
+            sc->cursor = ck.cursor;
+            sc->end    = ck.end;
+            sc->result = ck.result;
+            sc->pass_id++;
+            fprintf(stderr, "scrub: resuming %s pass at position %u "
+                            "(range %u-%u)\n",
+                    sc->repair ? "repair" : "scrub",
+                    sc->cursor, sc->start, sc->end);
+        }
+        pthread_cond_signal(&sc->cond);
+    }
+    pthread_mutex_unlock(&sc->lock);
+}
+
+uint64_t scrub_start(lr_scrub *sc, uint32_t start, uint32_t end, int repair)
+{
+    pthread_mutex_lock(&sc->lock);
+    if (sc->active) {
+        pthread_mutex_unlock(&sc->lock);
+        return 0;
+    }
+    sc->active = 1;
+    sc->stop   = 0;
+    sc->repair = repair != 0;
+    sc->start  = start;
+    sc->cursor = start;
+    sc->end    = end > 0 ? end : SCRUB_END_ALL;
+    memset(&sc->result, 0, sizeof(sc->result));
+    uint64_t id = ++sc->pass_id;
+    pthread_cond_signal(&sc->cond);
+    pthread_mutex_unlock(&sc->lock);
+    return id;
+}
+
+int scrub_wait(lr_scrub *sc, uint64_t id, unsigned timeout_ms,
+               lr_scrub_result *out)
+{
+    struct timespec ts;
+    deadline_after(&ts, (uint64_t)timeout_ms * 1000000ull);
+
+    pthread_mutex_lock(&sc->lock);
+    while (sc->done_id < id) {
+        if (pthread_cond_timedwait(&sc->done_cond, &sc->lock, &ts) == ETIMEDOUT) {
+            pthread_mutex_unlock(&sc->lock);
+            return 0;
+        }
+    }
+    if (sc->done_id == id)
+        *out = sc->last;
+    else
+        memset(out, 0, sizeof(*out));
+    int rc = (sc->done_id == id && sc->done_stopped) ? -1 : 1;
+    pthread_mutex_unlock(&sc->lock);
+    return rc;
+}
+
+int scrub_stop(lr_scrub *sc)
+{
+    pthread_mutex_lock(&sc->lock);
+    int had = sc->active;
+    if (had) {
+        sc->stop = 1;
+        pthread_cond_broadcast(&sc->cond);
+    }
+    pthread_mutex_unlock(&sc->lock);
+    return had;
+}
+
+void scrub_set_daily(lr_scrub *sc, unsigned pct)
+{
+    pthread_mutex_lock(&sc->lock);
+    if (sc->daily_pct == 0)
+        sc->roll_last_ns = throttle_now_ns();   /* no credit for time off */
+    sc->daily_pct = pct;
+    pthread_cond_broadcast(&sc->cond);
+    pthread_mutex_unlock(&sc->lock);
+}
+
+void scrub_get_status(lr_scrub *sc, lr_scrub_status *st)
+{
+    pthread_mutex_lock(&sc->lock);
+    st->id          = sc->pass_id;
+    st->active      = sc->active;
+    st->repair      = sc->repair;
+    st->start       = sc->start;
+    st->cursor      = sc->cursor;
+    st->end         = sc->end;
+    st->result      = sc->result;
+    st->daily_pct   = sc->daily_pct;
+    st->roll_cursor = sc->roll_cursor;
+    st->passes      = sc->passes;
+    pthread_mutex_unlock(&sc->lock);
+}
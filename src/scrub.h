@@ -0,0 +1,139 @@
+#ifndef LR_SCRUB_H
+#define LR_SCRUB_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <limits.h>
+
+#include "throttle.h"
+
+/*
+ * Background scrub scheduler.
+ *
+ * A scrub pass verifies (or with repair, rewrites) parity over a range of
+ * positions.  Passes run on a dedicated thread in slices of a bounded
+ * number of positions, so the journal's drains get the parity pool
+ * between slices instead of waiting for a whole pass.  An optional rate
+ * cap (bytes read per second) spaces the slices out.
+ *
+ * Progress is checkpointed to a small file: a pass interrupted by an
+ * unmount or a crash resumes from its last checkpoint on the next mount,
+ * keeping the counts gathered so far.
+ *
+ * Without an explicit pass the thread can run a rolling schedule: it
+ * verifies daily_pct percent of the array per day, advancing a persistent
+ * cursor that wraps at the end of the array.
+ *
+ * The scheduler does not know how to check parity: the range callback
+ * given to scrub_init does the work and the limit callback returns the
+ * current end of the position space.
+ */
+
+#define LR_SCRUB_SLICE_BYTES  (64u << 20) /* per drive, one slice */
+#define LR_SCRUB_CHECKPOINT_S 10          /* seconds between checkpoints */
+
+typedef struct {
+    uint32_t positions_checked;
+    uint32_t parity_mismatches;
+    uint32_t parity_fixed;
+    uint32_t read_errors;
+} lr_scrub_result;
+
+/* Check [pos, pos+count) and add to *r.  Returns 0, or -1 to abort. */
+typedef int      (*lr_scrub_range_fn)(void *arg, uint32_t pos, uint32_t count,
+                                      int repair, lr_scrub_result *r);
+typedef uint32_t (*lr_scrub_limit_fn)(void *arg);
+
+typedef struct {
+    uint64_t        id;          /* current or last pass */
+    int             active;      /* an explicit pass is running */
+    int             repair;
+    uint32_t        start;
+    uint32_t        cursor;      /* next position to check */
+    uint32_t        end;
+    lr_scrub_result result;      /* so far in this pass */
+    unsigned        daily_pct;   /* rolling schedule; 0 = off */
+    uint32_t        roll_cursor;
+    uint64_t        passes;      /* passes finished since scrub_init */
+} lr_scrub_status;
+
+typedef struct lr_scrub {
+    pthread_mutex_t   lock;
+    pthread_cond_t    cond;       /* wakes the thread */
+    pthread_cond_t    done_cond;  /* a pass finished or stopped */
+    pthread_t         thread;
+    int               running;
+
+    lr_scrub_range_fn range;
+    lr_scrub_limit_fn limit;
+    void             *arg;
+    uint32_t          slice;      /* positions per slice */
+    uint64_t          pos_bytes;  /* bytes read per position, for the cap */
+    lr_throttle       throttle;
+    char              path[PATH_MAX]; /* checkpoint file; "" = none */
+    uint64_t          ckpt_ns;    /* time of the last checkpoint */
+
+    /* Explicit pass */
+    int               active;
+    int               repair;
+    int               stop;       /* cancel requested */
+    uint32_t          start;
+    uint32_t          cursor;
+    uint32_t          end;
+    lr_scrub_result   result;
+    uint64_t          pass_id;    /* last pass started */
+    uint64_t          done_id;    /* last pass finished or stopped */
+    int               done_stopped;
+    lr_scrub_result   last;       /* result of pass done_id */
+    uint64_t          passes;
+
+    /* Rolling schedule */
+    unsigned          daily_pct;
+    uint32_t          roll_cursor;
+    lr_scrub_result   roll_result; /* since the cursor last wrapped */
+    double            roll_credit; /* positions earned, not yet checked */
+    uint64_t          roll_last_ns;
+} lr_scrub;
+
+/* Start the scrub thread.  slice is the number of positions checked per
+ * slice, pos_bytes the bytes one position reads (for rate_bps, 0 =
+ * unlimited).  Returns 0 or -1. */
+int  scrub_init(lr_scrub *sc, uint32_t slice, uint64_t pos_bytes,
+                uint64_t rate_bps, lr_scrub_range_fn range,
+                lr_scrub_limit_fn limit, void *arg);
+
+/* Stop the thread (between slices) and checkpoint; an unfinished pass
+ * resumes at the next scrub_set_checkpoint with the same file. */
+void scrub_done(lr_scrub *sc);
+
+/* Set the checkpoint file and resume any pass or rolling cursor saved in
+ * it.  Call once, after scrub_init. */
+void scrub_set_checkpoint(lr_scrub *sc, const char *path);
+
+/* Start a pass over [start, end); end 0 = the whole array.  Returns the
+ * pass id, or 0 if a pass is already running. */
+uint64_t scrub_start(lr_scrub *sc, uint32_t start, uint32_t end, int repair);
+
+/* Wait up to timeout_ms for pass id.  Returns 1 when it finished (*out =
+ * its result), -1 if it was stopped (*out = partial result), 0 on
+ * timeout. */
+int  scrub_wait(lr_scrub *sc, uint64_t id, unsigned timeout_ms,
+                lr_scrub_result *out);
+
+/* Cancel the running pass.  Returns 1 if there was one. */
+int  scrub_stop(lr_scrub *sc);
+
+/* Change the rolling schedule (percent of the array per day, 0 = off). */
+void scrub_set_daily(lr_scrub *sc, unsigned pct);
+
+void scrub_get_status(lr_scrub *sc, lr_scrub_status *st);
+
+/* Positions a rolling schedule of pct percent per day earns in
+ * elapsed_ns over a position space of limit. */
+static inline double scrub_daily_positions(unsigned pct, uint32_t limit,
+                                           uint64_t elapsed_ns)
+{
+    return (double)limit * pct / 100.0 * (double)elapsed_ns / 86400e9;
+}
+
+#endif /* LR_SCRUB_H */
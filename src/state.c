@@ -5,10 +5,18 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <time.h>
+#include <sys/stat.h>
 #include <sys/statvfs.h>
 
 lr_state *g_state = NULL;
 
+static lr_dnode *dnode_new(const char *name, size_t len);
+static void      dnode_free_tree(lr_dnode *n);
+static lr_dnode *dnode_walk(lr_state *s, const char *vpath, size_t len,
+                            int create);
+static void      dnode_prune(lr_state *s, lr_dnode *n);
+static size_t    parent_len(const char *vpath);
+
 static pthread_once_t s_rng_once = PTHREAD_ONCE_INIT;
 static void s_seed_rng(void) { srandom((unsigned int)time(NULL)); }
 
@@ -19,10 +27,17 @@ int state_init(lr_state *s, const lr_config *cfg)
     memset(s, 0, sizeof(*s));
     s->cfg = *cfg;
 
-    for (i = 0; i < cfg->drive_count; i++) {
+    s->drive_count = cfg->drive_count;
+    s->cache_drive = LR_NO_CACHE;
+    if (cfg->cache.name[0] != '\0' && cfg->drive_count < LR_DRIVE_MAX)
+        s->cache_drive = cfg->drive_count;
+
+    for (i = 0; i < state_drive_slots(s); i++) {
+        const lr_drive_conf *dc = i < cfg->drive_count ? &cfg->drives[i]
+                                                       : &cfg->cache;
         lr_drive *d = &s->drives[i];
-        snprintf(d->name, sizeof(d->name), "%s", cfg->drives[i].name);
-        snprintf(d->dir,  sizeof(d->dir),  "%s", cfg->drives[i].dir);
+        snprintf(d->name, sizeof(d->name), "%s", dc->name);
+        snprintf(d->dir,  sizeof(d->dir),  "%s", dc->dir);
         size_t len = strlen(d->dir);
         if (len > 0 && d->dir[len-1] != '/') {
             if (len + 1 < PATH_MAX) {
@@ -33,21 +48,32 @@ int state_init(lr_state *s, const lr_config *cfg)
         d->idx = i;
         alloc_init(&d->pos_alloc);
     }
-    s->drive_count = cfg->drive_count;
 
     lr_hash_init(&s->file_table);
     lr_list_init(&s->file_list);
+    lr_list_init(&s->cache_files);
 
     lr_hash_init(&s->dir_table);
     lr_list_init(&s->dir_list);
 
     lr_hash_init(&s->symlink_table);
     lr_list_init(&s->symlink_list);
+    lr_list_init(&s->log_dirty);
+
+    strpool_init(&s->paths);
+
+    s->root = dnode_new("", 0);
+    if (!s->root) {
+        fprintf(stderr, "state_init: out of memory\n");
+        return -1;
+    }
 
     if (pthread_rwlock_init(&s->state_lock, NULL) != 0) {
         fprintf(stderr, "state_init: rwlock_init failed\n");
         return -1;
     }
+    for (i = 0; i < LR_DRIVE_MAX; i++)
+        pthread_mutex_init(&s->drives[i].lock, NULL);
 
     return 0;
 }
@@ -83,23 +109,93 @@ void state_done(lr_state *s)
     }
     lr_hash_done(&s->symlink_table);
 
-    for (i = 0; i < s->drive_count; i++)
+    if (s->root)
+        dnode_free_tree(s->root);
+
+    /* The records' strings go with the pool */
+    strpool_done(&s->paths);
+
+    for (i = 0; i < state_drive_slots(s); i++)
         alloc_done(&s->drives[i].pos_alloc);
 
     for (i = 0; i < LR_DRIVE_MAX; i++) {
         free(s->pos_index[i]);
-        s->pos_index[i] = NULL;
+        s->pos_index[i]       = NULL;
+        s->pos_index_count[i] = 0;
+        s->pos_index_cap[i]   = 0;
     }
 
+    for (i = 0; i < LR_DRIVE_MAX; i++)
+        pthread_mutex_destroy(&s->drives[i].lock);
     pthread_rwlock_destroy(&s->state_lock);
     memset(s, 0, sizeof(*s));
 }
 
+/* ------------------------------------------------------------------ */
+/* Record strings                                                       */
+/* ------------------------------------------------------------------ */
+
+int state_set_path(lr_state *s, const char **field, const char *str)
+{
+    const char *copy = strpool_dup(&s->paths, str);
+    if (!copy)
+        return -1;
+    strpool_free(&s->paths, *field);
+    *field = copy;
+    return 0;
+}
+
+void state_free_file(lr_state *s, lr_file *f)
+{
+    if (!f)
+        return;
+    strpool_free(&s->paths, f->vpath);
+    free(f);
+}
+
+void state_free_dir(lr_state *s, lr_dir *d)
+{
+    if (!d)
+        return;
+    strpool_free(&s->paths, d->vpath);
+    free(d);
+}
+
+void state_free_symlink(lr_state *s, lr_symlink *sl)
+{
+    if (!sl)
+        return;
+    strpool_free(&s->paths, sl->vpath);
+    strpool_free(&s->paths, sl->target);
+    free(sl);
+}
+
+char *state_real_path(const lr_state *s, const lr_file *f,
+                      char *buf, size_t size)
+{
+    const char *rel = f->vpath[0] == '/' ? f->vpath + 1 : f->vpath;
+    snprintf(buf, size, "%s%s", s->drives[f->drive_idx].dir, rel);
+    return buf;
+}
+
+/* ------------------------------------------------------------------ */
+/* File table                                                           */
+/* ------------------------------------------------------------------ */
+
 void state_insert_file(lr_state *s, lr_file *f)
 {
     uint32_t h = lr_hash_string(f->vpath);
     lr_hash_insert(&s->file_table, &f->vpath_node, f, h);
     lr_list_insert_tail(&s->file_list, &f->list_node, f);
+    if (state_is_cache(s, f->drive_idx))
+        lr_list_insert_tail(&s->cache_files, &f->cache_node, f);
+
+    f->parent = dnode_walk(s, f->vpath, parent_len(f->vpath), 1);
+    if (f->parent)
+        lr_list_insert_tail(&f->parent->files, &f->tree_node, f);
+    else
+        fprintf(stderr, "state: out of memory adding %s to the tree\n",
+                f->vpath);
 }
 
 static int find_compare(const void *arg, const void *obj)
@@ -122,6 +218,17 @@ lr_file *state_remove_file(lr_state *s, const char *vpath)
         return NULL;
     lr_hash_remove(&s->file_table, &f->vpath_node);
     lr_list_remove(&s->file_list, &f->list_node);
+    if (state_is_cache(s, f->drive_idx))
+        lr_list_remove(&s->cache_files, &f->cache_node);
+    if (f->parent) {
+        lr_list_remove(&f->parent->files, &f->tree_node);
+        dnode_prune(s, f->parent);
+        f->parent = NULL;
+    }
+    if (f->log_dirty) {
+        lr_list_remove(&s->log_dirty, &f->log_node);
+        f->log_dirty = 0;
+    }
     return f;
 }
 
@@ -141,6 +248,10 @@ void state_insert_dir(lr_state *s, lr_dir *d)
     uint32_t h = lr_hash_string(d->vpath);
     lr_hash_insert(&s->dir_table, &d->vpath_node, d, h);
     lr_list_insert_tail(&s->dir_list, &d->list_node, d);
+
+    d->node = dnode_walk(s, d->vpath, strlen(d->vpath), 1);
+    if (d->node)
+        d->node->dir = d;
 }
 
 lr_dir *state_find_dir(lr_state *s, const char *vpath)
@@ -156,6 +267,12 @@ lr_dir *state_remove_dir(lr_state *s, const char *vpath)
         return NULL;
     lr_hash_remove(&s->dir_table, &d->vpath_node);
     lr_list_remove(&s->dir_list, &d->list_node);
+    if (d->node) {
+        if (d->node->dir == d)
+            d->node->dir = NULL;
+        dnode_prune(s, d->node);
+        d->node = NULL;
+    }
     return d;
 }
 
@@ -175,6 +292,10 @@ void state_insert_symlink(lr_state *s, lr_symlink *sl)
     uint32_t h = lr_hash_string(sl->vpath);
     lr_hash_insert(&s->symlink_table, &sl->vpath_node, sl, h);
     lr_list_insert_tail(&s->symlink_list, &sl->list_node, sl);
+
+    sl->parent = dnode_walk(s, sl->vpath, parent_len(sl->vpath), 1);
+    if (sl->parent)
+        lr_list_insert_tail(&sl->parent->symlinks, &sl->tree_node, sl);
 }
 
 lr_symlink *state_find_symlink(lr_state *s, const char *vpath)
@@ -191,10 +312,403 @@ lr_symlink *state_remove_symlink(lr_state *s, const char *vpath)
         return NULL;
     lr_hash_remove(&s->symlink_table, &sl->vpath_node);
     lr_list_remove(&s->symlink_list, &sl->list_node);
+    if (sl->parent) {
+        lr_list_remove(&sl->parent->symlinks, &sl->tree_node);
+        dnode_prune(s, sl->parent);
+        sl->parent = NULL;
+    }
     return sl;
 }
 
-unsigned state_pick_drive(lr_state *s)
+/* ------------------------------------------------------------------ */
+/* Directory tree                                                       */
+/* ------------------------------------------------------------------ */
+
+/*
+ * The tree is an index over the three tables, maintained by their insert
+ * and remove functions: each node lists the files and symlinks directly
+ * inside it and hashes its subdirectories by name.  A path names a
+ * directory exactly when the walk from the root finds its node.
+ */
+
+static lr_dnode *dnode_new(const char *name, size_t len)
+{
+    lr_dnode *n = calloc(1, sizeof(lr_dnode) + len + 1);
+    if (!n)
+        return NULL;
+    memcpy(n->name, name, len);
+    n->name[len] = '\0';
+    lr_hash_init(&n->subdir_table);
+    if (!n->subdir_table.buckets) {
+        free(n);
+        return NULL;
+    }
+    lr_list_init(&n->subdirs);
+    lr_list_init(&n->files);
+    lr_list_init(&n->symlinks);
+    return n;
+}
+
+static void dnode_free(lr_dnode *n)
+{
+    lr_hash_done(&n->subdir_table);
+    free(n);
+}
+
+/* Free n and every node below it (not the records they point at). */
+static void dnode_free_tree(lr_dnode *n)
+{
+    lr_list_node *ln = lr_list_head(&n->subdirs);
+    while (ln) {
+        lr_list_node *next = ln->next;
+        dnode_free_tree((lr_dnode *)ln->data);
+        ln = next;
+    }
+    dnode_free(n);
+}
+
+typedef struct {
+    const char *name;
+    size_t      len;
+} dnode_key;
+
+static int dnode_name_compare(const void *arg, const void *obj)
+{
+    const dnode_key *k = (const dnode_key *)arg;
+    const lr_dnode  *n = (const lr_dnode *)obj;
+    return !(strncmp(n->name, k->name, k->len) == 0 &&
+             n->name[k->len] == '\0');
+}
+
+static lr_dnode *dnode_child_n(lr_dnode *n, const char *name, size_t len)
+{
+    dnode_key k = { name, len };
+    return (lr_dnode *)lr_hash_search(&n->subdir_table,
+                                      lr_hash_bytes(name, len),
+                                      dnode_name_compare, &k);
+}
+
+lr_dnode *state_dnode_child(lr_dnode *n, const char *name)
+{
+    return dnode_child_n(n, name, strlen(name));
+}
+
+static void dnode_attach(lr_dnode *parent, lr_dnode *n)
+{
+    n->parent = parent;
+    lr_hash_insert(&parent->subdir_table, &n->name_node, n,
+                   lr_hash_string(n->name));
+    lr_list_insert_tail(&parent->subdirs, &n->list_node, n);
+}
+
+static void dnode_detach(lr_dnode *n)
+{
+    lr_hash_remove(&n->parent->subdir_table, &n->name_node);
+    lr_list_remove(&n->parent->subdirs, &n->list_node);
+    n->parent = NULL;
+}
+
+static int dnode_empty(const lr_dnode *n)
+{
+    return n->subdirs.count == 0 && n->files.count == 0 &&
+           n->symlinks.count == 0 && !n->dir;
+}
+
+/* Free n and then its ancestors for as long as they hold nothing. */
+static void dnode_prune(lr_state *s, lr_dnode *n)
+{
+    while (n && n != s->root && dnode_empty(n)) {
+        lr_dnode *p = n->parent;
+        dnode_detach(n);
+        dnode_free(n);
+        n = p;
+    }
+}
+
+/* Node for the directory named by the first len bytes of vpath, creating
+ * missing nodes when create.  NULL if absent or out of memory. */
+static lr_dnode *dnode_walk(lr_state *s, const char *vpath, size_t len,
+                            int create)
+{
+    lr_dnode *n = s->root;
+    size_t    i = 0;
+    while (i < len) {
+        while (i < len && vpath[i] == '/')
+            i++;
+        size_t j = i;
+        while (j < len && vpath[j] != '/')
+            j++;
+        if (j == i)
+            break;
+        lr_dnode *c = dnode_child_n(n, vpath + i, j - i);
+        if (!c) {
+            if (!create)
+                return NULL;
+            c = dnode_new(vpath + i, j - i);
+            if (!c) {
+                dnode_prune(s, n);
+                return NULL;
+            }
+            dnode_attach(n, c);
+        }
+        n = c;
+        i = j;
+    }
+    return n;
+}
+
+/* Length of vpath's parent directory ("/a/b" -> 2, "/b" -> 0). */
+static size_t parent_len(const char *vpath)
+{
+    const char *slash = strrchr(vpath, '/');
+    return slash ? (size_t)(slash - vpath) : 0;
+}
+
+lr_dnode *state_find_dnode(lr_state *s, const char *vpath)
+{
+    return dnode_walk(s, vpath, strlen(vpath), 0);
+}
+
+/* Replace the first from_len bytes of every vpath below n with to.
+ * Returns -1 if a new string cannot be allocated (the entry keeps its
+ * old path). */
+static int dnode_rekey(lr_state *s, lr_dnode *n, size_t from_len,
+                       const char *to)
+{
+    char buf[PATH_MAX];
+    lr_list_node *ln;
+    int rc = 0;
+
+    for (ln = lr_list_head(&n->files); ln; ln = ln->next) {
+        lr_file *f = (lr_file *)ln->data;
+        snprintf(buf, sizeof(buf), "%s%s", to, f->vpath + from_len);
+        lr_hash_remove(&s->file_table, &f->vpath_node);
+        if (state_set_path(s, &f->vpath, buf) != 0)
+            rc = -1;
+        lr_hash_insert(&s->file_table, &f->vpath_node, f,
+                       lr_hash_string(f->vpath));
+    }
+    for (ln = lr_list_head(&n->symlinks); ln; ln = ln->next) {
+        lr_symlink *sl = (lr_symlink *)ln->data;
+        snprintf(buf, sizeof(buf), "%s%s", to, sl->vpath + from_len);
+        lr_hash_remove(&s->symlink_table, &sl->vpath_node);
+        if (state_set_path(s, &sl->vpath, buf) != 0)
+            rc = -1;
+        lr_hash_insert(&s->symlink_table, &sl->vpath_node, sl,
+                       lr_hash_string(sl->vpath));
+    }
+    if (n->dir) {
+        lr_dir *d = n->dir;
+        snprintf(buf, sizeof(buf), "%s%s", to, d->vpath + from_len);
+        lr_hash_remove(&s->dir_table, &d->vpath_node);
+        if (state_set_path(s, &d->vpath, buf) != 0)
+            rc = -1;
+        lr_hash_insert(&s->dir_table, &d->vpath_node, d,
+                       lr_hash_string(d->vpath));
+    }
+    for (ln = lr_list_head(&n->subdirs); ln; ln = ln->next)
+        if (dnode_rekey(s, (lr_dnode *)ln->data, from_len, to) != 0)
+            rc = -1;
+    return rc;
+}
+
+/* Move everything in src (already detached) into dst and free src.  A
+ * record of src's replaces dst's own. */
+static void dnode_merge(lr_state *s, lr_dnode *dst, lr_dnode *src)
+{
+    lr_list_node *ln;
+
+    while ((ln = lr_list_head(&src->files)) != NULL) {
+        lr_file *f = (lr_file *)ln->data;
+        lr_list_remove(&src->files, ln);
+        lr_list_insert_tail(&dst->files, &f->tree_node, f);
+        f->parent = dst;
+    }
+    while ((ln = lr_list_head(&src->symlinks)) != NULL) {
+        lr_symlink *sl = (lr_symlink *)ln->data;
+        lr_list_remove(&src->symlinks, ln);
+        lr_list_insert_tail(&dst->symlinks, &sl->tree_node, sl);
+        sl->parent = dst;
+    }
+    if (src->dir) {
+        lr_dir *old = dst->dir;
+        if (old) {
+            lr_hash_remove(&s->dir_table, &old->vpath_node);
+            lr_list_remove(&s->dir_list, &old->list_node);
+            state_free_dir(s, old);
+        }
+        dst->dir       = src->dir;
+        dst->dir->node = dst;
+        src->dir       = NULL;
+    }
+    while ((ln = lr_list_head(&src->subdirs)) != NULL) {
+        lr_dnode *c = (lr_dnode *)ln->data;
+        dnode_detach(c);
+        lr_dnode *same = state_dnode_child(dst, c->name);
+        if (same)
+            dnode_merge(s, same, c);
+        else
+            dnode_attach(dst, c);
+    }
+    dnode_free(src);
+}
+
+int state_rename_dir(lr_state *s, const char *from, const char *to)
+{
+    size_t from_len = strlen(from);
+    if (strcmp(from, to) == 0)
+        return 0;
+    if (strncmp(to, from, from_len) == 0 && to[from_len] == '/')
+        return -1;
+
+    lr_dnode *src = state_find_dnode(s, from);
+    if (!src)
+        return 0;
+    if (src == s->root)
+        return -1;
+
+    size_t      plen   = parent_len(to);
+    const char *name   = to + plen + 1;
+    lr_dnode   *parent = dnode_walk(s, to, plen, 1);
+    if (!parent)
+        return -1;
+    lr_dnode *dst = state_dnode_child(parent, name);
+    lr_dnode *fresh = NULL;
+    if (!dst && strcmp(src->name, name) != 0) {
+        /* The name is stored inline: move the children to a new node */
+        fresh = dnode_new(name, strlen(name));
+        if (!fresh) {
+            dnode_prune(s, parent);
+            return -1;
+        }
+    }
+
+    int rc = dnode_rekey(s, src, from_len, to);
+
+    lr_dnode *old_parent = src->parent;
+    dnode_detach(src);
+    if (dst) {
+        dnode_merge(s, dst, src);
+    } else if (fresh) {
+        dnode_attach(parent, fresh);
+        dnode_merge(s, fresh, src);
+    } else {
+        dnode_attach(parent, src);
+    }
+    dnode_prune(s, old_parent);
+    return rc;
+}
+
+/* ------------------------------------------------------------------ */
+/* Attributes                                                           */
+/* ------------------------------------------------------------------ */
+
+static void stat_times(struct stat *st, time_t sec, long nsec)
+{
+    st->st_mtim.tv_sec  = sec;
+    st->st_mtim.tv_nsec = nsec;
+    st->st_atim = st->st_mtim;
+    st->st_ctim = st->st_mtim;
+}
+
+void state_stat_file(lr_state *s, const lr_file *f, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode    = f->mode ? f->mode : (S_IFREG | 0644);
+    st->st_nlink   = 1;
+    st->st_uid     = f->uid;
+    st->st_gid     = f->gid;
+    st->st_blksize = (blksize_t)s->cfg.block_size;
+
+    state_lock_drive(s, f->drive_idx);
+    st->st_size = (off_t)f->size;
+    stat_times(st, f->mtime_sec, f->mtime_nsec);
+    state_unlock_drive(s, f->drive_idx);
+
+    st->st_blocks = (blkcnt_t)((st->st_size + 511) / 512);
+}
+
+void state_stat_dir(const lr_dir *d, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode  = S_IFDIR | (d->mode & 07777);
+    st->st_nlink = 2;
+    st->st_uid   = d->uid;
+    st->st_gid   = d->gid;
+    stat_times(st, d->mtime_sec, d->mtime_nsec);
+}
+
+void state_stat_symlink(const lr_symlink *sl, struct stat *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->st_mode  = S_IFLNK | 0777;
+    st->st_nlink = 1;
+    st->st_size  = (off_t)strlen(sl->target);
+    st->st_uid   = sl->uid;
+    st->st_gid   = sl->gid;
+    stat_times(st, sl->mtime_sec, sl->mtime_nsec);
+}
+
+int state_touch_file(lr_file *f)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int changed = ts.tv_sec != f->mtime_sec;
+    f->mtime_sec  = ts.tv_sec;
+    f->mtime_nsec = ts.tv_nsec;
+    return changed;
+}
+
+/* ------------------------------------------------------------------ */
+/* Drive selection                                                      */
+/* ------------------------------------------------------------------ */
+
+static time_t mono_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+void state_refresh_free(lr_state *s)
+{
+    for (unsigned i = 0; i < state_drive_slots(s); i++) {
+        struct statvfs sv;
+        int64_t  avail = 0;
+        uint64_t total = 0;
+        if (statvfs(s->drives[i].dir, &sv) == 0) {
+            avail = (int64_t)((uint64_t)sv.f_bavail * sv.f_frsize);
+            total = (uint64_t)sv.f_blocks * sv.f_frsize;
+        }
+        __atomic_store_n(&s->drives[i].free_bytes, avail, __ATOMIC_RELAXED);
+        s->drives[i].total_bytes = total;
+    }
+    /* +1 so a refresh in the clock's first second still counts */
+    s->free_refreshed = mono_sec() + 1;
+}
+
+static void refresh_free_if_stale(lr_state *s)
+{
+    uint64_t now = (uint64_t)mono_sec();
+    if (s->free_refreshed == 0 ||
+        now >= (uint64_t)s->free_refreshed + LR_FREE_REFRESH_S)
+        state_refresh_free(s);
+}
+
+/* Drive whose newest file sits closest to vpath's directory, or
+ * UINT32_MAX.  The root's files do not count: everything is below it. */
+static unsigned dirlocal_drive(lr_state *s, const char *vpath)
+{
+    lr_dnode *n = dnode_walk(s, vpath, parent_len(vpath), 0);
+    for (; n && n != s->root; n = n->parent) {
+        lr_list_node *tail = n->files.tail;
+        if (tail)
+            return ((const lr_file *)tail->data)->drive_idx;
+    }
+    return UINT32_MAX;
+}
+
+unsigned state_pick_drive(lr_state *s, const char *vpath)
 {
     unsigned i, best = 0;
 
@@ -207,12 +721,23 @@ unsigned state_pick_drive(lr_state *s)
         return idx;
     }
 
-    /* Gather free-space stats used by mostfree, lfs, and pfrd */
+    /* Free space used by mostfree, lfs, pfrd and dirlocal: cached, so a
+     * create does not statvfs (and wake) every drive */
+    refresh_free_if_stale(s);
     uint64_t free_bytes[LR_DRIVE_MAX];
     for (i = 0; i < s->drive_count; i++) {
-        struct statvfs sv;
-        free_bytes[i] = (statvfs(s->drives[i].dir, &sv) == 0)
-                        ? (uint64_t)sv.f_bavail * sv.f_frsize : 0;
+        int64_t f = __atomic_load_n(&s->drives[i].free_bytes, __ATOMIC_RELAXED);
+        free_bytes[i] = f > 0 ? (uint64_t)f : 0;
+    }
+
+    if (s->cfg.placement_policy == LR_PLACE_DIRLOCAL && vpath) {
+        /* Siblings' drive while it has room; mostfree for a new
+         * directory or a drive that is filling up */
+        unsigned d = dirlocal_drive(s, vpath);
+        if (d < s->drive_count && free_bytes[d] > 0 &&
+            free_bytes[d] >= s->drives[d].total_bytes / 100 *
+                             LR_DIRLOCAL_RESERVE_PCT)
+            return d;
     }
 
     if (s->cfg.placement_policy == LR_PLACE_LFS) {
@@ -249,7 +774,7 @@ unsigned state_pick_drive(lr_state *s)
         return s->drive_count - 1; /* rounding fallback */
     }
 
-    /* MOSTFREE (default): pick drive with most free space */
+    /* MOSTFREE (default, and dirlocal's fallback): most free space */
     uint64_t best_free = 0;
     for (i = 0; i < s->drive_count; i++) {
         if (free_bytes[i] > best_free) {
@@ -260,10 +785,100 @@ unsigned state_pick_drive(lr_state *s)
     return best;
 }
 
+/* ------------------------------------------------------------------ */
+/* Cache tier                                                           */
+/* ------------------------------------------------------------------ */
+
+unsigned state_find_drive(const lr_state *s, const char *name)
+{
+    for (unsigned i = 0; i < state_drive_slots(s); i++)
+        if (strcmp(s->drives[i].name, name) == 0)
+            return i;
+    return UINT32_MAX;
+}
+
+int state_cache_has_room(lr_state *s)
+{
+    if (s->cache_drive == LR_NO_CACHE)
+        return 0;
+    refresh_free_if_stale(s);
+    const lr_drive *c = &s->drives[s->cache_drive];
+    int64_t free_bytes = __atomic_load_n(&c->free_bytes, __ATOMIC_RELAXED);
+    return free_bytes > 0 &&
+           (uint64_t)free_bytes >= c->total_bytes / 100 * LR_CACHE_RESERVE_PCT;
+}
+
+void state_set_file_drive(lr_state *s, lr_file *f, unsigned drive_idx)
+{
+    if (state_is_cache(s, f->drive_idx))
+        lr_list_remove(&s->cache_files, &f->cache_node);
+    f->drive_idx = drive_idx;
+    if (state_is_cache(s, drive_idx))
+        lr_list_insert_tail(&s->cache_files, &f->cache_node, f);
+}
+
+/* Mode for the missing directory vpath on drive_idx: that of the first
+ * other drive that has it */
+static mode_t parent_mode(lr_state *s, unsigned drive_idx, const char *vpath)
+{
+    for (unsigned i = 0; i < state_drive_slots(s); i++) {
+        if (i == drive_idx)
+            continue;
+        char        other[PATH_MAX];
+        struct stat st;
+        snprintf(other, sizeof(other), "%s%s", s->drives[i].dir, vpath + 1);
+        if (lstat(other, &st) == 0 && S_ISDIR(st.st_mode))
+            return st.st_mode & 07777;
+    }
+    return 0755;
+}
+
+void state_make_parents(lr_state *s, unsigned drive_idx, const char *real_path)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s", real_path);
+
+    char *slash = strrchr(tmp, '/');
+    if (!slash || slash == tmp)
+        return;
+    *slash = '\0'; /* tmp is now the parent directory real path */
+
+    /* Strip the drive prefix to recover each component's vpath */
+    size_t drive_dir_len = strlen(s->drives[drive_idx].dir);
+    if (strlen(tmp) < drive_dir_len)
+        return;
+
+    /* Walk from left, creating each missing component, then the leaf */
+    for (char *p = tmp + drive_dir_len; ; p++) {
+        if (*p != '/' && *p != '\0')
+            continue;
+        char c = *p;
+        *p = '\0';
+        struct stat st;
+        if (tmp[drive_dir_len] != '\0' && lstat(tmp, &st) != 0) {
+            char vpath[PATH_MAX];
+            snprintf(vpath, sizeof(vpath), "/%s", tmp + drive_dir_len);
+            mkdir(tmp, parent_mode(s, drive_idx, vpath));
+        }
+        *p = c;
+        if (c == '\0')
+            break;
+    }
+}
+
 /* ------------------------------------------------------------------ */
 /* Position index                                                       */
 /* ------------------------------------------------------------------ */
 
+/*
+ * Each drive's index is an array sorted by pos_start holding only files
+ * that own positions (block_count > 0), so the ranges are disjoint.  It
+ * is kept up to date in place: a lookup is a binary search, a resize that
+ * keeps its start rewrites one entry, and an insert or remove shifts the
+ * tail with one memmove.  Most inserts land at the tail, since new
+ * positions come from the top of the drive's namespace.
+ */
+
 static int pos_entry_cmp(const void *a, const void *b)
 {
     const lr_pos_entry *pa = (const lr_pos_entry *)a;
@@ -273,33 +888,128 @@ static int pos_entry_cmp(const void *a, const void *b)
     return 0;
 }
 
+/* First entry with pos_start >= pos. */
+static uint32_t pos_index_lower(const lr_pos_entry *arr, uint32_t count,
+                                uint32_t pos)
+{
+    uint32_t lo = 0, hi = count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (arr[mid].pos_start < pos)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static int pos_index_reserve(lr_state *s, unsigned drive_idx, uint32_t need)
+{
+    if (need <= s->pos_index_cap[drive_idx])
+        return 0;
+    uint32_t cap = s->pos_index_cap[drive_idx] ? s->pos_index_cap[drive_idx] : 64;
+    while (cap < need)
+        cap *= 2;
+    lr_pos_entry *arr = realloc(s->pos_index[drive_idx],
+                                (size_t)cap * sizeof(lr_pos_entry));
+    if (!arr)
+        return -1;
+    s->pos_index[drive_idx]     = arr;
+    s->pos_index_cap[drive_idx] = cap;
+    return 0;
+}
+
+/* Index of f's entry (keyed at pos_start), or UINT32_MAX. */
+static uint32_t pos_index_find_entry(lr_state *s, unsigned drive_idx,
+                                     uint32_t pos_start, const lr_file *f)
+{
+    lr_pos_entry *arr   = s->pos_index[drive_idx];
+    uint32_t      count = s->pos_index_count[drive_idx];
+    /* Equal starts only occur with a corrupt content file */
+    for (uint32_t i = pos_index_lower(arr, count, pos_start);
+         i < count && arr[i].pos_start == pos_start; i++)
+        if (arr[i].file == f)
+            return i;
+    return UINT32_MAX;
+}
+
+static void pos_index_delete(lr_state *s, unsigned drive_idx,
+                             uint32_t pos_start, const lr_file *f)
+{
+    uint32_t i = pos_index_find_entry(s, drive_idx, pos_start, f);
+    if (i == UINT32_MAX)
+        return;
+    lr_pos_entry *arr = s->pos_index[drive_idx];
+    uint32_t      n   = --s->pos_index_count[drive_idx];
+    memmove(&arr[i], &arr[i + 1], (size_t)(n - i) * sizeof(lr_pos_entry));
+}
+
+void state_pos_index_insert(lr_state *s, lr_file *f)
+{
+    unsigned d = f->drive_idx;
+    if (f->block_count == 0)
+        return;
+    if (pos_index_reserve(s, d, s->pos_index_count[d] + 1) != 0) {
+        fprintf(stderr, "liveraid: position index: out of memory for %s\n",
+                f->vpath);
+        return;
+    }
+    lr_pos_entry *arr   = s->pos_index[d];
+    uint32_t      count = s->pos_index_count[d];
+    uint32_t      i     = count;
+    if (count > 0 && arr[count - 1].pos_start > f->parity_pos_start)
+        i = pos_index_lower(arr, count, f->parity_pos_start);
+    memmove(&arr[i + 1], &arr[i], (size_t)(count - i) * sizeof(lr_pos_entry));
+    arr[i].pos_start   = f->parity_pos_start;
+    arr[i].block_count = f->block_count;
+    arr[i].file        = f;
+    s->pos_index_count[d] = count + 1;
+}
+
+void state_pos_index_remove(lr_state *s, lr_file *f)
+{
+    if (f->block_count > 0)
+        pos_index_delete(s, f->drive_idx, f->parity_pos_start, f);
+}
+
+void state_pos_index_update(lr_state *s, lr_file *f,
+                            uint32_t old_start, uint32_t old_count)
+{
+    unsigned d = f->drive_idx;
+    if (old_count > 0 && f->block_count > 0 &&
+        old_start == f->parity_pos_start) {
+        uint32_t i = pos_index_find_entry(s, d, old_start, f);
+        if (i != UINT32_MAX) {
+            s->pos_index[d][i].block_count = f->block_count;
+            return;
+        }
+    }
+    if (old_count > 0)
+        pos_index_delete(s, d, old_start, f);
+    state_pos_index_insert(s, f);
+}
+
 void state_rebuild_pos_index(lr_state *s, unsigned drive_idx)
 {
     uint32_t count = 0;
     lr_list_node *node = lr_list_head(&s->file_list);
     while (node) {
         lr_file *f = (lr_file *)node->data;
-        if (f->drive_idx == drive_idx)
+        if (f->drive_idx == drive_idx && f->block_count > 0)
             count++;
         node = node->next;
     }
 
-    free(s->pos_index[drive_idx]);
-    s->pos_index[drive_idx]       = NULL;
     s->pos_index_count[drive_idx] = 0;
-
-    if (count == 0)
-        return;
-
-    lr_pos_entry *arr = malloc(count * sizeof(lr_pos_entry));
-    if (!arr)
+    if (count == 0 || pos_index_reserve(s, drive_idx, count) != 0)
         return;
 
+    lr_pos_entry *arr = s->pos_index[drive_idx];
     uint32_t i = 0;
     node = lr_list_head(&s->file_list);
     while (node) {
         lr_file *f = (lr_file *)node->data;
-        if (f->drive_idx == drive_idx) {
+        if (f->drive_idx == drive_idx && f->block_count > 0) {
             arr[i].pos_start   = f->parity_pos_start;
             arr[i].block_count = f->block_count;
             arr[i].file        = f;
@@ -309,9 +1019,48 @@ void state_rebuild_pos_index(lr_state *s, unsigned drive_idx)
     }
 
     qsort(arr, count, sizeof(lr_pos_entry), pos_entry_cmp);
+    s->pos_index_count[drive_idx] = count;
+}
 
+void state_load_pos_index(lr_state *s, unsigned drive_idx,
+                          lr_pos_entry *arr, uint32_t n)
+{
+    for (uint32_t i = 1; i < n; i++) {
+        if (arr[i].pos_start < arr[i - 1].pos_start) {
+            qsort(arr, n, sizeof(lr_pos_entry), pos_entry_cmp);
+            break;
+        }
+    }
+    free(s->pos_index[drive_idx]);
     s->pos_index[drive_idx]       = arr;
-    s->pos_index_count[drive_idx] = count;
+    s->pos_index_count[drive_idx] = n;
+    s->pos_index_cap[drive_idx]   = n;
+}
+
+void state_rebuild_allocator(lr_state *s, unsigned drive_idx)
+{
+    lr_pos_allocator *pa    = &s->drives[drive_idx].pos_alloc;
+    lr_pos_entry     *arr   = s->pos_index[drive_idx];
+    uint32_t          count = s->pos_index_count[drive_idx];
+
+    /* At most one gap before each file */
+    lr_extent *gaps = malloc((size_t)(count ? count : 1) * sizeof(lr_extent));
+    if (!gaps) {
+        fprintf(stderr, "liveraid: out of memory rebuilding the allocator "
+                        "for drive '%s'\n", s->drives[drive_idx].name);
+        return;
+    }
+    uint32_t n = 0, end = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (arr[i].pos_start > end)
+            gaps[n++] = (lr_extent){ end, arr[i].pos_start - end };
+        if (arr[i].pos_start + arr[i].block_count > end)
+            end = arr[i].pos_start + arr[i].block_count;
+    }
+    pa->next_free = end;
+    alloc_set_extents(pa, NULL, 0);
+    alloc_set_extents(pa, gaps, n);
+    free(gaps);
 }
 
 lr_file *state_find_file_at_pos(lr_state *s, unsigned drive_idx, uint32_t pos)
@@ -332,3 +1081,39 @@ lr_file *state_find_file_at_pos(lr_state *s, unsigned drive_idx, uint32_t pos)
     }
     return NULL;
 }
+
+lr_file *state_lookup_pos(lr_state *s, unsigned drive_idx, uint32_t pos,
+                          uint32_t *start, uint32_t *end)
+{
+    state_lock_drive(s, drive_idx);
+    lr_file *f = state_find_file_at_pos(s, drive_idx, pos);
+    if (f) {
+        *start = f->parity_pos_start;
+        *end   = f->parity_pos_start + f->block_count;
+    }
+    state_unlock_drive(s, drive_idx);
+    return f;
+}
+
+void state_lock_wait(lr_state *s, int write)
+{
+    uint64_t t0 = stats_now_ns();
+    if (write)
+        pthread_rwlock_wrlock(&s->state_lock);
+    else
+        pthread_rwlock_rdlock(&s->state_lock);
+    uint64_t waited = stats_now_ns() - t0;
+    stats_lock(s->stats, waited ? waited : 1);
+}
+
+void state_lock_drives(lr_state *s)
+{
+    for (unsigned i = 0; i < state_drive_slots(s); i++)
+        state_lock_drive(s, i);
+}
+
+void state_unlock_drives(lr_state *s)
+{
+    for (unsigned i = state_drive_slots(s); i-- > 0; )
+        state_unlock_drive(s, i);
+}
@@ -3,11 +3,14 @@
 
 #include "config.h"
 #include "alloc.h"
+#include "strpool.h"
+#include "stats.h"
 
 #include <stdint.h>
 #include <pthread.h>
 #include <limits.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include "lr_hash.h"
 #include "lr_list.h"
@@ -18,6 +21,14 @@
 struct lr_parity_handle;
 struct lr_journal;
 struct lr_ctrl;
+struct lr_fdcache;
+struct lr_io;
+struct lr_rcache;
+struct lr_scrub;
+struct lr_compact;
+struct lr_mover;
+struct lr_dnode;
+struct lr_metalog;
 
 /*--------------------------------------------------------------------
  * Per-drive runtime info
@@ -28,14 +39,19 @@ typedef struct lr_drive {
     unsigned         idx;              /* index in state.drives[] */
     uint32_t         rr_seq;           /* round-robin counter */
     lr_pos_allocator pos_alloc;        /* per-drive parity position allocator */
+    int64_t          free_bytes;       /* last statvfs minus our growth since (atomic) */
+    uint64_t         total_bytes;      /* filesystem size at the last statvfs */
+
+    /* pos_alloc, the drive's position index, and the size and positions
+     * of its files, for holders of the read lock (see Locking below) */
+    pthread_mutex_t  lock;
 } lr_drive;
 
 /*--------------------------------------------------------------------
  * Per-file record
  *------------------------------------------------------------------*/
 typedef struct lr_file {
-    char     vpath[PATH_MAX];       /* virtual path, e.g. "/movies/foo.mkv" */
-    char     real_path[PATH_MAX];   /* absolute path on the data drive */
+    const char *vpath;              /* virtual path, e.g. "/movies/foo.mkv" (s->paths) */
     unsigned drive_idx;             /* index in state.drives[] */
     int64_t  size;                  /* bytes */
     uint32_t block_count;
@@ -45,17 +61,22 @@ typedef struct lr_file {
     mode_t   mode;              /* full st_mode, e.g. S_IFREG | 0644 */
     uid_t    uid;
     gid_t    gid;
-    int      open_count;        /* number of open FUSE file handles, guarded by state_lock */
+    int      open_count;        /* number of open FUSE file handles (atomic) */
+    int      log_dirty;         /* in s->log_dirty, awaiting a change-log record (mlog->lock) */
 
     lr_hash_node  vpath_node;       /* embedded node for file_table */
     lr_list_node  list_node;        /* embedded node for file_list */
+    lr_list_node  tree_node;        /* embedded node for parent->files */
+    struct lr_dnode *parent;        /* directory-tree node holding this file */
+    lr_list_node  log_node;         /* embedded node for s->log_dirty */
+    lr_list_node  cache_node;       /* embedded node for s->cache_files */
 } lr_file;
 
 /*--------------------------------------------------------------------
  * Per-directory record (explicitly mkdir'd or had metadata changed)
  *------------------------------------------------------------------*/
 typedef struct lr_dir {
-    char     vpath[PATH_MAX];
+    const char *vpath;          /* s->paths */
     mode_t   mode;              /* full st_mode including S_IFDIR */
     uid_t    uid;
     gid_t    gid;
@@ -64,14 +85,15 @@ typedef struct lr_dir {
 
     lr_hash_node  vpath_node;   /* embedded node for dir_table */
     lr_list_node  list_node;    /* embedded node for dir_list */
+    struct lr_dnode *node;      /* directory-tree node for vpath */
 } lr_dir;
 
 /*--------------------------------------------------------------------
  * Per-symlink record (metadata-only; no drive storage, no parity)
  *------------------------------------------------------------------*/
 typedef struct lr_symlink {
-    char     vpath[PATH_MAX];
-    char     target[PATH_MAX];
+    const char *vpath;          /* s->paths */
+    const char *target;         /* s->paths */
     time_t   mtime_sec;
     long     mtime_nsec;
     uid_t    uid;
@@ -79,8 +101,32 @@ typedef struct lr_symlink {
 
     lr_hash_node  vpath_node;   /* embedded node for symlink_table */
     lr_list_node  list_node;    /* embedded node for symlink_list */
+    lr_list_node  tree_node;    /* embedded node for parent->symlinks */
+    struct lr_dnode *parent;
 } lr_symlink;
 
+/*--------------------------------------------------------------------
+ * Directory-tree node
+ *
+ * One node per directory that holds a file or symlink somewhere below
+ * it, or has an lr_dir record.  Nodes are created by the insert
+ * functions and freed when their last child and record go away, so
+ * the tree mirrors the tables exactly.  Empty directories that exist
+ * only on the drives are not in the tree.
+ *------------------------------------------------------------------*/
+typedef struct lr_dnode {
+    struct lr_dnode *parent;       /* NULL for the root */
+    lr_hash          subdir_table; /* name → lr_dnode* */
+    lr_list          subdirs;      /* lr_dnode* for iteration */
+    lr_list          files;        /* lr_file* directly in this directory */
+    lr_list          symlinks;     /* lr_symlink* directly in this directory */
+    lr_dir          *dir;          /* explicit record, or NULL */
+
+    lr_hash_node     name_node;    /* embedded node for parent->subdir_table */
+    lr_list_node     list_node;    /* embedded node for parent->subdirs */
+    char             name[];       /* last component; "" for the root */
+} lr_dnode;
+
 /*--------------------------------------------------------------------
  * Position-index entry (for parity worker lookup)
  *------------------------------------------------------------------*/
@@ -96,10 +142,12 @@ typedef struct {
 typedef struct lr_state {
     lr_config         cfg;
     lr_drive          drives[LR_DRIVE_MAX];
-    unsigned          drive_count;
+    unsigned          drive_count;   /* data drives, drives[0 .. drive_count) */
+    unsigned          cache_drive;   /* drives[] index of the cache tier, or LR_NO_CACHE */
 
     lr_hash           file_table;   /* vpath → lr_file* */
     lr_list           file_list;    /* all lr_file* for iteration */
+    lr_list           cache_files;  /* lr_file* on the cache tier */
 
     lr_hash           dir_table;    /* vpath → lr_dir* (explicit dirs) */
     lr_list           dir_list;     /* all lr_dir* for iteration/save */
@@ -107,34 +155,160 @@ typedef struct lr_state {
     lr_hash           symlink_table; /* vpath → lr_symlink* */
     lr_list           symlink_list;  /* all lr_symlink* for iteration/save */
 
+    lr_dnode         *root;          /* directory tree over the three tables */
+    lr_strpool        paths;         /* vpath and target strings of the records */
+
     struct lr_parity_handle *parity;
     struct lr_journal        *journal;
-
-    pthread_rwlock_t  state_lock;
-
-    /* Per-drive sorted position index for parity worker lookup */
+    struct lr_fdcache        *fdcache;  /* read-only data fds; NULL = open per read */
+    struct lr_io             *io;       /* batched I/O engine; NULL = sync */
+    struct lr_rcache         *rcache;   /* recovered blocks for degraded reads; NULL = off */
+    struct lr_scrub          *scrub;    /* background scrub scheduler; NULL = inline scrub */
+    struct lr_compact        *compact;  /* position namespace compaction; NULL = unavailable */
+    struct lr_mover          *mover;    /* cache tier migration; NULL = no cache */
+    struct lr_metalog        *mlog;     /* metadata change log; NULL = snapshots only */
+    struct lr_stats          *stats;    /* runtime metrics; NULL = not collected */
+
+    /* Files changed since the last change-log flush (metalog_file); added
+     * and drained under mlog->lock, dropped by state_remove_file under the
+     * write lock */
+    lr_list           log_dirty;
+    uint64_t          meta_gen;      /* generation of the loaded/last saved snapshot */
+    uint32_t          log_replayed;  /* change-log records applied by metadata_load */
+
+    pthread_rwlock_t  state_lock;    /* the namespace; see Locking below */
+
+    /* Per-drive sorted position index for parity worker lookup (drive lock) */
     lr_pos_entry     *pos_index[LR_DRIVE_MAX];
     uint32_t          pos_index_count[LR_DRIVE_MAX];
+    uint32_t          pos_index_cap[LR_DRIVE_MAX];
 
     /* Round-robin drive selection counter */
     unsigned          rr_next;
 
+    /* CLOCK_MONOTONIC second of the last state_refresh_free; 0 = never */
+    time_t            free_refreshed;
+
     /* Control server (Unix domain socket for live rebuild), NULL if not started */
     struct lr_ctrl   *ctrl;
 
     /* Set to 1 by lr_destroy after metadata_save; prevents duplicate save
      * in the post-fuse_main cleanup block in main(). */
     int               metadata_saved;
+
+    /* Set by lr_init when the kernel agreed to write-back caching */
+    int               writeback_cache;
 } lr_state;
 
 extern lr_state *g_state;
 
+/*--------------------------------------------------------------------
+ * Locking
+ *
+ * state_lock guards the namespace: the tables, lists and tree, and every
+ * record field except those below.  Operations that add, remove, rename
+ * or re-home records take it for writing; lookups, reads and writes take
+ * it for reading, so independent streams do not serialize on it.
+ *
+ * A file's size, block_count and parity_pos_start, and its drive's
+ * pos_alloc and position index, change under the read lock too (a write
+ * that extends a file).  They are guarded by the drive's lock: a holder
+ * of the read lock takes it to read or change them; a holder of the
+ * write lock needs no drive lock.  Order: state_lock, then drive locks
+ * in index order, then subsystem locks (journal, mlog).
+ *
+ * open_count is atomic; use state_open_inc / state_open_dec.
+ *
+ * Take state_lock with state_rdlock / state_wrlock: they count the
+ * acquisition and, when it had to wait, the time spent waiting.  An
+ * uncontended acquisition costs one trylock and a sharded counter add.
+ *------------------------------------------------------------------*/
+
+/* Blocking acquisition after a failed trylock (write != 0: exclusive). */
+void state_lock_wait(lr_state *s, int write);
+
+static inline void state_rdlock(lr_state *s)
+{
+    if (pthread_rwlock_tryrdlock(&s->state_lock) == 0)
+        stats_lock(s->stats, 0);
+    else
+        state_lock_wait(s, 0);
+}
+
+static inline void state_wrlock(lr_state *s)
+{
+    if (pthread_rwlock_trywrlock(&s->state_lock) == 0)
+        stats_lock(s->stats, 0);
+    else
+        state_lock_wait(s, 1);
+}
+
+static inline void state_unlock(lr_state *s)
+{
+    pthread_rwlock_unlock(&s->state_lock);
+}
+
+static inline void state_lock_drive(lr_state *s, unsigned drive_idx)
+{
+    pthread_mutex_lock(&s->drives[drive_idx].lock);
+}
+
+static inline void state_unlock_drive(lr_state *s, unsigned drive_idx)
+{
+    pthread_mutex_unlock(&s->drives[drive_idx].lock);
+}
+
+/* Every drive's lock, for a consistent view of all files and allocators
+ * under the read lock (snapshots, rebuild target lists). */
+void state_lock_drives(lr_state *s);
+void state_unlock_drives(lr_state *s);
+
+static inline void state_open_inc(lr_file *f)
+{
+    __atomic_add_fetch(&f->open_count, 1, __ATOMIC_RELAXED);
+}
+
+/* Drop one open handle; never goes below zero. */
+static inline void state_open_dec(lr_file *f)
+{
+    int n = __atomic_load_n(&f->open_count, __ATOMIC_RELAXED);
+    while (n > 0 &&
+           !__atomic_compare_exchange_n(&f->open_count, &n, n - 1, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static inline int state_open_count(const lr_file *f)
+{
+    return __atomic_load_n(&f->open_count, __ATOMIC_RELAXED);
+}
+
 /*--------------------------------------------------------------------
  * Lifecycle
  *------------------------------------------------------------------*/
 int  state_init(lr_state *s, const lr_config *cfg);
 void state_done(lr_state *s);
 
+/*--------------------------------------------------------------------
+ * Record strings
+ *
+ * vpath and target strings live in s->paths and are immutable.  Set
+ * them with state_set_path and free records (after removing them from
+ * their table) with state_free_*, which return the strings to the pool.
+ *------------------------------------------------------------------*/
+
+/* Replace *field with a pooled copy of str.  Returns 0, or -1 (field
+ * unchanged) when str is too long or memory runs out. */
+int  state_set_path(lr_state *s, const char **field, const char *str);
+
+void state_free_file(lr_state *s, lr_file *f);
+void state_free_dir(lr_state *s, lr_dir *d);
+void state_free_symlink(lr_state *s, lr_symlink *sl);
+
+/* f's path on its drive (drive dir + vpath) in buf; returns buf. */
+char *state_real_path(const lr_state *s, const lr_file *f,
+                      char *buf, size_t size);
+
 /*--------------------------------------------------------------------
  * File table operations (caller must hold appropriate lock)
  *------------------------------------------------------------------*/
@@ -164,10 +338,112 @@ void        state_insert_symlink(lr_state *s, lr_symlink *sl);
 lr_symlink *state_find_symlink(lr_state *s, const char *vpath);
 lr_symlink *state_remove_symlink(lr_state *s, const char *vpath);
 
+/*--------------------------------------------------------------------
+ * Directory tree (caller must hold appropriate lock)
+ *------------------------------------------------------------------*/
+
+/* Node for directory vpath ("/" = root), or NULL if no file, symlink
+ * or lr_dir lives at or below it.  O(depth). */
+lr_dnode *state_find_dnode(lr_state *s, const char *vpath);
+
+/* Child directory name of n, or NULL. */
+lr_dnode *state_dnode_child(lr_dnode *n, const char *name);
+
+/* Move directory from to to: re-key every file, symlink and lr_dir
+ * below from and graft its node under to's parent, merging with any
+ * existing node at to.  Touches only the moved subtree.  Returns 0, or
+ * -1 when to is inside from or memory runs out (an entry whose new path
+ * could not be allocated keeps its old one). */
+int state_rename_dir(lr_state *s, const char *from, const char *to);
+
+/*--------------------------------------------------------------------
+ * Attributes
+ *
+ * liveraid is the only writer of its drives, so the records are the
+ * authoritative attributes: getattr and readdir answer from them without
+ * an lstat (which would wake an idle drive to report a size we already
+ * have).  st_blocks is derived from the size, so sparse files count in
+ * full; atime and ctime report the mtime.
+ *------------------------------------------------------------------*/
+
+/* Caller holds state_lock (either mode); f's drive lock is taken for
+ * size and mtime, which writers update under it. */
+void state_stat_file(lr_state *s, const lr_file *f, struct stat *st);
+void state_stat_dir(const lr_dir *d, struct stat *st);
+void state_stat_symlink(const lr_symlink *sl, struct stat *st);
+
+/* Set f's mtime to now.  Caller holds f's drive lock or the write lock.
+ * Returns 1 when the second changed (worth a change-log record; within
+ * the same second only the in-memory nanoseconds move). */
+int state_touch_file(lr_file *f);
+
 /*--------------------------------------------------------------------
  * Drive selection for new files
+ *
+ * mostfree, lfs and pfrd rank drives by the cached free space in
+ * lr_drive.free_bytes: a statvfs of every drive at most every
+ * LR_FREE_REFRESH_S seconds, adjusted in between by the size changes
+ * liveraid makes (state_account_free).  dirlocal places an entry on the
+ * drive of the newest file in its directory (or the nearest ancestor
+ * below the root that has files) while that drive keeps
+ * LR_DIRLOCAL_RESERVE_PCT of its size free; otherwise mostfree.
  *------------------------------------------------------------------*/
-unsigned state_pick_drive(lr_state *s);
+#define LR_FREE_REFRESH_S       30
+#define LR_DIRLOCAL_RESERVE_PCT 5
+
+/* vpath is the new entry's path, for dirlocal; NULL = no locality. */
+unsigned state_pick_drive(lr_state *s, const char *vpath);
+
+/* statvfs every drive into free_bytes / total_bytes. */
+void state_refresh_free(lr_state *s);
+
+/* A file on drive d grew by bytes (negative: shrank or was removed). */
+static inline void state_account_free(lr_state *s, unsigned d, int64_t bytes)
+{
+    if (bytes != 0)
+        __atomic_sub_fetch(&s->drives[d].free_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+/*--------------------------------------------------------------------
+ * Cache tier
+ *
+ * With a cache drive configured it takes the drives[] slot after the
+ * data drives, and new files land on it.  A file there owns no parity
+ * positions (block_count 0 whatever its size) and its writes dirty
+ * nothing; the mover (mover.h) later copies it to a data drive, where
+ * it gets positions like any other file.  New files go to the data
+ * drives instead while the cache has less than LR_CACHE_RESERVE_PCT of
+ * its size free.
+ *------------------------------------------------------------------*/
+#define LR_NO_CACHE           UINT32_MAX
+#define LR_CACHE_RESERVE_PCT  10
+
+static inline int state_is_cache(const lr_state *s, unsigned drive_idx)
+{
+    return drive_idx == s->cache_drive;
+}
+
+/* Slots in use in drives[]: the data drives, then the cache if any. */
+static inline unsigned state_drive_slots(const lr_state *s)
+{
+    return s->drive_count + (s->cache_drive != LR_NO_CACHE);
+}
+
+/* Index of the data or cache drive called name, or UINT32_MAX. */
+unsigned state_find_drive(const lr_state *s, const char *name);
+
+/* The cache exists and is above its reserve (cached free space, as
+ * state_pick_drive). */
+int state_cache_has_room(lr_state *s);
+
+/* Re-home f on drive_idx, keeping s->cache_files in step.  Caller holds
+ * the write lock; f's positions are the caller's. */
+void state_set_file_drive(lr_state *s, lr_file *f, unsigned drive_idx);
+
+/* Create the missing parent directories of real_path (a path on
+ * drive_idx), each with the mode of the same directory on another drive
+ * that has it, else 0755.  Caller holds state_lock. */
+void state_make_parents(lr_state *s, unsigned drive_idx, const char *real_path);
 
 /*--------------------------------------------------------------------
  * Block-count helper
@@ -178,12 +454,54 @@ static inline uint32_t blocks_for_size(uint64_t size, uint32_t block_size)
     return (uint32_t)(size / block_size + (size % block_size != 0));
 }
 
+/* Positions a file of size bytes owns on drive_idx: none on the cache. */
+static inline uint32_t state_file_blocks(const lr_state *s, unsigned drive_idx,
+                                         uint64_t size)
+{
+    return state_is_cache(s, drive_idx) ? 0
+                                        : blocks_for_size(size, s->cfg.block_size);
+}
+
 /*--------------------------------------------------------------------
- * Position index (rebuild after mutations)
+ * Position index
+ *
+ * Holds the files that own positions, sorted by parity_pos_start.  Call
+ * whenever a file's positions change, under the write lock or the read
+ * lock plus the drive's lock.
  *------------------------------------------------------------------*/
+
+/* Rebuild drive_idx's index from file_list (after a metadata load). */
 void state_rebuild_pos_index(lr_state *s, unsigned drive_idx);
 
-/* Binary search: find file on drive_idx that has data at position pos. */
+/* Install arr (malloc'd, n entries, taken over) as drive_idx's index,
+ * replacing the current one (bulk load).  arr should already be sorted by
+ * start; it is sorted here if it is not. */
+void state_load_pos_index(lr_state *s, unsigned drive_idx,
+                          lr_pos_entry *arr, uint32_t n);
+
+/* Add f; no-op when it has no blocks. */
+void state_pos_index_insert(lr_state *s, lr_file *f);
+
+/* Drop f; call before its parity_pos_start / block_count change. */
+void state_pos_index_remove(lr_state *s, lr_file *f);
+
+/* f moved from [old_start, old_start+old_count) to its current range. */
+void state_pos_index_update(lr_state *s, lr_file *f,
+                            uint32_t old_start, uint32_t old_count);
+
+/* Reset drive_idx's allocator to the complement of its position index:
+ * every position below the end of the last file that no file owns is
+ * free (after a change-log replay). */
+void state_rebuild_allocator(lr_state *s, unsigned drive_idx);
+
+/* Binary search: find file on drive_idx that has data at position pos.
+ * Caller holds the write lock or drive_idx's lock. */
 lr_file *state_find_file_at_pos(lr_state *s, unsigned drive_idx, uint32_t pos);
 
+/* state_find_file_at_pos for a holder of just the read lock: takes the
+ * drive's lock and returns the file's extent as it stood, its first
+ * position in *start and the position past its last in *end. */
+lr_file *state_lookup_pos(lr_state *s, unsigned drive_idx, uint32_t pos,
+                          uint32_t *start, uint32_t *end);
+
 #endif /* LR_STATE_H */
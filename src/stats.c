@@ -0,0 +1,309 @@
+#include "stats.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#define ADD(p, v) __atomic_add_fetch((p), (v), __ATOMIC_RELAXED)
+
+/* The snapshot sums counters as a flat array */
+_Static_assert(sizeof(lr_stats_counters) % sizeof(uint64_t) == 0,
+               "lr_stats_counters must hold only uint64_t counters");
+
+static const char *const op_names[LR_OP_COUNT] = {
+    "getattr", "readdir", "open", "release", "read", "read_buf", "write",
+    "write_buf", "create", "unlink", "rename", "symlink", "readlink",
+    "mkdir", "rmdir", "truncate", "statfs", "utimens", "chmod", "chown",
+    "flush", "fsync",
+};
+
+/* ------------------------------------------------------------------ */
+/* Updates                                                              */
+/* ------------------------------------------------------------------ */
+
+static unsigned  next_shard;
+static __thread unsigned tls_shard = UINT32_MAX;
+
+static lr_stats_counters *my_shard(lr_stats *st)
+{
+    if (tls_shard == UINT32_MAX)
+        tls_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED)
+                    % LR_STATS_SHARDS;
+    return &st->shard[tls_shard].c;
+}
+
+void stats_init(lr_stats *st)
+{
+    memset(st, 0, sizeof(*st));
+}
+
+void hist_add(lr_hist *h, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    unsigned i  = us ? 64 - (unsigned)__builtin_clzll(us) : 0;
+    if (i >= LR_HIST_BUCKETS)
+        i = LR_HIST_BUCKETS - 1;
+    ADD(&h->bucket[i], 1);
+    ADD(&h->count, 1);
+    ADD(&h->sum_ns, ns);
+}
+
+void stats_op(lr_stats *st, unsigned op, uint64_t start_ns, int rc)
+{
+    if (!st || op >= LR_OP_COUNT)
+        return;
+    lr_stats_counters *c = my_shard(st);
+    hist_add(&c->op[op], stats_now_ns() - start_ns);
+    if (rc < 0)
+        ADD(&c->op_errors[op], 1);
+}
+
+void stats_dev_io(lr_stats *st, unsigned dev, int write, int64_t res)
+{
+    if (!st || dev >= LR_STATS_DEVS)
+        return;
+    lr_dev_io *d = &my_shard(st)->dev[dev];
+    if (res < 0) {
+        ADD(&d->errors, 1);
+    } else if (write) {
+        ADD(&d->write_ops, 1);
+        ADD(&d->write_bytes, (uint64_t)res);
+    } else {
+        ADD(&d->read_ops, 1);
+        ADD(&d->read_bytes, (uint64_t)res);
+    }
+}
+
+void stats_lock(lr_stats *st, uint64_t wait_ns)
+{
+    if (!st)
+        return;
+    lr_stats_counters *c = my_shard(st);
+    ADD(&c->lock_acquired, 1);
+    if (wait_ns)
+        hist_add(&c->lock_wait, wait_ns);
+}
+
+void stats_drain(lr_stats *st, uint64_t positions, uint64_t ns)
+{
+    if (!st)
+        return;
+    lr_stats_counters *c = my_shard(st);
+    hist_add(&c->drain, ns);
+    ADD(&c->drain_positions, positions);
+}
+
+void stats_snapshot(const lr_stats *st, lr_stats_counters *out)
+{
+    uint64_t *dst = (uint64_t *)out;
+    size_t    n   = sizeof(*out) / sizeof(uint64_t);
+
+    memset(out, 0, sizeof(*out));
+    for (unsigned s = 0; s < LR_STATS_SHARDS; s++) {
+        const uint64_t *src = (const uint64_t *)&st->shard[s].c;
+        for (size_t i = 0; i < n; i++)
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+/* Histograms                                                           */
+/* ------------------------------------------------------------------ */
+
+uint64_t hist_bucket_us(unsigned i)
+{
+    return i + 1 >= LR_HIST_BUCKETS ? UINT64_MAX : (uint64_t)1 << i;
+}
+
+uint64_t hist_quantile_us(const lr_hist *h, double q)
+{
+    if (h->count == 0)
+        return 0;
+    uint64_t want = (uint64_t)(q * (double)h->count + 0.5);
+    if (want < 1)
+        want = 1;
+    uint64_t seen = 0;
+    unsigned i;
+    for (i = 0; i < LR_HIST_BUCKETS; i++) {
+        seen += h->bucket[i];
+        if (seen >= want)
+            break;
+    }
+    if (i + 1 >= LR_HIST_BUCKETS)   /* overflow: its lower bound */
+        return (uint64_t)1 << (LR_HIST_BUCKETS - 2);
+    return hist_bucket_us(i);
+}
+
+const char *stats_op_name(unsigned op)
+{
+    return op < LR_OP_COUNT ? op_names[op] : "?";
+}
+
+/* ------------------------------------------------------------------ */
+/* Output                                                               */
+/* ------------------------------------------------------------------ */
+
+static unsigned long long avg_us(const lr_hist *h)
+{
+    return h->count ? (unsigned long long)(h->sum_ns / h->count / 1000) : 0;
+}
+
+/* "+Inf" for the last bucket, else its bound in seconds */
+static void prom_le(char *buf, size_t len, unsigned i)
+{
+    if (i + 1 >= LR_HIST_BUCKETS)
+        snprintf(buf, len, "+Inf");
+    else
+        snprintf(buf, len, "%g", (double)hist_bucket_us(i) / 1e6);
+}
+
+/* One Prometheus histogram series; labels is "" or `key="value"` */
+static void prom_hist(FILE *out, const char *name, const char *labels,
+                      const lr_hist *h)
+{
+    const char *sep   = labels[0] ? "," : "";
+    const char *open  = labels[0] ? "{" : "";
+    const char *close = labels[0] ? "}" : "";
+    uint64_t    cumul = 0;
+    char        le[32];
+    for (unsigned i = 0; i < LR_HIST_BUCKETS; i++) {
+        cumul += h->bucket[i];
+        prom_le(le, sizeof(le), i);
+        fprintf(out, "%s_bucket{%s%sle=\"%s\"} %llu\n",
+                name, labels, sep, le, (unsigned long long)cumul);
+    }
+    fprintf(out, "%s_sum%s%s%s %.9f\n", name, open, labels, close,
+            (double)h->sum_ns / 1e9);
+    fprintf(out, "%s_count%s%s%s %llu\n", name, open, labels, close,
+            (unsigned long long)h->count);
+}
+
+static void prom_head(FILE *out, const char *name, const char *type,
+                      const char *help)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void print_prom(const lr_stats_counters *c,
+                       const char *const *dev_names, uint32_t block_size,
+                       FILE *out)
+{
+    char labels[96];
+
+    prom_head(out, "liveraid_fuse_op_duration_seconds", "histogram",
+              "FUSE operation latency.");
+    for (unsigned op = 0; op < LR_OP_COUNT; op++) {
+        snprintf(labels, sizeof(labels), "op=\"%s\"", op_names[op]);
+        prom_hist(out, "liveraid_fuse_op_duration_seconds", labels,
+                  &c->op[op]);
+    }
+    prom_head(out, "liveraid_fuse_op_errors_total", "counter",
+              "FUSE operations that returned an error.");
+    for (unsigned op = 0; op < LR_OP_COUNT; op++)
+        fprintf(out, "liveraid_fuse_op_errors_total{op=\"%s\"} %llu\n",
+                op_names[op], (unsigned long long)c->op_errors[op]);
+
+    static const struct {
+        const char *name, *help;
+        size_t      off;
+    } dev_fields[] = {
+        { "liveraid_device_read_ops_total", "Reads issued.",
+          offsetof(lr_dev_io, read_ops) },
+        { "liveraid_device_read_bytes_total", "Bytes read.",
+          offsetof(lr_dev_io, read_bytes) },
+        { "liveraid_device_write_ops_total", "Writes issued.",
+          offsetof(lr_dev_io, write_ops) },
+        { "liveraid_device_write_bytes_total", "Bytes written.",
+          offsetof(lr_dev_io, write_bytes) },
+        { "liveraid_device_errors_total", "Reads and writes that failed.",
+          offsetof(lr_dev_io, errors) },
+    };
+    for (unsigned f = 0; f < sizeof(dev_fields) / sizeof(dev_fields[0]); f++) {
+        prom_head(out, dev_fields[f].name, "counter", dev_fields[f].help);
+        for (unsigned d = 0; d < LR_STATS_DEVS; d++) {
+            if (!dev_names[d])
+                continue;
+            const uint64_t *v = (const uint64_t *)
+                ((const char *)&c->dev[d] + dev_fields[f].off);
+            fprintf(out, "%s{device=\"%s\"} %llu\n", dev_fields[f].name,
+                    dev_names[d], (unsigned long long)*v);
+        }
+    }
+
+    prom_head(out, "liveraid_state_lock_acquisitions_total", "counter",
+              "Namespace lock acquisitions.");
+    fprintf(out, "liveraid_state_lock_acquisitions_total %llu\n",
+            (unsigned long long)c->lock_acquired);
+    prom_head(out, "liveraid_state_lock_wait_seconds", "histogram",
+              "Time spent waiting for the namespace lock when contended.");
+    prom_hist(out, "liveraid_state_lock_wait_seconds", "", &c->lock_wait);
+
+    prom_head(out, "liveraid_drain_cycle_seconds", "histogram",
+              "Duration of parity drain cycles.");
+    prom_hist(out, "liveraid_drain_cycle_seconds", "", &c->drain);
+    prom_head(out, "liveraid_drain_bytes_total", "counter",
+              "Parity positions drained, in bytes per drive.");
+    fprintf(out, "liveraid_drain_bytes_total %llu\n",
+            (unsigned long long)(c->drain_positions * block_size));
+}
+
+static void print_text(const lr_stats_counters *c,
+                       const char *const *dev_names, uint32_t block_size,
+                       FILE *out)
+{
+    for (unsigned op = 0; op < LR_OP_COUNT; op++) {
+        const lr_hist *h = &c->op[op];
+        if (h->count == 0)
+            continue;
+        fprintf(out, "op %s calls=%llu errors=%llu avg_us=%llu p50_us=%llu "
+                     "p90_us=%llu p99_us=%llu\n",
+                op_names[op], (unsigned long long)h->count,
+                (unsigned long long)c->op_errors[op], avg_us(h),
+                (unsigned long long)hist_quantile_us(h, 0.50),
+                (unsigned long long)hist_quantile_us(h, 0.90),
+                (unsigned long long)hist_quantile_us(h, 0.99));
+    }
+
+    for (unsigned d = 0; d < LR_STATS_DEVS; d++) {
+        const lr_dev_io *v = &c->dev[d];
+        if (!dev_names[d] ||
+            (v->read_ops | v->write_ops | v->errors) == 0)
+            continue;
+        fprintf(out, "dev %s reads=%llu read_bytes=%llu writes=%llu "
+                     "write_bytes=%llu errors=%llu\n",
+                dev_names[d],
+                (unsigned long long)v->read_ops,
+                (unsigned long long)v->read_bytes,
+                (unsigned long long)v->write_ops,
+                (unsigned long long)v->write_bytes,
+                (unsigned long long)v->errors);
+    }
+
+    fprintf(out, "lock state acquired=%llu waits=%llu wait_ms=%llu "
+                 "p99_wait_us=%llu\n",
+            (unsigned long long)c->lock_acquired,
+            (unsigned long long)c->lock_wait.count,
+            (unsigned long long)(c->lock_wait.sum_ns / 1000000),
+            (unsigned long long)hist_quantile_us(&c->lock_wait, 0.99));
+
+    /* Rate while draining: bytes per drive over the time spent in cycles */
+    uint64_t bytes = c->drain_positions * block_size;
+    uint64_t ms    = c->drain.sum_ns / 1000000;
+    fprintf(out, "drain cycles=%llu positions=%llu bytes=%llu busy_ms=%llu "
+                 "rate_mbs=%llu avg_ms=%llu p99_ms=%llu\n",
+            (unsigned long long)c->drain.count,
+            (unsigned long long)c->drain_positions,
+            (unsigned long long)bytes, (unsigned long long)ms,
+            (unsigned long long)(c->drain.sum_ns
+                                 ? bytes * 1000 / c->drain.sum_ns : 0),
+            avg_us(&c->drain) / 1000,
+            (unsigned long long)(hist_quantile_us(&c->drain, 0.99) / 1000));
+}
+
+void stats_print(const lr_stats_counters *c, const char *const *dev_names,
+                 uint32_t block_size, FILE *out, int prom)
+{
+    if (prom)
+        print_prom(c, dev_names, block_size, out);
+    else
+        print_text(c, dev_names, block_size, out);
+}
@@ -0,0 +1,120 @@
+#ifndef LR_STATS_H
+#define LR_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "config.h"   /* LR_DRIVE_MAX, LR_LEV_MAX */
+
+/*
+ * Runtime metrics: FUSE operation latency histograms, per-device I/O
+ * counters, state_lock waits and parity drain cycles.
+ *
+ * Counters are sharded.  A thread picks a shard round robin on its first
+ * update and adds to it with relaxed atomics, so updates never lock and
+ * threads rarely share a cache line.  stats_snapshot sums the shards; a
+ * snapshot taken while counters move may miss updates in flight, but
+ * never sees a torn counter.
+ *
+ * Every update accepts st == NULL and does nothing, so code that runs
+ * without metrics (offline tools, tests) needs no checks.
+ */
+
+#define LR_STATS_SHARDS 16
+
+/* Histogram bucket i counts durations below 2^i µs; the last bucket
+ * counts the rest (4.2 s and up). */
+#define LR_HIST_BUCKETS 24
+
+/* Instrumented FUSE operations (one per lr_fuse_ops entry) */
+enum {
+    LR_OP_GETATTR, LR_OP_READDIR, LR_OP_OPEN, LR_OP_RELEASE, LR_OP_READ,
+    LR_OP_READ_BUF, LR_OP_WRITE, LR_OP_WRITE_BUF, LR_OP_CREATE,
+    LR_OP_UNLINK, LR_OP_RENAME, LR_OP_SYMLINK, LR_OP_READLINK,
+    LR_OP_MKDIR, LR_OP_RMDIR, LR_OP_TRUNCATE, LR_OP_STATFS,
+    LR_OP_UTIMENS, LR_OP_CHMOD, LR_OP_CHOWN, LR_OP_FLUSH, LR_OP_FSYNC,
+    LR_OP_COUNT
+};
+
+/* I/O devices: data drives by index, then parity levels */
+#define LR_STATS_DEV_PARITY LR_DRIVE_MAX
+#define LR_STATS_DEVS       (LR_DRIVE_MAX + LR_LEV_MAX)
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t bucket[LR_HIST_BUCKETS];
+} lr_hist;
+
+typedef struct {
+    uint64_t read_ops;
+    uint64_t read_bytes;
+    uint64_t write_ops;
+    uint64_t write_bytes;
+    uint64_t errors;
+} lr_dev_io;
+
+typedef struct {
+    lr_hist   op[LR_OP_COUNT];
+    uint64_t  op_errors[LR_OP_COUNT];   /* calls returning < 0 */
+    lr_dev_io dev[LR_STATS_DEVS];
+    uint64_t  lock_acquired;            /* state_lock, either mode */
+    lr_hist   lock_wait;                /* acquisitions that had to wait */
+    lr_hist   drain;                    /* journal drain cycle durations */
+    uint64_t  drain_positions;          /* positions those cycles drained */
+} lr_stats_counters;
+
+typedef struct lr_stats {
+    struct {
+        lr_stats_counters c;
+    } __attribute__((aligned(64))) shard[LR_STATS_SHARDS];
+} lr_stats;
+
+static inline uint64_t stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void stats_init(lr_stats *st);
+
+/* One call of FUSE op `op` that started at start_ns (stats_now_ns) and
+ * returned rc. */
+void stats_op(lr_stats *st, unsigned op, uint64_t start_ns, int rc);
+
+/* One read or write on device dev (drive index, or LR_STATS_DEV_PARITY +
+ * level) that returned res bytes, or res < 0 on error. */
+void stats_dev_io(lr_stats *st, unsigned dev, int write, int64_t res);
+
+/* One state_lock acquisition that waited wait_ns (0 = uncontended). */
+void stats_lock(lr_stats *st, uint64_t wait_ns);
+
+/* One drain cycle of `positions` positions that took ns. */
+void stats_drain(lr_stats *st, uint64_t positions, uint64_t ns);
+
+/* Sum of every shard. */
+void stats_snapshot(const lr_stats *st, lr_stats_counters *out);
+
+void hist_add(lr_hist *h, uint64_t ns);
+
+/* Upper bound of bucket i in µs (UINT64_MAX for the last one). */
+uint64_t hist_bucket_us(unsigned i);
+
+/* Upper bound (µs) of the bucket holding quantile q (0..1), the lower
+ * bound for the last bucket; 0 if empty. */
+uint64_t hist_quantile_us(const lr_hist *h, double q);
+
+const char *stats_op_name(unsigned op);
+
+/*
+ * Write the counters of a snapshot, human-readable (one "name key=value"
+ * line per op, device and subsystem, idle ops and devices omitted) or in
+ * the Prometheus text format with the liveraid_ prefix.  dev_names[i]
+ * names device i; NULL entries are skipped.
+ */
+void stats_print(const lr_stats_counters *c, const char *const *dev_names,
+                 uint32_t block_size, FILE *out, int prom);
+
+#endif /* LR_STATS_H */
@@ -0,0 +1,91 @@
+#include "strpool.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* Chunk header; slots start at the next grain boundary */
+#define CHUNK_HDR LR_STRPOOL_GRAIN
+
+static unsigned slot_class(size_t len)
+{
+    return (unsigned)((len + 1 + LR_STRPOOL_GRAIN - 1) / LR_STRPOOL_GRAIN) - 1;
+}
+
+void strpool_init(lr_strpool *p)
+{
+    memset(p, 0, sizeof(*p));
+    pthread_mutex_init(&p->lock, NULL);
+}
+
+void strpool_done(lr_strpool *p)
+{
+    void *c = p->chunks;
+    while (c) {
+        void *next = *(void **)c;
+        free(c);
+        c = next;
+    }
+    pthread_mutex_destroy(&p->lock);
+    memset(p, 0, sizeof(*p));
+}
+
+const char *strpool_dup(lr_strpool *p, const char *str)
+{
+    size_t len = strlen(str);
+    if (len + 1 > LR_STRPOOL_MAX)
+        return NULL;
+    unsigned cls  = slot_class(len);
+    size_t   size = (size_t)(cls + 1) * LR_STRPOOL_GRAIN;
+
+    pthread_mutex_lock(&p->lock);
+    char *slot = p->free_list[cls];
+    if (slot) {
+        p->free_list[cls] = *(void **)slot;
+    } else {
+        if ((size_t)(p->bump_end - p->bump) < size) {
+            char *c = malloc(LR_STRPOOL_CHUNK);
+            if (!c) {
+                pthread_mutex_unlock(&p->lock);
+                return NULL;
+            }
+            /* What is left of the old chunk is too small for this slot */
+            *(void **)c  = p->chunks;
+            p->chunks    = c;
+            p->bump      = c + CHUNK_HDR;
+            p->bump_end  = c + LR_STRPOOL_CHUNK;
+            p->reserved += LR_STRPOOL_CHUNK;
+        }
+        slot     = p->bump;
+        p->bump += size;
+    }
+    p->strings++;
+    p->used += size;
+    pthread_mutex_unlock(&p->lock);
+
+    memcpy(slot, str, len + 1);
+    return slot;
+}
+
+void strpool_free(lr_strpool *p, const char *str)
+{
+    if (!str)
+        return;
+    unsigned cls  = slot_class(strlen(str));
+    char    *slot = (char *)str;
+
+    pthread_mutex_lock(&p->lock);
+    *(void **)slot    = p->free_list[cls];
+    p->free_list[cls] = slot;
+    p->strings--;
+    p->used -= (size_t)(cls + 1) * LR_STRPOOL_GRAIN;
+    pthread_mutex_unlock(&p->lock);
+}
+
+void strpool_get_stats(lr_strpool *p, lr_strpool_stats *st)
+{
+    pthread_mutex_lock(&p->lock);
+    st->strings  = p->strings;
+    st->used     = p->used;
+    st->reserved = p->reserved;
+    pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,57 @@
+#ifndef LR_STRPOOL_H
+#define LR_STRPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Slab allocator for the immutable path strings of the metadata records.
+ *
+ * A string takes the smallest slot of LR_STRPOOL_GRAIN-byte granularity
+ * that holds it, carved from LR_STRPOOL_CHUNK-byte chunks; freed slots go
+ * on a per-size free list and are reused by the next string of that size.
+ * There is no per-string header: strpool_free derives the slot size from
+ * the string itself, so pooled strings must never be modified in place —
+ * replace them with a new strpool_dup instead.
+ *
+ * Memory goes back to the system only at strpool_done.
+ */
+
+#define LR_STRPOOL_GRAIN   16u
+#define LR_STRPOOL_MAX     4096u          /* longest string, including NUL */
+#define LR_STRPOOL_CLASSES (LR_STRPOOL_MAX / LR_STRPOOL_GRAIN)
+#define LR_STRPOOL_CHUNK   (64u << 10)
+
+typedef struct lr_strpool {
+    pthread_mutex_t lock;
+    void           *free_list[LR_STRPOOL_CLASSES];
+    void           *chunks;     /* chained through their first word */
+    char           *bump;       /* next unused byte of the newest chunk */
+    char           *bump_end;
+
+    /* Counters (guarded by lock) */
+    uint64_t        strings;    /* live strings */
+    uint64_t        used;       /* bytes in live slots */
+    uint64_t        reserved;   /* bytes in chunks */
+} lr_strpool;
+
+void strpool_init(lr_strpool *p);
+void strpool_done(lr_strpool *p);
+
+/* Copy str into the pool.  NULL if it is longer than LR_STRPOOL_MAX - 1
+ * bytes or memory runs out. */
+const char *strpool_dup(lr_strpool *p, const char *str);
+
+/* Return a string from strpool_dup; NULL is ignored. */
+void strpool_free(lr_strpool *p, const char *str);
+
+typedef struct {
+    uint64_t strings;
+    uint64_t used;
+    uint64_t reserved;
+} lr_strpool_stats;
+
+void strpool_get_stats(lr_strpool *p, lr_strpool_stats *st);
+
+#endif /* LR_STRPOOL_H */
@@ -0,0 +1,65 @@
+#include "throttle.h"
+
+#include <string.h>
+#include <time.h>
+
+void throttle_init(lr_throttle *t, uint64_t bytes_per_sec)
+{
+    memset(t, 0, sizeof(*t));
+    t->rate = bytes_per_sec;
+    pthread_mutex_init(&t->lock, NULL);
+}
+
+void throttle_done(lr_throttle *t)
+{
+    pthread_mutex_destroy(&t->lock);
+}
+
+uint64_t throttle_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void deadline_after(struct timespec *ts, uint64_t ns)
+{
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec  += (time_t)(ns / 1000000000ull);
+    ts->tv_nsec += (long)(ns % 1000000000ull);
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+uint64_t throttle_reserve(lr_throttle *t, uint64_t bytes, uint64_t now_ns)
+{
+    if (t->rate == 0)
+        return 0;
+
+    uint64_t cost = (uint64_t)((double)bytes * 1e9 / (double)t->rate);
+
+    pthread_mutex_lock(&t->lock);
+    uint64_t start = t->next_ns > now_ns ? t->next_ns : now_ns;
+    t->next_ns     = start + cost;
+    uint64_t wait  = start - now_ns;
+    t->waited_ns  += wait;
+    pthread_mutex_unlock(&t->lock);
+    return wait;
+}
+
+void throttle_wait(lr_throttle *t, uint64_t bytes)
+{
+    if (t->rate == 0)
+        return;
+
+    uint64_t wait = throttle_reserve(t, bytes, throttle_now_ns());
+    if (wait == 0)
+        return;
+    struct timespec ts;
+    ts.tv_sec  = (time_t)(wait / 1000000000ull);
+    ts.tv_nsec = (long)(wait % 1000000000ull);
+    while (nanosleep(&ts, &ts) != 0)
+        ;
+}
@@ -0,0 +1,40 @@
+#ifndef LR_THROTTLE_H
+#define LR_THROTTLE_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Bandwidth cap shared by several threads.
+ *
+ * Each caller reserves the next slot of the byte budget before doing its
+ * I/O: a reservation of n bytes advances the shared "next free" time by
+ * n / rate, and the caller sleeps until its slot starts.  Idle time is not
+ * banked, so a pause is not followed by a burst above the cap.
+ */
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint64_t        rate;      /* bytes per second; 0 = unlimited */
+    uint64_t        next_ns;   /* CLOCK_MONOTONIC time the next slot starts */
+    uint64_t        waited_ns; /* total time callers were held back */
+} lr_throttle;
+
+void throttle_init(lr_throttle *t, uint64_t bytes_per_sec);
+void throttle_done(lr_throttle *t);
+
+/* Reserve bytes at time now_ns; returns how long the caller must wait
+ * before starting (0 when under the cap or unlimited). */
+uint64_t throttle_reserve(lr_throttle *t, uint64_t bytes, uint64_t now_ns);
+
+/* throttle_reserve at the current time, then sleep for the result. */
+void throttle_wait(lr_throttle *t, uint64_t bytes);
+
+/* CLOCK_MONOTONIC in nanoseconds. */
+uint64_t throttle_now_ns(void);
+
+/* CLOCK_REALTIME deadline ns from now, for pthread_cond_timedwait. */
+void deadline_after(struct timespec *ts, uint64_t ns);
+
+#endif /* LR_THROTTLE_H */
@@ -0,0 +1,320 @@
+#include "wal.h"
+#include "metadata.h"
+#include "throttle.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#define WAL_MAGIC "LRDL"
+#define WAL_HDR   12
+
+/* ------------------------------------------------------------------ */
+/* Commit                                                               */
+/* ------------------------------------------------------------------ */
+
+/* Swap out the buffer and write it as one batch.  Caller holds io_lock. */
+static int commit_locked(lr_wal *w)
+{
+    pthread_mutex_lock(&w->lock);
+    uint32_t    n   = w->n;
+    lr_wal_rec *rec = w->buf;
+    if (n == 0) {
+        pthread_mutex_unlock(&w->lock);
+        return 0;
+    }
+    w->buf       = w->spare;
+    w->spare     = rec;
+    uint32_t cap = w->cap;
+    w->cap       = w->spare_cap;
+    w->spare_cap = cap;
+    w->n         = 0;
+    w->last_commit_ns = throttle_now_ns();
+    pthread_mutex_unlock(&w->lock);
+
+    uint8_t  hdr[WAL_HDR];
+    uint32_t crc = metadata_crc32(rec, (size_t)n * sizeof(*rec));
+    memcpy(hdr, WAL_MAGIC, 4);
+    memcpy(hdr + 4, &n, 4);
+    memcpy(hdr + 8, &crc, 4);
+    struct iovec iov[2] = {
+        { hdr, WAL_HDR },
+        { rec, (size_t)n * sizeof(*rec) },
+    };
+    ssize_t want = (ssize_t)(WAL_HDR + (size_t)n * sizeof(*rec));
+
+    int rc = 0;
+    if (w->fd < 0 || writev(w->fd, iov, 2) != want || fdatasync(w->fd) != 0) {
+        int err = errno;
+        /* Keep the log ending on a whole batch so later ones replay */
+        if (w->fd >= 0 && ftruncate(w->fd, (off_t)w->size) != 0)
+            err = errno;
+        if (!w->failed)
+            fprintf(stderr, "wal: write to '%s' failed: %s; positions are "
+                            "only covered by the next bitmap save\n",
+                    w->path, strerror(err));
+        rc = -1;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    if (rc == 0) {
+        w->size += (uint64_t)want;
+        w->stats.commits++;
+        w->stats.records += n;
+        w->failed = 0;
+    } else {
+        w->stats.failures++;
+        w->failed = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return rc;
+}
+
+int wal_commit(lr_wal *w)
+{
+    pthread_mutex_lock(&w->io_lock);
+    int rc = commit_locked(w);
+    pthread_mutex_unlock(&w->io_lock);
+    return rc;
+}
+
+/*
+ * Group commit: sleep until something is appended, then until commit_ms
+ * after the previous commit, and write everything that came in meanwhile
+ * as one batch with one fdatasync.
+ */
+static void *commit_thread(void *arg)
+{
+    lr_wal  *w        = (lr_wal *)arg;
+    uint64_t interval = (uint64_t)w->commit_ms * 1000000ULL;
+
+    pthread_mutex_lock(&w->lock);
+    while (w->running) {
+        if (w->n == 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+        uint64_t due = w->last_commit_ns + interval;
+        uint64_t now = throttle_now_ns();
+        if (now < due) {
+            struct timespec ts;
+            deadline_after(&ts, due - now);
+            pthread_cond_timedwait(&w->cond, &w->lock, &ts);
+            continue;
+        }
+        pthread_mutex_unlock(&w->lock);
+        wal_commit(w);
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* Open / close                                                         */
+/* ------------------------------------------------------------------ */
+
+int wal_open(lr_wal *w, const char *path, unsigned commit_ms)
+{
+    memset(w, 0, sizeof(*w));
+    snprintf(w->path, sizeof(w->path), "%s", path);
+    w->commit_ms = commit_ms;
+    w->last_commit_ns = throttle_now_ns();
+
+    w->fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (w->fd < 0) {
+        fprintf(stderr, "wal: cannot open '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(w->fd, &st) == 0)
+        w->size = (uint64_t)st.st_size;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_mutex_init(&w->io_lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->running = 1;
+    if (pthread_create(&w->thread, NULL, commit_thread, w) != 0) {
+        fprintf(stderr, "wal: cannot start the committer thread\n");
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->io_lock);
+        pthread_mutex_destroy(&w->lock);
+        close(w->fd);
+        w->fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+void wal_close(lr_wal *w, int remove)
+{
+    pthread_mutex_lock(&w->lock);
+    w->running = 0;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+
+    if (!remove)
+        wal_commit(w);
+    if (w->fd >= 0)
+        close(w->fd);
+    if (remove)
+        unlink(w->path);
+
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->io_lock);
+    pthread_mutex_destroy(&w->lock);
+    free(w->buf);
+    free(w->spare);
+    memset(w, 0, sizeof(*w));
+    w->fd = -1;
+}
+
+/* ------------------------------------------------------------------ */
+/* Append / checkpoint                                                  */
+/* ------------------------------------------------------------------ */
+
+void wal_append(lr_wal *w, uint32_t start, uint32_t count)
+{
+    if (count == 0)
+        return;
+    uint64_t end = (uint64_t)start + count;
+
+    pthread_mutex_lock(&w->lock);
+    if (w->n > 0) {
+        /* Sequential writes extend the last record instead of adding one */
+        lr_wal_rec *last = &w->buf[w->n - 1];
+        uint64_t    lend = (uint64_t)last->start + last->count;
+        if (start >= last->start && start <= lend) {
+            if (end > lend)
+                last->count = (uint32_t)(end - last->start);
+            pthread_mutex_unlock(&w->lock);
+            return;
+        }
+    }
+    if (w->n == w->cap) {
+        uint32_t    cap = w->cap ? w->cap * 2 : 256;
+        lr_wal_rec *buf = realloc(w->buf, (size_t)cap * sizeof(*buf));
+        if (!buf) {
+            w->stats.failures++;
+            pthread_mutex_unlock(&w->lock);
+            fprintf(stderr, "wal: out of memory, positions %u+%u not "
+                            "logged\n", start, count);
+            return;
+        }
+        w->buf = buf;
+        w->cap = cap;
+    }
+    w->buf[w->n++] = (lr_wal_rec){ start, count };
+    if (w->n == 1)
+        pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+int wal_checkpoint(lr_wal *w, void (*snapshot)(void *arg),
+                   int (*save)(void *arg), void *arg)
+{
+    /* No commit can run until the truncate, so every record in the file
+     * had its bits set before the snapshot.  Buffered records are kept:
+     * they go to the emptied log, and survive a failed save. */
+    pthread_mutex_lock(&w->io_lock);
+    snapshot(arg);
+
+    int rc = save(arg);
+    if (rc == 0 && w->fd >= 0 && w->size > 0) {
+        if (ftruncate(w->fd, 0) == 0) {
+            pthread_mutex_lock(&w->lock);
+            w->size = 0;
+            w->stats.checkpoints++;
+            pthread_mutex_unlock(&w->lock);
+        } else {
+            fprintf(stderr, "wal: truncate '%s' failed: %s\n",
+                    w->path, strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&w->io_lock);
+    return rc;
+}
+
+uint64_t wal_size(lr_wal *w)
+{
+    pthread_mutex_lock(&w->lock);
+    uint64_t size = w->size;
+    pthread_mutex_unlock(&w->lock);
+    return size;
+}
+
+void wal_get_stats(lr_wal *w, lr_wal_stats *st)
+{
+    pthread_mutex_lock(&w->lock);
+    *st           = w->stats;
+    st->log_bytes = w->size;
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* ------------------------------------------------------------------ */
+/* Replay                                                               */
+/* ------------------------------------------------------------------ */
+
+uint64_t wal_replay(const char *path,
+                    void (*fn)(void *arg, uint32_t start, uint32_t count),
+                    void *arg)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    uint64_t    replayed = 0;
+    uint64_t    off      = 0;
+    lr_wal_rec *rec      = NULL;
+    size_t      cap      = 0;
+    while (1) {
+        uint8_t  hdr[WAL_HDR];
+        uint32_t n, crc;
+        ssize_t  got = pread(fd, hdr, WAL_HDR, (off_t)off);
+        if (got == 0)
+            break;
+        if (got != WAL_HDR || memcmp(hdr, WAL_MAGIC, 4) != 0)
+            goto torn;
+        memcpy(&n, hdr + 4, 4);
+        memcpy(&crc, hdr + 8, 4);
+        if (n == 0 || n > (UINT32_MAX / sizeof(*rec)))
+            goto torn;
+        if (n > cap) {
+            lr_wal_rec *r = realloc(rec, (size_t)n * sizeof(*rec));
+            if (!r) {
+                fprintf(stderr, "wal: out of memory replaying '%s'\n", path);
+                break;
+            }
+            rec = r;
+            cap = n;
+        }
+        size_t len = (size_t)n * sizeof(*rec);
+        if (pread(fd, rec, len, (off_t)(off + WAL_HDR)) != (ssize_t)len ||
+            metadata_crc32(rec, len) != crc)
+            goto torn;
+
+        for (uint32_t i = 0; i < n; i++)
+            if (rec[i].count > 0 &&
+                (uint64_t)rec[i].start + rec[i].count <= (uint64_t)UINT32_MAX + 1)
+                fn(arg, rec[i].start, rec[i].count);
+        replayed += n;
+        off      += WAL_HDR + len;
+        continue;
+
+torn:
+        fprintf(stderr, "wal: batch at offset %llu of '%s' is torn or fails "
+                        "its checksum, ignoring the rest of the log\n",
+                (unsigned long long)off, path);
+        break;
+    }
+    free(rec);
+    close(fd);
+    return replayed;
+}
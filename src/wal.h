@@ -0,0 +1,108 @@
+#ifndef LR_WAL_H
+#define LR_WAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <limits.h>
+
+/*
+ * Dirty-range write-ahead log (<content_path>.bitmap.log).
+ *
+ * The bitmap file alone is only as fresh as the last periodic save, so a
+ * crash between saves leaves parity silently stale wherever writes landed
+ * since.  With the log on, journal_mark_dirty_range (and an accepted
+ * journal_delta_add) appends (start, count) here after setting its bits.
+ * A committer thread writes what accumulated as one batch and fdatasyncs
+ * it, at most every commit_ms, so the cost follows the write rate and a
+ * crash loses at most the last commit_ms of marks.
+ *
+ * A checkpoint captures a snapshot (the bitmap save) with commits held
+ * off: every record in the file had its bits set before it was appended,
+ * so the snapshot covers it, and once the snapshot is on disk the log is
+ * truncated.  Records still buffered are committed to the emptied log.
+ * At mount the bitmap file and then the log are merged into the dirty
+ * bitmap.
+ *
+ * Each batch is a 12-byte header followed by its records, host byte
+ * order:
+ *
+ *   magic[4]  "LRDL"
+ *   nrec[4]   uint32_t
+ *   crc[4]    uint32_t, CRC32 of the records
+ *   records   lr_wal_rec[nrec]
+ *
+ * Replay stops at the first batch that is torn or fails its CRC.
+ */
+
+/* Log size at which the journal worker checkpoints early */
+#define LR_WAL_CHECKPOINT_BYTES (8u << 20)
+
+typedef struct {
+    uint32_t start;
+    uint32_t count;
+} lr_wal_rec;
+
+typedef struct {
+    uint64_t commits;      /* batches written */
+    uint64_t records;      /* records written */
+    uint64_t log_bytes;    /* current size of the log */
+    uint64_t checkpoints;  /* truncations after a snapshot */
+    uint64_t failures;     /* writes that failed (records lost) */
+} lr_wal_stats;
+
+typedef struct lr_wal {
+    pthread_mutex_t lock;       /* buf, counters, running */
+    pthread_cond_t  cond;       /* records appended, or stop */
+    lr_wal_rec     *buf;        /* records not yet written */
+    uint32_t        n, cap;
+    lr_wal_rec     *spare;      /* the other buffer, swapped in by a commit */
+    uint32_t        spare_cap;
+
+    pthread_mutex_t io_lock;    /* fd: one commit or checkpoint at a time */
+    int             fd;
+    char            path[PATH_MAX];
+    uint64_t        size;       /* bytes in the log file */
+    int             failed;     /* last write failed (reported once) */
+
+    pthread_t       thread;
+    int             running;
+    unsigned        commit_ms;
+    uint64_t        last_commit_ns;
+
+    lr_wal_stats    stats;
+} lr_wal;
+
+/* Open (creating it if needed) the log at `path` for appending, keeping
+ * what it holds, and start the committer.  Returns 0 or -1. */
+int  wal_open(lr_wal *w, const char *path, unsigned commit_ms);
+
+/* Commit what is buffered and stop the committer.  remove = 1 deletes
+ * the log (clean shutdown). */
+void wal_close(lr_wal *w, int remove);
+
+/* Log [start, start+count) as dirty; merged with the previous record
+ * when they touch.  Call after setting the bits. */
+void wal_append(lr_wal *w, uint32_t start, uint32_t count);
+
+/* Write and fdatasync what is buffered now, ahead of the committer. */
+int  wal_commit(lr_wal *w);
+
+/*
+ * Checkpoint.  snapshot(arg) runs with commits held off and must capture
+ * every bit set so far; save(arg) then persists it and returns 0 on
+ * success, after which the log is truncated.  Returns what save
+ * returned.
+ */
+int  wal_checkpoint(lr_wal *w, void (*snapshot)(void *arg),
+                    int (*save)(void *arg), void *arg);
+
+uint64_t wal_size(lr_wal *w);
+void     wal_get_stats(lr_wal *w, lr_wal_stats *st);
+
+/* Call fn for every record of the log at `path`, batch by batch.
+ * Returns the records replayed (0 when there is no log). */
+uint64_t wal_replay(const char *path,
+                    void (*fn)(void *arg, uint32_t start, uint32_t count),
+                    void *arg);
+
+#endif /* LR_WAL_H */
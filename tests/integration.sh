@@ -20,8 +20,9 @@
 #   8. Multiple content paths: both written on save, secondary used when primary missing
 #   9. Empty files: size=0 created and survives remount
 #  10. Directory metadata: chmod and utimens persist across remount
-#  11. Control socket: scrub and scrub repair return 0 mismatches
+#  11. Control socket: scrub, scrub repair and a scrub range return 0 mismatches
 #  12. Position reuse: parity position freed by unlink is reused by next alloc
+#      + parity hole punch: an unlinked file's parity blocks are deallocated
 #  13. chown: uid/gid on files and dirs, immediate + remount persistence
 #  14. Placement policies: mostfree, lfs, pfrd smoke test (8 files + parity clean)
 #  15. Symlinks: create, readlink, getattr S_IFLNK, readdir, persistence, unlink
@@ -433,6 +434,23 @@ echo "  scrub repair: $repair_result"
 echo "$repair_result" | grep -qP "^done \d+ 0 fixed=0 errors=0$" \
     && pass "socket scrub repair: 0 mismatches, 0 fixed" \
     || fail "socket scrub repair" "$repair_result"
+
+range_result=$(python3 -c "
+import socket
+s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+s.connect('$ctrl')
+s.sendall(b'scrub 0 1\n')
+data = b''
+while True:
+    chunk = s.recv(4096)
+    if not chunk: break
+    data += chunk
+print(data.decode().strip())
+")
+echo "  scrub 0 1: $range_result"
+echo "$range_result" | grep -qP "^done 1 0 errors=0$" \
+    && pass "socket scrub range: 1 position checked" \
+    || fail "socket scrub range" "$range_result"
 unmount_fs
 
 # ===================================================================
@@ -467,6 +485,27 @@ echo "  pos_b.txt at parity position $pos"
     && pass "position reuse: freed position reused by next allocation" \
     || fail "position reuse" "pos=$pos (expected 0)"
 
+# ===================================================================
+echo ""
+echo "=== Parity hole punch after delete ==="
+wipe_data
+$BIN -c /tmp/lrt/single.conf -f $MNT >>/tmp/lrt/liveraid.log 2>&1 &
+sleep 1.5
+if ! grep -q lrt /proc/mounts; then
+    echo "ERROR: mount failed"; tail -5 /tmp/lrt/liveraid.log; exit 1
+fi
+
+dd if=/dev/urandom of=$MNT/punch.bin bs=64K count=64 2>/dev/null
+sleep 1                        # let the drain write the parity
+before=$(stat -c %b /tmp/lrt/parity1/liveraid.parity)
+rm $MNT/punch.bin
+unmount_fs                     # journal_flush drains the freed positions
+after=$(stat -c %b /tmp/lrt/parity1/liveraid.parity)
+echo "  parity blocks: $before before delete, $after after"
+[ "$before" -gt 0 ] && [ "$after" -lt $((before / 4)) ] \
+    && pass "hole punch: freed positions deallocated from parity" \
+    || fail "hole punch" "before=$before after=$after"
+
 # ===================================================================
 echo ""
 echo "=== chown: uid/gid on files and dirs ==="
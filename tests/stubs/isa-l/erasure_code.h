@@ -0,0 +1,10 @@
+#ifndef LR_TEST_STUB_ERASURE_CODE_H
+#define LR_TEST_STUB_ERASURE_CODE_H
+
+/*
+ * Empty stand-in for ISA-L's header, so tests can include parity.h (for
+ * its declarations) without ISA-L installed.  Tests that do so provide
+ * their own parity_* functions and never call into ISA-L.
+ */
+
+#endif /* LR_TEST_STUB_ERASURE_CODE_H */
@@ -5,17 +5,28 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* The i-th free extent in address order ({0, 0} past the end) */
+static lr_extent ext_at(const lr_pos_allocator *a, uint32_t i)
+{
+    lr_extent e = { 0, 0 };
+    for (uint32_t pos = 0; alloc_next_extent(a, pos, &e);
+         pos = e.start + e.count)
+        if (i-- == 0)
+            return e;
+    return (lr_extent){ 0, 0 };
+}
+
 static void test_init_done(void)
 {
     lr_pos_allocator a;
     alloc_init(&a);
     ASSERT_INT_EQ(a.next_free,  0);
-    ASSERT(a.extents == NULL);
+    ASSERT(a.nodes == NULL);
     ASSERT_INT_EQ(a.ext_count,  0);
-    ASSERT_INT_EQ(a.ext_cap,    0);
+    ASSERT_INT_EQ(a.free_count, 0);
     alloc_done(&a);
     ASSERT_INT_EQ(a.next_free,  0);
-    ASSERT(a.extents == NULL);
+    ASSERT(a.nodes == NULL);
 }
 
 /* alloc(0) probes the high-water mark without advancing it. */
@@ -64,8 +75,8 @@ static void test_free_creates_extent(void)
     alloc_positions(&a, 8);
     free_positions(&a, 2, 3);
     ASSERT_INT_EQ(a.ext_count,            1);
-    ASSERT_INT_EQ(a.extents[0].start,     2);
-    ASSERT_INT_EQ(a.extents[0].count,     3);
+    ASSERT_INT_EQ(ext_at(&a, 0).start,     2);
+    ASSERT_INT_EQ(ext_at(&a, 0).count,     3);
     ASSERT_INT_EQ(a.next_free,            8);   /* high-water unchanged */
     alloc_done(&a);
 }
@@ -79,8 +90,8 @@ static void test_free_merge_left_neighbor(void)
     free_positions(&a, 4, 4);           /* extent [4,8) */
     free_positions(&a, 2, 2);           /* [2,4) abuts [4,8) on right → merge */
     ASSERT_INT_EQ(a.ext_count,            1);
-    ASSERT_INT_EQ(a.extents[0].start,     2);
-    ASSERT_INT_EQ(a.extents[0].count,     6);
+    ASSERT_INT_EQ(ext_at(&a, 0).start,     2);
+    ASSERT_INT_EQ(ext_at(&a, 0).count,     6);
     alloc_done(&a);
 }
 
@@ -93,8 +104,8 @@ static void test_free_merge_right_neighbor(void)
     free_positions(&a, 2, 2);           /* extent [2,4) */
     free_positions(&a, 4, 2);           /* [4,6) abuts [2,4) on left → merge */
     ASSERT_INT_EQ(a.ext_count,            1);
-    ASSERT_INT_EQ(a.extents[0].start,     2);
-    ASSERT_INT_EQ(a.extents[0].count,     4);
+    ASSERT_INT_EQ(ext_at(&a, 0).start,     2);
+    ASSERT_INT_EQ(ext_at(&a, 0).count,     4);
     alloc_done(&a);
 }
 
@@ -126,8 +137,8 @@ static void test_alloc_reuses_free_extent(void)
     free_positions(&a, 2, 4);           /* free [2,6) */
     ASSERT_INT_EQ(alloc_positions(&a, 2),  2);   /* first-fit from [2,6) */
     ASSERT_INT_EQ(a.ext_count,             1);
-    ASSERT_INT_EQ(a.extents[0].start,      4);   /* remainder [4,6) */
-    ASSERT_INT_EQ(a.extents[0].count,      2);
+    ASSERT_INT_EQ(ext_at(&a, 0).start,      4);   /* remainder [4,6) */
+    ASSERT_INT_EQ(ext_at(&a, 0).count,      2);
     ASSERT_INT_EQ(a.next_free,             8);   /* bump not touched */
     alloc_done(&a);
 }
@@ -145,7 +156,7 @@ static void test_alloc_exact_fit_removes_extent(void)
     alloc_done(&a);
 }
 
-/* alloc skips extents that are too small (first-fit). */
+/* alloc skips extents that are too small. */
 static void test_alloc_first_fit_skips_small(void)
 {
     lr_pos_allocator a;
@@ -155,8 +166,8 @@ static void test_alloc_first_fit_skips_small(void)
     free_positions(&a, 5, 3);           /* [5,8) */
     ASSERT_INT_EQ(a.ext_count, 2);
     ASSERT_INT_EQ(alloc_positions(&a, 2), 5);   /* [1,2) too small; use [5,8) */
-    ASSERT_INT_EQ(a.extents[0].start,  1);      /* tiny extent still present */
-    ASSERT_INT_EQ(a.extents[1].start,  7);      /* remainder [7,8) */
+    ASSERT_INT_EQ(ext_at(&a, 0).start,  1);      /* tiny extent still present */
+    ASSERT_INT_EQ(ext_at(&a, 1).start,  7);      /* remainder [7,8) */
     alloc_done(&a);
 }
 
@@ -183,9 +194,198 @@ static void test_free_multiple_extents_sorted(void)
     free_positions(&a, 3, 1);
     free_positions(&a, 1, 1);
     ASSERT_INT_EQ(a.ext_count,         3);
-    ASSERT_INT_EQ(a.extents[0].start,  1);
-    ASSERT_INT_EQ(a.extents[1].start,  3);
-    ASSERT_INT_EQ(a.extents[2].start,  7);
+    ASSERT_INT_EQ(ext_at(&a, 0).start,  1);
+    ASSERT_INT_EQ(ext_at(&a, 1).start,  3);
+    ASSERT_INT_EQ(ext_at(&a, 2).start,  7);
+    alloc_done(&a);
+}
+
+/* Bulk load matches the same extents freed one at a time; bad lists are
+ * rejected without touching the allocator. */
+static void test_set_extents(void)
+{
+    lr_pos_allocator a;
+    alloc_init(&a);
+    a.next_free = 100;
+    lr_extent ext[3] = { { 1, 2 }, { 10, 5 }, { 50, 10 } };
+    ASSERT_INT_EQ(alloc_set_extents(&a, ext, 3), 0);
+    ASSERT_INT_EQ(a.ext_count,        3);
+    ASSERT_INT_EQ(ext_at(&a, 1).start, 10);
+    ASSERT_INT_EQ(alloc_positions(&a, 4), 10);  /* best fit */
+
+    lr_extent unsorted[2] = { { 10, 5 }, { 1, 2 } };
+    lr_extent touching[2] = { { 1, 2 }, { 3, 5 } };
+    lr_extent past_end[1] = { { 95, 10 } };
+    lr_extent at_end[1]   = { { 90, 10 } };
+    ASSERT_INT_EQ(alloc_set_extents(&a, unsorted, 2), -1);
+    ASSERT_INT_EQ(alloc_set_extents(&a, touching, 2), -1);
+    ASSERT_INT_EQ(alloc_set_extents(&a, past_end, 1), -1);
+    ASSERT_INT_EQ(alloc_set_extents(&a, at_end,   1), -1);
+    ASSERT_INT_EQ(a.ext_count, 3);
+
+    ASSERT_INT_EQ(alloc_set_extents(&a, NULL, 0), 0);
+    ASSERT_INT_EQ(a.ext_count, 0);
+    alloc_done(&a);
+}
+
+/* The smallest extent that fits wins, the lowest start among equals. */
+static void test_alloc_best_fit(void)
+{
+    lr_pos_allocator a;
+    alloc_init(&a);
+    a.next_free = 100;
+    lr_extent ext[4] = { { 0, 10 }, { 20, 3 }, { 30, 5 }, { 40, 3 } };
+    ASSERT_INT_EQ(alloc_set_extents(&a, ext, 4), 0);
+    ASSERT_INT_EQ(alloc_positions(&a, 3), 20);  /* exact, lower of two */
+    ASSERT_INT_EQ(alloc_positions(&a, 4), 30);  /* 5 beats 10 */
+    ASSERT_INT_EQ(alloc_positions(&a, 4),  0);  /* [34,35) too small now */
+    ASSERT_INT_EQ(alloc_positions(&a, 1), 34);
+    ASSERT_INT_EQ(a.ext_count,  2);
+    ASSERT_INT_EQ(a.free_count, 9);
+    ASSERT_INT_EQ(ext_at(&a, 0).start, 4);
+    ASSERT_INT_EQ(ext_at(&a, 1).start, 40);
+    alloc_done(&a);
+}
+
+/* Compaction allocates from the lowest extent that fits, below a limit. */
+static void test_alloc_positions_low(void)
+{
+    lr_pos_allocator a;
+    alloc_init(&a);
+    a.next_free = 100;
+    lr_extent ext[3] = { { 5, 2 }, { 20, 8 }, { 40, 3 } };
+    ASSERT_INT_EQ(alloc_set_extents(&a, ext, 3), 0);
+    ASSERT_INT_EQ(alloc_positions_low(&a, 3, 15), UINT32_MAX);
+    ASSERT_INT_EQ(alloc_positions_low(&a, 9, 100), UINT32_MAX);
+    ASSERT_INT_EQ(alloc_positions_low(&a, 3, 100), 20);   /* not best fit */
+    ASSERT_INT_EQ(alloc_positions_low(&a, 2, 100), 5);
+    ASSERT_INT_EQ(alloc_positions_low(&a, 0, 100), UINT32_MAX);
+    ASSERT_INT_EQ(a.next_free, 100);
+    ASSERT_INT_EQ(a.ext_count, 2);
+    ASSERT_INT_EQ(ext_at(&a, 0).start, 23);
+    alloc_done(&a);
+}
+
+/* Freeing a range that is already free is refused. */
+static void test_free_overlap_refused(void)
+{
+    lr_pos_allocator a;
+    alloc_init(&a);
+    alloc_positions(&a, 20);
+    free_positions(&a, 5, 5);
+    free_positions(&a, 8, 4);           /* overlaps [5,10) */
+    free_positions(&a, 3, 3);           /* overlaps from the left */
+    free_positions(&a, 5, 5);           /* twice */
+    ASSERT_INT_EQ(a.ext_count,  1);
+    ASSERT_INT_EQ(a.free_count, 5);
+    ASSERT_INT_EQ(ext_at(&a, 0).start, 5);
+    ASSERT_INT_EQ(ext_at(&a, 0).count, 5);
+    alloc_done(&a);
+}
+
+/* Random allocs and frees against a bitmap of the same space: the extents
+ * must be exactly the free runs below next_free, and every allocation from
+ * them must be a best fit. */
+#define MODEL_SPACE 2048
+
+static int model_check(const lr_pos_allocator *a, const unsigned char *used)
+{
+    uint32_t top = 0, runs = 0;
+    uint64_t free_n = 0;
+    for (uint32_t i = 0; i < MODEL_SPACE; i++)
+        if (used[i])
+            top = i + 1;
+    if (a->next_free != top)
+        return 0;
+    lr_extent e;
+    uint32_t  pos = 0;
+    for (uint32_t i = 0; i < top; ) {
+        if (used[i]) {
+            i++;
+            continue;
+        }
+        uint32_t j = i;
+        while (j < top && !used[j])
+            j++;
+        if (!alloc_next_extent(a, pos, &e) || e.start != i ||
+            e.count != j - i)
+            return 0;
+        pos = e.start + e.count;
+        runs++;
+        free_n += j - i;
+        i = j;
+    }
+    return !alloc_next_extent(a, pos, &e) && a->ext_count == runs &&
+           a->free_count == free_n;
+}
+
+static void test_alloc_random_model(void)
+{
+    static unsigned char used[MODEL_SPACE];
+    static lr_extent     live[MODEL_SPACE];
+    uint32_t nlive = 0, seed = 12345, bad = 0;
+    lr_pos_allocator a;
+    alloc_init(&a);
+    memset(used, 0, sizeof(used));
+
+    for (int step = 0; step < 20000 && !bad; step++) {
+        seed = seed * 1103515245u + 12345u;
+        uint32_t r = seed >> 8;
+        if (nlive > 0 && (r % 2 == 0 || a.next_free > MODEL_SPACE - 64)) {
+            uint32_t k = (r >> 1) % nlive;
+            free_positions(&a, live[k].start, live[k].count);
+            memset(used + live[k].start, 0, live[k].count);
+            live[k] = live[--nlive];
+        } else {
+            uint32_t n = 1 + (r >> 1) % 16;
+            /* Best fit the model expects: smallest run that holds n */
+            uint32_t want = a.next_free, want_len = UINT32_MAX;
+            for (uint32_t i = 0; i < a.next_free; ) {
+                if (used[i]) {
+                    i++;
+                    continue;
+                }
+                uint32_t j = i;
+                while (j < a.next_free && !used[j])
+                    j++;
+                if (j - i >= n && j - i < want_len) {
+                    want     = i;
+                    want_len = j - i;
+                }
+                i = j;
+            }
+            uint32_t start = alloc_positions(&a, n);
+            if (start != want) {
+                bad = 1;
+                break;
+            }
+            memset(used + start, 1, n);
+            live[nlive++] = (lr_extent){ start, n };
+        }
+        if (!model_check(&a, used))
+            bad = 1;
+    }
+    ASSERT_INT_EQ(bad, 0);
+
+    /* Bulk load of the same list gives the same allocator */
+    lr_extent *copy = malloc((a.ext_count + 1) * sizeof(lr_extent));
+    uint32_t   n = 0;
+    lr_extent  e;
+    for (uint32_t pos = 0; alloc_next_extent(&a, pos, &e);
+         pos = e.start + e.count)
+        copy[n++] = e;
+    uint32_t expect = n;
+    ASSERT_INT_EQ(alloc_set_extents(&a, copy, n), 0);
+    ASSERT_INT_EQ(a.ext_count, expect);
+    ASSERT(model_check(&a, used));
+    free(copy);
+
+    /* Free everything: back to empty */
+    for (uint32_t k = 0; k < nlive; k++)
+        free_positions(&a, live[k].start, live[k].count);
+    ASSERT_INT_EQ(a.next_free, 0);
+    ASSERT_INT_EQ(a.ext_count, 0);
+    ASSERT_INT_EQ(a.free_count, 0);
     alloc_done(&a);
 }
 
@@ -205,5 +405,10 @@ int main(void)
     RUN(test_alloc_first_fit_skips_small);
     RUN(test_alloc_falls_back_to_bump);
     RUN(test_free_multiple_extents_sorted);
+    RUN(test_set_extents);
+    RUN(test_alloc_best_fit);
+    RUN(test_alloc_positions_low);
+    RUN(test_free_overlap_refused);
+    RUN(test_alloc_random_model);
     REPORT();
 }
@@ -0,0 +1,237 @@
+#include "test_harness.h"
+#include "compact.h"
+#include "state.h"
+#include "config.h"
+#include "alloc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static void make_config(lr_config *cfg, unsigned drive_count)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->block_size       = 65536;
+    cfg->placement_policy = LR_PLACE_ROUNDROBIN;
+    cfg->parity_threads   = 1;
+    for (unsigned i = 0; i < drive_count; i++) {
+        snprintf(cfg->drives[i].name, 64,       "d%u", i);
+        snprintf(cfg->drives[i].dir,  PATH_MAX, "/tmp/lr_test_drive%u", i);
+    }
+    cfg->drive_count = drive_count;
+    snprintf(cfg->content_paths[0], PATH_MAX, "/tmp/lr_test_compact.content");
+    cfg->content_count = 1;
+    snprintf(cfg->mountpoint, PATH_MAX, "/tmp/lr_test_mount");
+}
+
+static lr_file *add_file(lr_state *s, const char *vpath, unsigned drive,
+                         uint32_t start, uint32_t count)
+{
+    lr_file *f = calloc(1, sizeof(lr_file));
+    state_set_path(s, &f->vpath, vpath);
+    f->drive_idx        = drive;
+    f->parity_pos_start = start;
+    f->block_count      = count;
+    f->size             = (int64_t)count * s->cfg.block_size;
+    f->mode             = S_IFREG | 0644;
+    state_insert_file(s, f);
+    state_pos_index_insert(s, f);
+    return f;
+}
+
+/* Records the ranges passed to the callbacks */
+typedef struct {
+    unsigned  nmark, nflush;
+    lr_extent mark[16], flush[16];
+} calls;
+
+static void rec_mark(void *arg, uint32_t start, uint32_t count)
+{
+    calls *c = arg;
+    if (c->nmark < 16)
+        c->mark[c->nmark++] = (lr_extent){ start, count };
+}
+
+static void rec_flush(void *arg, uint32_t start, uint32_t count)
+{
+    calls *c = arg;
+    if (c->nflush < 16)
+        c->flush[c->nflush++] = (lr_extent){ start, count };
+}
+
+/* Run one pass to completion */
+static int run_pass(lr_compact *cp, int drive, lr_compact_result *r)
+{
+    uint64_t id = compact_start(cp, drive);
+    if (id == 0)
+        return 0;
+    int rc;
+    while ((rc = compact_wait(cp, id, 1000, r)) == 0)
+        ;
+    return rc;
+}
+
+/* The top file slides down into the hole right below it, although the
+ * hole is smaller than the file; both ranges are marked, and flushed in
+ * one call because they overlap. */
+static void test_slide_down(void)
+{
+    lr_config cfg;
+    lr_state  s;
+    make_config(&cfg, 1);
+    ASSERT_INT_EQ(state_init(&s, &cfg), 0);
+    add_file(&s, "/a", 0, 0, 4);
+    lr_file *b = add_file(&s, "/b", 0, 10, 8);
+    state_rebuild_allocator(&s, 0);
+    ASSERT_INT_EQ(s.drives[0].pos_alloc.next_free, 18);
+
+    calls      c;
+    lr_compact cp;
+    memset(&c, 0, sizeof(c));
+    ASSERT_INT_EQ(compact_init(&cp, &s, 0, rec_mark, rec_flush, &c), 0);
+    lr_compact_result r;
+    ASSERT_INT_EQ(run_pass(&cp, LR_COMPACT_ALL, &r), 1);
+    ASSERT_INT_EQ(r.files_moved,  1);
+    ASSERT_INT_EQ(r.blocks_moved, 8);
+    ASSERT_INT_EQ(r.files_busy,   0);
+    ASSERT_INT_EQ(r.limit_before, 18);
+    ASSERT_INT_EQ(r.limit_after,  12);
+
+    ASSERT_INT_EQ(b->parity_pos_start, 4);
+    ASSERT_INT_EQ(s.drives[0].pos_alloc.next_free, 12);
+    ASSERT_INT_EQ(s.drives[0].pos_alloc.ext_count, 0);
+    ASSERT(state_find_file_at_pos(&s, 0, 11) == b);
+    ASSERT(state_find_file_at_pos(&s, 0, 12) == NULL);
+
+    ASSERT_INT_EQ(c.nmark, 2);
+    ASSERT_INT_EQ(c.mark[0].start, 10);
+    ASSERT_INT_EQ(c.mark[0].count, 8);
+    ASSERT_INT_EQ(c.mark[1].start, 4);
+    ASSERT_INT_EQ(c.mark[1].count, 8);
+    ASSERT_INT_EQ(c.nflush, 1);
+    ASSERT_INT_EQ(c.flush[0].start, 4);
+    ASSERT_INT_EQ(c.flush[0].count, 14);
+
+    compact_done(&cp);
+    state_done(&s);
+}
+
+/* Files go to the lowest extent that holds them, not the best fit; a
+ * move that leaves the ranges apart flushes each one. */
+static void test_lowest_extent(void)
+{
+    lr_config cfg;
+    lr_state  s;
+    make_config(&cfg, 1);
+    ASSERT_INT_EQ(state_init(&s, &cfg), 0);
+    add_file(&s, "/a", 0, 0, 2);
+    add_file(&s, "/c", 0, 5, 1);
+    lr_file *d = add_file(&s, "/d", 0, 20, 3);
+    lr_file *e = add_file(&s, "/e", 0, 23, 3);
+    state_rebuild_allocator(&s, 0);     /* free [2,5) and [6,20) */
+
+    calls      c;
+    lr_compact cp;
+    memset(&c, 0, sizeof(c));
+    ASSERT_INT_EQ(compact_init(&cp, &s, 0, rec_mark, rec_flush, &c), 0);
+    lr_compact_result r;
+    ASSERT_INT_EQ(run_pass(&cp, LR_COMPACT_ALL, &r), 1);
+    ASSERT_INT_EQ(r.files_moved, 2);
+    ASSERT_INT_EQ(r.limit_after, 9);
+    ASSERT_INT_EQ(e->parity_pos_start, 2);
+    ASSERT_INT_EQ(d->parity_pos_start, 6);
+    ASSERT(state_find_file_at_pos(&s, 0, 3) == e);
+    ASSERT(state_find_file_at_pos(&s, 0, 8) == d);
+    ASSERT_INT_EQ(s.drives[0].pos_alloc.next_free, 9);
+    ASSERT_INT_EQ(s.drives[0].pos_alloc.ext_count, 0);
+
+    ASSERT_INT_EQ(c.nflush, 4);
+    ASSERT_INT_EQ(c.flush[0].start, 2);     /* e: [23,26) -> [2,5) */
+    ASSERT_INT_EQ(c.flush[1].start, 23);
+    ASSERT_INT_EQ(c.flush[2].start, 6);     /* d: [20,23) -> [6,9) */
+    ASSERT_INT_EQ(c.flush[3].start, 20);
+    ASSERT_INT_EQ(c.flush[3].count, 3);
+
+    /* Nothing left to do */
+    memset(&c, 0, sizeof(c));
+    ASSERT_INT_EQ(run_pass(&cp, LR_COMPACT_ALL, &r), 1);
+    ASSERT_INT_EQ(r.files_moved, 0);
+    ASSERT_INT_EQ(c.nmark, 0);
+
+    lr_compact_status st;
+    compact_get_status(&cp, &st);
+    ASSERT_INT_EQ(st.active, 0);
+    ASSERT_INT_EQ(st.passes, 2);
+    ASSERT_INT_EQ(compact_stop(&cp), 0);
+    compact_done(&cp);
+    state_done(&s);
+}
+
+/* An open top file stays put and ends that drive's walk. */
+static void test_busy_top_file(void)
+{
+    lr_config cfg;
+    lr_state  s;
+    make_config(&cfg, 1);
+    ASSERT_INT_EQ(state_init(&s, &cfg), 0);
+    add_file(&s, "/a", 0, 0, 2);
+    lr_file *b = add_file(&s, "/b", 0, 10, 2);
+    state_rebuild_allocator(&s, 0);
+    state_open_inc(b);
+
+    lr_compact cp;
+    ASSERT_INT_EQ(compact_init(&cp, &s, 0, NULL, NULL, NULL), 0);
+    lr_compact_result r;
+    ASSERT_INT_EQ(run_pass(&cp, LR_COMPACT_ALL, &r), 1);
+    ASSERT_INT_EQ(r.files_moved, 0);
+    ASSERT_INT_EQ(r.files_busy,  1);
+    ASSERT_INT_EQ(b->parity_pos_start, 10);
+    ASSERT_INT_EQ(s.drives[0].pos_alloc.next_free, 12);
+
+    state_open_dec(b);
+    ASSERT_INT_EQ(run_pass(&cp, LR_COMPACT_ALL, &r), 1);
+    ASSERT_INT_EQ(r.files_moved, 1);
+    ASSERT_INT_EQ(b->parity_pos_start, 2);
+    compact_done(&cp);
+    state_done(&s);
+}
+
+/* A pass over one drive leaves the others alone. */
+static void test_one_drive(void)
+{
+    lr_config cfg;
+    lr_state  s;
+    make_config(&cfg, 2);
+    ASSERT_INT_EQ(state_init(&s, &cfg), 0);
+    lr_file *x = add_file(&s, "/x", 0, 50, 5);
+    lr_file *y = add_file(&s, "/y", 1, 30, 5);
+    state_rebuild_allocator(&s, 0);
+    state_rebuild_allocator(&s, 1);
+
+    lr_compact cp;
+    ASSERT_INT_EQ(compact_init(&cp, &s, 0, NULL, NULL, NULL), 0);
+    lr_compact_result r;
+    ASSERT_INT_EQ(run_pass(&cp, 1, &r), 1);
+    ASSERT_INT_EQ(r.files_moved,  1);
+    ASSERT_INT_EQ(r.limit_before, 55);
+    ASSERT_INT_EQ(r.limit_after,  55);    /* drive 0 still reaches 55 */
+    ASSERT_INT_EQ(y->parity_pos_start, 0);
+    ASSERT_INT_EQ(x->parity_pos_start, 50);
+
+    ASSERT_INT_EQ(run_pass(&cp, LR_COMPACT_ALL, &r), 1);
+    ASSERT_INT_EQ(r.files_moved, 1);
+    ASSERT_INT_EQ(r.limit_after, 5);
+    ASSERT_INT_EQ(x->parity_pos_start, 0);
+    compact_done(&cp);
+    state_done(&s);
+}
+
+int main(void)
+{
+    printf("test_compact\n");
+    RUN(test_slide_down);
+    RUN(test_lowest_extent);
+    RUN(test_busy_top_file);
+    RUN(test_one_drive);
+    REPORT();
+}
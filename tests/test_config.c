@@ -33,7 +33,7 @@ static void test_minimal_valid(void)
     ASSERT_STR_EQ(cfg.mountpoint,        "/tmp/lr_mount");
 }
 
-/* Default blocksize, placement, parity_threads, bitmap_interval_s when not specified. */
+/* Default blocksize, placement, parity_threads, bitmap_interval_s, delta_parity, fd_cache, io_engine, degraded cache, rebuild_rate, scrub_rate, scrub_daily, compact_rate, drain caps, kernel cache timeouts, splice, FUSE profile, parity stripe and direct I/O, parity_code, content_format, metadata_log, metadata_compact, dirty_log, cache when not specified. */
 static void test_defaults(void)
 {
     write_conf(
@@ -48,15 +48,49 @@ static void test_defaults(void)
     ASSERT_INT_EQ(cfg.parity_threads,     1);
     ASSERT_INT_EQ(cfg.parity_levels,      0);
     ASSERT_INT_EQ(cfg.bitmap_interval_s,  0); /* 0 = runtime default (300s) */
+    ASSERT_INT_EQ(cfg.delta_parity_mb,    64);
+    ASSERT_INT_EQ(cfg.fd_cache,           256);
+    ASSERT_INT_EQ(cfg.io_engine,          LR_IO_SYNC);
+    ASSERT_INT_EQ(cfg.io_depth,           64);
+    ASSERT_INT_EQ(cfg.degraded_cache_mb,  32);
+    ASSERT_INT_EQ(cfg.degraded_readahead, 8);
+    ASSERT_INT_EQ(cfg.rebuild_rate_mb,    0);
+    ASSERT_INT_EQ(cfg.scrub_rate_mb,      0);
+    ASSERT_INT_EQ(cfg.scrub_daily_pct,    0);
+    ASSERT_INT_EQ(cfg.compact_rate_mb,    0);
+    ASSERT_INT_EQ(cfg.drain_max_dirty_mb, 0);
+    ASSERT_INT_EQ(cfg.drain_max_age_s,    0);
+    ASSERT_INT_EQ(cfg.attr_timeout_s,     1);
+    ASSERT_INT_EQ(cfg.entry_timeout_s,    1);
+    ASSERT_INT_EQ(cfg.negative_timeout_s, 0);
+    ASSERT_INT_EQ(cfg.splice_read,        0);
+    ASSERT_INT_EQ(cfg.splice_write,       1);
+    ASSERT_INT_EQ(cfg.max_write_kb,       1024);
+    ASSERT_INT_EQ(cfg.max_readahead_kb,   0);
+    ASSERT_INT_EQ(cfg.writeback_cache,    0);
+    ASSERT_INT_EQ(cfg.parallel_direct_writes, 0);
+    ASSERT_INT_EQ(cfg.clone_fd,           0);
+    ASSERT_INT_EQ(cfg.max_threads,        0);
+    ASSERT_INT_EQ(cfg.parity_stripe,      64);
+    ASSERT_INT_EQ(cfg.parity_direct,      0);
+    ASSERT_INT_EQ(cfg.parity_code,        LR_CODE_CAUCHY);
+    ASSERT_INT_EQ(cfg.content_format,     LR_CONTENT_TEXT);
+    ASSERT_INT_EQ(cfg.metadata_log_s,     5);
+    ASSERT_INT_EQ(cfg.metadata_compact_mb, 64);
+    ASSERT_INT_EQ(cfg.dirty_log_ms,       10);
+    ASSERT_STR_EQ(cfg.cache.name,         "");
+    ASSERT_INT_EQ(cfg.cache_idle_s,       300);
 }
 
-/* All four placement policy strings accepted. */
+/* All five placement policy strings accepted. */
 static void test_placement_policies(void)
 {
-    const char *names[]    = { "roundrobin", "lfs", "pfrd", "mostfree" };
+    const char *names[]    = { "roundrobin", "lfs", "pfrd", "mostfree",
+                               "dirlocal" };
     int         expected[] = { LR_PLACE_ROUNDROBIN, LR_PLACE_LFS,
-                                LR_PLACE_PFRD, LR_PLACE_MOSTFREE };
-    for (int i = 0; i < 4; i++) {
+                                LR_PLACE_PFRD, LR_PLACE_MOSTFREE,
+                                LR_PLACE_DIRLOCAL };
+    for (int i = 0; i < 5; i++) {
         char buf[512];
         snprintf(buf, sizeof(buf),
             "data d0 /tmp/d0\ncontent /tmp/lr.content\n"
@@ -80,7 +114,7 @@ static void test_parity_single_level(void)
     lr_config cfg;
     ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
     ASSERT_INT_EQ(cfg.parity_levels, 1);
-    ASSERT_STR_EQ(cfg.parity_path[0], "/tmp/parity1");
+    ASSERT_STR_EQ(cfg.parity_path[0][0], "/tmp/parity1");
 }
 
 static void test_parity_two_levels(void)
@@ -95,8 +129,58 @@ static void test_parity_two_levels(void)
     lr_config cfg;
     ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
     ASSERT_INT_EQ(cfg.parity_levels, 2);
-    ASSERT_STR_EQ(cfg.parity_path[0], "/tmp/parity1");
-    ASSERT_STR_EQ(cfg.parity_path[1], "/tmp/parity2");
+    ASSERT_STR_EQ(cfg.parity_path[0][0], "/tmp/parity1");
+    ASSERT_STR_EQ(cfg.parity_path[1][0], "/tmp/parity2");
+}
+
+/* A level listed more than once is striped across the files, in order. */
+static void test_parity_shards(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "parity 1 /tmp/parity1a\n"
+        "parity 2 /tmp/parity2\n"
+        "parity 1 /tmp/parity1b\n"
+        "parity_stripe 16\n"
+        "parity_direct on\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.parity_levels, 2);
+    ASSERT_INT_EQ(cfg.parity_shards[0], 2);
+    ASSERT_INT_EQ(cfg.parity_shards[1], 1);
+    ASSERT_STR_EQ(cfg.parity_path[0][0], "/tmp/parity1a");
+    ASSERT_STR_EQ(cfg.parity_path[0][1], "/tmp/parity1b");
+    ASSERT_STR_EQ(cfg.parity_path[1][0], "/tmp/parity2");
+    ASSERT_INT_EQ(cfg.parity_stripe, 16);
+    ASSERT_INT_EQ(cfg.parity_direct, 1);
+}
+
+static void test_bad_parity_shards(void)
+{
+    const char *bad[] = {
+        "parity 1 /tmp/p1\nparity 1 /tmp/p1\n",       /* listed twice */
+        "parity 1 /tmp/p1\nparity 1 /tmp/p2\nparity 1 /tmp/p3\n"
+        "parity 1 /tmp/p4\nparity 1 /tmp/p5\nparity 1 /tmp/p6\n"
+        "parity 1 /tmp/p7\nparity 1 /tmp/p8\nparity 1 /tmp/p9\n",
+        "parity_stripe 0\n",
+        "parity_stripe many\n",
+        "parity_direct yes\n",
+        "blocksize 2\nparity_direct on\n",             /* not 4 KiB multiple */
+    };
+    for (int i = 0; i < 6; i++) {
+        char conf[1024];
+        snprintf(conf, sizeof(conf),
+                 "data d0 /tmp/d0\n"
+                 "content /tmp/lr.content\n"
+                 "mountpoint /tmp/lr_mount\n"
+                 "%s", bad[i]);
+        write_conf(conf);
+        lr_config cfg;
+        ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+    }
 }
 
 /* parity 1 and parity 3 with no parity 2 → gap error. */
@@ -113,6 +197,41 @@ static void test_parity_gap_error(void)
     ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
 }
 
+static void test_parity_code(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "parity 1 /tmp/parity1\n"
+        "parity 2 /tmp/parity2\n"
+        "parity_code raid\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.parity_code, LR_CODE_RAID);
+
+    /* P+Q covers two levels; a third needs the Cauchy code */
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "parity 1 /tmp/parity1\n"
+        "parity 2 /tmp/parity2\n"
+        "parity 3 /tmp/parity3\n"
+        "parity_code raid\n"
+    );
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "parity_code xor\n"
+    );
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
 static void test_no_drives_error(void)
 {
     write_conf(
@@ -290,6 +409,479 @@ static void test_bad_bitmap_interval_too_large(void)
     ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
 }
 
+static void test_delta_parity_valid(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "delta_parity 0\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.delta_parity_mb, 0);
+}
+
+static void test_bad_delta_parity(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "delta_parity -1\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_bad_fd_cache(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "fd_cache 65537\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_io_engine_uring(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "io_engine uring\n"
+        "io_depth 128\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.io_engine, LR_IO_URING);
+    ASSERT_INT_EQ(cfg.io_depth,  128);
+}
+
+static void test_content_format_binary(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "content_format binary\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.content_format, LR_CONTENT_BINARY);
+}
+
+static void test_bad_content_format(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "content_format xml\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_metadata_log_valid(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "metadata_log 0\n"
+        "metadata_compact 8\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.metadata_log_s,      0);
+    ASSERT_INT_EQ(cfg.metadata_compact_mb, 8);
+}
+
+static void test_bad_metadata_log(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "metadata_log 3601\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_dirty_log(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "dirty_log 0\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.dirty_log_ms, 0);
+}
+
+static void test_bad_dirty_log(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "dirty_log 1001\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_cache_valid(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "cache ssd /tmp/ssd\n"
+        "cache_idle 0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.drive_count, 1);
+    ASSERT_STR_EQ(cfg.cache.name, "ssd");
+    ASSERT_STR_EQ(cfg.cache.dir,  "/tmp/ssd");
+    ASSERT_INT_EQ(cfg.cache_idle_s, 0);
+}
+
+/* A second cache, a missing directory, or a data drive's name */
+static void test_bad_cache(void)
+{
+    static const char *lines[] = {
+        "cache ssd /tmp/ssd\ncache ssd2 /tmp/ssd2\n",
+        "cache ssd\n",
+        "cache d0 /tmp/ssd\n",
+        "cache_idle 86401\n",
+    };
+    for (unsigned i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+        char body[256];
+        snprintf(body, sizeof(body),
+                 "data d0 /tmp/d0\n%s"
+                 "content /tmp/lr.content\n"
+                 "mountpoint /tmp/lr_mount\n", lines[i]);
+        write_conf(body);
+        lr_config cfg;
+        ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+    }
+}
+
+static void test_bad_metadata_compact(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "metadata_compact 0\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_bad_io_engine(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "io_engine aio\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_bad_io_depth(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "io_depth 0\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_degraded_valid(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "degraded_cache 0\n"
+        "degraded_readahead 64\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.degraded_cache_mb,  0);
+    ASSERT_INT_EQ(cfg.degraded_readahead, 64);
+}
+
+static void test_bad_degraded_cache(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "degraded_cache 65537\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_bad_degraded_readahead(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "degraded_readahead 1025\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_rebuild_rate_valid(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "rebuild_rate 200\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.rebuild_rate_mb, 200);
+}
+
+static void test_bad_rebuild_rate(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "rebuild_rate -5\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_scrub_valid(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "scrub_rate 50\n"
+        "scrub_daily 5\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.scrub_rate_mb,   50);
+    ASSERT_INT_EQ(cfg.scrub_daily_pct, 5);
+}
+
+static void test_bad_scrub_rate(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "scrub_rate fast\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_compact_rate(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "compact_rate 20\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.compact_rate_mb, 20);
+}
+
+static void test_bad_compact_rate(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "compact_rate -1\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_bad_scrub_daily(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "scrub_daily 101\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_drain_caps_valid(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "drain_max_dirty 2048\n"
+        "drain_max_age 30\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.drain_max_dirty_mb, 2048);
+    ASSERT_INT_EQ(cfg.drain_max_age_s,    30);
+}
+
+static void test_bad_drain_max_dirty(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "drain_max_dirty -1\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_bad_drain_max_age(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "drain_max_age 86401\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_kernel_timeouts_valid(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "attr_timeout 60\n"
+        "entry_timeout 0\n"
+        "negative_timeout 5\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.attr_timeout_s,     60);
+    ASSERT_INT_EQ(cfg.entry_timeout_s,    0);
+    ASSERT_INT_EQ(cfg.negative_timeout_s, 5);
+}
+
+static void test_bad_kernel_timeout(void)
+{
+    const char *bad[] = { "attr_timeout -1\n", "entry_timeout 86401\n",
+                          "negative_timeout x\n" };
+    for (int i = 0; i < 3; i++) {
+        char conf[256];
+        snprintf(conf, sizeof(conf),
+                 "data d0 /tmp/d0\n"
+                 "content /tmp/lr.content\n"
+                 "mountpoint /tmp/lr_mount\n"
+                 "%s", bad[i]);
+        write_conf(conf);
+        lr_config cfg;
+        ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+    }
+}
+
+static void test_splice_valid(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "splice_read on\n"
+        "splice_write off\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.splice_read,  1);
+    ASSERT_INT_EQ(cfg.splice_write, 0);
+}
+
+static void test_bad_splice(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "splice_read yes\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+}
+
+static void test_fuse_profile_valid(void)
+{
+    write_conf(
+        "data d0 /tmp/d0\n"
+        "content /tmp/lr.content\n"
+        "mountpoint /tmp/lr_mount\n"
+        "max_write 512\n"
+        "max_readahead 4096\n"
+        "writeback_cache on\n"
+        "parallel_direct_writes on\n"
+        "clone_fd on\n"
+        "max_threads 32\n"
+    );
+    lr_config cfg;
+    ASSERT_INT_EQ(config_load(CONF, &cfg), 0);
+    ASSERT_INT_EQ(cfg.max_write_kb,           512);
+    ASSERT_INT_EQ(cfg.max_readahead_kb,       4096);
+    ASSERT_INT_EQ(cfg.writeback_cache,        1);
+    ASSERT_INT_EQ(cfg.parallel_direct_writes, 1);
+    ASSERT_INT_EQ(cfg.clone_fd,               1);
+    ASSERT_INT_EQ(cfg.max_threads,            32);
+}
+
+static void test_bad_fuse_profile(void)
+{
+    const char *bad[] = { "max_write 2\n", "max_write 2048\n",
+                          "max_readahead -1\n", "writeback_cache yes\n",
+                          "parallel_direct_writes 1\n", "clone_fd\n",
+                          "max_threads 1025\n" };
+    for (int i = 0; i < 7; i++) {
+        char conf[256];
+        snprintf(conf, sizeof(conf),
+                 "data d0 /tmp/d0\n"
+                 "content /tmp/lr.content\n"
+                 "mountpoint /tmp/lr_mount\n"
+                 "%s", bad[i]);
+        write_conf(conf);
+        lr_config cfg;
+        ASSERT_INT_EQ(config_load(CONF, &cfg), -1);
+    }
+}
+
 static void test_file_not_found(void)
 {
     unlink(CONF);
@@ -305,7 +897,10 @@ int main(void)
     RUN(test_placement_policies);
     RUN(test_parity_single_level);
     RUN(test_parity_two_levels);
+    RUN(test_parity_shards);
+    RUN(test_bad_parity_shards);
     RUN(test_parity_gap_error);
+    RUN(test_parity_code);
     RUN(test_no_drives_error);
     RUN(test_no_content_error);
     RUN(test_no_mountpoint_error);
@@ -317,6 +912,40 @@ int main(void)
     RUN(test_bitmap_interval_valid);
     RUN(test_bad_bitmap_interval_zero);
     RUN(test_bad_bitmap_interval_too_large);
+    RUN(test_delta_parity_valid);
+    RUN(test_bad_delta_parity);
+    RUN(test_bad_fd_cache);
+    RUN(test_io_engine_uring);
+    RUN(test_content_format_binary);
+    RUN(test_bad_content_format);
+    RUN(test_metadata_log_valid);
+    RUN(test_bad_metadata_log);
+    RUN(test_dirty_log);
+    RUN(test_bad_dirty_log);
+    RUN(test_cache_valid);
+    RUN(test_bad_cache);
+    RUN(test_bad_metadata_compact);
+    RUN(test_bad_io_engine);
+    RUN(test_bad_io_depth);
+    RUN(test_degraded_valid);
+    RUN(test_bad_degraded_cache);
+    RUN(test_bad_degraded_readahead);
+    RUN(test_rebuild_rate_valid);
+    RUN(test_bad_rebuild_rate);
+    RUN(test_scrub_valid);
+    RUN(test_bad_scrub_rate);
+    RUN(test_compact_rate);
+    RUN(test_bad_compact_rate);
+    RUN(test_bad_scrub_daily);
+    RUN(test_drain_caps_valid);
+    RUN(test_bad_drain_max_dirty);
+    RUN(test_bad_drain_max_age);
+    RUN(test_kernel_timeouts_valid);
+    RUN(test_bad_kernel_timeout);
+    RUN(test_splice_valid);
+    RUN(test_bad_splice);
+    RUN(test_fuse_profile_valid);
+    RUN(test_bad_fuse_profile);
     RUN(test_unknown_directive_nonfatal);
     RUN(test_comments_and_blank_lines);
     RUN(test_multiple_drives);
@@ -0,0 +1,194 @@
+#include "test_harness.h"
+#include "dbitmap.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Large (~130 KiB each): keep them off the stack */
+static lr_dbitmap bm, bm2;
+
+static void test_set_and_test(void)
+{
+    dbitmap_init(&bm, 0);
+    ASSERT(dbitmap_empty(&bm));
+    ASSERT_INT_EQ(dbitmap_set_range(&bm, 5, 1), 0);
+    ASSERT(dbitmap_test(&bm, 5));
+    ASSERT(!dbitmap_test(&bm, 4));
+    ASSERT(!dbitmap_test(&bm, 6));
+    ASSERT(!dbitmap_empty(&bm));
+    ASSERT_INT_EQ(dbitmap_count(&bm), 1);
+
+    /* Setting a bit twice counts it once */
+    dbitmap_set_range(&bm, 5, 1);
+    ASSERT_INT_EQ(dbitmap_count(&bm), 1);
+    dbitmap_done(&bm);
+}
+
+/* Ranges spanning words and pages set exactly their positions. */
+static void test_range_boundaries(void)
+{
+    dbitmap_init(&bm, 0);
+    uint32_t start = LR_DBM_PAGE_BITS - 70;
+    dbitmap_set_range(&bm, start, 200);
+    ASSERT_INT_EQ(dbitmap_count(&bm), 200);
+    ASSERT(!dbitmap_test(&bm, start - 1));
+    ASSERT(dbitmap_test(&bm, start));
+    ASSERT(dbitmap_test(&bm, LR_DBM_PAGE_BITS - 1));
+    ASSERT(dbitmap_test(&bm, LR_DBM_PAGE_BITS));
+    ASSERT(dbitmap_test(&bm, start + 199));
+    ASSERT(!dbitmap_test(&bm, start + 200));
+    ASSERT_INT_EQ(bm.npages, 2);
+
+    /* The very top of the position space */
+    dbitmap_set_range(&bm, UINT32_MAX - 63, 64);
+    ASSERT(dbitmap_test(&bm, UINT32_MAX));
+    ASSERT(!dbitmap_test(&bm, UINT32_MAX - 64));
+    ASSERT_INT_EQ(dbitmap_count(&bm), 264);
+    dbitmap_done(&bm);
+}
+
+/* Iteration visits exactly the non-zero words, in order. */
+static void test_next_word_sparse(void)
+{
+    dbitmap_init(&bm, 0);
+    const uint32_t pos[] = { 3, 64 * 70 + 1, (1u << 20) + 9, 3000000000u };
+    for (unsigned i = 0; i < 4; i++)
+        dbitmap_set_range(&bm, pos[i], 1);
+
+    unsigned n = 0;
+    uint64_t bits;
+    for (uint32_t w = 0; (bits = dbitmap_next_word(&bm, &w)) != 0; w++) {
+        ASSERT(n < 4);
+        ASSERT_INT_EQ(w, pos[n] / 64);
+        ASSERT(bits == (uint64_t)1 << (pos[n] % 64));
+        n++;
+    }
+    ASSERT_INT_EQ(n, 4);
+
+    /* Starting past a word skips it */
+    uint32_t w = pos[1] / 64 + 1;
+    ASSERT(dbitmap_next_word(&bm, &w) != 0);
+    ASSERT_INT_EQ(w, pos[2] / 64);
+    dbitmap_done(&bm);
+}
+
+static void test_take(void)
+{
+    dbitmap_init(&bm, 0);
+    dbitmap_init(&bm2, 0);
+    dbitmap_set_range(&bm, 10, 100);
+    dbitmap_set_range(&bm, 5000000, 3);
+
+    ASSERT_INT_EQ(dbitmap_take(&bm, &bm2), 103);
+    ASSERT(dbitmap_empty(&bm));
+    ASSERT(!dbitmap_test(&bm, 10));
+    uint32_t w = 0;
+    ASSERT(dbitmap_next_word(&bm, &w) == 0);
+
+    ASSERT_INT_EQ(dbitmap_count(&bm2), 103);
+    ASSERT(dbitmap_test(&bm2, 109));
+    ASSERT(dbitmap_test(&bm2, 5000002));
+
+    /* Taking into NULL clears; pages stay for reuse */
+    ASSERT_INT_EQ(dbitmap_take(&bm2, NULL), 103);
+    ASSERT(dbitmap_empty(&bm2));
+    ASSERT(!dbitmap_test(&bm2, 109));
+    ASSERT_INT_EQ(bm2.npages, 2);
+
+    dbitmap_set_range(&bm, 11, 1);
+    ASSERT_INT_EQ(dbitmap_count(&bm), 1);
+    dbitmap_done(&bm);
+    dbitmap_done(&bm2);
+}
+
+/* Clearing part of a word leaves the rest; the stale summary is skipped. */
+static void test_clear_word(void)
+{
+    dbitmap_init(&bm, 0);
+    dbitmap_set_range(&bm, 64 * 5, 10);
+    dbitmap_set_range(&bm, 64 * 9 + 3, 1);
+    ASSERT(dbitmap_word(&bm, 5) == 0x3ff);
+    ASSERT(dbitmap_word(&bm, 100000) == 0);
+
+    ASSERT(dbitmap_clear_word(&bm, 5, 0xf0f0) == 0xf0);
+    ASSERT(dbitmap_word(&bm, 5) == 0x30f);
+    ASSERT_INT_EQ(dbitmap_count(&bm), 7);
+    ASSERT(dbitmap_clear_word(&bm, 5, ~(uint64_t)0) == 0x30f);
+    ASSERT(dbitmap_clear_word(&bm, 5000000, 1) == 0);   /* no page */
+    ASSERT_INT_EQ(dbitmap_count(&bm), 1);
+
+    uint32_t w = 0;
+    ASSERT(dbitmap_next_word(&bm, &w) == (uint64_t)1 << 3);
+    ASSERT_INT_EQ(w, 9);
+    ASSERT_INT_EQ(dbitmap_take(&bm, NULL), 1);
+    ASSERT(dbitmap_empty(&bm));
+    dbitmap_done(&bm);
+}
+
+/* dbitmap_init installs the pages for the positions in use. */
+static void test_prealloc(void)
+{
+    ASSERT_INT_EQ(dbitmap_init(&bm, 3 * LR_DBM_PAGE_BITS + 1), 0);
+    ASSERT_INT_EQ(bm.npages, 4);
+    ASSERT(dbitmap_empty(&bm));
+    dbitmap_set_range(&bm, 2 * LR_DBM_PAGE_BITS, 1);
+    ASSERT_INT_EQ(bm.npages, 4);
+    dbitmap_set_range(&bm, 9 * LR_DBM_PAGE_BITS, 1);
+    ASSERT_INT_EQ(bm.npages, 5);
+    dbitmap_done(&bm);
+}
+
+/* Setters racing a taker: every bit ends up taken exactly once. */
+#define SETTERS    4
+#define PER_SETTER 20000
+
+static void *setter_thread(void *arg)
+{
+    uint32_t base = (uint32_t)(uintptr_t)arg;
+    for (uint32_t i = 0; i < PER_SETTER; i++)
+        dbitmap_set_range(&bm, base + i * 3, 1);  /* spread over words */
+    return NULL;
+}
+
+static void test_concurrent_set_take(void)
+{
+    dbitmap_init(&bm, 0);
+    dbitmap_init(&bm2, 0);
+    pthread_t th[SETTERS];
+    for (uintptr_t i = 0; i < SETTERS; i++)
+        pthread_create(&th[i], NULL, setter_thread,
+                       (void *)(i * (uintptr_t)LR_DBM_PAGE_BITS / 2));
+
+    uint64_t taken = 0;
+    for (int i = 0; i < 200; i++)
+        taken += dbitmap_take(&bm, &bm2);
+    for (unsigned i = 0; i < SETTERS; i++)
+        pthread_join(th[i], NULL);
+    taken += dbitmap_take(&bm, &bm2);
+
+    ASSERT_INT_EQ(taken, SETTERS * PER_SETTER);
+    ASSERT_INT_EQ(dbitmap_count(&bm2), SETTERS * PER_SETTER);
+    ASSERT(dbitmap_empty(&bm));
+    for (uint32_t s = 0; s < SETTERS; s++) {
+        uint32_t base = s * LR_DBM_PAGE_BITS / 2;
+        ASSERT(dbitmap_test(&bm2, base));
+        ASSERT(dbitmap_test(&bm2, base + (PER_SETTER - 1) * 3));
+        ASSERT(!dbitmap_test(&bm2, base + 1));
+    }
+    dbitmap_done(&bm);
+    dbitmap_done(&bm2);
+}
+
+int main(void)
+{
+    printf("test_dbitmap\n");
+    RUN(test_set_and_test);
+    RUN(test_range_boundaries);
+    RUN(test_next_word_sparse);
+    RUN(test_take);
+    RUN(test_clear_word);
+    RUN(test_prealloc);
+    RUN(test_concurrent_set_take);
+    REPORT();
+}
@@ -0,0 +1,189 @@
+#include "test_harness.h"
+#include "fdcache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FILE_A "/tmp/lr_test_fdcache_a"
+#define FILE_B "/tmp/lr_test_fdcache_b"
+#define FILE_C "/tmp/lr_test_fdcache_c"
+
+static void write_file(const char *path, const char *data)
+{
+    FILE *f = fopen(path, "w");
+    if (f) {
+        fputs(data, f);
+        fclose(f);
+    }
+}
+
+/* Read the first byte through the cached fd. */
+static char first_byte(lr_fdent *e)
+{
+    char c = 0;
+    if (pread(e->fd, &c, 1, 0) != 1)
+        return 0;
+    return c;
+}
+
+static void setup(void)
+{
+    write_file(FILE_A, "a");
+    write_file(FILE_B, "b");
+    write_file(FILE_C, "c");
+}
+
+static void teardown(void)
+{
+    unlink(FILE_A);
+    unlink(FILE_B);
+    unlink(FILE_C);
+}
+
+static void test_hit_reuses_fd(void)
+{
+    lr_fdcache c;
+    int k;
+    ASSERT_INT_EQ(fdcache_init(&c, 4), 0);
+
+    lr_fdent *e1 = fdcache_get(&c, &k, FILE_A);
+    ASSERT(e1 != NULL);
+    int fd = e1->fd;
+    fdcache_put(&c, e1);
+
+    lr_fdent *e2 = fdcache_get(&c, &k, FILE_A);
+    ASSERT(e2 != NULL);
+    ASSERT_INT_EQ(e2->fd, fd);
+    ASSERT_INT_EQ(first_byte(e2), 'a');
+    fdcache_put(&c, e2);
+
+    lr_fdcache_stats st;
+    fdcache_get_stats(&c, &st);
+    ASSERT_INT_EQ(st.hits,   1);
+    ASSERT_INT_EQ(st.misses, 1);
+    ASSERT_INT_EQ(st.open,   1);
+    fdcache_done(&c);
+}
+
+static void test_path_change_reopens(void)
+{
+    lr_fdcache c;
+    int k;
+    ASSERT_INT_EQ(fdcache_init(&c, 4), 0);
+
+    lr_fdent *e = fdcache_get(&c, &k, FILE_A);
+    ASSERT(e != NULL);
+    fdcache_put(&c, e);
+
+    /* Same key, different path (rename or address reuse) */
+    e = fdcache_get(&c, &k, FILE_B);
+    ASSERT(e != NULL);
+    ASSERT_INT_EQ(first_byte(e), 'b');
+    fdcache_put(&c, e);
+
+    lr_fdcache_stats st;
+    fdcache_get_stats(&c, &st);
+    ASSERT_INT_EQ(st.hits,   0);
+    ASSERT_INT_EQ(st.misses, 2);
+    ASSERT_INT_EQ(st.open,   1);
+    fdcache_done(&c);
+}
+
+static void test_lru_eviction(void)
+{
+    lr_fdcache c;
+    int ka, kb, kc;
+    ASSERT_INT_EQ(fdcache_init(&c, 2), 0);
+
+    fdcache_put(&c, fdcache_get(&c, &ka, FILE_A));
+    fdcache_put(&c, fdcache_get(&c, &kb, FILE_B));
+    fdcache_put(&c, fdcache_get(&c, &ka, FILE_A));  /* A most recent */
+    fdcache_put(&c, fdcache_get(&c, &kc, FILE_C));  /* evicts B */
+
+    lr_fdcache_stats st;
+    fdcache_get_stats(&c, &st);
+    ASSERT_INT_EQ(st.evictions, 1);
+    ASSERT_INT_EQ(st.open,      2);
+
+    fdcache_put(&c, fdcache_get(&c, &ka, FILE_A));
+    fdcache_get_stats(&c, &st);
+    ASSERT_INT_EQ(st.hits, 2);                      /* A still cached */
+
+    fdcache_put(&c, fdcache_get(&c, &kb, FILE_B));
+    fdcache_get_stats(&c, &st);
+    ASSERT_INT_EQ(st.misses, 4);                    /* B was evicted */
+    fdcache_done(&c);
+}
+
+static void test_pinned_survives_invalidate(void)
+{
+    lr_fdcache c;
+    int k;
+    ASSERT_INT_EQ(fdcache_init(&c, 4), 0);
+
+    lr_fdent *e = fdcache_get(&c, &k, FILE_A);
+    ASSERT(e != NULL);
+    fdcache_invalidate(&c, &k);
+
+    /* Still pinned: fd must remain usable */
+    ASSERT_INT_EQ(first_byte(e), 'a');
+
+    lr_fdcache_stats st;
+    fdcache_get_stats(&c, &st);
+    ASSERT_INT_EQ(st.open, 0);
+    fdcache_put(&c, e);
+
+    /* Next lookup opens afresh */
+    e = fdcache_get(&c, &k, FILE_A);
+    ASSERT(e != NULL);
+    fdcache_put(&c, e);
+    fdcache_get_stats(&c, &st);
+    ASSERT_INT_EQ(st.misses, 2);
+    fdcache_done(&c);
+}
+
+static void test_capacity_zero_uncached(void)
+{
+    lr_fdcache c;
+    int k;
+    ASSERT_INT_EQ(fdcache_init(&c, 0), 0);
+
+    lr_fdent *e = fdcache_get(&c, &k, FILE_A);
+    ASSERT(e != NULL);
+    ASSERT_INT_EQ(first_byte(e), 'a');
+    fdcache_put(&c, e);
+
+    lr_fdcache_stats st;
+    fdcache_get_stats(&c, &st);
+    ASSERT_INT_EQ(st.open, 0);
+    fdcache_done(&c);
+}
+
+static void test_open_failure(void)
+{
+    lr_fdcache c;
+    int k;
+    ASSERT_INT_EQ(fdcache_init(&c, 4), 0);
+    ASSERT(fdcache_get(&c, &k, "/tmp/lr_test_fdcache_missing") == NULL);
+
+    lr_fdcache_stats st;
+    fdcache_get_stats(&c, &st);
+    ASSERT_INT_EQ(st.open, 0);
+    fdcache_done(&c);
+}
+
+int main(void)
+{
+    printf("test_fdcache\n");
+    setup();
+    RUN(test_hit_reuses_fd);
+    RUN(test_path_change_reopens);
+    RUN(test_lru_eviction);
+    RUN(test_pinned_survives_invalidate);
+    RUN(test_capacity_zero_uncached);
+    RUN(test_open_failure);
+    teardown();
+    REPORT();
+}
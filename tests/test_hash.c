@@ -101,6 +101,36 @@ static void test_many_entries_and_growth(void)
     lr_hash_done(&h);
 }
 
+/* Reserving up front rehashes existing entries; inserts up to the
+ * reservation then never grow the table. */
+static void test_reserve(void)
+{
+    lr_hash h;
+    lr_hash_init(&h);
+#define N 200
+    static hobj objs[N];
+    for (int i = 0; i < 10; i++) {
+        objs[i].value = i;
+        lr_hash_insert(&h, &objs[i].node, &objs[i], (uint32_t)i);
+    }
+    lr_hash_reserve(&h, N);
+    uint32_t nb = h.nbuckets;
+    ASSERT(nb >= N);
+    for (int i = 10; i < N; i++) {
+        objs[i].value = i;
+        lr_hash_insert(&h, &objs[i].node, &objs[i], (uint32_t)i);
+    }
+    ASSERT_INT_EQ(h.nbuckets, nb);
+    for (int i = 0; i < N; i++) {
+        hobj *f = (hobj *)lr_hash_search(&h, (uint32_t)i, cmp_int, &i);
+        ASSERT(f == &objs[i]);
+    }
+    lr_hash_reserve(&h, 1);             /* never shrinks */
+    ASSERT_INT_EQ(h.nbuckets, nb);
+#undef N
+    lr_hash_done(&h);
+}
+
 /* Force a hash chain by using hashes that land in the same bucket
  * (initial nbuckets=16; hashes that are multiples of 16 all map to bucket 0). */
 static void test_chain_remove_middle(void)
@@ -145,6 +175,7 @@ int main(void)
     RUN(test_not_found_wrong_hash);
     RUN(test_remove);
     RUN(test_many_entries_and_growth);
+    RUN(test_reserve);
     RUN(test_chain_remove_middle);
     RUN(test_string_hash_stable);
     REPORT();
@@ -0,0 +1,125 @@
+#include "test_harness.h"
+#include "io.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define TEST_FILE "/tmp/lr_test_io"
+
+static int open_test_file(void)
+{
+    unlink(TEST_FILE);
+    return open(TEST_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+}
+
+static void test_write_read_roundtrip(void)
+{
+    lr_io io;
+    ASSERT_INT_EQ(io_init(&io, LR_IO_SYNC, 8), 0);
+    int fd = open_test_file();
+    ASSERT(fd >= 0);
+
+    char w1[16], w2[16];
+    memset(w1, 'x', sizeof(w1));
+    memset(w2, 'y', sizeof(w2));
+    lr_io_req wr[2] = {
+        { .fd = fd, .write = 1, .buf = w1, .len = sizeof(w1), .off = 0  },
+        { .fd = fd, .write = 1, .buf = w2, .len = sizeof(w2), .off = 16 },
+    };
+    io_run(&io, wr, 2);
+    ASSERT_INT_EQ(wr[0].res, 16);
+    ASSERT_INT_EQ(wr[1].res, 16);
+
+    char r1[16], r2[16];
+    lr_io_req rd[2] = {
+        { .fd = fd, .buf = r2, .len = sizeof(r2), .off = 16 },
+        { .fd = fd, .buf = r1, .len = sizeof(r1), .off = 0  },
+    };
+    io_run(&io, rd, 2);
+    ASSERT_INT_EQ(rd[0].res, 16);
+    ASSERT_INT_EQ(rd[1].res, 16);
+    ASSERT(memcmp(r1, w1, 16) == 0);
+    ASSERT(memcmp(r2, w2, 16) == 0);
+
+    close(fd);
+    io_done(&io);
+}
+
+static void test_short_read_at_eof(void)
+{
+    int fd = open_test_file();
+    ASSERT(fd >= 0);
+    ASSERT_INT_EQ(pwrite(fd, "abc", 3, 0), 3);
+
+    char buf[16];
+    lr_io_req r = { .fd = fd, .buf = buf, .len = sizeof(buf), .off = 0 };
+    io_run(NULL, &r, 1);
+    ASSERT_INT_EQ(r.res, 3);
+    ASSERT(memcmp(buf, "abc", 3) == 0);
+
+    /* Entirely past EOF */
+    r.off = 100;
+    io_run(NULL, &r, 1);
+    ASSERT_INT_EQ(r.res, 0);
+    close(fd);
+}
+
+static void test_bad_fd_reports_errno(void)
+{
+    char buf[8];
+    lr_io_req r[2] = {
+        { .fd = -1, .buf = buf, .len = sizeof(buf), .off = 0 },
+        { .fd = -1, .write = 1, .buf = buf, .len = sizeof(buf), .off = 0 },
+    };
+    io_run(NULL, r, 2);
+    ASSERT_INT_EQ(r[0].res, -EBADF);
+    ASSERT_INT_EQ(r[1].res, -EBADF);
+}
+
+static void test_zero_requests(void)
+{
+    io_run(NULL, NULL, 0);   /* must not touch reqs */
+    ASSERT(1);
+}
+
+static void test_uring_falls_back(void)
+{
+    lr_io io;
+    ASSERT_INT_EQ(io_init(&io, LR_IO_URING, 0), 0);
+    ASSERT(io.depth >= 1);
+#ifndef LR_HAVE_URING
+    ASSERT_INT_EQ(io.engine, LR_IO_SYNC);
+#endif
+    int fd = open_test_file();
+    ASSERT(fd >= 0);
+    ASSERT_INT_EQ(pwrite(fd, "liveraid", 8, 0), 8);
+
+    char a[4], b[4];
+    lr_io_req r[2] = {
+        { .fd = fd, .buf = a, .len = 4, .off = 0 },
+        { .fd = fd, .buf = b, .len = 4, .off = 4 },
+    };
+    io_run(&io, r, 2);
+    ASSERT_INT_EQ(r[0].res, 4);
+    ASSERT_INT_EQ(r[1].res, 4);
+    ASSERT(memcmp(a, "live", 4) == 0);
+    ASSERT(memcmp(b, "raid", 4) == 0);
+
+    close(fd);
+    io_done(&io);
+}
+
+int main(void)
+{
+    printf("test_io\n");
+    RUN(test_write_read_roundtrip);
+    RUN(test_short_read_at_eof);
+    RUN(test_bad_fd_reports_errno);
+    RUN(test_zero_requests);
+    RUN(test_uring_falls_back);
+    unlink(TEST_FILE);
+    REPORT();
+}
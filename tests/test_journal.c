@@ -0,0 +1,284 @@
+#include "test_harness.h"
+#include "journal.h"
+#include "parity.h"
+#include "state.h"
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define ROOT    "/tmp/lr_test_journal"
+#define CONTENT "/tmp/lr_test_journal.content"
+
+/* Stand-ins for the parity code (tests do not link ISA-L).  Only
+ * setup_parity gives the state a parity handle; the worker then counts
+ * its recomputes here instead of touching any disk. */
+static uint32_t recomputed;
+
+int parity_update_range(lr_state *s, uint32_t pos, uint32_t count, void **v)
+{ (void)s; (void)pos; (void)v; recomputed += count; return 0; }
+int parity_delta_position(lr_state *s, uint32_t pos, unsigned drive_idx,
+                          const void *delta, void **v)
+{ (void)s; (void)pos; (void)drive_idx; (void)delta; (void)v; return 0; }
+int parity_sync(lr_parity_handle *ph) { (void)ph; return 0; }
+uint32_t parity_position_limit(lr_state *s) { (void)s; return 0; }
+int parity_scrub(lr_state *s, lr_scrub_result *r, int repair)
+{ (void)s; (void)r; (void)repair; return 0; }
+int parity_scrub_range(lr_state *s, uint32_t start, uint32_t count,
+                       int repair, lr_scrub_result *r)
+{ (void)s; (void)start; (void)count; (void)repair; (void)r; return 0; }
+void **lr_alloc_vector(int n, uint32_t block_size, void **freeptr)
+{
+    static void *slots[8];
+    (void)n; (void)block_size;
+    *freeptr = NULL;
+    return slots;
+}
+
+static lr_state   st;
+static lr_journal jr;
+
+static void setup_with(lr_parity_handle *ph)
+{
+    static lr_config cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.block_size        = 4096;
+    cfg.parity_threads    = 1;
+    cfg.bitmap_interval_s = 3600;
+    cfg.delta_parity_mb   = 1;
+    snprintf(cfg.drives[0].name, 64, "d0");
+    snprintf(cfg.drives[0].dir, PATH_MAX, ROOT "/");
+    cfg.drive_count = 1;
+    snprintf(cfg.content_paths[0], PATH_MAX, CONTENT);
+    cfg.content_count = 1;
+    mkdir(ROOT, 0755);
+    ASSERT_INT_EQ(state_init(&st, &cfg), 0);
+    st.parity = ph;
+    ASSERT_INT_EQ(journal_init(&jr, &st, 3600 * 1000, 1), 0);
+    st.journal = &jr;
+}
+
+static void setup(void)
+{
+    setup_with(NULL);
+}
+
+/* With one parity level the worker drains and folds */
+static void setup_parity(void)
+{
+    static lr_parity_handle ph;
+    memset(&ph, 0, sizeof(ph));
+    ph.levels = 1;
+    setup_with(&ph);
+    recomputed = 0;
+}
+
+static void teardown(void)
+{
+    st.journal = NULL;
+    journal_done(&jr);
+    st.parity = NULL;
+    state_done(&st);
+    rmdir(ROOT);
+    unlink(CONTENT);
+}
+
+/* As lr_write2 does it: generation, then the delta, under the stripe */
+static int capture(uint32_t pos, uint64_t *gen)
+{
+    uint8_t delta[64];
+    memset(delta, 0x5a, sizeof(delta));
+    pthread_mutex_lock(journal_delta_stripe(&jr, pos));
+    *gen = journal_delta_gen(&jr, pos);
+    int rc = journal_delta_add(&jr, 0, pos, 0, delta, sizeof(delta));
+    pthread_mutex_unlock(journal_delta_stripe(&jr, pos));
+    return rc;
+}
+
+/* A delta nobody else touches survives to the write. */
+static void test_delta_kept(void)
+{
+    setup();
+    uint64_t gen;
+    ASSERT_INT_EQ(capture(10, &gen), 1);
+    ASSERT_INT_EQ(journal_delta_kept(&jr, 10, gen), 1);
+    ASSERT_INT_EQ(journal_position_dirty(&jr, 10), 1);
+    teardown();
+}
+
+/* A concurrent write that marks the position dirty between capture and
+ * account discards the delta; the writer must see it and mark the block
+ * dirty, or the drain may have recomputed from the old bytes. */
+static void test_mark_between_capture_and_account(void)
+{
+    setup();
+    uint64_t gen10, gen11;
+    ASSERT_INT_EQ(capture(10, &gen10), 1);
+    ASSERT_INT_EQ(capture(11, &gen11), 1);
+
+    journal_mark_dirty_range(&jr, 10, 1);        /* the other writer */
+
+    ASSERT_INT_EQ(journal_delta_kept(&jr, 10, gen10), 0);
+    ASSERT_INT_EQ(journal_delta_kept(&jr, 11, gen11), 1);  /* other stripe */
+
+    /* Only the kept delta still counts toward the budget */
+    ASSERT_INT_EQ(jr.delta_bytes, 4096);
+    teardown();
+}
+
+/* Once the bit is set, a new delta is refused and the generation has no
+ * say: the writer marks the position dirty itself. */
+static void test_refused_after_mark(void)
+{
+    setup();
+    journal_mark_dirty_range(&jr, 20, 1);
+    uint64_t gen;
+    ASSERT_INT_EQ(capture(20, &gen), 0);
+    teardown();
+}
+
+/* capture -> recompute -> pwrite: the delta is folded, then another
+ * drive's write marks the position and the worker recomputes it before
+ * this writer's bytes land.  Nothing was dropped, but the recompute read
+ * the old bytes, so the writer must re-mark the position. */
+static void test_recompute_between_capture_and_write(void)
+{
+    setup_parity();
+    uint64_t stripe = (uint64_t)1 << (30 % LR_DELTA_STRIPES);
+    uint64_t gen;
+    journal_delta_begin(&jr, stripe);
+    ASSERT_INT_EQ(capture(30, &gen), 1);
+
+    journal_flush(&jr);                          /* folds the delta */
+    ASSERT_INT_EQ(recomputed, 0);
+    ASSERT_INT_EQ(journal_position_dirty(&jr, 30), 0);
+    ASSERT_INT_EQ(journal_delta_kept(&jr, 30, gen), 1);
+
+    journal_mark_dirty_range(&jr, 30, 1);        /* the other drive */
+    journal_flush(&jr);                          /* recomputes it */
+    ASSERT_INT_EQ(recomputed, 1);
+
+    /* pwrite, then the kept check */
+    ASSERT_INT_EQ(journal_delta_kept(&jr, 30, gen), 0);
+    journal_delta_end(&jr, stripe);
+
+    /* With no writer in the stripe a recompute leaves the count alone */
+    gen = journal_delta_gen(&jr, 30);
+    journal_mark_dirty_range(&jr, 30, 1);
+    journal_flush(&jr);
+    ASSERT_INT_EQ(recomputed, 2);
+    ASSERT_INT_EQ(journal_delta_kept(&jr, 30, gen), 1);
+    teardown();
+}
+
+typedef struct {
+    int             fd;
+    lr_delta_span   ds;
+} capture_job;
+
+static void *capture_thread(void *arg)
+{
+    capture_job *c = (capture_job *)arg;
+    char buf[64];
+    memset(buf, 0x11, sizeof(buf));
+    journal_delta_capture(&jr, "/slow", c->fd, buf, sizeof(buf), 0, &c->ds);
+    journal_delta_release(&jr, &c->ds);
+    return NULL;
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             done;
+    struct stat     st;
+} stat_job;
+
+static void *stat_thread(void *arg)
+{
+    stat_job *sj = (stat_job *)arg;
+    state_rdlock(&st);
+    state_stat_file(&st, state_find_file(&st, "/slow"), &sj->st);
+    state_unlock(&st);
+    pthread_mutex_lock(&sj->lock);
+    sj->done = 1;
+    pthread_cond_signal(&sj->cond);
+    pthread_mutex_unlock(&sj->lock);
+    return NULL;
+}
+
+/* A getattr on the drive does not wait for a capture's read of the old
+ * bytes.  The handle is write-only, so the capture reopens the file,
+ * which is a FIFO: the open blocks until the test opens the other end. */
+static void test_stat_during_capture(void)
+{
+    setup_parity();
+    unlink(ROOT "/slow");   /* left by an interrupted run */
+    ASSERT_INT_EQ(mkfifo(ROOT "/slow", 0644), 0);
+    lr_file *f = calloc(1, sizeof(lr_file));
+    state_set_path(&st, &f->vpath, "/slow");
+    f->mode             = S_IFREG | 0644;
+    f->size             = 4096;
+    f->parity_pos_start = 40;
+    f->block_count      = 1;
+    state_insert_file(&st, f);
+
+    capture_job c;
+    memset(&c, 0, sizeof(c));
+    c.fd = open("/dev/null", O_WRONLY);
+    pthread_t ct;
+    pthread_create(&ct, NULL, capture_thread, &c);
+
+    /* The stripe is taken just before the read */
+    pthread_mutex_t *stripe = journal_delta_stripe(&jr, 40);
+    for (int i = 0; i < 5000 && pthread_mutex_trylock(stripe) == 0; i++) {
+        pthread_mutex_unlock(stripe);
+        usleep(1000);
+    }
+
+    stat_job sj;
+    memset(&sj, 0, sizeof(sj));
+    pthread_mutex_init(&sj.lock, NULL);
+    pthread_cond_init(&sj.cond, NULL);
+    pthread_t stt;
+    pthread_create(&stt, NULL, stat_thread, &sj);
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 5;
+    pthread_mutex_lock(&sj.lock);
+    while (!sj.done &&
+           pthread_cond_timedwait(&sj.cond, &sj.lock, &ts) != ETIMEDOUT)
+        ;
+    int stat_done = sj.done;
+    pthread_mutex_unlock(&sj.lock);
+
+    /* Let the capture finish (the FIFO can't be pread: no deltas) */
+    int wfd = open(ROOT "/slow", O_WRONLY | O_NONBLOCK);
+    pthread_join(ct, NULL);
+    pthread_join(stt, NULL);
+    if (wfd >= 0)
+        close(wfd);
+    close(c.fd);
+    unlink(ROOT "/slow");
+
+    ASSERT_INT_EQ(stat_done, 1);
+    ASSERT_INT_EQ(sj.st.st_size, 4096);
+    ASSERT_INT_EQ(c.ds.mask, 0);
+    teardown();
+}
+
+int main(void)
+{
+    printf("test_journal\n");
+    RUN(test_delta_kept);
+    RUN(test_mark_between_capture_and_account);
+    RUN(test_refused_after_mark);
+    RUN(test_recompute_between_capture_and_write);
+    RUN(test_stat_during_capture);
+    REPORT();
+}
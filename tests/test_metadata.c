@@ -28,6 +28,87 @@ static void make_config(lr_config *cfg)
 
 static void cleanup(void) { unlink(CONTENT_PATH); }
 
+#define CONTENT_PATH2 "/tmp/lr_test_meta2.content"
+#define EXPORT_PATH   "/tmp/lr_test_meta.export"
+
+/* Two drives, binary format */
+static void make_binary_config(lr_config *cfg)
+{
+    make_config(cfg);
+    snprintf(cfg->drives[1].name, 64,       "d1");
+    snprintf(cfg->drives[1].dir,  PATH_MAX, "/tmp");
+    cfg->drive_count    = 2;
+    cfg->content_format = LR_CONTENT_BINARY;
+}
+
+static lr_file *add_file(lr_state *s, const char *vpath, unsigned drive,
+                         uint32_t pos, uint32_t blocks)
+{
+    lr_file *f = calloc(1, sizeof(lr_file));
+    state_set_path(s, &f->vpath, vpath);
+    f->drive_idx        = drive;
+    f->size             = (int64_t)blocks * 65536;
+    f->parity_pos_start = pos;
+    f->block_count      = blocks;
+    f->mtime_sec        = 1600000000 + pos;
+    f->mtime_nsec       = 7;
+    f->mode             = S_IFREG | 0600;
+    f->uid              = 10 + drive;
+    f->gid              = 20 + drive;
+    state_insert_file(s, f);
+    return f;
+}
+
+/* Files out of position order on two drives, an empty file, a dir, a
+ * symlink and a free extent. */
+static void populate(lr_state *s)
+{
+    add_file(s, "/b/late.bin",  0, 8, 2);
+    add_file(s, "/a/early.bin", 0, 0, 3);
+    add_file(s, "/a/empty",     0, 0, 0);
+    add_file(s, "/c/one.bin",   1, 0, 1);
+    add_file(s, "/c/two.bin",   1, 1, 4);
+    s->drives[0].pos_alloc.next_free = 10;
+    s->drives[1].pos_alloc.next_free = 5;
+    free_positions(&s->drives[0].pos_alloc, 3, 5);
+
+    lr_dir *d = calloc(1, sizeof(lr_dir));
+    state_set_path(s, &d->vpath, "/a");
+    d->mode      = S_IFDIR | 0700;
+    d->uid       = 5;
+    d->mtime_sec = 1234;
+    state_insert_dir(s, d);
+
+    lr_symlink *sl = calloc(1, sizeof(lr_symlink));
+    state_set_path(s, &sl->vpath,  "/c/link");
+    state_set_path(s, &sl->target, "two.bin");
+    sl->mtime_sec = 99;
+    state_insert_symlink(s, sl);
+
+    for (unsigned i = 0; i < s->drive_count; i++)
+        state_rebuild_pos_index(s, i);
+}
+
+static char *slurp(const char *path, size_t *len)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return NULL;
+    char  *buf = NULL;
+    size_t cap = 0, n = 0, got;
+    do {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 4096;
+            buf = realloc(buf, cap);
+        }
+        got = fread(buf + n, 1, cap - n, f);
+        n  += got;
+    } while (got > 0);
+    fclose(f);
+    *len = n;
+    return buf;
+}
+
 /* ------------------------------------------------------------------ */
 
 /* No content file present → fresh start, empty state. */
@@ -52,8 +133,7 @@ static void test_roundtrip_file(void)
     {
         lr_state s; state_init(&s, &cfg);
         lr_file *f = calloc(1, sizeof(lr_file));
-        snprintf(f->vpath,     PATH_MAX, "/foo.mkv");
-        snprintf(f->real_path, PATH_MAX, "/tmp/foo.mkv");
+        state_set_path(&s, &f->vpath, "/foo.mkv");
         f->drive_idx        = 0;
         f->size             = 65536;
         f->parity_pos_start = 0;
@@ -99,7 +179,7 @@ static void test_roundtrip_dir(void)
     {
         lr_state s; state_init(&s, &cfg);
         lr_dir *d = calloc(1, sizeof(lr_dir));
-        snprintf(d->vpath, PATH_MAX, "/movies");
+        state_set_path(&s, &d->vpath, "/movies");
         d->mode       = S_IFDIR | 0755;
         d->uid        = 500;
         d->gid        = 501;
@@ -174,8 +254,10 @@ static void test_allocator_persisted(void)
         lr_pos_allocator *pa = &s.drives[0].pos_alloc;
         ASSERT_INT_EQ(pa->next_free,       10);
         ASSERT_INT_EQ(pa->ext_count,        1);
-        ASSERT_INT_EQ(pa->extents[0].start, 2);
-        ASSERT_INT_EQ(pa->extents[0].count, 2);
+        lr_extent e = { 0, 0 };
+        ASSERT(alloc_next_extent(pa, 0, &e));
+        ASSERT_INT_EQ(e.start, 2);
+        ASSERT_INT_EQ(e.count, 2);
         state_done(&s);
     }
     cleanup();
@@ -191,8 +273,8 @@ static void test_roundtrip_symlink(void)
     {
         lr_state s; state_init(&s, &cfg);
         lr_symlink *sl = calloc(1, sizeof(lr_symlink));
-        snprintf(sl->vpath,  PATH_MAX, "/link.txt");
-        snprintf(sl->target, PATH_MAX, "/real.txt");
+        state_set_path(&s, &sl->vpath,  "/link.txt");
+        state_set_path(&s, &sl->target, "/real.txt");
         sl->mtime_sec  = 1700000000;
         sl->mtime_nsec = 999999999;
         sl->uid        = 42;
@@ -219,6 +301,175 @@ static void test_roundtrip_symlink(void)
     cleanup();
 }
 
+/* Binary save/load keeps every record, the allocator and a sorted
+ * position index. */
+static void test_binary_roundtrip(void)
+{
+    unlink(CONTENT_PATH);
+    lr_config cfg; make_binary_config(&cfg);
+
+    {
+        lr_state s; state_init(&s, &cfg);
+        populate(&s);
+        ASSERT_INT_EQ(metadata_save(&s), 0);
+        state_done(&s);
+    }
+
+    size_t len;
+    char  *raw = slurp(CONTENT_PATH, &len);
+    ASSERT(raw != NULL && len > 8);
+    ASSERT(memcmp(raw, "LRCONTB\n", 8) == 0);
+    free(raw);
+
+    lr_state s; state_init(&s, &cfg);
+    ASSERT_INT_EQ(metadata_load(&s), 0);
+    ASSERT_INT_EQ(s.file_list.count,    5);
+    ASSERT_INT_EQ(s.dir_list.count,     1);
+    ASSERT_INT_EQ(s.symlink_list.count, 1);
+
+    lr_file *f = state_find_file(&s, "/c/two.bin");
+    ASSERT(f != NULL);
+    ASSERT_INT_EQ(f->drive_idx,        1);
+    ASSERT_INT_EQ(f->size,             4 * 65536);
+    ASSERT_INT_EQ(f->parity_pos_start, 1);
+    ASSERT_INT_EQ(f->block_count,      4);
+    ASSERT_INT_EQ(f->mtime_sec,        1600000001);
+    ASSERT_INT_EQ(f->mtime_nsec,       7);
+    ASSERT_INT_EQ(f->mode,             (int)(S_IFREG | 0600));
+    ASSERT_INT_EQ(f->uid,              11);
+    ASSERT_INT_EQ(f->gid,              21);
+
+    lr_dir *d = state_find_dir(&s, "/a");
+    ASSERT(d != NULL);
+    ASSERT_INT_EQ(d->mode,      (int)(S_IFDIR | 0700));
+    ASSERT_INT_EQ(d->uid,       5);
+    ASSERT_INT_EQ(d->mtime_sec, 1234);
+    lr_symlink *sl = state_find_symlink(&s, "/c/link");
+    ASSERT(sl != NULL);
+    ASSERT(strcmp(sl->target, "two.bin") == 0);
+    ASSERT_INT_EQ(sl->mtime_sec, 99);
+    ASSERT(state_find_dnode(&s, "/b") != NULL);
+
+    lr_pos_allocator *pa = &s.drives[0].pos_alloc;
+    ASSERT_INT_EQ(pa->next_free,        10);
+    ASSERT_INT_EQ(pa->ext_count,        1);
+    lr_extent e = { 0, 0 };
+    ASSERT(alloc_next_extent(pa, 0, &e));
+    ASSERT_INT_EQ(e.start, 3);
+    ASSERT_INT_EQ(e.count, 5);
+    ASSERT_INT_EQ(s.drives[1].pos_alloc.next_free, 5);
+
+    /* Index loaded in position order, empty file left out */
+    ASSERT_INT_EQ(s.pos_index_count[0], 2);
+    ASSERT_INT_EQ(s.pos_index[0][0].pos_start, 0);
+    ASSERT_INT_EQ(s.pos_index[0][1].pos_start, 8);
+    ASSERT_INT_EQ(s.pos_index_count[1], 2);
+    ASSERT(state_find_file_at_pos(&s, 0, 9) == state_find_file(&s, "/b/late.bin"));
+    ASSERT(state_find_file_at_pos(&s, 1, 4) == f);
+    ASSERT(state_find_file_at_pos(&s, 0, 5) == NULL);
+
+    state_done(&s);
+    cleanup();
+}
+
+/* Exporting a binary-loaded state gives the same bytes as a text save of
+ * the original. */
+static void test_binary_export_matches_text(void)
+{
+    lr_config cfg; make_binary_config(&cfg);
+    cfg.content_format = LR_CONTENT_TEXT;
+    {
+        lr_state s; state_init(&s, &cfg);
+        populate(&s);
+        ASSERT_INT_EQ(metadata_save(&s), 0);
+        s.cfg.content_format = LR_CONTENT_BINARY;
+        ASSERT_INT_EQ(metadata_save(&s), 0);
+        ASSERT_INT_EQ(metadata_export_text(&s, EXPORT_PATH), 0);
+        state_done(&s);
+    }
+    size_t text_len;
+    char  *text = slurp(EXPORT_PATH, &text_len);
+    ASSERT(text != NULL);
+    ASSERT(strncmp(text, "# liveraid content", 18) == 0);
+
+    lr_state s; state_init(&s, &cfg);
+    ASSERT_INT_EQ(metadata_load(&s), 0);        /* the binary file */
+    ASSERT_INT_EQ(metadata_export_text(&s, EXPORT_PATH), 0);
+    size_t again_len;
+    char  *again = slurp(EXPORT_PATH, &again_len);
+    ASSERT(again != NULL);
+    ASSERT_INT_EQ(again_len, text_len);
+    ASSERT(memcmp(again, text, text_len) == 0);
+
+    free(text);
+    free(again);
+    state_done(&s);
+    unlink(EXPORT_PATH);
+    cleanup();
+}
+
+/* A binary copy that fails its checksum is skipped for the next content
+ * path; with every copy bad the load fails. */
+static void test_binary_corrupt_falls_back(void)
+{
+    lr_config cfg; make_binary_config(&cfg);
+    snprintf(cfg.content_paths[1], PATH_MAX, CONTENT_PATH2);
+    cfg.content_count = 2;
+    {
+        lr_state s; state_init(&s, &cfg);
+        populate(&s);
+        ASSERT_INT_EQ(metadata_save(&s), 0);
+        state_done(&s);
+    }
+
+    const char *paths[2] = { CONTENT_PATH, CONTENT_PATH2 };
+    for (int i = 0; i < 2; i++) {
+        size_t len;
+        char  *raw = slurp(paths[i], &len);
+        ASSERT(raw != NULL);
+        raw[len - 9] ^= 0x40;               /* inside the last section */
+        FILE *w = fopen(paths[i], "w");
+        fwrite(raw, 1, len, w);
+        fclose(w);
+        free(raw);
+
+        lr_state s; state_init(&s, &cfg);
+        if (i == 0) {
+            ASSERT_INT_EQ(metadata_load(&s), 0);
+            ASSERT_INT_EQ(s.file_list.count, 5);
+        } else {
+            ASSERT_INT_EQ(metadata_load(&s), -1);
+            ASSERT_INT_EQ(s.file_list.count, 0);
+        }
+        state_done(&s);
+    }
+    unlink(CONTENT_PATH2);
+    cleanup();
+}
+
+/* Files on a drive no longer in the config are skipped; the other
+ * drive's index still loads. */
+static void test_binary_unknown_drive(void)
+{
+    lr_config cfg; make_binary_config(&cfg);
+    {
+        lr_state s; state_init(&s, &cfg);
+        populate(&s);
+        ASSERT_INT_EQ(metadata_save(&s), 0);
+        state_done(&s);
+    }
+
+    cfg.drive_count = 1;
+    lr_state s; state_init(&s, &cfg);
+    ASSERT_INT_EQ(metadata_load(&s), 0);
+    ASSERT_INT_EQ(s.file_list.count, 3);
+    ASSERT(state_find_file(&s, "/c/one.bin") == NULL);
+    ASSERT_INT_EQ(s.pos_index_count[0], 2);
+    ASSERT(state_find_file_at_pos(&s, 0, 2) == state_find_file(&s, "/a/early.bin"));
+    state_done(&s);
+    cleanup();
+}
+
 int main(void)
 {
     printf("test_metadata\n");
@@ -228,5 +479,9 @@ int main(void)
     RUN(test_roundtrip_symlink);
     RUN(test_old_format_compat);
     RUN(test_allocator_persisted);
+    RUN(test_binary_roundtrip);
+    RUN(test_binary_export_matches_text);
+    RUN(test_binary_corrupt_falls_back);
+    RUN(test_binary_unknown_drive);
     REPORT();
 }
@@ -0,0 +1,342 @@
+#include "test_harness.h"
+#include "metalog.h"
+#include "metadata.h"
+#include "state.h"
+#include "config.h"
+#include "alloc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define CONTENT_PATH "/tmp/lr_test_mlog.content"
+#define LOG_PATH     CONTENT_PATH ".log"
+
+static void make_config(lr_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->block_size       = 65536;
+    cfg->placement_policy = LR_PLACE_ROUNDROBIN;
+    cfg->parity_threads   = 1;
+    snprintf(cfg->drives[0].name, 64,       "d0");
+    snprintf(cfg->drives[0].dir,  PATH_MAX, "/tmp");
+    cfg->drive_count = 1;
+    snprintf(cfg->content_paths[0], PATH_MAX, CONTENT_PATH);
+    cfg->content_count = 1;
+    snprintf(cfg->mountpoint, PATH_MAX, "/tmp/lr_test_mount");
+}
+
+static void cleanup(void)
+{
+    unlink(CONTENT_PATH);
+    unlink(LOG_PATH);
+}
+
+/* Fresh state with an empty snapshot and a log attached. */
+static void start(lr_state *s, lr_metalog *ml, const lr_config *cfg)
+{
+    cleanup();
+    state_init(s, cfg);
+    ASSERT_INT_EQ(metadata_save(s), 0);
+    ASSERT_INT_EQ(metalog_init(ml, s, 64 << 20), 0);
+    s->mlog = ml;
+}
+
+static void stop(lr_state *s)
+{
+    if (s->mlog)
+        metalog_done(s->mlog);
+    s->mlog = NULL;
+    state_done(s);
+}
+
+static lr_file *add_file(lr_state *s, const char *vpath, uint32_t pos,
+                         uint32_t blocks)
+{
+    lr_file *f = calloc(1, sizeof(lr_file));
+    state_set_path(s, &f->vpath, vpath);
+    f->size             = (int64_t)blocks * 65536;
+    f->parity_pos_start = pos;
+    f->block_count      = blocks;
+    f->mtime_sec        = 1600000000;
+    f->mode             = S_IFREG | 0640;
+    f->uid              = 7;
+    state_insert_file(s, f);
+    state_pos_index_insert(s, f);
+    metalog_file(s, f);
+    return f;
+}
+
+static void flush(lr_state *s)
+{
+    metalog_collect(s);
+    ASSERT(metalog_write(s->mlog) >= 0);
+}
+
+static void append(const char *path, const char *text)
+{
+    FILE *f = fopen(path, "a");
+    fputs(text, f);
+    fclose(f);
+}
+
+/* ------------------------------------------------------------------ */
+
+/* Flushed changes survive without a snapshot; positions are rebuilt. */
+static void test_flush_replay(void)
+{
+    lr_config cfg; make_config(&cfg);
+    lr_state s; lr_metalog ml;
+    start(&s, &ml, &cfg);
+
+    add_file(&s, "/a/early.bin", 0, 3);
+    add_file(&s, "/b/late.bin",  8, 2);
+    s.drives[0].pos_alloc.next_free = 10;
+
+    lr_dir *d = calloc(1, sizeof(lr_dir));
+    state_set_path(&s, &d->vpath, "/a");
+    d->mode = S_IFDIR | 0700;
+    state_insert_dir(&s, d);
+    metalog_dir(&s, d);
+
+    lr_symlink *sl = calloc(1, sizeof(lr_symlink));
+    state_set_path(&s, &sl->vpath,  "/a/link");
+    state_set_path(&s, &sl->target, "early.bin");
+    state_insert_symlink(&s, sl);
+    metalog_symlink(&s, sl);
+
+    flush(&s);
+    stop(&s);   /* crash: no snapshot */
+
+    lr_state s2; state_init(&s2, &cfg);
+    ASSERT_INT_EQ(metadata_load(&s2), 0);
+    ASSERT_INT_EQ(s2.log_replayed, 4);
+    lr_file *f = state_find_file(&s2, "/b/late.bin");
+    ASSERT(f != NULL);
+    ASSERT_INT_EQ(f->parity_pos_start, 8);
+    ASSERT_INT_EQ(f->block_count, 2);
+    ASSERT_INT_EQ(f->uid, 7);
+    ASSERT(state_find_dir(&s2, "/a") != NULL);
+    ASSERT(state_find_symlink(&s2, "/a/link") != NULL);
+    ASSERT(state_find_file_at_pos(&s2, 0, 9) == f);
+
+    /* The gap between the two files is free again */
+    lr_pos_allocator *pa = &s2.drives[0].pos_alloc;
+    ASSERT_INT_EQ(pa->next_free, 10);
+    ASSERT_INT_EQ(pa->ext_count, 1);
+    lr_extent e = { 0, 0 };
+    ASSERT(alloc_next_extent(pa, 0, &e));
+    ASSERT_INT_EQ(e.start, 3);
+    ASSERT_INT_EQ(e.count, 5);
+    state_done(&s2);
+    cleanup();
+}
+
+/* A file changed many times between flushes costs one record, holding
+ * its latest state. */
+static void test_file_records_coalesce(void)
+{
+    lr_config cfg; make_config(&cfg);
+    lr_state s; lr_metalog ml;
+    start(&s, &ml, &cfg);
+
+    lr_file *f = add_file(&s, "/grow", 0, 1);
+    for (int i = 2; i <= 5; i++) {
+        f->size        = (int64_t)i * 65536;
+        f->block_count = (uint32_t)i;
+        metalog_file(&s, f);
+    }
+    s.drives[0].pos_alloc.next_free = 5;
+    flush(&s);
+    lr_metalog_stats st;
+    metalog_get_stats(&ml, &st);
+    ASSERT_INT_EQ(st.flushes, 1);
+    ASSERT_INT_EQ(st.records, 1);
+    stop(&s);
+
+    lr_state s2; state_init(&s2, &cfg);
+    ASSERT_INT_EQ(metadata_load(&s2), 0);
+    f = state_find_file(&s2, "/grow");
+    ASSERT(f != NULL);
+    ASSERT_INT_EQ(f->size, 5 * 65536);
+    state_done(&s2);
+    cleanup();
+}
+
+/* Removals, a file rename and a directory rename replay in order. */
+static void test_removals_and_renames(void)
+{
+    lr_config cfg; make_config(&cfg);
+    lr_state s; lr_metalog ml;
+    start(&s, &ml, &cfg);
+
+    add_file(&s, "/gone", 0, 1);
+    add_file(&s, "/old/name", 1, 1);
+    add_file(&s, "/dir/inner", 2, 1);
+    s.drives[0].pos_alloc.next_free = 3;
+    flush(&s);
+
+    /* unlink /gone */
+    lr_file *f = state_remove_file(&s, "/gone");
+    state_pos_index_remove(&s, f);
+    state_free_file(&s, f);
+    metalog_remove_file(&s, "/gone");
+
+    /* rename /old/name -> /new/name */
+    f = state_remove_file(&s, "/old/name");
+    state_set_path(&s, &f->vpath, "/new/name");
+    state_insert_file(&s, f);
+    metalog_remove_file(&s, "/old/name");
+    metalog_file(&s, f);
+
+    /* rename /dir -> /moved */
+    ASSERT_INT_EQ(state_rename_dir(&s, "/dir", "/moved"), 0);
+    metalog_rename_dir(&s, "/dir", "/moved");
+    flush(&s);
+    stop(&s);
+
+    lr_state s2; state_init(&s2, &cfg);
+    ASSERT_INT_EQ(metadata_load(&s2), 0);
+    ASSERT(state_find_file(&s2, "/gone") == NULL);
+    ASSERT(state_find_file(&s2, "/old/name") == NULL);
+    ASSERT(state_find_file(&s2, "/new/name") != NULL);
+    ASSERT(state_find_file(&s2, "/dir/inner") == NULL);
+    ASSERT(state_find_file(&s2, "/moved/inner") != NULL);
+    ASSERT_INT_EQ(s2.file_list.count, 2);
+    ASSERT_INT_EQ(s2.drives[0].pos_alloc.ext_count, 1);
+    lr_extent e = { 0, 0 };
+    ASSERT(alloc_next_extent(&s2.drives[0].pos_alloc, 0, &e));
+    ASSERT_INT_EQ(e.start, 0);
+    state_done(&s2);
+    cleanup();
+}
+
+/* An uncommitted or corrupt batch at the tail is not applied. */
+static void test_torn_tail_ignored(void)
+{
+    lr_config cfg; make_config(&cfg);
+    lr_state s; lr_metalog ml;
+    start(&s, &ml, &cfg);
+    add_file(&s, "/kept", 0, 1);
+    flush(&s);
+    stop(&s);
+
+    /* Batch with a wrong checksum, then a record without a commit */
+    append(LOG_PATH, "file|d0|/bad|0|0|0|0|0|100644|0|0\n"
+                     "# commit 2 1 crc32:00000000\n"
+                     "file|d0|/torn|0|0|0|0|0|100644|0|0\n");
+
+    lr_state s2; state_init(&s2, &cfg);
+    ASSERT_INT_EQ(metadata_load(&s2), 0);
+    ASSERT(state_find_file(&s2, "/kept") != NULL);
+    ASSERT(state_find_file(&s2, "/bad") == NULL);
+    ASSERT(state_find_file(&s2, "/torn") == NULL);
+    ASSERT_INT_EQ(s2.log_replayed, 1);
+    state_done(&s2);
+    cleanup();
+}
+
+/* A log older than the snapshot is already folded into it. */
+static void test_stale_log_ignored(void)
+{
+    lr_config cfg; make_config(&cfg);
+    lr_state s; lr_metalog ml;
+    start(&s, &ml, &cfg);
+    add_file(&s, "/logged", 0, 1);
+    flush(&s);
+    uint64_t gen = s.meta_gen;
+    stop(&s);
+
+    /* A newer, empty snapshot written without the log */
+    lr_state s2; state_init(&s2, &cfg);
+    s2.meta_gen = gen;
+    ASSERT_INT_EQ(metadata_save(&s2), 0);
+    state_done(&s2);
+
+    lr_state s3; state_init(&s3, &cfg);
+    ASSERT_INT_EQ(metadata_load(&s3), 0);
+    ASSERT_INT_EQ(s3.meta_gen, gen + 1);
+    ASSERT_INT_EQ(s3.log_replayed, 0);
+    ASSERT_INT_EQ(s3.file_list.count, 0);
+    state_done(&s3);
+    cleanup();
+}
+
+/* A snapshot flushes pending records, empties the log and bumps the
+ * generation; a tiny threshold makes compaction due. */
+static void test_compaction(void)
+{
+    lr_config cfg; make_config(&cfg);
+    lr_state s; lr_metalog ml;
+    start(&s, &ml, &cfg);
+    ml.compact_bytes = 16;
+    uint64_t gen = s.meta_gen;
+
+    add_file(&s, "/a", 0, 1);
+    flush(&s);
+    ASSERT(metalog_needs_compaction(&ml));
+    add_file(&s, "/b", 1, 1);     /* pending at the snapshot */
+    s.drives[0].pos_alloc.next_free = 2;
+    ASSERT_INT_EQ(metadata_save(&s), 0);
+    ASSERT_INT_EQ(s.meta_gen, gen + 1);
+    ASSERT(!metalog_needs_compaction(&ml));
+
+    lr_metalog_stats st;
+    metalog_get_stats(&ml, &st);
+    ASSERT_INT_EQ(st.compactions, 1);
+    ASSERT_INT_EQ(st.log_bytes, 0);
+    ASSERT_INT_EQ(st.records, 2);
+
+    struct stat sb;
+    ASSERT_INT_EQ(stat(LOG_PATH, &sb), 0);
+    ASSERT(sb.st_size < 32);   /* just the header */
+
+    /* Changes after the compaction go to the new log */
+    add_file(&s, "/c", 2, 1);
+    s.drives[0].pos_alloc.next_free = 3;
+    flush(&s);
+    stop(&s);
+
+    lr_state s2; state_init(&s2, &cfg);
+    ASSERT_INT_EQ(metadata_load(&s2), 0);
+    ASSERT_INT_EQ(s2.log_replayed, 1);
+    ASSERT_INT_EQ(s2.file_list.count, 3);
+    state_done(&s2);
+    cleanup();
+}
+
+/* The binary snapshot carries the generation too. */
+static void test_binary_snapshot(void)
+{
+    lr_config cfg; make_config(&cfg);
+    cfg.content_format = LR_CONTENT_BINARY;
+    lr_state s; lr_metalog ml;
+    start(&s, &ml, &cfg);
+    add_file(&s, "/bin", 0, 2);
+    s.drives[0].pos_alloc.next_free = 2;
+    flush(&s);
+    stop(&s);
+
+    lr_state s2; state_init(&s2, &cfg);
+    ASSERT_INT_EQ(metadata_load(&s2), 0);
+    ASSERT_INT_EQ(s2.meta_gen, 1);
+    ASSERT_INT_EQ(s2.log_replayed, 1);
+    ASSERT(state_find_file(&s2, "/bin") != NULL);
+    state_done(&s2);
+    cleanup();
+}
+
+int main(void)
+{
+    printf("test_metalog\n");
+    RUN(test_flush_replay);
+    RUN(test_file_records_coalesce);
+    RUN(test_removals_and_renames);
+    RUN(test_torn_tail_ignored);
+    RUN(test_stale_log_ignored);
+    RUN(test_compaction);
+    RUN(test_binary_snapshot);
+    REPORT();
+}
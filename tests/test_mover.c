@@ -0,0 +1,320 @@
+#include "test_harness.h"
+#include "mover.h"
+#include "metadata.h"
+#include "state.h"
+#include "config.h"
+#include "alloc.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define ROOT    "/tmp/lr_test_mover"
+#define CONTENT "/tmp/lr_test_mover.content"
+
+static const char *const dirs[] = { ROOT "/d0", ROOT "/d1", ROOT "/cache" };
+
+static void make_config(lr_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->block_size       = 65536;
+    cfg->placement_policy = LR_PLACE_ROUNDROBIN;
+    cfg->parity_threads   = 1;
+    for (unsigned i = 0; i < 2; i++) {
+        snprintf(cfg->drives[i].name, 64,       "d%u", i);
+        snprintf(cfg->drives[i].dir,  PATH_MAX, "%s", dirs[i]);
+    }
+    cfg->drive_count = 2;
+    snprintf(cfg->cache.name, 64,       "ssd");
+    snprintf(cfg->cache.dir,  PATH_MAX, "%s", dirs[2]);
+    cfg->cache_idle_s = 3600;
+    snprintf(cfg->content_paths[0], PATH_MAX, CONTENT);
+    cfg->content_count = 1;
+    snprintf(cfg->mountpoint, PATH_MAX, "/tmp/lr_test_mount");
+}
+
+/* Fresh drive directories and a state whose cache is half full (the
+ * cached free space is never refreshed from statvfs) */
+static void setup(lr_state *s)
+{
+    lr_config cfg;
+    make_config(&cfg);
+    mkdir(ROOT, 0755);
+    for (unsigned i = 0; i < 3; i++)
+        mkdir(dirs[i], 0755);
+    unlink(CONTENT);
+    ASSERT_INT_EQ(state_init(s, &cfg), 0);
+    s->free_refreshed = (time_t)1 << 40;
+    for (unsigned i = 0; i < 3; i++) {
+        s->drives[i].total_bytes = 1u << 30;
+        s->drives[i].free_bytes  = 1 << 29;
+    }
+}
+
+static void teardown(lr_state *s)
+{
+    state_done(s);
+    for (unsigned i = 0; i < 3; i++)
+        rmdir(dirs[i]);
+    rmdir(ROOT);
+    unlink(CONTENT);
+}
+
+/* A file of size bytes (byte i = i % 251) on drive d, with its record;
+ * age = seconds since its mtime */
+static lr_file *add_file(lr_state *s, unsigned d, const char *vpath,
+                         int64_t size, time_t age)
+{
+    char real[PATH_MAX];
+    snprintf(real, sizeof(real), "%s%s", s->drives[d].dir, vpath + 1);
+    state_make_parents(s, d, real);
+    int fd = open(real, O_WRONLY | O_CREAT | O_TRUNC, 0640);
+    if (fd < 0)
+        return NULL;
+    for (int64_t i = 0; i < size; i++) {
+        unsigned char b = (unsigned char)(i % 251);
+        if (write(fd, &b, 1) != 1)
+            break;
+    }
+    close(fd);
+
+    lr_file *f = calloc(1, sizeof(lr_file));
+    state_set_path(s, &f->vpath, vpath);
+    f->drive_idx   = d;
+    f->size        = size;
+    f->block_count = state_file_blocks(s, d, (uint64_t)size);
+    f->mtime_sec   = time(NULL) - age;
+    f->mode        = S_IFREG | 0640;
+    state_insert_file(s, f);
+    return f;
+}
+
+/* The file at real has add_file's content for size bytes */
+static int content_ok(const char *real, int64_t size)
+{
+    int fd = open(real, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    int ok = fstat(fd, &st) == 0 && st.st_size == size;
+    for (int64_t i = 0; ok && i < size; i++) {
+        unsigned char b;
+        ok = read(fd, &b, 1) == 1 && b == (unsigned char)(i % 251);
+    }
+    close(fd);
+    return ok;
+}
+
+static int exists(const char *path)
+{
+    struct stat st;
+    return lstat(path, &st) == 0;
+}
+
+static void remove_file(lr_state *s, const char *vpath)
+{
+    lr_file *f = state_find_file(s, vpath);
+    if (!f)
+        return;
+    char real[PATH_MAX];
+    unlink(state_real_path(s, f, real, sizeof(real)));
+    state_remove_file(s, vpath);
+    state_free_file(s, f);
+}
+
+/* Records the ranges passed to the callbacks */
+typedef struct {
+    unsigned  nmark, nflush;
+    lr_extent mark[8], flush[8];
+} calls;
+
+static void rec_mark(void *arg, uint32_t start, uint32_t count)
+{
+    calls *c = arg;
+    if (c->nmark < 8)
+        c->mark[c->nmark++] = (lr_extent){ start, count };
+}
+
+static void rec_flush(void *arg, uint32_t start, uint32_t count)
+{
+    calls *c = arg;
+    if (c->nflush < 8)
+        c->flush[c->nflush++] = (lr_extent){ start, count };
+}
+
+/* An idle file moves to a data drive with its data, attributes and new
+ * positions, which are marked and flushed; its cache copy and the
+ * directory left empty go, and the move is in the saved content file.
+ * A fresh file stays. */
+static void test_move_idle(void)
+{
+    lr_state s;
+    setup(&s);
+    unsigned cache = s.cache_drive;
+    ASSERT_INT_EQ(cache, 2);
+    lr_file *old = add_file(&s, cache, "/a/old.bin", 100000, 7200);
+    add_file(&s, cache, "/new.bin", 10, 0);
+    ASSERT_INT_EQ(old->block_count, 0);
+    ASSERT_INT_EQ(s.cache_files.count, 2);
+
+    calls c;
+    memset(&c, 0, sizeof(c));
+    lr_mover m;
+    ASSERT_INT_EQ(mover_init(&m, &s, 3600, rec_mark, rec_flush, &c), 0);
+    lr_mover_result r;
+    ASSERT_INT_EQ(mover_run(&m, 0, &r), 0);
+    ASSERT_INT_EQ(r.files_moved, 1);
+    ASSERT_INT_EQ(r.bytes_moved, 100000);
+    ASSERT_INT_EQ(r.raced, 0);
+    ASSERT_INT_EQ(r.failed, 0);
+
+    ASSERT(old->drive_idx < s.drive_count);
+    ASSERT_INT_EQ(old->block_count, 2);
+    ASSERT_INT_EQ(s.pos_index_count[old->drive_idx], 1);
+    ASSERT_INT_EQ(s.cache_files.count, 1);
+    ASSERT_INT_EQ(c.nmark, 1);
+    ASSERT_INT_EQ(c.mark[0].start, old->parity_pos_start);
+    ASSERT_INT_EQ(c.mark[0].count, 2);
+    ASSERT_INT_EQ(c.nflush, 1);
+    ASSERT_INT_EQ(c.flush[0].count, 2);
+
+    char real[PATH_MAX];
+    state_real_path(&s, old, real, sizeof(real));
+    ASSERT(content_ok(real, 100000));
+    struct stat st;
+    ASSERT_INT_EQ(stat(real, &st), 0);
+    ASSERT_INT_EQ(st.st_mode & 07777, 0640);
+    ASSERT_INT_EQ(st.st_mtim.tv_sec, old->mtime_sec);
+    ASSERT(!exists(ROOT "/cache/a/old.bin"));
+    ASSERT(!exists(ROOT "/cache/a"));
+    ASSERT(exists(ROOT "/cache/new.bin"));
+
+    lr_mover_stats ms;
+    mover_get_stats(&m, &ms);
+    ASSERT_INT_EQ(ms.passes, 1);
+    ASSERT_INT_EQ(ms.files_moved, 1);
+    ASSERT_INT_EQ(ms.pending, 1);
+    ASSERT_INT_EQ(ms.pending_bytes, 10);
+    mover_done(&m);
+
+    /* Reloaded: on its data drive, with its positions */
+    lr_state s2;
+    ASSERT_INT_EQ(state_init(&s2, &s.cfg), 0);
+    ASSERT_INT_EQ(metadata_load(&s2), 0);
+    lr_file *f2 = state_find_file(&s2, "/a/old.bin");
+    ASSERT(f2 != NULL);
+    ASSERT_INT_EQ(f2->drive_idx, old->drive_idx);
+    ASSERT_INT_EQ(f2->block_count, 2);
+    f2 = state_find_file(&s2, "/new.bin");
+    ASSERT(f2 != NULL);
+    ASSERT_INT_EQ(f2->drive_idx, cache);
+    ASSERT_INT_EQ(s2.cache_files.count, 1);
+    state_done(&s2);
+
+    unsigned d = old->drive_idx;
+    remove_file(&s, "/a/old.bin");
+    remove_file(&s, "/new.bin");
+    rmdir(d == 0 ? ROOT "/d0/a" : ROOT "/d1/a");
+    teardown(&s);
+}
+
+/* all = 1 moves fresh files too; a cache past its reserve does so on its
+ * own; open files stay either way. */
+static void test_all_and_full(void)
+{
+    lr_state s;
+    setup(&s);
+    unsigned cache = s.cache_drive;
+    lr_file *a = add_file(&s, cache, "/a.bin", 5, 0);
+    lr_file *b = add_file(&s, cache, "/b.bin", 0, 0);
+    lr_file *o = add_file(&s, cache, "/open.bin", 5, 7200);
+    state_open_inc(o);
+
+    lr_mover m;
+    ASSERT_INT_EQ(mover_init(&m, &s, 3600, NULL, NULL, NULL), 0);
+    lr_mover_result r;
+    ASSERT_INT_EQ(mover_run(&m, 0, &r), 0);
+    ASSERT_INT_EQ(r.files_moved, 0);
+
+    ASSERT_INT_EQ(mover_run(&m, 1, &r), 0);
+    ASSERT_INT_EQ(r.files_moved, 2);
+    ASSERT(a->drive_idx < s.drive_count);
+    ASSERT(b->drive_idx < s.drive_count);
+    ASSERT_INT_EQ(b->block_count, 0);
+    ASSERT_INT_EQ(o->drive_idx, cache);
+
+    lr_file *c = add_file(&s, cache, "/c.bin", 5, 0);
+    s.drives[cache].free_bytes = 0;
+    ASSERT(!state_cache_has_room(&s));
+    ASSERT_INT_EQ(mover_run(&m, 0, &r), 0);
+    ASSERT_INT_EQ(r.files_moved, 1);
+    ASSERT(c->drive_idx < s.drive_count);
+
+    state_open_dec(o);
+    ASSERT_INT_EQ(mover_run(&m, 0, &r), 0);
+    ASSERT_INT_EQ(r.files_moved, 1);
+    ASSERT_INT_EQ(s.cache_files.count, 0);
+    mover_done(&m);
+
+    remove_file(&s, "/a.bin");
+    remove_file(&s, "/b.bin");
+    remove_file(&s, "/c.bin");
+    remove_file(&s, "/open.bin");
+    teardown(&s);
+}
+
+/* A file whose data does not match its record is left on the cache as
+ * raced, with no copy behind; a stale temporary copy is replaced. */
+static void test_raced_and_stale(void)
+{
+    lr_state s;
+    setup(&s);
+    unsigned cache = s.cache_drive;
+    lr_file *f = add_file(&s, cache, "/f.bin", 20, 7200);
+    f->size = 10;
+
+    lr_mover m;
+    ASSERT_INT_EQ(mover_init(&m, &s, 3600, NULL, NULL, NULL), 0);
+    lr_mover_result r;
+    ASSERT_INT_EQ(mover_run(&m, 0, &r), 0);
+    ASSERT_INT_EQ(r.files_moved, 0);
+    ASSERT_INT_EQ(r.raced, 1);
+    ASSERT_INT_EQ(f->drive_idx, cache);
+    ASSERT(!exists(ROOT "/d0/f.bin.lrmove"));
+    ASSERT(!exists(ROOT "/d1/f.bin.lrmove"));
+
+    /* Left by an interrupted pass on both data drives */
+    f->size = 20;
+    int fd = open(ROOT "/d0/f.bin.lrmove", O_WRONLY | O_CREAT, 0600);
+    close(fd);
+    fd = open(ROOT "/d1/f.bin.lrmove", O_WRONLY | O_CREAT, 0600);
+    close(fd);
+    ASSERT_INT_EQ(mover_run(&m, 0, &r), 0);
+    ASSERT_INT_EQ(r.files_moved, 1);
+    char real[PATH_MAX];
+    ASSERT(content_ok(state_real_path(&s, f, real, sizeof(real)), 20));
+
+    lr_mover_stats ms;
+    mover_get_stats(&m, &ms);
+    ASSERT_INT_EQ(ms.raced, 1);
+    ASSERT_INT_EQ(ms.files_moved, 1);
+    ASSERT_INT_EQ(ms.pending, 0);
+    mover_done(&m);
+
+    unlink(ROOT "/d0/f.bin.lrmove");
+    unlink(ROOT "/d1/f.bin.lrmove");
+    remove_file(&s, "/f.bin");
+    teardown(&s);
+}
+
+int main(void)
+{
+    printf("test_mover\n");
+    RUN(test_move_idle);
+    RUN(test_all_and_full);
+    RUN(test_raced_and_stale);
+    REPORT();
+}
@@ -0,0 +1,185 @@
+#include "test_harness.h"
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ITEMS 10000
+
+typedef struct {
+    pthread_mutex_t lock;
+    unsigned        hits[ITEMS];
+    void          **seen[LR_POOL_MAX];   /* distinct scratch vectors */
+    unsigned        nseen;
+    int             misaligned;
+    unsigned        slow_start;          /* chunk start that sleeps */
+} count_job;
+
+static void count_chunk(void *arg, void **v, uint32_t start, uint32_t count)
+{
+    count_job *job = (count_job *)arg;
+
+    if (start == job->slow_start)
+        usleep(50000);
+
+    pthread_mutex_lock(&job->lock);
+    for (uint32_t i = start; i < start + count; i++)
+        job->hits[i]++;
+    unsigned k;
+    for (k = 0; k < job->nseen; k++)
+        if (job->seen[k] == v)
+            break;
+    if (k == job->nseen && job->nseen < LR_POOL_MAX)
+        job->seen[job->nseen++] = v;
+    if (v && (((uintptr_t)v[0] | (uintptr_t)v[1]) & 4095))
+        job->misaligned = 1;
+    pthread_mutex_unlock(&job->lock);
+}
+
+static count_job *job_new(void)
+{
+    count_job *job = calloc(1, sizeof(*job));
+    pthread_mutex_init(&job->lock, NULL);
+    job->slow_start = UINT32_MAX;
+    return job;
+}
+
+static void job_free(count_job *job)
+{
+    pthread_mutex_destroy(&job->lock);
+    free(job);
+}
+
+static int all_hit_once(const count_job *job, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        if (job->hits[i] != 1)
+            return 0;
+    return 1;
+}
+
+static void test_every_item_once(void)
+{
+    lr_pool p;
+    ASSERT_INT_EQ(pool_init(&p, 4, 2, 100), 0);
+
+    count_job *job = job_new();
+    pool_run(&p, ITEMS, 7, count_chunk, job);
+    ASSERT(all_hit_once(job, ITEMS));
+    ASSERT(job->nseen >= 1 && job->nseen <= 4);
+    ASSERT_INT_EQ(job->misaligned, 0);
+
+    lr_pool_stats st;
+    pool_get_stats(&p, &st);
+    ASSERT_INT_EQ(st.threads, 4);
+    ASSERT_INT_EQ(st.runs,    1);
+    ASSERT_INT_EQ(st.chunks,  (ITEMS + 6) / 7);
+
+    job_free(job);
+    pool_done(&p);
+}
+
+static void test_reuse_across_runs(void)
+{
+    lr_pool p;
+    ASSERT_INT_EQ(pool_init(&p, 3, 1, 64), 0);
+
+    for (int r = 0; r < 20; r++) {
+        count_job *job = job_new();
+        pool_run(&p, 1000 + (uint32_t)r, 10, count_chunk, job);
+        ASSERT(all_hit_once(job, 1000 + (uint32_t)r));
+        job_free(job);
+    }
+
+    lr_pool_stats st;
+    pool_get_stats(&p, &st);
+    ASSERT_INT_EQ(st.runs, 20);
+    pool_done(&p);
+}
+
+/* One slow chunk at the head of worker 0's deque: the rest of its range
+ * must be stolen instead of waiting behind it. */
+static void test_slow_chunk_stolen(void)
+{
+    lr_pool p;
+    ASSERT_INT_EQ(pool_init(&p, 4, 0, 0), 0);
+
+    count_job *job = job_new();
+    job->slow_start = 0;
+    pool_run(&p, 4000, 10, count_chunk, job);
+    ASSERT(all_hit_once(job, 4000));
+
+    lr_pool_stats st;
+    pool_get_stats(&p, &st);
+    ASSERT(st.steals > 0);
+
+    job_free(job);
+    pool_done(&p);
+}
+
+static void test_single_thread_and_empty(void)
+{
+    lr_pool p;
+    ASSERT_INT_EQ(pool_init(&p, 1, 1, 8), 0);
+
+    count_job *job = job_new();
+    pool_run(&p, 0, 10, count_chunk, job);   /* no-op */
+    pool_run(&p, 5, 0, count_chunk, job);    /* grain 0 treated as 1 */
+    ASSERT(all_hit_once(job, 5));
+    ASSERT_INT_EQ(job->nseen, 1);
+
+    lr_pool_stats st;
+    pool_get_stats(&p, &st);
+    ASSERT_INT_EQ(st.runs,   1);
+    ASSERT_INT_EQ(st.chunks, 5);
+    ASSERT_INT_EQ(st.steals, 0);
+
+    job_free(job);
+    pool_done(&p);
+}
+
+typedef struct {
+    lr_pool   *pool;
+    count_job *job;
+} caller_arg;
+
+static void *caller_thread(void *arg)
+{
+    caller_arg *ca = (caller_arg *)arg;
+    pool_run(ca->pool, ITEMS, 13, count_chunk, ca->job);
+    return NULL;
+}
+
+static void test_concurrent_callers(void)
+{
+    lr_pool p;
+    ASSERT_INT_EQ(pool_init(&p, 4, 1, 16), 0);
+
+    count_job *a = job_new(), *b = job_new();
+    caller_arg ca = { &p, a }, cb = { &p, b };
+    pthread_t  ta, tb;
+    ASSERT_INT_EQ(pthread_create(&ta, NULL, caller_thread, &ca), 0);
+    ASSERT_INT_EQ(pthread_create(&tb, NULL, caller_thread, &cb), 0);
+    pthread_join(ta, NULL);
+    pthread_join(tb, NULL);
+
+    ASSERT(all_hit_once(a, ITEMS));
+    ASSERT(all_hit_once(b, ITEMS));
+
+    job_free(a);
+    job_free(b);
+    pool_done(&p);
+}
+
+int main(void)
+{
+    printf("test_pool\n");
+    RUN(test_every_item_once);
+    RUN(test_reuse_across_runs);
+    RUN(test_slow_chunk_stolen);
+    RUN(test_single_thread_and_empty);
+    RUN(test_concurrent_callers);
+    REPORT();
+}
@@ -0,0 +1,197 @@
+#include "test_harness.h"
+#include "rcache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BS 64
+
+/* Block contents derived from (drive, pos) so any mix-up shows. */
+static void fill_block(uint8_t *buf, unsigned drive, uint32_t pos)
+{
+    for (unsigned i = 0; i < BS; i++)
+        buf[i] = (uint8_t)(drive * 31 + pos * 7 + i);
+}
+
+static void put_block(lr_rcache *c, unsigned drive, uint32_t pos)
+{
+    uint8_t buf[BS];
+    fill_block(buf, drive, pos);
+    rcache_put(c, drive, pos, buf, rcache_gen(c));
+}
+
+static int block_ok(lr_rcache *c, unsigned drive, uint32_t pos)
+{
+    uint8_t got[BS], want[BS];
+    if (!rcache_read(c, drive, pos, got, 0, BS))
+        return 0;
+    fill_block(want, drive, pos);
+    return memcmp(got, want, BS) == 0;
+}
+
+static void test_hit_miss_partial(void)
+{
+    lr_rcache c;
+    ASSERT_INT_EQ(rcache_init(&c, 8, BS, NULL, NULL), 0);
+
+    uint8_t out[BS];
+    ASSERT_INT_EQ(rcache_read(&c, 0, 5, out, 0, BS), 0);
+    put_block(&c, 0, 5);
+    ASSERT(block_ok(&c, 0, 5));
+    ASSERT_INT_EQ(rcache_read(&c, 1, 5, out, 0, BS), 0);   /* other drive */
+
+    uint8_t want[BS];
+    fill_block(want, 0, 5);
+    ASSERT_INT_EQ(rcache_read(&c, 0, 5, out, 10, 20), 1);
+    ASSERT(memcmp(out, want + 10, 20) == 0);
+
+    lr_rcache_stats st;
+    rcache_get_stats(&c, &st);
+    ASSERT_INT_EQ(st.hits,   2);
+    ASSERT_INT_EQ(st.misses, 2);
+    ASSERT_INT_EQ(st.blocks, 1);
+    rcache_done(&c);
+}
+
+static void test_lru_eviction(void)
+{
+    lr_rcache c;
+    ASSERT_INT_EQ(rcache_init(&c, 3, BS, NULL, NULL), 0);
+
+    put_block(&c, 0, 1);
+    put_block(&c, 0, 2);
+    put_block(&c, 0, 3);
+    ASSERT(block_ok(&c, 0, 1));     /* 1 becomes most recent */
+    put_block(&c, 0, 4);            /* evicts 2 */
+
+    ASSERT(rcache_contains(&c, 0, 1));
+    ASSERT(!rcache_contains(&c, 0, 2));
+    ASSERT(rcache_contains(&c, 0, 3));
+    ASSERT(rcache_contains(&c, 0, 4));
+
+    lr_rcache_stats st;
+    rcache_get_stats(&c, &st);
+    ASSERT_INT_EQ(st.evictions, 1);
+    ASSERT_INT_EQ(st.blocks,    3);
+    ASSERT_INT_EQ(st.capacity,  3);
+    rcache_done(&c);
+}
+
+/* A recovery that raced with an invalidation must not be cached. */
+static void test_stale_put_dropped(void)
+{
+    lr_rcache c;
+    ASSERT_INT_EQ(rcache_init(&c, 8, BS, NULL, NULL), 0);
+
+    uint8_t buf[BS];
+    fill_block(buf, 0, 7);
+    uint64_t gen = rcache_gen(&c);
+    rcache_invalidate(&c, 100, 1);  /* unrelated position, still bumps gen */
+    rcache_put(&c, 0, 7, buf, gen);
+    ASSERT(!rcache_contains(&c, 0, 7));
+
+    rcache_put(&c, 0, 7, buf, rcache_gen(&c));
+    ASSERT(rcache_contains(&c, 0, 7));
+    rcache_done(&c);
+}
+
+static void test_invalidate_range(void)
+{
+    lr_rcache c;
+    ASSERT_INT_EQ(rcache_init(&c, 64, BS, NULL, NULL), 0);
+
+    for (uint32_t p = 0; p < 10; p++) {
+        put_block(&c, 0, p);
+        put_block(&c, 2, p);
+    }
+    /* Small range: probed per drive */
+    rcache_invalidate(&c, 3, 2);
+    ASSERT(rcache_contains(&c, 0, 2));
+    ASSERT(!rcache_contains(&c, 0, 3));
+    ASSERT(!rcache_contains(&c, 2, 4));
+    ASSERT(rcache_contains(&c, 2, 5));
+
+    /* Large range: scanned */
+    rcache_invalidate(&c, 6, 1000);
+    ASSERT(rcache_contains(&c, 0, 5));
+    ASSERT(!rcache_contains(&c, 0, 6));
+    ASSERT(!rcache_contains(&c, 2, 9));
+
+    lr_rcache_stats st;
+    rcache_get_stats(&c, &st);
+    ASSERT_INT_EQ(st.blocks, 8);
+    rcache_done(&c);
+}
+
+typedef struct {
+    lr_rcache *cache;
+    unsigned   calls;
+    uint32_t   blocks;
+} fill_ctx;
+
+static int test_fill(void *arg, unsigned drive, uint32_t pos, uint32_t count)
+{
+    fill_ctx *fc = (fill_ctx *)arg;
+    __atomic_add_fetch(&fc->calls, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&fc->blocks, count, __ATOMIC_SEQ_CST);
+    for (uint32_t i = 0; i < count; i++)
+        put_block(fc->cache, drive, pos + i);
+    return 0;
+}
+
+static int wait_cached(lr_rcache *c, unsigned drive, uint32_t pos)
+{
+    for (int i = 0; i < 500; i++) {
+        if (rcache_contains(c, drive, pos))
+            return 1;
+        usleep(2000);
+    }
+    return 0;
+}
+
+static void test_prefetch_fills(void)
+{
+    lr_rcache c;
+    fill_ctx  fc = { &c, 0, 0 };
+    ASSERT_INT_EQ(rcache_init(&c, 64, BS, test_fill, &fc), 0);
+
+    /* Blocks already cached are skipped: 20..23 and 25..27 are filled */
+    put_block(&c, 1, 24);
+    rcache_prefetch(&c, 1, 20, 8);
+    ASSERT(wait_cached(&c, 1, 27));
+    for (uint32_t p = 20; p < 28; p++)
+        ASSERT(block_ok(&c, 1, p));
+    ASSERT_INT_EQ(__atomic_load_n(&fc.calls, __ATOMIC_SEQ_CST), 2);
+    ASSERT_INT_EQ(__atomic_load_n(&fc.blocks, __ATOMIC_SEQ_CST), 7);
+
+    lr_rcache_stats st;
+    rcache_get_stats(&c, &st);
+    ASSERT_INT_EQ(st.prefetched, 8);
+    rcache_done(&c);
+}
+
+static void test_prefetch_without_fill(void)
+{
+    lr_rcache c;
+    ASSERT_INT_EQ(rcache_init(&c, 4, BS, NULL, NULL), 0);
+    rcache_prefetch(&c, 0, 0, 4);   /* no-op */
+
+    lr_rcache_stats st;
+    rcache_get_stats(&c, &st);
+    ASSERT_INT_EQ(st.prefetched, 0);
+    ASSERT_INT_EQ(st.blocks,     0);
+    rcache_done(&c);
+}
+
+int main(void)
+{
+    printf("test_rcache\n");
+    RUN(test_hit_miss_partial);
+    RUN(test_lru_eviction);
+    RUN(test_stale_put_dropped);
+    RUN(test_invalidate_range);
+    RUN(test_prefetch_fills);
+    RUN(test_prefetch_without_fill);
+    REPORT();
+}
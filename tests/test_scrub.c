@@ -0,0 +1,223 @@
+#include "test_harness.h"
+#include "scrub.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CKPT "/tmp/test_scrub.ckpt"
+#define MS   1000000ull
+
+/* Stand-in for parity_scrub_range: counts how often each position is
+ * checked and reports one bad position. */
+typedef struct {
+    uint32_t limit;
+    uint32_t bad_pos;
+    unsigned delay_us;
+    unsigned calls;
+    uint8_t  seen[2048];
+} fake_array;
+
+static int fake_range(void *arg, uint32_t pos, uint32_t count, int repair,
+                      lr_scrub_result *r)
+{
+    fake_array *fa = (fake_array *)arg;
+    if (fa->delay_us)
+        usleep(fa->delay_us);
+    fa->calls++;
+    for (uint32_t p = pos; p < pos + count; p++) {
+        fa->seen[p]++;
+        r->positions_checked++;
+        if (p == fa->bad_pos) {
+            r->parity_mismatches++;
+            if (repair)
+                r->parity_fixed++;
+        }
+    }
+    return 0;
+}
+
+static uint32_t fake_limit(void *arg)
+{
+    return ((fake_array *)arg)->limit;
+}
+
+static void fake_reset(fake_array *fa, uint32_t limit)
+{
+    memset(fa, 0, sizeof(*fa));
+    fa->limit   = limit;
+    fa->bad_pos = UINT32_MAX;
+}
+
+static void test_full_pass(void)
+{
+    fake_array fa;
+    fake_reset(&fa, 95);
+    fa.bad_pos = 50;
+    lr_scrub sc;
+    ASSERT_INT_EQ(scrub_init(&sc, 10, 0, 0, fake_range, fake_limit, &fa), 0);
+
+    uint64_t id = scrub_start(&sc, 0, 0, 0);
+    ASSERT(id > 0);
+    lr_scrub_result r;
+    ASSERT_INT_EQ(scrub_wait(&sc, id, 5000, &r), 1);
+    ASSERT_INT_EQ(r.positions_checked, 95);
+    ASSERT_INT_EQ(r.parity_mismatches, 1);
+    ASSERT_INT_EQ(r.parity_fixed,      0);
+    ASSERT_INT_EQ(fa.calls, 10);        /* nine slices of 10, one of 5 */
+    int once = 1;
+    for (uint32_t p = 0; p < 95; p++)
+        if (fa.seen[p] != 1)
+            once = 0;
+    ASSERT(once);
+
+    lr_scrub_status st;
+    scrub_get_status(&sc, &st);
+    ASSERT_INT_EQ(st.active, 0);
+    ASSERT_INT_EQ(st.passes, 1);
+    scrub_done(&sc);
+}
+
+static void test_range_and_repair(void)
+{
+    fake_array fa;
+    fake_reset(&fa, 95);
+    fa.bad_pos = 30;
+    lr_scrub sc;
+    ASSERT_INT_EQ(scrub_init(&sc, 8, 0, 0, fake_range, fake_limit, &fa), 0);
+
+    lr_scrub_result r;
+    uint64_t id = scrub_start(&sc, 20, 40, 1);
+    ASSERT_INT_EQ(scrub_wait(&sc, id, 5000, &r), 1);
+    ASSERT_INT_EQ(r.positions_checked, 20);
+    ASSERT_INT_EQ(r.parity_fixed,      1);
+    ASSERT_INT_EQ(fa.seen[19], 0);
+    ASSERT_INT_EQ(fa.seen[20], 1);
+    ASSERT_INT_EQ(fa.seen[39], 1);
+    ASSERT_INT_EQ(fa.seen[40], 0);
+
+    /* A range past the end stops at the end of the array */
+    id = scrub_start(&sc, 90, 1000, 0);
+    ASSERT_INT_EQ(scrub_wait(&sc, id, 5000, &r), 1);
+    ASSERT_INT_EQ(r.positions_checked, 5);
+    scrub_done(&sc);
+}
+
+static void test_busy_and_stop(void)
+{
+    fake_array fa;
+    fake_reset(&fa, 1000);
+    fa.delay_us = 5000;
+    lr_scrub sc;
+    ASSERT_INT_EQ(scrub_init(&sc, 1, 0, 0, fake_range, fake_limit, &fa), 0);
+
+    uint64_t id = scrub_start(&sc, 0, 0, 0);
+    ASSERT_INT_EQ(scrub_start(&sc, 0, 0, 1), 0);   /* one pass at a time */
+    usleep(20000);
+    ASSERT_INT_EQ(scrub_stop(&sc), 1);
+
+    lr_scrub_result r;
+    ASSERT_INT_EQ(scrub_wait(&sc, id, 5000, &r), -1);
+    ASSERT(r.positions_checked > 0);
+    ASSERT(r.positions_checked < 1000);
+    ASSERT_INT_EQ(scrub_stop(&sc), 0);
+    ASSERT(scrub_start(&sc, 0, 10, 0) > id);       /* free again */
+    scrub_done(&sc);
+}
+
+/* An interrupted pass resumes where it stopped, keeping its counts. */
+static void test_checkpoint_resume(void)
+{
+    unlink(CKPT);
+    fake_array fa;
+    fake_reset(&fa, 1000);
+    fa.delay_us = 2000;
+    fa.bad_pos  = 3;
+    lr_scrub sc;
+    ASSERT_INT_EQ(scrub_init(&sc, 10, 0, 0, fake_range, fake_limit, &fa), 0);
+    scrub_set_checkpoint(&sc, CKPT);
+    scrub_start(&sc, 0, 0, 1);
+    usleep(30000);
+    scrub_done(&sc);                    /* "unmount" mid-pass */
+
+    uint32_t before = 0;
+    for (uint32_t p = 0; p < 1000; p++)
+        before += fa.seen[p];
+    ASSERT(before > 0);
+    ASSERT(before < 1000);
+
+    fa.delay_us = 0;
+    ASSERT_INT_EQ(scrub_init(&sc, 10, 0, 0, fake_range, fake_limit, &fa), 0);
+    scrub_set_checkpoint(&sc, CKPT);
+    lr_scrub_status st;
+    scrub_get_status(&sc, &st);
+    ASSERT(st.id > 0);
+    ASSERT_INT_EQ(st.repair, 1);
+
+    lr_scrub_result r;
+    ASSERT_INT_EQ(scrub_wait(&sc, st.id, 5000, &r), 1);
+    ASSERT_INT_EQ(r.positions_checked, 1000);
+    ASSERT_INT_EQ(r.parity_fixed,      1);
+    int once = 1;
+    for (uint32_t p = 0; p < 1000; p++)
+        if (fa.seen[p] != 1)
+            once = 0;
+    ASSERT(once);
+    scrub_done(&sc);
+
+    /* Nothing left to resume */
+    ASSERT_INT_EQ(scrub_init(&sc, 10, 0, 0, fake_range, fake_limit, &fa), 0);
+    scrub_set_checkpoint(&sc, CKPT);
+    scrub_get_status(&sc, &st);
+    ASSERT_INT_EQ(st.active, 0);
+    scrub_done(&sc);
+    unlink(CKPT);
+}
+
+/* 10 MiB/s with 1 MiB slices: three slices take at least 200 ms. */
+static void test_rate_cap(void)
+{
+    fake_array fa;
+    fake_reset(&fa, 3);
+    lr_scrub sc;
+    ASSERT_INT_EQ(scrub_init(&sc, 1, 1 << 20, 10 << 20,
+                             fake_range, fake_limit, &fa), 0);
+    uint64_t t0 = throttle_now_ns();
+    lr_scrub_result r;
+    ASSERT_INT_EQ(scrub_wait(&sc, scrub_start(&sc, 0, 0, 0), 5000, &r), 1);
+    uint64_t elapsed = throttle_now_ns() - t0;
+    ASSERT_INT_EQ(r.positions_checked, 3);
+    ASSERT(elapsed >= 180 * MS);
+    ASSERT(elapsed < 3000 * MS);
+    scrub_done(&sc);
+}
+
+static void test_daily_schedule(void)
+{
+    ASSERT_INT_EQ((int)scrub_daily_positions(10, 1000, 86400000 * MS), 100);
+    ASSERT_INT_EQ((int)scrub_daily_positions(100, 1000, 43200000 * MS), 500);
+    ASSERT_INT_EQ((int)scrub_daily_positions(0, 1000, 86400000 * MS), 0);
+
+    fake_array fa;
+    fake_reset(&fa, 100);
+    lr_scrub sc;
+    ASSERT_INT_EQ(scrub_init(&sc, 10, 0, 0, fake_range, fake_limit, &fa), 0);
+    scrub_set_daily(&sc, 5);
+    lr_scrub_status st;
+    scrub_get_status(&sc, &st);
+    ASSERT_INT_EQ(st.daily_pct, 5);
+    ASSERT_INT_EQ(st.active,    0);
+    scrub_done(&sc);
+}
+
+int main(void)
+{
+    printf("test_scrub\n");
+    RUN(test_full_pass);
+    RUN(test_range_and_repair);
+    RUN(test_busy_and_stop);
+    RUN(test_checkpoint_resume);
+    RUN(test_rate_cap);
+    RUN(test_daily_schedule);
+    REPORT();
+}
@@ -4,7 +4,10 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/stat.h>
+#include <time.h>
 
 /* Build a minimal config for state_init.  Uses roundrobin so drive-selection
  * tests never need real directories for statvfs. */
@@ -24,12 +27,11 @@ static void make_config(lr_config *cfg, unsigned drive_count)
     snprintf(cfg->mountpoint, PATH_MAX, "/tmp/lr_test_mount");
 }
 
-static lr_file *make_file(const char *vpath, unsigned drive_idx,
-                           uint32_t pos_start, uint32_t block_count)
+static lr_file *make_file(lr_state *s, const char *vpath, unsigned drive_idx,
+                          uint32_t pos_start, uint32_t block_count)
 {
     lr_file *f = calloc(1, sizeof(lr_file));
-    snprintf(f->vpath,     sizeof(f->vpath),    "%s", vpath);
-    snprintf(f->real_path, sizeof(f->real_path), "/tmp/real%s", vpath);
+    state_set_path(s, &f->vpath, vpath);
     f->drive_idx        = drive_idx;
     f->parity_pos_start = pos_start;
     f->block_count      = block_count;
@@ -37,6 +39,23 @@ static lr_file *make_file(const char *vpath, unsigned drive_idx,
     return f;
 }
 
+static lr_symlink *make_symlink(lr_state *s, const char *vpath,
+                                const char *target)
+{
+    lr_symlink *sl = calloc(1, sizeof(lr_symlink));
+    state_set_path(s, &sl->vpath,  vpath);
+    state_set_path(s, &sl->target, target);
+    return sl;
+}
+
+static lr_dir *make_dir(lr_state *s, const char *vpath, mode_t mode)
+{
+    lr_dir *d = calloc(1, sizeof(lr_dir));
+    state_set_path(s, &d->vpath, vpath);
+    d->mode = S_IFDIR | mode;
+    return d;
+}
+
 /* ------------------------------------------------------------------ */
 
 static void test_init_done(void)
@@ -58,7 +77,7 @@ static void test_file_insert_find(void)
 {
     lr_config cfg; make_config(&cfg, 1);
     lr_state s;    state_init(&s, &cfg);
-    lr_file *f = make_file("/foo.txt", 0, 0, 2);
+    lr_file *f = make_file(&s, "/foo.txt", 0, 0, 2);
     state_insert_file(&s, f);
     ASSERT_INT_EQ(s.file_list.count, 1);
     lr_file *found = state_find_file(&s, "/foo.txt");
@@ -78,13 +97,13 @@ static void test_file_remove(void)
 {
     lr_config cfg; make_config(&cfg, 1);
     lr_state s;    state_init(&s, &cfg);
-    lr_file *f = make_file("/bar.txt", 0, 0, 1);
+    lr_file *f = make_file(&s, "/bar.txt", 0, 0, 1);
     state_insert_file(&s, f);
     lr_file *removed = state_remove_file(&s, "/bar.txt");
     ASSERT(removed == f);
     ASSERT_INT_EQ(s.file_list.count, 0);
     ASSERT(state_find_file(&s, "/bar.txt") == NULL);
-    free(removed);
+    state_free_file(&s, removed);
     state_done(&s);
 }
 
@@ -92,9 +111,9 @@ static void test_multiple_files(void)
 {
     lr_config cfg; make_config(&cfg, 1);
     lr_state s;    state_init(&s, &cfg);
-    lr_file *f1 = make_file("/a.txt", 0, 0,  1);
-    lr_file *f2 = make_file("/b.txt", 0, 1,  2);
-    lr_file *f3 = make_file("/c.txt", 0, 3,  3);
+    lr_file *f1 = make_file(&s, "/a.txt", 0, 0,  1);
+    lr_file *f2 = make_file(&s, "/b.txt", 0, 1,  2);
+    lr_file *f3 = make_file(&s, "/c.txt", 0, 3,  3);
     state_insert_file(&s, f1);
     state_insert_file(&s, f2);
     state_insert_file(&s, f3);
@@ -109,16 +128,14 @@ static void test_dir_insert_find_remove(void)
 {
     lr_config cfg; make_config(&cfg, 1);
     lr_state s;    state_init(&s, &cfg);
-    lr_dir *d = calloc(1, sizeof(lr_dir));
-    snprintf(d->vpath, sizeof(d->vpath), "/movies");
-    d->mode = S_IFDIR | 0755;
+    lr_dir *d = make_dir(&s, "/movies", 0755);
     state_insert_dir(&s, d);
     lr_dir *found = state_find_dir(&s, "/movies");
     ASSERT(found == d);
     lr_dir *removed = state_remove_dir(&s, "/movies");
     ASSERT(removed == d);
     ASSERT(state_find_dir(&s, "/movies") == NULL);
-    free(removed);
+    state_free_dir(&s, removed);
     state_done(&s);
 }
 
@@ -139,9 +156,9 @@ static void test_pos_index_rebuild_and_search(void)
     lr_state s;    state_init(&s, &cfg);
 
     /* Three files on drive 0 with disjoint, out-of-order position ranges. */
-    lr_file *f1 = make_file("/a", 0, 10, 3); /* [10,13) */
-    lr_file *f2 = make_file("/b", 0,  0, 5); /* [0,5)   */
-    lr_file *f3 = make_file("/c", 0, 20, 2); /* [20,22) */
+    lr_file *f1 = make_file(&s, "/a", 0, 10, 3); /* [10,13) */
+    lr_file *f2 = make_file(&s, "/b", 0,  0, 5); /* [0,5)   */
+    lr_file *f3 = make_file(&s, "/c", 0, 20, 2); /* [20,22) */
     state_insert_file(&s, f1);
     state_insert_file(&s, f2);
     state_insert_file(&s, f3);
@@ -163,6 +180,213 @@ static void test_pos_index_rebuild_and_search(void)
     state_done(&s);
 }
 
+/* Inserts, in-place resizes, moves and removes keep the index sorted. */
+static void test_pos_index_incremental(void)
+{
+    lr_config cfg; make_config(&cfg, 2);
+    lr_state s;    state_init(&s, &cfg);
+
+    lr_file *f1 = make_file(&s, "/a", 0, 10, 3); /* [10,13) */
+    lr_file *f2 = make_file(&s, "/b", 0,  0, 5); /* [0,5)   */
+    lr_file *f3 = make_file(&s, "/c", 0, 20, 2); /* [20,22) */
+    lr_file *f4 = make_file(&s, "/d", 0, 30, 0); /* empty   */
+    lr_file *f5 = make_file(&s, "/e", 1,  0, 4); /* other drive */
+    lr_file *fs[] = { f1, f2, f3, f4, f5 };
+    for (int i = 0; i < 5; i++) {
+        state_insert_file(&s, fs[i]);
+        state_pos_index_insert(&s, fs[i]);
+    }
+    ASSERT_INT_EQ(s.pos_index_count[0], 3);   /* empty file not indexed */
+    ASSERT_INT_EQ(s.pos_index_count[1], 1);
+    ASSERT_INT_EQ(s.pos_index[0][0].pos_start,  0);
+    ASSERT_INT_EQ(s.pos_index[0][1].pos_start, 10);
+    ASSERT_INT_EQ(s.pos_index[0][2].pos_start, 20);
+
+    /* Grow in place */
+    f3->block_count = 6;
+    state_pos_index_update(&s, f3, 20, 2);
+    ASSERT_INT_EQ(s.pos_index_count[0], 3);
+    ASSERT(state_find_file_at_pos(&s, 0, 25) == f3);
+
+    /* Move to a new range */
+    f2->parity_pos_start = 40;
+    f2->block_count      = 8;
+    state_pos_index_update(&s, f2, 0, 5);
+    ASSERT(state_find_file_at_pos(&s, 0,  0) == NULL);
+    ASSERT(state_find_file_at_pos(&s, 0, 47) == f2);
+    ASSERT_INT_EQ(s.pos_index[0][2].pos_start, 40);
+
+    /* First blocks of an empty file */
+    f4->block_count = 2;
+    state_pos_index_update(&s, f4, 30, 0);
+    ASSERT(state_find_file_at_pos(&s, 0, 31) == f4);
+
+    /* Truncate to zero drops the entry */
+    uint32_t old = f1->block_count;
+    f1->block_count = 0;
+    state_pos_index_update(&s, f1, 10, old);
+    ASSERT(state_find_file_at_pos(&s, 0, 10) == NULL);
+
+    /* Unlink */
+    ASSERT(state_remove_file(&s, "/c") == f3);
+    state_pos_index_remove(&s, f3);
+    state_free_file(&s, f3);
+    ASSERT(state_find_file_at_pos(&s, 0, 20) == NULL);
+    ASSERT_INT_EQ(s.pos_index_count[0], 2);
+    ASSERT(state_find_file_at_pos(&s, 1, 3) == f5);
+
+    /* A full rebuild agrees with the incremental result */
+    lr_pos_entry saved[2];
+    memcpy(saved, s.pos_index[0], sizeof(saved));
+    state_rebuild_pos_index(&s, 0);
+    ASSERT_INT_EQ(s.pos_index_count[0], 2);
+    ASSERT(memcmp(saved, s.pos_index[0], sizeof(saved)) == 0);
+
+    state_done(&s);
+}
+
+/* Many appends (the ingest pattern) grow the array past its first size. */
+static void test_pos_index_append_many(void)
+{
+    lr_config cfg; make_config(&cfg, 1);
+    lr_state s;    state_init(&s, &cfg);
+
+    char name[32];
+    for (uint32_t i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "/f%u", i);
+        lr_file *f = make_file(&s, name, 0, i * 2, 2);
+        state_insert_file(&s, f);
+        state_pos_index_insert(&s, f);
+    }
+    ASSERT_INT_EQ(s.pos_index_count[0], 1000);
+    for (uint32_t i = 1; i < 1000; i++)
+        ASSERT(s.pos_index[0][i - 1].pos_start < s.pos_index[0][i].pos_start);
+    ASSERT(state_find_file_at_pos(&s, 0, 1999) != NULL);
+    ASSERT(state_find_file_at_pos(&s, 0, 2000) == NULL);
+
+    state_done(&s);
+}
+
+/* Nodes appear with their first entry and disappear with their last. */
+static void test_tree_insert_remove(void)
+{
+    lr_config cfg; make_config(&cfg, 1);
+    lr_state s;    state_init(&s, &cfg);
+
+    state_insert_file(&s, make_file(&s, "/a/b/f1", 0, 0, 1));
+    state_insert_file(&s, make_file(&s, "/a/f2", 0, 1, 1));
+    state_insert_symlink(&s, make_symlink(&s, "/a/l", "f2"));
+
+    lr_dnode *a = state_find_dnode(&s, "/a");
+    ASSERT(a != NULL);
+    ASSERT(state_find_dnode(&s, "/") == s.root);
+    ASSERT(state_dnode_child(s.root, "a") == a);
+    ASSERT_INT_EQ(a->subdirs.count,  1);
+    ASSERT_INT_EQ(a->files.count,    1);
+    ASSERT_INT_EQ(a->symlinks.count, 1);
+    ASSERT(state_find_dnode(&s, "/a/b") != NULL);
+    ASSERT(state_find_dnode(&s, "/a/b/f1") == NULL); /* a file, not a dir */
+    ASSERT(state_find_dnode(&s, "/a/bb") == NULL);
+    ASSERT(state_find_dnode(&s, "/c") == NULL);
+
+    state_free_file(&s, state_remove_file(&s, "/a/b/f1"));
+    ASSERT(state_find_dnode(&s, "/a/b") == NULL);
+    ASSERT_INT_EQ(a->subdirs.count, 0);
+
+    state_free_symlink(&s, state_remove_symlink(&s, "/a/l"));
+    ASSERT(state_find_dnode(&s, "/a") != NULL);
+    state_free_file(&s, state_remove_file(&s, "/a/f2"));
+    ASSERT(state_find_dnode(&s, "/a") == NULL);
+    ASSERT_INT_EQ(s.root->subdirs.count, 0);
+
+    /* A dir record alone keeps its node (and ancestors) alive */
+    state_insert_dir(&s, make_dir(&s, "/x/y", 0700));
+    ASSERT(state_find_dnode(&s, "/x") != NULL);
+    ASSERT(state_find_dnode(&s, "/x/y")->dir == state_find_dir(&s, "/x/y"));
+    state_free_dir(&s, state_remove_dir(&s, "/x/y"));
+    ASSERT(state_find_dnode(&s, "/x") == NULL);
+
+    state_done(&s);
+}
+
+/* A directory rename moves the subtree and re-keys everything below it. */
+static void test_tree_rename_dir(void)
+{
+    lr_config cfg; make_config(&cfg, 1);
+    lr_state s;    state_init(&s, &cfg);
+
+    lr_file    *f  = make_file(&s, "/x/y/f", 0, 0, 1);
+    lr_file    *g  = make_file(&s, "/xx/g", 0, 1, 1);   /* shares a prefix */
+    lr_symlink *sl = make_symlink(&s, "/x/z/l", "../y/f");
+    lr_dir     *d  = make_dir(&s, "/x/y", 0750);
+    state_insert_file(&s, f);
+    state_insert_file(&s, g);
+    state_insert_symlink(&s, sl);
+    state_insert_dir(&s, d);
+
+    ASSERT_INT_EQ(state_rename_dir(&s, "/x", "/w/q"), 0);
+    ASSERT(state_find_file(&s, "/x/y/f") == NULL);
+    ASSERT(state_find_file(&s, "/w/q/y/f") == f);
+    char real[PATH_MAX];
+    ASSERT(strcmp(state_real_path(&s, f, real, sizeof(real)),
+                  "/tmp/lr_test_drive0/w/q/y/f") == 0);
+    ASSERT(state_find_symlink(&s, "/w/q/z/l") == sl);
+    ASSERT(state_find_dir(&s, "/w/q/y") == d);
+    ASSERT(state_find_dir(&s, "/x/y") == NULL);
+    ASSERT(state_find_dnode(&s, "/x") == NULL);
+    ASSERT(state_find_dnode(&s, "/w/q/y") != NULL);
+    ASSERT(state_find_dnode(&s, "/w/q/y") == f->parent);
+    ASSERT(strcmp(state_find_dnode(&s, "/w/q")->name, "q") == 0);
+    ASSERT(state_find_file(&s, "/xx/g") == g);    /* untouched */
+
+    /* Same last component: the node itself moves */
+    lr_dnode *y = state_find_dnode(&s, "/w/q/y");
+    ASSERT_INT_EQ(state_rename_dir(&s, "/w/q/y", "/y"), 0);
+    ASSERT(state_find_dnode(&s, "/y") == y);
+    ASSERT(state_find_file(&s, "/y/f") == f);
+    ASSERT(state_find_dnode(&s, "/w/q") != NULL); /* still holds z/l */
+
+    /* Into itself is refused */
+    ASSERT_INT_EQ(state_rename_dir(&s, "/w", "/w/q/w"), -1);
+    /* Unknown source: nothing to move */
+    ASSERT_INT_EQ(state_rename_dir(&s, "/nope", "/other"), 0);
+
+    state_done(&s);
+}
+
+/* Renaming onto an existing directory merges the two. */
+static void test_tree_rename_merge(void)
+{
+    lr_config cfg; make_config(&cfg, 1);
+    lr_state s;    state_init(&s, &cfg);
+
+    lr_file *f1 = make_file(&s, "/m/sub/f1", 0, 0, 1);
+    lr_file *f2 = make_file(&s, "/n/sub/f2", 0, 1, 1);
+    lr_file *f3 = make_file(&s, "/n/f3", 0, 2, 1);
+    state_insert_file(&s, f1);
+    state_insert_file(&s, f2);
+    state_insert_file(&s, f3);
+    state_insert_dir(&s, make_dir(&s, "/m", 0700));
+    state_insert_dir(&s, make_dir(&s, "/n", 0755));
+
+    ASSERT_INT_EQ(state_rename_dir(&s, "/n", "/m"), 0);
+    ASSERT(state_find_dnode(&s, "/n") == NULL);
+    lr_dnode *m = state_find_dnode(&s, "/m");
+    ASSERT_INT_EQ(m->subdirs.count, 1);
+    ASSERT_INT_EQ(m->files.count,   1);
+    ASSERT_INT_EQ(state_find_dnode(&s, "/m/sub")->files.count, 2);
+    ASSERT(state_find_file(&s, "/m/sub/f2") == f2);
+    ASSERT(state_find_file(&s, "/m/f3") == f3);
+    ASSERT(f3->parent == m);
+
+    /* The moved directory's record replaces the target's */
+    ASSERT_INT_EQ(s.dir_list.count, 1);
+    ASSERT_INT_EQ(state_find_dir(&s, "/m")->mode & 0777, 0755);
+    ASSERT(m->dir == state_find_dir(&s, "/m"));
+
+    state_done(&s);
+}
+
 /* Round-robin policy cycles through drives deterministically. */
 static void test_pick_drive_roundrobin(void)
 {
@@ -170,10 +394,359 @@ static void test_pick_drive_roundrobin(void)
     make_config(&cfg, 3);
     cfg.placement_policy = LR_PLACE_ROUNDROBIN;
     lr_state s; state_init(&s, &cfg);
-    ASSERT_INT_EQ(state_pick_drive(&s), 0);
-    ASSERT_INT_EQ(state_pick_drive(&s), 1);
-    ASSERT_INT_EQ(state_pick_drive(&s), 2);
-    ASSERT_INT_EQ(state_pick_drive(&s), 0);
+    ASSERT_INT_EQ(state_pick_drive(&s, NULL), 0);
+    ASSERT_INT_EQ(state_pick_drive(&s, NULL), 1);
+    ASSERT_INT_EQ(state_pick_drive(&s, NULL), 2);
+    ASSERT_INT_EQ(state_pick_drive(&s, NULL), 0);
+    state_done(&s);
+}
+
+/* state_lookup_pos reports the extent it found under the drive lock. */
+static void test_lookup_pos(void)
+{
+    lr_config cfg; make_config(&cfg, 2);
+    lr_state s;    state_init(&s, &cfg);
+
+    lr_file *f = make_file(&s, "/a", 1, 8, 4); /* [8,12) */
+    state_insert_file(&s, f);
+    state_pos_index_insert(&s, f);
+
+    uint32_t start = 0, end = 0;
+    ASSERT(state_lookup_pos(&s, 1, 10, &start, &end) == f);
+    ASSERT_INT_EQ(start, 8);
+    ASSERT_INT_EQ(end, 12);
+    ASSERT(state_lookup_pos(&s, 1, 12, &start, &end) == NULL);
+    ASSERT(state_lookup_pos(&s, 0, 10, &start, &end) == NULL);
+
+    state_done(&s);
+}
+
+/* Writers extending files under the read lock, two per drive: the drive
+ * locks keep every allocator and position index consistent. */
+#define GROW_STEPS 500
+
+typedef struct {
+    lr_state *s;
+    lr_file  *f;
+} grow_arg;
+
+static void *grow_thread(void *p)
+{
+    grow_arg *a = (grow_arg *)p;
+    lr_state *s = a->s;
+    lr_file  *f = a->f;
+    for (int i = 0; i < GROW_STEPS; i++) {
+        state_rdlock(s);
+        state_lock_drive(s, f->drive_idx);
+        lr_pos_allocator *pa = &s->drives[f->drive_idx].pos_alloc;
+        uint32_t old_start = f->parity_pos_start;
+        uint32_t old_count = f->block_count;
+        if (old_count > 0)
+            free_positions(pa, old_start, old_count);
+        f->parity_pos_start = alloc_positions(pa, old_count + 1);
+        f->block_count      = old_count + 1;
+        f->size            += 65536;
+        state_pos_index_update(s, f, old_start, old_count);
+        state_unlock_drive(s, f->drive_idx);
+        state_unlock(s);
+    }
+    return NULL;
+}
+
+static void test_concurrent_grow(void)
+{
+    lr_config cfg; make_config(&cfg, 2);
+    lr_state s;    state_init(&s, &cfg);
+
+    grow_arg  args[4];
+    pthread_t th[4];
+    for (unsigned i = 0; i < 4; i++) {
+        char name[16];
+        snprintf(name, sizeof(name), "/f%u", i);
+        args[i].s = &s;
+        args[i].f = make_file(&s, name, i % 2, 0, 0);
+        state_insert_file(&s, args[i].f);
+    }
+    for (unsigned i = 0; i < 4; i++)
+        pthread_create(&th[i], NULL, grow_thread, &args[i]);
+    for (unsigned i = 0; i < 4; i++)
+        pthread_join(th[i], NULL);
+
+    for (unsigned d = 0; d < 2; d++) {
+        ASSERT_INT_EQ(s.pos_index_count[d], 2);
+        lr_pos_entry *e = s.pos_index[d];
+        ASSERT(e[0].pos_start + e[0].block_count <= e[1].pos_start);
+    }
+    for (unsigned i = 0; i < 4; i++) {
+        lr_file *f = args[i].f;
+        ASSERT_INT_EQ(f->block_count, GROW_STEPS);
+        ASSERT(state_find_file_at_pos(&s, f->drive_idx,
+                                      f->parity_pos_start + GROW_STEPS - 1) == f);
+    }
+    state_done(&s);
+}
+
+/* open_count is updated atomically and never drops below zero. */
+static void *open_close_thread(void *p)
+{
+    lr_file *f = (lr_file *)p;
+    for (int i = 0; i < 10000; i++) {
+        state_open_inc(f);
+        state_open_dec(f);
+    }
+    state_open_inc(f);
+    return NULL;
+}
+
+static void test_open_count_atomic(void)
+{
+    lr_file f;
+    memset(&f, 0, sizeof(f));
+
+    pthread_t th[4];
+    for (unsigned i = 0; i < 4; i++)
+        pthread_create(&th[i], NULL, open_close_thread, &f);
+    for (unsigned i = 0; i < 4; i++)
+        pthread_join(th[i], NULL);
+    ASSERT_INT_EQ(state_open_count(&f), 4);
+
+    for (unsigned i = 0; i < 5; i++)
+        state_open_dec(&f);
+    ASSERT_INT_EQ(state_open_count(&f), 0);
+}
+
+/* Set drive d's cached free space and size (refreshing first so the
+ * values are not overwritten by a statvfs of the missing test dirs). */
+static void set_free(lr_state *s, unsigned d, int64_t free_b, uint64_t total)
+{
+    if (s->free_refreshed == 0)
+        state_refresh_free(s);
+    s->drives[d].free_bytes  = free_b;
+    s->drives[d].total_bytes = total;
+}
+
+/* mostfree / lfs rank the cached free space, which writes adjust. */
+static void test_pick_drive_cached_free(void)
+{
+    lr_config cfg;
+    make_config(&cfg, 3);
+    cfg.placement_policy = LR_PLACE_MOSTFREE;
+    lr_state s; state_init(&s, &cfg);
+    set_free(&s, 0, 100, 1000);
+    set_free(&s, 1, 300, 1000);
+    set_free(&s, 2, 200, 1000);
+    ASSERT_INT_EQ(state_pick_drive(&s, NULL), 1);
+
+    /* 150 bytes written to drive 1 move it below drive 2 */
+    state_account_free(&s, 1, 150);
+    ASSERT_INT_EQ(state_pick_drive(&s, NULL), 2);
+    state_account_free(&s, 1, -150);
+    ASSERT_INT_EQ(state_pick_drive(&s, NULL), 1);
+
+    /* Overdrawn estimates count as full */
+    state_account_free(&s, 0, 500);
+    s.cfg.placement_policy = LR_PLACE_LFS;
+    ASSERT_INT_EQ(state_pick_drive(&s, NULL), 2);
+    state_done(&s);
+}
+
+/* dirlocal follows the newest file in the directory or an ancestor. */
+static void test_pick_drive_dirlocal(void)
+{
+    lr_config cfg;
+    make_config(&cfg, 3);
+    cfg.placement_policy = LR_PLACE_DIRLOCAL;
+    lr_state s; state_init(&s, &cfg);
+    set_free(&s, 0, 500, 1000);
+    set_free(&s, 1, 900, 1000);
+    set_free(&s, 2, 100, 1000);
+
+    /* No siblings: mostfree */
+    ASSERT_INT_EQ(state_pick_drive(&s, "/music/a/01.flac"), 1);
+    ASSERT_INT_EQ(state_pick_drive(&s, NULL), 1);
+
+    state_insert_file(&s, make_file(&s, "/music/a/01.flac", 2, 0, 1));
+    ASSERT_INT_EQ(state_pick_drive(&s, "/music/a/02.flac"), 2);
+    /* A new subdirectory inherits from the nearest ancestor with files */
+    state_insert_dir(&s, make_dir(&s, "/music/a/cd2", 0755));
+    ASSERT_INT_EQ(state_pick_drive(&s, "/music/a/cd2/01.flac"), 2);
+    /* Another directory does not */
+    state_insert_dir(&s, make_dir(&s, "/music/b", 0755));
+    ASSERT_INT_EQ(state_pick_drive(&s, "/music/b/01.flac"), 1);
+
+    /* Files in the root do not pull everything onto their drive */
+    state_insert_file(&s, make_file(&s, "/top.txt", 0, 0, 1));
+    ASSERT_INT_EQ(state_pick_drive(&s, "/new/x"), 1);
+
+    /* The newest sibling wins */
+    state_insert_file(&s, make_file(&s, "/music/a/02.flac", 0, 1, 1));
+    ASSERT_INT_EQ(state_pick_drive(&s, "/music/a/03.flac"), 0);
+
+    /* Below the reserve the siblings' drive is passed over */
+    set_free(&s, 0, 49, 1000);
+    ASSERT_INT_EQ(state_pick_drive(&s, "/music/a/03.flac"), 1);
+    state_done(&s);
+}
+
+/* Attributes come from the records, with no backing file needed. */
+static void test_stat_from_records(void)
+{
+    lr_config cfg;
+    make_config(&cfg, 2);
+    lr_state s; state_init(&s, &cfg);
+
+    lr_file *f = make_file(&s, "/m/a.mkv", 1, 0, 3);
+    f->size       = 600000;
+    f->mode       = S_IFREG | 0640;
+    f->uid        = 1000;
+    f->gid        = 100;
+    f->mtime_sec  = 1700000000;
+    f->mtime_nsec = 42;
+    state_insert_file(&s, f);
+
+    struct stat st;
+    state_stat_file(&s, f, &st);
+    ASSERT_INT_EQ(st.st_mode, S_IFREG | 0640);
+    ASSERT_INT_EQ(st.st_nlink, 1);
+    ASSERT_INT_EQ(st.st_size, 600000);
+    ASSERT_INT_EQ(st.st_blocks, (600000 + 511) / 512);
+    ASSERT_INT_EQ(st.st_blksize, cfg.block_size);
+    ASSERT_INT_EQ(st.st_uid, 1000);
+    ASSERT_INT_EQ(st.st_gid, 100);
+    ASSERT_INT_EQ(st.st_mtim.tv_sec, 1700000000);
+    ASSERT_INT_EQ(st.st_mtim.tv_nsec, 42);
+    ASSERT_INT_EQ(st.st_ctim.tv_sec, 1700000000);
+
+    /* A record without a mode reads as a plain file */
+    f->mode = 0;
+    state_stat_file(&s, f, &st);
+    ASSERT_INT_EQ(st.st_mode, S_IFREG | 0644);
+
+    lr_dir *d = make_dir(&s, "/m", 0750);
+    d->mtime_sec = 5;
+    state_stat_dir(d, &st);
+    ASSERT_INT_EQ(st.st_mode, S_IFDIR | 0750);
+    ASSERT_INT_EQ(st.st_nlink, 2);
+    ASSERT_INT_EQ(st.st_mtim.tv_sec, 5);
+    state_free_dir(&s, d);
+
+    lr_symlink *sl = make_symlink(&s, "/m/l", "a.mkv");
+    state_stat_symlink(sl, &st);
+    ASSERT_INT_EQ(st.st_mode, S_IFLNK | 0777);
+    ASSERT_INT_EQ(st.st_size, 5);
+    state_free_symlink(&s, sl);
+
+    state_done(&s);
+}
+
+/* state_touch_file reports only a change of second. */
+static void test_touch_file(void)
+{
+    lr_file f;
+    memset(&f, 0, sizeof(f));
+    ASSERT_INT_EQ(state_touch_file(&f), 1);
+    ASSERT(f.mtime_sec >= time(NULL) - 1);
+    time_t sec = f.mtime_sec;
+    f.mtime_nsec = -1;
+    int changed = state_touch_file(&f);
+    ASSERT(f.mtime_nsec >= 0);
+    ASSERT_INT_EQ(changed, f.mtime_sec != sec);
+}
+
+/* state_rdlock/state_wrlock count acquisitions and time contended ones. */
+static void *hold_wrlock(void *p)
+{
+    lr_state *s = (lr_state *)p;
+    state_wrlock(s);
+    struct timespec ts = { 0, 20 * 1000000 };
+    nanosleep(&ts, NULL);
+    state_unlock(s);
+    return NULL;
+}
+
+static void test_lock_stats(void)
+{
+    lr_config cfg; make_config(&cfg, 1);
+    lr_state s;    state_init(&s, &cfg);
+    s.stats = malloc(sizeof(lr_stats));
+    ASSERT(s.stats != NULL);
+    stats_init(s.stats);
+
+    state_rdlock(&s);
+    state_unlock(&s);
+    state_wrlock(&s);
+    state_unlock(&s);
+
+    lr_stats_counters c;
+    stats_snapshot(s.stats, &c);
+    ASSERT_INT_EQ(c.lock_acquired, 2);
+    ASSERT_INT_EQ(c.lock_wait.count, 0);
+
+    /* A reader behind a writer waits, and says so */
+    pthread_t th;
+    pthread_create(&th, NULL, hold_wrlock, &s);
+    while (pthread_rwlock_tryrdlock(&s.state_lock) == 0) {
+        pthread_rwlock_unlock(&s.state_lock);   /* writer not in yet */
+        sched_yield();
+    }
+    state_rdlock(&s);
+    state_unlock(&s);
+    pthread_join(th, NULL);
+
+    stats_snapshot(s.stats, &c);
+    ASSERT_INT_EQ(c.lock_acquired, 4);
+    ASSERT_INT_EQ(c.lock_wait.count, 1);
+    ASSERT(c.lock_wait.sum_ns > 0);
+
+    free(s.stats);
+    state_done(&s);
+}
+
+/* The cache takes the slot after the data drives; its files own no
+ * positions and are listed in cache_files wherever they come from. */
+static void test_cache_tier(void)
+{
+    lr_config cfg;
+    make_config(&cfg, 2);
+    lr_state s; state_init(&s, &cfg);
+    ASSERT_INT_EQ(s.cache_drive, LR_NO_CACHE);
+    ASSERT_INT_EQ(state_drive_slots(&s), 2);
+    ASSERT(!state_cache_has_room(&s));
+    state_done(&s);
+
+    snprintf(cfg.cache.name, 64,       "ssd");
+    snprintf(cfg.cache.dir,  PATH_MAX, "/tmp/lr_test_cache");
+    state_init(&s, &cfg);
+    ASSERT_INT_EQ(s.cache_drive, 2);
+    ASSERT_INT_EQ(state_drive_slots(&s), 3);
+    ASSERT_STR_EQ(s.drives[2].name, "ssd");
+    ASSERT_STR_EQ(s.drives[2].dir, "/tmp/lr_test_cache/");
+    ASSERT_INT_EQ(state_find_drive(&s, "ssd"), 2);
+    ASSERT_INT_EQ(state_find_drive(&s, "d1"), 1);
+    ASSERT_INT_EQ(state_find_drive(&s, "nope"), UINT32_MAX);
+    ASSERT_INT_EQ(state_file_blocks(&s, 2, 200000), 0);
+    ASSERT_INT_EQ(state_file_blocks(&s, 0, 200000), 4);
+
+    /* Room is the reserve share of the cache's size */
+    set_free(&s, 2, 100, 1000);
+    ASSERT(state_cache_has_room(&s));
+    state_account_free(&s, 2, 1);
+    ASSERT(!state_cache_has_room(&s));
+
+    lr_file *a = make_file(&s, "/a", 2, 0, 0);
+    lr_file *b = make_file(&s, "/b", 0, 0, 1);
+    state_insert_file(&s, a);
+    state_insert_file(&s, b);
+    ASSERT_INT_EQ(s.cache_files.count, 1);
+    state_set_file_drive(&s, b, 2);
+    ASSERT_INT_EQ(s.cache_files.count, 2);
+    state_set_file_drive(&s, a, 1);
+    ASSERT_INT_EQ(a->drive_idx, 1);
+    ASSERT_INT_EQ(s.cache_files.count, 1);
+    ASSERT(lr_list_head(&s.cache_files)->data == b);
+
+    state_free_file(&s, state_remove_file(&s, "/b"));
+    ASSERT_INT_EQ(s.cache_files.count, 0);
     state_done(&s);
 }
 
@@ -188,6 +761,20 @@ int main(void)
     RUN(test_dir_insert_find_remove);
     RUN(test_blocks_for_size);
     RUN(test_pos_index_rebuild_and_search);
+    RUN(test_pos_index_incremental);
+    RUN(test_pos_index_append_many);
+    RUN(test_tree_insert_remove);
+    RUN(test_tree_rename_dir);
+    RUN(test_tree_rename_merge);
     RUN(test_pick_drive_roundrobin);
+    RUN(test_pick_drive_cached_free);
+    RUN(test_pick_drive_dirlocal);
+    RUN(test_stat_from_records);
+    RUN(test_touch_file);
+    RUN(test_lookup_pos);
+    RUN(test_concurrent_grow);
+    RUN(test_open_count_atomic);
+    RUN(test_lock_stats);
+    RUN(test_cache_tier);
     REPORT();
 }
@@ -0,0 +1,223 @@
+#include "test_harness.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+/* Large (one counter block per shard): keep it off the stack */
+static lr_stats          st;
+static lr_stats_counters snap;
+
+/* Bucket i holds durations below 2^i µs; the last one holds the rest. */
+static void test_hist_buckets(void)
+{
+    lr_hist h;
+    memset(&h, 0, sizeof(h));
+    hist_add(&h, 500);                 /* 0 µs */
+    hist_add(&h, 1000);                /* 1 µs */
+    hist_add(&h, 3999);                /* 3 µs */
+    hist_add(&h, 4000);                /* 4 µs */
+    hist_add(&h, (uint64_t)3600 * 1000000000u);   /* an hour */
+
+    ASSERT_INT_EQ(h.bucket[0], 1);
+    ASSERT_INT_EQ(h.bucket[1], 1);
+    ASSERT_INT_EQ(h.bucket[2], 1);
+    ASSERT_INT_EQ(h.bucket[3], 1);
+    ASSERT_INT_EQ(h.bucket[LR_HIST_BUCKETS - 1], 1);
+    ASSERT_INT_EQ(h.count, 5);
+    ASSERT(h.sum_ns == 500 + 1000 + 3999 + 4000 +
+                       (uint64_t)3600 * 1000000000u);
+
+    ASSERT_INT_EQ(hist_bucket_us(0), 1);
+    ASSERT_INT_EQ(hist_bucket_us(10), 1024);
+    ASSERT(hist_bucket_us(LR_HIST_BUCKETS - 1) == UINT64_MAX);
+}
+
+static void test_hist_quantile(void)
+{
+    lr_hist h;
+    memset(&h, 0, sizeof(h));
+    ASSERT_INT_EQ(hist_quantile_us(&h, 0.5), 0);
+
+    /* 90 fast calls (~10 µs) and 10 slow ones (~5 ms) */
+    for (int i = 0; i < 90; i++)
+        hist_add(&h, 10000);
+    for (int i = 0; i < 10; i++)
+        hist_add(&h, 5000000);
+    ASSERT_INT_EQ(hist_quantile_us(&h, 0.50), 16);
+    ASSERT_INT_EQ(hist_quantile_us(&h, 0.90), 16);
+    ASSERT_INT_EQ(hist_quantile_us(&h, 0.99), 8192);
+    ASSERT_INT_EQ(hist_quantile_us(&h, 0.0), 16);
+
+    /* The overflow bucket reports its lower bound */
+    hist_add(&h, (uint64_t)100 * 1000000000u);
+    ASSERT_INT_EQ(hist_quantile_us(&h, 1.0),
+                  (uint64_t)1 << (LR_HIST_BUCKETS - 2));
+}
+
+/* Every update entry point accepts NULL. */
+static void test_null_safe(void)
+{
+    stats_op(NULL, LR_OP_READ, stats_now_ns(), 0);
+    stats_dev_io(NULL, 0, 1, 4096);
+    stats_lock(NULL, 100);
+    stats_drain(NULL, 10, 1000);
+
+    /* Out-of-range ops and devices are ignored */
+    stats_init(&st);
+    stats_op(&st, LR_OP_COUNT, stats_now_ns(), 0);
+    stats_dev_io(&st, LR_STATS_DEVS, 0, 1);
+    stats_snapshot(&st, &snap);
+    for (unsigned op = 0; op < LR_OP_COUNT; op++)
+        ASSERT_INT_EQ(snap.op[op].count, 0);
+    ASSERT_INT_EQ(snap.dev[0].read_ops, 0);
+    ASSERT_STR_EQ(stats_op_name(LR_OP_WRITE_BUF), "write_buf");
+    ASSERT_STR_EQ(stats_op_name(LR_OP_COUNT), "?");
+}
+
+static void test_counters(void)
+{
+    stats_init(&st);
+    uint64_t t0 = stats_now_ns();
+    stats_op(&st, LR_OP_READ, t0, 4096);
+    stats_op(&st, LR_OP_READ, t0, -5);
+    stats_op(&st, LR_OP_FSYNC, t0, 0);
+    stats_dev_io(&st, 2, 0, 4096);
+    stats_dev_io(&st, 2, 1, 512);
+    stats_dev_io(&st, 2, 1, -1);
+    stats_dev_io(&st, LR_STATS_DEV_PARITY + 1, 1, 65536);
+    stats_lock(&st, 0);
+    stats_lock(&st, 2000000);
+    stats_drain(&st, 64, 3000000);
+
+    stats_snapshot(&st, &snap);
+    ASSERT_INT_EQ(snap.op[LR_OP_READ].count, 2);
+    ASSERT_INT_EQ(snap.op_errors[LR_OP_READ], 1);
+    ASSERT_INT_EQ(snap.op[LR_OP_FSYNC].count, 1);
+    ASSERT_INT_EQ(snap.op_errors[LR_OP_FSYNC], 0);
+    ASSERT_INT_EQ(snap.dev[2].read_ops, 1);
+    ASSERT_INT_EQ(snap.dev[2].read_bytes, 4096);
+    ASSERT_INT_EQ(snap.dev[2].write_ops, 1);
+    ASSERT_INT_EQ(snap.dev[2].write_bytes, 512);
+    ASSERT_INT_EQ(snap.dev[2].errors, 1);
+    ASSERT_INT_EQ(snap.dev[LR_STATS_DEV_PARITY + 1].write_bytes, 65536);
+    ASSERT_INT_EQ(snap.lock_acquired, 2);
+    ASSERT_INT_EQ(snap.lock_wait.count, 1);
+    ASSERT_INT_EQ(snap.drain.count, 1);
+    ASSERT_INT_EQ(snap.drain_positions, 64);
+}
+
+/* Threads land on different shards; the snapshot sums them all. */
+#define THREADS    8
+#define PER_THREAD 50000
+
+static void *io_thread(void *arg)
+{
+    unsigned dev = (unsigned)(uintptr_t)arg;
+    for (int i = 0; i < PER_THREAD; i++) {
+        stats_dev_io(&st, dev, 1, 8);
+        stats_lock(&st, 0);
+    }
+    return NULL;
+}
+
+static void test_shards_summed(void)
+{
+    stats_init(&st);
+    pthread_t th[THREADS];
+    for (uintptr_t i = 0; i < THREADS; i++)
+        pthread_create(&th[i], NULL, io_thread, (void *)(i % 2));
+    for (unsigned i = 0; i < THREADS; i++)
+        pthread_join(th[i], NULL);
+
+    stats_snapshot(&st, &snap);
+    ASSERT_INT_EQ(snap.lock_acquired, THREADS * PER_THREAD);
+    ASSERT_INT_EQ(snap.dev[0].write_ops, THREADS / 2 * PER_THREAD);
+    ASSERT_INT_EQ(snap.dev[1].write_bytes, THREADS / 2 * PER_THREAD * 8);
+
+    unsigned used = 0;
+    for (unsigned s = 0; s < LR_STATS_SHARDS; s++)
+        used += st.shard[s].c.lock_acquired != 0;
+    ASSERT(used > 1);
+}
+
+static char *print_to_string(const lr_stats_counters *c, int prom)
+{
+    const char *names[LR_STATS_DEVS];
+    memset(names, 0, sizeof(names));
+    names[0] = "d1";
+    names[2] = "d3";
+    names[LR_STATS_DEV_PARITY] = "parity1";
+
+    char  *buf = NULL;
+    size_t len = 0;
+    FILE  *out = open_memstream(&buf, &len);
+    if (!out)
+        return NULL;
+    stats_print(c, names, 4096, out, prom);
+    fclose(out);
+    return buf;
+}
+
+static void test_print_text(void)
+{
+    stats_init(&st);
+    stats_op(&st, LR_OP_GETATTR, stats_now_ns(), 0);
+    stats_dev_io(&st, 2, 0, 100);
+    stats_dev_io(&st, 3, 0, 100);          /* unnamed: skipped */
+    stats_drain(&st, 256, 1000000);
+    stats_snapshot(&st, &snap);
+
+    char *txt = print_to_string(&snap, 0);
+    ASSERT(txt != NULL);
+    ASSERT(strstr(txt, "op getattr calls=1 errors=0 ") != NULL);
+    ASSERT(strstr(txt, "op read ") == NULL);          /* idle */
+    ASSERT(strstr(txt, "dev d3 reads=1 read_bytes=100 ") != NULL);
+    ASSERT(strstr(txt, "dev d1 ") == NULL);           /* idle */
+    ASSERT(strstr(txt, "lock state acquired=0 ") != NULL);
+    ASSERT(strstr(txt, "drain cycles=1 positions=256 bytes=1048576 "
+                       "busy_ms=1 rate_mbs=1048 ") != NULL);
+    free(txt);
+}
+
+static void test_print_prom(void)
+{
+    stats_init(&st);
+    stats_op(&st, LR_OP_WRITE, stats_now_ns(), -28);
+    stats_dev_io(&st, LR_STATS_DEV_PARITY, 1, 4096);
+    stats_snapshot(&st, &snap);
+
+    char *txt = print_to_string(&snap, 1);
+    ASSERT(txt != NULL);
+    ASSERT(strstr(txt, "# TYPE liveraid_fuse_op_duration_seconds "
+                       "histogram\n") != NULL);
+    ASSERT(strstr(txt, "liveraid_fuse_op_duration_seconds_count"
+                       "{op=\"write\"} 1\n") != NULL);
+    ASSERT(strstr(txt, "liveraid_fuse_op_duration_seconds_bucket"
+                       "{op=\"write\",le=\"+Inf\"} 1\n") != NULL);
+    ASSERT(strstr(txt, "liveraid_fuse_op_errors_total{op=\"write\"} 1\n")
+           != NULL);
+    ASSERT(strstr(txt, "liveraid_device_write_bytes_total"
+                       "{device=\"parity1\"} 4096\n") != NULL);
+    ASSERT(strstr(txt, "liveraid_device_read_ops_total{device=\"d1\"} 0\n")
+           != NULL);
+    ASSERT(strstr(txt, "liveraid_state_lock_wait_seconds_count 0\n") != NULL);
+    ASSERT(strstr(txt, "liveraid_drain_bytes_total 0\n") != NULL);
+    free(txt);
+}
+
+int main(void)
+{
+    printf("test_stats\n");
+    RUN(test_hist_buckets);
+    RUN(test_hist_quantile);
+    RUN(test_null_safe);
+    RUN(test_counters);
+    RUN(test_shards_summed);
+    RUN(test_print_text);
+    RUN(test_print_prom);
+    REPORT();
+}
@@ -0,0 +1,108 @@
+#include "test_harness.h"
+#include "strpool.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static void test_dup_copies(void)
+{
+    lr_strpool p;
+    strpool_init(&p);
+    char src[32] = "/movies/a.mkv";
+    const char *s = strpool_dup(&p, src);
+    ASSERT(s != NULL);
+    ASSERT(s != src);
+    src[1] = 'X';
+    ASSERT(strcmp(s, "/movies/a.mkv") == 0);
+    ASSERT_INT_EQ(p.strings, 1);
+    ASSERT_INT_EQ(p.used, 16);     /* 14 bytes round up to one grain */
+    strpool_done(&p);
+}
+
+static void test_slot_sizes(void)
+{
+    lr_strpool p;
+    strpool_init(&p);
+    char buf[64];
+    memset(buf, 'a', sizeof(buf));
+    buf[15] = '\0';                          /* 16 bytes with NUL */
+    strpool_dup(&p, buf);
+    ASSERT_INT_EQ(p.used, 16);
+    buf[15] = 'a'; buf[16] = '\0';           /* 17 bytes */
+    strpool_dup(&p, buf);
+    ASSERT_INT_EQ(p.used, 16 + 32);
+    ASSERT(strpool_dup(&p, "") != NULL);
+    ASSERT_INT_EQ(p.used, 16 + 32 + 16);
+    strpool_done(&p);
+}
+
+/* A freed slot is reused by the next string of the same size class. */
+static void test_free_reuses_slot(void)
+{
+    lr_strpool p;
+    strpool_init(&p);
+    const char *a = strpool_dup(&p, "/one/two/three");
+    const char *b = strpool_dup(&p, "/x");
+    strpool_free(&p, a);
+    ASSERT_INT_EQ(p.strings, 1);
+    const char *c = strpool_dup(&p, "/four/five/six");  /* same class */
+    ASSERT(c == a);
+    const char *d = strpool_dup(&p, "/a-much-longer-path/than-before/x");
+    ASSERT(d != a && d != b);
+    ASSERT(strcmp(b, "/x") == 0);
+    strpool_free(&p, NULL);                  /* ignored */
+    ASSERT_INT_EQ(p.strings, 3);
+    strpool_done(&p);
+}
+
+static void test_limits(void)
+{
+    lr_strpool p;
+    strpool_init(&p);
+    static char big[LR_STRPOOL_MAX + 1];
+    memset(big, 'b', sizeof(big));
+    big[LR_STRPOOL_MAX - 1] = '\0';          /* longest accepted */
+    const char *s = strpool_dup(&p, big);
+    ASSERT(s != NULL);
+    ASSERT_INT_EQ(strlen(s), LR_STRPOOL_MAX - 1);
+    big[LR_STRPOOL_MAX - 1] = 'b';
+    big[LR_STRPOOL_MAX]     = '\0';          /* one byte too long */
+    ASSERT(strpool_dup(&p, big) == NULL);
+    strpool_free(&p, s);
+    ASSERT_INT_EQ(p.used, 0);
+    strpool_done(&p);
+}
+
+/* Enough strings to span several chunks; all stay intact. */
+static void test_many_chunks(void)
+{
+    lr_strpool p;
+    strpool_init(&p);
+    static const char *ptrs[20000];
+    char buf[64];
+    for (int i = 0; i < 20000; i++) {
+        snprintf(buf, sizeof(buf), "/dir%d/file%d.dat", i % 97, i);
+        ptrs[i] = strpool_dup(&p, buf);
+        ASSERT(ptrs[i] != NULL);
+    }
+    ASSERT(p.reserved > LR_STRPOOL_CHUNK);
+    for (int i = 0; i < 20000; i += 2)
+        strpool_free(&p, ptrs[i]);
+    for (int i = 1; i < 20000; i += 2) {
+        snprintf(buf, sizeof(buf), "/dir%d/file%d.dat", i % 97, i);
+        ASSERT(strcmp(ptrs[i], buf) == 0);
+    }
+    ASSERT_INT_EQ(p.strings, 10000);
+    strpool_done(&p);
+}
+
+int main(void)
+{
+    printf("test_strpool\n");
+    RUN(test_dup_copies);
+    RUN(test_slot_sizes);
+    RUN(test_free_reuses_slot);
+    RUN(test_limits);
+    RUN(test_many_chunks);
+    REPORT();
+}
@@ -0,0 +1,78 @@
+#include "test_harness.h"
+#include "throttle.h"
+
+#include <stdio.h>
+
+#define MS 1000000ull
+
+static void test_unlimited(void)
+{
+    lr_throttle t;
+    throttle_init(&t, 0);
+    for (int i = 0; i < 100; i++)
+        ASSERT_INT_EQ(throttle_reserve(&t, 1u << 30, 0), 0);
+    ASSERT_INT_EQ(t.waited_ns, 0);
+    throttle_done(&t);
+}
+
+/* 1 MiB/s: each 256 KiB reservation pushes the next one back 250 ms. */
+static void test_reservations_queue_up(void)
+{
+    lr_throttle t;
+    throttle_init(&t, 1 << 20);
+    uint64_t now = 1000 * MS;
+    ASSERT_INT_EQ(throttle_reserve(&t, 256 << 10, now), 0);
+    ASSERT_INT_EQ(throttle_reserve(&t, 256 << 10, now), 250 * MS);
+    ASSERT_INT_EQ(throttle_reserve(&t, 256 << 10, now), 500 * MS);
+
+    /* Half the backlog has passed */
+    ASSERT_INT_EQ(throttle_reserve(&t, 256 << 10, now + 375 * MS), 375 * MS);
+    ASSERT_INT_EQ(t.waited_ns, 1125 * MS);
+    throttle_done(&t);
+}
+
+/* Time spent idle is not saved up for a later burst. */
+static void test_idle_not_banked(void)
+{
+    lr_throttle t;
+    throttle_init(&t, 1 << 20);
+    ASSERT_INT_EQ(throttle_reserve(&t, 1 << 20, 0), 0);
+    uint64_t later = 60000 * MS;
+    ASSERT_INT_EQ(throttle_reserve(&t, 1 << 20, later), 0);
+    ASSERT_INT_EQ(throttle_reserve(&t, 1 << 20, later), 1000 * MS);
+    throttle_done(&t);
+}
+
+static void test_large_request(void)
+{
+    lr_throttle t;
+    throttle_init(&t, 100ull << 20);
+    ASSERT_INT_EQ(throttle_reserve(&t, 1ull << 40, 0), 0);
+    /* 1 TiB at 100 MiB/s is 10485.76 s */
+    ASSERT_INT_EQ(throttle_reserve(&t, 1, 0) / MS, 10485760);
+    throttle_done(&t);
+}
+
+static void test_wait_sleeps(void)
+{
+    lr_throttle t;
+    throttle_init(&t, 10 << 20);
+    uint64_t t0 = throttle_now_ns();
+    throttle_wait(&t, 1 << 20);     /* starts at once */
+    throttle_wait(&t, 1 << 20);     /* waits ~100 ms */
+    uint64_t elapsed = throttle_now_ns() - t0;
+    ASSERT(elapsed >= 90 * MS);
+    ASSERT(elapsed < 2000 * MS);
+    throttle_done(&t);
+}
+
+int main(void)
+{
+    printf("test_throttle\n");
+    RUN(test_unlimited);
+    RUN(test_reservations_queue_up);
+    RUN(test_idle_not_banked);
+    RUN(test_large_request);
+    RUN(test_wait_sleeps);
+    REPORT();
+}
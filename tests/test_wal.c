@@ -0,0 +1,264 @@
+#include "test_harness.h"
+#include "wal.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#define LOG "/tmp/lr_test_wal.log"
+
+/* Records replayed, in order */
+typedef struct {
+    lr_wal_rec rec[64];
+    unsigned   n;
+} collected;
+
+static void collect(void *arg, uint32_t start, uint32_t count)
+{
+    collected *c = (collected *)arg;
+    if (c->n < 64)
+        c->rec[c->n] = (lr_wal_rec){ start, count };
+    c->n++;
+}
+
+static uint64_t replay(collected *c)
+{
+    c->n = 0;
+    return wal_replay(LOG, collect, c);
+}
+
+static off_t file_size(void)
+{
+    struct stat st;
+    return stat(LOG, &st) == 0 ? st.st_size : -1;
+}
+
+/* Checkpoint callbacks: count the calls, fail on request */
+static int snapshots, saves, save_rc;
+
+static void snap(void *arg)
+{
+    (void)arg;
+    snapshots++;
+}
+
+static int save(void *arg)
+{
+    (void)arg;
+    saves++;
+    return save_rc;
+}
+
+/* Committed records replay in order, one batch per commit. */
+static void test_append_replay(void)
+{
+    unlink(LOG);
+    lr_wal w;
+    ASSERT_INT_EQ(wal_open(&w, LOG, 1000), 0);
+    wal_append(&w, 100, 4);
+    wal_append(&w, 7, 1);
+    ASSERT_INT_EQ(wal_commit(&w), 0);
+    wal_append(&w, 3000000000u, 2);
+    ASSERT_INT_EQ(wal_commit(&w), 0);
+    ASSERT_INT_EQ(wal_commit(&w), 0);   /* nothing buffered: no batch */
+
+    lr_wal_stats st;
+    wal_get_stats(&w, &st);
+    ASSERT_INT_EQ(st.commits, 2);
+    ASSERT_INT_EQ(st.records, 3);
+    ASSERT_INT_EQ(st.log_bytes, 2 * 12 + 3 * 8);
+    ASSERT_INT_EQ(file_size(), 2 * 12 + 3 * 8);
+    wal_close(&w, 0);
+
+    collected c;
+    ASSERT_INT_EQ(replay(&c), 3);
+    ASSERT_INT_EQ(c.rec[0].start, 100);
+    ASSERT_INT_EQ(c.rec[0].count, 4);
+    ASSERT_INT_EQ(c.rec[1].start, 7);
+    ASSERT_INT_EQ(c.rec[2].start, 3000000000u);
+    ASSERT_INT_EQ(c.rec[2].count, 2);
+    unlink(LOG);
+}
+
+/* A range that starts inside or right after the last one extends it. */
+static void test_coalesce(void)
+{
+    unlink(LOG);
+    lr_wal w;
+    ASSERT_INT_EQ(wal_open(&w, LOG, 1000), 0);
+    wal_append(&w, 10, 4);
+    wal_append(&w, 14, 2);      /* adjacent */
+    wal_append(&w, 12, 1);      /* inside */
+    wal_append(&w, 11, 9);      /* overlapping, longer */
+    wal_append(&w, 5, 1);       /* before: a new record */
+    wal_append(&w, 5, 0);       /* empty: ignored */
+    wal_close(&w, 0);           /* commits what is buffered */
+
+    collected c;
+    ASSERT_INT_EQ(replay(&c), 2);
+    ASSERT_INT_EQ(c.rec[0].start, 10);
+    ASSERT_INT_EQ(c.rec[0].count, 10);
+    ASSERT_INT_EQ(c.rec[1].start, 5);
+    ASSERT_INT_EQ(c.rec[1].count, 1);
+    unlink(LOG);
+}
+
+/* The committer writes appended records on its own, batching what
+ * arrives within one interval. */
+static void test_group_commit(void)
+{
+    unlink(LOG);
+    lr_wal w;
+    ASSERT_INT_EQ(wal_open(&w, LOG, 50), 0);
+    wal_append(&w, 1, 1);
+
+    lr_wal_stats st;
+    for (int i = 0; i < 200; i++) {
+        wal_get_stats(&w, &st);
+        if (st.commits >= 1)
+            break;
+        usleep(5000);
+    }
+    wal_get_stats(&w, &st);
+    ASSERT_INT_EQ(st.commits, 1);
+
+    /* Within the next interval: one batch for all of them */
+    for (uint32_t i = 0; i < 20; i++)
+        wal_append(&w, 100 + 2 * i, 1);
+    for (int i = 0; i < 200; i++) {
+        wal_get_stats(&w, &st);
+        if (st.records >= 21)
+            break;
+        usleep(5000);
+    }
+    wal_get_stats(&w, &st);
+    ASSERT_INT_EQ(st.records, 21);
+    ASSERT_INT_EQ(st.commits, 2);
+
+    collected c;
+    ASSERT_INT_EQ(replay(&c), 21);
+    wal_close(&w, 1);
+    ASSERT_INT_EQ(file_size(), -1);
+}
+
+/* A successful checkpoint empties the log; buffered records survive it,
+ * and a failed save keeps everything. */
+static void test_checkpoint(void)
+{
+    unlink(LOG);
+    snapshots = saves = save_rc = 0;
+    lr_wal w;
+    ASSERT_INT_EQ(wal_open(&w, LOG, 1000), 0);
+    wal_append(&w, 1, 1);
+    wal_commit(&w);
+    wal_append(&w, 50, 1);      /* still buffered */
+
+    save_rc = -1;
+    ASSERT_INT_EQ(wal_checkpoint(&w, snap, save, NULL), -1);
+    ASSERT_INT_EQ(wal_size(&w), 12 + 8);
+
+    save_rc = 0;
+    ASSERT_INT_EQ(wal_checkpoint(&w, snap, save, NULL), 0);
+    ASSERT_INT_EQ(snapshots, 2);
+    ASSERT_INT_EQ(saves, 2);
+    ASSERT_INT_EQ(wal_size(&w), 0);
+    ASSERT_INT_EQ(file_size(), 0);
+
+    lr_wal_stats st;
+    wal_get_stats(&w, &st);
+    ASSERT_INT_EQ(st.checkpoints, 1);
+
+    /* Appending after the truncate starts at offset 0 */
+    wal_commit(&w);
+    ASSERT_INT_EQ(file_size(), 12 + 8);
+    wal_close(&w, 0);
+
+    collected c;
+    ASSERT_INT_EQ(replay(&c), 1);
+    ASSERT_INT_EQ(c.rec[0].start, 50);
+    unlink(LOG);
+}
+
+/* Reopening keeps the records for replay and appends after them. */
+static void test_reopen(void)
+{
+    unlink(LOG);
+    lr_wal w;
+    ASSERT_INT_EQ(wal_open(&w, LOG, 1000), 0);
+    wal_append(&w, 8, 2);
+    wal_close(&w, 0);
+
+    ASSERT_INT_EQ(wal_open(&w, LOG, 1000), 0);
+    ASSERT_INT_EQ(wal_size(&w), 12 + 8);
+    wal_append(&w, 20, 1);
+    wal_close(&w, 0);
+
+    collected c;
+    ASSERT_INT_EQ(replay(&c), 2);
+    ASSERT_INT_EQ(c.rec[0].start, 8);
+    ASSERT_INT_EQ(c.rec[1].start, 20);
+
+    /* No log: nothing replayed */
+    unlink(LOG);
+    ASSERT_INT_EQ(replay(&c), 0);
+    ASSERT_INT_EQ(c.n, 0);
+}
+
+/* Replay stops at a torn batch or one that fails its checksum. */
+static void test_torn_and_corrupt(void)
+{
+    unlink(LOG);
+    lr_wal w;
+    ASSERT_INT_EQ(wal_open(&w, LOG, 1000), 0);
+    wal_append(&w, 1, 1);
+    wal_commit(&w);
+    wal_append(&w, 10, 1);
+    wal_append(&w, 20, 1);
+    wal_commit(&w);
+    wal_append(&w, 30, 1);
+    wal_commit(&w);
+    wal_close(&w, 0);
+
+    /* Flip a byte of the second batch's first record */
+    int fd = open(LOG, O_RDWR);
+    ASSERT(fd >= 0);
+    uint8_t b;
+    ASSERT_INT_EQ(pread(fd, &b, 1, 20 + 12), 1);
+    b ^= 0xFF;
+    ASSERT_INT_EQ(pwrite(fd, &b, 1, 20 + 12), 1);
+
+    collected c;
+    ASSERT_INT_EQ(replay(&c), 1);
+    ASSERT_INT_EQ(c.rec[0].start, 1);
+
+    /* Undo it and cut the last batch short */
+    b ^= 0xFF;
+    ASSERT_INT_EQ(pwrite(fd, &b, 1, 20 + 12), 1);
+    ASSERT_INT_EQ(ftruncate(fd, 20 + 28 + 12 + 4), 0);
+    close(fd);
+    ASSERT_INT_EQ(replay(&c), 3);
+    ASSERT_INT_EQ(c.rec[2].start, 20);
+
+    /* Zeros past the end (a lost size update) are not a batch */
+    fd = open(LOG, O_WRONLY | O_TRUNC);
+    uint8_t zero[32] = { 0 };
+    ASSERT_INT_EQ(write(fd, zero, sizeof(zero)), (long long)sizeof(zero));
+    close(fd);
+    ASSERT_INT_EQ(replay(&c), 0);
+    unlink(LOG);
+}
+
+int main(void)
+{
+    printf("test_wal\n");
+    RUN(test_append_replay);
+    RUN(test_coalesce);
+    RUN(test_group_commit);
+    RUN(test_checkpoint);
+    RUN(test_reopen);
+    RUN(test_torn_and_corrupt);
+    REPORT();
+}